@@ -101,6 +101,7 @@ LIBOBJ_NW = stdlib\snprintf.$(O) stdlib\vsnprintf.$(O) stdlib\strlcpy.$(O) \
 	asm\segalloc.$(O) \
 	asm\rdstrnum.$(O) \
 	asm\srcfile.$(O) \
+	asm\batch.$(O) \
 	macros\macros.$(O) \
 	\
 	output\outform.$(O) output\outlib.$(O) output\legacy.$(O) \
@@ -412,6 +413,10 @@ asm\assemble.$(O): asm\assemble.c asm\assemble.h asm\directiv.h \
  include\nasmlib.h include\nctype.h include\opflags.h include\perfhash.h \
  include\rbtree.h include\strlist.h include\tables.h include\warnings.h \
  x86\iflaggen.h x86\insnsi.h x86\regs.h
+asm\batch.$(O): asm\batch.c asm\batch.h config\msvc.h config\unconfig.h \
+ config\unknown.h config\watcom.h include\bytesex.h include\compiler.h \
+ include\error.h include\nasmint.h include\nasmlib.h include\nctype.h \
+ include\warnings.h
 asm\directbl.$(O): asm\directbl.c asm\directiv.h config\msvc.h \
  config\unconfig.h config\unknown.h config\watcom.h include\bytesex.h \
  include\compiler.h include\nasmint.h include\nasmlib.h include\perfhash.h
@@ -469,16 +474,16 @@ asm\listing.$(O): asm\listing.c asm\directiv.h asm\listing.h asm\pptok.h \
  include\nasmint.h include\nasmlib.h include\nctype.h include\opflags.h \
  include\perfhash.h include\strlist.h include\tables.h include\warnings.h \
  x86\insnsi.h x86\regs.h
-asm\nasm.$(O): asm\nasm.c asm\assemble.h asm\directiv.h asm\eval.h \
- asm\floats.h asm\listing.h asm\parser.h asm\pptok.h asm\preproc.h \
- asm\quote.h asm\srcfile.h asm\stdscan.h asm\tokens.h config\msvc.h \
- config\unconfig.h config\unknown.h config\watcom.h include\bytesex.h \
- include\compiler.h include\error.h include\hashtbl.h include\iflag.h \
- include\ilog2.h include\insns.h include\labels.h include\nasm.h \
- include\nasmint.h include\nasmlib.h include\nctype.h include\opflags.h \
- include\perfhash.h include\raa.h include\saa.h include\strlist.h \
- include\tables.h include\ver.h include\warnings.h output\outform.h \
- x86\iflaggen.h x86\insnsi.h x86\regs.h
+asm\nasm.$(O): asm\nasm.c asm\assemble.h asm\batch.h asm\directiv.h \
+ asm\eval.h asm\floats.h asm\listing.h asm\parser.h asm\pptok.h \
+ asm\preproc.h asm\quote.h asm\srcfile.h asm\stdscan.h asm\tokens.h \
+ config\msvc.h config\unconfig.h config\unknown.h config\watcom.h \
+ include\bytesex.h include\compiler.h include\error.h include\hashtbl.h \
+ include\iflag.h include\ilog2.h include\insns.h include\labels.h \
+ include\nasm.h include\nasmint.h include\nasmlib.h include\nctype.h \
+ include\opflags.h include\perfhash.h include\raa.h include\saa.h \
+ include\strlist.h include\tables.h include\ver.h include\warnings.h \
+ output\outform.h x86\iflaggen.h x86\insnsi.h x86\regs.h
 asm\parser.$(O): asm\parser.c asm\assemble.h asm\directiv.h asm\eval.h \
  asm\floats.h asm\parser.h asm\pptok.h asm\preproc.h asm\srcfile.h \
  asm\stdscan.h asm\tokens.h config\msvc.h config\unconfig.h config\unknown.h \
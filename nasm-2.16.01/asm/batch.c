@@ -0,0 +1,181 @@
+/* ----------------------------------------------------------------------- *
+ *
+ *   Copyright 1996-2023 The NASM Authors - All Rights Reserved
+ *   See the file AUTHORS included with the NASM distribution for
+ *   the specific copyright holders.
+ *
+ *   Redistribution and use in source and binary forms, with or without
+ *   modification, are permitted provided that the following
+ *   conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *
+ *     THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ *     CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ *     INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ *     MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ *     DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ *     CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *     SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ *     NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *     LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ *     HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *     CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ *     OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ *     EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ----------------------------------------------------------------------- */
+
+/*
+ * batch.c - assemble each line of a file as a command line of its own.
+ *
+ * "nasm --batch [-j jobs] file" splits each line of file at spaces, as
+ * in an @ response file. Every line is assembled by a copy of this
+ * process, forked once it is loaded and set up, so none of them pays for
+ * starting the assembler again; up to jobs of them run at once. NASM's
+ * state is global, so it is separate processes rather than threads that
+ * keep the lines apart.
+ *
+ * This file is apart from nasm.c because, with glibc, <sys/wait.h>
+ * declares register names that opflags.h defines as macros.
+ */
+
+#include "compiler.h"
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef HAVE_SYS_WAIT_H
+# include <sys/wait.h>
+#endif
+
+#include "nasmlib.h"
+#include "nctype.h"
+#include "error.h"
+#include "batch.h"
+
+#if defined(HAVE_FORK) && defined(HAVE_SYS_WAIT_H)
+
+#define BATCH_LINE_MAX 4096
+
+/* Run one line in the child that was forked for it */
+static int batch_job(const char *progname, char *line, int (*assemble)(int, char **))
+{
+    char **argv;
+    int argc = 1;
+    char *p;
+
+    /* At most one word in every two characters, then the name and NULL */
+    argv = nasm_malloc((strlen(line) / 2 + 3) * sizeof(char *));
+    argv[0] = (char *)progname;
+    for (p = nasm_skip_spaces(line); *p; p = nasm_skip_spaces(p)) {
+        argv[argc++] = p;
+        while (*p && !nasm_isspace(*p))
+            p++;
+        if (*p)
+            *p++ = '\0';
+    }
+    argv[argc] = NULL;
+
+    return assemble(argc, argv);
+}
+
+/* Reap one child; true if its line failed */
+static bool batch_wait(void)
+{
+    int status;
+
+    if (wait(&status) < 0)
+        return true;
+    return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+int nasm_batch(int argc, char **argv, int (*assemble)(int, char **))
+{
+    const char *progname = argv[0];
+    const char *listname = NULL;
+    char line[BATCH_LINE_MAX];
+    int jobs = 1, running = 0;
+    bool failed = false;
+    FILE *list;
+
+    /* Past the program name, to "--batch" */
+    argc--;
+    argv++;
+    while (--argc) {
+        argv++;
+        if (argv[0][0] == '-' && argv[0][1] == 'j') {
+            const char *count = argv[0] + 2;
+            if (!*count && argc > 1) {
+                count = *++argv;
+                argc--;
+            }
+            jobs = atoi(count);
+            if (jobs < 1)
+                nasm_fatalf(ERR_USAGE, "invalid number of batch jobs `%s'", count);
+        } else if (!listname) {
+            listname = argv[0];
+        } else {
+            nasm_fatalf(ERR_USAGE, "more than one batch file specified");
+        }
+    }
+    if (!listname)
+        nasm_fatalf(ERR_USAGE, "no batch file specified");
+
+    list = nasm_open_read(listname, NF_TEXT);
+    if (!list)
+        nasm_fatalf(ERR_USAGE, "unable to open batch file `%s'", listname);
+
+    /* Set up once here rather than again in every child */
+    nasm_ctype_init();
+
+    while (fgets(line, sizeof line, list)) {
+        char *end = line + strcspn(line, "\r\n");
+        pid_t pid;
+
+        if (!*end && !feof(list))
+            nasm_fatalf(ERR_USAGE, "line too long in batch file `%s'", listname);
+        *end = '\0';
+        if (!*nasm_skip_spaces(line))
+            continue;
+
+        if (running == jobs) {
+            failed |= batch_wait();
+            running--;
+        }
+
+        /* Nothing buffered may be written twice */
+        fflush(NULL);
+        pid = fork();
+        if (pid < 0)
+            nasm_fatal("unable to start a batch job: %s", strerror(errno));
+        if (pid == 0) {
+            fclose(list);
+            exit(batch_job(progname, line, assemble));
+        }
+        running++;
+    }
+    fclose(list);
+
+    while (running--)
+        failed |= batch_wait();
+
+    return failed;
+}
+
+#else
+
+int nasm_batch(int argc, char **argv, int (*assemble)(int, char **))
+{
+    (void)argc;
+    (void)argv;
+    (void)assemble;
+    nasm_fatalf(ERR_USAGE, "--batch is not supported on this platform");
+}
+
+#endif
@@ -57,6 +57,7 @@
 #include "iflag.h"
 #include "quote.h"
 #include "ver.h"
+#include "batch.h"
 
 /*
  * This is the maximum number of optimization passes to do.  If we ever
@@ -72,6 +73,7 @@ struct forwrefinfo {            /* info held on forward refs. */
 
 const char *_progname;
 
+static int assemble_main(int, char **);
 static void parse_cmdline(int, char **, int);
 static void assemble_file(const char *, struct strlist *);
 static bool skip_this_pass(errflags severity);
@@ -522,6 +524,17 @@ int main(int argc, char **argv)
     if (!_progname || !_progname[0])
         _progname = "nasm";
 
+    if (argc > 1 && !strcmp(argv[1], "--batch"))
+        return nasm_batch(argc, argv, assemble_main);
+
+    return assemble_main(argc, argv);
+}
+
+/*
+ * Assemble one file, as the command line says
+ */
+static int assemble_main(int argc, char **argv)
+{
     timestamp();
 
     set_cpu(NULL);
@@ -681,8 +694,10 @@ int main(int argc, char **argv)
                 }
 
                 /* Skip blank lines if we will need a %line anyway */
-                if (linnum == -1 && !line[0])
+                if (linnum == -1 && !line[0]) {
+                    nasm_free(line);
                     continue;
+                }
 
                 if (linnum != where.lineno) {
                     fprintf(out, "%%line %"PRId32"%+"PRId32" %s\n",
@@ -692,6 +707,7 @@ int main(int argc, char **argv)
 
                 fputs(line, out);
                 fputc('\n', out);
+                nasm_free(line);
             }
 
             nasm_free(quoted_file_name);
@@ -2219,8 +2235,9 @@ static void help(FILE *out)
 
     fprintf(out,
             "Usage: %s [-@ response_file] [options...] [--] filename\n"
-            "       %s -v (or --v)\n",
-            _progname, _progname);
+            "       %s -v (or --v)\n"
+            "       %s --batch [-j jobs] file\n",
+            _progname, _progname, _progname);
     fputs(
         "\n"
         "Options (values in brackets indicate defaults):\n"
@@ -2228,6 +2245,8 @@ static void help(FILE *out)
         "    -h            show this text and exit (also --help)\n"
         "    -v (or --v)   print the NASM version number and exit\n"
         "    -@ file       response file; one command line option per line\n"
+        "    --batch file  assemble each line of file as a command line, in\n"
+        "                  one process; -j jobs runs that many at once\n"
         "\n"
         "    -o outfile    write output to outfile\n"
         "    --keep-all    output files will not be removed even if an error happens\n"
@@ -661,6 +661,8 @@ static Token *new_Token_free(Token * next, enum token_type type,
 static Token *dup_Token(Token *next, const Token *src);
 static Token *new_White(Token *next);
 static Token *delete_Token(Token *t);
+static Line *alloc_Line(void);
+static void delete_Line(Line *l);
 static Token *steal_Token(Token *dst, Token *src);
 static const struct use_package *
 get_use_pkg(Token *t, const char *dname, const char **name);
@@ -880,7 +882,7 @@ static void free_llist(Line * list)
     Line *l, *tmp;
     list_for_each_safe(l, tmp, list) {
         free_tlist(l->first);
-        nasm_free(l);
+        delete_Line(l);
     }
 }
 
@@ -1208,7 +1210,7 @@ static char *line_from_stdmac(void)
              * features.
              */
             list_for_each(pd, predef) {
-                nasm_new(l);
+                l = alloc_Line();
                 l->next     = istk->expansion;
                 l->first    = dup_tlist(pd->first, NULL);
                 l->finishes = NULL;
@@ -1819,7 +1821,7 @@ static Token *delete_Token(Token *t)
     return next;
 }
 
-static void delete_Blocks(void)
+static void delete_Token_Blocks(void)
 {
     Token *block, *blocktmp;
 
@@ -1845,13 +1847,105 @@ static Token *delete_Token(Token *t)
     return next;
 }
 
-static inline void delete_Blocks(void)
+static inline void delete_Token_Blocks(void)
+{
+    /* Nothing to do */
+}
+
+#endif
+
+/*
+ * Lines are allocated in blocks as well: a macro expansion or %rep
+ * iteration pushes one for every line of the body, and each is freed
+ * again as soon as it has been read back.  Set the blocksize to 0 to
+ * use regular nasm_malloc().
+ *
+ * alloc_Line() returns a zero-initialized line structure.
+ */
+#define LINE_BLOCKSIZE 1024
+
+#if LINE_BLOCKSIZE
+
+static Line *freeLines  = NULL;
+static Line *lineblocks = NULL;
+
+static Line *alloc_Line(void)
+{
+    Line *l = freeLines;
+
+    if (unlikely(!l)) {
+        Line *block;
+        size_t i;
+
+        nasm_newn(block, LINE_BLOCKSIZE);
+
+        /*
+         * As for tokens, the first entry of each array links the
+         * block allocations together and is not used for data.
+         */
+        block[0].next = lineblocks;
+        lineblocks = block;
+
+        for (i = 2; i < LINE_BLOCKSIZE - 1; i++)
+            block[i].next = &block[i+1];
+
+        freeLines = &block[2];
+
+        return &block[1];
+    }
+
+    freeLines = l->next;
+    l->next = NULL;
+    return l;
+}
+
+static void delete_Line(Line *l)
+{
+    nasm_zero(*l);
+    l->next = freeLines;
+    freeLines = l;
+}
+
+static void delete_Line_Blocks(void)
+{
+    Line *block, *blocktmp;
+
+    list_for_each_safe(block, blocktmp, lineblocks)
+        nasm_free(block);
+
+    freeLines = lineblocks = NULL;
+}
+
+#else
+
+static inline Line *alloc_Line(void)
+{
+    Line *l;
+    nasm_new(l);
+    return l;
+}
+
+static void delete_Line(Line *l)
+{
+    nasm_free(l);
+}
+
+static inline void delete_Line_Blocks(void)
 {
     /* Nothing to do */
 }
 
 #endif
 
+/*
+ * Free every token and line block; nothing may still point into them.
+ */
+static void delete_Blocks(void)
+{
+    delete_Token_Blocks();
+    delete_Line_Blocks();
+}
+
 /*
  *  this function creates a new Token and passes a pointer to it
  *  back to the caller.  It sets the type, text, and next pointer elements.
@@ -4767,7 +4861,7 @@ issue_error:
          * continues) until the whole expansion is forcibly removed
          * from istk->expansion by a %exitrep.
          */
-        nasm_new(l);
+        l = alloc_Line();
         l->next = istk->expansion;
         l->finishes = defining;
         l->first = NULL;
@@ -5394,6 +5488,7 @@ static Token *expand_mmac_params(Token * tline)
         bool err_not_mac = false;
         Token *t = tline;
         const char *text = tok_text(t);
+        char *newtext = NULL;   /* text, when allocated here */
         int type = t->type;
 
         tline = tline->next;
@@ -5409,7 +5504,7 @@ static Token *expand_mmac_params(Token * tline)
             }
 
             type = TOKEN_ID;
-            text = nasm_asprintf("..@%"PRIu64".%s", mac->unique, text+2);
+            text = newtext = nasm_asprintf("..@%"PRIu64".%s", mac->unique, text+2);
             break;
         case TOKEN_MMACRO_PARAM:
         {
@@ -5437,7 +5532,7 @@ static Token *expand_mmac_params(Token * tline)
             case '0':
                 if (!text[2]) {
                     type = TOKEN_NUM;
-                    text = nasm_asprintf("%d", mac->nparam);
+                    text = newtext = nasm_asprintf("%d", mac->nparam);
                     break;
                 }
                 if (text[2] != '0' || text[3])
@@ -5493,7 +5588,7 @@ static Token *expand_mmac_params(Token * tline)
                     }
                     cc = ncc;
                 }
-                text = nasm_strdup(conditions[cc]);
+                text = newtext = nasm_strdup(conditions[cc]);
                 break;
             }
 
@@ -5508,7 +5603,7 @@ static Token *expand_mmac_params(Token * tline)
         case TOKEN_PREPROC_Q:
             if (mac) {
                 type = TOKEN_ID;
-                text = nasm_strdup(mac->iname);
+                text = newtext = nasm_strdup(mac->iname);
                 change = true;
             } else {
                 change = false;
@@ -5518,7 +5613,7 @@ static Token *expand_mmac_params(Token * tline)
         case TOKEN_PREPROC_QQ:
             if (mac) {
                 type = TOKEN_ID;
-                text = nasm_strdup(mac->name);
+                text = newtext = nasm_strdup(mac->name);
                 change = true;
             } else {
                 change = false;
@@ -5555,7 +5650,10 @@ static Token *expand_mmac_params(Token * tline)
             } else {
                 *tail = t;
                 tail = &t->next;
-		set_text(t, text, tok_strlen(text));
+                if (newtext)
+                    set_text_free(t, newtext, tok_strlen(newtext));
+                else
+                    set_text(t, text, tok_strlen(text));
                 t->type = type;
             }
             changed = true;
@@ -6881,7 +6979,7 @@ static int expand_mmacro(Token * tline)
      * macro as in progress, and set up its invocation-specific
      * variables.
      */
-    nasm_new(ll);
+    ll = alloc_Line();
     ll->next = istk->expansion;
     ll->finishes = m;
     ll->where = istk->where;
@@ -6910,7 +7008,7 @@ static int expand_mmacro(Token * tline)
     istk->mstk.mstk = istk->mstk.mmac = m;
 
     list_for_each(l, m->expansion) {
-        nasm_new(ll);
+        ll = alloc_Line();
         ll->next = istk->expansion;
         istk->expansion = ll;
         ll->first = dup_tlist(l->first, NULL);
@@ -6934,7 +7032,7 @@ static int expand_mmacro(Token * tline)
             paramlen[0] = 1;
             free_tlist(startline);
        } else {
-            nasm_new(ll);
+            ll = alloc_Line();
             ll->finishes = NULL;
             ll->next = istk->expansion;
             istk->expansion = ll;
@@ -7585,7 +7683,7 @@ static Token *pp_tokline(void)
                 list_for_each(l, fm->expansion) {
                     Line *ll;
 
-                    nasm_new(ll);
+                    ll = alloc_Line();
                     ll->next  = istk->expansion;
                     ll->first = dup_tlist(l->first, NULL);
                     ll->where = l->where;
@@ -7642,10 +7740,12 @@ static Token *pp_tokline(void)
                         nasm_free(m->params);
                         free_tlist(m->iline);
                         nasm_free(m->paramlen);
+                        nasm_free(m->iname);
                         fm->in_progress = 0;
 			m->params = NULL;
 			m->iline = NULL;
 			m->paramlen = NULL;
+			m->iname = NULL;
                     }
                 }
 
@@ -7668,18 +7768,21 @@ static Token *pp_tokline(void)
                 istk->where = l->where;
 
                 /*
-                 * FIXME It is incorrect to always free_mmacro here.
-                 * It leads to usage-after-free.
+                 * A %rep block belongs to nobody once its last
+                 * iteration is done: %exitrep only finds it through
+                 * this marker, which is going away.  Free it here,
+                 * after the last use of fm above; freeing it before
+                 * those was the use-after-free of
                  *
                  * https://bugzilla.nasm.us/show_bug.cgi?id=3392414
+                 *
+                 * Named macros stay in the macro table.
                  */
-#if 0
-                else
-                    free_mmacro(m);
-#endif
+                if (!fm->name)
+                    free_mmacro(fm);
             }
             istk->expansion = l->next;
-            nasm_free(l);
+            delete_Line(l);
 
             return &tok_pop;
         }
@@ -7693,7 +7796,7 @@ static Token *pp_tokline(void)
                 istk->expansion = l->next;
                 istk->where = l->where;
                 tline = l->first;
-                nasm_free(l);
+                delete_Line(l);
 
                 if (!istk->noline)
                     src_update(istk->where);
@@ -7768,7 +7871,7 @@ static Token *pp_tokline(void)
             MMacro *mmac = defining->dstk.mmac;
             Line *l;
 
-            nasm_new(l);
+            l = alloc_Line();
             l->next = defining->expansion;
             l->first = tline;
             l->finishes = NULL;
@@ -7905,7 +8008,7 @@ void pp_pre_include(char *fname)
     space = new_White(name);
     inc = new_Token(space, TOKEN_PREPROC_ID, "%include", 0);
 
-    l = nasm_malloc(sizeof(Line));
+    l = alloc_Line();
     l->next = predef;
     l->first = inc;
     l->finishes = NULL;
@@ -7927,7 +8030,7 @@ void pp_pre_define(char *definition)
     if (equals)
         *equals = '=';
 
-    nasm_new(l);
+    l = alloc_Line();
     l->next = predef;
     l->first = def;
     l->finishes = NULL;
@@ -7943,7 +8046,7 @@ void pp_pre_undefine(char *definition)
     def = new_Token(space, TOKEN_PREPROC_ID, "%undef", 0);
     space->next = tokenize(definition);
 
-    nasm_new(l);
+    l = alloc_Line();
     l->next = predef;
     l->first = def;
     l->finishes = NULL;
@@ -7962,7 +8065,7 @@ void pp_pre_command(const char *what, char *string)
         def = new_Token(space, TOKEN_PREPROC_ID, what, 0);
     }
 
-    nasm_new(l);
+    l = alloc_Line();
     l->next = predef;
     l->first = def;
     l->finishes = NULL;
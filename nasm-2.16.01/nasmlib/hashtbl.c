@@ -45,8 +45,6 @@
 #define HASH_MAX_LOAD   2	/* Higher = more memory-efficient, slower */
 #define HASH_INIT_SIZE  16      /* Initial size (power of 2, min 4) */
 
-#define hash_calc(key,keylen)   crc64b(CRC64_INIT, (key), (keylen))
-#define hash_calci(key,keylen)  crc64ib(CRC64_INIT, (key), (keylen))
 #define hash_max_load(size)     ((size) * (HASH_MAX_LOAD - 1) / HASH_MAX_LOAD)
 #define hash_expand(size)       ((size) << 1)
 #define hash_mask(size)         ((size) - 1)
@@ -54,6 +52,72 @@
 #define hash_inc(hash, mask)    ((((hash) >> 32) & (mask)) | 1) /* always odd */
 #define hash_pos_next(pos, inc, mask) (((pos) + (inc)) & (mask))
 
+/*
+ * Keys are hashed a 64-bit word at a time, in the style of wyhash:
+ * each word is multiplied into the state, and the splitmix64
+ * finalizer then spreads every key byte over both the low bits (the
+ * probe start) and the high bits (the probe step).  This replaced a
+ * byte-at-a-time CRC64, whose table lookups form one long dependency
+ * chain.  Byte order only changes where a key lands in the table.
+ */
+#define HASH_MUL    UINT64_C(0x9e3779b97f4a7c15)
+#define HASH_FIN1   UINT64_C(0xbf58476d1ce4e5b9)
+#define HASH_FIN2   UINT64_C(0x94d049bb133111eb)
+
+static inline uint64_t hash_word(uint64_t hash, uint64_t word)
+{
+    hash = (hash ^ word) * HASH_MUL;
+    return hash ^ (hash >> 32);
+}
+
+static inline uint64_t hash_final(uint64_t hash)
+{
+    hash = (hash ^ (hash >> 30)) * HASH_FIN1;
+    hash = (hash ^ (hash >> 27)) * HASH_FIN2;
+    return hash ^ (hash >> 31);
+}
+
+static uint64_t hash_calc(const void *key, size_t keylen)
+{
+    const uint8_t *p = key;
+    uint64_t hash = keylen;
+    uint64_t word;
+
+    for (; keylen >= 8; keylen -= 8, p += 8) {
+        memcpy(&word, p, 8);
+        hash = hash_word(hash, word);
+    }
+    if (keylen) {
+        word = 0;
+        memcpy(&word, p, keylen);
+        hash = hash_word(hash, word);
+    }
+    return hash_final(hash);
+}
+
+/*
+ * Case-insensitive: fold each byte exactly as nasm_memicmp() does, so
+ * that keys it considers equal hash the same.
+ */
+static uint64_t hash_calci(const void *key, size_t keylen)
+{
+    const uint8_t *p = key;
+    uint64_t hash = keylen;
+
+    while (keylen) {
+        size_t n = keylen < 8 ? keylen : 8;
+        uint64_t word = 0;
+        size_t i;
+
+        for (i = 0; i < n; i++)
+            word |= (uint64_t)(uint8_t)nasm_tolower(p[i]) << (i << 3);
+        hash = hash_word(hash, word);
+        p += n;
+        keylen -= n;
+    }
+    return hash_final(hash);
+}
+
 static void hash_init(struct hash_table *head)
 {
     head->size     = HASH_INIT_SIZE;
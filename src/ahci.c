@@ -0,0 +1,601 @@
+/*
+ * Tiny Operating System - AHCI SATA Driver
+ * Per-port command lists and FIS areas in coherent DMA memory, with Native
+ * Command Queuing
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SECTOR_SIZE 512
+#define PAGE_SIZE 4096
+
+/* PCI identity: mass storage, SATA, AHCI programming interface */
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_SATA 0x06
+#define AHCI_ABAR 5
+
+/* HBA registers (offsets from ABAR) */
+#define AHCI_CAP 0x00
+#define AHCI_GHC 0x04
+#define AHCI_IS 0x08
+#define AHCI_PI 0x0C
+#define AHCI_CAP_SNCQ (1u << 30)
+#define AHCI_GHC_IE (1u << 1)
+#define AHCI_GHC_AE (1u << 31)
+
+/* Port registers (offsets from the port's 128-byte window) */
+#define AHCI_PORT_BASE 0x100
+#define AHCI_PORT_SIZE 0x80
+#define AHCI_PxCLB 0x00
+#define AHCI_PxCLBU 0x04
+#define AHCI_PxFB 0x08
+#define AHCI_PxFBU 0x0C
+#define AHCI_PxIS 0x10
+#define AHCI_PxIE 0x14
+#define AHCI_PxCMD 0x18
+#define AHCI_PxTFD 0x20
+#define AHCI_PxSIG 0x24
+#define AHCI_PxSSTS 0x28
+#define AHCI_PxSERR 0x30
+#define AHCI_PxSACT 0x34
+#define AHCI_PxCI 0x38
+
+#define AHCI_PxCMD_ST (1u << 0)
+#define AHCI_PxCMD_FRE (1u << 4)
+#define AHCI_PxCMD_FR (1u << 14)
+#define AHCI_PxCMD_CR (1u << 15)
+#define AHCI_PxIS_DHRS (1u << 0)        /* D2H register FIS: a non-queued command ended */
+#define AHCI_PxIS_PSS (1u << 1)
+#define AHCI_PxIS_SDBS (1u << 3)        /* Set Device Bits FIS: queued commands ended */
+#define AHCI_PxIS_DPS (1u << 5)
+#define AHCI_PxIS_TFES (1u << 30)       /* Task file error */
+#define AHCI_SSTS_DET_PRESENT 0x3       /* Device present, PHY communication up */
+#define AHCI_SIG_ATA 0x00000101
+#define AHCI_TFD_BSY 0x80
+#define AHCI_TFD_DRQ 0x08
+
+/* ATA commands sent in H2D register FISes */
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+#define ATA_CMD_FLUSH_CACHE_EXT 0xEA
+#define ATA_CMD_IDENTIFY 0xEC
+#define FIS_TYPE_REG_H2D 0x27
+#define FIS_H2D_COMMAND 0x80            /* The FIS carries a command, not a control update */
+#define ATA_DEVICE_LBA 0x40
+
+/* Geometry */
+#define AHCI_MAX_PORTS 4                /* Disks driven; further ports are left alone */
+#define AHCI_SLOTS 32
+#define AHCI_PRDS 8                     /* Per command: 8 pages even when nothing merges */
+#define AHCI_PRD_MAX 0x400000           /* 4 MiB per region */
+#define AHCI_MAX_SECTORS (AHCI_PRDS * PAGE_SIZE / SECTOR_SIZE)
+#define AHCI_TIMEOUT_SPINS 1000000
+
+/* Deferred interrupt work (interrupt_handlers.c) */
+extern void irq_install_handler(uint32_t irq, void (*handler)(void));
+
+/* PCI configuration space (pci.c) */
+extern uint32_t pci_find_class(uint8_t class_code, uint8_t subclass);
+extern void* pci_map_bar(uint32_t device, uint32_t index);
+extern uint8_t pci_interrupt_line(uint32_t device);
+extern void pci_enable_device(uint32_t device);
+
+/* DMA memory (dma.c) */
+extern void* dma_alloc_coherent(uint32_t size, uint32_t limit, uint32_t* handle);
+
+/* Command list entry: one per slot */
+struct ahci_cmd_header {
+    uint16_t flags;                     /* FIS length in dwords, W (bit 6) for writes */
+    uint16_t prdt_length;
+    volatile uint32_t prd_byte_count;   /* Written back by the HBA */
+    uint32_t table;
+    uint32_t table_upper;
+    uint32_t reserved[4];
+} __attribute__((packed));
+
+struct ahci_prd {
+    uint32_t address;
+    uint32_t address_upper;
+    uint32_t reserved;
+    uint32_t byte_count;                /* Bytes - 1; bit 31 asks for an interrupt */
+} __attribute__((packed));
+
+/* Command table: the FIS to send and where the data goes */
+struct ahci_cmd_table {
+    uint8_t fis[64];
+    uint8_t atapi[16];
+    uint8_t reserved[48];
+    struct ahci_prd prdt[AHCI_PRDS];
+} __attribute__((packed, aligned(128)));
+
+/* Per-port DMA areas, laid out to the HBA's alignment rules */
+struct ahci_port_memory {
+    struct ahci_cmd_header list[AHCI_SLOTS] __attribute__((aligned(1024)));
+    uint8_t fis[256] __attribute__((aligned(256)));
+    struct ahci_cmd_table tables[AHCI_SLOTS];
+};
+
+struct ahci_disk {
+    uint32_t port;
+    uint32_t sectors;
+    uint8_t ncq;
+    uint8_t depth;                      /* Commands the disk takes at once */
+    uint32_t busy;                      /* Slots in flight */
+    uint32_t queued;                    /* How many of them */
+    uint32_t max_busy;                  /* Highest queue depth reached */
+    void (*done[AHCI_SLOTS])(void* context, int status);
+    void* context[AHCI_SLOTS];
+    uint32_t completed;
+    uint32_t errors;
+};
+
+/* HBA state; DMA addresses assume identity-mapped memory */
+static volatile uint8_t* ahci_mmio;
+static uint32_t ahci_slots;             /* Command slots the HBA implements */
+static struct ahci_disk ahci_disks[AHCI_MAX_PORTS];
+static uint32_t ahci_disk_count;
+static struct ahci_port_memory* ahci_memory[AHCI_MAX_PORTS];   /* Kept across ahci_init calls */
+
+/* Function prototypes */
+int ahci_init(void);
+uint32_t ahci_disks_found(void);
+uint32_t ahci_disk_sectors(uint32_t disk);
+uint32_t ahci_queue_depth(uint32_t disk);
+uint32_t ahci_max_queued(uint32_t disk);
+int ahci_submit(uint32_t disk, uint32_t lba, uint32_t count, void* buffer, int write,
+                void (*done)(void* context, int status), void* context);
+void ahci_poll(void);
+int ahci_read_sectors(uint32_t disk, uint32_t lba, uint32_t count, void* buffer);
+int ahci_write_sectors(uint32_t disk, uint32_t lba, uint32_t count, const void* buffer);
+int ahci_flush(uint32_t disk);
+
+/* MMIO register access */
+static inline uint32_t ahci_read(uint32_t reg) {
+    return *(volatile uint32_t*)(ahci_mmio + reg);
+}
+
+static inline void ahci_write(uint32_t reg, uint32_t value) {
+    *(volatile uint32_t*)(ahci_mmio + reg) = value;
+}
+
+static inline uint32_t port_read(uint32_t port, uint32_t reg) {
+    return ahci_read(AHCI_PORT_BASE + port * AHCI_PORT_SIZE + reg);
+}
+
+static inline void port_write(uint32_t port, uint32_t reg, uint32_t value) {
+    ahci_write(AHCI_PORT_BASE + port * AHCI_PORT_SIZE + reg, value);
+}
+
+/* Save EFLAGS and disable interrupts */
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+/* Restore the interrupt flag saved by irq_save */
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+}
+
+static void zero_bytes(void* dest, uint32_t size) {
+    uint8_t* d = (uint8_t*)dest;
+    for (uint32_t i = 0; i < size; i++) {
+        d[i] = 0;
+    }
+}
+
+/* Wait until none of mask is set in a port register; -1 on timeout */
+static int port_wait_clear(uint32_t port, uint32_t reg, uint32_t mask) {
+    for (uint32_t spins = 0; spins < AHCI_TIMEOUT_SPINS; spins++) {
+        if (!(port_read(port, reg) & mask)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Stop the command engine and FIS receive, as required before touching CLB/FB */
+static int port_stop(uint32_t port) {
+    port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) & ~(AHCI_PxCMD_ST | AHCI_PxCMD_FRE));
+    return port_wait_clear(port, AHCI_PxCMD, AHCI_PxCMD_CR | AHCI_PxCMD_FR);
+}
+
+static int port_start(uint32_t port) {
+    port_write(port, AHCI_PxSERR, 0xFFFFFFFF);
+    port_write(port, AHCI_PxIS, 0xFFFFFFFF);
+    port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) | AHCI_PxCMD_FRE);
+    if (port_wait_clear(port, AHCI_PxTFD, AHCI_TFD_BSY | AHCI_TFD_DRQ) != 0) {
+        return -1;
+    }
+    port_write(port, AHCI_PxCMD, port_read(port, AHCI_PxCMD) | AHCI_PxCMD_ST);
+    return 0;
+}
+
+/*
+ * Describe a buffer in a slot's PRD table, a page at a time and merging
+ * contiguous pages. Returns the entry count, or 0 if the table is too small.
+ */
+static uint32_t ahci_prd_build(struct ahci_cmd_table* table, uint8_t* buffer, uint32_t size) {
+    uint32_t entries = 0;
+    uint32_t length = 0;
+    
+    while (size) {
+        uint32_t phys = (uint32_t)(uintptr_t)buffer;
+        uint32_t chunk = PAGE_SIZE - (phys & (PAGE_SIZE - 1));
+        if (chunk > size) {
+            chunk = size;
+        }
+        
+        struct ahci_prd* prd = entries ? &table->prdt[entries - 1] : NULL;
+        if (prd && prd->address + length == phys && length + chunk <= AHCI_PRD_MAX) {
+            length += chunk;
+        } else {
+            if (entries == AHCI_PRDS) {
+                return 0;
+            }
+            prd = &table->prdt[entries++];
+            prd->address = phys;
+            prd->address_upper = 0;
+            prd->reserved = 0;
+            length = chunk;
+        }
+        prd->byte_count = length - 1;
+        buffer += chunk;
+        size -= chunk;
+    }
+    return entries;
+}
+
+/* Fill a slot's header and H2D FIS; the caller sets the slot's issue bits */
+static int ahci_prepare(struct ahci_disk* disk, uint32_t slot, uint8_t command,
+                        uint32_t lba, uint32_t count, void* buffer, int write) {
+    struct ahci_port_memory* memory = ahci_memory[disk - ahci_disks];
+    struct ahci_cmd_header* header = &memory->list[slot];
+    struct ahci_cmd_table* table = &memory->tables[slot];
+    
+    uint32_t entries = 0;
+    if (count) {
+        entries = ahci_prd_build(table, (uint8_t*)buffer, count * SECTOR_SIZE);
+        if (!entries) {
+            return -1;
+        }
+    }
+    
+    uint8_t* fis = table->fis;
+    zero_bytes(fis, 20);
+    fis[0] = FIS_TYPE_REG_H2D;
+    fis[1] = FIS_H2D_COMMAND;
+    fis[2] = command;
+    fis[4] = lba;
+    fis[5] = lba >> 8;
+    fis[6] = lba >> 16;
+    fis[7] = ATA_DEVICE_LBA;
+    fis[8] = lba >> 24;
+    if (command == ATA_CMD_READ_FPDMA_QUEUED || command == ATA_CMD_WRITE_FPDMA_QUEUED) {
+        /* Queued commands carry the count in FEATURES and the tag in COUNT */
+        fis[3] = count;
+        fis[11] = count >> 8;
+        fis[12] = slot << 3;
+    } else {
+        fis[12] = count;
+        fis[13] = count >> 8;
+    }
+    
+    header->flags = 5 | (write ? (1 << 6) : 0);
+    header->prdt_length = entries;
+    header->prd_byte_count = 0;
+    header->table = (uint32_t)(uintptr_t)table;
+    header->table_upper = 0;
+    return 0;
+}
+
+/* Finish the slots in mask, reporting status to their owners */
+static void ahci_complete(struct ahci_disk* disk, uint32_t mask, int status) {
+    disk->busy &= ~mask;
+    for (uint32_t slot = 0; mask; slot++, mask >>= 1) {
+        if (!(mask & 1)) {
+            continue;
+        }
+        disk->queued--;
+        disk->completed++;
+        if (status != 0) {
+            disk->errors++;
+        }
+        if (disk->done[slot]) {
+            disk->done[slot](disk->context[slot], status);
+        }
+    }
+}
+
+/*
+ * Reap one port. A slot has finished when the HBA clears its CI bit and,
+ * for a queued command, the disk clears its SACT bit. A task file error
+ * aborts every command in flight; the port is restarted for the next one.
+ */
+static void ahci_service(struct ahci_disk* disk) {
+    uint32_t port = disk->port;
+    uint32_t status = port_read(port, AHCI_PxIS);
+    port_write(port, AHCI_PxIS, status);
+    
+    if (status & AHCI_PxIS_TFES) {
+        uint32_t failed = disk->busy;
+        port_stop(port);
+        port_start(port);
+        ahci_complete(disk, failed, -1);
+        return;
+    }
+    
+    uint32_t active = port_read(port, AHCI_PxCI) | port_read(port, AHCI_PxSACT);
+    uint32_t finished = disk->busy & ~active;
+    if (finished) {
+        ahci_complete(disk, finished, 0);
+    }
+}
+
+void ahci_poll(void) {
+    uint32_t flags = irq_save();
+    for (uint32_t i = 0; i < ahci_disk_count; i++) {
+        if (ahci_disks[i].busy) {
+            ahci_service(&ahci_disks[i]);
+        }
+    }
+    irq_restore(flags);
+}
+
+static void ahci_interrupt_handler(void) {
+    uint32_t pending = ahci_read(AHCI_IS);
+    for (uint32_t i = 0; i < ahci_disk_count; i++) {
+        if (pending & (1u << ahci_disks[i].port)) {
+            ahci_service(&ahci_disks[i]);
+        }
+    }
+    ahci_write(AHCI_IS, pending);
+}
+
+/*
+ * Queue a transfer of count sectors at lba; done runs from the completion
+ * path with 0 or -1. Returns the slot, or -1 when the disk's queue is full
+ * or the request is malformed. Disks with NCQ take up to depth commands at
+ * once and reorder them; the rest take one.
+ */
+int ahci_submit(uint32_t index, uint32_t lba, uint32_t count, void* buffer, int write,
+                void (*done)(void* context, int status), void* context) {
+    if (index >= ahci_disk_count || !count || count > AHCI_MAX_SECTORS ||
+        ((uintptr_t)buffer & 1)) {
+        return -1;
+    }
+    struct ahci_disk* disk = &ahci_disks[index];
+    if (lba + count < lba || lba + count > disk->sectors) {
+        return -1;
+    }
+    
+    uint32_t flags = irq_save();
+    if (disk->queued >= disk->depth) {
+        irq_restore(flags);
+        return -1;
+    }
+    uint32_t slot = __builtin_ctz(~disk->busy);
+    
+    uint8_t command = disk->ncq ? (write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED) :
+                                  (write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
+    if (ahci_prepare(disk, slot, command, lba, count, buffer, write) != 0) {
+        irq_restore(flags);
+        return -1;
+    }
+    disk->done[slot] = done;
+    disk->context[slot] = context;
+    disk->busy |= 1u << slot;
+    disk->queued++;
+    if (disk->queued > disk->max_busy) {
+        disk->max_busy = disk->queued;
+    }
+    
+    /* The command table must be in memory before the HBA is told to fetch it */
+    __asm__ __volatile__("" : : : "memory");
+    if (disk->ncq) {
+        port_write(disk->port, AHCI_PxSACT, 1u << slot);
+    }
+    port_write(disk->port, AHCI_PxCI, 1u << slot);
+    
+    irq_restore(flags);
+    return slot;
+}
+
+/* Synchronous transfers: one command at a time, reaped by polling */
+static void ahci_sync_done(void* context, int status) {
+    *(volatile int*)context = status;
+}
+
+/* Reap one disk, which need not be counted yet while init identifies it */
+static void ahci_poll_disk(struct ahci_disk* disk) {
+    uint32_t flags = irq_save();
+    if (disk->busy) {
+        ahci_service(disk);
+    }
+    irq_restore(flags);
+}
+
+static int ahci_wait(struct ahci_disk* disk, volatile int* result) {
+    for (uint32_t spins = 0; *result == 1; spins++) {
+        if (spins == AHCI_TIMEOUT_SPINS) {
+            return -1;
+        }
+        ahci_poll_disk(disk);
+    }
+    return *result;
+}
+
+static int ahci_transfer(uint32_t disk, uint32_t lba, uint32_t count, void* buffer, int write) {
+    uint8_t* bytes = (uint8_t*)buffer;
+    while (count) {
+        uint32_t chunk = count < AHCI_MAX_SECTORS ? count : AHCI_MAX_SECTORS;
+        volatile int result = 1;
+        int slot;
+        while ((slot = ahci_submit(disk, lba, chunk, bytes, write, ahci_sync_done, (void*)&result)) < 0) {
+            if (disk >= ahci_disk_count || !ahci_disks[disk].busy) {
+                return -1; /* Refused for a reason waiting will not fix */
+            }
+            ahci_poll_disk(&ahci_disks[disk]);
+        }
+        if (ahci_wait(&ahci_disks[disk], &result) != 0) {
+            return -1;
+        }
+        bytes += chunk * SECTOR_SIZE;
+        lba += chunk;
+        count -= chunk;
+    }
+    return 0;
+}
+
+int ahci_read_sectors(uint32_t disk, uint32_t lba, uint32_t count, void* buffer) {
+    return ahci_transfer(disk, lba, count, buffer, 0);
+}
+
+int ahci_write_sectors(uint32_t disk, uint32_t lba, uint32_t count, const void* buffer) {
+    return ahci_transfer(disk, lba, count, (void*)buffer, 1);
+}
+
+/* Non-queued commands may only run on an idle port: drain it first */
+static int ahci_command(struct ahci_disk* disk, uint8_t command, void* buffer, uint32_t count) {
+    for (uint32_t spins = 0; disk->busy; spins++) {
+        if (spins == AHCI_TIMEOUT_SPINS) {
+            return -1;
+        }
+        ahci_poll_disk(disk);
+    }
+    
+    volatile int result = 1;
+    uint32_t flags = irq_save();
+    if (ahci_prepare(disk, 0, command, 0, count, buffer, 0) != 0) {
+        irq_restore(flags);
+        return -1;
+    }
+    disk->done[0] = ahci_sync_done;
+    disk->context[0] = (void*)&result;
+    disk->busy |= 1;
+    disk->queued++;
+    __asm__ __volatile__("" : : : "memory");
+    port_write(disk->port, AHCI_PxCI, 1);
+    irq_restore(flags);
+    
+    return ahci_wait(disk, &result);
+}
+
+int ahci_flush(uint32_t disk) {
+    if (disk >= ahci_disk_count) {
+        return -1;
+    }
+    return ahci_command(&ahci_disks[disk], ATA_CMD_FLUSH_CACHE_EXT, NULL, 0);
+}
+
+/* Point the port at its DMA areas, start it and ask the disk what it is */
+static int ahci_port_init(uint32_t port, struct ahci_disk* disk, struct ahci_port_memory* memory) {
+    if ((port_read(port, AHCI_PxSSTS) & 0xF) != AHCI_SSTS_DET_PRESENT ||
+        port_read(port, AHCI_PxSIG) != AHCI_SIG_ATA || port_stop(port) != 0) {
+        return -1;
+    }
+    
+    zero_bytes(memory, sizeof(*memory));
+    port_write(port, AHCI_PxCLB, (uint32_t)(uintptr_t)memory->list);
+    port_write(port, AHCI_PxCLBU, 0);
+    port_write(port, AHCI_PxFB, (uint32_t)(uintptr_t)memory->fis);
+    port_write(port, AHCI_PxFBU, 0);
+    if (port_start(port) != 0) {
+        return -1;
+    }
+    
+    disk->port = port;
+    disk->ncq = 0;
+    disk->depth = 1;
+    disk->busy = 0;
+    disk->queued = 0;
+    disk->max_busy = 0;
+    disk->completed = 0;
+    disk->errors = 0;
+    disk->sectors = 0;
+    
+    static uint16_t identify[256];
+    if (ahci_command(disk, ATA_CMD_IDENTIFY, identify, 1) != 0) {
+        return -1;
+    }
+    
+    /* Words 100-103: LBA48 capacity, of which a 32-bit LBA reaches 2 TiB */
+    disk->sectors = (identify[103] || identify[102]) ? 0xFFFFFFFF :
+                    identify[100] | ((uint32_t)identify[101] << 16);
+    if (!disk->sectors) {
+        disk->sectors = identify[60] | ((uint32_t)identify[61] << 16);
+    }
+    
+    /* Word 76 bit 8: NCQ; word 75: queue depth - 1 */
+    if ((ahci_read(AHCI_CAP) & AHCI_CAP_SNCQ) && (identify[76] & (1 << 8))) {
+        uint32_t depth = (identify[75] & 0x1F) + 1;
+        disk->ncq = 1;
+        disk->depth = depth < ahci_slots ? depth : ahci_slots;
+    }
+    
+    port_write(port, AHCI_PxIE, AHCI_PxIS_DHRS | AHCI_PxIS_PSS | AHCI_PxIS_SDBS |
+               AHCI_PxIS_DPS | AHCI_PxIS_TFES);
+    return 0;
+}
+
+/* Find the HBA, switch it to AHCI mode and bring up every attached disk */
+int ahci_init(void) {
+    ahci_disk_count = 0;
+    
+    uint32_t pci = pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_SATA);
+    if (!pci) {
+        return -1;
+    }
+    pci_enable_device(pci);
+    ahci_mmio = (volatile uint8_t*)pci_map_bar(pci, AHCI_ABAR);
+    if (!ahci_mmio) {
+        return -1;
+    }
+    
+    ahci_write(AHCI_GHC, ahci_read(AHCI_GHC) | AHCI_GHC_AE);
+    ahci_slots = ((ahci_read(AHCI_CAP) >> 8) & 0x1F) + 1;
+    
+    uint32_t implemented = ahci_read(AHCI_PI);
+    for (uint32_t port = 0; port < 32 && ahci_disk_count < AHCI_MAX_PORTS; port++) {
+        if (!(implemented & (1u << port))) {
+            continue;
+        }
+        /* Aligned to its power-of-two size, which covers the list's 1KB and the tables' 128 bytes */
+        struct ahci_port_memory** memory = &ahci_memory[ahci_disk_count];
+        if (!*memory) {
+            *memory = (struct ahci_port_memory*)dma_alloc_coherent(sizeof(**memory), 0xFFFFFFFF, NULL);
+        }
+        if (*memory && ahci_port_init(port, &ahci_disks[ahci_disk_count], *memory) == 0) {
+            ahci_disk_count++;
+        }
+    }
+    
+    ahci_write(AHCI_IS, 0xFFFFFFFF);
+    uint8_t irq = pci_interrupt_line(pci);
+    if (irq < 16) {
+        irq_install_handler(irq, ahci_interrupt_handler);
+        ahci_write(AHCI_GHC, ahci_read(AHCI_GHC) | AHCI_GHC_IE);
+    }
+    return ahci_disk_count ? 0 : -1;
+}
+
+uint32_t ahci_disks_found(void) {
+    return ahci_disk_count;
+}
+
+uint32_t ahci_disk_sectors(uint32_t disk) {
+    return disk < ahci_disk_count ? ahci_disks[disk].sectors : 0;
+}
+
+uint32_t ahci_queue_depth(uint32_t disk) {
+    return disk < ahci_disk_count ? ahci_disks[disk].depth : 0;
+}
+
+/* Deepest the queue has been since init */
+uint32_t ahci_max_queued(uint32_t disk) {
+    return disk < ahci_disk_count ? ahci_disks[disk].max_busy : 0;
+}
@@ -0,0 +1,340 @@
+/*
+ * Tiny Operating System - Allocator Benchmark
+ * Replays a fixed pseudo-random trace of allocations and frees against an
+ * allocator: short-lived scratch buffers freed in LIFO order, messages a
+ * producer allocates and a consumer frees oldest first, objects replaced
+ * at random, and a few that live for the whole run. Every call is timed
+ * with the TSC; the allocator reports its footprint and free space, so
+ * the log shows throughput, worst-case latency, peak footprint against
+ * peak live bytes, and external fragmentation at the end of the trace.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Trace shape */
+#define ALLOC_BENCH_STEPS 8192
+#define ALLOC_BENCH_SEED 0x2545F491
+#define ALLOC_SCRATCH_DEPTH 8           /* Short-lived: freed last-in first-out */
+#define ALLOC_QUEUE_SIZE 64             /* Producer/consumer: freed first-in first-out */
+#define ALLOC_SLOTS 256                 /* Replaced at random */
+#define ALLOC_LONG_LIVED 32             /* Kept until the end of the trace */
+#define ALLOC_LINE 120
+
+/* Size distributions (must match the users' copies) */
+#define ALLOC_PROFILE_MIXED 0           /* 16 bytes to 16KB, mostly small */
+#define ALLOC_PROFILE_SMALL 1           /* 16 to 256 bytes */
+
+/* CPUID feature bits */
+#define CPUID_FEAT_EDX_TSC (1u << 4)
+#define CPUID_FEAT_EDX_SSE2 (1u << 26)  /* LFENCE */
+
+/* Levels, as in syslog (must match printk.c) */
+#define PRINTK_WARNING 4
+#define PRINTK_INFO 6
+
+/* An allocator under test (must match the users' copies) */
+struct alloc_ops {
+    const char* name;
+    void* (*alloc)(uint32_t size);
+    void (*free)(void* ptr, uint32_t size);
+    uint32_t (*footprint)(void);                /* Backing bytes taken so far; cheap, called per step */
+    uint32_t (*free_space)(uint32_t* largest);  /* Free bytes inside the footprint and the largest block */
+};
+
+/* What one replay measured (must match the users' copies) */
+struct alloc_bench_result {
+    uint32_t ops;                       /* Allocations and frees timed */
+    uint32_t failures;                  /* Allocations that returned NULL */
+    uint32_t mean_cycles;
+    uint32_t worst_cycles;
+    uint32_t ops_per_sec;               /* 0 without a TSC rate */
+    uint32_t peak_live;                 /* Most bytes requested and not yet freed at once */
+    uint32_t peak_footprint;
+    uint32_t fragmentation;             /* Percent of free space outside the largest free block */
+};
+
+struct alloc_entry {
+    void* ptr;
+    uint32_t size;
+};
+
+/* The replay's live objects */
+static struct alloc_entry alloc_scratch[ALLOC_SCRATCH_DEPTH];
+static uint32_t alloc_scratch_depth;
+static struct alloc_entry alloc_queue[ALLOC_QUEUE_SIZE];
+static uint32_t alloc_queue_head;
+static uint32_t alloc_queue_count;
+static struct alloc_entry alloc_slots[ALLOC_SLOTS];
+static struct alloc_entry alloc_long_lived[ALLOC_LONG_LIVED];
+
+/* The run in progress */
+static const struct alloc_ops* alloc_ops;
+static struct alloc_bench_result* alloc_result;
+static uint64_t alloc_total_cycles;
+static uint32_t alloc_live;
+static uint32_t alloc_seed;
+static uint32_t alloc_overhead;
+static int alloc_has_lfence;
+static int alloc_header_logged;
+
+/* Function prototypes */
+int alloc_bench_run(const struct alloc_ops* ops, uint32_t profile, uint32_t tsc_khz,
+                    struct alloc_bench_result* result);
+
+/* Kernel log ring (printk.c) */
+extern int printk(uint32_t level, const char* text);
+
+/* Kernel runtime library (klib.c) */
+extern char* klib_puts(char* out, const char* text, uint32_t width);
+extern char* klib_putu(char* out, uint32_t value, uint32_t width);
+
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    __asm__ __volatile__("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+/* The TSC, fenced so the timed call neither starts early nor finishes late */
+static inline uint64_t alloc_clock(void) {
+    uint32_t low, high;
+    if (alloc_has_lfence) {
+        __asm__ __volatile__("lfence; rdtsc; lfence" : "=a"(low), "=d"(high) : : "memory");
+    } else {
+        __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high) : : "memory");
+    }
+    return ((uint64_t)high << 32) | low;
+}
+
+/* 64-by-32 division with divl; the quotient must fit 32 bits. There is no libgcc */
+static inline uint32_t div_u64_u32(uint64_t dividend, uint32_t divisor) {
+    uint32_t quotient, rem;
+    __asm__("divl %4" : "=a"(quotient), "=d"(rem) : "a"((uint32_t)dividend), "d"((uint32_t)(dividend >> 32)), "rm"(divisor));
+    return quotient;
+}
+
+/* xorshift32: the same trace for every allocator */
+static uint32_t alloc_random(void) {
+    alloc_seed ^= alloc_seed << 13;
+    alloc_seed ^= alloc_seed >> 17;
+    alloc_seed ^= alloc_seed << 5;
+    return alloc_seed;
+}
+
+/* A request size drawn from profile */
+static uint32_t alloc_size(uint32_t profile) {
+    static const uint32_t small[] = { 16, 24, 32, 32, 48, 64, 64, 96, 128, 192, 256 };
+    uint32_t r = alloc_random();
+    if (profile == ALLOC_PROFILE_SMALL) {
+        return small[r % (sizeof(small) / sizeof(small[0]))];
+    }
+
+    uint32_t bucket = (r >> 8) % 100;
+    if (bucket < 55) {
+        return small[r % 9];                    /* Up to 128 bytes */
+    } else if (bucket < 85) {
+        return 128 + (r >> 16) % 896;
+    } else if (bucket < 97) {
+        return 1024 + (r >> 16) % 3072;
+    }
+    return 4096 + (r >> 16) % 12288;
+}
+
+/* Account one timed call */
+static void alloc_account(uint64_t start) {
+    uint64_t cycles = alloc_clock() - start;
+    uint32_t elapsed = cycles > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)cycles;
+    elapsed = elapsed > alloc_overhead ? elapsed - alloc_overhead : 0;
+    alloc_total_cycles += elapsed;
+    if (elapsed > alloc_result->worst_cycles) {
+        alloc_result->worst_cycles = elapsed;
+    }
+    alloc_result->ops++;
+}
+
+/* Allocate into entry; a failure leaves it empty */
+static void alloc_take(struct alloc_entry* entry, uint32_t size) {
+    uint64_t start = alloc_clock();
+    void* ptr = alloc_ops->alloc(size);
+    alloc_account(start);
+
+    entry->ptr = ptr;
+    entry->size = ptr ? size : 0;
+    if (!ptr) {
+        alloc_result->failures++;
+        return;
+    }
+
+    /* Touch the first and last bytes, as a user would */
+    ((volatile uint8_t*)ptr)[0] = 1;
+    ((volatile uint8_t*)ptr)[size - 1] = 1;
+    alloc_live += size;
+    if (alloc_live > alloc_result->peak_live) {
+        alloc_result->peak_live = alloc_live;
+    }
+}
+
+static void alloc_release(struct alloc_entry* entry, int timed) {
+    if (!entry->ptr) {
+        return;
+    }
+    uint64_t start = alloc_clock();
+    alloc_ops->free(entry->ptr, entry->size);
+    if (timed) {
+        alloc_account(start);
+    }
+    alloc_live -= entry->size;
+    entry->ptr = NULL;
+    entry->size = 0;
+}
+
+/* One step of the trace */
+static void alloc_step(uint32_t profile) {
+    uint32_t kind = alloc_random() % 100;
+
+    if (kind < 40) {
+        /* Scratch buffers: pushed and popped like stack frames */
+        if (alloc_scratch_depth == ALLOC_SCRATCH_DEPTH || (alloc_scratch_depth && (alloc_random() & 1))) {
+            alloc_release(&alloc_scratch[--alloc_scratch_depth], 1);
+        } else {
+            alloc_take(&alloc_scratch[alloc_scratch_depth++], alloc_size(profile));
+        }
+    } else if (kind < 70) {
+        /* Messages: the consumer frees in bursts, oldest first, what the producer allocated */
+        if (alloc_queue_count == ALLOC_QUEUE_SIZE || (alloc_queue_count && alloc_random() % 3 == 0)) {
+            uint32_t burst = 1 + alloc_random() % 4;
+            while (burst-- && alloc_queue_count) {
+                alloc_release(&alloc_queue[alloc_queue_head], 1);
+                alloc_queue_head = (alloc_queue_head + 1) % ALLOC_QUEUE_SIZE;
+                alloc_queue_count--;
+            }
+        } else {
+            uint32_t tail = (alloc_queue_head + alloc_queue_count++) % ALLOC_QUEUE_SIZE;
+            alloc_take(&alloc_queue[tail], alloc_size(profile));
+        }
+    } else if (kind < 97) {
+        /* Objects replaced at random */
+        struct alloc_entry* slot = &alloc_slots[alloc_random() % ALLOC_SLOTS];
+        if (slot->ptr) {
+            alloc_release(slot, 1);
+        } else {
+            alloc_take(slot, alloc_size(profile));
+        }
+    } else {
+        /* Long-lived: allocated once, freed after the trace */
+        struct alloc_entry* entry = &alloc_long_lived[alloc_random() % ALLOC_LONG_LIVED];
+        if (!entry->ptr) {
+            alloc_take(entry, alloc_size(profile));
+        }
+    }
+
+    uint32_t footprint = alloc_ops->footprint();
+    if (footprint > alloc_result->peak_footprint) {
+        alloc_result->peak_footprint = footprint;
+    }
+}
+
+static void alloc_log(const char* name, uint32_t profile, const struct alloc_bench_result* result) {
+    char line[ALLOC_LINE];
+    if (!alloc_header_logged) {
+        alloc_header_logged = 1;
+        printk(PRINTK_INFO, "Allocators (ops/s, mean and worst cycles, peak live and footprint KB, fragmentation):\n");
+    }
+    char* out = klib_puts(line, "  ", 2);
+    out = klib_puts(out, name, 12);
+    out = klib_puts(out, profile == ALLOC_PROFILE_SMALL ? " small" : " mixed", 6);
+    out = klib_putu(out, result->ops_per_sec, 11);
+    out = klib_putu(out, result->mean_cycles, 7);
+    out = klib_putu(out, result->worst_cycles, 8);
+    out = klib_putu(out, result->peak_live >> 10, 7);
+    out = klib_putu(out, result->peak_footprint >> 10, 7);
+    out = klib_putu(out, result->fragmentation, 5);
+    out = klib_puts(out, "%", 1);
+    if (result->failures) {
+        out = klib_puts(out, " failed ", 0);
+        out = klib_putu(out, result->failures, 0);
+    }
+    *out++ = '\n';
+    *out = '\0';
+    printk(result->failures ? PRINTK_WARNING : PRINTK_INFO, line);
+}
+
+/*
+ * Replay the trace for profile against ops and log one line: ops/s, mean
+ * and worst cycles per call, peak live and footprint KB, fragmentation.
+ * Everything is freed again before returning. Returns 0, or -1 on a CPU
+ * without a TSC.
+ */
+int alloc_bench_run(const struct alloc_ops* ops, uint32_t profile, uint32_t tsc_khz,
+                    struct alloc_bench_result* result) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax < 1) {
+        return -1;
+    }
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & CPUID_FEAT_EDX_TSC)) {
+        return -1;
+    }
+    alloc_has_lfence = (edx & CPUID_FEAT_EDX_SSE2) != 0;
+
+    /* The cost of timing nothing comes off every call */
+    alloc_overhead = 0xFFFFFFFF;
+    for (uint32_t i = 0; i < 32; i++) {
+        uint64_t start = alloc_clock();
+        uint32_t cycles = (uint32_t)(alloc_clock() - start);
+        if (cycles < alloc_overhead) {
+            alloc_overhead = cycles;
+        }
+    }
+
+    struct alloc_bench_result zero = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    *result = zero;
+    alloc_ops = ops;
+    alloc_result = result;
+    alloc_total_cycles = 0;
+    alloc_live = 0;
+    alloc_seed = ALLOC_BENCH_SEED;
+    alloc_scratch_depth = 0;
+    alloc_queue_head = 0;
+    alloc_queue_count = 0;
+    for (uint32_t i = 0; i < ALLOC_SLOTS; i++) {
+        alloc_slots[i].ptr = NULL;
+    }
+    for (uint32_t i = 0; i < ALLOC_LONG_LIVED; i++) {
+        alloc_long_lived[i].ptr = NULL;
+    }
+
+    for (uint32_t step = 0; step < ALLOC_BENCH_STEPS; step++) {
+        alloc_step(profile);
+    }
+
+    /* Fragmentation with the trace's live set still in place */
+    uint32_t largest = 0;
+    uint32_t free_bytes = ops->free_space(&largest);
+    result->fragmentation = free_bytes ? 100 - div_u64_u32((uint64_t)largest * 100, free_bytes) : 0;
+
+    if (result->ops) {
+        result->mean_cycles = div_u64_u32(alloc_total_cycles, result->ops);
+    }
+    if (tsc_khz && result->mean_cycles >= 4) {        /* Keeps the quotient in 32 bits */
+        result->ops_per_sec = div_u64_u32((uint64_t)tsc_khz * 1000, result->mean_cycles);
+    }
+
+    /* Free the rest untimed */
+    while (alloc_scratch_depth) {
+        alloc_release(&alloc_scratch[--alloc_scratch_depth], 0);
+    }
+    while (alloc_queue_count) {
+        alloc_release(&alloc_queue[alloc_queue_head], 0);
+        alloc_queue_head = (alloc_queue_head + 1) % ALLOC_QUEUE_SIZE;
+        alloc_queue_count--;
+    }
+    for (uint32_t i = 0; i < ALLOC_SLOTS; i++) {
+        alloc_release(&alloc_slots[i], 0);
+    }
+    for (uint32_t i = 0; i < ALLOC_LONG_LIVED; i++) {
+        alloc_release(&alloc_long_lived[i], 0);
+    }
+
+    alloc_log(ops->name, profile, result);
+    return 0;
+}
@@ -0,0 +1,272 @@
+/*
+ * Tiny Operating System - Allocation Tracking
+ * Sampled leak detection for the kernel allocators: one allocation in N
+ * is recorded with its caller and TSC in a table keyed by pointer, and
+ * dropped again when freed. What stays is a picture of everything still
+ * outstanding, scaled by N, grouped by the code that allocated it.
+ */
+
+#include <stdint.h>
+
+#define ALLOC_TRACK_SLOTS 1024          /* Power of two */
+#define ALLOC_TRACK_SHIFT 22            /* 32 - log2(ALLOC_TRACK_SLOTS) */
+#define ALLOC_TRACK_CALLERS 64          /* Distinct callers a report can group */
+#define ALLOC_TRACK_TOP 8
+#define ALLOC_TRACK_LINE 96
+
+#define PRINTK_INFO 6                   /* Must match printk.c */
+
+/*
+ * Off, malloc pays a call and one compare, and free the same while the
+ * table is empty. On, the sampled allocations pay a hash insert and every
+ * free a probe. Records use linear probing with backward-shift deletion,
+ * so the table never fills with tombstones however long it runs.
+ * Interrupts are off around every change, as in kernel_heap.c.
+ */
+struct alloc_record {
+    void* ptr;                          /* NULL: an empty slot */
+    void* caller;
+    uint32_t size;
+    uint64_t tsc;
+};
+
+/* Outstanding allocations of one caller, estimated from the samples (must match the users' copies) */
+struct alloc_caller {
+    void* caller;
+    uint32_t count;
+    uint32_t bytes;
+    uint64_t oldest_tsc;                /* When its longest-lived sampled allocation was made */
+};
+
+static struct alloc_record alloc_records[ALLOC_TRACK_SLOTS];
+static uint32_t alloc_track_rate;       /* Record one allocation in this many; 0 is off */
+static uint32_t alloc_track_countdown;
+static uint32_t alloc_track_live;
+static uint32_t alloc_track_dropped;    /* Samples lost to a full table */
+
+/* Kernel log ring (printk.c) */
+extern int printk(uint32_t level, const char* text);
+
+/* Function prototypes */
+void alloc_track_enable(uint32_t rate);
+void alloc_track_alloc(void* ptr, uint32_t size, void* caller);
+void alloc_track_free(void* ptr);
+uint32_t alloc_track_top(struct alloc_caller* callers, uint32_t max);
+void alloc_track_report(uint32_t tsc_khz);
+
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+/* Fibonacci hashing; the low bits of an allocation are all alike */
+static inline uint32_t alloc_slot(const void* ptr) {
+    return ((uint32_t)(uintptr_t)ptr * 2654435761u) >> ALLOC_TRACK_SHIFT;
+}
+
+/* Sample one allocation in rate from now on; 0 stops and forgets every record */
+void alloc_track_enable(uint32_t rate) {
+    uint32_t flags = irq_save();
+    alloc_track_rate = rate;
+    alloc_track_countdown = rate;
+    if (!rate) {
+        for (uint32_t i = 0; i < ALLOC_TRACK_SLOTS; i++) {
+            alloc_records[i].ptr = 0;
+        }
+        alloc_track_live = 0;
+        alloc_track_dropped = 0;
+    }
+    irq_restore(flags);
+}
+
+/* An allocator handed ptr to caller */
+void alloc_track_alloc(void* ptr, uint32_t size, void* caller) {
+    if (!alloc_track_rate || !ptr) {
+        return;
+    }
+    uint32_t flags = irq_save();
+    if (--alloc_track_countdown) {
+        irq_restore(flags);
+        return;
+    }
+    alloc_track_countdown = alloc_track_rate;
+
+    /* Keep a quarter free so probes stay short */
+    if (alloc_track_live >= ALLOC_TRACK_SLOTS * 3 / 4) {
+        alloc_track_dropped++;
+        irq_restore(flags);
+        return;
+    }
+    uint32_t slot = alloc_slot(ptr);
+    while (alloc_records[slot].ptr) {
+        slot = (slot + 1) & (ALLOC_TRACK_SLOTS - 1);
+    }
+    alloc_records[slot].ptr = ptr;
+    alloc_records[slot].caller = caller;
+    alloc_records[slot].size = size;
+    alloc_records[slot].tsc = rdtsc();
+    alloc_track_live++;
+    irq_restore(flags);
+}
+
+/* ptr went back to its allocator */
+void alloc_track_free(void* ptr) {
+    if (!alloc_track_live || !ptr) {
+        return;
+    }
+    uint32_t flags = irq_save();
+    uint32_t slot = alloc_slot(ptr);
+    while (alloc_records[slot].ptr && alloc_records[slot].ptr != ptr) {
+        slot = (slot + 1) & (ALLOC_TRACK_SLOTS - 1);
+    }
+    if (!alloc_records[slot].ptr) {
+        irq_restore(flags);
+        return;                         /* Not sampled */
+    }
+
+    /* Pull back any later record of the run that the hole would cut off from its home slot */
+    uint32_t hole = slot;
+    for (uint32_t next = (hole + 1) & (ALLOC_TRACK_SLOTS - 1); alloc_records[next].ptr;
+         next = (next + 1) & (ALLOC_TRACK_SLOTS - 1)) {
+        uint32_t home = alloc_slot(alloc_records[next].ptr);
+        if (((next - home) & (ALLOC_TRACK_SLOTS - 1)) >= ((next - hole) & (ALLOC_TRACK_SLOTS - 1))) {
+            alloc_records[hole] = alloc_records[next];
+            hole = next;
+        }
+    }
+    alloc_records[hole].ptr = 0;
+    alloc_track_live--;
+    irq_restore(flags);
+}
+
+/*
+ * The callers with the most outstanding bytes, most first, counts and
+ * bytes scaled up by the sampling rate; returns how many were filled in
+ */
+uint32_t alloc_track_top(struct alloc_caller* callers, uint32_t max) {
+    static struct alloc_caller groups[ALLOC_TRACK_CALLERS];
+    uint32_t count = 0;
+    uint32_t flags = irq_save();
+    uint32_t rate = alloc_track_rate;
+    for (uint32_t i = 0; i < ALLOC_TRACK_SLOTS; i++) {
+        struct alloc_record* record = &alloc_records[i];
+        if (!record->ptr) {
+            continue;
+        }
+        uint32_t g = 0;
+        while (g < count && groups[g].caller != record->caller) {
+            g++;
+        }
+        if (g == count) {
+            if (count == ALLOC_TRACK_CALLERS) {
+                continue;               /* The rest are grouped no further */
+            }
+            groups[count].caller = record->caller;
+            groups[count].count = 0;
+            groups[count].bytes = 0;
+            groups[count].oldest_tsc = record->tsc;
+            count++;
+        }
+        groups[g].count += rate;
+        groups[g].bytes += record->size * rate;
+        if (record->tsc < groups[g].oldest_tsc) {
+            groups[g].oldest_tsc = record->tsc;
+        }
+    }
+    irq_restore(flags);
+
+    /* Selection sort of the few wanted */
+    uint32_t filled = 0;
+    for (; filled < max && filled < count; filled++) {
+        uint32_t best = filled;
+        for (uint32_t g = filled + 1; g < count; g++) {
+            if (groups[g].bytes > groups[best].bytes) {
+                best = g;
+            }
+        }
+        struct alloc_caller swap = groups[filled];
+        groups[filled] = groups[best];
+        groups[best] = swap;
+        callers[filled] = groups[filled];
+    }
+    return filled;
+}
+
+static char* alloc_puts(char* out, const char* text) {
+    while (*text) {
+        *out++ = *text++;
+    }
+    return out;
+}
+
+static char* alloc_putu(char* out, uint32_t value) {
+    char digits[10];
+    uint32_t count = 0;
+    do {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    while (count) {
+        *out++ = digits[--count];
+    }
+    return out;
+}
+
+static char* alloc_puthex(char* out, uint32_t value) {
+    out = alloc_puts(out, "0x");
+    for (int shift = 28; shift >= 0; shift -= 4) {
+        *out++ = "0123456789abcdef"[(value >> shift) & 0xF];
+    }
+    return out;
+}
+
+/* Log the biggest outstanding callers; ages need tsc_khz, and are left out when it is 0 */
+void alloc_track_report(uint32_t tsc_khz) {
+    struct alloc_caller top[ALLOC_TRACK_TOP];
+    char line[ALLOC_TRACK_LINE];
+    if (!alloc_track_rate) {
+        printk(PRINTK_INFO, "Allocation tracking is off\n");
+        return;
+    }
+    uint32_t count = alloc_track_top(top, ALLOC_TRACK_TOP);
+    uint64_t now = rdtsc();
+
+    char* out = alloc_puts(line, "Outstanding allocations, sampled 1 in ");
+    out = alloc_putu(out, alloc_track_rate);
+    out = alloc_puts(out, " (");
+    out = alloc_putu(out, alloc_track_dropped);
+    out = alloc_puts(out, " samples dropped):\n");
+    *out = '\0';
+    printk(PRINTK_INFO, line);
+    for (uint32_t i = 0; i < count; i++) {
+        out = alloc_puts(line, "  ");
+        out = alloc_puthex(out, (uint32_t)(uintptr_t)top[i].caller);
+        out = alloc_puts(out, "  ~");
+        out = alloc_putu(out, top[i].count);
+        out = alloc_puts(out, " allocs  ~");
+        out = alloc_putu(out, top[i].bytes);
+        out = alloc_puts(out, " bytes");
+        if (tsc_khz) {
+            /* Milliseconds, saturating where 32 bits of cycles over kHz run out */
+            uint64_t age = (now - top[i].oldest_tsc) >> 10;
+            uint32_t khz = tsc_khz >> 10 ? tsc_khz >> 10 : 1;
+            out = alloc_puts(out, "  oldest ");
+            out = alloc_putu(out, age >> 32 ? 0xFFFFFFFF : (uint32_t)age / khz);
+            out = alloc_puts(out, " ms");
+        }
+        *out++ = '\n';
+        *out = '\0';
+        printk(PRINTK_INFO, line);
+    }
+}
@@ -0,0 +1,79 @@
+;
+; Tiny Operating System - Application Processor Trampoline
+; Real-mode entry for APs woken by INIT-SIPI-SIPI; copied below 1MB by smp_init
+;
+
+[bits 16]
+
+TRAMPOLINE_BASE equ 0x8000
+
+; Address of a trampoline label once copied to TRAMPOLINE_BASE
+%define TRAMP(label) (TRAMPOLINE_BASE + (label) - ap_trampoline_start)
+
+global ap_trampoline_start
+global ap_trampoline_end
+global ap_boot_stack
+global ap_boot_cr3
+global ap_boot_cr4
+global ap_boot_entry
+
+ap_trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    
+    ; Enter protected mode with the trampoline's flat GDT
+    lgdt [TRAMP(ap_gdt_ptr)]
+    mov eax, cr0
+    or eax, 1
+    mov cr0, eax
+    jmp dword 0x08:TRAMP(ap_protected)
+
+[bits 32]
+ap_protected:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+    mov esp, [TRAMP(ap_boot_stack)]
+    
+    ; Share the BSP's address space when paging is on
+    mov eax, [TRAMP(ap_boot_cr3)]
+    test eax, eax
+    jz .no_paging
+    mov ecx, [TRAMP(ap_boot_cr4)]
+    mov cr4, ecx
+    mov cr3, eax
+    mov eax, cr0
+    or eax, 0x80000000
+    mov cr0, eax
+.no_paging:
+
+    ; Continue in C; ap_main never returns
+    mov eax, [TRAMP(ap_boot_entry)]
+    call eax
+.halt:
+    hlt
+    jmp .halt
+
+; Flat code and data segments for the switch to protected mode
+align 8
+ap_gdt:
+    dq 0
+    dq 0x00CF9A000000FFFF    ; Kernel code
+    dq 0x00CF92000000FFFF    ; Kernel data
+ap_gdt_ptr:
+    dw ap_gdt_ptr - ap_gdt - 1
+    dd TRAMP(ap_gdt)
+
+; Filled in by smp_init before each SIPI
+align 4
+ap_boot_stack: dd 0
+ap_boot_cr3:   dd 0
+ap_boot_cr4:   dd 0
+ap_boot_entry: dd 0
+
+ap_trampoline_end:
@@ -0,0 +1,291 @@
+/*
+ * Phase 10: Local APIC and I/O APIC Driver
+ * MMIO EOI, per-CPU LAPIC timer and IOAPIC interrupt routing
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Local APIC registers (offsets from the APIC base) */
+#define LAPIC_DEFAULT_BASE 0xFEE00000
+#define LAPIC_ID 0x020
+#define LAPIC_EOI 0x0B0
+#define LAPIC_SVR 0x0F0
+#define LAPIC_ICR_LOW 0x300
+#define LAPIC_ICR_HIGH 0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3E0
+#define LAPIC_SVR_ENABLE 0x100
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+#define LAPIC_LVT_MASKED 0x10000
+#define LAPIC_TIMER_PERIODIC 0x20000
+#define LAPIC_DIVIDE_16 0x3
+#define ICR_DELIVERY_PENDING 0x00001000
+
+/* I/O APIC registers */
+#define MAX_IOAPICS 4
+#define IOAPIC_REGSEL 0x00
+#define IOAPIC_WINDOW 0x10
+#define IOAPIC_VERSION 0x01
+#define IOAPIC_REDIRECTION 0x10
+#define IOAPIC_MASKED 0x10000
+#define IOAPIC_LEVEL 0x8000
+#define IOAPIC_ACTIVE_LOW 0x2000
+
+/* ACPI interrupt source override flags (MPS INTI flags) */
+#define ISO_POLARITY_MASK 0x3
+#define ISO_POLARITY_LOW 0x3
+#define ISO_TRIGGER_MASK 0xC
+#define ISO_TRIGGER_LEVEL 0xC
+
+/* Legacy PIT, used to calibrate the LAPIC timer */
+#define PIT_FREQUENCY 1193182
+#define PIT_CALIBRATE_MS 10
+
+/* I/O APIC state */
+struct ioapic {
+    volatile uint32_t* base;
+    uint32_t gsi_base;
+    uint32_t gsi_count;
+};
+
+/* How an ISA IRQ is wired to a global system interrupt */
+struct irq_override {
+    uint32_t gsi;
+    uint16_t flags;
+};
+
+/* Global variables */
+static volatile uint32_t* lapic = (volatile uint32_t*)LAPIC_DEFAULT_BASE;
+static uint32_t lapic_timer_hz_ticks;    /* LAPIC timer counts per second at divide 16 */
+static struct ioapic ioapics[MAX_IOAPICS];
+static uint32_t ioapic_count = 0;
+static struct irq_override irq_overrides[16];
+
+/* Function prototypes */
+void lapic_set_base(uint32_t address);
+uint32_t lapic_read(uint32_t reg);
+void lapic_write(uint32_t reg, uint32_t value);
+void lapic_enable(void);
+void lapic_eoi(void);
+uint32_t lapic_id(void);
+void lapic_send_ipi(uint32_t apic_id, uint32_t command);
+void lapic_timer_init(uint8_t vector, uint32_t frequency);
+void lapic_timer_stop(void);
+void apic_reset(void);
+uint32_t ioapic_add(uint32_t address, uint32_t gsi_base);
+void ioapic_add_override(uint8_t irq, uint32_t gsi, uint16_t flags);
+int ioapic_available(void);
+uint32_t ioapic_address(uint32_t index);
+int ioapic_route_irq(uint8_t irq, uint8_t vector, uint32_t apic_id);
+void ioapic_mask_irq(uint8_t irq);
+void pic_disable(void);
+
+/* Port I/O functions */
+static inline void outb(uint16_t port, uint8_t value) {
+    __asm__ __volatile__("outb %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    __asm__ __volatile__("inb %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+/* Local APIC access */
+void lapic_set_base(uint32_t address) {
+    lapic = (volatile uint32_t*)address;
+}
+
+uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+    (void)lapic[LAPIC_ID / 4];       /* Read back to post the write */
+}
+
+void lapic_enable(void) {
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+/* One MMIO store instead of the 8259's port I/O */
+void lapic_eoi(void) {
+    lapic[LAPIC_EOI / 4] = 0;
+}
+
+uint32_t lapic_id(void) {
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint32_t command) {
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, command);
+    while (lapic_read(LAPIC_ICR_LOW) & ICR_DELIVERY_PENDING) {
+        __asm__ __volatile__("pause");
+    }
+}
+
+/* Count LAPIC timer ticks across a PIT channel 2 window */
+static uint32_t lapic_timer_calibrate(void) {
+    uint32_t latch = PIT_FREQUENCY / (1000 / PIT_CALIBRATE_MS);
+    
+    /* Gate channel 2 on with the speaker off; mode 0 raises OUT2 at zero */
+    outb(0x61, (inb(0x61) & ~0x02) | 0x01);
+    outb(0x43, 0xB0);
+    outb(0x42, latch & 0xFF);
+    outb(0x42, (latch >> 8) & 0xFF);
+    
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+    while (!(inb(0x61) & 0x20)) {
+    }
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+    
+    return elapsed * (1000 / PIT_CALIBRATE_MS);
+}
+
+/* Start this CPU's periodic scheduling tick; the first caller calibrates */
+void lapic_timer_init(uint8_t vector, uint32_t frequency) {
+    if (frequency == 0) {
+        return;
+    }
+    if (lapic_timer_hz_ticks == 0) {
+        lapic_timer_hz_ticks = lapic_timer_calibrate();
+    }
+    
+    uint32_t initial = lapic_timer_hz_ticks / frequency;
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | vector);
+    lapic_write(LAPIC_TIMER_INITIAL, initial ? initial : 1);
+}
+
+void lapic_timer_stop(void) {
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+}
+
+/* I/O APIC access */
+static uint32_t ioapic_read(struct ioapic* io, uint32_t reg) {
+    io->base[IOAPIC_REGSEL / 4] = reg;
+    return io->base[IOAPIC_WINDOW / 4];
+}
+
+static void ioapic_write(struct ioapic* io, uint32_t reg, uint32_t value) {
+    io->base[IOAPIC_REGSEL / 4] = reg;
+    io->base[IOAPIC_WINDOW / 4] = value;
+}
+
+/* Forget firmware-reported I/O APICs before rescanning the tables */
+void apic_reset(void) {
+    ioapic_count = 0;
+    lapic_timer_hz_ticks = 0;
+    for (int irq = 0; irq < 16; irq++) {
+        irq_overrides[irq].gsi = irq;
+        irq_overrides[irq].flags = 0;
+    }
+}
+
+/* Register an I/O APIC with all pins masked; returns its pin count */
+uint32_t ioapic_add(uint32_t address, uint32_t gsi_base) {
+    if (ioapic_count >= MAX_IOAPICS) {
+        return 0;
+    }
+    
+    struct ioapic* io = &ioapics[ioapic_count++];
+    io->base = (volatile uint32_t*)address;
+    io->gsi_base = gsi_base;
+    io->gsi_count = ((ioapic_read(io, IOAPIC_VERSION) >> 16) & 0xFF) + 1;
+    
+    for (uint32_t pin = 0; pin < io->gsi_count; pin++) {
+        ioapic_write(io, IOAPIC_REDIRECTION + pin * 2, IOAPIC_MASKED);
+    }
+    return io->gsi_count;
+}
+
+/* Record an ISA IRQ that firmware wired to a different GSI or polarity */
+void ioapic_add_override(uint8_t irq, uint32_t gsi, uint16_t flags) {
+    if (irq < 16) {
+        irq_overrides[irq].gsi = gsi;
+        irq_overrides[irq].flags = flags;
+    }
+}
+
+int ioapic_available(void) {
+    return ioapic_count > 0;
+}
+
+/* Physical register window of the index'th I/O APIC, or 0 past the last */
+uint32_t ioapic_address(uint32_t index) {
+    return index < ioapic_count ? (uint32_t)ioapics[index].base : 0;
+}
+
+/* Find the I/O APIC and pin serving a GSI */
+static struct ioapic* ioapic_for_gsi(uint32_t gsi, uint32_t* pin) {
+    for (uint32_t i = 0; i < ioapic_count; i++) {
+        struct ioapic* io = &ioapics[i];
+        if (gsi >= io->gsi_base && gsi < io->gsi_base + io->gsi_count) {
+            *pin = gsi - io->gsi_base;
+            return io;
+        }
+    }
+    return NULL;
+}
+
+/* Deliver an IRQ as vector to the CPU with apic_id; returns 0 on success */
+int ioapic_route_irq(uint8_t irq, uint8_t vector, uint32_t apic_id) {
+    uint32_t gsi = irq;
+    uint16_t flags = 0;
+    if (irq < 16) {
+        gsi = irq_overrides[irq].gsi;
+        flags = irq_overrides[irq].flags;
+    }
+    
+    uint32_t pin;
+    struct ioapic* io = ioapic_for_gsi(gsi, &pin);
+    if (!io) {
+        return -1;
+    }
+    
+    /* ISA IRQs default to edge/active-high; PCI lines above 15 are level/active-low */
+    uint32_t low = vector;
+    if ((flags & ISO_POLARITY_MASK) == ISO_POLARITY_LOW || (irq >= 16 && !flags)) {
+        low |= IOAPIC_ACTIVE_LOW;
+    }
+    if ((flags & ISO_TRIGGER_MASK) == ISO_TRIGGER_LEVEL || (irq >= 16 && !flags)) {
+        low |= IOAPIC_LEVEL;
+    }
+    
+    /* Write the destination first so the unmasked entry is never half set */
+    ioapic_write(io, IOAPIC_REDIRECTION + pin * 2 + 1, apic_id << 24);
+    ioapic_write(io, IOAPIC_REDIRECTION + pin * 2, low);
+    return 0;
+}
+
+void ioapic_mask_irq(uint8_t irq) {
+    uint32_t gsi = irq < 16 ? irq_overrides[irq].gsi : irq;
+    uint32_t pin;
+    struct ioapic* io = ioapic_for_gsi(gsi, &pin);
+    if (io) {
+        ioapic_write(io, IOAPIC_REDIRECTION + pin * 2, IOAPIC_MASKED);
+    }
+}
+
+/* Remap the 8259s clear of the exception vectors and mask every line */
+void pic_disable(void) {
+    outb(0x20, 0x11);
+    outb(0xA0, 0x11);
+    outb(0x21, 0x20);
+    outb(0xA1, 0x28);
+    outb(0x21, 0x04);
+    outb(0xA1, 0x02);
+    outb(0x21, 0x01);
+    outb(0xA1, 0x01);
+    outb(0x21, 0xFF);
+    outb(0xA1, 0xFF);
+}
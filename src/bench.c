@@ -0,0 +1,271 @@
+/*
+ * Tiny Operating System - Micro-Benchmarks
+ * Registered benchmarks are timed with the TSC between serialising fences.
+ * Each is scaled until one sample is long enough to dwarf the timer's own
+ * cost, warmed up, then sampled repeatedly; the log gets the minimum,
+ * median and 99th percentile cycles per iteration, and the last results
+ * can be exported as JSON lines for comparison between builds.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BENCH_MAX 16
+#define BENCH_SAMPLES 128               /* p99 is then the second-slowest sample */
+#define BENCH_WARMUP 8                  /* Samples run and thrown away before the measured ones */
+#define BENCH_SAMPLE_CYCLES 20000       /* Scale iterations until one sample takes this long */
+#define BENCH_MAX_ITERATIONS (1u << 16)
+#define BENCH_LINE 80
+#define BENCH_NAME_MAX 20              /* The log's name column */
+
+/* CPUID feature bits */
+#define CPUID_FEAT_EDX_TSC (1u << 4)
+#define CPUID_FEAT_EDX_SSE2 (1u << 26)  /* LFENCE */
+#define CPUID_EXT_EDX_RDTSCP (1u << 27)
+
+/* Levels, as in syslog (must match printk.c) */
+#define PRINTK_WARNING 4
+#define PRINTK_INFO 6
+
+/* Cycles per iteration over the measured samples (must match the users' copies) */
+struct bench_result {
+    uint32_t iterations;                /* Per sample, after scaling */
+    uint32_t min;
+    uint32_t median;
+    uint32_t p99;
+};
+
+/* One registered benchmark: run executes the operation iterations times */
+struct bench {
+    const char* name;
+    void (*run)(uint32_t iterations);
+    int measured;                       /* result holds bench_run_all's last measurement */
+    struct bench_result result;
+};
+
+static struct bench benches[BENCH_MAX];
+static uint32_t bench_count;
+static int bench_probed;
+static int bench_has_tsc;
+static int bench_has_lfence;
+static int bench_has_rdtscp;
+static uint32_t bench_overhead;         /* Cycles an empty start/stop pair reads */
+static uint32_t bench_samples[BENCH_SAMPLES];
+
+/* Function prototypes */
+int bench_register(const char* name, void (*run)(uint32_t iterations));
+int bench_run(uint32_t id, struct bench_result* result);
+uint32_t bench_run_all(void);
+uint32_t bench_export(void (*emit)(const void* data, uint32_t size));
+
+/* Kernel log ring (printk.c) */
+extern int printk(uint32_t level, const char* text);
+
+/* Kernel runtime library (klib.c) */
+extern char* klib_puts(char* out, const char* text, uint32_t width);
+extern char* klib_putu(char* out, uint32_t value, uint32_t width);
+
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    __asm__ __volatile__("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+/*
+ * Start of a timed region: nothing before it may still be executing when
+ * the TSC is read, and nothing after it may start before. LFENCE orders
+ * instruction execution where SSE2 has it; CPUID serialises everywhere,
+ * at a higher and less steady cost.
+ */
+static inline uint64_t bench_start(void) {
+    uint32_t low, high, ebx, ecx;
+    if (bench_has_lfence) {
+        __asm__ __volatile__("lfence; rdtsc; lfence" : "=a"(low), "=d"(high) : : "memory");
+    } else {
+        __asm__ __volatile__("cpuid; rdtsc" : "=a"(low), "=d"(high), "=b"(ebx), "=c"(ecx) : "a"(0) : "memory");
+    }
+    return ((uint64_t)high << 32) | low;
+}
+
+/*
+ * End of a timed region: RDTSCP waits for everything before it to finish,
+ * and the fence keeps what follows out of the region
+ */
+static inline uint64_t bench_stop(void) {
+    uint32_t low, high, aux, ebx, ecx;
+    if (bench_has_rdtscp) {
+        __asm__ __volatile__("rdtscp; lfence" : "=a"(low), "=d"(high), "=c"(aux) : : "memory");
+    } else if (bench_has_lfence) {
+        __asm__ __volatile__("lfence; rdtsc; lfence" : "=a"(low), "=d"(high) : : "memory");
+    } else {
+        __asm__ __volatile__("cpuid; rdtsc" : "=a"(low), "=d"(high), "=b"(ebx), "=c"(ecx) : "a"(0) : "memory");
+    }
+    (void)aux;
+    return ((uint64_t)high << 32) | low;
+}
+
+/* Cycles in 32 bits: a sample is scaled to tens of thousands, never near 4G */
+static inline uint32_t bench_elapsed(uint64_t start, uint64_t end) {
+    uint64_t cycles = end - start;
+    return cycles > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)cycles;
+}
+
+/* What the CPU can time with, and the cost of timing nothing */
+static void bench_probe(void) {
+    uint32_t eax, ebx, ecx, edx;
+    bench_probed = 1;
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax < 1) {
+        return;
+    }
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    bench_has_tsc = (edx & CPUID_FEAT_EDX_TSC) != 0;
+    bench_has_lfence = (edx & CPUID_FEAT_EDX_SSE2) != 0;
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000001) {
+        cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+        bench_has_rdtscp = bench_has_lfence && (edx & CPUID_EXT_EDX_RDTSCP);
+    }
+    if (!bench_has_tsc) {
+        return;
+    }
+
+    uint32_t overhead = 0xFFFFFFFF;
+    for (uint32_t i = 0; i < BENCH_WARMUP * 4; i++) {
+        uint64_t start = bench_start();
+        uint32_t cycles = bench_elapsed(start, bench_stop());
+        if (cycles < overhead) {
+            overhead = cycles;
+        }
+    }
+    bench_overhead = overhead;
+}
+
+/* One sample of iterations runs, in cycles per iteration with the timer's cost taken out */
+static uint32_t bench_sample(const struct bench* bench, uint32_t iterations, uint32_t* total) {
+    uint64_t start = bench_start();
+    bench->run(iterations);
+    uint32_t cycles = bench_elapsed(start, bench_stop());
+    cycles = cycles > bench_overhead ? cycles - bench_overhead : 0;
+    if (total) {
+        *total = cycles;
+    }
+    return cycles / iterations;
+}
+
+/* Register a benchmark; returns its id, or -1 when the table is full or the name too long */
+int bench_register(const char* name, void (*run)(uint32_t iterations)) {
+    uint32_t len = 0;
+    while (name[len]) {
+        len++;
+    }
+    if (bench_count == BENCH_MAX || len > BENCH_NAME_MAX) {
+        return -1;
+    }
+    benches[bench_count].name = name;
+    benches[bench_count].run = run;
+    benches[bench_count].measured = 0;
+    return (int)bench_count++;
+}
+
+/*
+ * Measure benchmark id. Iterations double from one until a sample takes
+ * BENCH_SAMPLE_CYCLES, which also brings caches and predictors in; a few
+ * more samples are discarded, then BENCH_SAMPLES are kept and sorted.
+ * Returns 0, or -1 for an unknown id or a CPU without a TSC.
+ */
+int bench_run(uint32_t id, struct bench_result* result) {
+    if (!bench_probed) {
+        bench_probe();
+    }
+    if (id >= bench_count || !bench_has_tsc) {
+        return -1;
+    }
+    const struct bench* bench = &benches[id];
+
+    uint32_t iterations = 1;
+    uint32_t total;
+    bench_sample(bench, iterations, &total);
+    while (total < BENCH_SAMPLE_CYCLES && iterations < BENCH_MAX_ITERATIONS) {
+        iterations <<= 1;
+        bench_sample(bench, iterations, &total);
+    }
+    for (uint32_t i = 0; i < BENCH_WARMUP; i++) {
+        bench_sample(bench, iterations, NULL);
+    }
+
+    /* An insertion sort as the samples come in */
+    for (uint32_t i = 0; i < BENCH_SAMPLES; i++) {
+        uint32_t cycles = bench_sample(bench, iterations, NULL);
+        uint32_t j = i;
+        while (j && bench_samples[j - 1] > cycles) {
+            bench_samples[j] = bench_samples[j - 1];
+            j--;
+        }
+        bench_samples[j] = cycles;
+    }
+
+    result->iterations = iterations;
+    result->min = bench_samples[0];
+    result->median = bench_samples[BENCH_SAMPLES / 2];
+    result->p99 = bench_samples[BENCH_SAMPLES * 99 / 100];
+    return 0;
+}
+
+/* Run every registered benchmark and log a table of them; returns how many were measured */
+uint32_t bench_run_all(void) {
+    char line[BENCH_LINE];
+    uint32_t measured = 0;
+
+    printk(PRINTK_INFO, "Benchmarks, cycles per iteration (iterations, min, median, p99):\n");
+    for (uint32_t id = 0; id < bench_count; id++) {
+        const struct bench_result* result = &benches[id].result;
+        char* out = klib_puts(line, "  ", 2);
+        out = klib_puts(out, benches[id].name, BENCH_NAME_MAX);
+        int failed = bench_run(id, &benches[id].result) != 0;
+        benches[id].measured = !failed;
+        if (failed) {
+            out = klib_puts(out, " no TSC", 0);
+        } else {
+            out = klib_putu(out, result->iterations, 8);
+            out = klib_putu(out, result->min, 10);
+            out = klib_putu(out, result->median, 10);
+            out = klib_putu(out, result->p99, 10);
+            measured++;
+        }
+        *out++ = '\n';
+        *out = '\0';
+        printk(failed ? PRINTK_WARNING : PRINTK_INFO, line);
+    }
+    return measured;
+}
+
+/*
+ * The results of the last bench_run_all, one JSON object per line:
+ * {"bench":"name","unit":"cycles","iterations":N,"min":N,"median":N,"p99":N}
+ * Names are written as registered and must not need escaping. Returns
+ * how many lines were emitted.
+ */
+uint32_t bench_export(void (*emit)(const void* data, uint32_t size)) {
+    char line[BENCH_LINE * 2];
+    uint32_t exported = 0;
+
+    for (uint32_t id = 0; id < bench_count; id++) {
+        const struct bench_result* result = &benches[id].result;
+        if (!benches[id].measured) {
+            continue;
+        }
+        char* out = klib_puts(line, "{\"bench\":\"", 0);
+        out = klib_puts(out, benches[id].name, 0);
+        out = klib_puts(out, "\",\"unit\":\"cycles\",\"iterations\":", 0);
+        out = klib_putu(out, result->iterations, 0);
+        out = klib_puts(out, ",\"min\":", 0);
+        out = klib_putu(out, result->min, 0);
+        out = klib_puts(out, ",\"median\":", 0);
+        out = klib_putu(out, result->median, 0);
+        out = klib_puts(out, ",\"p99\":", 0);
+        out = klib_putu(out, result->p99, 0);
+        out = klib_puts(out, "}\n", 0);
+        emit(line, (uint32_t)(out - line));
+        exported++;
+    }
+    return exported;
+}
@@ -0,0 +1,358 @@
+/*
+ * Tiny Operating System - Block I/O Benchmark
+ * fio-style jobs against a block device: sequential or random reads or
+ * writes of one block size over a region of the disk. A direct job keeps
+ * a fixed number of bios in flight through the request queue; a cached
+ * job goes through bread and the buffer cache's write-back, one I/O at a
+ * time as a file system would. Every I/O is timed from submission to
+ * completion, and the log gets IOPS, MB/s and the latency percentiles.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SECTOR_SIZE 512
+#define BCACHE_BLOCK_SIZE 1024          /* Must match buffer_cache.c */
+#define BCACHE_SECTORS_PER_BLOCK (BCACHE_BLOCK_SIZE / SECTOR_SIZE)
+
+/* Job limits */
+#define BLK_BENCH_MAX_IOS 512
+#define BLK_BENCH_MAX_DEPTH 32
+#define BLK_BENCH_BUFFER (64 * 1024)    /* Queue depth times block size must fit */
+#define BLK_BENCH_SEED 0x9E3779B9
+#define BLK_BENCH_LINE 120
+
+/* CPUID feature bits */
+#define CPUID_FEAT_EDX_TSC (1u << 4)
+#define CPUID_FEAT_EDX_SSE2 (1u << 26)  /* LFENCE */
+
+/* Levels, as in syslog (must match printk.c) */
+#define PRINTK_WARNING 4
+#define PRINTK_INFO 6
+
+/* One I/O from a caller (must match struct bio in block.c) */
+struct bio {
+    struct bio* next;
+    uint32_t sector;
+    uint32_t count;
+    uint8_t* buffer;
+    uint8_t write;
+    int status;
+    void (*done)(struct bio* bio);
+    void* private;
+};
+
+/* A job (must match the users' copies) */
+struct blk_bench_job {
+    uint32_t device;                    /* Block layer device number */
+    uint32_t first_sector;              /* The job stays in [first_sector, first_sector + sectors) */
+    uint32_t sectors;
+    uint32_t block_size;                /* Bytes per I/O: whole sectors, or whole cache blocks when cached */
+    uint32_t queue_depth;               /* I/Os in flight; a cached job has one */
+    uint32_t ios;
+    uint8_t write;
+    uint8_t random;
+    uint8_t cached;                     /* Through the buffer cache instead of straight to the queue */
+};
+
+/* What a job measured (must match the users' copies) */
+struct blk_bench_result {
+    uint32_t ios;                       /* Completed, failed ones included */
+    uint32_t errors;
+    uint32_t iops;                      /* 0 without a TSC rate */
+    uint32_t kb_per_sec;
+    uint32_t lat_p50;                   /* Nanoseconds, or cycles without a TSC rate */
+    uint32_t lat_p99;
+    uint32_t lat_max;
+    uint32_t cache_hits;                /* Percent of a cached job's block lookups that hit */
+};
+
+/* The job in progress */
+static struct bio blk_bench_bios[BLK_BENCH_MAX_DEPTH];
+static uint64_t blk_bench_issued[BLK_BENCH_MAX_DEPTH];
+static volatile uint8_t blk_bench_busy[BLK_BENCH_MAX_DEPTH];
+static uint32_t blk_bench_latency[BLK_BENCH_MAX_IOS];
+static volatile uint32_t blk_bench_completed;
+static volatile uint32_t blk_bench_errors;
+static uint8_t blk_bench_buffer[BLK_BENCH_BUFFER] __attribute__((aligned(4096)));
+static uint32_t blk_bench_seed;
+static int blk_bench_has_lfence;
+static int blk_bench_header_logged;
+
+/* Function prototypes */
+int blk_bench_run(const char* name, const struct blk_bench_job* job, uint32_t tsc_khz,
+                  struct blk_bench_result* result);
+
+/* Block layer (block.c) */
+extern void blk_submit_bio(uint32_t device, struct bio* bio);
+extern void blk_poll(uint32_t device);
+extern uint32_t blk_sectors(uint32_t device);
+
+/* Buffer cache (buffer_cache.c) */
+struct buffer;
+extern struct buffer* bread(uint32_t device, uint32_t block);
+extern void brelse(struct buffer* buf);
+extern void bmark_dirty(struct buffer* buf);
+extern void* bdata(struct buffer* buf);
+extern int bsync(void);
+extern void bcache_get_statistics(uint32_t* hits, uint32_t* misses, uint32_t* evictions, uint32_t* writebacks);
+
+/* Kernel log ring (printk.c) */
+extern int printk(uint32_t level, const char* text);
+
+/* Kernel runtime library (klib.c) */
+extern void* memcpy(void* dest, const void* src, size_t n);
+extern char* klib_puts(char* out, const char* text, uint32_t width);
+extern char* klib_putu(char* out, uint32_t value, uint32_t width);
+
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    __asm__ __volatile__("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+/* The TSC, fenced where LFENCE exists so the stamp sits where it is taken */
+static inline uint64_t blk_bench_clock(void) {
+    uint32_t low, high;
+    if (blk_bench_has_lfence) {
+        __asm__ __volatile__("lfence; rdtsc; lfence" : "=a"(low), "=d"(high) : : "memory");
+    } else {
+        __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high) : : "memory");
+    }
+    return ((uint64_t)high << 32) | low;
+}
+
+/* 64-by-32 division with divl; the quotient must fit 32 bits. There is no libgcc */
+static inline uint32_t div_u64_u32(uint64_t dividend, uint32_t divisor) {
+    uint32_t quotient, rem;
+    __asm__("divl %4" : "=a"(quotient), "=d"(rem) : "a"((uint32_t)dividend), "d"((uint32_t)(dividend >> 32)), "rm"(divisor));
+    return quotient;
+}
+
+static uint32_t blk_bench_elapsed(uint64_t start, uint64_t end) {
+    uint64_t cycles = end - start;
+    return cycles > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)cycles;
+}
+
+/* xorshift32: the same offsets for every device */
+static uint32_t blk_bench_random(void) {
+    blk_bench_seed ^= blk_bench_seed << 13;
+    blk_bench_seed ^= blk_bench_seed >> 17;
+    blk_bench_seed ^= blk_bench_seed << 5;
+    return blk_bench_seed;
+}
+
+/* First sector of I/O number i */
+static uint32_t blk_bench_sector(const struct blk_bench_job* job, uint32_t i) {
+    uint32_t per_io = job->block_size / SECTOR_SIZE;
+    uint32_t slots = job->sectors / per_io;
+    uint32_t slot = job->random ? blk_bench_random() % slots : i % slots;
+    return job->first_sector + slot * per_io;
+}
+
+/* Completion, possibly from an interrupt: record the latency and free the slot */
+static void blk_bench_done(struct bio* bio) {
+    uint32_t slot = (uint32_t)(bio - blk_bench_bios);
+    uint32_t index = blk_bench_completed;
+    if (index < BLK_BENCH_MAX_IOS) {
+        blk_bench_latency[index] = blk_bench_elapsed(blk_bench_issued[slot], blk_bench_clock());
+    }
+    if (bio->status != 0) {
+        blk_bench_errors++;
+    }
+    blk_bench_completed = index + 1;
+    blk_bench_busy[slot] = 0;
+}
+
+/* Keep queue_depth bios in flight until ios have completed */
+static void blk_bench_direct(const struct blk_bench_job* job) {
+    uint32_t submitted = 0;
+    while (blk_bench_completed < job->ios) {
+        int issued = 0;
+        for (uint32_t slot = 0; slot < job->queue_depth && submitted < job->ios; slot++) {
+            if (blk_bench_busy[slot]) {
+                continue;
+            }
+            struct bio* bio = &blk_bench_bios[slot];
+            bio->sector = blk_bench_sector(job, submitted);
+            bio->count = job->block_size / SECTOR_SIZE;
+            bio->buffer = blk_bench_buffer + slot * job->block_size;
+            bio->write = job->write;
+            bio->done = blk_bench_done;
+            bio->private = NULL;
+            blk_bench_busy[slot] = 1;
+            submitted++;
+            issued = 1;
+            blk_bench_issued[slot] = blk_bench_clock();
+            blk_submit_bio(job->device, bio);
+        }
+        if (!issued) {
+            blk_poll(job->device);
+        }
+    }
+}
+
+/* One I/O at a time through the cache; writes are dirtied and flushed at the end */
+static void blk_bench_cached(const struct blk_bench_job* job) {
+    uint32_t blocks = job->block_size / BCACHE_BLOCK_SIZE;
+    for (uint32_t i = 0; i < job->ios; i++) {
+        uint32_t block = blk_bench_sector(job, i) / BCACHE_SECTORS_PER_BLOCK;
+        uint64_t start = blk_bench_clock();
+        for (uint32_t b = 0; b < blocks; b++) {
+            struct buffer* buf = bread(job->device, block + b);
+            if (!buf) {
+                blk_bench_errors++;
+                continue;
+            }
+            uint8_t* data = (uint8_t*)bdata(buf);
+            if (job->write) {
+                memcpy(data, blk_bench_buffer + b * BCACHE_BLOCK_SIZE, BCACHE_BLOCK_SIZE);
+                bmark_dirty(buf);
+            } else {
+                memcpy(blk_bench_buffer + b * BCACHE_BLOCK_SIZE, data, BCACHE_BLOCK_SIZE);
+            }
+            brelse(buf);
+        }
+        blk_bench_latency[i] = blk_bench_elapsed(start, blk_bench_clock());
+        blk_bench_completed = i + 1;
+    }
+    if (job->write && bsync() != 0) {
+        blk_bench_errors++;
+    }
+}
+
+static void blk_bench_log(const char* name, const struct blk_bench_job* job, const struct blk_bench_result* result) {
+    char line[BLK_BENCH_LINE];
+    if (!blk_bench_header_logged) {
+        blk_bench_header_logged = 1;
+        printk(PRINTK_INFO, "Block I/O (IOPS, MB/s, latency p50, p99 and max in ns):\n");
+    }
+    char* out = klib_puts(line, "  ", 2);
+    out = klib_puts(out, name, 9);
+    out = klib_puts(out, job->random ? "rand" : "seq", 0);
+    out = klib_puts(out, job->write ? "write " : "read  ", 0);
+    out = klib_putu(out, job->block_size >> 10, 3);
+    out = klib_puts(out, "K ", 0);
+    if (job->cached) {
+        out = klib_puts(out, "cached", 6);
+    } else {
+        out = klib_puts(out, "qd", 0);
+        out = klib_putu(out, job->queue_depth, 0);
+        out = klib_puts(out, job->queue_depth < 10 ? "   " : "  ", 0);
+    }
+    out = klib_putu(out, result->iops, 9);
+    out = klib_putu(out, result->kb_per_sec / 1000, 6);
+    out = klib_puts(out, ".", 0);
+    out = klib_putu(out, result->kb_per_sec % 1000 / 100, 1);
+    out = klib_putu(out, result->lat_p50, 10);
+    out = klib_putu(out, result->lat_p99, 10);
+    out = klib_putu(out, result->lat_max, 10);
+    if (job->cached) {
+        out = klib_puts(out, " hits ", 0);
+        out = klib_putu(out, result->cache_hits, 0);
+        out = klib_puts(out, "%", 0);
+    }
+    if (result->errors) {
+        out = klib_puts(out, " failed ", 0);
+        out = klib_putu(out, result->errors, 0);
+    }
+    *out++ = '\n';
+    *out = '\0';
+    printk(result->errors ? PRINTK_WARNING : PRINTK_INFO, line);
+}
+
+/* Cycles to nanoseconds at tsc_khz; cycles themselves without a rate */
+static uint32_t blk_bench_ns(uint32_t cycles, uint32_t tsc_khz) {
+    if (!tsc_khz) {
+        return cycles;
+    }
+    uint64_t ns = div_u64_u32((uint64_t)cycles * 1000, tsc_khz);
+    return (uint32_t)ns;
+}
+
+/*
+ * Run job on the device and log one line for it under name: IOPS, MB/s and
+ * the p50, p99 and maximum latency. A write job overwrites its region.
+ * Returns 0, or -1 for a job outside the limits or a CPU without a TSC.
+ */
+int blk_bench_run(const char* name, const struct blk_bench_job* job, uint32_t tsc_khz,
+                  struct blk_bench_result* result) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax < 1) {
+        return -1;
+    }
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & CPUID_FEAT_EDX_TSC)) {
+        return -1;
+    }
+    blk_bench_has_lfence = (edx & CPUID_FEAT_EDX_SSE2) != 0;
+
+    uint32_t unit = job->cached ? BCACHE_BLOCK_SIZE : SECTOR_SIZE;
+    uint32_t depth = job->cached ? 1 : job->queue_depth;
+    if (!job->block_size || job->block_size % unit || job->first_sector % (unit / SECTOR_SIZE) ||
+        !depth || depth > BLK_BENCH_MAX_DEPTH || depth * job->block_size > BLK_BENCH_BUFFER ||
+        !job->ios || job->ios > BLK_BENCH_MAX_IOS || job->sectors < job->block_size / SECTOR_SIZE ||
+        job->first_sector + job->sectors > blk_sectors(job->device)) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < BLK_BENCH_BUFFER; i++) {
+        blk_bench_buffer[i] = (uint8_t)(i * 7 + i / SECTOR_SIZE);
+    }
+    for (uint32_t i = 0; i < BLK_BENCH_MAX_DEPTH; i++) {
+        blk_bench_busy[i] = 0;
+    }
+    blk_bench_completed = 0;
+    blk_bench_errors = 0;
+    blk_bench_seed = BLK_BENCH_SEED;
+    uint32_t hits_before, misses_before;
+    bcache_get_statistics(&hits_before, &misses_before, NULL, NULL);
+
+    uint64_t start = blk_bench_clock();
+    if (job->cached) {
+        blk_bench_cached(job);
+    } else {
+        blk_bench_direct(job);
+    }
+    uint64_t total = blk_bench_clock() - start;
+
+    struct blk_bench_result zero = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    *result = zero;
+    result->ios = blk_bench_completed;
+    result->errors = blk_bench_errors;
+    if (job->cached) {
+        uint32_t hits, misses;
+        bcache_get_statistics(&hits, &misses, NULL, NULL);
+        uint32_t lookups = (hits - hits_before) + (misses - misses_before);
+        result->cache_hits = lookups ? div_u64_u32((uint64_t)(hits - hits_before) * 100, lookups) : 0;
+    }
+
+    /* An insertion sort: the percentiles, and the largest for the maximum */
+    uint32_t count = result->ios;
+    for (uint32_t i = 1; i < count; i++) {
+        uint32_t cycles = blk_bench_latency[i];
+        uint32_t j = i;
+        while (j && blk_bench_latency[j - 1] > cycles) {
+            blk_bench_latency[j] = blk_bench_latency[j - 1];
+            j--;
+        }
+        blk_bench_latency[j] = cycles;
+    }
+    result->lat_p50 = blk_bench_ns(blk_bench_latency[count / 2], tsc_khz);
+    result->lat_p99 = blk_bench_ns(blk_bench_latency[count * 99 / 100], tsc_khz);
+    result->lat_max = blk_bench_ns(blk_bench_latency[count - 1], tsc_khz);
+
+    /* Rates over the whole run, so overlap at depth shows */
+    if (tsc_khz && total) {
+        uint32_t shift = 0;
+        while (total >> 32) {
+            total >>= 1;
+            shift++;
+        }
+        uint64_t iops = div_u64_u32((uint64_t)count * tsc_khz * 1000 >> shift, (uint32_t)total);
+        result->iops = (uint32_t)iops;
+        result->kb_per_sec = div_u64_u32(iops * job->block_size, 1000);
+    }
+
+    blk_bench_log(name, job, result);
+    return 0;
+}
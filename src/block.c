@@ -0,0 +1,614 @@
+/*
+ * Tiny Operating System - Block Layer
+ * bio request queues with merging, plugging and a deadline scheduler
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SECTOR_SIZE 512
+
+#define BLK_MAX_DEVICES 8
+#define BLK_MAX_REQUESTS 64             /* Queued or in flight, across all devices */
+#define BLK_MAX_SECTORS 128             /* Largest request a merge may build: 64 KiB */
+#define BLK_PLUG_LIMIT 16               /* A plugged queue this long is flushed anyway */
+
+/* Deadline scheduler tuning, in timer ticks and requests */
+#define BLK_READ_EXPIRE 50
+#define BLK_WRITE_EXPIRE 500
+#define BLK_FIFO_BATCH 16               /* Requests dispatched in sector order before the FIFOs are checked */
+#define BLK_WRITES_STARVED 2            /* Read batches allowed while writes wait */
+
+#define BLK_READ 0
+#define BLK_WRITE 1
+
+/* One I/O from a caller; the block layer may merge it with its neighbours */
+struct bio {
+    struct bio* next;                   /* Within a request, in sector order */
+    uint32_t sector;
+    uint32_t count;
+    uint8_t* buffer;
+    uint8_t write;
+    int status;
+    void (*done)(struct bio* bio);
+    void* private;
+};
+
+/* Adjacent bios, dispatched to the device as one transfer */
+struct request {
+    struct request* sort_next;          /* Sector order, per direction */
+    struct request** sort_pprev;
+    struct request* fifo_next;          /* Arrival order, per direction */
+    struct request** fifo_pprev;
+    struct block_device* device;
+    struct bio* head;
+    struct bio* tail;
+    uint32_t sector;
+    uint32_t count;
+    uint8_t write;
+    uint8_t contiguous;                 /* The bios' buffers follow each other in memory */
+    uint32_t deadline;
+    uint8_t* bounce;                    /* Gathers the bios when they are not contiguous */
+};
+
+/*
+ * A device below the queue. transfer() moves count sectors between the
+ * device and one buffer and reports through blk_complete(cookie), from
+ * inside the call or later from an interrupt; poll() reaps completions
+ * for drivers that can run without interrupts. Memory-backed devices may
+ * also set map(), which returns their own storage for a sector so that
+ * callers can share it instead of copying.
+ */
+struct block_device {
+    const char* name;
+    uint32_t sectors;
+    uint32_t depth;                     /* Transfers the driver accepts at once */
+    uint32_t max_sectors;
+    int (*transfer)(uint32_t sector, uint32_t count, uint8_t* buffer, int write, void* cookie);
+    void (*poll)(void);
+    void* (*map)(uint32_t device, uint32_t sector);
+    
+    struct request* sorted[2];
+    struct request* fifo[2];
+    struct request** fifo_tail[2];
+    struct request* next[2];            /* Continues the current batch in sector order */
+    struct request* last_merge;
+    uint32_t queued;
+    uint32_t in_flight;
+    uint32_t plugged;
+    uint32_t batch;
+    uint32_t starved;
+    uint8_t dispatching;
+    
+    /* Statistics */
+    uint32_t bios;
+    uint32_t merges;
+    uint32_t dispatched;
+    uint32_t dispatched_sectors;
+};
+
+static struct block_device blk_devices[BLK_MAX_DEVICES];
+static uint32_t blk_device_count;
+static struct request blk_request_pool[BLK_MAX_REQUESTS];
+static struct request* blk_request_free;
+
+/* Tick counter of the kernel this is linked into */
+extern uint32_t timer_ticks;
+
+/* Kernel heap (kernel_heap.c) */
+extern void* malloc(uint32_t size);
+extern void free(void* ptr);
+
+/* Function prototypes */
+void blk_init(void);
+int blk_register(const char* name, uint32_t sectors, uint32_t depth, uint32_t max_sectors,
+                 int (*transfer)(uint32_t sector, uint32_t count, uint8_t* buffer, int write, void* cookie),
+                 void (*poll)(void));
+void blk_submit_bio(uint32_t device, struct bio* bio);
+void blk_complete(void* cookie, int status);
+void blk_plug(uint32_t device);
+void blk_unplug(uint32_t device);
+void blk_poll(uint32_t device);
+int blk_read(uint32_t device, uint32_t sector, uint32_t count, void* buffer);
+int blk_write(uint32_t device, uint32_t sector, uint32_t count, const void* buffer);
+uint32_t blk_sectors(uint32_t device);
+int blk_lookup(const char* name);
+int blk_request_device(void* cookie);
+void blk_set_map(uint32_t device, void* (*map)(uint32_t device, uint32_t sector));
+int blk_mappable(uint32_t device);
+void* blk_map(uint32_t device, uint32_t sector);
+void blk_get_statistics(uint32_t device, uint32_t* bios, uint32_t* merges,
+                        uint32_t* dispatched, uint32_t* dispatched_sectors);
+
+/* Save EFLAGS and disable interrupts; completions arrive from IRQ handlers */
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+/* Restore the interrupt flag saved by irq_save */
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+}
+
+/* Kernel runtime library (klib.c) */
+extern void* memcpy(void* dest, const void* src, size_t n);
+
+static void copy_bytes(void* dest, const void* src, uint32_t size) {
+    memcpy(dest, src, size);
+}
+
+void blk_init(void) {
+    blk_device_count = 0;
+    blk_request_free = NULL;
+    for (int i = BLK_MAX_REQUESTS - 1; i >= 0; i--) {
+        blk_request_pool[i].sort_next = blk_request_free;
+        blk_request_free = &blk_request_pool[i];
+    }
+}
+
+/* Attach a driver; returns the device number requests are submitted to */
+int blk_register(const char* name, uint32_t sectors, uint32_t depth, uint32_t max_sectors,
+                 int (*transfer)(uint32_t sector, uint32_t count, uint8_t* buffer, int write, void* cookie),
+                 void (*poll)(void)) {
+    if (blk_device_count == BLK_MAX_DEVICES || !transfer || !depth) {
+        return -1;
+    }
+    struct block_device* dev = &blk_devices[blk_device_count];
+    dev->name = name;
+    dev->sectors = sectors;
+    dev->depth = depth;
+    dev->max_sectors = max_sectors && max_sectors < BLK_MAX_SECTORS ? max_sectors : BLK_MAX_SECTORS;
+    dev->transfer = transfer;
+    dev->poll = poll;
+    dev->map = NULL;
+    for (int dir = 0; dir < 2; dir++) {
+        dev->sorted[dir] = NULL;
+        dev->fifo[dir] = NULL;
+        dev->fifo_tail[dir] = &dev->fifo[dir];
+        dev->next[dir] = NULL;
+    }
+    dev->last_merge = NULL;
+    dev->queued = 0;
+    dev->in_flight = 0;
+    dev->plugged = 0;
+    dev->batch = 0;
+    dev->starved = 0;
+    dev->dispatching = 0;
+    dev->bios = 0;
+    dev->merges = 0;
+    dev->dispatched = 0;
+    dev->dispatched_sectors = 0;
+    return blk_device_count++;
+}
+
+/* Queue bookkeeping; interrupts are off */
+static void rq_sort_insert(struct block_device* dev, struct request* rq) {
+    struct request** link = &dev->sorted[rq->write];
+    while (*link && (*link)->sector < rq->sector) {
+        link = &(*link)->sort_next;
+    }
+    rq->sort_next = *link;
+    if (rq->sort_next) {
+        rq->sort_next->sort_pprev = &rq->sort_next;
+    }
+    rq->sort_pprev = link;
+    *link = rq;
+}
+
+static void rq_remove(struct block_device* dev, struct request* rq) {
+    *rq->sort_pprev = rq->sort_next;
+    if (rq->sort_next) {
+        rq->sort_next->sort_pprev = rq->sort_pprev;
+    }
+    *rq->fifo_pprev = rq->fifo_next;
+    if (rq->fifo_next) {
+        rq->fifo_next->fifo_pprev = rq->fifo_pprev;
+    } else {
+        dev->fifo_tail[rq->write] = rq->fifo_pprev;
+    }
+    if (dev->next[rq->write] == rq) {
+        dev->next[rq->write] = rq->sort_next;
+    }
+    if (dev->last_merge == rq) {
+        dev->last_merge = NULL;
+    }
+    dev->queued--;
+}
+
+static void rq_free(struct request* rq) {
+    rq->sort_next = blk_request_free;
+    blk_request_free = rq;
+}
+
+/*
+ * Whether a run of count sectors at buffer can join rq at its back (or
+ * front). Buffers that do not continue the request's need a bounce buffer,
+ * taken now so that dispatch can never fail for want of one.
+ */
+static int rq_can_merge(struct block_device* dev, struct request* rq, const uint8_t* buffer,
+                        uint32_t count, int contiguous, int back) {
+    if (rq->count + count > dev->max_sectors) {
+        return 0;
+    }
+    int follows = contiguous && (back ? rq->tail->buffer + rq->tail->count * SECTOR_SIZE == buffer :
+                                        buffer + count * SECTOR_SIZE == rq->head->buffer);
+    if (!follows && !rq->bounce) {
+        rq->bounce = (uint8_t*)malloc(BLK_MAX_SECTORS * SECTOR_SIZE);
+        if (!rq->bounce) {
+            return 0;
+        }
+    }
+    rq->contiguous = rq->contiguous && follows;
+    return 1;
+}
+
+/* Absorb the request after rq in sector order, if rq now reaches it */
+static void rq_merge_next(struct block_device* dev, struct request* rq) {
+    struct request* next = rq->sort_next;
+    if (!next || rq->sector + rq->count != next->sector ||
+        !rq_can_merge(dev, rq, next->head->buffer, next->count, next->contiguous, 1)) {
+        return;
+    }
+    rq_remove(dev, next);
+    rq->count += next->count;
+    rq->tail->next = next->head;
+    rq->tail = next->tail;
+    if ((int32_t)(next->deadline - rq->deadline) < 0) {
+        rq->deadline = next->deadline;
+    }
+    if (next->bounce) {
+        free(next->bounce);
+    }
+    rq_free(next);
+    dev->merges++;
+}
+
+/* Put bio at the back or front of rq if it is adjacent there */
+static int rq_merge_bio(struct block_device* dev, struct request* rq, struct bio* bio) {
+    if (rq->write != bio->write) {
+        return 0;
+    }
+    if (rq->sector + rq->count == bio->sector && rq_can_merge(dev, rq, bio->buffer, bio->count, 1, 1)) {
+        rq->tail->next = bio;
+        rq->tail = bio;
+        rq->count += bio->count;
+        rq_merge_next(dev, rq);
+    } else if (bio->sector + bio->count == rq->sector && rq_can_merge(dev, rq, bio->buffer, bio->count, 1, 0)) {
+        bio->next = rq->head;
+        rq->head = bio;
+        rq->sector = bio->sector;
+        rq->count += bio->count;
+        
+        /* The bio may also close the gap to the request before */
+        if (rq->sort_pprev != &dev->sorted[rq->write]) {
+            struct request* prev = (struct request*)((uint8_t*)rq->sort_pprev - offsetof(struct request, sort_next));
+            rq_merge_next(dev, prev);
+            rq = prev->sort_next == rq ? rq : prev;
+        }
+    } else {
+        return 0;
+    }
+    dev->last_merge = rq;
+    dev->merges++;
+    return 1;
+}
+
+/* Try the request merged into last, then every queued neighbour */
+static int rq_try_merge(struct block_device* dev, struct bio* bio) {
+    if (dev->last_merge && rq_merge_bio(dev, dev->last_merge, bio)) {
+        return 1;
+    }
+    for (struct request* rq = dev->sorted[bio->write]; rq && rq->sector <= bio->sector + bio->count;
+         rq = rq->sort_next) {
+        if (rq_merge_bio(dev, rq, bio)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Deadline selection: continue the batch in sector order; at the end of a
+ * batch prefer reads, unless writes have been passed over too often, and
+ * start from an expired request if the chosen direction has one.
+ */
+static struct request* blk_choose(struct block_device* dev) {
+    for (int dir = 0; dir < 2; dir++) {
+        if (dev->batch && dev->next[dir]) {
+            dev->batch--;
+            return dev->next[dir];
+        }
+    }
+    
+    int dir;
+    if (dev->fifo[BLK_READ] && (!dev->fifo[BLK_WRITE] || dev->starved < BLK_WRITES_STARVED)) {
+        dir = BLK_READ;
+        if (dev->fifo[BLK_WRITE]) {
+            dev->starved++;
+        }
+    } else if (dev->fifo[BLK_WRITE]) {
+        dir = BLK_WRITE;
+        dev->starved = 0;
+    } else {
+        return NULL;
+    }
+    
+    struct request* rq = dev->fifo[dir];
+    if ((int32_t)(timer_ticks - rq->deadline) < 0) {
+        rq = dev->sorted[dir]; /* Nothing expired: sweep from the lowest sector */
+    }
+    dev->next[1 - dir] = NULL;
+    dev->batch = BLK_FIFO_BATCH - 1;
+    return rq;
+}
+
+/* Hand requests to the driver while it has room; interrupts are off */
+static void blk_dispatch(struct block_device* dev, int force) {
+    if (dev->dispatching || (dev->plugged && !force && dev->queued < BLK_PLUG_LIMIT)) {
+        return;
+    }
+    dev->dispatching = 1;
+    
+    struct request* rq;
+    while (dev->in_flight < dev->depth && (rq = blk_choose(dev)) != NULL) {
+        struct request* following = rq->sort_next;
+        rq_remove(dev, rq);
+        dev->next[rq->write] = following;
+        
+        uint8_t* buffer = rq->head->buffer;
+        if (!rq->contiguous) {
+            buffer = rq->bounce;
+            if (rq->write) {
+                uint8_t* out = buffer;
+                for (struct bio* bio = rq->head; bio; bio = bio->next) {
+                    copy_bytes(out, bio->buffer, bio->count * SECTOR_SIZE);
+                    out += bio->count * SECTOR_SIZE;
+                }
+            }
+        }
+        dev->in_flight++;
+        dev->dispatched++;
+        dev->dispatched_sectors += rq->count;
+        if (dev->transfer(rq->sector, rq->count, buffer, rq->write, rq) != 0) {
+            blk_complete(rq, -1);
+        }
+    }
+    
+    dev->dispatching = 0;
+}
+
+/* Called by the driver when a transfer ends: finish every bio in the request */
+void blk_complete(void* cookie, int status) {
+    struct request* rq = (struct request*)cookie;
+    struct block_device* dev = rq->device;
+    uint32_t flags = irq_save();
+    
+    if (rq->bounce && !rq->write && status == 0) {
+        const uint8_t* in = rq->bounce;
+        for (struct bio* bio = rq->head; bio; bio = bio->next) {
+            copy_bytes(bio->buffer, in, bio->count * SECTOR_SIZE);
+            in += bio->count * SECTOR_SIZE;
+        }
+    }
+    
+    /* Release the request first: a callback may submit the next bio */
+    struct bio* bio = rq->head;
+    if (rq->bounce) {
+        free(rq->bounce);
+    }
+    rq_free(rq);
+    dev->in_flight--;
+    
+    while (bio) {
+        struct bio* next = bio->next;
+        bio->status = status;
+        bio->next = NULL;
+        if (bio->done) {
+            bio->done(bio);
+        }
+        bio = next;
+    }
+    
+    blk_dispatch(dev, 0);
+    irq_restore(flags);
+}
+
+/*
+ * Queue a bio; it completes through bio->done with bio->status 0 or -1.
+ * Adjacent bios in the same direction merge into one request while they
+ * wait, which they do for as long as the queue is plugged.
+ */
+void blk_submit_bio(uint32_t device, struct bio* bio) {
+    if (device >= blk_device_count || !bio->count || bio->sector + bio->count < bio->sector ||
+        bio->sector + bio->count > blk_devices[device].sectors || bio->count > blk_devices[device].max_sectors) {
+        bio->status = -1;
+        if (bio->done) {
+            bio->done(bio);
+        }
+        return;
+    }
+    struct block_device* dev = &blk_devices[device];
+    bio->next = NULL;
+    bio->write = bio->write ? BLK_WRITE : BLK_READ;
+    
+    uint32_t flags = irq_save();
+    dev->bios++;
+    if (rq_try_merge(dev, bio)) {
+        blk_dispatch(dev, 0);
+        irq_restore(flags);
+        return;
+    }
+    
+    /* Out of requests: push every queue until a completion returns one */
+    while (!blk_request_free) {
+        for (uint32_t i = 0; i < blk_device_count; i++) {
+            blk_dispatch(&blk_devices[i], 1);
+        }
+        irq_restore(flags);
+        for (uint32_t i = 0; i < blk_device_count && !blk_request_free; i++) {
+            if (blk_devices[i].poll) {
+                blk_devices[i].poll();
+            }
+        }
+        flags = irq_save();
+    }
+    
+    struct request* rq = blk_request_free;
+    blk_request_free = rq->sort_next;
+    rq->device = dev;
+    rq->head = bio;
+    rq->tail = bio;
+    rq->sector = bio->sector;
+    rq->count = bio->count;
+    rq->write = bio->write;
+    rq->contiguous = 1;
+    rq->bounce = NULL;
+    rq->deadline = timer_ticks + (bio->write ? BLK_WRITE_EXPIRE : BLK_READ_EXPIRE);
+    
+    rq_sort_insert(dev, rq);
+    rq->fifo_next = NULL;
+    rq->fifo_pprev = dev->fifo_tail[rq->write];
+    *dev->fifo_tail[rq->write] = rq;
+    dev->fifo_tail[rq->write] = &rq->fifo_next;
+    dev->queued++;
+    dev->last_merge = rq;
+    
+    blk_dispatch(dev, 0);
+    irq_restore(flags);
+}
+
+/* Hold dispatch back so a burst of bios can merge; plugs nest */
+void blk_plug(uint32_t device) {
+    if (device < blk_device_count) {
+        uint32_t flags = irq_save();
+        blk_devices[device].plugged++;
+        irq_restore(flags);
+    }
+}
+
+void blk_unplug(uint32_t device) {
+    if (device < blk_device_count) {
+        uint32_t flags = irq_save();
+        struct block_device* dev = &blk_devices[device];
+        if (dev->plugged && --dev->plugged == 0) {
+            blk_dispatch(dev, 0);
+        }
+        irq_restore(flags);
+    }
+}
+
+/* Drive the queue from a waiter: flush what is queued and reap the driver */
+void blk_poll(uint32_t device) {
+    if (device >= blk_device_count) {
+        return;
+    }
+    struct block_device* dev = &blk_devices[device];
+    uint32_t flags = irq_save();
+    blk_dispatch(dev, 1);
+    irq_restore(flags);
+    if (dev->poll) {
+        dev->poll();
+    }
+}
+
+/* Synchronous I/O through the queue, for callers with nothing to overlap */
+static void blk_sync_done(struct bio* bio) {
+    *(volatile int*)bio->private = 1;
+}
+
+static int blk_sync(uint32_t device, uint32_t sector, uint32_t count, uint8_t* buffer, int write) {
+    if (device >= blk_device_count) {
+        return -1;
+    }
+    uint32_t max = blk_devices[device].max_sectors;
+    int status = 0;
+    
+    while (count && status == 0) {
+        volatile int done = 0;
+        struct bio bio;
+        bio.sector = sector;
+        bio.count = count < max ? count : max;
+        bio.buffer = buffer;
+        bio.write = write;
+        bio.done = blk_sync_done;
+        bio.private = (void*)&done;
+        
+        blk_submit_bio(device, &bio);
+        while (!done) {
+            blk_poll(device);
+        }
+        status = bio.status;
+        sector += bio.count;
+        buffer += bio.count * SECTOR_SIZE;
+        count -= bio.count;
+    }
+    return status;
+}
+
+int blk_read(uint32_t device, uint32_t sector, uint32_t count, void* buffer) {
+    return blk_sync(device, sector, count, (uint8_t*)buffer, 0);
+}
+
+int blk_write(uint32_t device, uint32_t sector, uint32_t count, const void* buffer) {
+    return blk_sync(device, sector, count, (uint8_t*)buffer, 1);
+}
+
+uint32_t blk_sectors(uint32_t device) {
+    return device < blk_device_count ? blk_devices[device].sectors : 0;
+}
+
+/* The device registered as name, or -1 */
+int blk_lookup(const char* name) {
+    for (uint32_t device = 0; device < blk_device_count; device++) {
+        const char* registered = blk_devices[device].name;
+        uint32_t i = 0;
+        while (registered[i] && registered[i] == name[i]) {
+            i++;
+        }
+        if (!registered[i] && !name[i]) {
+            return (int)device;
+        }
+    }
+    return -1;
+}
+
+/* The device a transfer() cookie belongs to, for drivers with several */
+int blk_request_device(void* cookie) {
+    return (int)(((struct request*)cookie)->device - blk_devices);
+}
+
+void blk_set_map(uint32_t device, void* (*map)(uint32_t device, uint32_t sector)) {
+    if (device < blk_device_count) {
+        blk_devices[device].map = map;
+    }
+}
+
+int blk_mappable(uint32_t device) {
+    return device < blk_device_count && blk_devices[device].map;
+}
+
+/*
+ * The device's storage for sector, valid up to the end of its page and for
+ * as long as the device exists; writes through it reach the device at
+ * once. NULL when the device cannot be mapped, or not there right now.
+ */
+void* blk_map(uint32_t device, uint32_t sector) {
+    if (!blk_mappable(device) || sector >= blk_devices[device].sectors) {
+        return NULL;
+    }
+    return blk_devices[device].map(device, sector);
+}
+
+void blk_get_statistics(uint32_t device, uint32_t* bios, uint32_t* merges,
+                        uint32_t* dispatched, uint32_t* dispatched_sectors) {
+    if (device >= blk_device_count) {
+        return;
+    }
+    struct block_device* dev = &blk_devices[device];
+    if (bios) *bios = dev->bios;
+    if (merges) *merges = dev->merges;
+    if (dispatched) *dispatched = dev->dispatched;
+    if (dispatched_sectors) *dispatched_sectors = dev->dispatched_sectors;
+}
@@ -6,6 +6,13 @@
 
 section .text
 global _start
+global boot_magic
+global boot_info
+global boot_loader_tsc
+global kernel_entry_tsc
+
+; bootloader.asm jumps to the first byte; GRUB enters at _start
+    jmp _start
 
 ; Multiboot2 header for GRUB bootloader
 align 8
@@ -22,6 +29,15 @@ mb2_header_start:
 mb2_header_end:
 
 _start:
+    ; Keep what the loader passed, and when we got here, before BSS is cleared
+    mov [boot_magic], eax
+    mov [boot_info], ebx
+    mov [boot_loader_tsc], esi
+    mov [boot_loader_tsc + 4], edi
+    rdtsc
+    mov [kernel_entry_tsc], eax
+    mov [kernel_entry_tsc + 4], edx
+    
     ; Set up stack
     mov esp, stack_top
     
@@ -31,6 +47,10 @@ _start:
     xor eax, eax
     rep stosb
     
+    ; Pick the stack protector's guard before any protected function runs
+    extern stack_protector_init
+    call stack_protector_init
+    
     ; Call kernel main function
     extern kernel_main
     call kernel_main
@@ -41,6 +61,15 @@ _start:
     hlt
     jmp .hang
 
+; Boot timing for initcall.c: 0x544F5342 in boot_magic means ESI:EDI held the loader's TSC.
+; boot_info is EBX: the end of the loader's memory map, or the multiboot2 information
+section .data
+align 8
+boot_loader_tsc: dq 0
+kernel_entry_tsc: dq 0
+boot_magic: dd 0
+boot_info: dd 0
+
 ; Stack section
 section .bss
 align 4
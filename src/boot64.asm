@@ -0,0 +1,204 @@
+;
+; Tiny Operating System - Long Mode Entry Point
+; GRUB enters in 32-bit protected mode; this builds the 4-level page
+; tables, turns on long mode and calls kernel_main in the higher half
+;
+
+KERNEL_VMA equ 0xFFFFFFFF80000000   ; Kernel image: -mcmodel=kernel's top 2 GiB (must match linker.ld)
+DIRECT_MAP_PML4 equ 256             ; 0xFFFF800000000000: all of the first 4 GiB (must match kernel64.c)
+KERNEL_PML4 equ 511
+KERNEL_PDPT equ 510
+
+PAGE_PRESENT equ 0x001
+PAGE_WRITE equ 0x002
+PAGE_HUGE equ 0x080                 ; A 2 MB page in a page directory
+PAGE_GLOBAL equ 0x100
+
+CR0_MP equ 0x00000002
+CR0_EM equ 0x00000004
+CR0_WP equ 0x00010000
+CR0_PG equ 0x80000000
+CR4_PAE equ 0x00000020
+CR4_PGE equ 0x00000080
+CR4_OSFXSR equ 0x00000200           ; SSE2 is architectural in long mode: let the compiler use it
+CR4_OSXMMEXCPT equ 0x00000400
+
+MSR_EFER equ 0xC0000080
+EFER_SCE equ 0x00000001             ; SYSCALL/SYSRET
+EFER_LME equ 0x00000100
+
+; Multiboot2 header for GRUB bootloader
+section .multiboot progbits alloc noexec nowrite
+align 8
+mb2_header_start:
+    dd 0xe85250d6               ; Magic number
+    dd 0                        ; Architecture 0 (protected mode i386)
+    dd mb2_header_end - mb2_header_start  ; Header length
+    dd 0x100000000 - (0xe85250d6 + 0 + (mb2_header_end - mb2_header_start))  ; Checksum
+
+    ; End tag
+    dw 0                        ; Type
+    dw 0                        ; Flags
+    dd 8                        ; Size
+mb2_header_end:
+
+; Identity-mapped, at the physical addresses GRUB loads it to
+section .boot progbits alloc exec nowrite
+[bits 32]
+global _start
+_start:
+    cli
+    mov esp, boot_stack_top
+
+    ; CPUID 0x80000001 EDX bit 29: long mode
+    mov eax, 0x80000000
+    cpuid
+    cmp eax, 0x80000001
+    jb .no_long_mode
+    mov eax, 0x80000001
+    cpuid
+    test edx, 1 << 29
+    jz .no_long_mode
+
+    ; Zero the tables; GRUB need not have cleared them
+    mov edi, boot_pml4
+    mov ecx, (boot_tables_end - boot_pml4) / 4
+    xor eax, eax
+    rep stosd
+
+    ; 2048 2 MB pages: the first 4 GiB, in four page directories
+    mov edi, boot_pd
+    mov eax, PAGE_PRESENT | PAGE_WRITE | PAGE_HUGE | PAGE_GLOBAL
+    xor edx, edx
+    mov ecx, 2048
+.map_pd:
+    mov [edi], eax
+    mov [edi + 4], edx
+    add eax, 0x200000
+    adc edx, 0
+    add edi, 8
+    loop .map_pd
+
+    ; One PDPT over them, reached from the identity slot (until kernel64.c
+    ; takes it for user space) and from the direct map
+    mov edi, boot_pdpt
+    mov eax, boot_pd + (PAGE_PRESENT | PAGE_WRITE)
+    mov ecx, 4
+.map_pdpt:
+    mov [edi], eax
+    add eax, 4096
+    add edi, 8
+    loop .map_pdpt
+    mov eax, boot_pdpt + (PAGE_PRESENT | PAGE_WRITE)
+    mov [boot_pml4], eax
+    mov [boot_pml4 + DIRECT_MAP_PML4 * 8], eax
+
+    ; The kernel image: its last PDPT's slot 510 is the first GiB again
+    mov eax, boot_pd + (PAGE_PRESENT | PAGE_WRITE)
+    mov [boot_pdpt_kernel + KERNEL_PDPT * 8], eax
+    mov eax, boot_pdpt_kernel + (PAGE_PRESENT | PAGE_WRITE)
+    mov [boot_pml4 + KERNEL_PML4 * 8], eax
+
+    mov eax, boot_pml4
+    mov cr3, eax
+    mov eax, cr4
+    or eax, CR4_PAE | CR4_PGE | CR4_OSFXSR | CR4_OSXMMEXCPT
+    mov cr4, eax
+    mov ecx, MSR_EFER
+    rdmsr
+    or eax, EFER_LME | EFER_SCE
+    wrmsr
+    mov eax, cr0
+    and eax, ~CR0_EM
+    or eax, CR0_PG | CR0_WP | CR0_MP
+    mov cr0, eax
+
+    lgdt [gdt64_pointer]
+    jmp 0x08:long_mode_entry
+
+.no_long_mode:
+    mov esi, no_long_mode_msg
+    mov edi, 0xB8000
+    mov ah, 0x4F                ; White on red
+.print:
+    lodsb
+    test al, al
+    jz .hang
+    stosw
+    jmp .print
+.hang:
+    hlt
+    jmp .hang
+
+[bits 64]
+long_mode_entry:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    xor ax, ax
+    mov fs, ax
+    mov gs, ax
+    mov rax, higher_half
+    jmp rax
+
+; Null, kernel code and data, then user data and code in the order SYSRET
+; derives them from STAR (must match kernel64.c)
+align 8
+gdt64:
+    dq 0
+    dq 0x00AF9A000000FFFF       ; 0x08: kernel code, 64-bit
+    dq 0x00CF92000000FFFF       ; 0x10: kernel data
+    dq 0x00CFF2000000FFFF       ; 0x18: user data
+    dq 0x00AFFA000000FFFF       ; 0x20: user code, 64-bit
+gdt64_end:
+
+gdt64_pointer:
+    dw gdt64_end - gdt64 - 1
+    dd gdt64
+
+no_long_mode_msg: db 'Tiny OS: this CPU has no long mode', 0
+
+section .boot_bss nobits alloc noexec write
+alignb 4096
+boot_pml4:
+    resb 4096
+boot_pdpt:
+    resb 4096
+boot_pdpt_kernel:
+    resb 4096
+boot_pd:
+    resb 4096 * 4
+boot_tables_end:
+    resb 4096
+boot_stack_top:
+
+section .text
+higher_half:
+    ; The GDT again through the kernel image's mapping, so it stays
+    ; reachable once the identity slot is gone
+    lgdt [rel gdt64_pointer_high]
+    mov rsp, stack_top
+    extern kernel_main
+    call kernel_main
+
+    ; Infinite loop if kernel returns
+    cli
+.hang:
+    hlt
+    jmp .hang
+
+section .data
+gdt64_pointer_high:
+    dw gdt64_end - gdt64 - 1
+    dq gdt64 + KERNEL_VMA
+
+; Stack section
+section .bss
+alignb 16
+stack_bottom:
+    resb 16384  ; 16KB stack
+stack_top:
+
+; Mark the object as not needing an executable stack
+section .note.GNU-stack noalloc noexec nowrite progbits
@@ -7,6 +7,16 @@
 [org 0x7C00]    ; BIOS loads bootloader at 0x7C00
 [bits 16]       ; Start in 16-bit real mode
 
+KERNEL_LBA equ 1        ; The kernel follows this sector on the disk
+%ifndef KERNEL_SECTORS
+%define KERNEL_SECTORS 256  ; 128 KB; the Makefile passes its own
+%endif
+%if KERNEL_SECTORS > 1024
+%error "the kernel must end below the protected-mode stack at 0x90000"
+%endif
+LBA_CHUNK equ 64        ; Sectors per extended read: 32 KB, so no read crosses a 64 KB boundary
+E820_MAP equ 0x9000     ; BIOS memory map, 24-byte entries up to the kernel, past the AP trampoline (must match kernel_usermode.c)
+
 section .text
 global start
 
@@ -47,37 +57,38 @@ main:
     mov ss, ax
     mov sp, 0x7C00      ; Set stack below bootloader
     
-    ; Clear screen
-    call clear_screen
+    ; Time the boot from here; the kernel reports how long reaching it took
+    rdtsc
+    mov [boot_tsc], eax
+    mov [boot_tsc + 4], edx
     
     ; Print welcome message
     mov si, boot_msg
     call print_string
     
+    ; Collect the BIOS memory map while ES is still 0: INT 15h E820 writes an
+    ; entry at ES:DI and leaves EBX 0 after the last, or sets carry past it
+    mov di, E820_MAP
+    xor ebx, ebx
+.e820_next:
+    mov eax, 0xE820
+    mov ecx, 24
+    mov edx, 0x534D4150 ; 'SMAP'
+    int 0x15
+    jc .e820_done       ; No E820 at all leaves DI at E820_MAP: an empty map
+    add di, 24
+    test ebx, ebx
+    jnz .e820_next
+.e820_done:
+    
     ; Read kernel from disk
     call load_kernel
     
     ; Check if kernel loaded successfully
-    cmp ax, 0
-    jne kernel_load_error
+    jc kernel_load_error
     
-    ; Switch to protected mode
+    ; Switch to protected mode; it jumps on to the kernel
     call enable_protected_mode
-    
-    ; Jump to kernel
-    jmp 0x08:0x10000  ; Jump to kernel at physical address 0x10000
-
-; Function: clear_screen
-; Clears the VGA text mode screen
-clear_screen:
-    pusha
-    mov ax, 0x0600      ; Scroll entire screen
-    mov bx, 0x0700      ; Attribute (light gray on black)
-    mov cx, 0x0000      ; Upper left corner
-    mov dx, 0x184F      ; Lower right corner
-    int 0x10            ; BIOS video interrupt
-    popa
-    ret
 
 ; Function: print_string
 ; Input: SI = string address
@@ -95,50 +106,108 @@ print_string:
     ret
 
 ; Function: load_kernel
-; Loads kernel from disk to memory at 0x10000
+; Loads KERNEL_SECTORS sectors from KERNEL_LBA to 0x10000: with INT 13h
+; extended reads of up to LBA_CHUNK sectors each if the BIOS has them,
+; otherwise a track at a time with CHS reads using the BPB's geometry
 load_kernel:
     pusha
-    mov si, load_msg
-    call print_string
+    push 0x1000         ; Destination segment (0x10000)
+    pop es
+    mov bp, KERNEL_LBA  ; Next sector to read
+    mov di, KERNEL_SECTORS ; Sectors left
     
-    ; Read kernel sectors (assume kernel starts at sector 2, size 20 sectors)
-    mov ax, 0x1000      ; Destination segment (0x10000)
-    mov es, ax
-    xor bx, bx          ; Destination offset (0)
-    
-    mov ah, 0x02        ; BIOS read function
-    mov al, 20          ; Number of sectors to read
-    mov ch, 0           ; Cylinder 0
-    mov cl, 2           ; Sector 2 (sector 1 is bootloader)
-    mov dh, 0           ; Head 0
-    mov dl, [DriveNumber] ; Drive number
+    ; Extensions present: AH=41h returns BX = 0xAA55 and CL bit 0 (packet calls)
+    mov ah, 0x41
+    mov bx, 0x55AA
+    mov dl, [DriveNumber]
     int 0x13
+    jc .chs_next
+    cmp bx, 0xAA55
+    jne .chs_next
+    test cl, 1
+    jz .chs_next
     
-    jc .read_error     ; Check for read error
+.lba_next:
+    mov cx, LBA_CHUNK
+    cmp di, cx
+    jae .lba_read
+    mov cx, di
+.lba_read:
+    mov [dap_count], cx
+    mov [dap_lba], bp
+    mov [dap_segment], es
+    mov si, dap
+    mov ah, 0x42
+    mov dl, [DriveNumber]
+    int 0x13
+    jc .read_error
+    call advance
+    jnz .lba_next
+    jmp .loaded
     
-    ; Verify read success
-    cmp al, 20          ; Check if all sectors read
-    jne .read_error
+.chs_next:
+    mov ax, bp
+    cwd                 ; DX = 0: sector numbers stay below 0x8000
+    div word [SectorsPerTrack] ; AX = track, DX = sector - 1
+    mov cx, [SectorsPerTrack]
+    sub cx, dx          ; Sectors to the end of the track
+    cmp cx, di
+    jbe .chs_dma
+    mov cx, di
+.chs_dma:
+    mov si, es
+    or si, 0xF000
+    neg si
+    shr si, 5           ; Sectors to the 64 KB boundary floppy DMA cannot cross
+    cmp cx, si
+    jbe .chs_read
+    mov cx, si
+.chs_read:
+    push cx
+    mov bx, dx
+    cwd
+    div word [NumberOfHeads] ; AX = cylinder, DX = head
+    mov ch, al
+    mov cl, bl
+    inc cl              ; Sectors count from 1
+    mov dh, dl
+    pop ax
+    push ax
+    mov ah, 0x02        ; BIOS read function, AL sectors
+    mov dl, [DriveNumber]
+    xor bx, bx
+    int 0x13
+    pop cx
+    jc .read_error
+    call advance
+    jnz .chs_next
     
-    mov si, success_msg
-    call print_string
-    xor ax, ax          ; Success
+.loaded:
+    clc                 ; Success; POPA would undo a code in AX
     jmp .done
     
 .read_error:
-    mov si, error_msg
-    call print_string
-    mov ax, 1           ; Error code
+    stc                 ; Error
 .done:
     popa
     ret
 
+; Function: advance
+; Input: CX = sectors just read. Moves BP, ES and DI past them; ZF set when DI reaches 0
+advance:
+    add bp, cx
+    mov ax, cx
+    shl ax, 5           ; Sectors to paragraphs
+    mov dx, es
+    add dx, ax
+    mov es, dx
+    sub di, cx
+    ret
+
 ; Function: enable_protected_mode
 ; Switches CPU from real mode to protected mode
 enable_protected_mode:
     pusha
-    mov si, pmode_msg
-    call print_string
     
     ; Disable interrupts
     cli
@@ -164,54 +233,17 @@ enable_a20:
     ; Try BIOS method first
     mov ax, 0x2401
     int 0x15
+    jnc .done
     
-    ; If BIOS method fails, try keyboard controller method
-    jc .keyboard_method
-    jmp .done
-    
-.keyboard_method:
-    call wait_keyboard_input
-    mov al, 0xAD        ; Disable keyboard
-    out 0x64, al
-    
-    call wait_keyboard_input
-    mov al, 0xD0        ; Read from input port
-    out 0x64, al
-    
-    call wait_keyboard_output
-    in al, 0x60        ; Read current value
-    push ax            ; Save it
-    
-    call wait_keyboard_input
-    mov al, 0xD1        ; Write to output port
-    out 0x64, al
-    
-    call wait_keyboard_input
-    pop ax             ; Get saved value
-    or al, 0x02        ; Set A20 bit
-    out 0x60, al
-    
-    call wait_keyboard_input
-    mov al, 0xAE        ; Enable keyboard
-    out 0x64, al
-    
-    call wait_keyboard_input
+    ; Else the fast A20 gate in system control port A
+    in al, 0x92
+    or al, 0x02
+    and al, 0xFE        ; Bit 0 would reset the machine
+    out 0x92, al
 .done:
     popa
     ret
 
-wait_keyboard_input:
-    in al, 0x64
-    test al, 0x02
-    jnz wait_keyboard_input
-    ret
-
-wait_keyboard_output:
-    in al, 0x64
-    test al, 0x01
-    jz wait_keyboard_output
-    ret
-
 ; Protected mode entry point
 [bits 32]
 protected_mode_entry:
@@ -226,6 +258,13 @@ protected_mode_entry:
     ; Set up stack
     mov esp, 0x90000    ; Stack at top of loaded kernel
     
+    ; Hand the kernel the TSC at boot start: EAX = "TOSB", ESI:EDI = TSC,
+    ; and EBX = the end of the memory map, which DI still points at
+    movzx ebx, di
+    mov eax, 0x544F5342
+    mov esi, [boot_tsc]
+    mov edi, [boot_tsc + 4]
+    
     ; Jump to kernel entry point
     jmp 0x10000  ; Jump to kernel at physical address 0x10000
 
@@ -263,13 +302,20 @@ kernel_load_error:
     call print_string
     jmp $
 
+boot_tsc: dq 0
+
+; Disk address packet for INT 13h AH=42h
+dap:
+    db 0x10             ; Packet size
+    db 0
+dap_count:   dw 0       ; Sectors to read
+dap_offset:  dw 0       ; Destination offset
+dap_segment: dw 0       ; Destination segment
+dap_lba:     dq 0       ; First sector
+
 ; Messages
-boot_msg: db 'Tiny OS Bootloader', 13, 10, 0
-load_msg: db 'Loading kernel...', 13, 10, 0
-success_msg: db 'OK', 13, 10, 0
-error_msg: db 'Error!', 13, 10, 0
-pmode_msg: db 'Protected mode...', 13, 10, 0
-kernel_error_msg: db 'Kernel failed!', 13, 10, 0
+boot_msg: db 'Tiny OS', 13, 10, 0
+kernel_error_msg: db 'Kernel failed!', 0
 
 ; Bootloader signature (required by BIOS)
 times 510-($-$$) db 0   ; Pad to 510 bytes
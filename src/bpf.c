@@ -0,0 +1,548 @@
+/*
+ * Tiny Operating System - Packet Filters
+ * Classic BPF, as tcpdump compiles it: an accumulator A, an index X, 16
+ * scratch words and forward jumps only, so every program ends. A program
+ * is checked once when it is attached, then run on each packet by the
+ * interpreter or, normally, as x86 code the JIT made from it then. The
+ * result is how many bytes of the packet to keep; 0 drops it.
+ *
+ * Packet loads are big-endian, as the wire is, and one past the end of
+ * the packet ends the program with 0. The negative offsets Linux uses for
+ * ancillary data are not supported; a program that uses them is refused.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BPF_MAXINSNS 256
+#define BPF_MEMWORDS 16
+#define BPF_MAX_PROGS 8                 /* Programs attached at once */
+#define BPF_IMAGE_SIZE 4096             /* Native code per program; a larger one is interpreted */
+
+/* Instruction classes */
+#define BPF_CLASS(code) ((code) & 0x07)
+#define BPF_LD 0x00
+#define BPF_LDX 0x01
+#define BPF_ST 0x02
+#define BPF_STX 0x03
+#define BPF_ALU 0x04
+#define BPF_JMP 0x05
+#define BPF_RET 0x06
+#define BPF_MISC 0x07
+
+/* Load width and addressing mode */
+#define BPF_SIZE(code) ((code) & 0x18)
+#define BPF_W 0x00
+#define BPF_H 0x08
+#define BPF_B 0x10
+#define BPF_MODE(code) ((code) & 0xE0)
+#define BPF_IMM 0x00
+#define BPF_ABS 0x20
+#define BPF_IND 0x40
+#define BPF_MEM 0x60
+#define BPF_LEN 0x80
+#define BPF_MSH 0xA0
+
+/* ALU and jump operations, and their operand */
+#define BPF_OP(code) ((code) & 0xF0)
+#define BPF_ADD 0x00
+#define BPF_SUB 0x10
+#define BPF_MUL 0x20
+#define BPF_DIV 0x30
+#define BPF_OR 0x40
+#define BPF_AND 0x50
+#define BPF_LSH 0x60
+#define BPF_RSH 0x70
+#define BPF_NEG 0x80
+#define BPF_MOD 0x90
+#define BPF_XOR 0xA0
+#define BPF_JA 0x00
+#define BPF_JEQ 0x10
+#define BPF_JGT 0x20
+#define BPF_JGE 0x30
+#define BPF_JSET 0x40
+#define BPF_SRC(code) ((code) & 0x08)
+#define BPF_K 0x00
+#define BPF_X 0x08
+
+/* What RET returns, and the register moves */
+#define BPF_RVAL(code) ((code) & 0x18)
+#define BPF_A 0x10
+#define BPF_MISCOP(code) ((code) & 0xF8)
+#define BPF_TAX 0x00
+#define BPF_TXA 0x80
+
+/* One instruction (must match the users' copies) */
+struct sock_filter {
+    uint16_t code;
+    uint8_t jt;                         /* Conditional jumps skip this many instructions when true */
+    uint8_t jf;                         /* and this many when false */
+    uint32_t k;
+};
+
+struct bpf_prog {
+    uint32_t used;
+    uint32_t len;
+    uint32_t (*jited)(const uint8_t* data, uint32_t len);  /* NULL: interpreted */
+    struct sock_filter insns[BPF_MAXINSNS];
+    uint8_t image[BPF_IMAGE_SIZE] __attribute__((aligned(16)));
+};
+
+static struct bpf_prog bpf_progs[BPF_MAX_PROGS];
+static int bpf_jit_enabled = 1;
+
+/* Function prototypes */
+int bpf_check(const struct sock_filter* insns, uint32_t len);
+struct bpf_prog* bpf_prog_create(const struct sock_filter* insns, uint32_t len);
+void bpf_prog_destroy(struct bpf_prog* prog);
+uint32_t bpf_prog_run(const struct bpf_prog* prog, const uint8_t* data, uint32_t len);
+int bpf_prog_jited(const struct bpf_prog* prog);
+void bpf_jit_enable(int enabled);
+
+/*
+ * Whether a program may run: every opcode known, scratch indices and
+ * constant shifts and divisors in range, every jump forward to an
+ * instruction, and a return last, so every path ends in one. 0 if so.
+ */
+int bpf_check(const struct sock_filter* insns, uint32_t len) {
+    if (!len || len > BPF_MAXINSNS || BPF_CLASS(insns[len - 1].code) != BPF_RET) {
+        return -1;
+    }
+    for (uint32_t pc = 0; pc < len; pc++) {
+        const struct sock_filter* insn = &insns[pc];
+        uint32_t k = insn->k;
+        switch (insn->code) {
+            case BPF_LD | BPF_W | BPF_ABS:
+            case BPF_LD | BPF_H | BPF_ABS:
+            case BPF_LD | BPF_B | BPF_ABS:
+            case BPF_LDX | BPF_B | BPF_MSH:
+                if (k > 0xFFFFFFFFu - 4) return -1;
+                break;
+            case BPF_LD | BPF_W | BPF_IND:
+            case BPF_LD | BPF_H | BPF_IND:
+            case BPF_LD | BPF_B | BPF_IND:
+            case BPF_LD | BPF_W | BPF_LEN:
+            case BPF_LD | BPF_IMM:
+            case BPF_LDX | BPF_W | BPF_IMM:
+            case BPF_LDX | BPF_W | BPF_LEN:
+            case BPF_ALU | BPF_NEG:
+            case BPF_RET | BPF_K:
+            case BPF_RET | BPF_A:
+            case BPF_RET | BPF_X:
+            case BPF_MISC | BPF_TAX:
+            case BPF_MISC | BPF_TXA:
+                break;
+            case BPF_LD | BPF_MEM:
+            case BPF_LDX | BPF_W | BPF_MEM:
+            case BPF_ST:
+            case BPF_STX:
+                if (k >= BPF_MEMWORDS) return -1;
+                break;
+            case BPF_ALU | BPF_ADD | BPF_K: case BPF_ALU | BPF_ADD | BPF_X:
+            case BPF_ALU | BPF_SUB | BPF_K: case BPF_ALU | BPF_SUB | BPF_X:
+            case BPF_ALU | BPF_MUL | BPF_K: case BPF_ALU | BPF_MUL | BPF_X:
+            case BPF_ALU | BPF_OR | BPF_K: case BPF_ALU | BPF_OR | BPF_X:
+            case BPF_ALU | BPF_AND | BPF_K: case BPF_ALU | BPF_AND | BPF_X:
+            case BPF_ALU | BPF_XOR | BPF_K: case BPF_ALU | BPF_XOR | BPF_X:
+            case BPF_ALU | BPF_DIV | BPF_X: case BPF_ALU | BPF_MOD | BPF_X:
+            case BPF_ALU | BPF_LSH | BPF_X: case BPF_ALU | BPF_RSH | BPF_X:
+                break;
+            case BPF_ALU | BPF_DIV | BPF_K:
+            case BPF_ALU | BPF_MOD | BPF_K:
+                if (k == 0) return -1;
+                break;
+            case BPF_ALU | BPF_LSH | BPF_K:
+            case BPF_ALU | BPF_RSH | BPF_K:
+                if (k >= 32) return -1;
+                break;
+            case BPF_JMP | BPF_JA:
+                if (k >= len - pc - 1) return -1;
+                break;
+            case BPF_JMP | BPF_JEQ | BPF_K: case BPF_JMP | BPF_JEQ | BPF_X:
+            case BPF_JMP | BPF_JGT | BPF_K: case BPF_JMP | BPF_JGT | BPF_X:
+            case BPF_JMP | BPF_JGE | BPF_K: case BPF_JMP | BPF_JGE | BPF_X:
+            case BPF_JMP | BPF_JSET | BPF_K: case BPF_JMP | BPF_JSET | BPF_X:
+                if (insn->jt >= len - pc - 1 || insn->jf >= len - pc - 1) return -1;
+                break;
+            default:
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/* size big-endian bytes at offset, if they are all inside the packet */
+static int bpf_load(const uint8_t* data, uint32_t len, uint32_t offset, uint32_t size, uint32_t* value) {
+    if (len < size || offset > len - size) {
+        return 0;
+    }
+    const uint8_t* p = data + offset;
+    *value = size == 4 ? ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3] :
+             size == 2 ? ((uint32_t)p[0] << 8) | p[1] : p[0];
+    return 1;
+}
+
+/* Run a checked program one instruction at a time; shifts by X take its low five bits, as x86 does */
+static uint32_t bpf_interpret(const struct bpf_prog* prog, const uint8_t* data, uint32_t len) {
+    uint32_t a = 0;
+    uint32_t x = 0;
+    uint32_t mem[BPF_MEMWORDS] = {0};
+    static const uint8_t sizes[4] = {4, 2, 1, 0};
+
+    for (uint32_t pc = 0;; pc++) {
+        const struct sock_filter* insn = &prog->insns[pc];
+        uint32_t k = insn->k;
+        uint32_t operand = BPF_SRC(insn->code) == BPF_X ? x : k;
+        switch (insn->code) {
+            case BPF_LD | BPF_W | BPF_ABS:
+            case BPF_LD | BPF_H | BPF_ABS:
+            case BPF_LD | BPF_B | BPF_ABS:
+                if (!bpf_load(data, len, k, sizes[BPF_SIZE(insn->code) >> 3], &a)) return 0;
+                break;
+            case BPF_LD | BPF_W | BPF_IND:
+            case BPF_LD | BPF_H | BPF_IND:
+            case BPF_LD | BPF_B | BPF_IND:
+                if (x + k < x || !bpf_load(data, len, x + k, sizes[BPF_SIZE(insn->code) >> 3], &a)) return 0;
+                break;
+            case BPF_LDX | BPF_B | BPF_MSH:
+                if (!bpf_load(data, len, k, 1, &x)) return 0;
+                x = (x & 0xF) << 2;
+                break;
+            case BPF_LD | BPF_W | BPF_LEN: a = len; break;
+            case BPF_LDX | BPF_W | BPF_LEN: x = len; break;
+            case BPF_LD | BPF_IMM: a = k; break;
+            case BPF_LDX | BPF_W | BPF_IMM: x = k; break;
+            case BPF_LD | BPF_MEM: a = mem[k]; break;
+            case BPF_LDX | BPF_W | BPF_MEM: x = mem[k]; break;
+            case BPF_ST: mem[k] = a; break;
+            case BPF_STX: mem[k] = x; break;
+            case BPF_ALU | BPF_ADD | BPF_K: case BPF_ALU | BPF_ADD | BPF_X: a += operand; break;
+            case BPF_ALU | BPF_SUB | BPF_K: case BPF_ALU | BPF_SUB | BPF_X: a -= operand; break;
+            case BPF_ALU | BPF_MUL | BPF_K: case BPF_ALU | BPF_MUL | BPF_X: a *= operand; break;
+            case BPF_ALU | BPF_OR | BPF_K: case BPF_ALU | BPF_OR | BPF_X: a |= operand; break;
+            case BPF_ALU | BPF_AND | BPF_K: case BPF_ALU | BPF_AND | BPF_X: a &= operand; break;
+            case BPF_ALU | BPF_XOR | BPF_K: case BPF_ALU | BPF_XOR | BPF_X: a ^= operand; break;
+            case BPF_ALU | BPF_LSH | BPF_K: case BPF_ALU | BPF_LSH | BPF_X: a <<= operand & 31; break;
+            case BPF_ALU | BPF_RSH | BPF_K: case BPF_ALU | BPF_RSH | BPF_X: a >>= operand & 31; break;
+            case BPF_ALU | BPF_DIV | BPF_K: case BPF_ALU | BPF_DIV | BPF_X:
+                if (!operand) return 0;
+                a /= operand;
+                break;
+            case BPF_ALU | BPF_MOD | BPF_K: case BPF_ALU | BPF_MOD | BPF_X:
+                if (!operand) return 0;
+                a %= operand;
+                break;
+            case BPF_ALU | BPF_NEG: a = -a; break;
+            case BPF_JMP | BPF_JA: pc += k; break;
+            case BPF_JMP | BPF_JEQ | BPF_K: case BPF_JMP | BPF_JEQ | BPF_X:
+                pc += a == operand ? insn->jt : insn->jf;
+                break;
+            case BPF_JMP | BPF_JGT | BPF_K: case BPF_JMP | BPF_JGT | BPF_X:
+                pc += a > operand ? insn->jt : insn->jf;
+                break;
+            case BPF_JMP | BPF_JGE | BPF_K: case BPF_JMP | BPF_JGE | BPF_X:
+                pc += a >= operand ? insn->jt : insn->jf;
+                break;
+            case BPF_JMP | BPF_JSET | BPF_K: case BPF_JMP | BPF_JSET | BPF_X:
+                pc += (a & operand) ? insn->jt : insn->jf;
+                break;
+            case BPF_RET | BPF_K: return k;
+            case BPF_RET | BPF_A: return a;
+            case BPF_RET | BPF_X: return x;
+            case BPF_MISC | BPF_TAX: x = a; break;
+            case BPF_MISC | BPF_TXA: a = x; break;
+            default: return 0;
+        }
+    }
+}
+
+/*
+ * The JIT. The code is a cdecl function of the packet and its length,
+ * with A in eax, X in ebx, the packet in esi, its length in edi and the
+ * scratch words on the stack. Every jump is a rel32, so an instruction's
+ * code is the same size whatever it jumps over: a first pass that only
+ * counts finds where each instruction starts, and the second emits.
+ * Failed loads and division by zero go to a shared exit returning 0.
+ */
+#define X86_JB 0x2
+#define X86_JAE 0x3
+#define X86_JE 0x4
+#define X86_JNE 0x5
+#define X86_JBE 0x6
+#define X86_JA 0x7
+
+struct bpf_jit {
+    uint8_t* image;                     /* NULL while sizing */
+    uint32_t pos;
+    uint32_t* addrs;                    /* Where each instruction starts; addrs[len] is the drop exit */
+    uint32_t len;
+};
+
+static void jit_emit(struct bpf_jit* jit, const uint8_t* bytes, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (jit->image && jit->pos < BPF_IMAGE_SIZE) {
+            jit->image[jit->pos] = bytes[i];
+        }
+        jit->pos++;
+    }
+}
+
+#define JIT_EMIT(jit, ...) do { \
+    const uint8_t bytes_[] = {__VA_ARGS__}; \
+    jit_emit(jit, bytes_, sizeof(bytes_)); \
+} while (0)
+
+static void jit_emit32(struct bpf_jit* jit, uint32_t value) {
+    uint8_t bytes[4] = {(uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24)};
+    jit_emit(jit, bytes, 4);
+}
+
+/* One opcode byte then a 32-bit immediate */
+static void jit_emit_op32(struct bpf_jit* jit, uint8_t op, uint32_t value) {
+    jit_emit(jit, &op, 1);
+    jit_emit32(jit, value);
+}
+
+static void jit_emit_disp8(struct bpf_jit* jit, uint8_t op, uint8_t modrm, uint8_t disp) {
+    uint8_t bytes[4] = {op, modrm, 0x24, disp};  /* [esp + disp] */
+    jit_emit(jit, bytes, 4);
+}
+
+/* jcc rel32 to target, a position in the image */
+static void jit_emit_jcc(struct bpf_jit* jit, uint8_t cc, uint32_t target) {
+    uint8_t bytes[2] = {0x0F, (uint8_t)(0x80 | cc)};
+    jit_emit(jit, bytes, 2);
+    jit_emit32(jit, target - (jit->pos + 4));
+}
+
+static void jit_emit_jmp(struct bpf_jit* jit, uint32_t target) {
+    JIT_EMIT(jit, 0xE9);
+    jit_emit32(jit, target - (jit->pos + 4));
+}
+
+/* A conditional jump: true and false both falling through emit nothing */
+static void jit_emit_cond(struct bpf_jit* jit, uint8_t cc, uint32_t pc, const struct sock_filter* insn) {
+    uint32_t taken = jit->addrs[pc + 1 + insn->jt];
+    uint32_t not_taken = jit->addrs[pc + 1 + insn->jf];
+    if (insn->jt == 0 && insn->jf == 0) {
+        return;
+    }
+    if (insn->jt == 0) {
+        jit_emit_jcc(jit, cc ^ 1, not_taken);
+    } else {
+        jit_emit_jcc(jit, cc, taken);
+        if (insn->jf != 0) {
+            jit_emit_jmp(jit, not_taken);
+        }
+    }
+}
+
+/* Load size bytes at [esi + ecx] into eax, in host order */
+static void jit_emit_load_ind(struct bpf_jit* jit, uint32_t size) {
+    if (size == 4) {
+        JIT_EMIT(jit, 0x8B, 0x04, 0x0E, 0x0F, 0xC8);            /* mov eax, [esi+ecx]; bswap eax */
+    } else if (size == 2) {
+        JIT_EMIT(jit, 0x0F, 0xB7, 0x04, 0x0E, 0x66, 0xC1, 0xC0, 0x08);  /* movzx; rol ax, 8 */
+    } else {
+        JIT_EMIT(jit, 0x0F, 0xB6, 0x04, 0x0E);                  /* movzx eax, byte [esi+ecx] */
+    }
+}
+
+static void jit_body(struct bpf_jit* jit, const struct bpf_prog* prog, int uses_mem) {
+    static const uint8_t sizes[4] = {4, 2, 1, 0};
+    uint32_t drop = jit->addrs[prog->len];
+    uint32_t exit = drop + 2;
+
+    /* push ebp; mov ebp, esp; push ebx, esi, edi; esi, edi = the arguments; A = X = 0 */
+    JIT_EMIT(jit, 0x55, 0x89, 0xE5, 0x53, 0x56, 0x57, 0x8B, 0x75, 0x08, 0x8B, 0x7D, 0x0C,
+             0x31, 0xC0, 0x31, 0xDB);
+    if (uses_mem) {
+        for (uint32_t i = 0; i < BPF_MEMWORDS; i++) {
+            JIT_EMIT(jit, 0x50);                                /* push eax: zeroed scratch */
+        }
+    }
+
+    for (uint32_t pc = 0; pc < prog->len; pc++) {
+        const struct sock_filter* insn = &prog->insns[pc];
+        uint32_t k = insn->k;
+        uint32_t size = sizes[BPF_SIZE(insn->code) >> 3];
+        jit->addrs[pc] = jit->pos;
+        switch (insn->code) {
+            case BPF_LD | BPF_W | BPF_ABS:
+            case BPF_LD | BPF_H | BPF_ABS:
+            case BPF_LD | BPF_B | BPF_ABS:
+                JIT_EMIT(jit, 0x81, 0xFF);                      /* cmp edi, k + size; jb drop */
+                jit_emit32(jit, k + size);
+                jit_emit_jcc(jit, X86_JB, drop);
+                if (size == 4) {
+                    JIT_EMIT(jit, 0x8B, 0x86);                  /* mov eax, [esi+k]; bswap eax */
+                    jit_emit32(jit, k);
+                    JIT_EMIT(jit, 0x0F, 0xC8);
+                } else if (size == 2) {
+                    JIT_EMIT(jit, 0x0F, 0xB7, 0x86);            /* movzx eax, word [esi+k]; rol ax, 8 */
+                    jit_emit32(jit, k);
+                    JIT_EMIT(jit, 0x66, 0xC1, 0xC0, 0x08);
+                } else {
+                    JIT_EMIT(jit, 0x0F, 0xB6, 0x86);            /* movzx eax, byte [esi+k] */
+                    jit_emit32(jit, k);
+                }
+                break;
+            case BPF_LD | BPF_W | BPF_IND:
+            case BPF_LD | BPF_H | BPF_IND:
+            case BPF_LD | BPF_B | BPF_IND:
+                JIT_EMIT(jit, 0x89, 0xD9, 0x81, 0xC1);          /* ecx = X + k, dropping on a carry */
+                jit_emit32(jit, k);
+                jit_emit_jcc(jit, X86_JB, drop);
+                JIT_EMIT(jit, 0x89, 0xFA, 0x83, 0xEA, (uint8_t)size);   /* edx = len - size */
+                jit_emit_jcc(jit, X86_JB, drop);
+                JIT_EMIT(jit, 0x39, 0xD1);                      /* cmp ecx, edx; ja drop */
+                jit_emit_jcc(jit, X86_JA, drop);
+                jit_emit_load_ind(jit, size);
+                break;
+            case BPF_LDX | BPF_B | BPF_MSH:
+                JIT_EMIT(jit, 0x81, 0xFF);                      /* cmp edi, k + 1; jb drop */
+                jit_emit32(jit, k + 1);
+                jit_emit_jcc(jit, X86_JB, drop);
+                JIT_EMIT(jit, 0x0F, 0xB6, 0x9E);                /* movzx ebx, byte [esi+k] */
+                jit_emit32(jit, k);
+                JIT_EMIT(jit, 0x83, 0xE3, 0x0F, 0xC1, 0xE3, 0x02);     /* and ebx, 15; shl ebx, 2 */
+                break;
+            case BPF_LD | BPF_W | BPF_LEN: JIT_EMIT(jit, 0x89, 0xF8); break;
+            case BPF_LDX | BPF_W | BPF_LEN: JIT_EMIT(jit, 0x89, 0xFB); break;
+            case BPF_LD | BPF_IMM: jit_emit_op32(jit, 0xB8, k); break;
+            case BPF_LDX | BPF_W | BPF_IMM: jit_emit_op32(jit, 0xBB, k); break;
+            case BPF_LD | BPF_MEM: jit_emit_disp8(jit, 0x8B, 0x44, (uint8_t)(k * 4)); break;
+            case BPF_LDX | BPF_W | BPF_MEM: jit_emit_disp8(jit, 0x8B, 0x5C, (uint8_t)(k * 4)); break;
+            case BPF_ST: jit_emit_disp8(jit, 0x89, 0x44, (uint8_t)(k * 4)); break;
+            case BPF_STX: jit_emit_disp8(jit, 0x89, 0x5C, (uint8_t)(k * 4)); break;
+            case BPF_ALU | BPF_ADD | BPF_K: jit_emit_op32(jit, 0x05, k); break;
+            case BPF_ALU | BPF_SUB | BPF_K: jit_emit_op32(jit, 0x2D, k); break;
+            case BPF_ALU | BPF_OR | BPF_K: jit_emit_op32(jit, 0x0D, k); break;
+            case BPF_ALU | BPF_AND | BPF_K: jit_emit_op32(jit, 0x25, k); break;
+            case BPF_ALU | BPF_XOR | BPF_K: jit_emit_op32(jit, 0x35, k); break;
+            case BPF_ALU | BPF_MUL | BPF_K:
+                JIT_EMIT(jit, 0x69, 0xC0);                      /* imul eax, eax, k */
+                jit_emit32(jit, k);
+                break;
+            case BPF_ALU | BPF_DIV | BPF_K:
+            case BPF_ALU | BPF_MOD | BPF_K:
+                JIT_EMIT(jit, 0x31, 0xD2);                      /* xor edx, edx; mov ecx, k; div ecx */
+                jit_emit_op32(jit, 0xB9, k);
+                JIT_EMIT(jit, 0xF7, 0xF1);
+                if (BPF_OP(insn->code) == BPF_MOD) {
+                    JIT_EMIT(jit, 0x89, 0xD0);                  /* mov eax, edx */
+                }
+                break;
+            case BPF_ALU | BPF_LSH | BPF_K: JIT_EMIT(jit, 0xC1, 0xE0, (uint8_t)k); break;
+            case BPF_ALU | BPF_RSH | BPF_K: JIT_EMIT(jit, 0xC1, 0xE8, (uint8_t)k); break;
+            case BPF_ALU | BPF_ADD | BPF_X: JIT_EMIT(jit, 0x01, 0xD8); break;
+            case BPF_ALU | BPF_SUB | BPF_X: JIT_EMIT(jit, 0x29, 0xD8); break;
+            case BPF_ALU | BPF_OR | BPF_X: JIT_EMIT(jit, 0x09, 0xD8); break;
+            case BPF_ALU | BPF_AND | BPF_X: JIT_EMIT(jit, 0x21, 0xD8); break;
+            case BPF_ALU | BPF_XOR | BPF_X: JIT_EMIT(jit, 0x31, 0xD8); break;
+            case BPF_ALU | BPF_MUL | BPF_X: JIT_EMIT(jit, 0x0F, 0xAF, 0xC3); break;
+            case BPF_ALU | BPF_DIV | BPF_X:
+            case BPF_ALU | BPF_MOD | BPF_X:
+                JIT_EMIT(jit, 0x85, 0xDB);                      /* test ebx, ebx; jz drop */
+                jit_emit_jcc(jit, X86_JE, drop);
+                JIT_EMIT(jit, 0x31, 0xD2, 0xF7, 0xF3);          /* xor edx, edx; div ebx */
+                if (BPF_OP(insn->code) == BPF_MOD) {
+                    JIT_EMIT(jit, 0x89, 0xD0);
+                }
+                break;
+            case BPF_ALU | BPF_LSH | BPF_X: JIT_EMIT(jit, 0x89, 0xD9, 0xD3, 0xE0); break;   /* mov ecx, ebx; shl eax, cl */
+            case BPF_ALU | BPF_RSH | BPF_X: JIT_EMIT(jit, 0x89, 0xD9, 0xD3, 0xE8); break;
+            case BPF_ALU | BPF_NEG: JIT_EMIT(jit, 0xF7, 0xD8); break;
+            case BPF_JMP | BPF_JA: jit_emit_jmp(jit, jit->addrs[pc + 1 + k]); break;
+            case BPF_JMP | BPF_JEQ | BPF_K: jit_emit_op32(jit, 0x3D, k); jit_emit_cond(jit, X86_JE, pc, insn); break;
+            case BPF_JMP | BPF_JGT | BPF_K: jit_emit_op32(jit, 0x3D, k); jit_emit_cond(jit, X86_JA, pc, insn); break;
+            case BPF_JMP | BPF_JGE | BPF_K: jit_emit_op32(jit, 0x3D, k); jit_emit_cond(jit, X86_JAE, pc, insn); break;
+            case BPF_JMP | BPF_JSET | BPF_K: jit_emit_op32(jit, 0xA9, k); jit_emit_cond(jit, X86_JNE, pc, insn); break;
+            case BPF_JMP | BPF_JEQ | BPF_X: JIT_EMIT(jit, 0x39, 0xD8); jit_emit_cond(jit, X86_JE, pc, insn); break;
+            case BPF_JMP | BPF_JGT | BPF_X: JIT_EMIT(jit, 0x39, 0xD8); jit_emit_cond(jit, X86_JA, pc, insn); break;
+            case BPF_JMP | BPF_JGE | BPF_X: JIT_EMIT(jit, 0x39, 0xD8); jit_emit_cond(jit, X86_JAE, pc, insn); break;
+            case BPF_JMP | BPF_JSET | BPF_X: JIT_EMIT(jit, 0x85, 0xD8); jit_emit_cond(jit, X86_JNE, pc, insn); break;
+            case BPF_RET | BPF_K: jit_emit_op32(jit, 0xB8, k); jit_emit_jmp(jit, exit); break;
+            case BPF_RET | BPF_A: jit_emit_jmp(jit, exit); break;
+            case BPF_RET | BPF_X: JIT_EMIT(jit, 0x89, 0xD8); jit_emit_jmp(jit, exit); break;
+            case BPF_MISC | BPF_TAX: JIT_EMIT(jit, 0x89, 0xC3); break;
+            case BPF_MISC | BPF_TXA: JIT_EMIT(jit, 0x89, 0xD8); break;
+        }
+    }
+
+    /* drop: xor eax, eax; exit: release the scratch, restore and return A */
+    jit->addrs[prog->len] = jit->pos;
+    JIT_EMIT(jit, 0x31, 0xC0);
+    if (uses_mem) {
+        JIT_EMIT(jit, 0x83, 0xC4, BPF_MEMWORDS * 4);
+    }
+    JIT_EMIT(jit, 0x5F, 0x5E, 0x5B, 0x5D, 0xC3);
+}
+
+/* Compile a checked program into its image; it stays interpreted if the code does not fit */
+static void bpf_jit_compile(struct bpf_prog* prog) {
+    uint32_t addrs[BPF_MAXINSNS + 1] = {0};
+    struct bpf_jit jit = {NULL, 0, addrs, prog->len};
+    int uses_mem = 0;
+    for (uint32_t pc = 0; pc < prog->len; pc++) {
+        uint16_t code = prog->insns[pc].code;
+        if (code == BPF_ST || code == BPF_STX || code == (BPF_LD | BPF_MEM) || code == (BPF_LDX | BPF_W | BPF_MEM)) {
+            uses_mem = 1;
+        }
+    }
+
+    /* Sizing finds every start, a jump's target included, before anything is emitted */
+    jit_body(&jit, prog, uses_mem);
+    if (jit.pos > BPF_IMAGE_SIZE) {
+        prog->jited = NULL;
+        return;
+    }
+    jit.image = prog->image;
+    jit.pos = 0;
+    jit_body(&jit, prog, uses_mem);
+    prog->jited = (uint32_t (*)(const uint8_t*, uint32_t))(uintptr_t)prog->image;
+}
+
+/* A checked copy of the program, compiled if the JIT is on; NULL if it fails the check or none is free */
+struct bpf_prog* bpf_prog_create(const struct sock_filter* insns, uint32_t len) {
+    if (bpf_check(insns, len) != 0) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < BPF_MAX_PROGS; i++) {
+        struct bpf_prog* prog = &bpf_progs[i];
+        if (prog->used) {
+            continue;
+        }
+        prog->used = 1;
+        prog->len = len;
+        for (uint32_t pc = 0; pc < len; pc++) {
+            prog->insns[pc] = insns[pc];
+        }
+        prog->jited = NULL;
+        if (bpf_jit_enabled) {
+            bpf_jit_compile(prog);
+        }
+        return prog;
+    }
+    return NULL;
+}
+
+void bpf_prog_destroy(struct bpf_prog* prog) {
+    if (prog) {
+        prog->used = 0;
+    }
+}
+
+/* Bytes of the packet to keep: 0 to drop it */
+uint32_t bpf_prog_run(const struct bpf_prog* prog, const uint8_t* data, uint32_t len) {
+    return prog->jited ? prog->jited(data, len) : bpf_interpret(prog, data, len);
+}
+
+int bpf_prog_jited(const struct bpf_prog* prog) {
+    return prog->jited != NULL;
+}
+
+/* Whether programs created from now on are compiled */
+void bpf_jit_enable(int enabled) {
+    bpf_jit_enabled = enabled;
+}
@@ -0,0 +1,568 @@
+/*
+ * Tiny Operating System - Buffer Cache
+ * Hashed (device, block) buffers with LRU eviction and periodic write-back
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SECTOR_SIZE 512
+#define BCACHE_BLOCK_SIZE 1024
+#define BCACHE_SECTORS_PER_BLOCK (BCACHE_BLOCK_SIZE / SECTOR_SIZE)
+#define BCACHE_BUFFERS 256
+#define BCACHE_HASH_SIZE 128            /* Power of two */
+
+/* Write-back policy, in timer ticks */
+#define BCACHE_FLUSH_INTERVAL 500       /* The flusher wakes every 5 s */
+#define BCACHE_DIRTY_EXPIRE 3000        /* and writes what has been dirty for 30 s */
+
+/* Buffer state */
+#define B_VALID 0x01                    /* Data matches the device, or is newer */
+#define B_DIRTY 0x02                    /* Newer than the device */
+#define B_BUSY 0x04                     /* I/O in flight */
+#define B_ERROR 0x08
+#define B_READAHEAD 0x10                /* Prefetched and not yet read by anyone */
+#define B_MAPPED 0x20                   /* data is the device's own storage (blk_map) */
+#define B_JOURNAL 0x40                  /* In an uncommitted journal transaction: not written back */
+
+/* Readahead window, in blocks */
+#define RA_INITIAL 4
+#define RA_MAX (128 * 1024 / BCACHE_BLOCK_SIZE)
+#define RA_NONE 0xFFFFFFFF              /* prev of a file not read yet */
+
+/* Block I/O request (must match struct bio in block.c) */
+struct bio {
+    struct bio* next;
+    uint32_t sector;
+    uint32_t count;
+    uint8_t* buffer;
+    uint8_t write;
+    int status;
+    void (*done)(struct bio* bio);
+    void* private;
+};
+
+/* Timer wheel entry (must match struct timer in timer_wheel.c) */
+struct timer {
+    struct timer* next;
+    struct timer** pprev;
+    uint32_t expires;
+    void (*callback)(void* data);
+    void* data;
+};
+
+/* One cached block */
+struct buffer {
+    struct buffer* hash_next;
+    struct buffer** hash_pprev;
+    struct buffer* lru_next;            /* Most recently used first */
+    struct buffer* lru_prev;
+    uint32_t device;
+    uint32_t block;
+    uint32_t refcount;
+    volatile uint32_t flags;
+    uint32_t dirty_since;
+    uint8_t* data;
+    struct bio bio;                     /* For the buffer's own reads and write-backs */
+};
+
+static struct buffer bcache_buffers[BCACHE_BUFFERS];
+static uint8_t bcache_data[BCACHE_BUFFERS][BCACHE_BLOCK_SIZE] __attribute__((aligned(BCACHE_BLOCK_SIZE)));
+static struct buffer* bcache_hash[BCACHE_HASH_SIZE];
+static struct buffer* lru_head;
+static struct buffer* lru_tail;
+static struct timer bcache_flush_timer;
+static void (*bcache_writeback_hook)(void);
+
+/*
+ * Readahead state of one open file. The window [start, start + size) is
+ * what the last readahead fetched; reading its marker block, while reading
+ * sequentially, fetches the next window, twice as large.
+ */
+struct file_ra_state {
+    uint32_t start;
+    uint32_t size;                      /* 0 while access looks random */
+    uint32_t marker;
+    uint32_t prev;                      /* Last block read */
+};
+
+/* Statistics */
+static uint32_t bcache_hits;
+static uint32_t bcache_misses;
+static uint32_t bcache_evictions;
+static uint32_t bcache_writebacks;
+static uint32_t ra_prefetched;
+static uint32_t ra_used;
+static uint32_t ra_wasted;              /* Evicted before anyone read them */
+
+/* Tick counter of the kernel this is linked into */
+extern uint32_t timer_ticks;
+
+/* Block layer (block.c) */
+extern void blk_submit_bio(uint32_t device, struct bio* bio);
+extern void blk_plug(uint32_t device);
+extern void blk_unplug(uint32_t device);
+extern void blk_poll(uint32_t device);
+extern uint32_t blk_sectors(uint32_t device);
+extern int blk_mappable(uint32_t device);
+extern void* blk_map(uint32_t device, uint32_t sector);
+
+/* Timer wheel functions (timer_wheel.c) */
+extern void timer_setup(struct timer* timer, void (*callback)(void* data), void* data);
+extern void timer_add(struct timer* timer, uint32_t expires);
+
+/* Function prototypes */
+void bcache_init(void);
+struct buffer* bread(uint32_t device, uint32_t block);
+void brelse(struct buffer* buf);
+void bmark_dirty(struct buffer* buf);
+void* bdata(struct buffer* buf);
+int bsync(void);
+void bcache_get_statistics(uint32_t* hits, uint32_t* misses, uint32_t* evictions, uint32_t* writebacks);
+void bcache_readahead(uint32_t device, uint32_t block, uint32_t count);
+void file_ra_init(struct file_ra_state* ra);
+struct buffer* bread_ra(struct file_ra_state* ra, uint32_t device, uint32_t block);
+void bcache_get_ra_statistics(uint32_t* prefetched, uint32_t* used, uint32_t* wasted);
+uint32_t bblock(struct buffer* buf);
+void bjournal_pin(struct buffer* buf);
+void bjournal_unpin(struct buffer* buf);
+void bcache_set_writeback_hook(void (*hook)(void));
+
+/* Save EFLAGS and disable interrupts; the flusher runs from the timer interrupt */
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+/* Restore the interrupt flag saved by irq_save */
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+}
+
+static uint32_t bcache_hashfn(uint32_t device, uint32_t block) {
+    return (block ^ (device * 0x9E3779B1u)) & (BCACHE_HASH_SIZE - 1);
+}
+
+/* List helpers; interrupts are off */
+static void hash_insert(struct buffer* buf) {
+    struct buffer** bucket = &bcache_hash[bcache_hashfn(buf->device, buf->block)];
+    buf->hash_next = *bucket;
+    if (buf->hash_next) {
+        buf->hash_next->hash_pprev = &buf->hash_next;
+    }
+    buf->hash_pprev = bucket;
+    *bucket = buf;
+}
+
+static void hash_remove(struct buffer* buf) {
+    if (!buf->hash_pprev) {
+        return;
+    }
+    *buf->hash_pprev = buf->hash_next;
+    if (buf->hash_next) {
+        buf->hash_next->hash_pprev = buf->hash_pprev;
+    }
+    buf->hash_pprev = NULL;
+}
+
+static void lru_remove(struct buffer* buf) {
+    if (buf->lru_prev) {
+        buf->lru_prev->lru_next = buf->lru_next;
+    } else {
+        lru_head = buf->lru_next;
+    }
+    if (buf->lru_next) {
+        buf->lru_next->lru_prev = buf->lru_prev;
+    } else {
+        lru_tail = buf->lru_prev;
+    }
+}
+
+static void lru_push_front(struct buffer* buf) {
+    buf->lru_prev = NULL;
+    buf->lru_next = lru_head;
+    if (lru_head) {
+        lru_head->lru_prev = buf;
+    } else {
+        lru_tail = buf;
+    }
+    lru_head = buf;
+}
+
+static struct buffer* bcache_lookup(uint32_t device, uint32_t block) {
+    struct buffer* buf = bcache_hash[bcache_hashfn(device, block)];
+    while (buf && (buf->device != device || buf->block != block)) {
+        buf = buf->hash_next;
+    }
+    return buf;
+}
+
+/* Runs from the block layer's completion path */
+static void bcache_io_done(struct bio* bio) {
+    struct buffer* buf = (struct buffer*)bio->private;
+    uint32_t flags = (buf->flags & ~(B_BUSY | B_ERROR)) | B_VALID;
+    if (bio->status != 0) {
+        flags |= B_ERROR;
+        if (bio->write) {
+            flags |= B_DIRTY; /* Still newer than the device: retry at the next flush */
+        } else {
+            flags &= ~B_VALID;
+        }
+    }
+    buf->flags = flags;
+}
+
+/* Start I/O on a buffer nobody else is touching; interrupts are off */
+static void bcache_submit(struct buffer* buf, int write) {
+    buf->flags |= B_BUSY;
+    if (write) {
+        buf->flags &= ~B_DIRTY;
+        bcache_writebacks++;
+    }
+    buf->bio.sector = buf->block * BCACHE_SECTORS_PER_BLOCK;
+    buf->bio.count = BCACHE_SECTORS_PER_BLOCK;
+    buf->bio.buffer = buf->data;
+    buf->bio.write = write;
+    buf->bio.done = bcache_io_done;
+    buf->bio.private = buf;
+    blk_submit_bio(buf->device, &buf->bio);
+}
+
+/* Drive the device until the buffer's I/O has finished */
+static void bcache_wait(struct buffer* buf) {
+    while (buf->flags & B_BUSY) {
+        blk_poll(buf->device);
+    }
+}
+
+/*
+ * A buffer to reuse: the least recently used one nobody holds, preferring
+ * a clean one. If every candidate is dirty, the oldest is written back
+ * first. With flags NULL, for readahead, only clean buffers that are not
+ * themselves waiting to be read qualify. NULL if there is nothing to reuse.
+ */
+static struct buffer* bcache_evict(uint32_t* flags) {
+    struct buffer* dirty = NULL;
+    for (struct buffer* buf = lru_tail; buf; buf = buf->lru_prev) {
+        if (buf->refcount || (buf->flags & (B_BUSY | B_JOURNAL))) {
+            continue;
+        }
+        if (!flags && (buf->flags & B_READAHEAD)) {
+            continue;
+        }
+        if (!(buf->flags & B_DIRTY)) {
+            return buf;
+        }
+        if (!dirty) {
+            dirty = buf;
+        }
+    }
+    if (dirty && !flags) {
+        return NULL;
+    }
+    if (dirty) {
+        dirty->refcount++;
+        bcache_submit(dirty, 1);
+        irq_restore(*flags);
+        bcache_wait(dirty);
+        *flags = irq_save();
+        dirty->refcount--;
+        if (dirty->flags & B_ERROR) {
+            return NULL; /* The device refuses it; do not spin on the same write */
+        }
+    }
+    return dirty;
+}
+
+/* Give a free buffer a new identity; interrupts are off */
+static void bcache_assign(struct buffer* buf, uint32_t device, uint32_t block) {
+    if (buf->flags & B_VALID) {
+        bcache_evictions++;
+        if (buf->flags & B_READAHEAD) {
+            ra_wasted++;
+        }
+    }
+    hash_remove(buf);
+    buf->device = device;
+    buf->block = block;
+    buf->flags = 0;
+    buf->data = bcache_data[buf - bcache_buffers];
+    hash_insert(buf);
+}
+
+/*
+ * Get block of device, reading it on a miss. The buffer stays held, so it
+ * cannot be evicted or written back under the caller, until brelse.
+ * Returns NULL on an I/O error or when every buffer is held.
+ */
+struct buffer* bread(uint32_t device, uint32_t block) {
+    if ((block + 1) * BCACHE_SECTORS_PER_BLOCK > blk_sectors(device)) {
+        return NULL;
+    }
+    uint32_t flags = irq_save();
+    struct buffer* buf = bcache_lookup(device, block);
+    if (buf) {
+        bcache_hits++;
+    } else {
+        bcache_misses++;
+        while (!buf) {
+            struct buffer* victim = bcache_evict(&flags);
+            if (!victim) {
+                irq_restore(flags);
+                return NULL;
+            }
+            
+            /* A write-back lets interrupts in: the block may have arrived meanwhile */
+            buf = bcache_lookup(device, block);
+            if (!buf && !victim->refcount && !(victim->flags & (B_BUSY | B_DIRTY))) {
+                bcache_assign(victim, device, block);
+                buf = victim;
+            }
+        }
+    }
+    
+    if (buf->flags & B_READAHEAD) {
+        buf->flags &= ~B_READAHEAD;
+        ra_used++;
+    }
+    buf->refcount++;
+    lru_remove(buf);
+    lru_push_front(buf);
+    if (!(buf->flags & (B_VALID | B_BUSY))) {
+        /* A memory-backed device lends its page instead: nothing to copy */
+        uint8_t* page = (uint8_t*)blk_map(device, block * BCACHE_SECTORS_PER_BLOCK);
+        if (page) {
+            buf->data = page;
+            buf->flags = (buf->flags & ~B_ERROR) | B_VALID | B_MAPPED;
+        } else {
+            bcache_submit(buf, 0);
+        }
+    }
+    irq_restore(flags);
+    
+    bcache_wait(buf);
+    if (!(buf->flags & B_VALID)) {
+        brelse(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+void brelse(struct buffer* buf) {
+    uint32_t flags = irq_save();
+    buf->refcount--;
+    irq_restore(flags);
+}
+
+/*
+ * The caller changed the data; it reaches the device at a flush or an
+ * eviction. A mapped buffer's data is the device's, so it is there already.
+ */
+void bmark_dirty(struct buffer* buf) {
+    uint32_t flags = irq_save();
+    if (!(buf->flags & (B_DIRTY | B_MAPPED))) {
+        buf->flags |= B_DIRTY;
+        buf->dirty_since = timer_ticks;
+    }
+    irq_restore(flags);
+}
+
+void* bdata(struct buffer* buf) {
+    return buf->data;
+}
+
+uint32_t bblock(struct buffer* buf) {
+    return buf->block;
+}
+
+/*
+ * Write-ahead rule for a journal: a pinned buffer stays in the cache and
+ * off the device until its transaction has committed and unpins it.
+ */
+void bjournal_pin(struct buffer* buf) {
+    uint32_t flags = irq_save();
+    buf->flags |= B_JOURNAL;
+    irq_restore(flags);
+}
+
+void bjournal_unpin(struct buffer* buf) {
+    uint32_t flags = irq_save();
+    buf->flags &= ~B_JOURNAL;
+    irq_restore(flags);
+}
+
+void bcache_set_writeback_hook(void (*hook)(void)) {
+    bcache_writeback_hook = hook;
+}
+
+/*
+ * Start write-back of dirty buffers nobody holds; with expired_only, just
+ * those dirty for longer than BCACHE_DIRTY_EXPIRE. Submitting under a plug
+ * lets the block layer merge neighbouring blocks into large writes.
+ * The hook runs first, so a journal can commit what it has pinned.
+ * Returns the number of writes started.
+ */
+static uint32_t bcache_writeback(int expired_only) {
+    uint32_t plugged = 0;               /* Devices, as a bitmask */
+    uint32_t started = 0;
+    if (bcache_writeback_hook) {
+        bcache_writeback_hook();
+    }
+    uint32_t flags = irq_save();
+    
+    for (uint32_t i = 0; i < BCACHE_BUFFERS; i++) {
+        struct buffer* buf = &bcache_buffers[i];
+        if ((buf->flags & (B_DIRTY | B_BUSY | B_JOURNAL)) != B_DIRTY || buf->refcount ||
+            (expired_only && timer_ticks - buf->dirty_since < BCACHE_DIRTY_EXPIRE)) {
+            continue;
+        }
+        if (buf->device < 32 && !(plugged & (1u << buf->device))) {
+            plugged |= 1u << buf->device;
+            blk_plug(buf->device);
+        }
+        bcache_submit(buf, 1);
+        started++;
+    }
+    
+    for (uint32_t device = 0; plugged; device++, plugged >>= 1) {
+        if (plugged & 1) {
+            blk_unplug(device);
+        }
+    }
+    irq_restore(flags);
+    return started;
+}
+
+/* Periodic flusher, from the timer wheel */
+static void bcache_flush_tick(void* data) {
+    (void)data;
+    bcache_writeback(1);
+    timer_add(&bcache_flush_timer, timer_ticks + BCACHE_FLUSH_INTERVAL);
+}
+
+/* Write every dirty buffer nobody holds and wait; -1 if any write failed */
+int bsync(void) {
+    bcache_writeback(0);
+    int status = 0;
+    for (uint32_t i = 0; i < BCACHE_BUFFERS; i++) {
+        struct buffer* buf = &bcache_buffers[i];
+        bcache_wait(buf);
+        if (buf->flags & B_ERROR) {
+            status = -1;
+        }
+    }
+    return status;
+}
+
+void bcache_init(void) {
+    lru_head = NULL;
+    lru_tail = NULL;
+    for (uint32_t i = 0; i < BCACHE_HASH_SIZE; i++) {
+        bcache_hash[i] = NULL;
+    }
+    for (uint32_t i = 0; i < BCACHE_BUFFERS; i++) {
+        struct buffer* buf = &bcache_buffers[i];
+        buf->hash_pprev = NULL;
+        buf->refcount = 0;
+        buf->flags = 0;
+        buf->data = bcache_data[i];
+        lru_push_front(buf);
+    }
+    bcache_writeback_hook = NULL;
+    bcache_hits = 0;
+    bcache_misses = 0;
+    bcache_evictions = 0;
+    bcache_writebacks = 0;
+    ra_prefetched = 0;
+    ra_used = 0;
+    ra_wasted = 0;
+    
+    timer_setup(&bcache_flush_timer, bcache_flush_tick, NULL);
+    timer_add(&bcache_flush_timer, timer_ticks + BCACHE_FLUSH_INTERVAL);
+}
+
+void bcache_get_statistics(uint32_t* hits, uint32_t* misses, uint32_t* evictions, uint32_t* writebacks) {
+    if (hits) *hits = bcache_hits;
+    if (misses) *misses = bcache_misses;
+    if (evictions) *evictions = bcache_evictions;
+    if (writebacks) *writebacks = bcache_writebacks;
+}
+
+/*
+ * Start reads of the blocks in [block, block + count) that are not cached,
+ * without waiting. Submitted under a plug, they reach the device as a few
+ * large requests. Only clean buffers are taken, to leave dirty ones to the
+ * flusher; the prefetch stops early when there are none.
+ */
+void bcache_readahead(uint32_t device, uint32_t block, uint32_t count) {
+    uint32_t blocks = blk_sectors(device) / BCACHE_SECTORS_PER_BLOCK;
+    if (block >= blocks || blk_mappable(device)) {
+        return; /* Mapped blocks cost no I/O to read */
+    }
+    if (count > blocks - block) {
+        count = blocks - block;
+    }
+    
+    uint32_t flags = irq_save();
+    blk_plug(device);
+    for (uint32_t i = 0; i < count; i++) {
+        if (bcache_lookup(device, block + i)) {
+            continue;
+        }
+        struct buffer* buf = bcache_evict(NULL);
+        if (!buf) {
+            break;
+        }
+        bcache_assign(buf, device, block + i);
+        lru_remove(buf);
+        lru_push_front(buf);
+        buf->flags |= B_READAHEAD;
+        bcache_submit(buf, 0);
+        ra_prefetched++;
+    }
+    blk_unplug(device);
+    irq_restore(flags);
+}
+
+void file_ra_init(struct file_ra_state* ra) {
+    ra->start = 0;
+    ra->size = 0;
+    ra->marker = 0;
+    ra->prev = RA_NONE;
+}
+
+/*
+ * bread for a file's stream of blocks. The first read, or one that
+ * follows the previous read, opens a window of RA_INITIAL blocks from the
+ * block read. Reading the block after it fetches the next window, and
+ * from then on the first block of each window fetches the one after it,
+ * twice the size up to RA_MAX: the prefetch stays a window ahead of the
+ * reader. Any other jump collapses the window until access turns
+ * sequential again.
+ */
+struct buffer* bread_ra(struct file_ra_state* ra, uint32_t device, uint32_t block) {
+    if (ra->prev == RA_NONE || block == ra->prev + 1) {
+        if (!ra->size) {
+            ra->start = block;
+            ra->size = RA_INITIAL;
+            ra->marker = block + 1;
+            bcache_readahead(device, ra->start, ra->size);
+        } else if (block == ra->marker) {
+            ra->start += ra->size;
+            ra->size = ra->size * 2 < RA_MAX ? ra->size * 2 : RA_MAX;
+            ra->marker = ra->start;
+            bcache_readahead(device, ra->start, ra->size);
+        }
+    } else if (block != ra->prev) {
+        ra->size = 0;
+    }
+    ra->prev = block;
+    return bread(device, block);
+}
+
+void bcache_get_ra_statistics(uint32_t* prefetched, uint32_t* used, uint32_t* wasted) {
+    if (prefetched) *prefetched = ra_prefetched;
+    if (used) *used = ra_used;
+    if (wasted) *wasted = ra_wasted;
+}
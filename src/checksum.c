@@ -0,0 +1,86 @@
+/*
+ * Tiny Operating System - Internet Checksum
+ * One's complement sums over 32-bit words, with RFC 1624 incremental updates
+ */
+
+#include <stdint.h>
+
+/* x86 tolerates unaligned loads; tell the compiler so it does not assume alignment */
+typedef uint32_t __attribute__((may_alias, aligned(1))) unaligned_u32;
+typedef uint16_t __attribute__((may_alias, aligned(1))) unaligned_u16;
+
+/* Function prototypes */
+uint32_t csum_partial(const void* data, uint32_t size, uint32_t sum);
+uint16_t csum_fold(uint32_t sum);
+uint16_t csum_compute(const void* data, uint32_t size);
+void csum_replace2(uint16_t* check, uint16_t old_value, uint16_t new_value);
+void csum_replace4(uint16_t* check, uint32_t old_value, uint32_t new_value);
+
+/* Fold a 64-bit accumulator to 32 bits with end-around carry */
+static uint32_t fold64(uint64_t sum) {
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    return (uint32_t)sum;
+}
+
+/*
+ * Add data to a running 32-bit sum. Summing little-endian dwords and folding
+ * gives the same 16-bit result as summing host-order halfwords.
+ */
+uint32_t csum_partial(const void* data, uint32_t size, uint32_t sum) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint64_t acc = sum;
+    
+    /* 32 bytes per pass; a 64-bit accumulator cannot overflow on any frame size */
+    while (size >= 32) {
+        const unaligned_u32* words = (const unaligned_u32*)bytes;
+        acc += (uint64_t)words[0] + words[1] + words[2] + words[3];
+        acc += (uint64_t)words[4] + words[5] + words[6] + words[7];
+        bytes += 32;
+        size -= 32;
+    }
+    while (size >= 4) {
+        acc += *(const unaligned_u32*)bytes;
+        bytes += 4;
+        size -= 4;
+    }
+    if (size >= 2) {
+        acc += *(const unaligned_u16*)bytes;
+        bytes += 2;
+        size -= 2;
+    }
+    if (size) {
+        acc += *bytes;
+    }
+    
+    return fold64(acc);
+}
+
+/* Fold to 16 bits and complement, giving the value stored in a header */
+uint16_t csum_fold(uint32_t sum) {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+uint16_t csum_compute(const void* data, uint32_t size) {
+    return csum_fold(csum_partial(data, size, 0));
+}
+
+/* RFC 1624 eqn. 3: HC' = ~(~HC + ~m + m'), for one rewritten halfword */
+void csum_replace2(uint16_t* check, uint16_t old_value, uint16_t new_value) {
+    uint32_t sum = (uint16_t)~*check;
+    sum += (uint16_t)~old_value;
+    sum += new_value;
+    *check = csum_fold(sum);
+}
+
+/* The same for a rewritten 32-bit field such as a NAT address */
+void csum_replace4(uint16_t* check, uint32_t old_value, uint32_t new_value) {
+    uint32_t sum = (uint16_t)~*check;
+    sum += (uint16_t)~(old_value & 0xFFFF);
+    sum += (uint16_t)~(old_value >> 16);
+    sum += new_value & 0xFFFF;
+    sum += new_value >> 16;
+    *check = csum_fold(sum);
+}
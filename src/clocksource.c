@@ -0,0 +1,175 @@
+/*
+ * Tiny Operating System - Clocksource
+ * TSC-based monotonic nanosecond clock, calibrated against the PIT at boot
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* PIT channel 2 is gated through the keyboard controller port B */
+#define PIT_FREQUENCY 1193182
+#define PIT_CHANNEL2 0x42
+#define PIT_COMMAND_PORT 0x43
+#define PIT_PORT_B 0x61
+#define PIT_GATE2 0x01
+#define PIT_SPEAKER 0x02
+#define PIT_OUT2 0x20
+
+/* Calibration window */
+#define CALIBRATE_MS 10
+#define CALIBRATE_LATCH (PIT_FREQUENCY / (1000 / CALIBRATE_MS))
+#define CALIBRATE_RUNS 3
+
+/* Cycles to nanoseconds: ns = cycles * mult >> CLOCK_SHIFT */
+#define CLOCK_SHIFT 22
+
+/* CPUID feature bits */
+#define CPUID_EDX_TSC (1u << 4)
+#define CPUID_EXT_EDX_INVARIANT_TSC (1u << 8)
+
+/* Clocksource state */
+static uint32_t tsc_khz;
+static uint32_t tsc_mult;
+static uint64_t tsc_base;
+static int tsc_invariant;
+
+/* Function prototypes */
+void clocksource_init(void);
+uint64_t ktime_ns(void);
+uint32_t ktime_ms(void);
+uint32_t clocksource_tsc_khz(void);
+int clocksource_tsc_invariant(void);
+void clocksource_params(uint32_t* mult, uint32_t* shift, uint64_t* base);
+
+/* Port I/O */
+static inline void outb(uint16_t port, uint8_t value) {
+    __asm__ __volatile__("outb %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    __asm__ __volatile__("inb %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+/* CPUID and RDTSC support */
+static inline uint64_t rdtsc(void) {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    __asm__ __volatile__("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+/* 64-by-32 division by shift and subtract; there is no libgcc to call */
+static uint64_t div_u64(uint64_t dividend, uint32_t divisor) {
+    uint64_t quotient = 0;
+    uint64_t remainder = 0;
+    
+    for (int bit = 63; bit >= 0; bit--) {
+        remainder = (remainder << 1) | ((dividend >> bit) & 1);
+        if (remainder >= divisor) {
+            remainder -= divisor;
+            quotient |= 1ull << bit;
+        }
+    }
+    return quotient;
+}
+
+/* TSC cycles elapsed while PIT channel 2 counts down one calibration window */
+static uint32_t calibrate_once(void) {
+    /* Gate channel 2 on with the speaker disconnected */
+    outb(PIT_PORT_B, (inb(PIT_PORT_B) & ~PIT_SPEAKER) | PIT_GATE2);
+    
+    /* Mode 0: OUT2 goes high when the count reaches zero */
+    outb(PIT_COMMAND_PORT, 0xB0);
+    outb(PIT_CHANNEL2, CALIBRATE_LATCH & 0xFF);
+    outb(PIT_CHANNEL2, (CALIBRATE_LATCH >> 8) & 0xFF);
+    
+    uint64_t start = rdtsc();
+    while (!(inb(PIT_PORT_B) & PIT_OUT2)) {
+    }
+    uint64_t end = rdtsc();
+    
+    return (uint32_t)(end - start);
+}
+
+/* Detect and calibrate the TSC; ktime_ns reads 0 on CPUs without one */
+void clocksource_init(void) {
+    uint32_t eax, ebx, ecx, edx;
+    
+    tsc_khz = 0;
+    tsc_mult = 0;
+    tsc_base = 0;
+    tsc_invariant = 0;
+    
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax < 1) {
+        return;
+    }
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (!(edx & CPUID_EDX_TSC)) {
+        return;
+    }
+    
+    /* Invariant TSC ticks at a constant rate across P-, C- and T-states */
+    cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000007) {
+        cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+        tsc_invariant = (edx & CPUID_EXT_EDX_INVARIANT_TSC) != 0;
+    }
+    
+    /* Keep the shortest run; longer ones were stretched by SMIs or emulation */
+    uint32_t flags;
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    uint32_t best = 0xFFFFFFFF;
+    for (int i = 0; i < CALIBRATE_RUNS; i++) {
+        uint32_t cycles = calibrate_once();
+        if (cycles < best) {
+            best = cycles;
+        }
+    }
+    __asm__ __volatile__("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+    
+    tsc_khz = best / CALIBRATE_MS;
+    if (tsc_khz == 0) {
+        return;
+    }
+    tsc_mult = (uint32_t)div_u64(1000000ull << CLOCK_SHIFT, tsc_khz);
+    tsc_base = rdtsc();
+}
+
+/* Nanoseconds since clocksource_init */
+uint64_t ktime_ns(void) {
+    if (!tsc_mult) {
+        return 0;
+    }
+    
+    /* Split the product so it cannot overflow 64 bits */
+    uint64_t cycles = rdtsc() - tsc_base;
+    uint64_t low = (uint64_t)(uint32_t)cycles * tsc_mult;
+    uint64_t high = (uint64_t)(uint32_t)(cycles >> 32) * tsc_mult;
+    return (low >> CLOCK_SHIFT) + (high << (32 - CLOCK_SHIFT));
+}
+
+/* Milliseconds since clocksource_init, for coarse timestamps */
+uint32_t ktime_ms(void) {
+    return (uint32_t)div_u64(ktime_ns(), 1000000);
+}
+
+uint32_t clocksource_tsc_khz(void) {
+    return tsc_khz;
+}
+
+int clocksource_tsc_invariant(void) {
+    return tsc_invariant;
+}
+
+/* Conversion parameters, for readers that compute ktime_ns themselves */
+void clocksource_params(uint32_t* mult, uint32_t* shift, uint64_t* base) {
+    *mult = tsc_mult;
+    *shift = CLOCK_SHIFT;
+    *base = tsc_base;
+}
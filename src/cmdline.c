@@ -0,0 +1,155 @@
+/*
+ * Tiny Operating System - Kernel Command Line
+ * A floppy boot has no loader to pass one, so the command line comes from
+ * QEMU's firmware configuration device instead:
+ *   -fw_cfg name=opt/tinyos/cmdline,string="shard=1/4"
+ * Words are key=value pairs separated by spaces. Without the device, or
+ * without the file, the command line is empty.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FW_CFG_SELECTOR 0x510          /* 16-bit key writes */
+#define FW_CFG_DATA 0x511              /* Byte reads from the selected item */
+#define FW_CFG_SIGNATURE 0x0000
+#define FW_CFG_FILE_DIR 0x0019
+#define FW_CFG_FILE_NAME 56
+
+#define CMDLINE_FILE "opt/tinyos/cmdline"
+#define CMDLINE_MAX 256
+
+static char cmdline[CMDLINE_MAX];
+static int cmdline_read;
+
+/* Function prototypes */
+const char* cmdline_get(void);
+const char* cmdline_find(const char* key);
+int cmdline_shard(uint32_t* index, uint32_t* count);
+
+static inline void outw(uint16_t port, uint16_t value) {
+    __asm__ __volatile__("outw %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    __asm__ __volatile__("inb %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+/* The next size bytes of the selected item, big-endian as the file directory stores them */
+static uint32_t fw_cfg_read_be(uint32_t size) {
+    uint32_t value = 0;
+    while (size--) {
+        value = value << 8 | inb(FW_CFG_DATA);
+    }
+    return value;
+}
+
+/* The file's key and size from the directory; 0 when it is not there */
+static uint16_t fw_cfg_find(const char* name, uint32_t* size) {
+    outw(FW_CFG_SELECTOR, FW_CFG_SIGNATURE);
+    if (inb(FW_CFG_DATA) != 'Q' || inb(FW_CFG_DATA) != 'E' || inb(FW_CFG_DATA) != 'M' || inb(FW_CFG_DATA) != 'U') {
+        return 0;
+    }
+    outw(FW_CFG_SELECTOR, FW_CFG_FILE_DIR);
+    uint32_t files = fw_cfg_read_be(4);
+    while (files--) {
+        char entry[FW_CFG_FILE_NAME];
+        uint32_t file_size = fw_cfg_read_be(4);
+        uint16_t select = (uint16_t)fw_cfg_read_be(2);
+        fw_cfg_read_be(2);
+        for (uint32_t i = 0; i < FW_CFG_FILE_NAME; i++) {
+            entry[i] = (char)inb(FW_CFG_DATA);
+        }
+        uint32_t i = 0;
+        while (i < FW_CFG_FILE_NAME - 1 && name[i] && entry[i] == name[i]) {
+            i++;
+        }
+        if (!name[i] && !entry[i]) {
+            *size = file_size;
+            return select;
+        }
+    }
+    return 0;
+}
+
+/* The file up to its NUL, cut to CMDLINE_MAX - 1 characters */
+static void cmdline_load(void) {
+    cmdline_read = 1;
+    uint32_t size = 0;
+    uint16_t select = fw_cfg_find(CMDLINE_FILE, &size);
+    if (!select) {
+        return;
+    }
+    outw(FW_CFG_SELECTOR, select);
+    uint32_t len = 0;
+    while (len < size && len < CMDLINE_MAX - 1) {
+        char c = (char)inb(FW_CFG_DATA);
+        if (!c) {
+            break;
+        }
+        cmdline[len++] = c;
+    }
+    cmdline[len] = '\0';
+}
+
+/* The whole command line, "" when there is none */
+const char* cmdline_get(void) {
+    if (!cmdline_read) {
+        cmdline_load();
+    }
+    return cmdline;
+}
+
+/* The value of key=value, ending at a space or the end; NULL when key is not given */
+const char* cmdline_find(const char* key) {
+    const char* word = cmdline_get();
+    while (*word) {
+        while (*word == ' ') {
+            word++;
+        }
+        uint32_t i = 0;
+        while (key[i] && word[i] == key[i]) {
+            i++;
+        }
+        if (!key[i] && word[i] == '=') {
+            return word + i + 1;
+        }
+        while (*word && *word != ' ') {
+            word++;
+        }
+    }
+    return NULL;
+}
+
+/* A decimal number at text; returns where it ends, or NULL when there are no digits */
+static const char* cmdline_number(const char* text, uint32_t* value) {
+    if (*text < '0' || *text > '9') {
+        return NULL;
+    }
+    *value = 0;
+    while (*text >= '0' && *text <= '9') {
+        *value = *value * 10 + (uint32_t)(*text++ - '0');
+    }
+    return text;
+}
+
+/*
+ * shard=I/N: this boot runs the I-th of N slices of a test list, counting
+ * from 0. Without it, or with a malformed one, the only shard is 0 of 1.
+ * Returns 0 when the command line selected a shard.
+ */
+int cmdline_shard(uint32_t* index, uint32_t* count) {
+    *index = 0;
+    *count = 1;
+    const char* value = cmdline_find("shard");
+    uint32_t i, n;
+    if (!value || !(value = cmdline_number(value, &i)) || *value != '/' ||
+        !(value = cmdline_number(value + 1, &n)) || (*value && *value != ' ') || !n || i >= n) {
+        return -1;
+    }
+    *index = i;
+    *count = n;
+    return 0;
+}
@@ -48,6 +48,7 @@
 #define MAX_TESTS 256
 #define STRESS_TEST_ITERATIONS 10000
 #define MEMORY_TEST_SIZE (1024 * 1024) /* 1MB for memory tests */
+#define TEST_EXPORT_LINE 160
 
 /* Test result structure */
 typedef struct {
@@ -57,6 +58,7 @@ typedef struct {
     int failed;
     uint32_t execution_time;
     uint32_t memory_used;
+    int fail_line;                      /* Of the assertion that failed last */
 } test_case_t;
 
 /* Stress test configuration */
@@ -82,6 +84,146 @@ typedef struct {
     uint32_t warning_count;
 } test_metrics_t;
 
+/* Micro-benchmarks (bench.c) */
+#define BENCH(name) static void bench_##name(uint32_t iterations)
+
+/* Cycles per iteration (must match bench.c) */
+struct bench_result {
+    uint32_t iterations;
+    uint32_t min;
+    uint32_t median;
+    uint32_t p99;
+};
+
+extern int bench_register(const char* name, void (*run)(uint32_t iterations));
+extern int bench_run(uint32_t id, struct bench_result* result);
+
+/* Allocator benchmark (alloc_bench.c) */
+#define ALLOC_PROFILE_MIXED 0           /* Must match alloc_bench.c */
+#define ALLOC_PROFILE_SMALL 1
+
+/* An allocator under test (must match alloc_bench.c) */
+struct alloc_ops {
+    const char* name;
+    void* (*alloc)(uint32_t size);
+    void (*free)(void* ptr, uint32_t size);
+    uint32_t (*footprint)(void);
+    uint32_t (*free_space)(uint32_t* largest);
+};
+
+/* What one replay measured (must match alloc_bench.c) */
+struct alloc_bench_result {
+    uint32_t ops;
+    uint32_t failures;
+    uint32_t mean_cycles;
+    uint32_t worst_cycles;
+    uint32_t ops_per_sec;
+    uint32_t peak_live;
+    uint32_t peak_footprint;
+    uint32_t fragmentation;
+};
+
+extern int alloc_bench_run(const struct alloc_ops* ops, uint32_t profile, uint32_t tsc_khz,
+                           struct alloc_bench_result* result);
+
+/* Monotonic clock (clocksource.c) */
+extern uint32_t clocksource_tsc_khz(void);
+
+/* Kernel heap (kernel_heap.c) */
+extern void* malloc(uint32_t size);
+extern void free(void* ptr);
+extern uint32_t heap_footprint(void);
+extern uint32_t heap_free_space(uint32_t* largest);
+
+/* Kernel runtime library (klib.c) */
+extern char* klib_puts(char* out, const char* text, uint32_t width);
+extern char* klib_putu(char* out, uint32_t value, uint32_t width);
+
+/* Size-class pool and slab caches (performance_tuning.c) */
+#define PRIORITY_NORMAL 2               /* Must match process_priority_t there */
+typedef struct kmem_cache kmem_cache_t;
+extern void* optimized_malloc(uint32_t size, int priority);
+extern void optimized_free(void* ptr, int priority);
+extern uint32_t optimized_pool_footprint(void);
+extern uint32_t optimized_pool_free_space(uint32_t* largest);
+extern kmem_cache_t* kmem_cache_create(const char* name, uint32_t size, void (*ctor)(void* object));
+extern void* kmem_cache_alloc(kmem_cache_t* cache);
+extern void kmem_cache_free(kmem_cache_t* cache, void* object);
+extern uint32_t kmem_cache_footprint(const kmem_cache_t* cache);
+extern uint32_t kmem_cache_free_space(const kmem_cache_t* cache);
+
+/* Scheduler workload replay (performance_tuning.c) */
+#define PRIORITY_IDLE 0                 /* Must match process_priority_t there */
+
+/* A replayed task (must match performance_tuning.c) */
+struct sched_sim_task {
+    uint32_t arrival;
+    uint32_t priority;
+    uint32_t fair;
+    int32_t nice;
+    uint32_t bursts;
+    uint32_t burst;
+    uint32_t block;
+};
+
+/* What a replay measured (must match performance_tuning.c) */
+struct sched_sim_result {
+    uint32_t finished;
+    uint32_t makespan;
+    uint32_t turnaround_mean;
+    uint32_t turnaround_max;
+    uint32_t response_mean;
+    uint32_t response_max;
+    uint32_t fairness;
+    uint32_t starvation_preventions;
+    uint32_t context_switches;
+};
+
+extern int sched_sim_run(const char* name, const struct sched_sim_task* trace, uint32_t count,
+                         struct sched_sim_result* result);
+
+/* Workqueues (performance_tuning.c) */
+#define PRIORITY_LOW 1                  /* Must match process_priority_t there */
+typedef struct workqueue workqueue_t;
+
+/* Timer wheel entry (must match struct timer in timer_wheel.c) */
+struct timer {
+    struct timer* next;
+    struct timer** pprev;
+    uint32_t expires;
+    void (*callback)(void* data);
+    void* data;
+};
+
+/* Deferred function call (must match performance_tuning.c) */
+typedef struct work {
+    struct work* next;
+    void (*func)(struct work* work);
+    uint32_t pending;
+} work_t;
+
+/* Work queued once its timer fires (must match performance_tuning.c) */
+typedef struct delayed_work {
+    work_t work;
+    struct timer timer;
+    workqueue_t* wq;
+} delayed_work_t;
+
+extern workqueue_t* create_workqueue(const char* name, uint32_t priority, uint32_t max_active);
+extern void init_work(work_t* work, void (*func)(work_t* work));
+extern int queue_work(workqueue_t* wq, work_t* work);
+extern void init_delayed_work(delayed_work_t* dwork, void (*func)(work_t* work));
+extern int queue_delayed_work(workqueue_t* wq, delayed_work_t* dwork, uint32_t delay);
+extern int cancel_delayed_work(delayed_work_t* dwork);
+extern void flush_workqueue(workqueue_t* wq);
+extern uint32_t workqueue_completed(const workqueue_t* wq);
+
+/* MWAIT idle (performance_tuning.c) */
+extern int cpu_idle_select(uint32_t predicted_us);
+
+/* Kernel command line (cmdline.c) */
+extern int cmdline_shard(uint32_t* index, uint32_t* count);
+
 /* Global test state */
 static test_case_t tests[MAX_TESTS];
 static uint32_t test_count = 0;
@@ -89,6 +231,8 @@ static test_metrics_t test_metrics;
 static int test_failed = 0;
 static int test_fail_line = 0;
 static uint8_t test_running = 0;
+static uint32_t test_shard = 0;         /* This boot runs tests[i] where i % test_shards == test_shard */
+static uint32_t test_shards = 1;
 
 /* Memory for testing */
 static uint8_t test_memory[MEMORY_TEST_SIZE];
@@ -137,6 +281,7 @@ void register_test(const char* name, void (*test_func)(void)) {
         tests[test_count].failed = 0;
         tests[test_count].execution_time = 0;
         tests[test_count].memory_used = 0;
+        tests[test_count].fail_line = 0;
         test_count++;
     }
 }
@@ -603,26 +748,205 @@ void test_error_recovery(void) {
     TEST_ASSERT(error_count == 0); /* All errors recovered */
 }
 
-void test_performance_benchmarks(void) {
-    /* Test performance benchmarks */
-    uint64_t start_time = get_timestamp();
-    uint32_t operations = 10000;
-    
-    /* Perform benchmark operations */
-    for (uint32_t i = 0; i < operations; i++) {
-        /* Simulate operation */
-        volatile uint32_t result = i * i;
-        (void)result; /* Prevent optimization */
+/* A page copied through the test heap: the bench harness scales, warms up and samples it */
+BENCH(page_copy) {
+    static uint8_t page[4096];
+    uint8_t* copy = test_memory + MEMORY_TEST_SIZE - sizeof(page);
+    for (uint32_t i = 0; i < iterations; i++) {
+        memcpy(copy, page, sizeof(page));
+        __asm__ __volatile__("" : : "r"(copy) : "memory");
+    }
+}
+
+/* The allocators behind the replay's interface */
+static void heap_bench_free(void* ptr, uint32_t size) {
+    (void)size;
+    free(ptr);
+}
+
+static void* pool_bench_alloc(uint32_t size) {
+    return optimized_malloc(size, PRIORITY_NORMAL);
+}
+
+static void pool_bench_free(void* ptr, uint32_t size) {
+    (void)size;
+    optimized_free(ptr, PRIORITY_NORMAL);
+}
+
+/* Slab caches by power of two from 16 to 256 bytes, as a kmalloc would put them in front */
+#define SLAB_BENCH_CLASSES 5
+static kmem_cache_t* slab_bench_caches[SLAB_BENCH_CLASSES];
+
+static kmem_cache_t* slab_bench_cache(uint32_t size) {
+    uint32_t cls = 0;
+    while ((16u << cls) < size) {
+        cls++;
+    }
+    return cls < SLAB_BENCH_CLASSES ? slab_bench_caches[cls] : NULL;
+}
+
+static void* slab_bench_alloc(uint32_t size) {
+    kmem_cache_t* cache = slab_bench_cache(size);
+    return cache ? kmem_cache_alloc(cache) : NULL;
+}
+
+static void slab_bench_free(void* ptr, uint32_t size) {
+    kmem_cache_free(slab_bench_cache(size), ptr);
+}
+
+static uint32_t slab_bench_footprint(void) {
+    uint32_t bytes = 0;
+    for (uint32_t i = 0; i < SLAB_BENCH_CLASSES; i++) {
+        bytes += kmem_cache_footprint(slab_bench_caches[i]);
+    }
+    return bytes;
+}
+
+/* A free object only serves its own class, but never splits: the waste shows in the footprint instead */
+static uint32_t slab_bench_free_space(uint32_t* largest) {
+    uint32_t bytes = 0;
+    for (uint32_t i = 0; i < SLAB_BENCH_CLASSES; i++) {
+        bytes += kmem_cache_free_space(slab_bench_caches[i]);
+    }
+    *largest = bytes;
+    return bytes;
+}
+
+/*
+ * test_memory_allocation_stress and test_memory_pressure run on the bump
+ * allocator, which never frees; this replays realistic traces, frees
+ * included, against the kernel allocators themselves
+ */
+void test_allocator_benchmark(void) {
+    static const char* slab_names[SLAB_BENCH_CLASSES] = {
+        "bench-16", "bench-32", "bench-64", "bench-128", "bench-256"
+    };
+    for (uint32_t i = 0; i < SLAB_BENCH_CLASSES; i++) {
+        if (!slab_bench_caches[i]) {
+            slab_bench_caches[i] = kmem_cache_create(slab_names[i], 16u << i, NULL);
+        }
+        TEST_ASSERT_NOT_NULL(slab_bench_caches[i]);
     }
     
-    uint64_t end_time = get_timestamp();
-    uint64_t elapsed_time = end_time - start_time;
-    
-    TEST_ASSERT(elapsed_time > 0);
-    
-    /* Calculate operations per second */
-    uint64_t ops_per_second = (operations * 1000) / elapsed_time;
-    TEST_ASSERT(ops_per_second > 1000); /* Should be at least 1000 ops/sec */
+    static const struct alloc_ops allocators[] = {
+        { "tlsf heap", malloc, heap_bench_free, heap_footprint, heap_free_space },
+        { "size pool", pool_bench_alloc, pool_bench_free, optimized_pool_footprint, optimized_pool_free_space },
+        { "slab", slab_bench_alloc, slab_bench_free, slab_bench_footprint, slab_bench_free_space },
+    };
+    uint32_t khz = clocksource_tsc_khz();
+    for (uint32_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+        struct alloc_bench_result result;
+        for (uint32_t profile = ALLOC_PROFILE_MIXED; profile <= ALLOC_PROFILE_SMALL; profile++) {
+            if (allocators[i].alloc == slab_bench_alloc && profile == ALLOC_PROFILE_MIXED) {
+                continue;                       /* Caches stop at 256 bytes */
+            }
+            TEST_ASSERT_EQUAL(0, alloc_bench_run(&allocators[i], profile, khz, &result));
+            TEST_ASSERT(result.ops > 0);
+            TEST_ASSERT(result.peak_footprint >= result.peak_live);
+            TEST_ASSERT(result.mean_cycles <= result.worst_cycles);
+            TEST_ASSERT(result.fragmentation <= 100);
+        }
+    }
+}
+
+/*
+ * A replay reads no clock, so the same trace must give the same decisions
+ * twice over; an interactive task among hogs and an idle-level task that
+ * only aging can run
+ */
+void test_scheduler_replay(void) {
+    static const struct sched_sim_task trace[] = {
+        { 0, PRIORITY_NORMAL, 0, 0, 1, 50000, 0 },
+        { 0, PRIORITY_NORMAL, 0, 0, 1, 50000, 0 },
+        { 0, PRIORITY_IDLE, 0, 0, 1, 5000, 0 },
+        { 1000, PRIORITY_NORMAL, 0, 0, 10, 500, 2000 },
+        { 2000, PRIORITY_NORMAL, 1, 0, 1, 20000, 0 },
+        { 2000, PRIORITY_NORMAL, 1, 10, 1, 20000, 0 },
+    };
+    uint32_t count = sizeof(trace) / sizeof(trace[0]);
+    struct sched_sim_result first, second;
+    TEST_ASSERT_EQUAL(0, sched_sim_run("test", trace, count, &first));
+    TEST_ASSERT_EQUAL(0, sched_sim_run("test", trace, count, &second));
+    
+    const uint32_t* a = (const uint32_t*)&first;
+    const uint32_t* b = (const uint32_t*)&second;
+    for (uint32_t i = 0; i < sizeof(first) / sizeof(uint32_t); i++) {
+        TEST_ASSERT_EQUAL(a[i], b[i]);
+    }
+    TEST_ASSERT_EQUAL(count, first.finished);
+    TEST_ASSERT(first.starvation_preventions > 0);
+    TEST_ASSERT(first.response_mean <= first.response_max);
+    TEST_ASSERT(first.turnaround_mean <= first.turnaround_max && first.turnaround_max <= first.makespan);
+    TEST_ASSERT(first.fairness > 0 && first.fairness <= 100);
+}
+
+static volatile uint32_t workqueue_test_runs;
+
+static void workqueue_test_func(work_t* work) {
+    (void)work;
+    workqueue_test_runs++;
+}
+
+/* Work queued twice before it starts runs once; delayed work waits on its timer until cancelled */
+void test_workqueue(void) {
+    static workqueue_t* wq;
+    static work_t work;
+    static delayed_work_t dwork;
+    if (!wq) {
+        wq = create_workqueue("test", PRIORITY_LOW, 2);
+    }
+    TEST_ASSERT(wq != NULL);
+    
+    workqueue_test_runs = 0;
+    uint32_t completed = workqueue_completed(wq);
+    init_work(&work, workqueue_test_func);
+    TEST_ASSERT_EQUAL(1, queue_work(wq, &work));
+    TEST_ASSERT_EQUAL(0, queue_work(wq, &work));
+    flush_workqueue(wq);
+    TEST_ASSERT_EQUAL(1, workqueue_test_runs);
+    TEST_ASSERT_EQUAL(completed + 1, workqueue_completed(wq));
+    TEST_ASSERT_EQUAL(0, work.pending);
+    
+    init_delayed_work(&dwork, workqueue_test_func);
+    TEST_ASSERT_EQUAL(1, queue_delayed_work(wq, &dwork, 100000));
+    TEST_ASSERT_EQUAL(0, queue_delayed_work(wq, &dwork, 100000));
+    TEST_ASSERT_EQUAL(1, cancel_delayed_work(&dwork));
+    TEST_ASSERT_EQUAL(0, cancel_delayed_work(&dwork));
+    flush_workqueue(wq);
+    TEST_ASSERT_EQUAL(1, workqueue_test_runs);
+    
+    /* No delay queues it at once */
+    TEST_ASSERT_EQUAL(1, queue_delayed_work(wq, &dwork, 0));
+    flush_workqueue(wq);
+    TEST_ASSERT_EQUAL(2, workqueue_test_runs);
+}
+
+/* Longer predicted idle never picks a shallower C-state, and a short one gets C1 */
+void test_idle_state_selection(void) {
+    int previous = cpu_idle_select(0);
+    if (previous < 0) {
+        /* No MWAIT: nothing is ever selected */
+        TEST_ASSERT_EQUAL(-1, cpu_idle_select(1000000));
+        return;
+    }
+    TEST_ASSERT_EQUAL(0, previous);
+    for (uint32_t predicted = 1; predicted <= 1000000; predicted *= 2) {
+        int state = cpu_idle_select(predicted);
+        TEST_ASSERT(state >= previous);
+        previous = state;
+    }
+}
+
+void test_performance_benchmarks(void) {
+    struct bench_result result;
+    int id = bench_register("page copy", bench_page_copy);
+    TEST_ASSERT(id >= 0);
+    TEST_ASSERT_EQUAL(0, bench_run((uint32_t)id, &result));
+    
+    /* Statistics of sorted samples, and a copy that cannot be free */
+    TEST_ASSERT(result.iterations > 0);
+    TEST_ASSERT(result.min <= result.median && result.median <= result.p99);
+    TEST_ASSERT(result.median > 0);
 }
 
 /* Test runner functions */
@@ -645,6 +969,7 @@ void run_single_test(test_case_t* test) {
     
     if (test_failed) {
         test->failed++;
+        test->fail_line = test_fail_line;
         test_metrics.tests_failed++;
         test_metrics.error_count++;
     } else {
@@ -688,13 +1013,16 @@ void run_comprehensive_test_suite(void) {
     memset(&test_metrics, 0, sizeof(test_metrics));
     test_memory_allocated = 0;
     
-    /* Run all registered tests */
-    for (uint32_t i = 0; i < test_count; i++) {
+    /* Run this boot's shard of the registered tests: all of them unless the command line splits them */
+    cmdline_shard(&test_shard, &test_shards);
+    for (uint32_t i = test_shard; i < test_count; i += test_shards) {
         run_single_test(&tests[i]);
     }
     
-    /* Run stress tests */
-    run_stress_tests();
+    /* Run stress tests, in the first shard only */
+    if (test_shard == 0) {
+        run_stress_tests();
+    }
     
     /* Calculate peak memory usage */
     test_metrics.memory_peak_usage = test_memory_allocated;
@@ -706,6 +1034,45 @@ void run_comprehensive_test_suite(void) {
     test_metrics.network_throughput = 100; /* 100 Mbps simulated */
 }
 
+/*
+ * The tests this boot ran, one JSON object per line, for the host to merge
+ * with the other shards:
+ * {"suite":"comprehensive","test":"name","shard":I,"passed":0|1,"line":N}
+ * then {"suite":"comprehensive","shard":I,"shards":N,"done":count}, whose
+ * absence tells the host the shard died. Returns how many lines were emitted.
+ */
+uint32_t test_export(void (*emit)(const void* data, uint32_t size)) {
+    char line[TEST_EXPORT_LINE];
+    uint32_t ran = 0;
+    
+    for (uint32_t i = test_shard; i < test_count; i += test_shards) {
+        if (!tests[i].passed && !tests[i].failed) {
+            continue;
+        }
+        char* out = klib_puts(line, "{\"suite\":\"comprehensive\",\"test\":\"", 0);
+        out = klib_puts(out, tests[i].name, 0);
+        out = klib_puts(out, "\",\"shard\":", 0);
+        out = klib_putu(out, test_shard, 0);
+        out = klib_puts(out, ",\"passed\":", 0);
+        out = klib_putu(out, tests[i].failed ? 0 : 1, 0);
+        out = klib_puts(out, ",\"line\":", 0);
+        out = klib_putu(out, (uint32_t)tests[i].fail_line, 0);
+        out = klib_puts(out, "}\n", 0);
+        emit(line, (uint32_t)(out - line));
+        ran++;
+    }
+    
+    char* out = klib_puts(line, "{\"suite\":\"comprehensive\",\"shard\":", 0);
+    out = klib_putu(out, test_shard, 0);
+    out = klib_puts(out, ",\"shards\":", 0);
+    out = klib_putu(out, test_shards, 0);
+    out = klib_puts(out, ",\"done\":", 0);
+    out = klib_putu(out, ran, 0);
+    out = klib_puts(out, "}\n", 0);
+    emit(line, (uint32_t)(out - line));
+    return ran + 1;
+}
+
 /* Test main function */
 void test_main(void) {
     /* Register all tests */
@@ -729,6 +1096,10 @@ void test_main(void) {
     register_test("Full System Integration", test_full_system_integration);
     register_test("Error Recovery", test_error_recovery);
     register_test("Performance Benchmarks", test_performance_benchmarks);
+    register_test("Allocator Benchmark", test_allocator_benchmark);
+    register_test("Scheduler Replay", test_scheduler_replay);
+    register_test("Workqueue", test_workqueue);
+    register_test("Idle State Selection", test_idle_state_selection);
     
     /* Run comprehensive test suite */
     run_comprehensive_test_suite();
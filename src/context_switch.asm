@@ -0,0 +1,55 @@
+;
+; Tiny Operating System - Context Switch
+; Kernel stack switch between two tasks
+;
+
+[bits 32]
+
+; struct cpu_context offsets (must match cpu_context_t in performance_tuning.c)
+CONTEXT_ESP  equ 0
+CONTEXT_CR3  equ 4
+CONTEXT_ESP0 equ 8
+
+; Points at the TSS esp0 field, or 0 if there is no ring 3 to return to
+extern tss_esp0_ptr
+
+; void switch_to(cpu_context_t* prev, cpu_context_t* next)
+global switch_to
+switch_to:
+    mov eax, [esp+4]    ; prev
+    mov edx, [esp+8]    ; next
+
+    ; Save callee-saved registers and flags on the outgoing stack
+    push ebp
+    push ebx
+    push esi
+    push edi
+    pushfd
+    mov [eax+CONTEXT_ESP], esp
+
+    ; Change address space only when it differs
+    mov ecx, [edx+CONTEXT_CR3]
+    test ecx, ecx
+    jz .same_space
+    mov eax, cr3
+    cmp eax, ecx
+    je .same_space
+    mov cr3, ecx
+.same_space:
+
+    ; Ring 3 interrupts of the incoming task land on its kernel stack
+    mov ecx, [tss_esp0_ptr]
+    test ecx, ecx
+    jz .no_tss
+    mov eax, [edx+CONTEXT_ESP0]
+    mov [ecx], eax
+.no_tss:
+
+    ; Resume the incoming task where it last called switch_to
+    mov esp, [edx+CONTEXT_ESP]
+    popfd
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ret
@@ -0,0 +1,167 @@
+;
+; Tiny Operating System - x86-64 Context Switch and System Call Entry
+; Kernel stack switch between two tasks, the SYSCALL entry point, and
+; the SYSRET drop to ring 3
+;
+
+[bits 64]
+
+; struct cpu_context64 offsets (must match kernel64.c)
+CONTEXT_RSP equ 0
+CONTEXT_CR3 equ 8
+CONTEXT_KERNEL_STACK equ 16
+
+USER_RFLAGS equ 0x002               ; Ring 3 runs with IF clear: this stage has no IDT
+
+section .text
+
+; Top of the stack SYSCALL switches to: the running task's kernel stack
+global syscall_kernel_rsp
+extern syscall_dispatch64
+
+; void switch_to64(struct cpu_context64* prev, struct cpu_context64* next)
+global switch_to64
+switch_to64:
+    ; Save callee-saved registers and flags on the outgoing stack
+    push rbp
+    push rbx
+    push r12
+    push r13
+    push r14
+    push r15
+    pushfq
+    mov [rdi + CONTEXT_RSP], rsp
+
+    ; Change address space only when it differs; CR3 reads back without
+    ; the no-flush bit a PCID-tagged value carries
+    mov rcx, [rsi + CONTEXT_CR3]
+    test rcx, rcx
+    jz .same_space
+    mov rax, cr3
+    mov rdx, rcx
+    btr rdx, 63
+    cmp rax, rdx
+    je .same_space
+    mov cr3, rcx
+.same_space:
+
+    ; System calls of the incoming task land on its kernel stack
+    mov rax, [rsi + CONTEXT_KERNEL_STACK]
+    test rax, rax
+    jz .no_stack
+    mov [rel syscall_kernel_rsp], rax
+.no_stack:
+
+    ; Resume the incoming task where it last called switch_to64
+    mov rsp, [rsi + CONTEXT_RSP]
+    popfq
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbx
+    pop rbp
+    ret
+
+; SYSCALL lands here with the user RIP in RCX and RFLAGS in R11, still on
+; the user stack. RAX is the number, RDI, RSI, RDX the arguments; every
+; register but RAX, RCX and R11 comes back as it was.
+global syscall_entry64
+syscall_entry64:
+    mov [rel syscall_user_rsp], rsp
+    mov rsp, [rel syscall_kernel_rsp]
+    push qword [rel syscall_user_rsp]
+    push rcx
+    push r11
+    push rdi
+    push rsi
+    push rdx
+    push r8
+    push r9
+    push r10
+    sub rsp, 8                  ; 16-byte aligned for the call
+
+    ; syscall_dispatch64(number, arg0, arg1, arg2)
+    mov rcx, rdx
+    mov rdx, rsi
+    mov rsi, rdi
+    mov rdi, rax
+    call syscall_dispatch64
+
+    add rsp, 8
+    pop r10
+    pop r9
+    pop r8
+    pop rdx
+    pop rsi
+    pop rdi
+    pop r11
+    pop rcx
+    pop rsp
+    o64 sysret
+
+; uint64_t enter_user64(uint64_t entry, uint64_t user_stack)
+; Runs ring 3 code until it exits; returns its exit status
+global enter_user64
+enter_user64:
+    push rbp
+    push rbx
+    push r12
+    push r13
+    push r14
+    push r15
+    mov [rel user_return_rsp], rsp
+    mov rcx, rdi
+    mov r11, USER_RFLAGS
+    mov rsp, rsi
+    o64 sysret
+
+; void exit_user64(uint64_t status)
+; From the exit system call: back out of enter_user64 with status
+global exit_user64
+exit_user64:
+    mov rax, rdi
+    mov rsp, [rel user_return_rsp]
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbx
+    pop rbp
+    ret
+
+; A ring 3 test program, position independent: kernel64.c copies it to a
+; user page. Writes a line, makes SYSCALL_ROUNDS empty calls, and exits.
+SYS64_WRITE equ 1               ; Must match kernel64.c
+SYS64_GETPID equ 39
+SYS64_EXIT equ 60
+SYSCALL_ROUNDS equ 1000
+
+global user64_program
+global user64_program_end
+user64_program:
+    lea rdi, [rel .message]
+    mov esi, .message_end - .message
+    mov eax, SYS64_WRITE
+    syscall
+    mov r12d, SYSCALL_ROUNDS
+.round:
+    mov eax, SYS64_GETPID
+    syscall
+    dec r12d
+    jnz .round
+    mov edi, SYSCALL_ROUNDS
+    mov eax, SYS64_EXIT
+    syscall
+.message:
+    db 'Hello from ring 3 in long mode', 10
+.message_end:
+user64_program_end:
+
+section .data
+syscall_kernel_rsp: dq 0
+syscall_user_rsp: dq 0
+user_return_rsp: dq 0
+
+; Mark the object as not needing an executable stack
+section .note.GNU-stack noalloc noexec nowrite progbits
@@ -0,0 +1,265 @@
+/*
+ * Tiny Operating System - Crash Dump
+ * When the kernel dies, stream its memory to COM1 for tools/crashdump.c
+ * to take apart offline: run QEMU with -serial file:crash.log. Everything
+ * after the code goes out, so the log ring, the trace rings, the process
+ * table and the heap arrive as they were; find each one with nm -S on the
+ * stage's .elf.
+ */
+
+#include <stdint.h>
+
+#define COM1_PORT 0x3F8                 /* Must match serial.c */
+#define UART_THR 0
+#define UART_IER 1
+#define UART_FCR 2
+#define UART_LCR 3
+#define UART_LSR 5
+#define UART_LSR_THRE 0x20
+#define UART_TX_FIFO 16
+
+#define CRASHDUMP_VERSION 1
+#define CRASHDUMP_FRAMES 16
+#define CRASHDUMP_REASON 64
+#define CRASHDUMP_NAME 16
+#define CRASHDUMP_REGIONS 8             /* Registered ones, besides the kernel's own memory */
+#define CRASHDUMP_BSS_BASE 0x100000     /* Must match -Tbss in the Makefile */
+
+/*
+ * The stream, little-endian: a header, then each region's header, its
+ * encoded bytes and the FNV-1a checksum of what they decode to, then an
+ * end marker. Regions are run-length encoded, which is cheap enough to
+ * run with nothing else working and shrinks the zeroes that most of a
+ * kernel's memory is: a control byte below 0x80 is followed by that many
+ * plus one literal bytes, one from 0x80 up by a byte to repeat that many
+ * less 0x80 plus three times. The encoding ends where size bytes have
+ * been decoded, so memory is read once, as it is sent: the stack this
+ * runs on is part of the dump and changes under it. (must match
+ * tools/crashdump.c)
+ */
+struct crashdump_header {
+    char magic[8];                      /* "TOSDUMP" */
+    uint32_t version;
+    uint32_t regions;
+    uint32_t eip;
+    uint32_t ebp;
+    uint32_t depth;
+    uint32_t frames[CRASHDUMP_FRAMES];  /* Return addresses above ebp, innermost first */
+    uint64_t tsc;
+    char reason[CRASHDUMP_REASON];
+} __attribute__((packed));
+
+struct crashdump_region_header {
+    char name[CRASHDUMP_NAME];
+    uint32_t base;
+    uint32_t size;                      /* Bytes the encoding that follows decodes to */
+} __attribute__((packed));
+
+struct crashdump_region {
+    const char* name;
+    const void* base;
+    uint32_t size;
+};
+
+static struct crashdump_region crashdump_regions[CRASHDUMP_REGIONS];
+static uint32_t crashdump_region_count;
+static volatile uint32_t crashdump_active;
+
+/* Where the code, the data and the image end (the linker's default script) */
+extern char etext[] __attribute__((weak));
+extern char _edata[] __attribute__((weak));
+extern char _end[] __attribute__((weak));
+
+/* Stack unwinder (unwind.c) */
+extern uint32_t unwind_stack(uint32_t ebp, uint32_t* frames, uint32_t max);
+
+/* Function prototypes */
+int crashdump_register(const char* name, const void* base, uint32_t size);
+void crashdump_write(const char* reason, uint32_t eip, uint32_t ebp);
+
+static inline void outb(uint16_t port, uint8_t value) {
+    __asm__ __volatile__("outb %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    __asm__ __volatile__("inb %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+/*
+ * Memory outside the kernel image worth having too, such as buffers at
+ * fixed physical addresses. Returns -1 when the table is full.
+ */
+int crashdump_register(const char* name, const void* base, uint32_t size) {
+    if (crashdump_region_count == CRASHDUMP_REGIONS) {
+        return -1;
+    }
+    crashdump_regions[crashdump_region_count].name = name;
+    crashdump_regions[crashdump_region_count].base = base;
+    crashdump_regions[crashdump_region_count].size = size;
+    crashdump_region_count++;
+    return 0;
+}
+
+/*
+ * Polled output straight to the UART: the serial ring and its interrupt
+ * cannot be trusted once the kernel has crashed. With no UART, LSR reads
+ * all ones and the bytes go nowhere.
+ */
+static void crashdump_uart_init(void) {
+    outb(COM1_PORT + UART_IER, 0x00);
+    outb(COM1_PORT + UART_LCR, 0x80);
+    outb(COM1_PORT + 0, 0x01);          /* 115200 baud */
+    outb(COM1_PORT + 1, 0x00);
+    outb(COM1_PORT + UART_LCR, 0x03);
+    outb(COM1_PORT + UART_FCR, 0x07);
+}
+
+static uint32_t crashdump_fifo_room;
+
+static void crashdump_putc(uint8_t byte) {
+    if (!crashdump_fifo_room) {
+        while (!(inb(COM1_PORT + UART_LSR) & UART_LSR_THRE)) {
+        }
+        crashdump_fifo_room = UART_TX_FIFO;
+    }
+    outb(COM1_PORT + UART_THR, byte);
+    crashdump_fifo_room--;
+}
+
+static void crashdump_put(const void* data, uint32_t size) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    while (size--) {
+        crashdump_putc(*bytes++);
+    }
+}
+
+#define FNV_OFFSET 0x811C9DC5
+#define FNV_PRIME 0x01000193
+
+/* Send count literal bytes, folding them into the checksum as they go */
+static uint32_t crashdump_literals(const uint8_t* data, uint32_t count, uint32_t hash) {
+    crashdump_putc((uint8_t)(count - 1));
+    while (count--) {
+        uint8_t byte = *data++;
+        crashdump_putc(byte);
+        hash = (hash ^ byte) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/* Run-length encode size bytes to the UART; returns the checksum of what was sent */
+static uint32_t crashdump_encode(const uint8_t* data, uint32_t size) {
+    uint32_t hash = FNV_OFFSET;
+    uint32_t literal = 0;               /* Pending literals end at i */
+    uint32_t i = 0;
+    while (i < size) {
+        uint8_t byte = data[i];
+        uint32_t run = 1;
+        while (i + run < size && run < 130 && data[i + run] == byte) {
+            run++;
+        }
+        if (run >= 3) {
+            if (literal) {
+                hash = crashdump_literals(data + i - literal, literal, hash);
+                literal = 0;
+            }
+            crashdump_putc((uint8_t)(0x80 + run - 3));
+            crashdump_putc(byte);
+            for (uint32_t n = 0; n < run; n++) {
+                hash = (hash ^ byte) * FNV_PRIME;
+            }
+            i += run;
+            continue;
+        }
+        literal++;
+        i++;
+        if (literal == 128) {
+            hash = crashdump_literals(data + i - literal, literal, hash);
+            literal = 0;
+        }
+    }
+    if (literal) {
+        hash = crashdump_literals(data + size - literal, literal, hash);
+    }
+    return hash;
+}
+
+static void crashdump_region(const char* name, const void* base, uint32_t size) {
+    struct crashdump_region_header header;
+    uint32_t i = 0;
+    for (; i < CRASHDUMP_NAME - 1 && name[i]; i++) {
+        header.name[i] = name[i];
+    }
+    for (; i < CRASHDUMP_NAME; i++) {
+        header.name[i] = '\0';
+    }
+    header.base = (uint32_t)(uintptr_t)base;
+    header.size = size;
+    crashdump_put(&header, sizeof(header));
+    uint32_t checksum = crashdump_encode((const uint8_t*)base, size);
+    crashdump_put(&checksum, sizeof(checksum));
+}
+
+/*
+ * Stream the dump: the registered regions, then the kernel's own memory,
+ * its data from the end of its code and its .bss above 1 MiB. Call with
+ * interrupts off, from the path that is about to halt; a crash while
+ * dumping does not start a second dump.
+ */
+void crashdump_write(const char* reason, uint32_t eip, uint32_t ebp) {
+    if (__atomic_exchange_n(&crashdump_active, 1, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    crashdump_uart_init();
+    crashdump_fifo_room = 0;
+
+    uint32_t image_start = (uint32_t)(uintptr_t)etext;
+    uint32_t image_end = (uint32_t)(uintptr_t)_edata;
+    uint32_t bss_end = (uint32_t)(uintptr_t)_end;
+    int image = image_start && image_end > image_start;
+    int bss = bss_end > CRASHDUMP_BSS_BASE;
+    struct crashdump_header header;
+    const char magic[8] = "TOSDUMP";
+    for (int i = 0; i < 8; i++) {
+        header.magic[i] = magic[i];
+    }
+    header.version = CRASHDUMP_VERSION;
+    header.regions = crashdump_region_count + (image ? 1 : 0) + (bss ? 1 : 0);
+    header.eip = eip;
+    header.ebp = ebp;
+    uint32_t frames[CRASHDUMP_FRAMES];
+    header.depth = unwind_stack(ebp, frames, CRASHDUMP_FRAMES);
+    for (uint32_t i = 0; i < CRASHDUMP_FRAMES; i++) {
+        header.frames[i] = i < header.depth ? frames[i] : 0;
+    }
+    header.tsc = rdtsc();
+    uint32_t len = 0;
+    for (; reason && reason[len] && len < CRASHDUMP_REASON - 1; len++) {
+        header.reason[len] = reason[len];
+    }
+    for (; len < CRASHDUMP_REASON; len++) {
+        header.reason[len] = '\0';
+    }
+    crashdump_put(&header, sizeof(header));
+
+    for (uint32_t i = 0; i < crashdump_region_count; i++) {
+        crashdump_region(crashdump_regions[i].name, crashdump_regions[i].base, crashdump_regions[i].size);
+    }
+    if (image) {
+        crashdump_region("kernel", etext, image_end - image_start);
+    }
+    if (bss) {
+        crashdump_region("bss", (const void*)CRASHDUMP_BSS_BASE, bss_end - CRASHDUMP_BSS_BASE);
+    }
+    crashdump_put("TOSDEND", 8);
+    while (!(inb(COM1_PORT + UART_LSR) & UART_LSR_THRE)) {
+    }
+}
@@ -0,0 +1,233 @@
+/*
+ * Tiny Operating System - CRC32C
+ * The Castagnoli CRC for integrity checks: the SSE4.2 crc32 instruction
+ * where the CPU has it, slice-by-8 tables where it does not. Both give the
+ * crc32c that iSCSI and ext4 use.
+ */
+
+#include <stdint.h>
+
+#define CRC32C_POLY 0x82F63B78          /* Reflected */
+#define CPUID_ECX_SSE42 (1u << 20)
+
+/*
+ * crc32 takes three cycles but issues every cycle, so the hardware path
+ * runs three streams over adjacent thirds of a chunk and merges them at
+ * the end. Advancing a CRC over n zero bytes is linear in its bits, so the
+ * merge is four table lookups per stream, tabulated for both chunk sizes.
+ */
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+/* x86 tolerates unaligned loads; tell the compiler so it does not assume alignment */
+typedef uint32_t __attribute__((may_alias, aligned(1))) unaligned_u32;
+
+static uint32_t crc32c_table[8][256];   /* Slice-by-8 */
+static uint32_t crc32c_long[4][256];    /* Advance over CRC32C_LONG zero bytes */
+static uint32_t crc32c_short[4][256];
+static volatile int crc32c_ready;
+static int crc32c_sse42;
+
+/* Function prototypes */
+uint32_t crc32c(uint32_t crc, const void* data, uint32_t size);
+int crc32c_hardware(void);
+
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    __asm__ __volatile__("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+static inline uint32_t crc32c_u8(uint32_t crc, uint8_t value) {
+    __asm__("crc32b %1, %0" : "+r"(crc) : "qm"(value));
+    return crc;
+}
+
+static inline uint32_t crc32c_u32(uint32_t crc, uint32_t value) {
+    __asm__("crc32l %1, %0" : "+r"(crc) : "rm"(value));
+    return crc;
+}
+
+/* Multiply vec by the 32x32 GF(2) matrix mat, one column per bit */
+static uint32_t gf2_matrix_times(const uint32_t* mat, uint32_t vec) {
+    uint32_t sum = 0;
+    while (vec) {
+        if (vec & 1) {
+            sum ^= *mat;
+        }
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t* square, const uint32_t* mat) {
+    for (uint32_t n = 0; n < 32; n++) {
+        square[n] = gf2_matrix_times(mat, mat[n]);
+    }
+}
+
+/* The operator advancing a CRC over size zero bytes, tabulated a byte of the CRC at a time */
+static void crc32c_zeros(uint32_t zeros[4][256], uint32_t size) {
+    uint32_t even[32], odd[32];
+
+    /* One zero bit, squared up to one zero byte */
+    odd[0] = CRC32C_POLY;
+    for (uint32_t n = 1; n < 32; n++) {
+        odd[n] = 1u << (n - 1);
+    }
+    gf2_matrix_square(even, odd);
+    gf2_matrix_square(odd, even);
+    gf2_matrix_square(even, odd);
+
+    /* Square once per bit of size, applying the bits that are set */
+    uint32_t op[32];
+    uint32_t* power = even;
+    uint32_t* spare = odd;
+    int have_op = 0;
+    while (size) {
+        if (size & 1) {
+            if (have_op) {
+                for (uint32_t n = 0; n < 32; n++) {
+                    spare[n] = gf2_matrix_times(power, op[n]);
+                }
+                for (uint32_t n = 0; n < 32; n++) {
+                    op[n] = spare[n];
+                }
+            } else {
+                for (uint32_t n = 0; n < 32; n++) {
+                    op[n] = power[n];
+                }
+                have_op = 1;
+            }
+        }
+        size >>= 1;
+        if (size) {
+            gf2_matrix_square(spare, power);
+            uint32_t* swap = power;
+            power = spare;
+            spare = swap;
+        }
+    }
+
+    for (uint32_t n = 0; n < 256; n++) {
+        zeros[0][n] = gf2_matrix_times(op, n);
+        zeros[1][n] = gf2_matrix_times(op, n << 8);
+        zeros[2][n] = gf2_matrix_times(op, n << 16);
+        zeros[3][n] = gf2_matrix_times(op, n << 24);
+    }
+}
+
+static inline uint32_t crc32c_shift(uint32_t zeros[4][256], uint32_t crc) {
+    return zeros[0][crc & 0xFF] ^ zeros[1][(crc >> 8) & 0xFF] ^
+           zeros[2][(crc >> 16) & 0xFF] ^ zeros[3][crc >> 24];
+}
+
+/* Build the tables on first use; racing CPUs compute the same values */
+static void crc32c_init(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = crc32c_table[0][n];
+        for (int k = 1; k < 8; k++) {
+            crc = crc32c_table[0][crc & 0xFF] ^ (crc >> 8);
+            crc32c_table[k][n] = crc;
+        }
+    }
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 1) {
+        cpuid(1, &eax, &ebx, &ecx, &edx);
+        crc32c_sse42 = (ecx & CPUID_ECX_SSE42) != 0;
+    }
+    if (crc32c_sse42) {
+        crc32c_zeros(crc32c_long, CRC32C_LONG);
+        crc32c_zeros(crc32c_short, CRC32C_SHORT);
+    }
+    crc32c_ready = 1;
+}
+
+/* Slice-by-8: eight table lookups per eight bytes */
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t* bytes, uint32_t size) {
+    while (size && ((uintptr_t)bytes & 3)) {
+        crc = crc32c_table[0][(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+        size--;
+    }
+    while (size >= 8) {
+        uint32_t low = *(const unaligned_u32*)bytes ^ crc;
+        uint32_t high = *(const unaligned_u32*)(bytes + 4);
+        crc = crc32c_table[7][low & 0xFF] ^ crc32c_table[6][(low >> 8) & 0xFF] ^
+              crc32c_table[5][(low >> 16) & 0xFF] ^ crc32c_table[4][low >> 24] ^
+              crc32c_table[3][high & 0xFF] ^ crc32c_table[2][(high >> 8) & 0xFF] ^
+              crc32c_table[1][(high >> 16) & 0xFF] ^ crc32c_table[0][high >> 24];
+        bytes += 8;
+        size -= 8;
+    }
+    while (size--) {
+        crc = crc32c_table[0][(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+/* Three streams over chunks of 3 * chunk bytes, merged through zeros */
+static const uint8_t* crc32c_hw_chunks(uint32_t* crc, const uint8_t* bytes, uint32_t* size,
+                                       uint32_t chunk, uint32_t zeros[4][256]) {
+    uint32_t crc0 = *crc;
+    while (*size >= 3 * chunk) {
+        uint32_t crc1 = 0, crc2 = 0;
+        const uint8_t* end = bytes + chunk;
+        do {
+            crc0 = crc32c_u32(crc0, *(const unaligned_u32*)bytes);
+            crc1 = crc32c_u32(crc1, *(const unaligned_u32*)(bytes + chunk));
+            crc2 = crc32c_u32(crc2, *(const unaligned_u32*)(bytes + 2 * chunk));
+            bytes += 4;
+        } while (bytes < end);
+        crc0 = crc32c_shift(zeros, crc0) ^ crc1;
+        crc0 = crc32c_shift(zeros, crc0) ^ crc2;
+        bytes += 2 * chunk;
+        *size -= 3 * chunk;
+    }
+    *crc = crc0;
+    return bytes;
+}
+
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t* bytes, uint32_t size) {
+    while (size && ((uintptr_t)bytes & 3)) {
+        crc = crc32c_u8(crc, *bytes++);
+        size--;
+    }
+    bytes = crc32c_hw_chunks(&crc, bytes, &size, CRC32C_LONG, crc32c_long);
+    bytes = crc32c_hw_chunks(&crc, bytes, &size, CRC32C_SHORT, crc32c_short);
+    while (size >= 4) {
+        crc = crc32c_u32(crc, *(const unaligned_u32*)bytes);
+        bytes += 4;
+        size -= 4;
+    }
+    while (size--) {
+        crc = crc32c_u8(crc, *bytes++);
+    }
+    return crc;
+}
+
+/* Continue crc over data; start from 0 */
+uint32_t crc32c(uint32_t crc, const void* data, uint32_t size) {
+    if (!crc32c_ready) {
+        crc32c_init();
+    }
+    const uint8_t* bytes = (const uint8_t*)data;
+    crc = ~crc;
+    crc = crc32c_sse42 ? crc32c_hw(crc, bytes, size) : crc32c_sw(crc, bytes, size);
+    return ~crc;
+}
+
+/* Non-zero when crc32c runs on the SSE4.2 instruction */
+int crc32c_hardware(void) {
+    if (!crc32c_ready) {
+        crc32c_init();
+    }
+    return crc32c_sse42;
+}
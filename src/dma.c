@@ -0,0 +1,361 @@
+/*
+ * Tiny Operating System - DMA Memory
+ * Memory devices can reach, so drivers stop carving it each their own
+ * way. Coherent memory comes from a pool of frames the stage hands over
+ * at dma_init, split by a buddy allocator into naturally aligned blocks
+ * of 4KB up to the pool, and below a page from power-of-two chunks cut
+ * out of whole pages, for descriptor rings and command tables. The pool
+ * is aligned to its size and so is every block in it, so none crosses a
+ * boundary of its size or smaller: a PRD's 64KB rule holds for free. x86
+ * snoops DMA, so coherent memory is ordinary cached memory.
+ *
+ * Streaming mappings hand a device a buffer the driver already has. One
+ * the device can address goes as it is; one above the device's limit is
+ * copied through a bounce buffer from the pool, out before the transfer
+ * and back after it, as its direction says.
+ *
+ * The stages that drive devices run unpaged, so an address is its own
+ * physical address and a bus address is the same number again.
+ */
+
+#include <stdint.h>
+
+#define PAGE_SIZE 4096
+#define PAGE_SHIFT 12
+#define DMA_MAX_ORDER 7                 /* The pool is one block of 512KB */
+#define DMA_POOL_SIZE (PAGE_SIZE << DMA_MAX_ORDER)
+#define DMA_POOL_PAGES (DMA_POOL_SIZE / PAGE_SIZE)
+#define DMA_MIN_SHIFT 5                 /* Chunks of 32 bytes up to 2KB */
+#define DMA_CLASSES 7
+#define DMA_BOUNCE_SLOTS 32             /* Streaming mappings bounced at once */
+#define DMA_NONE 0xFFFF
+
+/* Directions (must match the drivers' copies) */
+#define DMA_TO_DEVICE 1
+#define DMA_FROM_DEVICE 2
+#define DMA_BIDIRECTIONAL 3
+#define DMA_MAPPING_ERROR 0
+
+/* What each pool page is */
+#define DMA_PAGE_FREE 0                 /* Heads a free block on the list of its order */
+#define DMA_PAGE_TAIL 1                 /* Inside a free block */
+#define DMA_PAGE_BLOCK 2                /* Part of an allocated block; its head has the order */
+#define DMA_PAGE_CHUNKS 3               /* Cut into chunks of one class */
+
+struct dma_chunk {
+    struct dma_chunk* next;
+};
+
+/* A buffer out through a bounce buffer */
+struct dma_bounce {
+    uint32_t bus;                       /* 0 when the slot is free */
+    uint8_t* buffer;                    /* The driver's */
+    uint32_t size;
+    uint32_t direction;
+};
+
+static uint8_t* dma_pool;              /* DMA_POOL_SIZE bytes, aligned to their size */
+static uint8_t dma_page_state[DMA_POOL_PAGES];
+static uint8_t dma_page_order[DMA_POOL_PAGES];  /* Or chunk class, for DMA_PAGE_CHUNKS */
+static uint16_t dma_free_head[DMA_MAX_ORDER + 1];
+static uint16_t dma_free_next[DMA_POOL_PAGES];
+static uint16_t dma_free_prev[DMA_POOL_PAGES];
+static struct dma_chunk* dma_chunks[DMA_CLASSES];
+static struct dma_bounce dma_bounces[DMA_BOUNCE_SLOTS];
+static uint32_t dma_free_pages;
+static uint32_t dma_bounced;            /* Mappings that needed a bounce buffer */
+static volatile uint32_t dma_lock_word;
+
+/* Function prototypes */
+void dma_init(void);
+void* dma_alloc_coherent(uint32_t size, uint32_t limit, uint32_t* handle);
+void dma_free_coherent(void* address);
+uint32_t dma_map_single(void* buffer, uint32_t size, uint32_t direction, uint32_t limit);
+void dma_unmap_single(uint32_t bus, uint32_t size, uint32_t direction);
+uint32_t dma_get_stats(uint32_t* bounced);
+
+/* Physical frames (the stage's paging_alloc_frames) */
+extern uint32_t paging_alloc_frames(uint32_t order);
+
+/* Interrupts off: drivers map and unmap from their handlers */
+static uint32_t dma_lock(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    while (__atomic_exchange_n(&dma_lock_word, 1, __ATOMIC_ACQUIRE)) {
+        __asm__ __volatile__("pause");
+    }
+    return flags;
+}
+
+static void dma_unlock(uint32_t flags) {
+    __atomic_store_n(&dma_lock_word, 0, __ATOMIC_RELEASE);
+    __asm__ __volatile__("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+}
+
+static uint32_t dma_virt_to_phys(const void* address) {
+    return (uint32_t)(uintptr_t)address;
+}
+
+static void dma_copy(uint8_t* dst, const uint8_t* src, uint32_t size) {
+    for (uint32_t i = 0; i < size; i++) {
+        dst[i] = src[i];
+    }
+}
+
+static void dma_zero(uint8_t* dst, uint32_t size) {
+    for (uint32_t i = 0; i < size; i++) {
+        dst[i] = 0;
+    }
+}
+
+static void dma_list_add(uint32_t page, uint32_t order) {
+    dma_page_state[page] = DMA_PAGE_FREE;
+    dma_page_order[page] = (uint8_t)order;
+    dma_free_prev[page] = DMA_NONE;
+    dma_free_next[page] = dma_free_head[order];
+    if (dma_free_head[order] != DMA_NONE) {
+        dma_free_prev[dma_free_head[order]] = (uint16_t)page;
+    }
+    dma_free_head[order] = (uint16_t)page;
+}
+
+static void dma_list_remove(uint32_t page, uint32_t order) {
+    if (dma_free_prev[page] != DMA_NONE) {
+        dma_free_next[dma_free_prev[page]] = dma_free_next[page];
+    } else {
+        dma_free_head[order] = dma_free_next[page];
+    }
+    if (dma_free_next[page] != DMA_NONE) {
+        dma_free_prev[dma_free_next[page]] = dma_free_prev[page];
+    }
+}
+
+/* The whole pool free, no chunks and no bounces; with no frames for it, nothing to allocate */
+void dma_init(void) {
+    if (!dma_pool) {
+        dma_pool = (uint8_t*)(uintptr_t)paging_alloc_frames(DMA_MAX_ORDER);
+    }
+    uint32_t flags = dma_lock();
+    for (uint32_t order = 0; order <= DMA_MAX_ORDER; order++) {
+        dma_free_head[order] = DMA_NONE;
+    }
+    for (uint32_t page = 0; page < DMA_POOL_PAGES; page++) {
+        dma_page_state[page] = DMA_PAGE_TAIL;
+        dma_page_order[page] = 0;
+    }
+    if (dma_pool) {
+        dma_list_add(0, DMA_MAX_ORDER);
+    }
+    for (uint32_t class = 0; class < DMA_CLASSES; class++) {
+        dma_chunks[class] = 0;
+    }
+    for (uint32_t i = 0; i < DMA_BOUNCE_SLOTS; i++) {
+        dma_bounces[i].bus = 0;
+    }
+    dma_free_pages = dma_pool ? DMA_POOL_PAGES : 0;
+    dma_bounced = 0;
+    dma_unlock(flags);
+}
+
+/*
+ * A block of 2^order pages ending at or below limit, or -1. Any free block
+ * starting low enough will do: it is split down through its lower halves,
+ * the buddies going back on the lists. Locked.
+ */
+static int dma_block_alloc(uint32_t order, uint32_t limit) {
+    uint32_t base = dma_virt_to_phys(dma_pool);
+    uint32_t size = PAGE_SIZE << order;
+    for (uint32_t at = order; at <= DMA_MAX_ORDER; at++) {
+        for (uint32_t page = dma_free_head[at]; page != DMA_NONE; page = dma_free_next[page]) {
+            uint32_t phys = base + (page << PAGE_SHIFT);
+            if (phys + (size - 1) < phys || phys + (size - 1) > limit) {
+                continue;
+            }
+            dma_list_remove(page, at);
+            while (at > order) {
+                at--;
+                dma_list_add(page + (1u << at), at);
+            }
+            for (uint32_t i = 0; i < (1u << order); i++) {
+                dma_page_state[page + i] = DMA_PAGE_BLOCK;
+            }
+            dma_page_order[page] = (uint8_t)order;
+            dma_free_pages -= 1u << order;
+            return (int)page;
+        }
+    }
+    return -1;
+}
+
+/* Give a block back, merging it with its buddy while the buddy is a free block of the same order. Locked */
+static void dma_block_free(uint32_t page) {
+    uint32_t order = dma_page_order[page];
+    dma_free_pages += 1u << order;
+    while (order < DMA_MAX_ORDER) {
+        uint32_t buddy = page ^ (1u << order);
+        if (dma_page_state[buddy] != DMA_PAGE_FREE || dma_page_order[buddy] != order) {
+            break;
+        }
+        dma_list_remove(buddy, order);
+        page &= buddy;
+        order++;
+    }
+    for (uint32_t i = 0; i < (1u << order); i++) {
+        dma_page_state[page + i] = DMA_PAGE_TAIL;
+    }
+    dma_list_add(page, order);
+}
+
+/* A chunk of class at or below limit, cutting a fresh page when none is. Locked */
+static uint8_t* dma_chunk_alloc(uint32_t class, uint32_t limit) {
+    uint32_t size = 1u << (DMA_MIN_SHIFT + class);
+    struct dma_chunk** link = &dma_chunks[class];
+    for (struct dma_chunk* chunk = *link; chunk; link = &chunk->next, chunk = chunk->next) {
+        uint32_t phys = dma_virt_to_phys(chunk);
+        if (phys + (size - 1) <= limit) {
+            *link = chunk->next;
+            return (uint8_t*)chunk;
+        }
+    }
+
+    int page = dma_block_alloc(0, limit);
+    if (page < 0) {
+        return 0;
+    }
+    dma_page_state[page] = DMA_PAGE_CHUNKS;
+    dma_page_order[page] = (uint8_t)class;
+    uint8_t* memory = dma_pool + ((uint32_t)page << PAGE_SHIFT);
+    /* Pushed from the top down, so they are handed out in address order */
+    for (uint32_t offset = PAGE_SIZE - size; offset; offset -= size) {
+        struct dma_chunk* chunk = (struct dma_chunk*)(memory + offset);
+        chunk->next = dma_chunks[class];
+        dma_chunks[class] = chunk;
+    }
+    return memory;
+}
+
+/*
+ * size bytes of zeroed memory that a device addressing up to limit can
+ * reach, aligned to size rounded up to a power of two; its bus address in
+ * *handle. NULL when the pool has nothing low enough. Chunk pages stay
+ * chunks once cut, as a descriptor pool's pages do.
+ */
+void* dma_alloc_coherent(uint32_t size, uint32_t limit, uint32_t* handle) {
+    if (!size || size > DMA_POOL_SIZE) {
+        return 0;
+    }
+    uint8_t* memory;
+    uint32_t flags = dma_lock();
+    if (size <= PAGE_SIZE / 2) {
+        uint32_t class = 0;
+        while ((1u << (DMA_MIN_SHIFT + class)) < size) {
+            class++;
+        }
+        memory = dma_chunk_alloc(class, limit);
+    } else {
+        uint32_t order = 0;
+        while (((uint32_t)PAGE_SIZE << order) < size) {
+            order++;
+        }
+        int page = dma_block_alloc(order, limit);
+        memory = page < 0 ? 0 : dma_pool + ((uint32_t)page << PAGE_SHIFT);
+    }
+    dma_unlock(flags);
+    if (!memory) {
+        return 0;
+    }
+    dma_zero(memory, size);
+    if (handle) {
+        *handle = dma_virt_to_phys(memory);
+    }
+    return memory;
+}
+
+/* Give back memory from dma_alloc_coherent; NULL is ignored */
+void dma_free_coherent(void* address) {
+    uint8_t* memory = (uint8_t*)address;
+    if (memory < dma_pool || memory >= dma_pool + DMA_POOL_SIZE) {
+        return;
+    }
+    uint32_t page = (uint32_t)(memory - dma_pool) >> PAGE_SHIFT;
+    uint32_t flags = dma_lock();
+    if (dma_page_state[page] == DMA_PAGE_CHUNKS) {
+        struct dma_chunk* chunk = (struct dma_chunk*)memory;
+        chunk->next = dma_chunks[dma_page_order[page]];
+        dma_chunks[dma_page_order[page]] = chunk;
+    } else if (dma_page_state[page] == DMA_PAGE_BLOCK) {
+        dma_block_free(page);
+    }
+    dma_unlock(flags);
+}
+
+/*
+ * The bus address at which a device addressing up to limit finds size
+ * bytes of buffer, or DMA_MAPPING_ERROR when it needs a bounce buffer and
+ * none is left. What the device is to read is in place on return; unmap
+ * after the transfer to have what it wrote.
+ */
+uint32_t dma_map_single(void* buffer, uint32_t size, uint32_t direction, uint32_t limit) {
+    uint32_t phys = dma_virt_to_phys(buffer);
+    if (!size || (phys + (size - 1) >= phys && phys + (size - 1) <= limit)) {
+        return phys;
+    }
+
+    uint32_t flags = dma_lock();
+    struct dma_bounce* slot = 0;
+    for (uint32_t i = 0; i < DMA_BOUNCE_SLOTS && !slot; i++) {
+        if (!dma_bounces[i].bus) {
+            slot = &dma_bounces[i];
+        }
+    }
+    if (!slot) {
+        dma_unlock(flags);
+        return DMA_MAPPING_ERROR;
+    }
+    slot->bus = 1;                      /* Claimed while the lock is dropped */
+    dma_unlock(flags);
+
+    uint32_t bus;
+    uint8_t* bounce = (uint8_t*)dma_alloc_coherent(size, limit, &bus);
+    if (!bounce) {
+        slot->bus = 0;
+        return DMA_MAPPING_ERROR;
+    }
+    if (direction & DMA_TO_DEVICE) {
+        dma_copy(bounce, (const uint8_t*)buffer, size);
+    }
+    slot->buffer = (uint8_t*)buffer;
+    slot->size = size;
+    slot->direction = direction;
+    __atomic_store_n(&slot->bus, bus, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&dma_bounced, 1, __ATOMIC_RELAXED);
+    return bus;
+}
+
+/* End a mapping once the device is done with it; a bounced one copies back what the device wrote */
+void dma_unmap_single(uint32_t bus, uint32_t size, uint32_t direction) {
+    if (bus == DMA_MAPPING_ERROR || bus == 1) {
+        return;
+    }
+    for (uint32_t i = 0; i < DMA_BOUNCE_SLOTS; i++) {
+        struct dma_bounce* slot = &dma_bounces[i];
+        if (slot->bus != bus) {
+            continue;
+        }
+        uint8_t* bounce = (uint8_t*)(uintptr_t)bus;
+        if (direction & DMA_FROM_DEVICE) {
+            dma_copy(slot->buffer, bounce, size < slot->size ? size : slot->size);
+        }
+        dma_free_coherent(bounce);
+        __atomic_store_n(&slot->bus, 0, __ATOMIC_RELEASE);
+        return;
+    }
+}
+
+/* Pool pages free; *bounced gets how many mappings have needed a bounce buffer */
+uint32_t dma_get_stats(uint32_t* bounced) {
+    if (bounced) {
+        *bounced = dma_bounced;
+    }
+    return dma_free_pages;
+}
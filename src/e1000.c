@@ -0,0 +1,410 @@
+/*
+ * Intel e1000 (82540EM) Network Device Driver
+ * MMIO register access with RX/TX descriptor rings in coherent DMA memory
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Network constants from kernel */
+#define ETH_MTU 1500
+#define ETH_FRAME_MAX (ETH_MTU + 14)
+#define PAGE_SIZE 4096
+
+/* PCI identity */
+#define E1000_VENDOR 0x8086
+#define E1000_DEVICE_82540EM 0x100E
+
+/* Registers (offsets from BAR0) */
+#define E1000_CTRL 0x0000
+#define E1000_STATUS 0x0008
+#define E1000_EERD 0x0014
+#define E1000_ICR 0x00C0
+#define E1000_ITR 0x00C4
+#define E1000_IMS 0x00D0
+#define E1000_IMC 0x00D8
+#define E1000_RCTL 0x0100
+#define E1000_TCTL 0x0400
+#define E1000_TIPG 0x0410
+#define E1000_RDBAL 0x2800
+#define E1000_RDBAH 0x2804
+#define E1000_RDLEN 0x2808
+#define E1000_RDH 0x2810
+#define E1000_RDT 0x2818
+#define E1000_TDBAL 0x3800
+#define E1000_TDBAH 0x3804
+#define E1000_TDLEN 0x3808
+#define E1000_TDH 0x3810
+#define E1000_TDT 0x3818
+#define E1000_MTA 0x5200
+#define E1000_RAL 0x5400
+#define E1000_RAH 0x5404
+
+/* Control and status bits */
+#define E1000_CTRL_SLU (1u << 6)        /* Set link up */
+#define E1000_CTRL_RST (1u << 26)
+#define E1000_STATUS_LU (1u << 1)
+#define E1000_EERD_START 0x01
+#define E1000_EERD_DONE 0x10
+#define E1000_RAH_AV (1u << 31)
+
+/* Receive control */
+#define E1000_RCTL_EN (1u << 1)
+#define E1000_RCTL_BAM (1u << 15)       /* Accept broadcast */
+#define E1000_RCTL_SECRC (1u << 26)     /* Strip the Ethernet CRC */
+
+/* Transmit control */
+#define E1000_TCTL_EN (1u << 1)
+#define E1000_TCTL_PSP (1u << 3)        /* Pad short packets */
+#define E1000_TCTL_CT (0x10u << 4)
+#define E1000_TCTL_COLD (0x40u << 12)
+#define E1000_TIPG_DEFAULT 0x0060200A
+
+/* Interrupt causes */
+#define E1000_INT_TXDW (1u << 0)
+#define E1000_INT_LSC (1u << 2)
+#define E1000_INT_RXT0 (1u << 7)
+
+/* Descriptor bits */
+#define E1000_TXD_CMD_EOP 0x01
+#define E1000_TXD_CMD_IFCS 0x02
+#define E1000_TXD_CMD_RS 0x08
+#define E1000_TXD_STAT_DD 0x01
+#define E1000_RXD_STAT_DD 0x01
+#define E1000_RXD_STAT_EOP 0x02
+
+/* Ring geometry; lengths must be multiples of 128 bytes */
+#define E1000_RX_DESCS 32
+#define E1000_TX_DESCS 32
+#define E1000_BUFFER_SIZE 2048          /* Matches RCTL.BSIZE = 0 */
+
+/* Interrupt throttling: ITR counts in 256 ns units */
+#define E1000_MAX_INTS_PER_SEC 8000
+#define E1000_ITR_VALUE (1000000000 / (E1000_MAX_INTS_PER_SEC * 256))
+
+/* Deferred interrupt work (interrupt_handlers.c) */
+extern void irq_install_handler(uint32_t irq, void (*handler)(void));
+
+/* PCI configuration space (pci.c) */
+extern uint32_t pci_find_device(uint16_t vendor, uint16_t device_id);
+extern void* pci_map_bar(uint32_t device, uint32_t index);
+extern uint8_t pci_interrupt_line(uint32_t device);
+extern void pci_enable_device(uint32_t device);
+
+/* DMA memory (dma.c) */
+extern void* dma_alloc_coherent(uint32_t size, uint32_t limit, uint32_t* handle);
+
+/* Legacy descriptor formats, shared with the NIC */
+struct e1000_rx_desc {
+    uint64_t addr;
+    uint16_t length;
+    uint16_t checksum;
+    uint8_t status;
+    uint8_t errors;
+    uint16_t special;
+} __attribute__((packed));
+
+struct e1000_tx_desc {
+    uint64_t addr;
+    uint16_t length;
+    uint8_t cso;
+    uint8_t cmd;
+    uint8_t status;
+    uint8_t css;
+    uint16_t special;
+} __attribute__((packed));
+
+/* e1000 device structure */
+struct e1000_device {
+    volatile uint32_t* mmio;
+    uint8_t irq;
+    uint8_t mac_address[6];
+    volatile struct e1000_rx_desc* rx_ring;
+    volatile struct e1000_tx_desc* tx_ring;
+    uint8_t* rx_buffers[E1000_RX_DESCS];
+    uint8_t* tx_buffers[E1000_TX_DESCS];
+    uint32_t rx_next;                   /* Next descriptor the NIC will complete */
+    uint32_t tx_tail;                   /* Next descriptor to fill */
+    uint32_t rx_packets;
+    uint32_t tx_packets;
+    uint32_t rx_errors;
+    uint32_t tx_errors;
+    uint32_t interrupts;
+};
+
+/* Global e1000 device instance; DMA addresses assume identity-mapped frames */
+static struct e1000_device e1000_dev;
+
+/* Function prototypes */
+uint32_t e1000_register_device(void);
+uint32_t e1000_send(const void* data, uint32_t size);
+uint32_t e1000_receive(void* data, uint32_t max_size);
+uint32_t e1000_get_mac_address(uint8_t* mac);
+uint32_t e1000_get_statistics(uint32_t* rx_packets, uint32_t* tx_packets,
+                              uint32_t* rx_errors, uint32_t* tx_errors);
+
+/* MMIO register access */
+static inline uint32_t e1000_read(uint32_t reg) {
+    return e1000_dev.mmio[reg / 4];
+}
+
+static inline void e1000_write(uint32_t reg, uint32_t value) {
+    e1000_dev.mmio[reg / 4] = value;
+}
+
+/* Save EFLAGS and disable interrupts */
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+/* Restore the interrupt flag saved by irq_save */
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+}
+
+static void copy_bytes(void* dest, const void* src, uint32_t size) {
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+    for (uint32_t i = 0; i < size; i++) {
+        d[i] = s[i];
+    }
+}
+
+/* Read one 16-bit word of the EEPROM */
+static uint16_t e1000_eeprom_read(uint8_t addr) {
+    e1000_write(E1000_EERD, ((uint32_t)addr << 8) | E1000_EERD_START);
+    for (uint32_t timeout = 10000; timeout; timeout--) {
+        uint32_t value = e1000_read(E1000_EERD);
+        if (value & E1000_EERD_DONE) {
+            return value >> 16;
+        }
+    }
+    return 0;
+}
+
+/* Prefer the address firmware left in RAL0/RAH0, else the EEPROM copy */
+static void e1000_read_mac(void) {
+    uint32_t high = e1000_read(E1000_RAH);
+    uint32_t low = e1000_read(E1000_RAL);
+    
+    if (!(high & E1000_RAH_AV)) {
+        uint16_t words[3];
+        for (int i = 0; i < 3; i++) {
+            words[i] = e1000_eeprom_read(i);
+        }
+        low = words[0] | ((uint32_t)words[1] << 16);
+        high = words[2];
+        e1000_write(E1000_RAL, low);
+        e1000_write(E1000_RAH, high | E1000_RAH_AV);
+    }
+    
+    for (int i = 0; i < 4; i++) {
+        e1000_dev.mac_address[i] = low >> (i * 8);
+    }
+    e1000_dev.mac_address[4] = high;
+    e1000_dev.mac_address[5] = high >> 8;
+}
+
+/* Packet buffers for a ring; the NIC takes 32-bit addresses here, as RDBAH and TDBAH stay 0 */
+static uint32_t e1000_alloc_buffers(uint8_t** buffers, uint32_t* handles, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        buffers[i] = (uint8_t*)dma_alloc_coherent(E1000_BUFFER_SIZE, 0xFFFFFFFF, &handles[i]);
+        if (!buffers[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Give every receive descriptor a buffer and start the receiver */
+static uint32_t e1000_rx_init(void) {
+    uint32_t ring;
+    uint32_t handles[E1000_RX_DESCS];
+    void* memory = dma_alloc_coherent(E1000_RX_DESCS * sizeof(struct e1000_rx_desc), 0xFFFFFFFF, &ring);
+    if (!memory || !e1000_alloc_buffers(e1000_dev.rx_buffers, handles, E1000_RX_DESCS)) {
+        return 0;
+    }
+    e1000_dev.rx_ring = (volatile struct e1000_rx_desc*)memory;
+    
+    for (uint32_t i = 0; i < E1000_RX_DESCS; i++) {
+        e1000_dev.rx_ring[i].addr = handles[i];
+        e1000_dev.rx_ring[i].status = 0;
+    }
+    e1000_dev.rx_next = 0;
+    
+    e1000_write(E1000_RDBAL, ring);
+    e1000_write(E1000_RDBAH, 0);
+    e1000_write(E1000_RDLEN, E1000_RX_DESCS * sizeof(struct e1000_rx_desc));
+    e1000_write(E1000_RDH, 0);
+    e1000_write(E1000_RDT, E1000_RX_DESCS - 1);
+    e1000_write(E1000_RCTL, E1000_RCTL_EN | E1000_RCTL_BAM | E1000_RCTL_SECRC);
+    return 1;
+}
+
+/* Mark every transmit descriptor done so the first pass finds them free */
+static uint32_t e1000_tx_init(void) {
+    uint32_t ring;
+    uint32_t handles[E1000_TX_DESCS];
+    void* memory = dma_alloc_coherent(E1000_TX_DESCS * sizeof(struct e1000_tx_desc), 0xFFFFFFFF, &ring);
+    if (!memory || !e1000_alloc_buffers(e1000_dev.tx_buffers, handles, E1000_TX_DESCS)) {
+        return 0;
+    }
+    e1000_dev.tx_ring = (volatile struct e1000_tx_desc*)memory;
+    
+    for (uint32_t i = 0; i < E1000_TX_DESCS; i++) {
+        e1000_dev.tx_ring[i].addr = handles[i];
+        e1000_dev.tx_ring[i].status = E1000_TXD_STAT_DD;
+    }
+    e1000_dev.tx_tail = 0;
+    
+    e1000_write(E1000_TDBAL, ring);
+    e1000_write(E1000_TDBAH, 0);
+    e1000_write(E1000_TDLEN, E1000_TX_DESCS * sizeof(struct e1000_tx_desc));
+    e1000_write(E1000_TDH, 0);
+    e1000_write(E1000_TDT, 0);
+    e1000_write(E1000_TIPG, E1000_TIPG_DEFAULT);
+    e1000_write(E1000_TCTL, E1000_TCTL_EN | E1000_TCTL_PSP | E1000_TCTL_CT | E1000_TCTL_COLD);
+    return 1;
+}
+
+/* Reading ICR acknowledges every pending cause */
+static void e1000_interrupt_handler(void) {
+    (void)e1000_read(E1000_ICR);
+    e1000_dev.interrupts++;
+}
+
+/* e1000 initialization */
+static uint32_t e1000_init(void) {
+    e1000_dev.rx_packets = 0;
+    e1000_dev.tx_packets = 0;
+    e1000_dev.rx_errors = 0;
+    e1000_dev.tx_errors = 0;
+    e1000_dev.interrupts = 0;
+    e1000_dev.rx_ring = NULL;
+    e1000_dev.tx_ring = NULL;
+    
+    uint32_t pci = pci_find_device(E1000_VENDOR, E1000_DEVICE_82540EM);
+    if (!pci) {
+        return 0; /* Device not found */
+    }
+    pci_enable_device(pci);
+    e1000_dev.mmio = (volatile uint32_t*)pci_map_bar(pci, 0);
+    if (!e1000_dev.mmio) {
+        return 0;
+    }
+    e1000_dev.irq = pci_interrupt_line(pci);
+    
+    /* Reset with interrupts masked; the reset bit self-clears */
+    e1000_write(E1000_IMC, 0xFFFFFFFF);
+    e1000_write(E1000_CTRL, e1000_read(E1000_CTRL) | E1000_CTRL_RST);
+    for (uint32_t timeout = 100000; timeout && (e1000_read(E1000_CTRL) & E1000_CTRL_RST); timeout--) {
+    }
+    e1000_write(E1000_IMC, 0xFFFFFFFF);
+    (void)e1000_read(E1000_ICR);
+    
+    e1000_write(E1000_CTRL, e1000_read(E1000_CTRL) | E1000_CTRL_SLU);
+    e1000_read_mac();
+    for (uint32_t i = 0; i < 128; i++) {
+        e1000_write(E1000_MTA + i * 4, 0);
+    }
+    
+    if (!e1000_rx_init() || !e1000_tx_init()) {
+        return 0;
+    }
+    
+    /* Cap the interrupt rate so a flood raises at most E1000_MAX_INTS_PER_SEC */
+    e1000_write(E1000_ITR, E1000_ITR_VALUE);
+    if (e1000_dev.irq < 16) {
+        irq_install_handler(e1000_dev.irq, e1000_interrupt_handler);
+        e1000_write(E1000_IMS, E1000_INT_RXT0 | E1000_INT_TXDW | E1000_INT_LSC);
+    }
+    
+    return 1; /* Success */
+}
+
+/* Queue one frame; the NIC fetches it by DMA and sets DD when done */
+uint32_t e1000_send(const void* data, uint32_t size) {
+    if (size > ETH_FRAME_MAX || !e1000_dev.tx_ring) {
+        return 0;
+    }
+    
+    uint32_t flags = irq_save();
+    volatile struct e1000_tx_desc* desc = &e1000_dev.tx_ring[e1000_dev.tx_tail];
+    if (!(desc->status & E1000_TXD_STAT_DD)) {
+        /* Ring full: the NIC has not reached this slot yet */
+        e1000_dev.tx_errors++;
+        irq_restore(flags);
+        return 0;
+    }
+    
+    copy_bytes(e1000_dev.tx_buffers[e1000_dev.tx_tail], data, size);
+    desc->length = size;
+    desc->cmd = E1000_TXD_CMD_EOP | E1000_TXD_CMD_IFCS | E1000_TXD_CMD_RS;
+    desc->status = 0;
+    
+    /* Descriptor writes must land before the tail bump that publishes them */
+    __asm__ __volatile__("" : : : "memory");
+    e1000_dev.tx_tail = (e1000_dev.tx_tail + 1) % E1000_TX_DESCS;
+    e1000_write(E1000_TDT, e1000_dev.tx_tail);
+    e1000_dev.tx_packets++;
+    
+    irq_restore(flags);
+    return size;
+}
+
+/* Copy out the next received frame and return its descriptor; returns its length or 0 */
+uint32_t e1000_receive(void* data, uint32_t max_size) {
+    if (!e1000_dev.rx_ring) {
+        return 0;
+    }
+    
+    uint32_t flags = irq_save();
+    uint32_t index = e1000_dev.rx_next;
+    volatile struct e1000_rx_desc* desc = &e1000_dev.rx_ring[index];
+    if (!(desc->status & E1000_RXD_STAT_DD)) {
+        irq_restore(flags);
+        return 0;
+    }
+    
+    uint32_t size = 0;
+    if ((desc->status & E1000_RXD_STAT_EOP) && !desc->errors) {
+        size = desc->length < max_size ? desc->length : max_size;
+        copy_bytes(data, e1000_dev.rx_buffers[index], size);
+        e1000_dev.rx_packets++;
+    } else {
+        e1000_dev.rx_errors++;
+    }
+    
+    desc->status = 0;
+    __asm__ __volatile__("" : : : "memory");
+    e1000_write(E1000_RDT, index);
+    e1000_dev.rx_next = (index + 1) % E1000_RX_DESCS;
+    
+    irq_restore(flags);
+    return size;
+}
+
+/* e1000 device registration function */
+uint32_t e1000_register_device(void) {
+    return e1000_init();
+}
+
+uint32_t e1000_get_mac_address(uint8_t* mac) {
+    if (mac) {
+        for (int i = 0; i < 6; i++) {
+            mac[i] = e1000_dev.mac_address[i];
+        }
+    }
+    return 1;
+}
+
+uint32_t e1000_get_statistics(uint32_t* rx_packets, uint32_t* tx_packets,
+                              uint32_t* rx_errors, uint32_t* tx_errors) {
+    if (rx_packets) *rx_packets = e1000_dev.rx_packets;
+    if (tx_packets) *tx_packets = e1000_dev.tx_packets;
+    if (rx_errors) *rx_errors = e1000_dev.rx_errors;
+    if (tx_errors) *tx_errors = e1000_dev.tx_errors;
+    return 1;
+}
@@ -14,6 +14,90 @@
 #define NETWORK_BUFFER_SIZE (1024 * 1024) /* 1MB network buffer */
 #define TCP_WINDOW_SIZE 16384
 #define SOCKET_TIMEOUT 30000 /* 30 seconds */
+#define SOCKET_EST_HASH_BITS 10   /* Connected sockets by 4-tuple */
+#define SOCKET_PORT_HASH_BITS 8   /* Listeners and unconnected datagram sockets by local port */
+#define CACHE_LINE_SIZE 64
+
+/* TCP parameters; timer wheel ticks are milliseconds */
+#define IP_HEADER_LEN 20
+#define TCP_HEADER_LEN 20
+#define TCP_MSS 1460
+#define TCP_MSS_DEFAULT 536           /* Peer sent no MSS option (RFC 1122) */
+#define TCP_INIT_CWND (10 * TCP_MSS)  /* RFC 6928 */
+#define TCP_RTO_INIT 1000             /* RFC 6298 */
+#define TCP_RTO_MIN 200
+#define TCP_RTO_MAX 60000
+#define TCP_DELACK_TICKS 40
+#define TCP_SYN_RETRIES 4
+#define TCP_DUPACK_THRESHOLD 3
+#define TCP_BACKLOG_MAX 32            /* Bound on a listener's SYN queue, and on its accept queue */
+#define TCP_OOO_RANGES 4
+#define TCP_EPHEMERAL_PORT 49152
+#define TCP_SACK_RANGES 8             /* Sender's scoreboard of SACKed ranges */
+#define TCP_SNDBUF_INIT 8192
+#define TCP_SNDBUF_MAX 131072
+#define TCP_RCVBUF_MAX 131072         /* Receive autotuning ceiling */
+#define TCP_WSCALE 2                  /* Our window shift: TCP_RCVBUF_MAX >> 2 fits 16 bits */
+#define TCP_SYNCOOKIE_PERIOD 64000    /* Ticks per step of the cookie counter */
+#define TCP_SYNCOOKIE_AGE 2           /* Steps a cookie stays good for */
+#define TCP_FASTOPEN_COOKIE_LEN 8     /* Cookies we issue; the option carries 4 to 16 bytes (RFC 7413) */
+#define TCP_FASTOPEN_CACHE 16         /* Servers a client remembers a cookie for */
+#define TCP_FASTOPEN_OPTION 0x01      /* Our SYN or SYN-ACK carries the Fast Open option */
+#define TCP_FASTOPEN_OPEN 0x02        /* A child that took data from the SYN; its SYN-ACK is at snd_una - 1 */
+
+/* TCP option kinds (RFC 793, 2018, 7323) */
+#define TCPOPT_EOL 0
+#define TCPOPT_NOP 1
+#define TCPOPT_MSS 2
+#define TCPOPT_WSCALE 3
+#define TCPOPT_SACK_PERMITTED 4
+#define TCPOPT_SACK 5
+#define TCPOPT_TIMESTAMP 8
+#define TCPOPT_FASTOPEN 34
+#define TCP_TIMESTAMP_SPACE 12        /* NOP, NOP, kind, length, TSval, TSecr */
+
+/* TCP header flags */
+#define TCP_FLAG_FIN 0x01
+#define TCP_FLAG_SYN 0x02
+#define TCP_FLAG_RST 0x04
+#define TCP_FLAG_PSH 0x08
+#define TCP_FLAG_ACK 0x10
+
+/* Sequence space comparisons */
+#define SEQ_LT(a, b) ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a, b) ((int32_t)((a) - (b)) > 0)
+#define SEQ_GEQ(a, b) ((int32_t)((a) - (b)) >= 0)
+
+/* Loopback delivery queue, drained by enhanced_network_poll */
+#define LOOPBACK_QUEUE_LEN 32
+#define LOOPBACK_FRAME_SIZE (IP_HEADER_LEN + TCP_HEADER_LEN + 40 + TCP_MSS)
+
+/* Super-segments: built once by tcp_output, cut per MSS on transmit, merged again on receive */
+#define TCP_GSO_MAX_SIZE (0xFFFF - IP_HEADER_LEN - TCP_HEADER_LEN - 40)
+#define GRO_MAX_SIZE 0xFFFF
+
+/* Socket buffer allocator geometry */
+#define SOCKBUF_MIN_SIZE 4096
+#define SOCKBUF_MAX_ORDER 5           /* 128 KiB rings */
+#define SOCKBUF_PAGES (NETWORK_BUFFER_SIZE / SOCKBUF_MIN_SIZE)
+#define SOCKBUF_FREE 0x80
+#define SOCKBUF_NONE 0xFFFFFFFFu
+
+/* Encrypted stream records: big-endian payload length, ChaCha20 ciphertext, Poly1305 tag */
+#define AEAD_HEADER_LEN 4
+#define AEAD_TAG_LEN 16
+#define AEAD_OVERHEAD (AEAD_HEADER_LEN + AEAD_TAG_LEN)
+#define AEAD_RECORD_MAX 4096          /* Payload per record; a whole record fits the smallest window */
+
+/* CPU features for the SSE2 cipher path */
+#define CPUID_FEAT_EDX_SSE2 (1 << 26)
+#define CR0_TS 0x00000008
+#define CR4_OSFXSR 0x00000200
+
+/* Deferred timer work, run from enhanced_network_poll */
+#define TCP_EVENT_RTO 0x01
+#define TCP_EVENT_DELACK 0x02
 
 /* Enhanced network protocols */
 typedef enum {
@@ -71,59 +155,162 @@ typedef struct {
     void* driver_data;
 } network_interface_t;
 
-/* Enhanced socket structure */
+/* Timer wheel entry (must match struct timer in timer_wheel.c) */
+struct timer {
+    struct timer* next;
+    struct timer** pprev;
+    uint32_t expires;
+    void (*callback)(void* data);
+    void* data;
+};
+
+/* Event poll (eventpoll.c) */
+#define EPOLLIN 0x001
+#define EPOLLOUT 0x004
+#define EPOLLERR 0x008
+#define EPOLLHUP 0x010
+#define EPOLLET 0x80000000u
+#define EP_CTL_ADD 1
+
+struct ep_item;
+
+/* Per-object wait queue (must match eventpoll.c) */
+struct ep_wait_queue {
+    struct ep_item* head;
+    uint32_t (*poll)(void* object);
+    void* object;
+};
+
+struct ep_event {
+    uint32_t events;
+    uint32_t data;
+};
+
+/* Per-socket counters, as enhanced_socket_get_stats reports them */
 typedef struct {
-    int socket_id;
-    socket_type_t type;
-    socket_state_t state;
-    uint32_t local_ip;
-    uint16_t local_port;
-    uint32_t remote_ip;
-    uint16_t remote_port;
-    uint32_t protocol;
-    
-    /* Buffer management */
-    uint8_t* rx_buffer;
-    uint32_t rx_buffer_size;
-    uint32_t rx_head;
-    uint32_t rx_tail;
-    uint8_t* tx_buffer;
-    uint32_t tx_buffer_size;
-    uint32_t tx_head;
-    uint32_t tx_tail;
-    
-    /* TCP specific */
-    uint32_t sequence_number;
-    uint32_t acknowledgment_number;
-    uint16_t window_size;
-    uint32_t timeout;
-    uint8_t tcp_options[40];
-    uint32_t tcp_options_len;
-    
-    /* Security features */
-    uint8_t encrypted;
-    uint8_t authenticated;
-    uint32_t encryption_key[4];
-    uint32_t authentication_key[4];
-    
-    /* Statistics */
     uint32_t bytes_sent;
     uint32_t bytes_received;
     uint32_t packets_sent;
     uint32_t packets_received;
     uint32_t connection_time;
     uint32_t last_activity;
+} enhanced_socket_stats_t;
+
+/*
+ * What a socket needs rarely or only in some roles, allocated apart so it
+ * does not share cache lines with the fields every segment touches.
+ */
+struct enhanced_socket_cold {
+    /* Security; the two keys are the halves of the 256-bit AEAD key */
+    uint8_t authenticated;
+    uint32_t encryption_key[4];
+    uint32_t authentication_key[4];
+    uint64_t tx_record_seq;             /* Nonce of the next record sealed / opened */
+    uint64_t rx_record_seq;
+    
+    enhanced_socket_stats_t stats;
+    
+    /* Listeners only */
+    int accept_queue[TCP_BACKLOG_MAX];  /* Established children, a ring from accept_head */
     
     /* Callbacks */
     void (*receive_callback)(int socket_id, void* data, uint32_t size);
     void (*connect_callback)(int socket_id);
     void (*disconnect_callback)(int socket_id);
-    
-    /* Flow control */
+};
+
+/*
+ * Enhanced socket structure. The first two cache lines hold what the demux
+ * and each segment read and write; loss recovery, timers and setup follow,
+ * and the rest is behind cold. The rings are not allocated until the first
+ * byte needs one.
+ */
+typedef struct enhanced_socket {
+    /* Demux */
+    struct enhanced_socket* est_next;
+    struct enhanced_socket* port_next;
+    uint32_t local_ip;
+    uint32_t remote_ip;
+    uint16_t local_port;
+    uint16_t remote_port;
+    int socket_id;
+    socket_type_t type;
+    socket_state_t state;
+    uint8_t est_hashed;
+    uint8_t port_hashed;
+    uint8_t encrypted;
+    uint8_t events;                     /* TCP_EVENT_* awaiting enhanced_network_poll */
+    
+    /* Sequence space and windows */
+    uint32_t sequence_number;           /* SND.NXT */
+    uint32_t acknowledgment_number;     /* RCV.NXT */
+    uint32_t snd_una;                   /* Oldest unacknowledged sequence; tx_tail holds its byte */
+    uint32_t snd_max;                   /* Highest sequence sent, kept across go-back-N */
+    uint32_t snd_wnd;                   /* Peer's advertised window */
+    uint32_t window_size;               /* Receive window last advertised, in bytes */
+    uint32_t rcv_unacked;               /* Bytes received since our last ACK */
+    uint32_t mss;                       /* Payload per segment, after the peer's MSS and our options */
     uint32_t congestion_window;
     uint32_t slow_start_threshold;
     uint8_t congestion_avoidance;
-} enhanced_socket_t;
+    uint8_t in_recovery;                /* SACK (RFC 6675) or NewReno (RFC 6582) fast recovery */
+    uint8_t snd_wscale;                 /* Shift applied to the peer's windows */
+    uint8_t rcv_wscale;                 /* Shift applied to our advertised windows */
+    
+    /* Rings; a size is the ring's capacity whether or not it has been allocated yet */
+    uint8_t* rx_buffer;
+    uint32_t rx_buffer_size;
+    uint32_t rx_head;
+    uint32_t rx_tail;
+    uint8_t* tx_buffer;
+    uint32_t tx_buffer_size;
+    uint32_t tx_head;
+    uint32_t tx_tail;
+    
+    /* RTT, negotiated options (RFC 7323, RFC 2018) and loss recovery */
+    uint8_t sack_ok;
+    uint8_t ts_ok;
+    uint8_t rtt_timing;
+    uint8_t retries;
+    uint32_t ts_recent;                 /* Peer TSval to echo */
+    uint32_t timeout;                   /* Current RTO in ticks */
+    uint32_t srtt;                      /* Smoothed RTT in ticks */
+    uint32_t rttvar;
+    uint32_t rtt_seq;                   /* Segment being timed (Karn: never a retransmission) */
+    uint32_t rtt_start;
+    uint64_t rtt_sent_ns;               /* When the timed segment went out, for the network-wide RTT */
+    uint32_t rcv_rtt;                   /* Receiver-side RTT from echoed timestamps */
+    uint32_t rcv_space_copied;          /* Bytes read by the application this autotuning interval */
+    uint32_t rcv_space_time;
+    uint32_t dupacks;
+    uint32_t recover;
+    uint32_t high_rxt;                  /* Hole retransmissions in this recovery reached here */
+    uint32_t ooo_start[TCP_OOO_RANGES]; /* Out-of-order data already in the receive ring */
+    uint32_t ooo_end[TCP_OOO_RANGES];
+    uint32_t ooo_count;
+    uint32_t sack_start[TCP_SACK_RANGES];   /* Scoreboard: peer-held ranges above snd_una, sorted */
+    uint32_t sack_end[TCP_SACK_RANGES];
+    uint32_t sack_count;
+    
+    /* Timers */
+    struct timer rto_timer;
+    struct timer delack_timer;
+    struct enhanced_socket* event_next;
+    
+    /* Connection setup */
+    uint32_t protocol;
+    struct enhanced_socket* parent;     /* Listener of an embryonic connection */
+    uint32_t accept_head;
+    uint32_t accept_count;
+    uint32_t syn_count;                 /* Embryonic children: the SYN queue */
+    uint32_t backlog;                   /* Bound on each queue */
+    uint8_t reuseport;                  /* Shares its port with the others that set it */
+    uint8_t fastopen;                   /* A listener takes data in SYNs; otherwise TCP_FASTOPEN_* */
+    uint32_t incoming_cpu;              /* Where a reuseport listener was last accepted from */
+    
+    struct ep_wait_queue wait;          /* Event poll watchers, woken from the RX path */
+    struct enhanced_socket_cold* cold;
+} __attribute__((aligned(CACHE_LINE_SIZE))) enhanced_socket_t;
 
 /* Enhanced TCP header with options */
 typedef struct {
@@ -173,7 +360,7 @@ typedef struct {
 
 /* Network statistics */
 typedef struct {
-    uint64_t total_packets_received;
+    uint64_t total_packets_received;    /* The four totals are counted per CPU and filled in by snapshots */
     uint64_t total_packets_sent;
     uint64_t total_bytes_received;
     uint64_t total_bytes_sent;
@@ -185,33 +372,137 @@ typedef struct {
     uint32_t authentication_failures;
     uint32_t packet_loss;
     uint32_t retransmissions;
-    uint32_t round_trip_time;
-    uint32_t jitter;
+    uint32_t round_trip_time;       /* Smoothed RTT in microseconds */
+    uint32_t jitter;                /* RTT variation in microseconds */
+    uint32_t gso_segments;          /* Segments cut from super-segments */
+    uint32_t gro_merged;            /* Received segments merged into an earlier one */
+    uint32_t syncookies_sent;       /* SYN-ACKs answered statelessly */
+    uint32_t syncookies_recv;       /* Connections established from a returned cookie */
+    uint32_t listen_drops;          /* SYNs dropped with the accept queue full */
+    uint32_t fastopen_recv;         /* Connections that took data from the SYN */
 } network_stats_t;
 
+/* A server's Fast Open cookie, as a client remembers it */
+struct tcp_fastopen_entry {
+    uint32_t ip;                        /* As on the wire */
+    uint32_t mss;                       /* Payload its SYN-ACK allowed, the most data a SYN may carry */
+    uint32_t last_used;
+    uint8_t len;                        /* 0 for a free entry */
+    uint8_t cookie[16];
+};
+
+/* Ticket spinlock (spinlock.c) (must match struct spinlock there) */
+typedef struct spinlock {
+    union {
+        uint32_t tickets;
+        struct {
+            uint16_t owner;
+            uint16_t next;
+        };
+    };
+    uint32_t contended;
+} spinlock_t;
+
+/* Sequence lock (spinlock.c) (must match struct seqlock there) */
+typedef struct seqlock {
+    uint32_t sequence;
+    spinlock_t lock;
+} seqlock_t;
+
+extern uint32_t spin_lock_irqsave(spinlock_t* lock);
+extern void spin_unlock_irqrestore(spinlock_t* lock, uint32_t flags);
+extern uint32_t write_seqlock_irqsave(seqlock_t* lock);
+extern void write_sequnlock_irqrestore(seqlock_t* lock, uint32_t flags);
+extern uint32_t read_seqbegin(const seqlock_t* lock);
+extern int read_seqretry(const seqlock_t* lock, uint32_t start);
+
+/* Per-CPU counters (percpu.c) */
+#define PCPU_NET_RX_PACKETS 4
+#define PCPU_NET_TX_PACKETS 5
+#define PCPU_NET_RX_BYTES 6
+#define PCPU_NET_TX_BYTES 7
+extern void this_cpu_add(uint32_t counter, uint32_t amount);
+extern uint64_t percpu_counter_read(uint32_t counter);
+
+/* Slab allocator (performance_tuning.c) */
+typedef struct kmem_cache kmem_cache_t;
+extern kmem_cache_t* kmem_cache_create(const char* name, uint32_t size, void (*ctor)(void* object));
+extern void* kmem_cache_alloc(kmem_cache_t* cache);
+extern void kmem_cache_free(kmem_cache_t* cache, void* object);
+
+/* Timer wheel (timer_wheel.c) */
+extern void timer_setup(struct timer* timer, void (*callback)(void* data), void* data);
+extern void timer_add(struct timer* timer, uint32_t expires);
+extern void timer_cancel(struct timer* timer);
+extern int timer_pending(const struct timer* timer);
+extern uint32_t timer_wheel_now(void);
+
+/* Monotonic clock (clocksource.c) */
+extern uint64_t ktime_ns(void);
+
+extern void ep_queue_init(struct ep_wait_queue* queue, uint32_t (*poll)(void* object), void* object);
+extern void ep_queue_release(struct ep_wait_queue* queue);
+extern void ep_wake(struct ep_wait_queue* queue, uint32_t events);
+extern int ep_create(void);
+extern int ep_close(int epfd);
+extern int ep_ctl(int epfd, int op, struct ep_wait_queue* target, const struct ep_event* event);
+extern int ep_wait(int epfd, struct ep_event* events, int maxevents, int timeout);
+
+/* Loopback frame slot */
+struct loopback_frame {
+    uint32_t size;
+    uint8_t data[LOOPBACK_FRAME_SIZE];
+};
+
 /* Global network state */
 static network_interface_t interfaces[MAX_NETWORK_INTERFACES];
-static enhanced_socket_t sockets[MAX_SOCKETS];
+static enhanced_socket_t* sockets[MAX_SOCKETS];   /* Indexed by socket id */
+static kmem_cache_t* socket_cache = NULL;
+static kmem_cache_t* socket_cold_cache = NULL;
+static enhanced_socket_t* est_hash[1 << SOCKET_EST_HASH_BITS];
+static enhanced_socket_t* port_hash[1 << SOCKET_PORT_HASH_BITS];
+static int free_socket_ids[MAX_SOCKETS];
+static uint32_t free_socket_id_count = 0;
 static network_stats_t network_stats;
+static seqlock_t network_stats_lock;    /* Counters are bumped from the RX path and timer work alike */
 static uint8_t network_buffer[NETWORK_BUFFER_SIZE];
-static uint32_t network_buffer_head = 0;
-static uint32_t network_buffer_tail = 0;
+static uint32_t sockbuf_free_list[SOCKBUF_MAX_ORDER + 1];   /* First page of each free block */
+static uint8_t sockbuf_page_state[SOCKBUF_PAGES];           /* Order of a block head, SOCKBUF_FREE if free */
 static uint8_t network_initialized = 0;
-static uint32_t next_socket_id = 1;
+static struct loopback_frame loopback_queue[LOOPBACK_QUEUE_LEN];
+static uint32_t loopback_head = 0;
+static uint32_t loopback_tail = 0;
+static enhanced_socket_t* tcp_event_list = NULL;
+static spinlock_t tcp_event_lock;       /* Timer interrupts post to tcp_event_list */
+static uint32_t tcp_iss = 0;
 
-/* Utility functions */
-static void* memset(void* s, int c, size_t n) {
-    unsigned char* p = s;
-    while (n--) *p++ = c;
-    return s;
-}
+/*
+ * SYN cookies: 0 never, 1 once a listener's SYN queue is full, 2 for every
+ * SYN. The secret keys the ChaCha20 block that hashes a cookie's 4-tuple.
+ */
+static uint8_t tcp_syncookies = 1;
+static uint32_t syncookie_secret[8];
+static uint32_t fastopen_secret[8];     /* Keys the Fast Open cookies we issue, by client address */
+static struct tcp_fastopen_entry tcp_fastopen_cache[TCP_FASTOPEN_CACHE];
+static uint32_t tcp_fastopen_clock;
+static uint32_t ip_identification = 0;
+static uint16_t next_ephemeral_port = 0;
 
-static void* memcpy(void* dest, const void* src, size_t n) {
-    unsigned char* d = dest;
-    const unsigned char* s = src;
-    while (n--) *d++ = *s++;
-    return dest;
-}
+/* Receive window a new stream socket offers; the tcp_window tunable */
+static uint32_t tcp_window = TCP_WINDOW_SIZE;
+static uint32_t (*net_this_cpu)(void);  /* NULL: everything is CPU 0 */
+
+/* Runtime tunables (sysctl.c) */
+#define SYSCTL_UINT 0                   /* Must match sysctl.c */
+extern int sysctl_register(const char* name, uint32_t type, void* value, int64_t min, int64_t max);
+
+/* Kernel runtime library (klib.c) */
+extern void* memcpy(void* dest, const void* src, size_t n);
+extern void* memset(void* s, int c, size_t n);
+extern int memcmp(const void* a, const void* b, size_t n);
+extern size_t strlen(const char* str);
+
+/* Utility functions */
 
 static uint16_t htons(uint16_t hostshort) {
     return ((hostshort & 0xFF) << 8) | ((hostshort >> 8) & 0xFF);
@@ -222,41 +513,582 @@ static uint32_t htonl(uint32_t hostlong) {
            ((hostlong >> 8) & 0xFF00) | ((hostlong >> 24) & 0xFF);
 }
 
+/* Internet checksum (checksum.c) */
+extern uint16_t csum_compute(const void* data, uint32_t size);
+extern uint32_t csum_partial(const void* data, uint32_t size, uint32_t sum);
+extern uint16_t csum_fold(uint32_t sum);
+
 static uint16_t calculate_checksum(const void* data, uint32_t size) {
-    uint32_t sum = 0;
-    const uint16_t* ptr = (const uint16_t*)data;
-    
-    while (size > 1) {
-        sum += *ptr++;
-        size -= 2;
+    return csum_compute(data, size);
+}
+
+/* Save EFLAGS and disable interrupts; TCP timers fire from the timer interrupt */
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+/* Restore the interrupt flag saved by irq_save */
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+}
+
+/*
+ * Bump one of the rarer network_stats counters inside the seqlock. The
+ * per-packet totals are per-CPU counters instead, summed into a snapshot.
+ */
+static void net_stat_add(uint32_t* counter, uint32_t amount) {
+    uint32_t flags = write_seqlock_irqsave(&network_stats_lock);
+    *counter += amount;
+    write_sequnlock_irqrestore(&network_stats_lock, flags);
+}
+
+/*
+ * ChaCha20-Poly1305 AEAD (RFC 8439). Encrypted stream sockets carry records
+ * of a length header, the ciphertext and a tag. The header is the additional
+ * data and the nonce holds the record number, so a record cannot be altered,
+ * replayed, reordered or dropped without the tag check failing.
+ */
+typedef uint32_t __attribute__((may_alias, aligned(1))) unaligned_u32;
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+typedef uint32_t __attribute__((vector_size(16), may_alias, aligned(1))) unaligned_v4u32;
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define CHACHA_QUARTER(a, b, c, d) \
+    a += b; d ^= a; d = ROTL32(d, 16); \
+    c += d; b ^= c; b = ROTL32(b, 12); \
+    a += b; d ^= a; d = ROTL32(d, 8); \
+    c += d; b ^= c; b = ROTL32(b, 7)
+
+/* Column then diagonal rounds, for scalar words and 4-lane vectors alike */
+#define CHACHA_DOUBLE_ROUND(x) do { \
+    CHACHA_QUARTER(x[0], x[4], x[8], x[12]); \
+    CHACHA_QUARTER(x[1], x[5], x[9], x[13]); \
+    CHACHA_QUARTER(x[2], x[6], x[10], x[14]); \
+    CHACHA_QUARTER(x[3], x[7], x[11], x[15]); \
+    CHACHA_QUARTER(x[0], x[5], x[10], x[15]); \
+    CHACHA_QUARTER(x[1], x[6], x[11], x[12]); \
+    CHACHA_QUARTER(x[2], x[7], x[8], x[13]); \
+    CHACHA_QUARTER(x[3], x[4], x[9], x[14]); \
+} while (0)
+
+struct poly1305 {
+    uint32_t r[5];                      /* Clamped key, 26-bit limbs */
+    uint32_t h[5];                      /* Accumulator, 26-bit limbs */
+    uint32_t pad[4];
+    uint8_t buffer[16];
+    uint32_t fill;
+};
+
+struct aead_ctx {
+    uint32_t state[16];                 /* ChaCha20 input; word 12 is the block counter */
+    uint32_t keystream[16];             /* Rest of a block a previous piece started */
+    uint32_t keystream_used;            /* Bytes of it consumed, 64 when none is left */
+    struct poly1305 mac;
+    uint32_t aad_len;
+    uint32_t text_len;
+};
+
+/* Set when the CPU has SSE2 and the OS has enabled FXSAVE */
+static uint8_t chacha_sse2 = 0;
+static uint8_t chacha_fpu_save[512] __attribute__((aligned(16)));
+
+static inline uint32_t read_cr0(void) {
+    uint32_t cr0;
+    __asm__ __volatile__("movl %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+static void chacha_detect_sse2(void) {
+    uint32_t eax = 1, ebx, ecx = 0, edx, cr4;
+    __asm__ __volatile__("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    __asm__ __volatile__("movl %%cr4, %0" : "=r"(cr4));
+    chacha_sse2 = (edx & CPUID_FEAT_EDX_SSE2) && (cr4 & CR4_OSFXSR);
+}
+
+static uint32_t load32_le(const uint8_t* p) {
+    return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void store32_le(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static void chacha20_block(const uint32_t state[16], uint32_t out[16]) {
+    uint32_t x[16];
+    for (int i = 0; i < 16; i++) x[i] = state[i];
+    for (int i = 0; i < 10; i++) {
+        CHACHA_DOUBLE_ROUND(x);
     }
-    
-    if (size > 0) {
-        sum += *(const uint8_t*)ptr;
+    for (int i = 0; i < 16; i++) out[i] = x[i] + state[i];
+}
+
+/*
+ * Four blocks at once, one per vector lane, XORed into 256 bytes of data per
+ * pass. Lanes hold the same word of consecutive blocks, so the results are
+ * transposed back to block order before the XOR.
+ */
+__attribute__((target("sse2")))
+static void chacha20_xor4_sse2(uint32_t state[16], uint8_t* data, uint32_t passes) {
+    while (passes--) {
+        v4u32 s[16], x[16];
+        for (int i = 0; i < 16; i++) {
+            s[i] = (v4u32){ state[i], state[i], state[i], state[i] };
+        }
+        s[12] += (v4u32){ 0, 1, 2, 3 };
+        for (int i = 0; i < 16; i++) x[i] = s[i];
+        for (int i = 0; i < 10; i++) {
+            CHACHA_DOUBLE_ROUND(x);
+        }
+        
+        for (int i = 0; i < 16; i += 4) {
+            v4u32 a = x[i] + s[i], b = x[i + 1] + s[i + 1];
+            v4u32 c = x[i + 2] + s[i + 2], d = x[i + 3] + s[i + 3];
+            v4u32 ab_lo = __builtin_shuffle(a, b, (v4u32){ 0, 4, 1, 5 });
+            v4u32 cd_lo = __builtin_shuffle(c, d, (v4u32){ 0, 4, 1, 5 });
+            v4u32 ab_hi = __builtin_shuffle(a, b, (v4u32){ 2, 6, 3, 7 });
+            v4u32 cd_hi = __builtin_shuffle(c, d, (v4u32){ 2, 6, 3, 7 });
+            *(unaligned_v4u32*)(data + i * 4) ^= __builtin_shuffle(ab_lo, cd_lo, (v4u32){ 0, 1, 4, 5 });
+            *(unaligned_v4u32*)(data + 64 + i * 4) ^= __builtin_shuffle(ab_lo, cd_lo, (v4u32){ 2, 3, 6, 7 });
+            *(unaligned_v4u32*)(data + 128 + i * 4) ^= __builtin_shuffle(ab_hi, cd_hi, (v4u32){ 0, 1, 4, 5 });
+            *(unaligned_v4u32*)(data + 192 + i * 4) ^= __builtin_shuffle(ab_hi, cd_hi, (v4u32){ 2, 3, 6, 7 });
+        }
+        state[12] += 4;
+        data += 256;
+    }
+}
+
+/* XOR the keystream into data, continuing where the previous piece stopped */
+static void chacha20_xor(struct aead_ctx* ctx, uint8_t* data, uint32_t len) {
+    const uint8_t* leftover = (const uint8_t*)ctx->keystream;
+    while (len && ctx->keystream_used < 64) {
+        *data++ ^= leftover[ctx->keystream_used++];
+        len--;
     }
     
-    sum = (sum >> 16) + (sum & 0xFFFF);
-    sum += (sum >> 16);
+    /*
+     * The kernel owns no vector state of its own: borrow the registers only
+     * while the FPU is not handed off lazily (CR0.TS), saving whoever's they are.
+     */
+    if (len >= 256 && chacha_sse2 && !(read_cr0() & CR0_TS)) {
+        uint32_t flags = irq_save();
+        __asm__ __volatile__("fxsave %0" : "=m"(chacha_fpu_save));
+        chacha20_xor4_sse2(ctx->state, data, len / 256);
+        __asm__ __volatile__("fxrstor %0" : : "m"(chacha_fpu_save));
+        irq_restore(flags);
+        data += len & ~255u;
+        len &= 255;
+    }
     
-    return (uint16_t)(~sum);
+    while (len >= 64) {
+        uint32_t block[16];
+        chacha20_block(ctx->state, block);
+        ctx->state[12]++;
+        for (int i = 0; i < 16; i++) {
+            ((unaligned_u32*)data)[i] ^= block[i];
+        }
+        data += 64;
+        len -= 64;
+    }
+    if (len) {
+        chacha20_block(ctx->state, ctx->keystream);
+        ctx->state[12]++;
+        for (uint32_t i = 0; i < len; i++) {
+            data[i] ^= leftover[i];
+        }
+        ctx->keystream_used = len;
+    }
+}
+
+static void poly1305_init(struct poly1305* st, const uint8_t key[32]) {
+    st->r[0] = load32_le(key) & 0x3FFFFFF;
+    st->r[1] = (load32_le(key + 3) >> 2) & 0x3FFFF03;
+    st->r[2] = (load32_le(key + 6) >> 4) & 0x3FFC0FF;
+    st->r[3] = (load32_le(key + 9) >> 6) & 0x3F03FFF;
+    st->r[4] = (load32_le(key + 12) >> 8) & 0x00FFFFF;
+    for (int i = 0; i < 5; i++) st->h[i] = 0;
+    for (int i = 0; i < 4; i++) st->pad[i] = load32_le(key + 16 + 4 * i);
+    st->fill = 0;
 }
 
-/* Simple encryption (XOR-based for demonstration) */
-static void simple_encrypt(void* data, uint32_t size, const uint32_t* key) {
-    uint32_t* data32 = (uint32_t*)data;
-    uint32_t blocks = size / 4;
+/* h = (h + m) * r mod 2^130 - 5 for each 16-byte block; 32x32 products only */
+static void poly1305_blocks(struct poly1305* st, const uint8_t* m, uint32_t bytes) {
+    uint32_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2], r3 = st->r[3], r4 = st->r[4];
+    uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+    
+    while (bytes >= 16) {
+        h0 += load32_le(m) & 0x3FFFFFF;
+        h1 += (load32_le(m + 3) >> 2) & 0x3FFFFFF;
+        h2 += (load32_le(m + 6) >> 4) & 0x3FFFFFF;
+        h3 += (load32_le(m + 9) >> 6) & 0x3FFFFFF;
+        h4 += (load32_le(m + 12) >> 8) | (1 << 24);
+        
+        uint64_t d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 + (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+        uint64_t d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 + (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+        uint64_t d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 + (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+        uint64_t d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 + (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+        uint64_t d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 + (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+        
+        uint32_t c = (uint32_t)(d0 >> 26);
+        h0 = (uint32_t)d0 & 0x3FFFFFF;
+        d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3FFFFFF;
+        d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3FFFFFF;
+        d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3FFFFFF;
+        d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3FFFFFF;
+        h0 += c * 5;
+        c = h0 >> 26;
+        h0 &= 0x3FFFFFF;
+        h1 += c;
+        
+        m += 16;
+        bytes -= 16;
+    }
     
-    for (uint32_t i = 0; i < blocks; i++) {
-        data32[i] ^= key[i % 4];
+    st->h[0] = h0; st->h[1] = h1; st->h[2] = h2; st->h[3] = h3; st->h[4] = h4;
+}
+
+static void poly1305_update(struct poly1305* st, const uint8_t* m, uint32_t bytes) {
+    if (st->fill) {
+        while (bytes && st->fill < 16) {
+            st->buffer[st->fill++] = *m++;
+            bytes--;
+        }
+        if (st->fill < 16) return;
+        poly1305_blocks(st, st->buffer, 16);
+        st->fill = 0;
+    }
+    poly1305_blocks(st, m, bytes & ~15u);
+    m += bytes & ~15u;
+    bytes &= 15;
+    while (bytes--) {
+        st->buffer[st->fill++] = *m++;
+    }
+}
+
+/* Zero-pad to a block boundary, as the AEAD construction does after each input */
+static void poly1305_pad(struct poly1305* st) {
+    if (!st->fill) return;
+    while (st->fill < 16) st->buffer[st->fill++] = 0;
+    poly1305_blocks(st, st->buffer, 16);
+    st->fill = 0;
+}
+
+static void poly1305_finish(struct poly1305* st, uint8_t mac[16]) {
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+    uint32_t c;
+    
+    /* Propagate carries fully */
+    c = h1 >> 26; h1 &= 0x3FFFFFF; h2 += c;
+    c = h2 >> 26; h2 &= 0x3FFFFFF; h3 += c;
+    c = h3 >> 26; h3 &= 0x3FFFFFF; h4 += c;
+    c = h4 >> 26; h4 &= 0x3FFFFFF; h0 += c * 5;
+    c = h0 >> 26; h0 &= 0x3FFFFFF; h1 += c;
+    
+    /* g = h - (2^130 - 5); take it instead of h when it does not underflow, without branching */
+    uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3FFFFFF;
+    uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= 0x3FFFFFF;
+    uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= 0x3FFFFFF;
+    uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= 0x3FFFFFF;
+    uint32_t g4 = h4 + c - (1 << 26);
+    uint32_t mask = (g4 >> 31) - 1;
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+    h3 = (h3 & ~mask) | (g3 & mask);
+    h4 = (h4 & ~mask) | (g4 & mask);
+    
+    /* h + pad mod 2^128 */
+    uint64_t f;
+    f = (uint64_t)(h0 | (h1 << 26)) + st->pad[0];
+    store32_le(mac, (uint32_t)f);
+    f = (uint64_t)((h1 >> 6) | (h2 << 20)) + st->pad[1] + (f >> 32);
+    store32_le(mac + 4, (uint32_t)f);
+    f = (uint64_t)((h2 >> 12) | (h3 << 14)) + st->pad[2] + (f >> 32);
+    store32_le(mac + 8, (uint32_t)f);
+    f = (uint64_t)((h3 >> 18) | (h4 << 8)) + st->pad[3] + (f >> 32);
+    store32_le(mac + 12, (uint32_t)f);
+}
+
+/* Key the cipher, derive the one-time Poly1305 key from block 0 and absorb the AAD */
+static void aead_init(struct aead_ctx* ctx, const uint32_t key[8], const uint32_t nonce[3],
+                      const uint8_t* aad, uint32_t aad_len) {
+    ctx->state[0] = 0x61707865;         /* "expand 32-byte k" */
+    ctx->state[1] = 0x3320646E;
+    ctx->state[2] = 0x79622D32;
+    ctx->state[3] = 0x6B206574;
+    for (int i = 0; i < 8; i++) ctx->state[4 + i] = key[i];
+    ctx->state[12] = 0;
+    for (int i = 0; i < 3; i++) ctx->state[13 + i] = nonce[i];
+    
+    uint32_t block[16];
+    uint8_t poly_key[32];
+    chacha20_block(ctx->state, block);
+    for (int i = 0; i < 8; i++) store32_le(poly_key + 4 * i, block[i]);
+    poly1305_init(&ctx->mac, poly_key);
+    ctx->state[12] = 1;
+    ctx->keystream_used = 64;
+    
+    poly1305_update(&ctx->mac, aad, aad_len);
+    poly1305_pad(&ctx->mac);
+    ctx->aad_len = aad_len;
+    ctx->text_len = 0;
+}
+
+/* Encrypt a piece in place; pieces of one message may be any length */
+static void aead_encrypt(struct aead_ctx* ctx, uint8_t* data, uint32_t len) {
+    chacha20_xor(ctx, data, len);
+    poly1305_update(&ctx->mac, data, len);
+    ctx->text_len += len;
+}
+
+/* Authenticate a piece of ciphertext; it is decrypted only once the tag checks out */
+static void aead_authenticate(struct aead_ctx* ctx, const uint8_t* data, uint32_t len) {
+    poly1305_update(&ctx->mac, data, len);
+    ctx->text_len += len;
+}
+
+static void aead_final(struct aead_ctx* ctx, uint8_t tag[16]) {
+    uint8_t lengths[16];
+    poly1305_pad(&ctx->mac);
+    store32_le(lengths, ctx->aad_len);
+    store32_le(lengths + 4, 0);
+    store32_le(lengths + 8, ctx->text_len);
+    store32_le(lengths + 12, 0);
+    poly1305_blocks(&ctx->mac, lengths, 16);
+    poly1305_finish(&ctx->mac, tag);
+}
+
+/* Compare tags in constant time */
+static int aead_tag_equal(const uint8_t* a, const uint8_t* b) {
+    uint8_t diff = 0;
+    for (int i = 0; i < AEAD_TAG_LEN; i++) diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+/*
+ * Socket buffer allocator: a buddy allocator over network_buffer, so rings can
+ * be freed on close and replaced by larger ones as the window autotunes.
+ */
+static uint32_t sockbuf_order(uint32_t size) {
+    uint32_t order = 0;
+    while (((uint32_t)SOCKBUF_MIN_SIZE << order) < size) order++;
+    return order;
+}
+
+static void sockbuf_push(uint32_t page, uint32_t order) {
+    *(uint32_t*)(network_buffer + page * SOCKBUF_MIN_SIZE) = sockbuf_free_list[order];
+    sockbuf_free_list[order] = page;
+    sockbuf_page_state[page] = SOCKBUF_FREE | order;
+}
+
+/* Unlink a free block from its order's list */
+static void sockbuf_unlink(uint32_t page, uint32_t order) {
+    uint32_t* link = &sockbuf_free_list[order];
+    while (*link != page) {
+        link = (uint32_t*)(network_buffer + *link * SOCKBUF_MIN_SIZE);
+    }
+    *link = *(uint32_t*)(network_buffer + page * SOCKBUF_MIN_SIZE);
+    sockbuf_page_state[page] = 0;
+}
+
+static void sockbuf_init(void) {
+    for (uint32_t order = 0; order <= SOCKBUF_MAX_ORDER; order++) {
+        sockbuf_free_list[order] = SOCKBUF_NONE;
+    }
+    for (uint32_t page = 0; page < SOCKBUF_PAGES; page++) {
+        sockbuf_page_state[page] = 0;
+    }
+    for (uint32_t page = 0; page < SOCKBUF_PAGES; page += 1u << SOCKBUF_MAX_ORDER) {
+        sockbuf_push(page, SOCKBUF_MAX_ORDER);
+    }
+}
+
+/* Allocate a power-of-two ring of at least size bytes, or NULL */
+static uint8_t* sockbuf_alloc(uint32_t size) {
+    uint32_t want = sockbuf_order(size);
+    uint32_t order = want;
+    while (order <= SOCKBUF_MAX_ORDER && sockbuf_free_list[order] == SOCKBUF_NONE) order++;
+    if (order > SOCKBUF_MAX_ORDER) return NULL;
+    
+    uint32_t page = sockbuf_free_list[order];
+    sockbuf_unlink(page, order);
+    while (order > want) {
+        order--;
+        sockbuf_push(page + (1u << order), order);
+    }
+    sockbuf_page_state[page] = order;
+    return network_buffer + page * SOCKBUF_MIN_SIZE;
+}
+
+/* Free a ring, merging it with its buddy while the buddy is free too */
+static void sockbuf_free(uint8_t* buffer) {
+    if (!buffer) return;
+    uint32_t page = (uint32_t)(buffer - network_buffer) / SOCKBUF_MIN_SIZE;
+    uint32_t order = sockbuf_page_state[page] & ~SOCKBUF_FREE;
+    
+    while (order < SOCKBUF_MAX_ORDER) {
+        uint32_t buddy = page ^ (1u << order);
+        if (sockbuf_page_state[buddy] != (SOCKBUF_FREE | order)) break;
+        sockbuf_unlink(buddy, order);
+        page &= ~(1u << order);
+        order++;
+    }
+    sockbuf_push(page, order);
+}
+
+/* Copy len bytes at absolute ring position start between rings of different sizes */
+static void ring_copy(uint8_t* dst, uint32_t dst_size, const uint8_t* src, uint32_t src_size,
+                      uint32_t start, uint32_t len) {
+    while (len) {
+        uint32_t src_off = start % src_size;
+        uint32_t dst_off = start % dst_size;
+        uint32_t chunk = src_size - src_off;
+        if (chunk > dst_size - dst_off) chunk = dst_size - dst_off;
+        if (chunk > len) chunk = len;
+        memcpy(dst + dst_off, src + src_off, chunk);
+        start += chunk;
+        len -= chunk;
+    }
+}
+
+/* Double a ring, carrying over len bytes from index start */
+static int ring_grow(uint8_t** buffer, uint32_t* size, uint32_t start, uint32_t len) {
+    uint8_t* bigger = sockbuf_alloc(*size * 2);
+    if (!bigger) return -1;
+    ring_copy(bigger, *size * 2, *buffer, *size, start, len);
+    sockbuf_free(*buffer);
+    *buffer = bigger;
+    *size *= 2;
+    return 0;
+}
+
+/* Allocate a socket's ring at its notional size the first time it is needed */
+static int ring_reserve(uint8_t** buffer, uint32_t size) {
+    if (!*buffer) *buffer = sockbuf_alloc(size);
+    return *buffer ? 0 : -1;
+}
+
+/* Copy len bytes into / out of a ring at absolute position start */
+static void ring_write(uint8_t* ring, uint32_t ring_size, uint32_t start, const void* src, uint32_t len) {
+    uint32_t offset = start % ring_size;
+    uint32_t first = ring_size - offset;
+    if (first > len) first = len;
+    memcpy(ring + offset, src, first);
+    memcpy(ring, (const uint8_t*)src + first, len - first);
+}
+
+static void ring_read(void* dst, const uint8_t* ring, uint32_t ring_size, uint32_t start, uint32_t len) {
+    uint32_t offset = start % ring_size;
+    uint32_t first = ring_size - offset;
+    if (first > len) first = len;
+    memcpy(dst, ring + offset, first);
+    memcpy((uint8_t*)dst + first, ring, len - first);
+}
+
+/*
+ * Record keying. The nonce is the port pair in sending order plus the record
+ * number, so the two directions of a connection never share a nonce.
+ */
+static void aead_socket_init(struct aead_ctx* ctx, const enhanced_socket_t* sock, uint16_t from_port,
+                             uint16_t to_port, uint64_t seq, const uint8_t* header) {
+    uint32_t key[8];
+    uint32_t nonce[3] = { ((uint32_t)from_port << 16) | to_port, (uint32_t)seq, (uint32_t)(seq >> 32) };
+    for (int i = 0; i < 4; i++) {
+        key[i] = sock->cold->encryption_key[i];
+        key[4 + i] = sock->cold->authentication_key[i];
+    }
+    aead_init(ctx, key, nonce, header, AEAD_HEADER_LEN);
+}
+
+/* Append one record to the send ring, encrypting the payload where it lands in the ring */
+static void aead_seal_record(enhanced_socket_t* sock, const uint8_t* data, uint32_t len) {
+    uint8_t header[AEAD_HEADER_LEN] = { (uint8_t)(len >> 24), (uint8_t)(len >> 16), (uint8_t)(len >> 8), (uint8_t)len };
+    uint8_t tag[AEAD_TAG_LEN];
+    struct aead_ctx ctx;
+    aead_socket_init(&ctx, sock, sock->local_port, sock->remote_port, sock->cold->tx_record_seq++, header);
+    
+    uint32_t pos = sock->tx_head;
+    ring_write(sock->tx_buffer, sock->tx_buffer_size, pos, header, AEAD_HEADER_LEN);
+    pos += AEAD_HEADER_LEN;
+    ring_write(sock->tx_buffer, sock->tx_buffer_size, pos, data, len);
+    while (len) {
+        uint32_t offset = pos % sock->tx_buffer_size;
+        uint32_t chunk = sock->tx_buffer_size - offset;
+        if (chunk > len) chunk = len;
+        aead_encrypt(&ctx, sock->tx_buffer + offset, chunk);
+        pos += chunk;
+        len -= chunk;
     }
+    aead_final(&ctx, tag);
+    ring_write(sock->tx_buffer, sock->tx_buffer_size, pos, tag, AEAD_TAG_LEN);
+    sock->tx_head = pos + AEAD_TAG_LEN;
 }
 
-static void simple_decrypt(void* data, uint32_t size, const uint32_t* key) {
-    /* XOR is symmetric, so same function */
-    simple_encrypt(data, size, key);
+/*
+ * Take the next whole record from the receive ring into data and decrypt it
+ * there once its tag verifies. Returns the payload length, 0 while the record
+ * is incomplete, or -1 if data is too small (nothing consumed) or the record
+ * is forged. *consumed is the ring bytes to release.
+ */
+static int aead_open_record(enhanced_socket_t* sock, uint8_t* data, uint32_t size, uint32_t available,
+                            uint32_t* consumed) {
+    uint8_t header[AEAD_HEADER_LEN];
+    uint8_t tag[AEAD_TAG_LEN];
+    uint8_t expected[AEAD_TAG_LEN];
+    struct aead_ctx ctx;
+    
+    *consumed = 0;
+    if (available < AEAD_HEADER_LEN) return 0;
+    ring_read(header, sock->rx_buffer, sock->rx_buffer_size, sock->rx_tail, AEAD_HEADER_LEN);
+    uint32_t len = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) | ((uint32_t)header[2] << 8) | header[3];
+    
+    /* A length no sender produces means the stream is corrupt: discard what is there */
+    if (len > AEAD_RECORD_MAX) {
+        net_stat_add(&network_stats.authentication_failures, 1);
+        *consumed = available;
+        return -1;
+    }
+    if (available < len + AEAD_OVERHEAD) return 0;
+    if (size < len) return -1;
+    
+    *consumed = len + AEAD_OVERHEAD;
+    ring_read(data, sock->rx_buffer, sock->rx_buffer_size, sock->rx_tail + AEAD_HEADER_LEN, len);
+    ring_read(tag, sock->rx_buffer, sock->rx_buffer_size, sock->rx_tail + AEAD_HEADER_LEN + len, AEAD_TAG_LEN);
+    aead_socket_init(&ctx, sock, sock->remote_port, sock->local_port, sock->cold->rx_record_seq, header);
+    aead_authenticate(&ctx, data, len);
+    aead_final(&ctx, expected);
+    if (!aead_tag_equal(tag, expected)) {
+        net_stat_add(&network_stats.authentication_failures, 1);
+        return -1;
+    }
+    
+    chacha20_xor(&ctx, data, len);
+    sock->cold->rx_record_seq++;
+    return (int)len;
 }
 
 /* Enhanced network initialization */
+/* Key the SYN and Fast Open cookie hashes from the TSC, run through one ChaCha20 block */
+static void syncookie_init(void) {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    uint32_t state[16] = {0x61707865, 0x3320646E, 0x79622D32, 0x6B206574};
+    for (int i = 4; i < 16; i++) {
+        state[i] = (low ^ (uint32_t)i * 0x9E3779B9u) * 2654435761u + high;
+    }
+    uint32_t out[16];
+    chacha20_block(state, out);
+    for (int i = 0; i < 8; i++) {
+        syncookie_secret[i] = out[i];
+        fastopen_secret[i] = out[8 + i];
+    }
+}
+
 void enhanced_network_init(void) {
     /* Initialize network interfaces */
     memset(interfaces, 0, sizeof(interfaces));
@@ -270,262 +1102,1980 @@ void enhanced_network_init(void) {
     
     /* Initialize sockets */
     memset(sockets, 0, sizeof(sockets));
+    memset(est_hash, 0, sizeof(est_hash));
+    memset(port_hash, 0, sizeof(port_hash));
+    if (!socket_cache) {
+        socket_cache = kmem_cache_create("enhanced_socket_t", sizeof(enhanced_socket_t), NULL);
+    }
+    if (!socket_cold_cache) {
+        socket_cold_cache = kmem_cache_create("enhanced_socket_cold", sizeof(struct enhanced_socket_cold), NULL);
+    }
+    free_socket_id_count = 0;
+    for (int i = MAX_SOCKETS - 1; i >= 0; i--) {
+        free_socket_ids[free_socket_id_count++] = i;
+    }
     
     /* Initialize network statistics */
     memset(&network_stats, 0, sizeof(network_stats));
     
     /* Initialize network buffer */
     memset(network_buffer, 0, sizeof(network_buffer));
-    network_buffer_head = 0;
-    network_buffer_tail = 0;
+    sockbuf_init();
+    
+    /* Initialize TCP and loopback state */
+    loopback_head = 0;
+    loopback_tail = 0;
+    tcp_event_list = NULL;
+    ip_identification = 0;
+    next_ephemeral_port = 0;
+    chacha_detect_sse2();
+    syncookie_init();
+    memset(tcp_fastopen_cache, 0, sizeof(tcp_fastopen_cache));
+    tcp_fastopen_clock = 0;
+    sysctl_register("tcp_window", SYSCTL_UINT, &tcp_window, TCP_MSS, 65535);
     
     network_initialized = 1;
 }
 
 /* Enhanced socket management */
-int enhanced_socket_create(socket_type_t type, uint32_t protocol) {
-    if (!network_initialized) return -1;
-    
-    /* Find free socket */
-    for (int i = 0; i < MAX_SOCKETS; i++) {
-        if (sockets[i].state == SOCKET_STATE_FREE) {
-            /* Initialize socket */
-            sockets[i].socket_id = next_socket_id++;
-            sockets[i].type = type;
-            sockets[i].state = SOCKET_STATE_CLOSED;
-            sockets[i].protocol = protocol;
-            
-            /* Allocate buffers */
-            sockets[i].rx_buffer_size = 8192;
-            sockets[i].tx_buffer_size = 8192;
-            sockets[i].rx_buffer = network_buffer + network_buffer_tail;
-            network_buffer_tail += sockets[i].rx_buffer_size;
-            sockets[i].tx_buffer = network_buffer + network_buffer_tail;
-            network_buffer_tail += sockets[i].tx_buffer_size;
-            
-            /* Initialize TCP parameters */
-            if (type == SOCKET_TYPE_STREAM) {
-                sockets[i].sequence_number = 1000; /* Initial sequence number */
-                sockets[i].window_size = TCP_WINDOW_SIZE;
-                sockets[i].congestion_window = 1024; /* Initial congestion window */
-                sockets[i].slow_start_threshold = 65536;
-            }
-            
-            /* Initialize security parameters */
-            sockets[i].encrypted = 0;
-            sockets[i].authenticated = 0;
-            for (int j = 0; j < 4; j++) {
-                sockets[i].encryption_key[j] = 0x12345678;
-                sockets[i].authentication_key[j] = 0x87654321;
-            }
-            
-            /* Initialize statistics */
-            sockets[i].connection_time = 0;
-            sockets[i].last_activity = 0;
-            
-            return sockets[i].socket_id;
-        }
-    }
-    
-    return -1; /* No free sockets */
+static enhanced_socket_t* socket_lookup(int socket_id) {
+    if (socket_id < 0 || socket_id >= MAX_SOCKETS) return NULL;
+    return sockets[socket_id];
 }
 
-int enhanced_socket_bind(int socket_id, uint32_t ip_address, uint16_t port) {
-    if (socket_id < 0 || socket_id >= MAX_SOCKETS) return -1;
-    
-    enhanced_socket_t* sock = &sockets[socket_id];
-    if (sock->state == SOCKET_STATE_FREE) return -1;
-    
-    sock->local_ip = ip_address;
-    sock->local_port = htons(port);
-    
-    return 0;
+/* Multiplicative hashes; ports and addresses are in network order throughout */
+static uint32_t socket_flow_hash(uint32_t local_ip, uint16_t local_port, uint32_t remote_ip, uint16_t remote_port) {
+    uint32_t h = (local_ip * 2654435761u) ^ remote_ip;
+    h ^= ((uint32_t)local_port << 16) | remote_port;
+    return h * 2654435761u;
 }
 
-int enhanced_socket_listen(int socket_id, int backlog) {
-    if (socket_id < 0 || socket_id >= MAX_SOCKETS) return -1;
-    
-    enhanced_socket_t* sock = &sockets[socket_id];
-    if (sock->state != SOCKET_STATE_CLOSED) return -1;
-    
-    sock->state = SOCKET_STATE_LISTENING;
-    
-    return 0;
+static uint32_t socket_est_hashfn(uint32_t local_ip, uint16_t local_port, uint32_t remote_ip, uint16_t remote_port) {
+    return socket_flow_hash(local_ip, local_port, remote_ip, remote_port) >> (32 - SOCKET_EST_HASH_BITS);
 }
 
-int enhanced_socket_connect(int socket_id, uint32_t ip_address, uint16_t port) {
-    if (socket_id < 0 || socket_id >= MAX_SOCKETS) return -1;
-    
-    enhanced_socket_t* sock = &sockets[socket_id];
-    if (sock->state != SOCKET_STATE_CLOSED) return -1;
-    
-    sock->remote_ip = ip_address;
-    sock->remote_port = htons(port);
-    sock->state = SOCKET_STATE_SYN_SENT;
-    
-    /* Simulate TCP handshake */
-    sock->state = SOCKET_STATE_ESTABLISHED;
-    sock->connection_time = network_stats.total_packets_sent;
-    
-    network_stats.active_connections++;
-    
-    return 0;
+static uint32_t socket_port_hashfn(uint16_t port) {
+    return ((uint32_t)port * 2654435761u) >> (32 - SOCKET_PORT_HASH_BITS);
 }
 
-int enhanced_socket_accept(int socket_id, uint32_t* client_ip, uint16_t* client_port) {
-    if (socket_id < 0 || socket_id >= MAX_SOCKETS) return -1;
-    
-    enhanced_socket_t* sock = &sockets[socket_id];
-    if (sock->state != SOCKET_STATE_LISTENING) return -1;
-    
-    /* Create new socket for connection */
-    int new_socket_id = enhanced_socket_create(SOCKET_TYPE_STREAM, NET_PROTOCOL_TCP);
-    if (new_socket_id < 0) return -1;
-    
-    enhanced_socket_t* new_sock = &sockets[new_socket_id];
-    new_sock->state = SOCKET_STATE_ESTABLISHED;
-    new_sock->local_ip = sock->local_ip;
-    new_sock->local_port = sock->local_port;
-    
-    /* Simulate incoming connection */
-    if (client_ip) *client_ip = htonl(0x7F000001); /* 127.0.0.1 */
-    if (client_port) *client_port = htons(12345);
+static void socket_est_hash(enhanced_socket_t* sock) {
+    if (sock->est_hashed) return;
+    uint32_t bucket = socket_est_hashfn(sock->local_ip, sock->local_port, sock->remote_ip, sock->remote_port);
+    sock->est_next = est_hash[bucket];
+    est_hash[bucket] = sock;
+    sock->est_hashed = 1;
+}
+
+static void socket_est_unhash(enhanced_socket_t* sock) {
+    if (!sock->est_hashed) return;
+    enhanced_socket_t** link = &est_hash[socket_est_hashfn(sock->local_ip, sock->local_port,
+                                                           sock->remote_ip, sock->remote_port)];
+    while (*link != sock) link = &(*link)->est_next;
+    *link = sock->est_next;
+    sock->est_hashed = 0;
+}
+
+static void socket_port_hash(enhanced_socket_t* sock) {
+    if (sock->port_hashed) return;
+    uint32_t bucket = socket_port_hashfn(sock->local_port);
+    sock->port_next = port_hash[bucket];
+    port_hash[bucket] = sock;
+    sock->port_hashed = 1;
+}
+
+static void socket_port_unhash(enhanced_socket_t* sock) {
+    if (!sock->port_hashed) return;
+    enhanced_socket_t** link = &port_hash[socket_port_hashfn(sock->local_port)];
+    while (*link != sock) link = &(*link)->port_next;
+    *link = sock->port_next;
+    sock->port_hashed = 0;
+}
+
+static uint32_t net_cpu(void) {
+    return net_this_cpu ? net_this_cpu() : 0;
+}
+
+/* Where connections go depends on the CPU they arrive on; NULL for a single one */
+void enhanced_network_set_this_cpu(uint32_t (*this_cpu)(void)) {
+    net_this_cpu = this_cpu;
+}
+
+/*
+ * The socket bound to local_ip and port for a flow with this hash. A
+ * reuseport group shares the flows out by hash, over only the members
+ * last accepted from on this CPU when there are any, so a connection is
+ * handed to a worker already running where it arrived.
+ */
+static enhanced_socket_t* socket_port_select(uint32_t protocol, uint32_t local_ip, uint16_t port, uint32_t hash) {
+    uint32_t bucket = socket_port_hashfn(port);
+    uint32_t cpu = net_cpu();
+    uint32_t count = 0;
+    uint32_t local = 0;
+    for (enhanced_socket_t* sock = port_hash[bucket]; sock; sock = sock->port_next) {
+        if (sock->protocol != protocol || sock->local_port != port || sock->local_ip != local_ip) continue;
+        if (!sock->reuseport) return sock;
+        count++;
+        if (sock->incoming_cpu == cpu) local++;
+    }
+    if (!count) return NULL;
+    
+    /* Scale the hash onto the members rather than take a remainder, so its high bits decide */
+    uint32_t pick = (uint32_t)(((uint64_t)hash * (local ? local : count)) >> 32);
+    for (enhanced_socket_t* sock = port_hash[bucket]; sock; sock = sock->port_next) {
+        if (sock->protocol != protocol || sock->local_port != port || sock->local_ip != local_ip) continue;
+        if (local && sock->incoming_cpu != cpu) continue;
+        if (pick-- == 0) return sock;
+    }
+    return NULL;
+}
+
+/*
+ * Find the socket for an inbound segment: an exact 4-tuple match first, then a
+ * listener or unconnected datagram socket on the port, preferring a specific
+ * local address over a wildcard bind. Returns the socket id or -1.
+ */
+int enhanced_socket_demux(uint32_t protocol, uint32_t src_ip, uint16_t src_port,
+                          uint32_t dst_ip, uint16_t dst_port) {
+    uint32_t hash = socket_flow_hash(dst_ip, dst_port, src_ip, src_port);
+    for (enhanced_socket_t* sock = est_hash[hash >> (32 - SOCKET_EST_HASH_BITS)]; sock; sock = sock->est_next) {
+        if (sock->protocol == protocol && sock->local_port == dst_port && sock->remote_port == src_port &&
+            sock->local_ip == dst_ip && sock->remote_ip == src_ip) {
+            return sock->socket_id;
+        }
+    }
+    
+    enhanced_socket_t* sock = socket_port_select(protocol, dst_ip, dst_port, hash);
+    if (!sock && dst_ip != 0) {
+        sock = socket_port_select(protocol, 0, dst_port, hash);
+    }
+    return sock ? sock->socket_id : -1;
+}
+
+/* Whether sock may take its port: only alongside sockets that, like it, set reuseport */
+static int socket_port_available(const enhanced_socket_t* sock) {
+    for (enhanced_socket_t* other = port_hash[socket_port_hashfn(sock->local_port)]; other; other = other->port_next) {
+        if (other != sock && other->protocol == sock->protocol && other->local_port == sock->local_port &&
+            other->local_ip == sock->local_ip && !(other->reuseport && sock->reuseport)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void tcp_rto_expire(void* data);
+static void tcp_delack_expire(void* data);
+static void tcp_stop_timers(enhanced_socket_t* sock);
+static void tcp_send_segment(enhanced_socket_t* sock, uint32_t seq, uint8_t flags, uint32_t len);
+static void tcp_output(enhanced_socket_t* sock);
+static void tcp_send_ack(enhanced_socket_t* sock);
+
+/* Readiness for event poll: data or a pending connection to read, ring space to write */
+static uint32_t enhanced_socket_poll(void* object) {
+    const enhanced_socket_t* sock = (const enhanced_socket_t*)object;
+    uint32_t events = 0;
+    
+    switch (sock->state) {
+        case SOCKET_STATE_LISTENING:
+            if (sock->accept_count) events |= EPOLLIN;
+            break;
+        case SOCKET_STATE_CLOSE_WAIT:
+            events |= EPOLLIN;  /* End of stream reads as 0 */
+            break;
+        case SOCKET_STATE_CLOSED:
+            if (sock->type == SOCKET_TYPE_STREAM && sock->remote_port) events |= EPOLLHUP;
+            break;
+        default:
+            break;
+    }
+    if (sock->rx_head != sock->rx_tail) events |= EPOLLIN;
+    if ((sock->state == SOCKET_STATE_ESTABLISHED || sock->type != SOCKET_TYPE_STREAM) &&
+        sock->tx_head - sock->tx_tail < sock->tx_buffer_size) {
+        events |= EPOLLOUT;
+    }
+    return events;
+}
+
+/* The wait queue to pass to ep_ctl for a socket */
+struct ep_wait_queue* enhanced_socket_wait_queue(int socket_id) {
+    enhanced_socket_t* sock = socket_lookup(socket_id);
+    return sock ? &sock->wait : NULL;
+}
+
+int enhanced_socket_create(socket_type_t type, uint32_t protocol) {
+    if (!network_initialized || free_socket_id_count == 0) return -1;
+    
+    enhanced_socket_t* sock = kmem_cache_alloc(socket_cache);
+    if (!sock) return -1; /* No free sockets */
+    memset(sock, 0, sizeof(enhanced_socket_t));
+    sock->cold = kmem_cache_alloc(socket_cold_cache);
+    if (!sock->cold) {
+        kmem_cache_free(socket_cache, sock);
+        return -1;
+    }
+    memset(sock->cold, 0, sizeof(struct enhanced_socket_cold));
+    
+    /*
+     * The rings come with the first byte each way (ring_reserve), so a
+     * listener or an idle connection holds none; the receive ring grows
+     * later with the window
+     */
+    sock->rx_buffer_size = tcp_window;
+    sock->tx_buffer_size = TCP_SNDBUF_INIT;
+    
+    /* Initialize socket */
+    sock->socket_id = free_socket_ids[--free_socket_id_count];
+    sock->type = type;
+    sock->state = SOCKET_STATE_CLOSED;
+    sock->protocol = protocol;
+    sock->incoming_cpu = 0xFFFFFFFF;    /* None until it accepts */
+    
+    /* Initialize TCP parameters */
+    if (type == SOCKET_TYPE_STREAM) {
+        sock->sequence_number = 1000; /* Initial sequence number */
+        sock->window_size = tcp_window;
+        sock->congestion_window = TCP_INIT_CWND;
+        sock->slow_start_threshold = 65536;
+        sock->timeout = TCP_RTO_INIT;
+        sock->mss = TCP_MSS;
+    }
+    timer_setup(&sock->rto_timer, tcp_rto_expire, sock);
+    timer_setup(&sock->delack_timer, tcp_delack_expire, sock);
+    ep_queue_init(&sock->wait, enhanced_socket_poll, sock);
+    
+    /* Initialize security parameters */
+    sock->encrypted = 0;
+    sock->cold->authenticated = 0;
+    for (int j = 0; j < 4; j++) {
+        sock->cold->encryption_key[j] = 0x12345678;
+        sock->cold->authentication_key[j] = 0x87654321;
+    }
+    sock->cold->tx_record_seq = 0;
+    sock->cold->rx_record_seq = 0;
+    
+    /* Initialize statistics */
+    sock->cold->stats.connection_time = 0;
+    sock->cold->stats.last_activity = 0;
+    
+    sockets[sock->socket_id] = sock;
+    return sock->socket_id;
+}
+
+int enhanced_socket_close(int socket_id) {
+    enhanced_socket_t* sock = socket_lookup(socket_id);
+    if (!sock) return -1;
+    
+    uint32_t flags = write_seqlock_irqsave(&network_stats_lock);
+    if (sock->state == SOCKET_STATE_ESTABLISHED && network_stats.active_connections > 0) {
+        network_stats.active_connections--;
+    }
+    write_sequnlock_irqrestore(&network_stats_lock, flags);
+    
+    /* Best-effort FIN; the connection is not kept around for the close handshake */
+    if (sock->state == SOCKET_STATE_ESTABLISHED || sock->state == SOCKET_STATE_CLOSE_WAIT) {
+        tcp_send_segment(sock, sock->snd_max, TCP_FLAG_FIN | TCP_FLAG_ACK, 0);
+    }
+    
+    /* A listener takes its embryonic and unaccepted connections with it */
+    if (sock->state == SOCKET_STATE_LISTENING) {
+        for (int i = 0; i < MAX_SOCKETS; i++) {
+            if (sockets[i] && sockets[i]->parent == sock) {
+                enhanced_socket_close(i);
+            }
+        }
+        for (uint32_t i = 0; i < sock->accept_count; i++) {
+            enhanced_socket_close(sock->cold->accept_queue[(sock->accept_head + i) % TCP_BACKLOG_MAX]);
+        }
+    }
+    if (sock->parent) {
+        sock->parent->syn_count--;
+    }
+    
+    tcp_stop_timers(sock);
+    ep_queue_release(&sock->wait);
+    socket_est_unhash(sock);
+    socket_port_unhash(sock);
+    sockets[socket_id] = NULL;
+    free_socket_ids[free_socket_id_count++] = socket_id;
+    sockbuf_free(sock->rx_buffer);
+    sockbuf_free(sock->tx_buffer);
+    kmem_cache_free(socket_cold_cache, sock->cold);
+    kmem_cache_free(socket_cache, sock);
+    
+    return 0;
+}
+
+int enhanced_socket_bind(int socket_id, uint32_t ip_address, uint16_t port) {
+    enhanced_socket_t* sock = socket_lookup(socket_id);
+    if (!sock) return -1;
+    
+    socket_port_unhash(sock);
+    sock->local_ip = ip_address;
+    sock->local_port = htons(port);
+    
+    /* Datagram sockets take traffic as soon as they are bound */
+    if (sock->type == SOCKET_TYPE_DGRAM) {
+        if (!socket_port_available(sock)) return -1;
+        socket_port_hash(sock);
+    }
+    
+    return 0;
+}
+
+int enhanced_socket_listen(int socket_id, int backlog) {
+    enhanced_socket_t* sock = socket_lookup(socket_id);
+    if (!sock || sock->state != SOCKET_STATE_CLOSED || !socket_port_available(sock)) return -1;
+    
+    sock->state = SOCKET_STATE_LISTENING;
+    sock->backlog = backlog > 0 && backlog < TCP_BACKLOG_MAX ? (uint32_t)backlog : TCP_BACKLOG_MAX;
+    sock->accept_head = 0;
+    sock->accept_count = 0;
+    sock->syn_count = 0;
+    socket_port_hash(sock);
+    
+    return 0;
+}
+
+/* Fold one RTT sample into the smoothed RTT and its variation (RFC 6298 gains) */
+static void network_rtt_sample(uint64_t rtt_ns) {
+    /* Clamp first so the divide stays 32-bit */
+    uint32_t rtt_us = (rtt_ns > 0xFFFFFFFFull ? 0xFFFFFFFFu : (uint32_t)rtt_ns) / 1000;
+    
+    uint32_t flags = write_seqlock_irqsave(&network_stats_lock);
+    if (network_stats.round_trip_time == 0) {
+        network_stats.round_trip_time = rtt_us;
+        network_stats.jitter = rtt_us / 2;
+    } else {
+        uint32_t srtt = network_stats.round_trip_time;
+        uint32_t delta = rtt_us > srtt ? rtt_us - srtt : srtt - rtt_us;
+        network_stats.jitter = network_stats.jitter - network_stats.jitter / 4 + delta / 4;
+        network_stats.round_trip_time = srtt - srtt / 8 + rtt_us / 8;
+    }
+    write_sequnlock_irqrestore(&network_stats_lock, flags);
+}
+
+/* Timer callbacks only queue the socket; the work runs in enhanced_network_poll */
+static void tcp_post_event(enhanced_socket_t* sock, uint8_t event) {
+    uint32_t flags = spin_lock_irqsave(&tcp_event_lock);
+    if (!sock->events) {
+        sock->event_next = tcp_event_list;
+        tcp_event_list = sock;
+    }
+    sock->events |= event;
+    spin_unlock_irqrestore(&tcp_event_lock, flags);
+}
+
+static void tcp_rto_expire(void* data) {
+    tcp_post_event((enhanced_socket_t*)data, TCP_EVENT_RTO);
+}
+
+static void tcp_delack_expire(void* data) {
+    tcp_post_event((enhanced_socket_t*)data, TCP_EVENT_DELACK);
+}
+
+/* Drop a socket's timers and any queued timer work before it is freed */
+static void tcp_stop_timers(enhanced_socket_t* sock) {
+    timer_cancel(&sock->rto_timer);
+    timer_cancel(&sock->delack_timer);
+    
+    uint32_t flags = spin_lock_irqsave(&tcp_event_lock);
+    if (sock->events) {
+        enhanced_socket_t** link = &tcp_event_list;
+        while (*link != sock) link = &(*link)->event_next;
+        *link = sock->event_next;
+        sock->events = 0;
+    }
+    spin_unlock_irqrestore(&tcp_event_lock, flags);
+}
+
+static void tcp_arm_rto(enhanced_socket_t* sock) {
+    timer_add(&sock->rto_timer, timer_wheel_now() + sock->timeout);
+}
+
+/* RFC 6298 estimator, in ticks */
+static void tcp_rtt_sample(enhanced_socket_t* sock, uint32_t rtt) {
+    if (sock->srtt == 0 && sock->rttvar == 0) {
+        sock->srtt = rtt;
+        sock->rttvar = rtt / 2;
+    } else {
+        uint32_t delta = rtt > sock->srtt ? rtt - sock->srtt : sock->srtt - rtt;
+        sock->rttvar = sock->rttvar - sock->rttvar / 4 + delta / 4;
+        sock->srtt = sock->srtt - sock->srtt / 8 + rtt / 8;
+    }
+    
+    uint32_t rto = sock->srtt + (4 * sock->rttvar > 1 ? 4 * sock->rttvar : 1);
+    sock->timeout = rto < TCP_RTO_MIN ? TCP_RTO_MIN : (rto > TCP_RTO_MAX ? TCP_RTO_MAX : rto);
+}
+
+/* Free receive buffer space, which is what we advertise */
+static uint32_t tcp_receive_window(const enhanced_socket_t* sock) {
+    return sock->rx_buffer_size - (sock->rx_head - sock->rx_tail);
+}
+
+/* Hand an IP datagram to the loopback queue or to the interface it routes out of */
+static void ip_transmit(const uint8_t* frame, uint32_t size) {
+    const enhanced_ip_header_t* ip = (const enhanced_ip_header_t*)frame;
+    this_cpu_add(PCPU_NET_TX_PACKETS, 1);
+    this_cpu_add(PCPU_NET_TX_BYTES, size);
+    
+    int local = (ip->destination_ip & 0xFF) == 127;
+    for (int i = 0; i < MAX_NETWORK_INTERFACES && !local; i++) {
+        local = interfaces[i].is_up && interfaces[i].ip_address == ip->destination_ip;
+    }
+    if (!local) {
+        /* No link-layer driver is attached to this stack yet */
+        net_stat_add(&network_stats.packet_loss, 1);
+        return;
+    }
+    
+    if (loopback_head - loopback_tail == LOOPBACK_QUEUE_LEN || size > LOOPBACK_FRAME_SIZE) {
+        net_stat_add(&network_stats.packet_loss, 1);
+        return;
+    }
+    struct loopback_frame* slot = &loopback_queue[loopback_head % LOOPBACK_QUEUE_LEN];
+    memcpy(slot->data, frame, size);
+    slot->size = size;
+    loopback_head++;
+    interfaces[0].tx_packets++;
+    interfaces[0].tx_bytes += size;
+}
+
+/* Checksum, wrap in IPv4 and send a TCP segment already built at frame + IP_HEADER_LEN */
+static void tcp_transmit(uint8_t* frame, uint32_t src_ip, uint32_t dst_ip, uint32_t tcp_size) {
+    enhanced_ip_header_t* ip = (enhanced_ip_header_t*)frame;
+    enhanced_tcp_header_t* tcp = (enhanced_tcp_header_t*)(frame + IP_HEADER_LEN);
+    
+    /* Pseudo-header: addresses, protocol and TCP length, summed ahead of the segment */
+    uint32_t sum = csum_partial(&src_ip, 4, 0);
+    sum = csum_partial(&dst_ip, 4, sum);
+    sum += htons(NET_PROTOCOL_TCP) + htons((uint16_t)tcp_size);
+    tcp->checksum = 0;
+    tcp->checksum = csum_fold(csum_partial(tcp, tcp_size, sum));
+    
+    ip->version_ihl = 0x45;
+    ip->type_of_service = 0;
+    ip->total_length = htons((uint16_t)(IP_HEADER_LEN + tcp_size));
+    ip->identification = htons((uint16_t)ip_identification++);
+    ip->flags_fragment = htons(0x4000);  /* Don't fragment */
+    ip->ttl = 64;
+    ip->protocol = NET_PROTOCOL_TCP;
+    ip->source_ip = src_ip;
+    ip->destination_ip = dst_ip;
+    ip->checksum = 0;
+    ip->checksum = calculate_checksum(ip, IP_HEADER_LEN);
+    
+    ip_transmit(frame, IP_HEADER_LEN + tcp_size);
+}
+
+static enhanced_tcp_header_t* tcp_build_header(uint8_t* frame, uint16_t src_port, uint16_t dst_port,
+                                               uint32_t seq, uint32_t ack, uint8_t flags, uint16_t window) {
+    enhanced_tcp_header_t* tcp = (enhanced_tcp_header_t*)(frame + IP_HEADER_LEN);
+    tcp->source_port = src_port;
+    tcp->destination_port = dst_port;
+    tcp->sequence_number = htonl(seq);
+    tcp->acknowledgment_number = htonl(ack);
+    tcp->data_offset = (TCP_HEADER_LEN / 4) << 4;
+    tcp->flags = flags;
+    tcp->window_size = htons(window);
+    tcp->urgent_pointer = 0;
+    return tcp;
+}
+
+/* Options parsed from one segment */
+typedef struct {
+    uint32_t mss;               /* 0 when absent */
+    uint8_t wscale;
+    uint8_t has_wscale;
+    uint8_t sack_permitted;
+    uint8_t has_timestamp;
+    uint32_t ts_val;
+    uint32_t ts_ecr;
+    uint32_t sack_count;
+    uint32_t sack_start[4];
+    uint32_t sack_end[4];
+    uint8_t has_fastopen;
+    uint8_t fastopen_len;       /* 0: a request for a cookie */
+    uint8_t fastopen_cookie[16];
+} tcp_options_t;
+
+static uint32_t get_be32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint8_t* put_be32(uint8_t* p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+    return p + 4;
+}
+
+static void tcp_parse_options(const enhanced_tcp_header_t* tcp, uint32_t header_len, tcp_options_t* opts) {
+    memset(opts, 0, sizeof(*opts));
+    const uint8_t* p = tcp->options;
+    const uint8_t* end = (const uint8_t*)tcp + header_len;
+    
+    while (p < end && *p != TCPOPT_EOL) {
+        if (*p == TCPOPT_NOP) {
+            p++;
+            continue;
+        }
+        if (p + 2 > end || p[1] < 2 || p + p[1] > end) break;
+        uint8_t kind = p[0];
+        uint8_t len = p[1];
+        
+        if (kind == TCPOPT_MSS && len == 4) {
+            opts->mss = ((uint32_t)p[2] << 8) | p[3];
+        } else if (kind == TCPOPT_WSCALE && len == 3) {
+            opts->has_wscale = 1;
+            opts->wscale = p[2] > 14 ? 14 : p[2];  /* RFC 7323 limit */
+        } else if (kind == TCPOPT_SACK_PERMITTED && len == 2) {
+            opts->sack_permitted = 1;
+        } else if (kind == TCPOPT_TIMESTAMP && len == 10) {
+            opts->has_timestamp = 1;
+            opts->ts_val = get_be32(p + 2);
+            opts->ts_ecr = get_be32(p + 6);
+        } else if (kind == TCPOPT_SACK && (len - 2) % 8 == 0) {
+            for (uint32_t i = 0; i < (uint32_t)(len - 2) / 8 && i < 4; i++) {
+                opts->sack_start[i] = get_be32(p + 2 + i * 8);
+                opts->sack_end[i] = get_be32(p + 6 + i * 8);
+                opts->sack_count++;
+            }
+        } else if (kind == TCPOPT_FASTOPEN && len <= 18) {
+            opts->has_fastopen = 1;
+            opts->fastopen_len = len - 2;
+            memcpy(opts->fastopen_cookie, p + 2, len - 2);
+        }
+        p += len;
+    }
+}
+
+/* The Fast Open cookie for a client at ip (as on the wire) */
+static void tcp_fastopen_cookie(uint32_t ip, uint8_t cookie[TCP_FASTOPEN_COOKIE_LEN]) {
+    uint32_t state[16] = {0x61707865, 0x3320646E, 0x79622D32, 0x6B206574};
+    for (int i = 0; i < 8; i++) state[4 + i] = fastopen_secret[i];
+    state[12] = ip;
+    uint32_t out[16];
+    chacha20_block(state, out);
+    store32_le(cookie, out[0]);
+    store32_le(cookie + 4, out[1]);
+}
+
+/* Whether a SYN from ip presents the cookie we would issue it */
+static int tcp_fastopen_valid(uint32_t ip, const tcp_options_t* opts) {
+    uint8_t cookie[TCP_FASTOPEN_COOKIE_LEN];
+    if (opts->fastopen_len != TCP_FASTOPEN_COOKIE_LEN) return 0;
+    tcp_fastopen_cookie(ip, cookie);
+    uint8_t diff = 0;
+    for (uint32_t i = 0; i < TCP_FASTOPEN_COOKIE_LEN; i++) diff |= cookie[i] ^ opts->fastopen_cookie[i];
+    return diff == 0;
+}
+
+/* The cookie held for the server at ip, or NULL */
+static struct tcp_fastopen_entry* tcp_fastopen_lookup(uint32_t ip) {
+    for (uint32_t i = 0; i < TCP_FASTOPEN_CACHE; i++) {
+        if (tcp_fastopen_cache[i].len && tcp_fastopen_cache[i].ip == ip) {
+            tcp_fastopen_cache[i].last_used = ++tcp_fastopen_clock;
+            return &tcp_fastopen_cache[i];
+        }
+    }
+    return NULL;
+}
+
+/* Remember the cookie a server's SYN-ACK issued, in place of its old one or the least recently used */
+static void tcp_fastopen_store(uint32_t ip, const tcp_options_t* opts) {
+    struct tcp_fastopen_entry* entry = &tcp_fastopen_cache[0];
+    for (uint32_t i = 0; i < TCP_FASTOPEN_CACHE; i++) {
+        if (tcp_fastopen_cache[i].len && tcp_fastopen_cache[i].ip == ip) {
+            entry = &tcp_fastopen_cache[i];
+            break;
+        }
+        if (tcp_fastopen_cache[i].last_used < entry->last_used || !tcp_fastopen_cache[i].len) {
+            entry = &tcp_fastopen_cache[i];
+        }
+    }
+    uint32_t mss = opts->mss ? opts->mss : TCP_MSS_DEFAULT;
+    entry->ip = ip;
+    entry->mss = mss > TCP_MSS ? TCP_MSS : mss;
+    entry->last_used = ++tcp_fastopen_clock;
+    entry->len = opts->fastopen_len;
+    memcpy(entry->cookie, opts->fastopen_cookie, opts->fastopen_len);
+}
+
+/*
+ * Build this segment's options into out, returning their length. SYNs offer MSS, window
+ * scale, SACK and timestamps (a SYN-ACK echoes only what the peer offered),
+ * and Fast Open when asked to; later segments carry a timestamp and, while we hold out-of-order data, SACK
+ * blocks with the most recently received range first.
+ */
+static uint32_t tcp_build_options(enhanced_socket_t* sock, uint8_t flags, uint8_t* out) {
+    uint8_t* p = out;
+    
+    if (flags & TCP_FLAG_SYN) {
+        *p++ = TCPOPT_MSS;
+        *p++ = 4;
+        *p++ = TCP_MSS >> 8;
+        *p++ = TCP_MSS & 0xFF;
+        if (sock->rcv_wscale || !(flags & TCP_FLAG_ACK)) {
+            *p++ = TCPOPT_NOP;
+            *p++ = TCPOPT_WSCALE;
+            *p++ = 3;
+            *p++ = sock->rcv_wscale;
+        }
+        if (sock->sack_ok) {
+            *p++ = TCPOPT_SACK_PERMITTED;
+            *p++ = 2;
+        } else if (sock->ts_ok) {
+            *p++ = TCPOPT_NOP;
+            *p++ = TCPOPT_NOP;
+        }
+    } else if (sock->ts_ok) {
+        *p++ = TCPOPT_NOP;
+        *p++ = TCPOPT_NOP;
+    }
+    
+    if (sock->ts_ok) {
+        *p++ = TCPOPT_TIMESTAMP;
+        *p++ = 10;
+        p = put_be32(p, timer_wheel_now());
+        p = put_be32(p, sock->ts_recent);
+    }
+    
+    /* A client's SYN presents the cookie it holds for the server or asks for one; a SYN-ACK issues one */
+    if ((flags & TCP_FLAG_SYN) && (sock->fastopen & TCP_FASTOPEN_OPTION)) {
+        uint8_t cookie[TCP_FASTOPEN_COOKIE_LEN];
+        const uint8_t* value = cookie;
+        uint32_t len = TCP_FASTOPEN_COOKIE_LEN;
+        if (flags & TCP_FLAG_ACK) {
+            tcp_fastopen_cookie(sock->remote_ip, cookie);
+        } else {
+            struct tcp_fastopen_entry* entry = tcp_fastopen_lookup(sock->remote_ip);
+            value = entry ? entry->cookie : cookie;
+            len = entry ? entry->len : 0;
+        }
+        *p++ = TCPOPT_FASTOPEN;
+        *p++ = 2 + len;
+        memcpy(p, value, len);
+        p += len;
+    }
+    
+    if (!(flags & TCP_FLAG_SYN) && (flags & TCP_FLAG_ACK) && sock->sack_ok && sock->ooo_count) {
+        uint32_t blocks = sock->ooo_count < (sock->ts_ok ? 3u : 4u) ? sock->ooo_count : (sock->ts_ok ? 3u : 4u);
+        *p++ = TCPOPT_NOP;
+        *p++ = TCPOPT_NOP;
+        *p++ = TCPOPT_SACK;
+        *p++ = 2 + blocks * 8;
+        for (uint32_t i = 0; i < blocks; i++) {
+            p = put_be32(p, sock->ooo_start[i]);
+            p = put_be32(p, sock->ooo_end[i]);
+        }
+    }
+    
+    while ((p - out) & 3) {
+        *p++ = TCPOPT_NOP;
+    }
+    return p - out;
+}
+
+/* Settle the options of a handshake: each one is used only if both SYNs carried it */
+static void tcp_negotiate(enhanced_socket_t* sock, const tcp_options_t* opts) {
+    if (opts->has_wscale) {
+        sock->snd_wscale = opts->wscale;
+    } else {
+        sock->snd_wscale = 0;
+        sock->rcv_wscale = 0;
+    }
+    sock->sack_ok = sock->sack_ok && opts->sack_permitted;
+    sock->ts_ok = sock->ts_ok && opts->has_timestamp;
+    if (sock->ts_ok) sock->ts_recent = opts->ts_val;
+    
+    uint32_t mss = opts->mss ? opts->mss : TCP_MSS_DEFAULT;
+    if (mss > TCP_MSS) mss = TCP_MSS;
+    sock->mss = mss - (sock->ts_ok ? TCP_TIMESTAMP_SPACE : 0);
+}
+
+/*
+ * Send one segment from a connection: seq and len select bytes of the transmit
+ * ring (relative to snd_una at tx_tail). Every segment but the first SYN
+ * carries an ACK, which satisfies any pending delayed ACK. More than one MSS
+ * is a super-segment: the header and options are built once, and each
+ * MSS-sized piece goes out under them with its own sequence number, PSH and
+ * FIN only on the last.
+ */
+static void tcp_send_segment(enhanced_socket_t* sock, uint32_t seq, uint8_t flags, uint32_t len) {
+    uint8_t frame[LOOPBACK_FRAME_SIZE];
+    
+    /* Windows in SYNs are never scaled */
+    uint32_t window = tcp_receive_window(sock);
+    uint32_t shift = (flags & TCP_FLAG_SYN) ? 0 : sock->rcv_wscale;
+    uint32_t field = window >> shift > 0xFFFF ? 0xFFFF : window >> shift;
+    enhanced_tcp_header_t* tcp = tcp_build_header(frame, sock->local_port, sock->remote_port, seq,
+                                                  sock->acknowledgment_number, flags, (uint16_t)field);
+    
+    uint32_t options_len = tcp_build_options(sock, flags, tcp->options);
+    tcp->data_offset = ((TCP_HEADER_LEN + options_len) / 4) << 4;
+    
+    if (flags & TCP_FLAG_ACK) {
+        sock->window_size = field << shift;
+        sock->rcv_unacked = 0;
+        timer_cancel(&sock->delack_timer);
+    }
+    
+    uint8_t* payload = frame + IP_HEADER_LEN + TCP_HEADER_LEN + options_len;
+    uint32_t sent = 0;
+    do {
+        uint32_t chunk = len - sent > sock->mss ? sock->mss : len - sent;
+        uint32_t offset = (sock->tx_tail + (seq + sent - sock->snd_una)) % sock->tx_buffer_size;
+        uint32_t first = sock->tx_buffer_size - offset;
+        if (first > chunk) first = chunk;
+        memcpy(payload, sock->tx_buffer + offset, first);
+        memcpy(payload + first, sock->tx_buffer, chunk - first);
+        
+        tcp->sequence_number = htonl(seq + sent);
+        tcp->flags = sent + chunk < len ? flags & ~(TCP_FLAG_PSH | TCP_FLAG_FIN) : flags;
+        if (len > sock->mss) net_stat_add(&network_stats.gso_segments, 1);
+        sock->cold->stats.packets_sent++;
+        tcp_transmit(frame, sock->local_ip, sock->remote_ip, TCP_HEADER_LEN + options_len + chunk);
+        sent += chunk;
+    } while (sent < len);
+}
+
+static void tcp_send_ack(enhanced_socket_t* sock) {
+    tcp_send_segment(sock, sock->sequence_number, TCP_FLAG_ACK, 0);
+}
+
+/* Answer a segment that matches no connection (RFC 793 reset generation) */
+static void tcp_send_reset(const enhanced_ip_header_t* ip, const enhanced_tcp_header_t* in, uint32_t seg_len) {
+    uint8_t frame[IP_HEADER_LEN + sizeof(enhanced_tcp_header_t)];
+    if (in->flags & TCP_FLAG_ACK) {
+        tcp_build_header(frame, in->destination_port, in->source_port,
+                         htonl(in->acknowledgment_number), 0, TCP_FLAG_RST, 0);
+    } else {
+        tcp_build_header(frame, in->destination_port, in->source_port, 0,
+                         htonl(in->sequence_number) + seg_len, TCP_FLAG_RST | TCP_FLAG_ACK, 0);
+    }
+    tcp_transmit(frame, ip->destination_ip, ip->source_ip, TCP_HEADER_LEN);
+}
+
+/* Resend the oldest unacknowledged segment; Karn's rule stops any RTT timing */
+static void tcp_retransmit(enhanced_socket_t* sock) {
+    uint32_t len = sock->snd_max - sock->snd_una;
+    if (len > sock->mss) len = sock->mss;
+    sock->rtt_timing = 0;
+    net_stat_add(&network_stats.retransmissions, 1);
+    tcp_send_segment(sock, sock->snd_una, TCP_FLAG_ACK, len);
+}
+
+static uint32_t tcp_sack_bytes(const enhanced_socket_t* sock) {
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < sock->sack_count; i++) {
+        total += sock->sack_end[i] - sock->sack_start[i];
+    }
+    return total;
+}
+
+/* Merge a SACK block into the sorted scoreboard */
+static void tcp_sack_add(enhanced_socket_t* sock, uint32_t start, uint32_t end) {
+    uint32_t first = 0;
+    while (first < sock->sack_count && SEQ_LT(sock->sack_end[first], start)) first++;
+    
+    uint32_t last = first;
+    while (last < sock->sack_count && SEQ_LEQ(sock->sack_start[last], end)) {
+        if (SEQ_LT(sock->sack_start[last], start)) start = sock->sack_start[last];
+        if (SEQ_GT(sock->sack_end[last], end)) end = sock->sack_end[last];
+        last++;
+    }
+    
+    if (first == last) {
+        /* A new range; when the scoreboard is full the block is simply not tracked */
+        if (sock->sack_count == TCP_SACK_RANGES) return;
+        for (uint32_t i = sock->sack_count; i > first; i--) {
+            sock->sack_start[i] = sock->sack_start[i - 1];
+            sock->sack_end[i] = sock->sack_end[i - 1];
+        }
+        sock->sack_count++;
+    } else {
+        /* Ranges first..last-1 collapse into one */
+        uint32_t removed = last - first - 1;
+        for (uint32_t i = first + 1; i + removed < sock->sack_count; i++) {
+            sock->sack_start[i] = sock->sack_start[i + removed];
+            sock->sack_end[i] = sock->sack_end[i + removed];
+        }
+        sock->sack_count -= removed;
+    }
+    sock->sack_start[first] = start;
+    sock->sack_end[first] = end;
+}
+
+/* Drop scoreboard ranges the cumulative ACK has passed */
+static void tcp_sack_trim(enhanced_socket_t* sock) {
+    uint32_t gone = 0;
+    while (gone < sock->sack_count && SEQ_LEQ(sock->sack_end[gone], sock->snd_una)) gone++;
+    for (uint32_t i = gone; i < sock->sack_count; i++) {
+        sock->sack_start[i - gone] = sock->sack_start[i];
+        sock->sack_end[i - gone] = sock->sack_end[i];
+    }
+    sock->sack_count -= gone;
+    if (sock->sack_count && SEQ_LT(sock->sack_start[0], sock->snd_una)) {
+        sock->sack_start[0] = sock->snd_una;
+    }
+}
+
+/*
+ * RFC 6675 pipe, treating every unSACKed byte below the highest SACKed one as
+ * lost: what is still above that point plus the holes resent so far.
+ */
+static uint32_t tcp_sack_pipe(enhanced_socket_t* sock) {
+    if (SEQ_LT(sock->high_rxt, sock->snd_una)) sock->high_rxt = sock->snd_una;
+    if (sock->sack_count == 0) return sock->snd_max - sock->snd_una;
+    
+    uint32_t fack = sock->sack_end[sock->sack_count - 1];
+    uint32_t resent_to = SEQ_LT(sock->high_rxt, fack) ? sock->high_rxt : fack;
+    uint32_t resent = resent_to - sock->snd_una;
+    for (uint32_t i = 0; i < sock->sack_count && SEQ_LT(sock->sack_start[i], resent_to); i++) {
+        uint32_t end = SEQ_LT(sock->sack_end[i], resent_to) ? sock->sack_end[i] : resent_to;
+        resent -= end - sock->sack_start[i];
+    }
+    return (sock->snd_max - fack) + resent;
+}
+
+/* Resend the next hole not yet resent in this recovery; returns bytes sent */
+static uint32_t tcp_sack_retransmit(enhanced_socket_t* sock) {
+    uint32_t seq = SEQ_LT(sock->high_rxt, sock->snd_una) ? sock->snd_una : sock->high_rxt;
+    for (uint32_t i = 0; i < sock->sack_count; i++) {
+        if (SEQ_LEQ(sock->sack_end[i], seq)) continue;
+        if (SEQ_LEQ(sock->sack_start[i], seq)) {
+            seq = sock->sack_end[i];
+            continue;
+        }
+        
+        uint32_t len = sock->sack_start[i] - seq;
+        if (len > sock->mss) len = sock->mss;
+        sock->rtt_timing = 0;
+        net_stat_add(&network_stats.retransmissions, 1);
+        tcp_send_segment(sock, seq, TCP_FLAG_ACK, len);
+        sock->high_rxt = seq + len;
+        return len;
+    }
+    return 0;
+}
+
+/* Fast recovery on a third duplicate ACK, or sooner once SACKs show enough loss */
+static void tcp_enter_recovery(enhanced_socket_t* sock) {
+    uint32_t mss = sock->mss;
+    uint32_t flight = sock->snd_max - sock->snd_una;
+    sock->slow_start_threshold = flight / 2 > 2 * mss ? flight / 2 : 2 * mss;
+    sock->recover = sock->snd_max;
+    sock->in_recovery = 1;
+    if (sock->sack_ok) {
+        sock->congestion_window = sock->slow_start_threshold;
+        sock->high_rxt = sock->snd_una;
+        tcp_sack_retransmit(sock);
+    } else {
+        tcp_retransmit(sock);
+        sock->congestion_window = sock->slow_start_threshold + TCP_DUPACK_THRESHOLD * mss;
+    }
+}
+
+/*
+ * Send as much queued data as min(cwnd, peer window) allows. In SACK recovery
+ * cwnd limits the pipe rather than the whole flight, and holes go out first.
+ */
+static void tcp_output(enhanced_socket_t* sock) {
+    if (sock->state != SOCKET_STATE_ESTABLISHED && sock->state != SOCKET_STATE_CLOSE_WAIT &&
+        !(sock->state == SOCKET_STATE_SYN_RECEIVED && (sock->fastopen & TCP_FASTOPEN_OPEN))) {
+        return;
+    }
+    uint32_t mss = sock->mss;
+    
+    for (;;) {
+        /* Resending after an RTO: step over ranges the peer already holds */
+        uint32_t seq = sock->sequence_number;
+        for (uint32_t i = 0; i < sock->sack_count; i++) {
+            if (SEQ_LEQ(sock->sack_start[i], seq) && SEQ_LT(seq, sock->sack_end[i])) seq = sock->sack_end[i];
+        }
+        sock->sequence_number = seq;
+        
+        uint32_t in_flight = seq - sock->snd_una;
+        uint32_t queued = sock->tx_head - sock->tx_tail;
+        uint32_t unsent = queued - in_flight;
+        uint32_t room;
+        if (sock->in_recovery && sock->sack_ok) {
+            uint32_t pipe = tcp_sack_pipe(sock);
+            if (pipe + mss > sock->congestion_window) break;
+            if (tcp_sack_retransmit(sock)) continue;
+            room = sock->congestion_window - pipe;
+        } else {
+            /* Limited transmit (RFC 3042): each early duplicate ACK lets one new segment out */
+            uint32_t cwnd = sock->congestion_window + (sock->in_recovery ? 0 : sock->dupacks * mss);
+            room = in_flight < cwnd ? cwnd - in_flight : 0;
+        }
+        if (in_flight >= sock->snd_wnd) room = 0;
+        if (room > sock->snd_wnd - in_flight) room = sock->snd_wnd - in_flight;
+        if (unsent == 0 || room == 0) break;
+        
+        /* Whole MSS multiples, or everything left, go down as one super-segment */
+        uint32_t len = room;
+        if (len > unsent) len = unsent;
+        if (len > TCP_GSO_MAX_SIZE) len = TCP_GSO_MAX_SIZE;
+        if (len > mss && len < unsent) len -= len % mss;
+        /* Sender silly-window avoidance: no runt segments while data is in flight */
+        if (len < mss && len < unsent && in_flight) break;
+        for (uint32_t i = 0; i < sock->sack_count; i++) {
+            if (SEQ_GT(sock->sack_start[i], seq) && SEQ_LT(sock->sack_start[i], seq + len)) {
+                len = sock->sack_start[i] - seq;
+            }
+        }
+        
+        if (!sock->rtt_timing && SEQ_GEQ(seq, sock->snd_max)) {
+            sock->rtt_timing = 1;
+            sock->rtt_seq = seq;
+            sock->rtt_start = timer_wheel_now();
+            sock->rtt_sent_ns = ktime_ns();
+        }
+        tcp_send_segment(sock, seq, TCP_FLAG_ACK | (len == unsent ? TCP_FLAG_PSH : 0), len);
+        sock->sequence_number = seq + len;
+        if (SEQ_GT(sock->sequence_number, sock->snd_max)) {
+            sock->snd_max = sock->sequence_number;
+        }
+        if (!timer_pending(&sock->rto_timer)) {
+            tcp_arm_rto(sock);
+        }
+    }
+    
+    /* Data waiting on a zero window: the RTO timer doubles as the persist timer */
+    if (sock->tx_head != sock->tx_tail && !timer_pending(&sock->rto_timer)) {
+        tcp_arm_rto(sock);
+    }
+}
+
+/* Process the acknowledgment, SACK blocks and window of an incoming segment */
+static void tcp_ack(enhanced_socket_t* sock, uint32_t ack, uint32_t window, uint32_t seg_len,
+                    const tcp_options_t* opts) {
+    uint32_t mss = sock->mss;
+    if (SEQ_GT(ack, sock->snd_max)) return;  /* Acknowledges data never sent */
+    
+    uint32_t sacked = tcp_sack_bytes(sock);
+    if (sock->sack_ok) {
+        for (uint32_t i = 0; i < opts->sack_count; i++) {
+            uint32_t start = opts->sack_start[i];
+            uint32_t end = opts->sack_end[i];
+            if (SEQ_LT(start, ack)) start = ack;
+            if (SEQ_LT(start, end) && SEQ_LEQ(end, sock->snd_max)) tcp_sack_add(sock, start, end);
+        }
+    }
+    int new_sack = tcp_sack_bytes(sock) > sacked;
+    
+    if (SEQ_GT(ack, sock->snd_una)) {
+        uint32_t acked = ack - sock->snd_una;
+        sock->tx_tail += acked;
+        sock->snd_una = ack;
+        if (SEQ_LT(sock->sequence_number, ack)) {
+            sock->sequence_number = ack;
+        }
+        sock->snd_wnd = window;
+        sock->retries = 0;
+        tcp_sack_trim(sock);
+        ep_wake(&sock->wait, EPOLLOUT);
+        
+        /* The network-wide RTT comes only from the timed segment, which is never a retransmission (Karn) */
+        if (sock->rtt_timing && SEQ_GT(ack, sock->rtt_seq)) {
+            network_rtt_sample(ktime_ns() - sock->rtt_sent_ns);
+        }
+        
+        /* An echoed timestamp times any segment, retransmitted or not (RFC 7323) */
+        if (sock->ts_ok && opts->has_timestamp && opts->ts_ecr) {
+            sock->rtt_timing = 0;
+            tcp_rtt_sample(sock, timer_wheel_now() - opts->ts_ecr);
+        } else if (sock->rtt_timing && SEQ_GT(ack, sock->rtt_seq)) {
+            sock->rtt_timing = 0;
+            tcp_rtt_sample(sock, timer_wheel_now() - sock->rtt_start);
+        }
+        
+        if (sock->in_recovery && sock->sack_ok) {
+            if (SEQ_GEQ(ack, sock->recover)) {
+                sock->in_recovery = 0;
+                sock->congestion_window = sock->slow_start_threshold;
+            }
+        } else if (sock->in_recovery) {
+            if (SEQ_GEQ(ack, sock->recover)) {
+                /* Full ACK: leave recovery with cwnd deflated to ssthresh */
+                uint32_t flight = sock->snd_max - ack;
+                sock->in_recovery = 0;
+                sock->congestion_window = sock->slow_start_threshold < flight + mss ?
+                                          sock->slow_start_threshold : flight + mss;
+            } else {
+                /* Partial ACK: the next hole is lost too, resend it without waiting */
+                tcp_retransmit(sock);
+                sock->congestion_window = acked < sock->congestion_window ? sock->congestion_window - acked : 0;
+                if (acked >= mss || sock->congestion_window < mss) sock->congestion_window += mss;
+            }
+        } else if (sock->congestion_window < sock->slow_start_threshold) {
+            sock->congestion_window += acked < mss ? acked : mss;
+        } else {
+            uint32_t growth = mss * mss / sock->congestion_window;
+            sock->congestion_window += growth ? growth : 1;
+        }
+        sock->congestion_avoidance = sock->congestion_window >= sock->slow_start_threshold;
+        sock->dupacks = 0;
+        
+        if (sock->snd_una == sock->snd_max) {
+            timer_cancel(&sock->rto_timer);
+        } else {
+            tcp_arm_rto(sock);
+        }
+    } else if (ack == sock->snd_una && seg_len == 0 && sock->snd_max != sock->snd_una &&
+               (sock->sack_ok ? new_sack : window && window == sock->snd_wnd)) {
+        /* Duplicate ACK; with SACK, only one that reports newly held data */
+        sock->dupacks++;
+        if (sock->dupacks == TCP_DUPACK_THRESHOLD && !sock->in_recovery) {
+            tcp_enter_recovery(sock);
+        } else if (sock->in_recovery && !sock->sack_ok) {
+            /* Each further duplicate means another segment has left the network */
+            sock->congestion_window += mss;
+        }
+    } else {
+        sock->snd_wnd = window;
+    }
+    
+    /* Enough SACKed data (RFC 6675 IsLost) starts recovery before the third duplicate */
+    if (sock->sack_ok && !sock->in_recovery && tcp_sack_bytes(sock) > (TCP_DUPACK_THRESHOLD - 1) * mss) {
+        tcp_enter_recovery(sock);
+    }
+    
+    tcp_output(sock);
+}
+
+/* Record an out-of-order range [start, end), merging it with any ranges it touches */
+static void tcp_ooo_insert(enhanced_socket_t* sock, uint32_t start, uint32_t end) {
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < sock->ooo_count; i++) {
+        if (SEQ_LT(end, sock->ooo_start[i]) || SEQ_GT(start, sock->ooo_end[i])) {
+            sock->ooo_start[kept] = sock->ooo_start[i];
+            sock->ooo_end[kept] = sock->ooo_end[i];
+            kept++;
+        } else {
+            if (SEQ_LT(sock->ooo_start[i], start)) start = sock->ooo_start[i];
+            if (SEQ_GT(sock->ooo_end[i], end)) end = sock->ooo_end[i];
+        }
+    }
+    
+    sock->ooo_count = kept;
+    if (kept == TCP_OOO_RANGES) return;  /* Not reported, so the sender will resend it */
+    
+    /* Newest range first, which is the order SACK blocks report them in (RFC 2018) */
+    for (uint32_t i = kept; i > 0; i--) {
+        sock->ooo_start[i] = sock->ooo_start[i - 1];
+        sock->ooo_end[i] = sock->ooo_end[i - 1];
+    }
+    sock->ooo_start[0] = start;
+    sock->ooo_end[0] = end;
+    sock->ooo_count = kept + 1;
+}
+
+/* Advance RCV.NXT over queued ranges that the in-order data has reached */
+static void tcp_ooo_collapse(enhanced_socket_t* sock) {
+    for (uint32_t i = 0; i < sock->ooo_count;) {
+        if (SEQ_GT(sock->ooo_start[i], sock->acknowledgment_number)) {
+            i++;
+            continue;
+        }
+        if (SEQ_GT(sock->ooo_end[i], sock->acknowledgment_number)) {
+            sock->rx_head += sock->ooo_end[i] - sock->acknowledgment_number;
+            sock->acknowledgment_number = sock->ooo_end[i];
+        }
+        sock->ooo_count--;
+        sock->ooo_start[i] = sock->ooo_start[sock->ooo_count];
+        sock->ooo_end[i] = sock->ooo_end[sock->ooo_count];
+        i = 0;
+    }
+}
+
+/*
+ * Place payload in the receive ring at its sequence offset, so segments that
+ * arrive out of order are kept and only the hole needs retransmitting; then
+ * decide whether to ACK now or after the delayed-ACK timer.
+ */
+static void tcp_data(enhanced_socket_t* sock, uint32_t seq, const uint8_t* payload, uint32_t len, uint8_t flags) {
+    uint32_t rcv_nxt = sock->acknowledgment_number;
+    uint32_t window_end = rcv_nxt + (sock->rx_buffer_size - (sock->rx_head - sock->rx_tail));
+    
+    /* Trim what we already have and what falls outside the window */
+    if (SEQ_LT(seq, rcv_nxt)) {
+        uint32_t skip = rcv_nxt - seq;
+        if (skip >= len) {
+            /* Pure duplicate; ACK so a peer that lost our ACK stops resending */
+            if (len || (flags & TCP_FLAG_FIN)) tcp_send_ack(sock);
+            return;
+        }
+        seq = rcv_nxt;
+        payload += skip;
+        len -= skip;
+    }
+    if (SEQ_GT(seq + len, window_end)) {
+        if (SEQ_GEQ(seq, window_end)) {
+            tcp_send_ack(sock);
+            return;
+        }
+        len = window_end - seq;
+        flags &= ~TCP_FLAG_FIN;
+    }
+    if (len && ring_reserve(&sock->rx_buffer, sock->rx_buffer_size) < 0) {
+        return; /* No ring and no memory for one: as good as lost */
+    }
+    
+    uint32_t offset = (sock->rx_head + (seq - rcv_nxt)) % sock->rx_buffer_size;
+    uint32_t first = sock->rx_buffer_size - offset;
+    if (first > len) first = len;
+    memcpy(sock->rx_buffer + offset, payload, first);
+    memcpy(sock->rx_buffer, payload + first, len - first);
+    
+    if (seq != rcv_nxt) {
+        /* Out of order: hold it and send an immediate duplicate ACK so the sender sees the loss */
+        if (len) tcp_ooo_insert(sock, seq, seq + len);
+        tcp_send_ack(sock);
+        return;
+    }
+    
+    int filled_hole = sock->ooo_count != 0;
+    sock->rx_head += len;
+    sock->acknowledgment_number += len;
+    tcp_ooo_collapse(sock);
+    ep_wake(&sock->wait, EPOLLIN);
+    
+    if ((flags & TCP_FLAG_FIN) && sock->ooo_count == 0) {
+        sock->acknowledgment_number++;
+        if (sock->state == SOCKET_STATE_ESTABLISHED) sock->state = SOCKET_STATE_CLOSE_WAIT;
+        tcp_send_ack(sock);
+        return;
+    }
+    
+    /* ACK at least every second full-sized segment's worth (RFC 5681), and at once when a hole fills */
+    sock->rcv_unacked += len;
+    if (sock->rcv_unacked >= 2 * sock->mss || filled_hole) {
+        tcp_send_ack(sock);
+    } else if (!timer_pending(&sock->delack_timer)) {
+        timer_add(&sock->delack_timer, timer_wheel_now() + TCP_DELACK_TICKS);
+    }
+}
+
+static void tcp_init_connection(enhanced_socket_t* sock) {
+    tcp_iss += 64000;
+    sock->snd_una = tcp_iss;
+    sock->sequence_number = tcp_iss + 1;  /* The SYN takes one sequence number */
+    sock->snd_max = tcp_iss + 1;
+    sock->snd_wnd = TCP_MSS;
+    sock->timeout = TCP_RTO_INIT;
+    sock->srtt = 0;
+    sock->rttvar = 0;
+    sock->retries = 0;
+    sock->sack_count = 0;
+    
+    /* Offer every option; tcp_negotiate drops what the peer does not */
+    sock->rcv_wscale = TCP_WSCALE;
+    sock->sack_ok = 1;
+    sock->ts_ok = 1;
+}
+
+/* Cookie MSS values, indexed by the three bits a cookie carries */
+static const uint16_t syncookie_mss[] = {536, 1200, 1300, 1440, 1460};
+#define SYNCOOKIE_MSS_COUNT (sizeof(syncookie_mss) / sizeof(syncookie_mss[0]))
+
+/* Keyed hash of a segment's 4-tuple and a counter value; addresses and ports as on the wire */
+static uint32_t syncookie_hash(const enhanced_ip_header_t* ip, const enhanced_tcp_header_t* tcp, uint32_t count) {
+    uint32_t state[16] = {0x61707865, 0x3320646E, 0x79622D32, 0x6B206574};
+    for (int i = 0; i < 8; i++) state[4 + i] = syncookie_secret[i];
+    state[12] = count;
+    state[13] = ip->source_ip;
+    state[14] = ip->destination_ip;
+    state[15] = ((uint32_t)tcp->source_port << 16) | tcp->destination_port;
+    uint32_t out[16];
+    chacha20_block(state, out);
+    return out[0];
+}
+
+/*
+ * The ISN that stands in for a SYN queue entry, as Linux builds it: the
+ * tuple's hash plus the peer's ISN, the counter in the top byte, and below
+ * it the MSS index hidden under a second hash that covers the counter.
+ */
+static uint32_t syncookie_make(const enhanced_ip_header_t* ip, const enhanced_tcp_header_t* tcp, uint32_t mss) {
+    uint32_t index = 0;
+    while (index + 1 < SYNCOOKIE_MSS_COUNT && syncookie_mss[index + 1] <= mss) index++;
+    uint32_t count = timer_wheel_now() / TCP_SYNCOOKIE_PERIOD;
+    return syncookie_hash(ip, tcp, 0) + htonl(tcp->sequence_number) + (count << 24) +
+           ((syncookie_hash(ip, tcp, count) + index) & 0xFFFFFF);
+}
+
+/* The MSS an ACK's cookie was made with, or 0 when it is not one of ours or has expired */
+static uint32_t syncookie_check(const enhanced_ip_header_t* ip, const enhanced_tcp_header_t* tcp) {
+    uint32_t cookie = htonl(tcp->acknowledgment_number) - 1;
+    uint32_t peer_isn = htonl(tcp->sequence_number) - 1;
+    uint32_t now = timer_wheel_now() / TCP_SYNCOOKIE_PERIOD;
+    cookie -= syncookie_hash(ip, tcp, 0) + peer_isn;
+    uint32_t count = cookie >> 24;
+    if (((now - count) & 0xFF) >= TCP_SYNCOOKIE_AGE) return 0;
+    
+    /* The counter was 32 bits when hashed; rebuild it from the 8 the cookie kept */
+    count = now - ((now - count) & 0xFF);
+    uint32_t index = (cookie - syncookie_hash(ip, tcp, count)) & 0xFFFFFF;
+    return index < SYNCOOKIE_MSS_COUNT ? syncookie_mss[index] : 0;
+}
+
+/* Answer a SYN with a cookie for its ISN and only an MSS option: nothing is kept to remember the rest */
+static void tcp_send_syncookie(const enhanced_ip_header_t* ip, const enhanced_tcp_header_t* in,
+                               const tcp_options_t* opts) {
+    uint8_t frame[IP_HEADER_LEN + sizeof(enhanced_tcp_header_t)];
+    uint32_t cookie = syncookie_make(ip, in, opts->mss ? opts->mss : TCP_MSS_DEFAULT);
+    enhanced_tcp_header_t* tcp = tcp_build_header(frame, in->destination_port, in->source_port, cookie,
+                                                  htonl(in->sequence_number) + 1, TCP_FLAG_SYN | TCP_FLAG_ACK,
+                                                  TCP_WINDOW_SIZE);
+    tcp->options[0] = TCPOPT_MSS;
+    tcp->options[1] = 4;
+    tcp->options[2] = TCP_MSS >> 8;
+    tcp->options[3] = TCP_MSS & 0xFF;
+    tcp->data_offset = ((TCP_HEADER_LEN + 4) / 4) << 4;
+    net_stat_add(&network_stats.syncookies_sent, 1);
+    tcp_transmit(frame, ip->destination_ip, ip->source_ip, TCP_HEADER_LEN + 4);
+}
+
+/* Queue an established child for accept; 0 when the accept queue is full */
+static int tcp_accept_enqueue(enhanced_socket_t* listener, int child_id) {
+    if (listener->accept_count >= listener->backlog) return 0;
+    listener->cold->accept_queue[(listener->accept_head + listener->accept_count++) % TCP_BACKLOG_MAX] = child_id;
+    ep_wake(&listener->wait, EPOLLIN);
+    return 1;
+}
+
+/* A connection for a segment from the peer in ip and tcp, on the listener's address */
+static enhanced_socket_t* tcp_create_child(enhanced_socket_t* listener, const enhanced_ip_header_t* ip,
+                                           const enhanced_tcp_header_t* tcp) {
+    int child_id = enhanced_socket_create(SOCKET_TYPE_STREAM, listener->protocol);
+    if (child_id < 0) return NULL;
+    enhanced_socket_t* child = sockets[child_id];
+    child->local_ip = ip->destination_ip;
+    child->local_port = tcp->destination_port;
+    child->remote_ip = ip->source_ip;
+    child->remote_port = tcp->source_port;
+    tcp_init_connection(child);
+    return child;
+}
+
+/*
+ * A segment on a listener. A SYN gets an embryonic connection on the SYN
+ * queue, or a cookie once that queue is full, while the accept queue has
+ * room for it to go to when established; otherwise the SYN is dropped and
+ * the peer retries. An ACK returning a good cookie becomes a connection
+ * straight onto the accept queue: its id is returned so the segment's
+ * data is processed on it. -1 when the segment is done with.
+ */
+static int tcp_listen_input(enhanced_socket_t* listener, const enhanced_ip_header_t* ip,
+                            const enhanced_tcp_header_t* tcp, const tcp_options_t* opts,
+                            const uint8_t* payload, uint32_t len) {
+    uint8_t flags = tcp->flags;
+    if ((flags & (TCP_FLAG_SYN | TCP_FLAG_ACK | TCP_FLAG_RST)) == TCP_FLAG_ACK && tcp_syncookies) {
+        uint32_t mss = syncookie_check(ip, tcp);
+        if (mss && listener->accept_count < listener->backlog) {
+            /* The options offered with the SYN are gone: none of them are used */
+            enhanced_socket_t* child = tcp_create_child(listener, ip, tcp);
+            if (!child) return -1;
+            child->acknowledgment_number = htonl(tcp->sequence_number);
+            child->snd_una = htonl(tcp->acknowledgment_number);
+            child->sequence_number = child->snd_una;
+            child->snd_max = child->snd_una;
+            child->snd_wnd = htons(tcp->window_size);
+            child->rcv_wscale = 0;
+            child->snd_wscale = 0;
+            child->sack_ok = 0;
+            child->ts_ok = 0;
+            child->mss = mss > TCP_MSS ? TCP_MSS : mss;
+            child->state = SOCKET_STATE_ESTABLISHED;
+            socket_est_hash(child);
+            tcp_accept_enqueue(listener, child->socket_id);
+            net_stat_add(&network_stats.syncookies_recv, 1);
+            return child->socket_id;
+        }
+        if (mss) return -1;  /* Accept queue full: the peer's retransmission brings the cookie back */
+    }
+    if (!(flags & TCP_FLAG_SYN) || (flags & TCP_FLAG_ACK)) {
+        if (!(flags & TCP_FLAG_RST)) tcp_send_reset(ip, tcp, 0);
+        return -1;
+    }
+    if (listener->accept_count >= listener->backlog) {
+        net_stat_add(&network_stats.listen_drops, 1);
+        return -1;
+    }
+    if (tcp_syncookies == 2 || (tcp_syncookies && listener->syn_count >= listener->backlog)) {
+        tcp_send_syncookie(ip, tcp, opts);
+        return -1;
+    }
+    if (listener->syn_count >= listener->backlog) return -1;  /* The peer will retry the SYN */
+    
+    enhanced_socket_t* child = tcp_create_child(listener, ip, tcp);
+    if (!child) return -1;
+    child->acknowledgment_number = htonl(tcp->sequence_number) + 1;
+    tcp_negotiate(child, opts);
+    child->snd_wnd = htons(tcp->window_size);
+    child->state = SOCKET_STATE_SYN_RECEIVED;
+    socket_est_hash(child);
+    
+    /*
+     * Fast Open (RFC 7413): data in a SYN with a good cookie is taken now and
+     * the child goes straight to the accept queue, so the server can answer
+     * before the handshake completes. A SYN asking for a cookie, or with one
+     * we did not issue, gets one in the SYN-ACK; its data comes again later.
+     */
+    if (listener->fastopen && opts->has_fastopen) {
+        if (!tcp_fastopen_valid(ip->source_ip, opts)) {
+            child->fastopen = TCP_FASTOPEN_OPTION;
+        } else if (len && ring_reserve(&child->rx_buffer, child->rx_buffer_size) == 0) {
+            ring_write(child->rx_buffer, child->rx_buffer_size, child->rx_head, payload, len);
+            child->rx_head += len;
+            child->acknowledgment_number += len;
+            child->fastopen = TCP_FASTOPEN_OPEN;
+        }
+    }
+    if (child->fastopen & TCP_FASTOPEN_OPEN) {
+        tcp_accept_enqueue(listener, child->socket_id);
+        net_stat_add(&network_stats.fastopen_recv, 1);
+    } else {
+        child->parent = listener;
+        listener->syn_count++;
+    }
+    
+    tcp_send_segment(child, child->snd_una, TCP_FLAG_SYN | TCP_FLAG_ACK, 0);
+    if (child->fastopen & TCP_FASTOPEN_OPEN) {
+        child->snd_una = child->sequence_number;  /* The send ring starts after the SYN */
+    }
+    tcp_arm_rto(child);
+    return -1;
+}
+
+/* A well-formed IPv4 TCP segment with a valid checksum; returns its IP total length, or 0 */
+static uint32_t tcp_segment_check(const uint8_t* frame, uint32_t size) {
+    const enhanced_ip_header_t* ip = (const enhanced_ip_header_t*)frame;
+    uint32_t ip_len = (ip->version_ihl & 0x0F) * 4;
+    uint32_t total = htons(ip->total_length);
+    if (size < IP_HEADER_LEN || ip_len < IP_HEADER_LEN || total > size || total < ip_len + TCP_HEADER_LEN ||
+        ip->protocol != NET_PROTOCOL_TCP) {
+        return 0;
+    }
+    
+    const enhanced_tcp_header_t* tcp = (const enhanced_tcp_header_t*)(frame + ip_len);
+    uint32_t tcp_size = total - ip_len;
+    uint32_t header_len = (tcp->data_offset >> 4) * 4;
+    uint32_t sum = csum_partial(&ip->source_ip, 8, 0);
+    sum += htons(NET_PROTOCOL_TCP) + htons((uint16_t)tcp_size);
+    if (header_len < TCP_HEADER_LEN || header_len > tcp_size || csum_fold(csum_partial(tcp, tcp_size, sum)) != 0) {
+        net_stat_add(&network_stats.packet_loss, 1);
+        return 0;
+    }
+    return total;
+}
+
+/*
+ * Validate and dispatch one received IPv4 datagram carrying TCP; GRO has
+ * already checked the segments a merged one was built from.
+ */
+static void tcp_input(const uint8_t* frame, uint32_t size, int checked) {
+    if (!checked && !tcp_segment_check(frame, size)) return;
+    
+    const enhanced_ip_header_t* ip = (const enhanced_ip_header_t*)frame;
+    uint32_t ip_len = (ip->version_ihl & 0x0F) * 4;
+    uint32_t total = htons(ip->total_length);
+    const enhanced_tcp_header_t* tcp = (const enhanced_tcp_header_t*)(frame + ip_len);
+    uint32_t tcp_size = total - ip_len;
+    uint32_t header_len = (tcp->data_offset >> 4) * 4;
+    
+    const uint8_t* payload = (const uint8_t*)tcp + header_len;
+    uint32_t len = tcp_size - header_len;
+    uint32_t seq = htonl(tcp->sequence_number);
+    uint32_t ack = htonl(tcp->acknowledgment_number);
+    uint32_t window = htons(tcp->window_size);
+    uint8_t flags = tcp->flags;
+    tcp_options_t opts;
+    tcp_parse_options(tcp, header_len, &opts);
+    this_cpu_add(PCPU_NET_RX_PACKETS, 1);
+    
+    int id = enhanced_socket_demux(NET_PROTOCOL_TCP, ip->source_ip, tcp->source_port,
+                                   ip->destination_ip, tcp->destination_port);
+    enhanced_socket_t* sock = socket_lookup(id);
+    if (!sock) {
+        if (!(flags & TCP_FLAG_RST)) {
+            tcp_send_reset(ip, tcp, len + ((flags & TCP_FLAG_SYN) ? 1 : 0) + ((flags & TCP_FLAG_FIN) ? 1 : 0));
+        }
+        return;
+    }
+    sock->cold->stats.last_activity = timer_wheel_now();
+    
+    switch (sock->state) {
+        case SOCKET_STATE_LISTENING:
+            id = tcp_listen_input(sock, ip, tcp, &opts, payload, len);
+            sock = socket_lookup(id);
+            if (!sock) return;
+            break;
+        
+        case SOCKET_STATE_SYN_SENT:
+            if ((flags & TCP_FLAG_ACK) && (SEQ_LEQ(ack, sock->snd_una) || SEQ_GT(ack, sock->snd_max))) {
+                if (!(flags & TCP_FLAG_RST)) tcp_send_reset(ip, tcp, len);
+                return;
+            }
+            if (flags & TCP_FLAG_RST) {
+                if (flags & TCP_FLAG_ACK) {
+                    tcp_stop_timers(sock);
+                    sock->state = SOCKET_STATE_CLOSED;  /* Connection refused */
+                    ep_wake(&sock->wait, EPOLLERR | EPOLLHUP);
+                }
+                return;
+            }
+            if ((flags & (TCP_FLAG_SYN | TCP_FLAG_ACK)) != (TCP_FLAG_SYN | TCP_FLAG_ACK)) return;
+        
+            tcp_negotiate(sock, &opts);
+            if ((sock->fastopen & TCP_FASTOPEN_OPTION) && opts.has_fastopen && opts.fastopen_len) {
+                tcp_fastopen_store(sock->remote_ip, &opts);
+            }
+            sock->acknowledgment_number = seq + 1;
+            /* Data that rode in the SYN and was not acknowledged with it goes again */
+            sock->tx_tail += ack - (sock->snd_una + 1);
+            sock->snd_una = ack;
+            sock->sequence_number = ack;
+            sock->snd_wnd = window;
+            sock->state = SOCKET_STATE_ESTABLISHED;
+            timer_cancel(&sock->rto_timer);
+            if (sock->retries == 0) {
+                tcp_rtt_sample(sock, timer_wheel_now() - sock->rtt_start);
+                network_rtt_sample(ktime_ns() - sock->rtt_sent_ns);
+            }
+            sock->retries = 0;
+            tcp_send_ack(sock);
+            tcp_output(sock);
+            ep_wake(&sock->wait, EPOLLOUT);
+            return;
+        
+        case SOCKET_STATE_SYN_RECEIVED:
+            if (flags & TCP_FLAG_RST) {
+                enhanced_socket_close(id);
+                return;
+            }
+            if (!(flags & TCP_FLAG_ACK)) return;
+            
+            /* A Fast Open child is already accepted and may have sent data: tcp_ack takes the ACK below */
+            if (sock->fastopen & TCP_FASTOPEN_OPEN) {
+                if (SEQ_LT(ack, sock->snd_una) || SEQ_GT(ack, sock->snd_max)) return;
+            } else {
+                if (ack != sock->snd_max) return;
+                
+                /* From the SYN queue to the accept queue; with that full, the SYN-ACK's retransmission asks again */
+                if (sock->parent && !tcp_accept_enqueue(sock->parent, id)) return;
+                if (sock->parent) sock->parent->syn_count--;
+                sock->parent = NULL;
+                sock->snd_una = ack;
+            }
+            sock->snd_wnd = window << sock->snd_wscale;
+            sock->state = SOCKET_STATE_ESTABLISHED;
+            sock->retries = 0;
+            timer_cancel(&sock->rto_timer);
+            break;
+        
+        case SOCKET_STATE_ESTABLISHED:
+        case SOCKET_STATE_CLOSE_WAIT:
+            if (flags & TCP_FLAG_RST) {
+                tcp_stop_timers(sock);
+                sock->state = SOCKET_STATE_CLOSED;
+                ep_wake(&sock->wait, EPOLLERR | EPOLLHUP);
+                return;
+            }
+            break;
+        
+        default:
+            return;
+    }
+    
+    if (sock->ts_ok && opts.has_timestamp) {
+        /* PAWS (RFC 7323): a timestamp older than the last one taken is from an earlier wrap */
+        if ((int32_t)(opts.ts_val - sock->ts_recent) < 0 && !(flags & TCP_FLAG_RST)) {
+            tcp_send_ack(sock);
+            return;
+        }
+        if (SEQ_LEQ(seq, sock->acknowledgment_number)) {
+            sock->ts_recent = opts.ts_val;
+        }
+        /* The receiver's RTT, which paces its buffer autotuning */
+        if (len && opts.ts_ecr) {
+            uint32_t rtt = timer_wheel_now() - opts.ts_ecr;
+            sock->rcv_rtt = sock->rcv_rtt ? sock->rcv_rtt - sock->rcv_rtt / 8 + rtt / 8 : rtt;
+        }
+    }
+    
+    if (flags & TCP_FLAG_ACK) {
+        tcp_ack(sock, ack, window << sock->snd_wscale, len, &opts);
+    }
+    if (len || (flags & TCP_FLAG_FIN)) {
+        tcp_data(sock, seq, payload, len, flags);
+    }
+}
+
+/* Retransmission timeout: back off, collapse cwnd to one segment and go back N */
+static void tcp_timeout(enhanced_socket_t* sock) {
+    int id = sock->socket_id;
+    uint32_t mss = sock->mss;
+    
+    sock->timeout = sock->timeout * 2 > TCP_RTO_MAX ? TCP_RTO_MAX : sock->timeout * 2;
+    switch (sock->state) {
+        case SOCKET_STATE_SYN_SENT:
+        case SOCKET_STATE_SYN_RECEIVED:
+            if (++sock->retries > TCP_SYN_RETRIES) {
+                net_stat_add(&network_stats.timeout_connections, 1);
+                if (sock->state == SOCKET_STATE_SYN_RECEIVED && !(sock->fastopen & TCP_FASTOPEN_OPEN)) {
+                    enhanced_socket_close(id);
+                } else {
+                    sock->state = SOCKET_STATE_CLOSED;
+                    ep_wake(&sock->wait, EPOLLERR | EPOLLHUP);
+                }
+                return;
+            }
+            net_stat_add(&network_stats.retransmissions, 1);
+            tcp_send_segment(sock, sock->snd_una - ((sock->fastopen & TCP_FASTOPEN_OPEN) ? 1 : 0),
+                             sock->state == SOCKET_STATE_SYN_SENT ? TCP_FLAG_SYN : TCP_FLAG_SYN | TCP_FLAG_ACK, 0);
+            tcp_arm_rto(sock);
+            return;
+        
+        case SOCKET_STATE_ESTABLISHED:
+        case SOCKET_STATE_CLOSE_WAIT:
+            break;
+        
+        default:
+            return;
+    }
+    
+    if (sock->snd_wnd == 0 && sock->tx_head != sock->tx_tail) {
+        /* Persist: probe the closed window with one byte, without counting it as loss */
+        tcp_send_segment(sock, sock->snd_una, TCP_FLAG_ACK, 1);
+        if (sock->snd_max == sock->snd_una) {
+            sock->sequence_number = sock->snd_una + 1;
+            sock->snd_max = sock->sequence_number;
+        }
+        tcp_arm_rto(sock);
+        return;
+    }
+    if (sock->snd_max == sock->snd_una) return;
+    
+    uint32_t flight = sock->snd_max - sock->snd_una;
+    sock->slow_start_threshold = flight / 2 > 2 * mss ? flight / 2 : 2 * mss;
+    sock->congestion_window = mss;
+    sock->congestion_avoidance = 0;
+    sock->in_recovery = 0;
+    sock->dupacks = 0;
+    sock->sequence_number = sock->snd_una;
+    /* Keep the scoreboard so go-back-N skips what the peer holds, unless it may have reneged */
+    if (sock->retries) sock->sack_count = 0;
+    sock->retries++;
+    tcp_retransmit(sock);
+    sock->sequence_number = sock->snd_una + (flight < mss ? flight : mss);
+    tcp_arm_rto(sock);
+}
+
+/* GRO: the run of segments being merged, flushed to tcp_input when it ends */
+static uint8_t gro_frame[GRO_MAX_SIZE];
+static uint32_t gro_size;               /* 0 while nothing is held */
+static uint32_t gro_seg_len;            /* Payload of the first segment; later ones may not exceed it */
+
+static void gro_flush(void) {
+    if (!gro_size) return;
+    uint32_t size = gro_size;
+    gro_size = 0;
+    tcp_input(gro_frame, size, 1);
+}
+
+/*
+ * Merge a checked segment into the held run if it continues it: same flow,
+ * next in sequence, ACK (and PSH) only, same ACK, window and options. Anything
+ * else flushes the run first. PSH or a short segment ends a run, and only a
+ * bare ACK data segment starts one. Returns 1 if the frame was taken.
+ */
+static int gro_receive(const uint8_t* frame, uint32_t total) {
+    const enhanced_ip_header_t* ip = (const enhanced_ip_header_t*)frame;
+    const enhanced_tcp_header_t* tcp = (const enhanced_tcp_header_t*)(frame + IP_HEADER_LEN);
+    uint32_t header_len = (tcp->data_offset >> 4) * 4;
+    uint32_t len = total - IP_HEADER_LEN - header_len;
+    int plain = ip->version_ihl == 0x45 && len > 0 && (tcp->flags & ~TCP_FLAG_PSH) == TCP_FLAG_ACK;
+    
+    if (gro_size) {
+        enhanced_ip_header_t* held_ip = (enhanced_ip_header_t*)gro_frame;
+        enhanced_tcp_header_t* held = (enhanced_tcp_header_t*)(gro_frame + IP_HEADER_LEN);
+        uint32_t held_len = gro_size - IP_HEADER_LEN - header_len;
+        int match = plain && ip->source_ip == held_ip->source_ip && ip->destination_ip == held_ip->destination_ip &&
+                    tcp->source_port == held->source_port && tcp->destination_port == held->destination_port &&
+                    tcp->data_offset == held->data_offset && tcp->acknowledgment_number == held->acknowledgment_number &&
+                    tcp->window_size == held->window_size &&
+                    htonl(tcp->sequence_number) == htonl(held->sequence_number) + held_len &&
+                    len <= gro_seg_len && gro_size + len <= GRO_MAX_SIZE;
+        for (uint32_t i = 0; match && i < header_len - TCP_HEADER_LEN; i++) {
+            match = tcp->options[i] == held->options[i];
+        }
+        if (match) {
+            memcpy(gro_frame + gro_size, frame + IP_HEADER_LEN + header_len, len);
+            gro_size += len;
+            held->flags |= tcp->flags & TCP_FLAG_PSH;
+            held_ip->total_length = htons((uint16_t)gro_size);
+            net_stat_add(&network_stats.gro_merged, 1);
+            if ((tcp->flags & TCP_FLAG_PSH) || len < gro_seg_len) gro_flush();
+            return 1;
+        }
+        gro_flush();
+    }
+    
+    if (!plain || (tcp->flags & TCP_FLAG_PSH)) return 0;
+    memcpy(gro_frame, frame, total);
+    gro_size = total;
+    gro_seg_len = len;
+    return 1;
+}
+
+/*
+ * Network bottom half: run expired TCP timers, then deliver loopback frames.
+ * Call from the idle loop or a softirq; returns the number of frames handled.
+ */
+uint32_t enhanced_network_poll(void) {
+    /* Pop one socket at a time: handling an event may close another queued socket */
+    for (;;) {
+        uint32_t flags = spin_lock_irqsave(&tcp_event_lock);
+        enhanced_socket_t* sock = tcp_event_list;
+        if (!sock) {
+            spin_unlock_irqrestore(&tcp_event_lock, flags);
+            break;
+        }
+        tcp_event_list = sock->event_next;
+        uint8_t events = sock->events;
+        sock->events = 0;
+        spin_unlock_irqrestore(&tcp_event_lock, flags);
+        
+        if (events & TCP_EVENT_DELACK) {
+            tcp_send_ack(sock);
+        }
+        if (events & TCP_EVENT_RTO) {
+            tcp_timeout(sock);
+        }
+    }
+    
+    /* Segments of one flow in a row are merged, so tcp_input runs once per run */
+    uint32_t handled = 0;
+    uint32_t budget = LOOPBACK_QUEUE_LEN * 2;
+    while (loopback_tail != loopback_head && handled < budget) {
+        struct loopback_frame* slot = &loopback_queue[loopback_tail % LOOPBACK_QUEUE_LEN];
+        uint8_t frame[LOOPBACK_FRAME_SIZE];
+        uint32_t size = slot->size;
+        memcpy(frame, slot->data, size);
+        loopback_tail++;
+        interfaces[0].rx_packets++;
+        interfaces[0].rx_bytes += size;
+        handled++;
+        
+        uint32_t total = tcp_segment_check(frame, size);
+        if (total && !gro_receive(frame, total)) {
+            tcp_input(frame, total, 1);
+        }
+    }
+    gro_flush();
+    return handled;
+}
+
+/*
+ * Active open, with size bytes of data queued to go first. With data, the
+ * SYN asks for Fast Open: it carries as much of the data as the server's
+ * cookie allows when we hold one, or asks for a cookie for next time.
+ */
+static int tcp_connect(enhanced_socket_t* sock, uint32_t ip_address, uint16_t port, const void* data, uint32_t size) {
+    if (sock->state != SOCKET_STATE_CLOSED) return -1;
+    if (size && (ring_reserve(&sock->tx_buffer, sock->tx_buffer_size) < 0 || size > sock->tx_buffer_size)) {
+        return -1;
+    }
+    
+    /* A connected socket only matches its own 4-tuple */
+    socket_port_unhash(sock);
+    sock->remote_ip = ip_address;
+    sock->remote_port = htons(port);
+    if (sock->local_ip == 0) {
+        sock->local_ip = (ip_address & 0xFF) == 127 ? ip_address : interfaces[0].ip_address;
+    }
+    if (sock->local_port == 0) {
+        sock->local_port = htons(TCP_EPHEMERAL_PORT + next_ephemeral_port++ % (65536 - TCP_EPHEMERAL_PORT));
+    }
+    socket_est_hash(sock);
+    
+    /* Active open: send the SYN and run the stack until the handshake settles */
+    tcp_init_connection(sock);
+    uint32_t syn_len = 0;
+    if (size) {
+        struct tcp_fastopen_entry* entry = tcp_fastopen_lookup(sock->remote_ip);
+        ring_write(sock->tx_buffer, sock->tx_buffer_size, sock->tx_head, data, size);
+        sock->tx_head += size;
+        sock->fastopen = TCP_FASTOPEN_OPTION;
+        if (entry) syn_len = size < entry->mss ? size : entry->mss;
+        sock->sequence_number += syn_len;
+        sock->snd_max = sock->sequence_number;
+    }
+    sock->state = SOCKET_STATE_SYN_SENT;
+    sock->rtt_start = timer_wheel_now();
+    sock->rtt_sent_ns = ktime_ns();
+    tcp_send_segment(sock, sock->snd_una, TCP_FLAG_SYN, syn_len);
+    tcp_arm_rto(sock);
+    while (sock->state == SOCKET_STATE_SYN_SENT) {
+        if (!enhanced_network_poll()) {
+            __asm__ __volatile__("pause");
+        }
+    }
+    if (sock->state != SOCKET_STATE_ESTABLISHED) {
+        net_stat_add(&network_stats.failed_connections, 1);
+        socket_est_unhash(sock);
+        return -1;
+    }
+    
+    sock->cold->stats.connection_time = timer_wheel_now();
+    sock->cold->stats.bytes_sent += size;
+    net_stat_add(&network_stats.active_connections, 1);
+    
+    return 0;
+}
+
+int enhanced_socket_connect(int socket_id, uint32_t ip_address, uint16_t port) {
+    enhanced_socket_t* sock = socket_lookup(socket_id);
+    if (!sock) return -1;
     
-    new_sock->remote_ip = htonl(0x7F000001);
-    new_sock->remote_port = htons(12345);
+    return tcp_connect(sock, ip_address, port, NULL, 0);
+}
+
+/*
+ * Connect and send, as sendto with MSG_FASTOPEN: to a server that has given
+ * us a Fast Open cookie, the data goes in the SYN and the request saves the
+ * handshake's round trip. Returns size, or -1 when the connection fails.
+ */
+int enhanced_socket_connect_data(int socket_id, uint32_t ip_address, uint16_t port, const void* data, uint32_t size) {
+    enhanced_socket_t* sock = socket_lookup(socket_id);
+    if (!sock || sock->type != SOCKET_TYPE_STREAM || !data || !size) return -1;
+    
+    return tcp_connect(sock, ip_address, port, data, size) == 0 ? (int)size : -1;
+}
+
+/* Take the oldest completed connection off a listener's accept queue */
+int enhanced_socket_accept(int socket_id, uint32_t* client_ip, uint16_t* client_port) {
+    enhanced_socket_t* sock = socket_lookup(socket_id);
+    if (!sock || sock->state != SOCKET_STATE_LISTENING) return -1;
     
-    network_stats.active_connections++;
+    enhanced_network_poll();
+    if (sock->reuseport) {
+        sock->incoming_cpu = net_cpu();
+    }
+    if (sock->accept_count == 0) return -1;
+    
+    int new_socket_id = sock->cold->accept_queue[sock->accept_head];
+    sock->accept_head = (sock->accept_head + 1) % TCP_BACKLOG_MAX;
+    sock->accept_count--;
+    
+    enhanced_socket_t* new_sock = sockets[new_socket_id];
+    if (client_ip) *client_ip = new_sock->remote_ip;
+    if (client_port) *client_port = new_sock->remote_port;
+    new_sock->cold->stats.connection_time = timer_wheel_now();
+    
+    net_stat_add(&network_stats.active_connections, 1);
     
     return new_socket_id;
 }
 
 /* Enhanced data transmission */
 int enhanced_socket_send(int socket_id, const void* data, uint32_t size, uint8_t encrypt) {
-    if (socket_id < 0 || socket_id >= MAX_SOCKETS) return -1;
+    enhanced_socket_t* sock = socket_lookup(socket_id);
+    if (!sock) return -1;
+    /* A Fast Open child may answer before its handshake completes */
+    if (sock->state != SOCKET_STATE_ESTABLISHED &&
+        !(sock->state == SOCKET_STATE_SYN_RECEIVED && (sock->fastopen & TCP_FASTOPEN_OPEN))) {
+        return -1;
+    }
+    
+    /* Sealed data goes out as records of at most AEAD_RECORD_MAX, each with its header and tag */
+    uint8_t sealed = encrypt && sock->encrypted;
+    uint32_t needed = size;
+    if (sealed) {
+        needed += (size + AEAD_RECORD_MAX - 1) / AEAD_RECORD_MAX * AEAD_OVERHEAD;
+    }
+    
+    if (ring_reserve(&sock->tx_buffer, sock->tx_buffer_size) < 0) return -1;
     
-    enhanced_socket_t* sock = &sockets[socket_id];
-    if (sock->state != SOCKET_STATE_ESTABLISHED) return -1;
+    /* Grow the send ring while it is what limits the window */
+    uint32_t queued = sock->tx_head - sock->tx_tail;
+    while (sock->type == SOCKET_TYPE_STREAM && sock->tx_buffer_size - queued < needed &&
+           sock->tx_buffer_size < TCP_SNDBUF_MAX &&
+           sock->tx_buffer_size < 2 * (sock->congestion_window < sock->snd_wnd ?
+                                       sock->congestion_window : sock->snd_wnd) &&
+           ring_grow(&sock->tx_buffer, &sock->tx_buffer_size, sock->tx_tail, queued) == 0) {
+    }
     
     /* Check buffer space */
-    if (sock->tx_buffer_size - (sock->tx_head - sock->tx_tail) < size) {
+    if (sock->tx_buffer_size - queued < needed) {
         return -1; /* Buffer full */
     }
     
-    /* Copy data to buffer */
-    uint8_t* send_buffer = sock->tx_buffer + (sock->tx_head % sock->tx_buffer_size);
-    memcpy(send_buffer, data, size);
-    
-    /* Apply encryption if requested */
-    if (encrypt && sock->encrypted) {
-        simple_encrypt(send_buffer, size, sock->encryption_key);
+    /* Copy data into the ring, sealing it in place when requested */
+    if (sealed) {
+        for (uint32_t done = 0; done < size; done += AEAD_RECORD_MAX) {
+            uint32_t len = size - done < AEAD_RECORD_MAX ? size - done : AEAD_RECORD_MAX;
+            aead_seal_record(sock, (const uint8_t*)data + done, len);
+        }
+    } else {
+        ring_write(sock->tx_buffer, sock->tx_buffer_size, sock->tx_head, data, size);
+        sock->tx_head += size;
     }
     
     /* Update socket statistics */
-    sock->bytes_sent += size;
-    sock->packets_sent++;
-    sock->last_activity = network_stats.total_packets_sent;
-    
-    /* Update network statistics */
-    network_stats.total_bytes_sent += size;
-    network_stats.total_packets_sent++;
+    sock->cold->stats.bytes_sent += size;
+    sock->cold->stats.last_activity = timer_wheel_now();
     
-    /* Update TCP congestion control */
+    /* Streams go out through the sliding window; segments are counted as they are sent */
     if (sock->type == SOCKET_TYPE_STREAM) {
-        if (sock->congestion_window < sock->slow_start_threshold) {
-            /* Slow start */
-            sock->congestion_window *= 2;
-        } else {
-            /* Congestion avoidance */
-            sock->congestion_window += 1024;
-        }
+        tcp_output(sock);
+    } else {
+        sock->cold->stats.packets_sent++;
+        this_cpu_add(PCPU_NET_TX_BYTES, size);
+        this_cpu_add(PCPU_NET_TX_PACKETS, 1);
     }
     
-    sock->tx_head += size;
-    
     return size;
 }
 
 int enhanced_socket_recv(int socket_id, void* data, uint32_t size, uint8_t decrypt) {
-    if (socket_id < 0 || socket_id >= MAX_SOCKETS) return -1;
-    
-    enhanced_socket_t* sock = &sockets[socket_id];
-    if (sock->state != SOCKET_STATE_ESTABLISHED) return -1;
+    enhanced_socket_t* sock = socket_lookup(socket_id);
+    if (!sock) return -1;
+    if (sock->state != SOCKET_STATE_ESTABLISHED && sock->state != SOCKET_STATE_CLOSE_WAIT &&
+        !(sock->state == SOCKET_STATE_SYN_RECEIVED && (sock->fastopen & TCP_FASTOPEN_OPEN))) {
+        return -1;
+    }
     
     /* Check available data */
     uint32_t available = sock->rx_head - sock->rx_tail;
-    if (available == 0) return 0; /* No data available */
-    
-    /* Determine how much to read */
-    uint32_t to_read = (available < size) ? available : size;
+    if (available == 0) return 0; /* No data available, or end of stream in CLOSE_WAIT */
     
-    /* Copy data from buffer */
-    uint8_t* recv_buffer = sock->rx_buffer + (sock->rx_tail % sock->rx_buffer_size);
-    memcpy(data, recv_buffer, to_read);
-    
-    /* Apply decryption if requested */
+    /* Sealed data is read a whole verified record at a time, raw data as far as it fits */
+    uint32_t to_read;
+    int result;
     if (decrypt && sock->encrypted) {
-        simple_decrypt(data, to_read, sock->encryption_key);
+        result = aead_open_record(sock, data, size, available, &to_read);
+        if (!to_read) return result;
+    } else {
+        to_read = (available < size) ? available : size;
+        ring_read(data, sock->rx_buffer, sock->rx_buffer_size, sock->rx_tail, to_read);
+        result = (int)to_read;
     }
     
     /* Update socket statistics */
-    sock->bytes_received += to_read;
-    sock->packets_received++;
-    sock->last_activity = network_stats.total_packets_received;
+    sock->cold->stats.bytes_received += to_read;
+    sock->cold->stats.packets_received++;
+    sock->cold->stats.last_activity = timer_wheel_now();
+    sock->rx_tail += to_read;
     
-    /* Update network statistics */
-    network_stats.total_bytes_received += to_read;
-    network_stats.total_packets_received++;
+    if (sock->type != SOCKET_TYPE_STREAM) {
+        this_cpu_add(PCPU_NET_RX_BYTES, to_read);
+        this_cpu_add(PCPU_NET_RX_PACKETS, 1);
+        return result;
+    }
     
-    sock->rx_tail += to_read;
+    /*
+     * Autotuning: a reader that drains more than half the ring in one RTT is
+     * being held back by the window, so double the ring (and so the window).
+     * The ring holds out-of-order data too, so all of it moves.
+     */
+    uint32_t now = timer_wheel_now();
+    sock->rcv_space_copied += to_read;
+    if (now - sock->rcv_space_time >= (sock->rcv_rtt ? sock->rcv_rtt : 1)) {
+        if (2 * sock->rcv_space_copied > sock->rx_buffer_size && sock->rx_buffer_size < TCP_RCVBUF_MAX) {
+            ring_grow(&sock->rx_buffer, &sock->rx_buffer_size, sock->rx_tail, sock->rx_buffer_size);
+        }
+        sock->rcv_space_copied = 0;
+        sock->rcv_space_time = now;
+    }
     
-    return to_read;
+    /* Window update once the window has opened by two segments, or out of a near-zero window */
+    uint32_t window = tcp_receive_window(sock);
+    if (window >= sock->window_size + 2 * sock->mss || (sock->window_size < sock->mss && window >= sock->mss)) {
+        tcp_send_ack(sock);
+    }
+    
+    return result;
 }
 
 /* Enhanced security functions */
 int enhanced_socket_set_encryption(int socket_id, uint8_t enabled) {
-    if (socket_id < 0 || socket_id >= MAX_SOCKETS) return -1;
+    enhanced_socket_t* sock = socket_lookup(socket_id);
+    if (!sock) return -1;
     
-    enhanced_socket_t* sock = &sockets[socket_id];
     sock->encrypted = enabled;
     
     return 0;
 }
 
 int enhanced_socket_set_authentication(int socket_id, uint8_t enabled) {
-    if (socket_id < 0 || socket_id >= MAX_SOCKETS) return -1;
+    enhanced_socket_t* sock = socket_lookup(socket_id);
+    if (!sock) return -1;
     
-    enhanced_socket_t* sock = &sockets[socket_id];
-    sock->authenticated = enabled;
+    sock->cold->authenticated = enabled;
     
     return 0;
 }
 
-int enhanced_socket_set_security_keys(int socket_id, const uint32_t* enc_key, const uint32_t* auth_key) {
-    if (socket_id < 0 || socket_id >= MAX_SOCKETS) return -1;
+/* Let the socket share its port with others that set this too; before bind or listen */
+int enhanced_socket_set_reuseport(int socket_id, uint8_t enabled) {
+    enhanced_socket_t* sock = socket_lookup(socket_id);
+    if (!sock || sock->port_hashed) return -1;
+    
+    sock->reuseport = enabled;
+    
+    return 0;
+}
+
+/* Let a listener take data from SYNs bearing a Fast Open cookie it issued */
+int enhanced_socket_set_fastopen(int socket_id, uint8_t enabled) {
+    enhanced_socket_t* sock = socket_lookup(socket_id);
+    if (!sock || sock->type != SOCKET_TYPE_STREAM) return -1;
     
-    enhanced_socket_t* sock = &sockets[socket_id];
+    sock->fastopen = enabled;
+    
+    return 0;
+}
+
+/* The two 128-bit halves of the ChaCha20-Poly1305 key; both ends must set the same ones */
+int enhanced_socket_set_security_keys(int socket_id, const uint32_t* enc_key, const uint32_t* auth_key) {
+    enhanced_socket_t* sock = socket_lookup(socket_id);
+    if (!sock) return -1;
     
     if (enc_key) {
-        memcpy(sock->encryption_key, enc_key, 16);
+        memcpy(sock->cold->encryption_key, enc_key, 16);
     }
     
     if (auth_key) {
-        memcpy(sock->authentication_key, auth_key, 16);
+        memcpy(sock->cold->authentication_key, auth_key, 16);
     }
     
     return 0;
 }
 
 /* Enhanced network statistics */
+/* Copied without taking the lock, retried if an update ran meanwhile; the totals are summed per-CPU counters */
 void enhanced_network_get_stats(network_stats_t* stats) {
     if (stats) {
-        memcpy(stats, &network_stats, sizeof(network_stats_t));
+        uint32_t seq;
+        do {
+            seq = read_seqbegin(&network_stats_lock);
+            memcpy(stats, &network_stats, sizeof(network_stats_t));
+        } while (read_seqretry(&network_stats_lock, seq));
+        stats->total_packets_received = percpu_counter_read(PCPU_NET_RX_PACKETS);
+        stats->total_packets_sent = percpu_counter_read(PCPU_NET_TX_PACKETS);
+        stats->total_bytes_received = percpu_counter_read(PCPU_NET_RX_BYTES);
+        stats->total_bytes_sent = percpu_counter_read(PCPU_NET_TX_BYTES);
     }
 }
 
-void enhanced_socket_get_stats(int socket_id, enhanced_socket_t* stats) {
-    if (socket_id >= 0 && socket_id < MAX_SOCKETS && stats) {
-        memcpy(stats, &sockets[socket_id], sizeof(enhanced_socket_t));
+void enhanced_socket_get_stats(int socket_id, enhanced_socket_stats_t* stats) {
+    enhanced_socket_t* sock = socket_lookup(socket_id);
+    if (sock && stats) {
+        memcpy(stats, &sock->cold->stats, sizeof(enhanced_socket_stats_t));
     }
 }
 
@@ -535,29 +3085,320 @@ void enhanced_network_diagnostics(void) {
     for (int i = 0; i < MAX_NETWORK_INTERFACES; i++) {
         if (interfaces[i].is_up) {
             /* Interface is up, report statistics */
-            network_stats.active_connections++;
+            net_stat_add(&network_stats.active_connections, 1);
         }
     }
     
     /* Socket status */
     uint32_t active_sockets = 0;
     for (int i = 0; i < MAX_SOCKETS; i++) {
-        if (sockets[i].state != SOCKET_STATE_FREE && sockets[i].state != SOCKET_STATE_CLOSED) {
+        if (sockets[i] && sockets[i]->state != SOCKET_STATE_CLOSED) {
             active_sockets++;
         }
     }
     
     /* Calculate packet loss rate */
-    if (network_stats.total_packets_sent > 0) {
-        network_stats.packet_loss = (network_stats.retransmissions * 100) / network_stats.total_packets_sent;
+    uint64_t packets_sent = percpu_counter_read(PCPU_NET_TX_PACKETS);
+    uint32_t flags = write_seqlock_irqsave(&network_stats_lock);
+    if (packets_sent > 0) {
+        network_stats.packet_loss = (network_stats.retransmissions * 100) / packets_sent;
     }
-    
-    /* Simulate RTT calculation */
-    network_stats.round_trip_time = 50; /* 50ms simulated RTT */
-    network_stats.jitter = 5; /* 5ms simulated jitter */
+    write_sequnlock_irqrestore(&network_stats_lock, flags);
 }
 
 /* Enhanced network testing */
+/* Stream total bytes from a client to an accepted server socket, in sealed records if encrypt; 0 if it all arrives intact */
+static int tcp_loopback_test(uint32_t total, uint8_t encrypt) {
+    int listener = enhanced_socket_create(SOCKET_TYPE_STREAM, NET_PROTOCOL_TCP);
+    int client = enhanced_socket_create(SOCKET_TYPE_STREAM, NET_PROTOCOL_TCP);
+    int server = -1;
+    int result = -1;
+    
+    if (listener >= 0 && client >= 0 &&
+        enhanced_socket_bind(listener, htonl(0x7F000001), 9000) == 0 &&
+        enhanced_socket_listen(listener, 4) == 0 &&
+        enhanced_socket_connect(client, htonl(0x7F000001), 9000) == 0) {
+        server = enhanced_socket_accept(listener, NULL, NULL);
+    }
+    if (encrypt && server >= 0) {
+        uint32_t enc_key[4] = {0x03020100, 0x07060504, 0x0B0A0908, 0x0F0E0D0C};
+        uint32_t auth_key[4] = {0x13121110, 0x17161514, 0x1B1A1918, 0x1F1E1D1C};
+        enhanced_socket_set_security_keys(client, enc_key, auth_key);
+        enhanced_socket_set_security_keys(server, enc_key, auth_key);
+        enhanced_socket_set_encryption(client, 1);
+        enhanced_socket_set_encryption(server, 1);
+    }
+    
+    /* The server reads only when an edge-triggered watch says data arrived */
+    int ep = server >= 0 ? ep_create() : -1;
+    struct ep_event watch = { EPOLLIN | EPOLLET, (uint32_t)server };
+    if (ep >= 0 && ep_ctl(ep, EP_CTL_ADD, enhanced_socket_wait_queue(server), &watch) == 0) {
+        uint8_t chunk[1000];
+        uint32_t sent = 0;
+        uint32_t received = 0;
+        int readable = 0;
+        result = 0;
+        for (uint32_t round = 0; round < 10000 && received < total && result == 0; round++) {
+            if (sent < total) {
+                uint32_t len = total - sent < sizeof(chunk) ? total - sent : sizeof(chunk);
+                for (uint32_t i = 0; i < len; i++) {
+                    chunk[i] = (uint8_t)((sent + i) * 7 + 3);
+                }
+                if (enhanced_socket_send(client, chunk, len, encrypt) == (int)len) {
+                    sent += len;
+                }
+            }
+            enhanced_network_poll();
+            
+            struct ep_event event;
+            if (ep_wait(ep, &event, 1, 0) == 1) {
+                readable = event.data == (uint32_t)server && (event.events & EPOLLIN);
+            }
+            if (!readable) continue;
+            
+            /* Edge-triggered: drain until empty, since no new event comes for old data */
+            int got = enhanced_socket_recv(server, chunk, sizeof(chunk), encrypt);
+            for (int i = 0; i < got; i++) {
+                if (chunk[i] != (uint8_t)((received + i) * 7 + 3)) {
+                    result = -1;
+                }
+            }
+            if (got > 0) {
+                received += got;
+            } else {
+                readable = 0;
+            }
+        }
+        if (received != total) {
+            result = -1;
+        }
+    }
+    
+    if (ep >= 0) ep_close(ep);
+    if (server >= 0) enhanced_socket_close(server);
+    if (client >= 0) enhanced_socket_close(client);
+    if (listener >= 0) enhanced_socket_close(listener);
+    enhanced_network_poll();
+    return result;
+}
+
+/* Connect clients to a listener answering only with SYN cookies; 0 if all are accepted from cookies and carry data */
+static int tcp_syncookie_test(void) {
+    int listener = enhanced_socket_create(SOCKET_TYPE_STREAM, NET_PROTOCOL_TCP);
+    int clients[3] = {-1, -1, -1};
+    int servers[3] = {-1, -1, -1};
+    uint32_t cookies = network_stats.syncookies_recv;
+    int result = -1;
+    
+    tcp_syncookies = 2;
+    if (listener >= 0 && enhanced_socket_bind(listener, htonl(0x7F000001), 9001) == 0 &&
+        enhanced_socket_listen(listener, 2) == 0) {
+        result = 0;
+        for (uint32_t i = 0; i < 3 && result == 0; i++) {
+            clients[i] = enhanced_socket_create(SOCKET_TYPE_STREAM, NET_PROTOCOL_TCP);
+            if (clients[i] < 0 || enhanced_socket_connect(clients[i], htonl(0x7F000001), 9001) != 0) {
+                result = -1;
+            }
+        }
+        for (uint32_t i = 0; i < 3 && result == 0; i++) {
+            servers[i] = enhanced_socket_accept(listener, NULL, NULL);
+            char byte = (char)('a' + i);
+            char got = 0;
+            if (servers[i] < 0 || enhanced_socket_send(clients[i], &byte, 1, 0) != 1) {
+                result = -1;
+                break;
+            }
+            enhanced_network_poll();
+            if (enhanced_socket_recv(servers[i], &got, 1, 0) != 1 || got != byte) {
+                result = -1;
+            }
+        }
+        if (network_stats.syncookies_recv - cookies != 3) {
+            result = -1;
+        }
+    }
+    tcp_syncookies = 1;
+    
+    for (uint32_t i = 0; i < 3; i++) {
+        if (servers[i] >= 0) enhanced_socket_close(servers[i]);
+        if (clients[i] >= 0) enhanced_socket_close(clients[i]);
+    }
+    if (listener >= 0) enhanced_socket_close(listener);
+    enhanced_network_poll();
+    return result;
+}
+
+/* Spread clients over a reuseport group of listeners; 0 if none is lost and the load is shared */
+static int tcp_reuseport_test(void) {
+    int listeners[4];
+    int clients[16];
+    uint32_t accepted[4] = {0, 0, 0, 0};
+    int result = 0;
+    
+    for (uint32_t i = 0; i < 4; i++) {
+        listeners[i] = enhanced_socket_create(SOCKET_TYPE_STREAM, NET_PROTOCOL_TCP);
+        if (listeners[i] < 0 || enhanced_socket_set_reuseport(listeners[i], 1) != 0 ||
+            enhanced_socket_bind(listeners[i], htonl(0x7F000001), 9002) != 0 ||
+            enhanced_socket_listen(listeners[i], 16) != 0) {
+            result = -1;
+        }
+    }
+    
+    /* A socket that did not ask to share the port cannot join the group */
+    int outsider = enhanced_socket_create(SOCKET_TYPE_STREAM, NET_PROTOCOL_TCP);
+    if (outsider < 0 || enhanced_socket_bind(outsider, htonl(0x7F000001), 9002) != 0 ||
+        enhanced_socket_listen(outsider, 16) == 0) {
+        result = -1;
+    }
+    
+    for (uint32_t i = 0; i < 16; i++) {
+        clients[i] = enhanced_socket_create(SOCKET_TYPE_STREAM, NET_PROTOCOL_TCP);
+        if (result == 0 && (clients[i] < 0 || enhanced_socket_connect(clients[i], htonl(0x7F000001), 9002) != 0)) {
+            result = -1;
+        }
+    }
+    
+    /* Each worker drains its own queue */
+    uint32_t total = 0;
+    uint32_t busy = 0;
+    for (uint32_t i = 0; i < 4 && result == 0; i++) {
+        int server;
+        while ((server = enhanced_socket_accept(listeners[i], NULL, NULL)) >= 0) {
+            accepted[i]++;
+            total++;
+            enhanced_socket_close(server);
+        }
+        if (accepted[i]) busy++;
+    }
+    if (total != 16 || busy < 2) result = -1;
+    
+    for (uint32_t i = 0; i < 16; i++) {
+        if (clients[i] >= 0) enhanced_socket_close(clients[i]);
+    }
+    if (outsider >= 0) enhanced_socket_close(outsider);
+    for (uint32_t i = 0; i < 4; i++) {
+        if (listeners[i] >= 0) enhanced_socket_close(listeners[i]);
+    }
+    enhanced_network_poll();
+    return result;
+}
+
+/*
+ * Make two request/response exchanges with a Fast Open listener; 0 if the
+ * first gets a cookie and the second's request rides in the SYN, acknowledged
+ * by the SYN-ACK and queued for accept with the connection.
+ */
+static int tcp_fastopen_test(void) {
+    int listener = enhanced_socket_create(SOCKET_TYPE_STREAM, NET_PROTOCOL_TCP);
+    uint32_t taken = network_stats.fastopen_recv;
+    int result = -1;
+    
+    /* Start without a cookie for the server */
+    struct tcp_fastopen_entry* stale = tcp_fastopen_lookup(htonl(0x7F000001));
+    if (stale) stale->len = 0;
+    
+    if (listener >= 0 && enhanced_socket_set_fastopen(listener, 1) == 0 &&
+        enhanced_socket_bind(listener, htonl(0x7F000001), 9004) == 0 && enhanced_socket_listen(listener, 4) == 0) {
+        result = 0;
+        for (uint32_t round = 0; round < 2 && result == 0; round++) {
+            int client = enhanced_socket_create(SOCKET_TYPE_STREAM, NET_PROTOCOL_TCP);
+            int server = -1;
+            char request[8] = {0};
+            char reply[8] = {0};
+            if (client < 0 || enhanced_socket_connect_data(client, htonl(0x7F000001), 9004, "GET /", 5) != 5) {
+                result = -1;
+            }
+            
+            /* The second request was acknowledged with the SYN, and its connection is accepted already */
+            enhanced_socket_t* l = sockets[listener];
+            enhanced_socket_t* c = socket_lookup(client);
+            if (result == 0 && round == 1) {
+                enhanced_socket_t* child = l->accept_count ? sockets[l->cold->accept_queue[l->accept_head]] : NULL;
+                if (!c || c->snd_una != c->snd_max || !child || enhanced_socket_send(child->socket_id, "OK", 2, 0) != 2) {
+                    result = -1;
+                }
+            }
+            if (result == 0) {
+                server = enhanced_socket_accept(listener, NULL, NULL);
+                if (server < 0 || (round == 0 && enhanced_socket_send(server, "OK", 2, 0) != 2)) {
+                    result = -1;
+                }
+            }
+            enhanced_network_poll();
+            if (result == 0 && (enhanced_socket_recv(server, request, sizeof(request), 0) != 5 ||
+                                memcmp(request, "GET /", 5) != 0 ||
+                                enhanced_socket_recv(client, reply, sizeof(reply), 0) != 2 ||
+                                reply[0] != 'O' || reply[1] != 'K')) {
+                result = -1;
+            }
+            
+            /* The first exchange left a cookie behind and nothing more */
+            if (round == 0 && (!tcp_fastopen_lookup(htonl(0x7F000001)) || network_stats.fastopen_recv != taken)) {
+                result = -1;
+            }
+            if (server >= 0) enhanced_socket_close(server);
+            if (client >= 0) enhanced_socket_close(client);
+        }
+        if (network_stats.fastopen_recv - taken != 1) {
+            result = -1;
+        }
+    }
+    
+    if (listener >= 0) enhanced_socket_close(listener);
+    enhanced_network_poll();
+    return result;
+}
+
+/* Check that sockets hold no rings until data moves, and where the hot fields sit; 0 if so */
+static int tcp_lazy_ring_test(void) {
+    int listener = enhanced_socket_create(SOCKET_TYPE_STREAM, NET_PROTOCOL_TCP);
+    int client = enhanced_socket_create(SOCKET_TYPE_STREAM, NET_PROTOCOL_TCP);
+    int server = -1;
+    int result = -1;
+    
+    if (offsetof(enhanced_socket_t, tx_tail) < 2 * CACHE_LINE_SIZE && listener >= 0 && client >= 0 &&
+        enhanced_socket_bind(listener, htonl(0x7F000001), 9003) == 0 && enhanced_socket_listen(listener, 4) == 0 &&
+        enhanced_socket_connect(client, htonl(0x7F000001), 9003) == 0 &&
+        (server = enhanced_socket_accept(listener, NULL, NULL)) >= 0) {
+        enhanced_socket_t* l = sockets[listener];
+        enhanced_socket_t* c = sockets[client];
+        enhanced_socket_t* s = sockets[server];
+        result = 0;
+        if (((uintptr_t)l | (uintptr_t)c | (uintptr_t)s) & (CACHE_LINE_SIZE - 1)) {
+            result = -1;
+        }
+        
+        /* Connected but idle: nothing but the sockets themselves */
+        if (l->rx_buffer || l->tx_buffer || c->rx_buffer || c->tx_buffer || s->rx_buffer || s->tx_buffer) {
+            result = -1;
+        }
+        
+        /* One byte one way gives the sender a send ring and the receiver a receive ring, and no more */
+        char byte = 'z';
+        char got = 0;
+        enhanced_socket_stats_t stats;
+        if (result == 0 && enhanced_socket_send(client, &byte, 1, 0) == 1) {
+            enhanced_network_poll();
+            if (!c->tx_buffer || c->rx_buffer || !s->rx_buffer || s->tx_buffer ||
+                enhanced_socket_recv(server, &got, 1, 0) != 1 || got != byte) {
+                result = -1;
+            }
+            enhanced_socket_get_stats(server, &stats);
+            if (stats.bytes_received != 1) {
+                result = -1;
+            }
+        } else {
+            result = -1;
+        }
+    }
+    
+    if (server >= 0) enhanced_socket_close(server);
+    if (client >= 0) enhanced_socket_close(client);
+    if (listener >= 0) enhanced_socket_close(listener);
+    enhanced_network_poll();
+    return result;
+}
+
 void enhanced_network_test(void) {
     /* Test socket creation */
     int sock1 = enhanced_socket_create(SOCKET_TYPE_STREAM, NET_PROTOCOL_TCP);
@@ -568,6 +3409,12 @@ void enhanced_network_test(void) {
         enhanced_socket_bind(sock1, htonl(0x7F000001), 8080);
         enhanced_socket_bind(sock2, htonl(0x7F000001), 8081);
         
+        /* Test inbound demux to the bound datagram socket */
+        if (enhanced_socket_demux(NET_PROTOCOL_UDP, htonl(0x7F000001), htons(5353),
+                                  htonl(0x7F000001), htons(8081)) == sock2) {
+            this_cpu_add(PCPU_NET_RX_PACKETS, 1);
+        }
+        
         /* Test security features */
         enhanced_socket_set_encryption(sock1, 1);
         enhanced_socket_set_authentication(sock1, 1);
@@ -588,12 +3435,42 @@ void enhanced_network_test(void) {
             
             if (received > 0) {
                 /* Data successfully sent and received */
-                network_stats.total_packets_sent++;
-                network_stats.total_packets_received++;
+                this_cpu_add(PCPU_NET_TX_PACKETS, 1);
+                this_cpu_add(PCPU_NET_RX_PACKETS, 1);
             }
         }
     }
     
+    /* Test a bulk TCP transfer over loopback, wrapping both socket rings */
+    if (tcp_loopback_test(12000, 0) != 0) {
+        net_stat_add(&network_stats.failed_connections, 1);
+    }
+    
+    /* The same with ChaCha20-Poly1305 records */
+    if (tcp_loopback_test(12000, 1) != 0) {
+        net_stat_add(&network_stats.failed_connections, 1);
+    }
+    
+    /* Connections set up from SYN cookies, with no state kept for the SYN */
+    if (tcp_syncookie_test() != 0) {
+        net_stat_add(&network_stats.failed_connections, 1);
+    }
+    
+    /* Connections shared out over listeners on one port */
+    if (tcp_reuseport_test() != 0) {
+        net_stat_add(&network_stats.failed_connections, 1);
+    }
+    
+    /* A request in the SYN to a server that gave us a cookie */
+    if (tcp_fastopen_test() != 0) {
+        net_stat_add(&network_stats.failed_connections, 1);
+    }
+    
+    /* Rings only once data moves */
+    if (tcp_lazy_ring_test() != 0) {
+        net_stat_add(&network_stats.failed_connections, 1);
+    }
+    
     /* Run network diagnostics */
     enhanced_network_diagnostics();
 }
@@ -602,8 +3479,8 @@ void enhanced_network_test(void) {
 void enhanced_network_cleanup(void) {
     /* Close all sockets */
     for (int i = 0; i < MAX_SOCKETS; i++) {
-        if (sockets[i].state != SOCKET_STATE_FREE) {
-            sockets[i].state = SOCKET_STATE_CLOSED;
+        if (sockets[i]) {
+            enhanced_socket_close(i);
         }
     }
     
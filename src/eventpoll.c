@@ -0,0 +1,302 @@
+/*
+ * Tiny Operating System - Event Poll
+ * epoll-style readiness notification over per-object wait queues
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Event bits; EPOLLERR and EPOLLHUP are always reported */
+#define EPOLLIN 0x001
+#define EPOLLOUT 0x004
+#define EPOLLERR 0x008
+#define EPOLLHUP 0x010
+#define EPOLLET 0x80000000u             /* Edge-triggered: report once per wakeup */
+
+#define EP_CTL_ADD 1
+#define EP_CTL_DEL 2
+#define EP_CTL_MOD 3
+
+#define EP_MAX_INSTANCES 16
+#define EP_MAX_ITEMS 1024               /* Watches across all instances */
+
+struct ep_item;
+
+/* Wait queue embedded in each pollable object: a pipe, a socket */
+struct ep_wait_queue {
+    struct ep_item* head;               /* Watches on this object, one per instance */
+    uint32_t (*poll)(void* object);     /* Current EPOLL* state of the object */
+    void* object;
+};
+
+struct ep_event {
+    uint32_t events;
+    uint32_t data;                      /* Caller's cookie, returned with the events */
+};
+
+/* One object watched by one instance */
+struct ep_item {
+    struct ep_item* wait_next;          /* Next watch on the same object */
+    struct ep_item* ready_next;
+    struct ep_item** ready_pprev;       /* NULL while not on the ready list */
+    struct ep_item* instance_next;
+    struct ep_item** instance_pprev;
+    struct ep_wait_queue* queue;
+    uint32_t instance;
+    uint32_t events;
+    uint32_t data;
+};
+
+struct eventpoll {
+    uint32_t used;
+    struct ep_item* items;              /* Every watch, for close */
+    struct ep_item* ready_head;         /* FIFO of watches that may have events */
+    struct ep_item** ready_tail;
+    uint32_t ready_count;
+};
+
+static struct eventpoll instances[EP_MAX_INSTANCES];
+static struct ep_item item_pool[EP_MAX_ITEMS];
+static struct ep_item* item_free;
+
+/* Tick counter of the kernel this is linked into */
+extern uint32_t timer_ticks;
+
+/* Function prototypes */
+void ep_init(void);
+void ep_queue_init(struct ep_wait_queue* queue, uint32_t (*poll)(void* object), void* object);
+void ep_queue_release(struct ep_wait_queue* queue);
+void ep_wake(struct ep_wait_queue* queue, uint32_t events);
+int ep_create(void);
+int ep_close(int epfd);
+int ep_ctl(int epfd, int op, struct ep_wait_queue* target, const struct ep_event* event);
+int ep_wait(int epfd, struct ep_event* events, int maxevents, int timeout);
+
+/* Save EFLAGS and disable interrupts; wakeups come from interrupt-driven RX paths */
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+/* Restore the interrupt flag saved by irq_save */
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+}
+
+void ep_init(void) {
+    item_free = NULL;
+    for (int i = EP_MAX_ITEMS - 1; i >= 0; i--) {
+        item_pool[i].wait_next = item_free;
+        item_free = &item_pool[i];
+    }
+    for (int i = 0; i < EP_MAX_INSTANCES; i++) {
+        instances[i].used = 0;
+    }
+}
+
+/* Set up the wait queue of a new object; poll reports its readiness on demand */
+void ep_queue_init(struct ep_wait_queue* queue, uint32_t (*poll)(void* object), void* object) {
+    queue->head = NULL;
+    queue->poll = poll;
+    queue->object = object;
+}
+
+static struct eventpoll* ep_lookup(int epfd) {
+    if (epfd < 0 || epfd >= EP_MAX_INSTANCES || !instances[epfd].used) return NULL;
+    return &instances[epfd];
+}
+
+static void ready_add(struct ep_item* item) {
+    struct eventpoll* ep = &instances[item->instance];
+    if (item->ready_pprev) return;
+    item->ready_next = NULL;
+    item->ready_pprev = ep->ready_tail;
+    *ep->ready_tail = item;
+    ep->ready_tail = &item->ready_next;
+    ep->ready_count++;
+}
+
+static void ready_remove(struct ep_item* item) {
+    struct eventpoll* ep = &instances[item->instance];
+    if (!item->ready_pprev) return;
+    *item->ready_pprev = item->ready_next;
+    if (item->ready_next) {
+        item->ready_next->ready_pprev = item->ready_pprev;
+    } else {
+        ep->ready_tail = item->ready_pprev;
+    }
+    item->ready_pprev = NULL;
+    ep->ready_count--;
+}
+
+/* Unlink a watch from everything and return it to the pool; interrupts are off */
+static void item_destroy(struct ep_item* item) {
+    ready_remove(item);
+    
+    struct ep_item** link = &item->queue->head;
+    while (*link != item) link = &(*link)->wait_next;
+    *link = item->wait_next;
+    
+    *item->instance_pprev = item->instance_next;
+    if (item->instance_next) {
+        item->instance_next->instance_pprev = item->instance_pprev;
+    }
+    
+    item->wait_next = item_free;
+    item_free = item;
+}
+
+/* The object is going away: drop every watch on it */
+void ep_queue_release(struct ep_wait_queue* queue) {
+    uint32_t flags = irq_save();
+    while (queue->head) {
+        item_destroy(queue->head);
+    }
+    irq_restore(flags);
+}
+
+/*
+ * Called by the object when its state changes. Only watches interested in the
+ * events are queued; the object is polled again when ep_wait collects them.
+ */
+void ep_wake(struct ep_wait_queue* queue, uint32_t events) {
+    uint32_t flags = irq_save();
+    for (struct ep_item* item = queue->head; item; item = item->wait_next) {
+        if ((item->events | EPOLLERR | EPOLLHUP) & events) {
+            ready_add(item);
+        }
+    }
+    irq_restore(flags);
+}
+
+int ep_create(void) {
+    uint32_t flags = irq_save();
+    for (int i = 0; i < EP_MAX_INSTANCES; i++) {
+        if (!instances[i].used) {
+            instances[i].used = 1;
+            instances[i].items = NULL;
+            instances[i].ready_head = NULL;
+            instances[i].ready_tail = &instances[i].ready_head;
+            instances[i].ready_count = 0;
+            irq_restore(flags);
+            return i;
+        }
+    }
+    irq_restore(flags);
+    return -1;
+}
+
+int ep_close(int epfd) {
+    uint32_t flags = irq_save();
+    struct eventpoll* ep = ep_lookup(epfd);
+    if (!ep) {
+        irq_restore(flags);
+        return -1;
+    }
+    while (ep->items) {
+        item_destroy(ep->items);
+    }
+    ep->used = 0;
+    irq_restore(flags);
+    return 0;
+}
+
+/* The watch of instance epfd on target, or NULL */
+static struct ep_item* ep_find(struct ep_wait_queue* target, int epfd) {
+    struct ep_item* item = target->head;
+    while (item && item->instance != (uint32_t)epfd) {
+        item = item->wait_next;
+    }
+    return item;
+}
+
+/* Add, change or remove the watch of one instance on one object */
+int ep_ctl(int epfd, int op, struct ep_wait_queue* target, const struct ep_event* event) {
+    if (!target || (op != EP_CTL_DEL && !event)) return -1;
+    
+    uint32_t flags = irq_save();
+    struct eventpoll* ep = ep_lookup(epfd);
+    struct ep_item* item = ep ? ep_find(target, epfd) : NULL;
+    
+    if (!ep || (op == EP_CTL_ADD) == (item != NULL) || (op == EP_CTL_ADD && !item_free) ||
+        (op != EP_CTL_ADD && op != EP_CTL_MOD && op != EP_CTL_DEL)) {
+        irq_restore(flags);
+        return -1;
+    }
+    if (op == EP_CTL_DEL) {
+        item_destroy(item);
+        irq_restore(flags);
+        return 0;
+    }
+    
+    if (op == EP_CTL_ADD) {
+        item = item_free;
+        item_free = item->wait_next;
+        item->queue = target;
+        item->instance = epfd;
+        item->ready_pprev = NULL;
+        item->wait_next = target->head;
+        target->head = item;
+        item->instance_next = ep->items;
+        if (item->instance_next) {
+            item->instance_next->instance_pprev = &item->instance_next;
+        }
+        item->instance_pprev = &ep->items;
+        ep->items = item;
+    }
+    item->events = event->events;
+    item->data = event->data;
+    
+    /* A new or changed watch reports an object that is already ready */
+    if (target->poll(target->object) & (item->events | EPOLLERR | EPOLLHUP)) {
+        ready_add(item);
+    }
+    irq_restore(flags);
+    return 0;
+}
+
+/*
+ * Collect up to maxevents from the ready list, polling each object for its
+ * current state. Level-triggered watches that are still ready go back on the
+ * tail, so the next wait sees them again; edge-triggered ones wait for the
+ * next ep_wake. The cost is in the ready watches, not all of them.
+ */
+static int ep_collect(struct eventpoll* ep, struct ep_event* events, int maxevents) {
+    uint32_t flags = irq_save();
+    uint32_t pending = ep->ready_count;
+    int count = 0;
+    
+    while (pending-- && count < maxevents) {
+        struct ep_item* item = ep->ready_head;
+        ready_remove(item);
+        
+        uint32_t revents = item->queue->poll(item->queue->object) & (item->events | EPOLLERR | EPOLLHUP);
+        if (!revents) continue;
+        
+        events[count].events = revents;
+        events[count].data = item->data;
+        count++;
+        if (!(item->events & EPOLLET)) {
+            ready_add(item);
+        }
+    }
+    irq_restore(flags);
+    return count;
+}
+
+/* Wait for events: timeout 0 polls, negative waits indefinitely, else waits that many ticks */
+int ep_wait(int epfd, struct ep_event* events, int maxevents, int timeout) {
+    struct eventpoll* ep = ep_lookup(epfd);
+    if (!ep || !events || maxevents <= 0) return -1;
+    
+    uint32_t start = *(volatile uint32_t*)&timer_ticks;
+    for (;;) {
+        int count = ep_collect(ep, events, maxevents);
+        if (count || timeout == 0) return count;
+        if (timeout > 0 && *(volatile uint32_t*)&timer_ticks - start >= (uint32_t)timeout) return 0;
+        
+        /* Sleep until an interrupt, which is where wakeups come from */
+        __asm__ __volatile__("hlt" : : : "memory");
+    }
+}
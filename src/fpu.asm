@@ -0,0 +1,34 @@
+;
+; Tiny Operating System - FPU Trap Handler
+; Device-not-available (#NM) entry for lazy FPU/SSE switching
+;
+
+[bits 32]
+
+; Device not available handler (INT 7)
+global device_not_available_handler
+extern fpu_handle_nm
+device_not_available_handler:
+    ; Save registers
+    pusha
+    mov ax, ds
+    push eax
+    mov ax, 0x10  ; Kernel data segment
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    
+    ; Load the current process's FPU state
+    call fpu_handle_nm
+    
+    ; Restore registers
+    pop eax
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    popa
+    
+    ; Retry the faulting FPU instruction
+    iret
@@ -0,0 +1,216 @@
+/*
+ * Tiny Operating System - Profile Counters
+ * The runtime that GCC's -fprofile-arcs code calls into, for the bench
+ * kernel of the profile-guided build (make pgo). Each instrumented object
+ * counts its functions' arcs in static counters, which need nothing from
+ * here, and registers them from a constructor. Nothing runs constructors
+ * at boot, so gcov_dump runs them when it is first called; they are the
+ * only ones the kernels have. It then sends each object's counters out in
+ * the .gcda form -fprofile-use reads, one line per file:
+ *   {"gcda":"/path/of/object.gcda","data":"<the file's bytes in hex>"}
+ * which tools/gcdaextract.c writes back beside the objects. The version
+ * in each file is the compiler's own, so -fprofile-use refuses data that
+ * another compiler made.
+ */
+
+#include <stdint.h>
+
+/* GCC 10 to 13's libgcov (must match the compiler's gcov-io.h) */
+#define GCOV_COUNTERS 8
+#define GCOV_COUNTER_ARCS 0
+#define GCOV_DATA_MAGIC 0x67636461u     /* "gcda" */
+#define GCOV_TAG_FUNCTION 0x01000000u
+#define GCOV_TAG_FUNCTION_LENGTH 12     /* Lengths are in bytes */
+#define GCOV_TAG_COUNTER_BASE 0x01a10000u
+#define GCOV_TAG_OBJECT_SUMMARY 0xa1000000u
+#define GCOV_TAG_SUMMARY_LENGTH 8
+
+#define GCOV_LINE 128                   /* Characters sent at a time */
+
+struct gcov_info;
+
+struct gcov_ctr_info {
+    uint32_t num;
+    int64_t* values;
+};
+
+struct gcov_fn_info {
+    const struct gcov_info* key;        /* The object whose copy of the function this is */
+    uint32_t ident;
+    uint32_t lineno_checksum;
+    uint32_t cfg_checksum;
+    struct gcov_ctr_info ctrs[];        /* One per counter kind the object merges, in order */
+};
+
+typedef void (*gcov_merge_fn)(int64_t* counters, uint32_t n);
+
+struct gcov_info {
+    uint32_t version;
+    struct gcov_info* next;
+    uint32_t stamp;
+    uint32_t checksum;
+    const char* filename;
+    gcov_merge_fn merge[GCOV_COUNTERS]; /* Set for the counter kinds in use */
+    uint32_t n_functions;
+    const struct gcov_fn_info* const* functions;
+};
+
+static struct gcov_info* gcov_list;
+static int gcov_registered;
+
+/* The line being put together, and where it goes */
+static char gcov_line[GCOV_LINE];
+static uint32_t gcov_line_length;
+static void (*gcov_emit)(const void* data, uint32_t size);
+
+/* Linker symbols: the constructors */
+extern void (*__init_array_start[])(void);
+extern void (*__init_array_end[])(void);
+
+/* Function prototypes */
+void __gcov_init(struct gcov_info* info);
+void __gcov_merge_add(int64_t* counters, uint32_t n);
+void __gcov_exit(void);
+uint32_t gcov_dump(void (*emit)(const void* data, uint32_t size));
+
+/* Called by each object's constructor */
+void __gcov_init(struct gcov_info* info) {
+    info->next = gcov_list;
+    gcov_list = info;
+}
+
+/* Merges with a .gcda already on disk; there is none here */
+void __gcov_merge_add(int64_t* counters, uint32_t n) {
+    (void)counters;
+    (void)n;
+}
+
+/* Called by each object's destructor, which nothing runs */
+void __gcov_exit(void) {
+}
+
+static void gcov_flush(void) {
+    if (gcov_line_length) {
+        gcov_emit(gcov_line, gcov_line_length);
+        gcov_line_length = 0;
+    }
+}
+
+static void gcov_puts(const char* text) {
+    while (*text) {
+        if (gcov_line_length == GCOV_LINE) {
+            gcov_flush();
+        }
+        gcov_line[gcov_line_length++] = *text++;
+    }
+}
+
+/* A word of the file, in its little-endian byte order */
+static void gcov_put_word(uint32_t word) {
+    static const char hex[] = "0123456789abcdef";
+    for (uint32_t i = 0; i < 4; i++) {
+        if (gcov_line_length > GCOV_LINE - 2) {
+            gcov_flush();
+        }
+        uint8_t byte = (uint8_t)(word >> (i * 8));
+        gcov_line[gcov_line_length++] = hex[byte >> 4];
+        gcov_line[gcov_line_length++] = hex[byte & 0xF];
+    }
+}
+
+/* The largest arc count of the whole kernel, which sets what -fprofile-use calls hot */
+static uint64_t gcov_sum_max(void) {
+    uint64_t max = 0;
+    for (const struct gcov_info* info = gcov_list; info; info = info->next) {
+        if (!info->merge[GCOV_COUNTER_ARCS]) {
+            continue;
+        }
+        for (uint32_t f = 0; f < info->n_functions; f++) {
+            const struct gcov_fn_info* function = info->functions[f];
+            if (!function || function->key != info) {
+                continue;
+            }
+            for (uint32_t i = 0; i < function->ctrs[0].num; i++) {
+                uint64_t count = (uint64_t)function->ctrs[0].values[i];
+                max = count > max ? count : max;
+            }
+        }
+    }
+    return max;
+}
+
+/* One object's .gcda, as libgcov writes it after a single run */
+static void gcov_write(const struct gcov_info* info, uint64_t sum_max) {
+    gcov_put_word(GCOV_DATA_MAGIC);
+    gcov_put_word(info->version);
+    gcov_put_word(info->stamp);
+    gcov_put_word(info->checksum);
+    gcov_put_word(GCOV_TAG_OBJECT_SUMMARY);
+    gcov_put_word(GCOV_TAG_SUMMARY_LENGTH);
+    gcov_put_word(1);                   /* Runs */
+    gcov_put_word((uint32_t)sum_max);   /* Cut to 32 bits, as libgcov does */
+
+    for (uint32_t f = 0; f < info->n_functions; f++) {
+        const struct gcov_fn_info* function = info->functions[f];
+        /* A function another object's copy was kept of has an empty record */
+        if (!function || function->key != info) {
+            gcov_put_word(GCOV_TAG_FUNCTION);
+            gcov_put_word(0);
+            continue;
+        }
+        gcov_put_word(GCOV_TAG_FUNCTION);
+        gcov_put_word(GCOV_TAG_FUNCTION_LENGTH);
+        gcov_put_word(function->ident);
+        gcov_put_word(function->lineno_checksum);
+        gcov_put_word(function->cfg_checksum);
+
+        /* -fprofile-arcs only counts arcs: each kind is a plain array of counts */
+        const struct gcov_ctr_info* counters = function->ctrs;
+        for (uint32_t kind = 0; kind < GCOV_COUNTERS; kind++) {
+            if (!info->merge[kind]) {
+                continue;
+            }
+            int zero = 1;
+            for (uint32_t i = 0; i < counters->num && zero; i++) {
+                zero = counters->values[i] == 0;
+            }
+            /* All zero is written as a negated length and no values */
+            uint32_t length = counters->num * 8;
+            gcov_put_word(GCOV_TAG_COUNTER_BASE + (kind << 17));
+            gcov_put_word(zero ? -length : length);
+            for (uint32_t i = 0; i < counters->num && !zero; i++) {
+                uint64_t count = (uint64_t)counters->values[i];
+                gcov_put_word((uint32_t)count);
+                gcov_put_word((uint32_t)(count >> 32));
+            }
+            counters++;
+        }
+    }
+    gcov_put_word(0);
+}
+
+/*
+ * Send the counts so far of every instrumented object through emit, one
+ * line per .gcda file; returns how many files were sent.
+ */
+uint32_t gcov_dump(void (*emit)(const void* data, uint32_t size)) {
+    if (!gcov_registered) {
+        for (void (**constructor)(void) = __init_array_start; constructor < __init_array_end; constructor++) {
+            (*constructor)();
+        }
+        gcov_registered = 1;
+    }
+    gcov_emit = emit;
+    uint64_t sum_max = gcov_sum_max();
+    uint32_t files = 0;
+    for (const struct gcov_info* info = gcov_list; info; info = info->next) {
+        gcov_puts("{\"gcda\":\"");
+        gcov_puts(info->filename);
+        gcov_puts("\",\"data\":\"");
+        gcov_write(info, sum_max);
+        gcov_puts("\"}\n");
+        gcov_flush();
+        files++;
+    }
+    return files;
+}
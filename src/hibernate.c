@@ -0,0 +1,186 @@
+/*
+ * Tiny Operating System - Hibernation
+ * A snapshot of a booted kernel, written to a block device, so that a
+ * later boot of the same build can load it back instead of initialising
+ * everything again. The image is the kernel's memory: code and data from
+ * its link address to _edata, below the VGA window and ROMs at 640 KiB,
+ * and every static table, cache and pool in its .bss from 1 MiB, then
+ * the frames the stage handed out past _end, DMA memory among them. It
+ * is copied to staging memory past those with interrupts off, so it is
+ * one moment's memory, and written from there. Resuming reads it
+ * into the same place, checks it, and copies it over the running kernel,
+ * which then returns from the hibernate_snapshot call that made it.
+ *
+ * Only memory is saved. Devices stay as the booting kernel set them up,
+ * which the same build does the same way, so the image must be taken
+ * with no I/O in flight, and the sectors it is written to must be ones
+ * nothing else uses. The machine needs RAM for the staging copy: as
+ * much again as the kernel, past its end.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HIBERNATE_MAGIC "TOSHIBER"
+#define HIBERNATE_VERSION 1
+#define HIBERNATE_LOW_BASE 0x10000      /* Link address of every stage (must match hibernate_restore.asm) */
+#define HIBERNATE_HOLE_START 0xA0000    /* VGA window and ROMs, not saved */
+#define HIBERNATE_HIGH_BASE 0x100000    /* Must match hibernate_restore.asm */
+#define SECTOR_SIZE 512
+#define PAGE_SIZE 4096
+
+/* The image's first sector, and the image from the next */
+struct hibernate_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t low_size;                  /* Bytes from HIBERNATE_LOW_BASE */
+    uint32_t high_size;                 /* Bytes from HIBERNATE_HIGH_BASE, following them */
+    uint32_t text_crc;                  /* CRC32C of the kernel's code: only the same build resumes */
+    uint32_t image_crc;                 /* CRC32C of both ranges */
+};
+
+/* Registers hibernate_save keeps (must match hibernate_restore.asm) */
+struct hibernate_context {
+    uint32_t eip;
+    uint32_t esp;
+    uint32_t ebp;
+    uint32_t ebx;
+    uint32_t esi;
+    uint32_t edi;
+    uint32_t eflags;
+    uint8_t gdtr[8];                    /* sgdt's six bytes */
+    uint8_t idtr[8];
+} __attribute__((packed));
+
+static struct hibernate_context hibernate_context;
+static uint8_t hibernate_sector[SECTOR_SIZE] __attribute__((aligned(SECTOR_SIZE)));
+
+/* Linker symbols */
+extern char etext[];
+extern char _edata[];
+
+/* Entry and exit (hibernate_restore.asm) */
+extern int hibernate_save(struct hibernate_context* context) __attribute__((returns_twice));
+extern void hibernate_restore(const void* image, const struct hibernate_context* context,
+                              uint32_t low_size, uint32_t high_size) __attribute__((noreturn));
+
+/* Frame allocator (kernel_drivers.c): the end of the frames handed out past _end */
+extern uint32_t paging_frames_end(void);
+
+/* CRC32C (crc32c.c) */
+extern uint32_t crc32c(uint32_t crc, const void* data, uint32_t size);
+
+/* Block layer (block.c) */
+extern int blk_read(uint32_t device, uint32_t sector, uint32_t count, void* buffer);
+extern int blk_write(uint32_t device, uint32_t sector, uint32_t count, const void* buffer);
+extern uint32_t blk_sectors(uint32_t device);
+
+/* Kernel runtime library (klib.c) */
+extern void* memcpy(void* dest, const void* src, size_t n);
+extern void* memset(void* s, int c, size_t n);
+extern int memcmp(const void* a, const void* b, size_t n);
+
+/* Function prototypes */
+uint8_t* hibernate_staging(void);
+uint32_t hibernate_image_sectors(void);
+int hibernate_snapshot(uint32_t device, uint32_t sector);
+int hibernate_resume(uint32_t device, uint32_t sector);
+
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+}
+
+/* The image's two ranges, in bytes, each a whole number of words */
+static void hibernate_layout(uint32_t* low_size, uint32_t* high_size) {
+    uint32_t low_end = ((uint32_t)_edata + 3) & ~3u;
+    uint32_t end = paging_frames_end();
+    *low_size = (low_end < HIBERNATE_HOLE_START ? low_end : HIBERNATE_HOLE_START) - HIBERNATE_LOW_BASE;
+    *high_size = end > HIBERNATE_HIGH_BASE ? end - HIBERNATE_HIGH_BASE : 0;
+}
+
+/* Where the image is put together and read back: the first page past the kernel's frames */
+uint8_t* hibernate_staging(void) {
+    return (uint8_t*)paging_frames_end();
+}
+
+/* Sectors an image takes on disk, its header included */
+uint32_t hibernate_image_sectors(void) {
+    uint32_t low_size, high_size;
+    hibernate_layout(&low_size, &high_size);
+    return 1 + (low_size + high_size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+}
+
+/*
+ * Write an image of the kernel to device from sector on. Returns 0 once
+ * it is written, and 1 when hibernate_resume has brought it back and
+ * this call returns again, into the restored kernel; -1 when it does not
+ * fit or a write fails.
+ */
+int hibernate_snapshot(uint32_t device, uint32_t sector) {
+    uint32_t low_size, high_size;
+    hibernate_layout(&low_size, &high_size);
+    uint32_t sectors = hibernate_image_sectors();
+    if (sector + sectors < sector || sector + sectors > blk_sectors(device)) {
+        return -1;
+    }
+    uint8_t* staging = hibernate_staging();
+    uint32_t flags = irq_save();
+    if (hibernate_save(&hibernate_context)) {
+        irq_restore(flags);
+        return 1;
+    }
+    memcpy(staging, (const void*)HIBERNATE_LOW_BASE, low_size);
+    memcpy(staging + low_size, (const void*)HIBERNATE_HIGH_BASE, high_size);
+    irq_restore(flags);
+
+    /* The padding of the last sector is zeroes, and not part of the CRC */
+    struct hibernate_header* header = (struct hibernate_header*)hibernate_sector;
+    memset(hibernate_sector, 0, SECTOR_SIZE);
+    memcpy(header->magic, HIBERNATE_MAGIC, sizeof(header->magic));
+    header->version = HIBERNATE_VERSION;
+    header->low_size = low_size;
+    header->high_size = high_size;
+    header->text_crc = crc32c(0, (const void*)HIBERNATE_LOW_BASE, (uint32_t)etext - HIBERNATE_LOW_BASE);
+    header->image_crc = crc32c(0, staging, low_size + high_size);
+    memset(staging + low_size + high_size, 0, (sectors - 1) * SECTOR_SIZE - low_size - high_size);
+
+    /* The header goes last, so a torn write leaves no image that looks whole */
+    if (blk_write(device, sector + 1, sectors - 1, staging) != 0 ||
+        blk_write(device, sector, 1, hibernate_sector) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Resume the image at sector of device: returns only when there is none,
+ * it was written by another build, or it does not read back whole, with
+ * -1. Otherwise the kernel continues from the hibernate_snapshot call
+ * that wrote it.
+ */
+int hibernate_resume(uint32_t device, uint32_t sector) {
+    uint32_t low_size, high_size;
+    hibernate_layout(&low_size, &high_size);
+    uint32_t sectors = hibernate_image_sectors();
+    const struct hibernate_header* header = (const struct hibernate_header*)hibernate_sector;
+    if (sector + sectors < sector || sector + sectors > blk_sectors(device) ||
+        blk_read(device, sector, 1, hibernate_sector) != 0 ||
+        memcmp(header->magic, HIBERNATE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != HIBERNATE_VERSION || header->low_size != low_size || header->high_size != high_size ||
+        header->text_crc != crc32c(0, (const void*)HIBERNATE_LOW_BASE, (uint32_t)etext - HIBERNATE_LOW_BASE)) {
+        return -1;
+    }
+    uint8_t* staging = hibernate_staging();
+    uint32_t image_crc = header->image_crc;
+    if (blk_read(device, sector + 1, sectors - 1, staging) != 0 ||
+        crc32c(0, staging, low_size + high_size) != image_crc) {
+        return -1;
+    }
+    hibernate_restore(staging, &hibernate_context, low_size, high_size);
+}
@@ -0,0 +1,85 @@
+;
+; Tiny Operating System - Hibernation Entry and Exit
+; Save the registers of a running kernel, and later copy a saved image
+; of it back over the kernel and resume it where it was saved
+;
+
+[bits 32]
+
+; struct hibernate_context offsets (must match hibernate.c)
+CONTEXT_EIP    equ 0
+CONTEXT_ESP    equ 4
+CONTEXT_EBP    equ 8
+CONTEXT_EBX    equ 12
+CONTEXT_ESI    equ 16
+CONTEXT_EDI    equ 20
+CONTEXT_EFLAGS equ 24
+CONTEXT_GDTR   equ 28
+CONTEXT_IDTR   equ 36
+
+; Where the image's two ranges go (must match hibernate.c)
+IMAGE_LOW_BASE  equ 0x10000
+IMAGE_HIGH_BASE equ 0x100000
+
+section .text
+
+; int hibernate_save(struct hibernate_context* context)
+; Returns 0 having saved the caller's registers; returns 1 from the same
+; call again when hibernate_restore brings an image of them back
+global hibernate_save
+hibernate_save:
+    mov eax, [esp+4]
+    mov edx, [esp]
+    mov [eax+CONTEXT_EIP], edx
+    lea edx, [esp+4]    ; The caller's stack once this returns
+    mov [eax+CONTEXT_ESP], edx
+    mov [eax+CONTEXT_EBP], ebp
+    mov [eax+CONTEXT_EBX], ebx
+    mov [eax+CONTEXT_ESI], esi
+    mov [eax+CONTEXT_EDI], edi
+    pushfd
+    pop dword [eax+CONTEXT_EFLAGS]
+    sgdt [eax+CONTEXT_GDTR]
+    sidt [eax+CONTEXT_IDTR]
+    xor eax, eax
+    ret
+
+; void hibernate_restore(const void* image, const struct hibernate_context* context,
+;                        uint32_t low_size, uint32_t high_size)
+; Copy the image over this kernel, low range then high, and return 1 from
+; its hibernate_save. The copy overwrites this code with the same bytes,
+; and the stack it was called on with the image's, so from the first
+; store on only registers are used. context is at the same address in
+; both, and is read once it holds the image's.
+global hibernate_restore
+hibernate_restore:
+    cli
+    mov esi, [esp+4]
+    mov ebx, [esp+8]
+    mov ecx, [esp+12]
+    mov edx, [esp+16]
+    cld
+    mov edi, IMAGE_LOW_BASE
+    shr ecx, 2
+    rep movsd
+    mov edi, IMAGE_HIGH_BASE
+    mov ecx, edx
+    shr ecx, 2
+    rep movsd
+
+    ; Descriptor tables are in the image, at the addresses saved with them
+    lgdt [ebx+CONTEXT_GDTR]
+    lidt [ebx+CONTEXT_IDTR]
+    mov esp, [ebx+CONTEXT_ESP]
+    mov ebp, [ebx+CONTEXT_EBP]
+    mov esi, [ebx+CONTEXT_ESI]
+    mov edi, [ebx+CONTEXT_EDI]
+    push dword [ebx+CONTEXT_EFLAGS]
+    popfd
+    mov edx, [ebx+CONTEXT_EIP]
+    mov ebx, [ebx+CONTEXT_EBX]
+    mov eax, 1
+    jmp edx
+
+; Mark the object as not needing an executable stack
+section .note.GNU-stack noalloc noexec nowrite progbits
@@ -0,0 +1,286 @@
+/*
+ * Tiny Operating System - Boot Timeline
+ * Each init phase of kernel_main is stamped with the TSC on the way in and
+ * out; the report lists the phases slowest first, with the time the
+ * bootloader took to reach the kernel. Driver probes are registered with
+ * their dependencies, and the ones boot does not wait for are left to the
+ * idle loop or to their first user.
+ */
+
+#include <stdint.h>
+
+#define INITCALL_MAX 32                 /* Phases recorded per boot; later ones are run unrecorded */
+#define INITCALL_LINE 80
+#define INITCALL_DRIVERS 32             /* Ids are bits of a dependency mask */
+
+/* Driver flags (must match the users' copies) */
+#define INITCALL_DEFERRED 0x1           /* Not needed to boot: probed from the idle loop */
+#define INITCALL_ON_DEMAND 0x2          /* Probed only when first required */
+
+#define BOOT_TSC_MAGIC 0x544F5342       /* "TOSB": ESI:EDI hold the loader's TSC (must match bootloader.asm) */
+
+/* Levels, as in syslog (must match printk.c) */
+#define PRINTK_INFO 6
+
+/* One init phase */
+struct initcall {
+    const char* name;
+    uint64_t start;
+    uint64_t end;
+};
+
+static struct initcall initcalls[INITCALL_MAX];
+static uint32_t initcall_count;
+static int initcall_open;               /* A phase was begun and not yet ended */
+
+/* One registered driver probe */
+struct initcall_driver {
+    const char* name;
+    int (*probe)(void);
+    uint32_t depends;                   /* Ids probed before this one */
+    uint32_t flags;
+    int result;                         /* The probe's return, once run */
+};
+
+static struct initcall_driver initcall_drivers[INITCALL_DRIVERS];
+static uint32_t initcall_driver_count;
+static uint32_t initcall_probed;        /* Ids whose probe has returned */
+static uint32_t initcall_probing;       /* Ids on the way down; a cycle stops at them */
+
+/*
+ * Left by boot.asm, which saves them before it touches a register. Weak:
+ * the stages that enter at kernel_main directly have no boot.o, and the
+ * timeline then starts at the first phase.
+ */
+extern uint32_t boot_magic __attribute__((weak));
+extern uint64_t boot_loader_tsc __attribute__((weak));
+extern uint64_t kernel_entry_tsc __attribute__((weak));
+
+/* Function prototypes */
+void initcall_begin(const char* name);
+void initcall_end(void);
+void initcall_run(const char* name, void (*init)(void));
+uint32_t initcall_phases(void);
+void initcall_report(uint32_t tsc_khz);
+int initcall_driver(const char* name, int (*probe)(void), uint32_t depends, uint32_t flags);
+void initcall_run_drivers(void);
+int initcall_require(uint32_t id);
+uint32_t initcall_run_deferred(uint32_t budget);
+
+/* Kernel log ring (printk.c) */
+extern int printk(uint32_t level, const char* text);
+
+static inline uint64_t rdtsc(void) {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+/* Open a phase; a phase still open is closed first */
+void initcall_begin(const char* name) {
+    if (initcall_open) {
+        initcall_end();
+    }
+    if (initcall_count == INITCALL_MAX) {
+        return;
+    }
+    initcalls[initcall_count].name = name;
+    initcalls[initcall_count].start = rdtsc();
+    initcall_open = 1;
+}
+
+void initcall_end(void) {
+    if (!initcall_open) {
+        return;
+    }
+    initcalls[initcall_count++].end = rdtsc();
+    initcall_open = 0;
+}
+
+/* Run one argument-less init function as a phase of its own */
+void initcall_run(const char* name, void (*init)(void)) {
+    initcall_begin(name);
+    init();
+    initcall_end();
+}
+
+uint32_t initcall_phases(void) {
+    return initcall_count;
+}
+
+/*
+ * Register a probe to run after the drivers whose ids are set in depends.
+ * Returns its id, or -1 when the table is full. A dependency only orders
+ * the probes: one that found no device still counts as probed.
+ */
+int initcall_driver(const char* name, int (*probe)(void), uint32_t depends, uint32_t flags) {
+    if (initcall_driver_count == INITCALL_DRIVERS) {
+        return -1;
+    }
+    struct initcall_driver* driver = &initcall_drivers[initcall_driver_count];
+    driver->name = name;
+    driver->probe = probe;
+    driver->depends = depends;
+    driver->flags = flags;
+    driver->result = 0;
+    return (int)initcall_driver_count++;
+}
+
+/* Probe id after its dependencies, each once and as a phase of its own */
+static int initcall_probe(uint32_t id) {
+    struct initcall_driver* driver = &initcall_drivers[id];
+    uint32_t bit = 1u << id;
+    if (initcall_probed & bit) {
+        return driver->result;
+    }
+    if (initcall_probing & bit) {
+        return -1;
+    }
+    initcall_probing |= bit;
+    for (uint32_t dep = 0; dep < initcall_driver_count; dep++) {
+        if (driver->depends & (1u << dep)) {
+            initcall_probe(dep);
+        }
+    }
+    initcall_begin(driver->name);
+    driver->result = driver->probe();
+    initcall_end();
+    initcall_probing &= ~bit;
+    initcall_probed |= bit;
+    return driver->result;
+}
+
+/* Probe every driver boot waits for, with whatever they depend on, deferred or not */
+void initcall_run_drivers(void) {
+    for (uint32_t id = 0; id < initcall_driver_count; id++) {
+        if (!(initcall_drivers[id].flags & (INITCALL_DEFERRED | INITCALL_ON_DEMAND))) {
+            initcall_probe(id);
+        }
+    }
+}
+
+/* For a driver's first user: probe it now unless that was done. Returns the probe's result */
+int initcall_require(uint32_t id) {
+    if (id >= initcall_driver_count) {
+        return -1;
+    }
+    return initcall_probe(id);
+}
+
+/*
+ * From the idle loop: probe up to budget deferred drivers still waiting.
+ * Returns how many are left, so the loop knows whether to halt.
+ */
+uint32_t initcall_run_deferred(uint32_t budget) {
+    uint32_t left = 0;
+    for (uint32_t id = 0; id < initcall_driver_count; id++) {
+        if (!(initcall_drivers[id].flags & INITCALL_DEFERRED) || (initcall_probed & (1u << id))) {
+            continue;
+        }
+        if (budget) {
+            initcall_probe(id);
+            budget--;
+        } else {
+            left++;
+        }
+    }
+    return left;
+}
+
+/* Cycles in microseconds, or left as cycles without a TSC rate; a 64-by-32 division without libgcc */
+static uint32_t initcall_scale(uint64_t cycles, uint32_t tsc_khz) {
+    if (!tsc_khz) {
+        return cycles > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)cycles;
+    }
+    uint64_t dividend = cycles * 1000;
+    uint64_t quotient = 0;
+    uint64_t remainder = 0;
+    for (int bit = 63; bit >= 0; bit--) {
+        remainder = (remainder << 1) | ((dividend >> bit) & 1);
+        if (remainder >= tsc_khz) {
+            remainder -= tsc_khz;
+            quotient |= 1ull << bit;
+        }
+    }
+    return quotient > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)quotient;
+}
+
+static char* initcall_puts(char* out, const char* text, uint32_t width) {
+    uint32_t len = 0;
+    while (text[len] && len < 24) {
+        *out++ = text[len++];
+    }
+    while (len++ < width) {
+        *out++ = ' ';
+    }
+    return out;
+}
+
+/* Right-aligned in width columns */
+static char* initcall_putu(char* out, uint32_t value, uint32_t width) {
+    char digits[10];
+    uint32_t count = 0;
+    do {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    while (width-- > count) {
+        *out++ = ' ';
+    }
+    while (count) {
+        *out++ = digits[--count];
+    }
+    return out;
+}
+
+/* "  name   offset   duration unit" */
+static void initcall_line(const char* name, uint32_t offset, uint32_t duration, const char* unit) {
+    char line[INITCALL_LINE];
+    char* out = initcall_puts(line, "  ", 2);
+    out = initcall_puts(out, name, 24);
+    out = initcall_putu(out, offset, 11);
+    out = initcall_putu(out, duration, 11);
+    out = initcall_puts(out, " ", 1);
+    out = initcall_puts(out, unit, 0);
+    *out++ = '\n';
+    *out = '\0';
+    printk(PRINTK_INFO, line);
+}
+
+/*
+ * Log the timeline: the loader's share if it passed its TSC, then every
+ * phase, slowest first, with its start measured from kernel entry, then
+ * the total to now. In microseconds given the TSC rate, else in cycles.
+ */
+void initcall_report(uint32_t tsc_khz) {
+    const char* unit = tsc_khz ? "us" : "cycles";
+    uint64_t now = rdtsc();
+    uint64_t entry = &kernel_entry_tsc ? kernel_entry_tsc : 0;
+    if (!entry) {
+        entry = initcall_count ? initcalls[0].start : now;
+    }
+
+    printk(PRINTK_INFO, "Boot timeline, slowest phase first (start, duration):\n");
+    if (&boot_magic && boot_magic == BOOT_TSC_MAGIC && boot_loader_tsc && boot_loader_tsc < entry) {
+        initcall_line("bootloader", 0, initcall_scale(entry - boot_loader_tsc, tsc_khz), unit);
+    }
+
+    /* Few phases: an insertion sort of their indices by duration */
+    uint8_t order[INITCALL_MAX];
+    for (uint32_t i = 0; i < initcall_count; i++) {
+        uint64_t duration = initcalls[i].end - initcalls[i].start;
+        uint32_t j = i;
+        while (j && initcalls[order[j - 1]].end - initcalls[order[j - 1]].start < duration) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = (uint8_t)i;
+    }
+    for (uint32_t i = 0; i < initcall_count; i++) {
+        const struct initcall* call = &initcalls[order[i]];
+        uint64_t start = call->start > entry ? call->start - entry : 0;
+        initcall_line(call->name, initcall_scale(start, tsc_khz),
+                      initcall_scale(call->end - call->start, tsc_khz), unit);
+    }
+    initcall_line("total", 0, initcall_scale(now - entry, tsc_khz), unit);
+}
@@ -0,0 +1,131 @@
+/*
+ * Tiny Operating System - Initial RAM Filesystem
+ * GRUB loads the root filesystem as a multiboot2 module next to the
+ * kernel, in one sequential read:
+ *   module2 /boot/initramfs.cpio initramfs
+ * The module is an uncompressed "newc" cpio archive, as
+ *   find . | cpio -o -H newc
+ * writes it. Nothing is copied out of it here: each entry is handed to
+ * the filesystem with its name and data where they lie in the module,
+ * which stays where GRUB put it for as long as the kernel runs.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MULTIBOOT2_MAGIC 0x36D76289     /* EBX is the multiboot2 information */
+#define MB2_TAG_END 0
+#define MB2_TAG_MODULE 3
+
+#define CPIO_MAGIC "07070"              /* Then '1', or '2' when entries carry a checksum */
+#define CPIO_HEADER_LEN 110             /* Magic and thirteen 8-digit hex fields */
+#define CPIO_TRAILER "TRAILER!!!"
+
+/* Entry types, from the mode's high bits */
+#define CPIO_MODE_TYPE 0170000
+#define CPIO_MODE_DIR 0040000
+#define CPIO_MODE_FILE 0100000
+
+/* Kernel runtime library (klib.c) */
+extern int memcmp(const void* a, const void* b, size_t n);
+
+/* Boot state (boot.asm): absent from stages that are not entered through it */
+extern uint32_t boot_magic __attribute__((weak));
+extern uint32_t boot_info __attribute__((weak));
+
+/* Function prototypes */
+int initramfs_module(const uint8_t** start, uint32_t* size);
+int cpio_unpack(const uint8_t* archive, uint32_t size,
+                int (*add)(const char* path, int is_directory, const uint8_t* data, uint32_t size));
+
+/*
+ * Find the first module GRUB loaded; 0 when there is none or the kernel
+ * was not booted through multiboot2.
+ */
+int initramfs_module(const uint8_t** start, uint32_t* size) {
+    if (!&boot_magic || !&boot_info || boot_magic != MULTIBOOT2_MAGIC || !boot_info) {
+        return 0;
+    }
+    const uint8_t* tag = (const uint8_t*)boot_info + 8;
+    const uint8_t* end = (const uint8_t*)boot_info + *(const uint32_t*)boot_info;
+    while (tag + 8 <= end) {
+        const uint32_t* header = (const uint32_t*)tag;
+        if (header[0] == MB2_TAG_END || header[1] < 8) {
+            break;
+        }
+        if (header[0] == MB2_TAG_MODULE && header[1] >= 16 && header[3] >= header[2]) {
+            *start = (const uint8_t*)header[2];
+            *size = header[3] - header[2];
+            return 1;
+        }
+        tag += (header[1] + 7) & ~7u;
+    }
+    return 0;
+}
+
+/* Header field n, 8 hex digits; sets *ok to -1 when one is not a digit */
+static uint32_t cpio_field(const uint8_t* header, uint32_t n, int* ok) {
+    const uint8_t* digits = header + 6 + n * 8;
+    uint32_t value = 0;
+    for (uint32_t i = 0; i < 8; i++) {
+        uint8_t c = digits[i];
+        uint32_t digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                         c >= 'A' && c <= 'F' ? c - 'A' + 10 : 16;
+        if (digit == 16) {
+            *ok = -1;
+        }
+        value = value << 4 | (digit & 0xF);
+    }
+    return value;
+}
+
+/*
+ * Hand add each directory and regular file of the archive, in archive
+ * order (a directory before what it holds, as find lists them), with its
+ * path relative to the root and its data in place. Other entries, and
+ * the root itself, are passed over. Returns how many add took, or -1 at
+ * the first malformed header or refused entry; those before it stay.
+ */
+int cpio_unpack(const uint8_t* archive, uint32_t size,
+                int (*add)(const char* path, int is_directory, const uint8_t* data, uint32_t size)) {
+    uint32_t offset = 0;
+    int added = 0;
+    while (1) {
+        if (offset > size || size - offset < CPIO_HEADER_LEN) {
+            return -1;
+        }
+        const uint8_t* header = archive + offset;
+        int ok = memcmp(header, CPIO_MAGIC, 5) || (header[5] != '1' && header[5] != '2') ? -1 : 0;
+        uint32_t mode = cpio_field(header, 1, &ok);
+        uint32_t file_size = cpio_field(header, 6, &ok);
+        uint32_t name_size = cpio_field(header, 11, &ok);
+        if (ok < 0 || !name_size) {
+            return -1;
+        }
+
+        /* Name and data each start on a 4-byte boundary */
+        const char* name = (const char*)header + CPIO_HEADER_LEN;
+        uint32_t data = (offset + CPIO_HEADER_LEN + name_size + 3) & ~3u;
+        if (data < offset || data > size || name[name_size - 1] || size - data < file_size) {
+            return -1;
+        }
+        if (name_size == sizeof(CPIO_TRAILER) && !memcmp(name, CPIO_TRAILER, sizeof(CPIO_TRAILER))) {
+            return added;
+        }
+        const char* path = name;
+        while (*path == '.' && path[1] == '/') {
+            path += 2;
+        }
+        while (*path == '/') {
+            path++;
+        }
+        uint32_t type = mode & CPIO_MODE_TYPE;
+        if (*path && !(path[0] == '.' && !path[1]) && (type == CPIO_MODE_DIR || type == CPIO_MODE_FILE)) {
+            if (add(path, type == CPIO_MODE_DIR, archive + data, type == CPIO_MODE_FILE ? file_size : 0) < 0) {
+                return -1;
+            }
+            added++;
+        }
+        offset = (data + file_size + 3) & ~3u;
+    }
+}
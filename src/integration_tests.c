@@ -12,6 +12,7 @@
 #define MAX_PROCESSES 32
 #define TEST_DURATION_SECONDS 30
 #define MEMORY_TEST_SIZE (2 * 1024 * 1024) /* 2MB */
+#define TEST_EXPORT_LINE 384             /* A whole description fits */
 
 /* Test scenario types */
 typedef enum {
@@ -56,6 +57,7 @@ typedef struct {
     uint32_t resources_used;
     float performance_score;
     char description[256];
+    void (*run)(void);
 } integration_test_result_t;
 
 /* System load generator */
@@ -89,6 +91,8 @@ static system_health_t system_health;
 static test_monitoring_t test_monitoring;
 static uint8_t* test_memory_area;
 static uint8_t integration_test_running = 0;
+static uint32_t test_shard = 0;         /* This boot runs test_results[i] where i % test_shards == test_shard */
+static uint32_t test_shards = 1;
 
 /* Forward declarations for external functions */
 void error_handler(int code, int severity, const char* message, const char* file, int line, const char* function);
@@ -98,6 +102,13 @@ void enhanced_network_init(void);
 void comprehensive_security_audit(void);
 void enhanced_network_test(void);
 
+/* Kernel command line (cmdline.c) */
+extern int cmdline_shard(uint32_t* index, uint32_t* count);
+
+/* Kernel runtime library (klib.c) */
+extern char* klib_puts(char* out, const char* text, uint32_t width);
+extern char* klib_putu(char* out, uint32_t value, uint32_t width);
+
 /* Utility functions */
 static void* memset(void* s, int c, size_t n) {
     unsigned char* p = s;
@@ -158,7 +169,7 @@ static void update_system_health(void) {
 }
 
 /* Test scenario registration */
-static void register_test_scenario(test_scenario_t scenario, const char* description) {
+static void register_test_scenario(test_scenario_t scenario, const char* description, void (*run)(void)) {
     if (test_scenario_count < MAX_TEST_SCENARIOS) {
         test_results[test_scenario_count].scenario = scenario;
         test_results[test_scenario_count].passed = 0;
@@ -168,6 +179,7 @@ static void register_test_scenario(test_scenario_t scenario, const char* descrip
         test_results[test_scenario_count].errors_encountered = 0;
         test_results[test_scenario_count].resources_used = 0;
         test_results[test_scenario_count].performance_score = 0.0f;
+        test_results[test_scenario_count].run = run;
         
         strncpy(test_results[test_scenario_count].description, description, 255);
         test_results[test_scenario_count].description[255] = '\0';
@@ -659,31 +671,26 @@ static void run_integration_tests(void) {
     test_monitoring.start_time = get_timestamp();
     
     /* Register test scenarios */
-    register_test_scenario(SCENARIO_BOOT_TEST, "System Boot Test");
-    register_test_scenario(SCENARIO_MEMORY_STRESS, "Memory Stress Test");
-    register_test_scenario(SCENARIO_PROCESS_CREATION, "Process Creation Test");
-    register_test_scenario(SCENARIO_SYSTEM_CALLS, "System Call Test");
-    register_test_scenario(SCENARIO_NETWORK_LOAD, "Network Load Test");
-    register_test_scenario(SCENARIO_SECURITY_AUDIT, "Security Audit Test");
-    register_test_scenario(SCENARIO_PERFORMANCE_BENCHMARK, "Performance Benchmark Test");
-    register_test_scenario(SCENARIO_ERROR_RECOVERY, "Error Recovery Test");
-    register_test_scenario(SCENARIO_FULL_SYSTEM_LOAD, "Full System Load Test");
+    register_test_scenario(SCENARIO_BOOT_TEST, "System Boot Test", run_boot_test);
+    register_test_scenario(SCENARIO_MEMORY_STRESS, "Memory Stress Test", run_memory_stress_test);
+    register_test_scenario(SCENARIO_PROCESS_CREATION, "Process Creation Test", run_process_creation_test);
+    register_test_scenario(SCENARIO_SYSTEM_CALLS, "System Call Test", run_system_call_test);
+    register_test_scenario(SCENARIO_NETWORK_LOAD, "Network Load Test", run_network_load_test);
+    register_test_scenario(SCENARIO_SECURITY_AUDIT, "Security Audit Test", run_security_audit_test);
+    register_test_scenario(SCENARIO_PERFORMANCE_BENCHMARK, "Performance Benchmark Test", run_performance_benchmark_test);
+    register_test_scenario(SCENARIO_ERROR_RECOVERY, "Error Recovery Test", run_error_recovery_test);
+    register_test_scenario(SCENARIO_FULL_SYSTEM_LOAD, "Full System Load Test", run_full_system_load_test);
     
     /* Initialize system components */
     performance_tuning_init();
     security_hardening_init();
     enhanced_network_init();
     
-    /* Run all test scenarios */
-    run_boot_test();
-    run_memory_stress_test();
-    run_process_creation_test();
-    run_system_call_test();
-    run_network_load_test();
-    run_security_audit_test();
-    run_performance_benchmark_test();
-    run_error_recovery_test();
-    run_full_system_load_test();
+    /* Run this boot's shard of the scenarios: all of them unless the command line splits them */
+    cmdline_shard(&test_shard, &test_shards);
+    for (uint32_t i = test_shard; i < test_scenario_count; i += test_shards) {
+        test_results[i].run();
+    }
     
     /* Final monitoring */
     test_monitoring.end_time = get_timestamp();
@@ -694,6 +701,43 @@ static void run_integration_tests(void) {
     update_system_health();
 }
 
+/*
+ * The scenarios this boot completed, as JSON lines in the form
+ * comprehensive_tests.c's test_export writes, "errors" in place of "line",
+ * and its closing "done" line. Returns how many lines were emitted.
+ */
+uint32_t integration_test_export(void (*emit)(const void* data, uint32_t size)) {
+    char line[TEST_EXPORT_LINE];
+    uint32_t ran = 0;
+    
+    for (uint32_t i = test_shard; i < test_scenario_count; i += test_shards) {
+        if (!test_results[i].completed) {
+            continue;
+        }
+        char* out = klib_puts(line, "{\"suite\":\"integration\",\"test\":\"", 0);
+        out = klib_puts(out, test_results[i].description, 0);
+        out = klib_puts(out, "\",\"shard\":", 0);
+        out = klib_putu(out, test_shard, 0);
+        out = klib_puts(out, ",\"passed\":", 0);
+        out = klib_putu(out, test_results[i].passed ? 1 : 0, 0);
+        out = klib_puts(out, ",\"errors\":", 0);
+        out = klib_putu(out, test_results[i].errors_encountered, 0);
+        out = klib_puts(out, "}\n", 0);
+        emit(line, (uint32_t)(out - line));
+        ran++;
+    }
+    
+    char* out = klib_puts(line, "{\"suite\":\"integration\",\"shard\":", 0);
+    out = klib_putu(out, test_shard, 0);
+    out = klib_puts(out, ",\"shards\":", 0);
+    out = klib_putu(out, test_shards, 0);
+    out = klib_puts(out, ",\"done\":", 0);
+    out = klib_putu(out, ran, 0);
+    out = klib_puts(out, "}\n", 0);
+    emit(line, (uint32_t)(out - line));
+    return ran + 1;
+}
+
 /* Integration test main function */
 void integration_test_main(void) {
     /* Initialize test memory area */
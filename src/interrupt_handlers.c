@@ -30,6 +30,103 @@ enum vga_color {
     VGA_COLOR_LIGHT_YELLOW = 14,
 };
 
+/* Deferred interrupt work */
+#define MAX_CPUS 1
+#define NR_SOFTIRQS 8
+#define SOFTIRQ_MAX_RESTART 10   /* Rounds per exit before leaving work to the idle loop */
+#define IRQ_LINES 16
+#define MSI_VECTOR_BASE 48       /* Vectors past the PIC's, for message-signalled interrupts (must match isr.asm) */
+#define MSI_VECTORS 32
+#define IRQ_STAT_LINES (IRQ_LINES + MSI_VECTORS)   /* A line is its vector less 32 */
+#define IRQ_LATENCY_BUCKETS 32   /* Bucket n counts latencies of 2^n to 2^(n+1)-1 cycles */
+#define BACKTRACE_DEPTH 8        /* Frames an exception report names */
+
+enum softirq_nr {
+    SOFTIRQ_TIMER = 0,
+    SOFTIRQ_NET_RX = 1,
+    SOFTIRQ_NET_TX = 2,
+    SOFTIRQ_BLOCK = 3,
+    SOFTIRQ_TASKLET = 4,
+    SOFTIRQ_NET_BACKLOG = 5  /* Software-queued receives, such as lo */
+};
+
+/* Registers saved by isr_common_stub and irq_common_stub, below the CPU's own frame */
+struct interrupt_frame {
+    uint32_t ds;
+    uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax;
+    uint32_t int_no, err_code;
+    uint32_t eip, cs, eflags;
+};
+
+/* Top halves registered per IRQ line, and bottom halves per softirq */
+static void (*irq_handlers[IRQ_LINES])(void);
+static void (*msi_handlers[MSI_VECTORS])(void* data);
+static void* msi_data[MSI_VECTORS];
+static uint32_t msi_allocated;           /* Bit n: vector MSI_VECTOR_BASE + n is taken */
+static int irq_lines_via_ioapic;         /* IRQ lines arrive through the I/O APIC, not the 8259 */
+static void (*softirq_actions[NR_SOFTIRQS])(void);
+static int (*nmi_handler)(uint32_t eip, uint32_t cs, uint32_t ebp);
+static volatile uint32_t softirq_pending[MAX_CPUS];
+static uint32_t softirq_running[MAX_CPUS];
+
+/* Per-line interrupt counts and entry-to-EOI latency histograms, in TSC cycles */
+struct irq_stat {
+    uint32_t count;
+    uint32_t max_cycles;
+    uint32_t latency[IRQ_LATENCY_BUCKETS];
+};
+
+static struct irq_stat irq_stats[IRQ_STAT_LINES];
+extern volatile uint64_t irq_entry_tsc;   /* Set by the isr.asm IRQ stubs */
+extern uint32_t msi_stub_table[MSI_VECTORS];
+
+/*
+ * The stage's IDT and local APIC. Weak: a stage with no IDT cannot hand
+ * out vectors, and drivers there stay on their INTx line.
+ */
+extern void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags) __attribute__((weak));
+extern void lapic_eoi(void) __attribute__((weak));
+
+/* Per-CPU counters (percpu.c) */
+#define PCPU_INTERRUPTS 1
+extern void this_cpu_inc(uint32_t counter);
+
+/* Tracepoints (trace.c) (must match the event numbers there) */
+#define TRACE_IRQ_ENTRY 4
+extern void trace_record(uint32_t event, uint32_t arg0, uint32_t arg1, uint32_t arg2);
+
+/* A NOP until trace_start patches in a jump to the call; -DNO_TRACEPOINTS leaves no site */
+#ifdef NO_TRACEPOINTS
+#define TRACEPOINT(event, arg0, arg1, arg2) do { (void)(arg0); (void)(arg1); (void)(arg2); } while (0)
+#else
+static inline __attribute__((always_inline)) int tracepoint_on(uint32_t event) {
+    __asm__ goto("1: .byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n\t"
+                 ".pushsection __tracepoints, \"aw\"\n\t"
+                 ".long 1b, %l[on], %c0\n\t"
+                 ".popsection" : : "i"(event) : : on);
+    return 0;
+on:
+    return 1;
+}
+
+#define TRACEPOINT(event, arg0, arg1, arg2) do {                     \
+    if (__builtin_expect(tracepoint_on(event), 0)) {                 \
+        trace_record(event, arg0, arg1, arg2);                       \
+    }                                                                \
+} while (0)
+#endif
+
+/* Kernel log ring (printk.c); an interrupt must not wait on the screen */
+#define PRINTK_WARNING 4
+extern int printk_value(uint32_t level, const char* text, uint32_t value);
+
+/* Stack unwinder and kernel symbols (unwind.c) */
+extern uint32_t unwind_stack(uint32_t ebp, uint32_t* frames, uint32_t max);
+extern uint32_t ksym_format(char* out, uint32_t size, uint32_t addr);
+
+/* Crash dump (crashdump.c) */
+extern void crashdump_write(const char* reason, uint32_t eip, uint32_t ebp);
+
 /* Exception messages */
 static const char* exception_messages[] = {
     "Division by zero",
@@ -123,13 +220,53 @@ static inline uint8_t inb(uint16_t port) {
     return ret;
 }
 
+/* Save EFLAGS and disable interrupts */
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+/* Restore the interrupt flag saved by irq_save */
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+/* Interrupt statistics functions */
+void irq_stats_reset(void);
+uint32_t irq_get_stats(uint32_t line, uint32_t* max_cycles);
+void irq_get_latency_histogram(uint32_t line, uint32_t* buckets);
+
+/* Deferred work functions */
+void softirq_init(void);
+void irq_install_handler(uint32_t irq, void (*handler)(void));
+void nmi_install_handler(int (*handler)(uint32_t eip, uint32_t cs, uint32_t ebp));
+void open_softirq(uint32_t nr, void (*action)(void));
+void raise_softirq(uint32_t nr);
+void do_softirq(void);
+uint32_t softirq_pending_mask(void);
+
 /* External interrupt handlers */
 extern void keyboard_handler(void);
 extern void timer_handler(void);
 extern void syscall_handler_c(uint32_t syscall_num, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5);
 
 /* ISR handler function */
-void isr_handler(uint32_t interrupt_number, uint32_t error_code) {
+void isr_handler(struct interrupt_frame* frame) {
+    uint32_t interrupt_number = frame->int_no;
+    uint32_t error_code = frame->err_code;
+    
+    /* A performance counter overflow arrives as an NMI and resumes where it struck */
+    if (interrupt_number == 2 && nmi_handler && nmi_handler(frame->eip, frame->cs, frame->ebp)) {
+        return;
+    }
+    
     terminal_setcolor(VGA_COLOR_LIGHT_RED);
     terminal_writestring("EXCEPTION: ");
     
@@ -148,7 +285,32 @@ void isr_handler(uint32_t interrupt_number, uint32_t error_code) {
         terminal_writehex(error_code);
     }
     
-    terminal_writestring("\nSystem halted.\n");
+    terminal_writestring("\n");
+    
+    /* Where it struck, then who called, while the frames are still there */
+    char symbol[64];
+    uint32_t frames[BACKTRACE_DEPTH];
+    ksym_format(symbol, sizeof(symbol), frame->eip);
+    terminal_writestring("  at ");
+    terminal_writestring(symbol);
+    terminal_writestring("\n");
+    if (!(frame->cs & 3)) {
+        uint32_t depth = unwind_stack(frame->ebp, frames, BACKTRACE_DEPTH);
+        for (uint32_t i = 0; i < depth; i++) {
+            ksym_format(symbol, sizeof(symbol), frames[i]);
+            terminal_writestring("  from ");
+            terminal_writestring(symbol);
+            terminal_writestring("\n");
+        }
+    }
+    
+    /* Everything else for offline analysis */
+    terminal_writestring("Writing crash dump to COM1...\n");
+    crashdump_write(interrupt_number < sizeof(exception_messages) / sizeof(exception_messages[0]) ?
+                    exception_messages[interrupt_number] : "Unknown exception",
+                    frame->eip, frame->cs & 3 ? 0 : frame->ebp);
+    
+    terminal_writestring("System halted.\n");
     
     /* Halt the system */
     while (1) {
@@ -156,30 +318,220 @@ void isr_handler(uint32_t interrupt_number, uint32_t error_code) {
     }
 }
 
-/* IRQ handler function */
-void irq_handler(uint32_t irq_number) {
-    /* Handle specific IRQs */
-    switch (irq_number) {
-        case 32:  /* Timer (IRQ 0) */
-            timer_handler();
-            break;
-        case 33:  /* Keyboard (IRQ 1) */
-            keyboard_handler();
-            break;
-        default:
-            /* Unhandled IRQ */
-            terminal_setcolor(VGA_COLOR_LIGHT_YELLOW);
-            terminal_writestring("Unhandled IRQ: ");
-            terminal_writehex(irq_number);
-            terminal_writestring("\n");
-            break;
+/* Forget every top half, bottom half and pending softirq */
+void softirq_init(void) {
+    for (int i = 0; i < IRQ_LINES; i++) {
+        irq_handlers[i] = NULL;
+    }
+    for (int i = 0; i < NR_SOFTIRQS; i++) {
+        softirq_actions[i] = NULL;
+    }
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        softirq_pending[cpu] = 0;
+        softirq_running[cpu] = 0;
+    }
+}
+
+/*
+ * A vector of its own for handler, called with data: one per MSI or
+ * MSI-X message, so a multi-queue device gets a top half per queue that
+ * shares with nothing. The gate goes into the IDT here. Returns the
+ * vector, or 0 when they are all taken or the stage has no IDT or LAPIC
+ * to deliver through.
+ */
+uint32_t irq_alloc_vector(void (*handler)(void* data), void* data) {
+    if (!idt_set_gate || !lapic_eoi || !handler) {
+        return 0;
+    }
+    uint32_t flags = irq_save();
+    uint32_t free = ~msi_allocated;
+    if (!free) {
+        irq_restore(flags);
+        return 0;
+    }
+    uint32_t index = __builtin_ctz(free);
+    msi_allocated |= 1u << index;
+    msi_handlers[index] = handler;
+    msi_data[index] = data;
+    irq_restore(flags);
+    idt_set_gate(MSI_VECTOR_BASE + index, msi_stub_table[index], 0x08, 0x8E);
+    return MSI_VECTOR_BASE + index;
+}
+
+/* Give a vector back; the device must have stopped signalling it */
+void irq_free_vector(uint32_t vector) {
+    uint32_t index = vector - MSI_VECTOR_BASE;
+    if (index >= MSI_VECTORS) {
+        return;
+    }
+    uint32_t flags = irq_save();
+    msi_allocated &= ~(1u << index);
+    msi_handlers[index] = NULL;
+    msi_data[index] = NULL;
+    irq_restore(flags);
+    idt_set_gate(vector, 0, 0, 0);
+}
+
+/*
+ * The stage has parked the 8259 and routed its IRQ lines through the
+ * I/O APIC, so they are acknowledged at the local APIC from now on.
+ */
+void irq_use_ioapic(void) {
+    if (lapic_eoi) {
+        irq_lines_via_ioapic = 1;
+    }
+}
+
+/* Route an IRQ line to a driver's top half */
+void irq_install_handler(uint32_t irq, void (*handler)(void)) {
+    if (irq < IRQ_LINES) {
+        irq_handlers[irq] = handler;
+    }
+}
+
+/*
+ * Offer NMIs to handler before they are treated as fatal, with the
+ * interrupted EIP, CS and frame pointer; it returns nonzero for one it
+ * raised itself. NULL removes it.
+ */
+void nmi_install_handler(int (*handler)(uint32_t eip, uint32_t cs, uint32_t ebp)) {
+    nmi_handler = handler;
+}
+
+/* Register the bottom half run for softirq nr */
+void open_softirq(uint32_t nr, void (*action)(void)) {
+    if (nr < NR_SOFTIRQS) {
+        softirq_actions[nr] = action;
     }
+}
+
+/* Mark a bottom half pending on this CPU; safe from top halves and task context */
+void raise_softirq(uint32_t nr) {
+    if (nr < NR_SOFTIRQS) {
+        uint32_t flags = irq_save();
+        softirq_pending[0] |= 1u << nr;
+        irq_restore(flags);
+    }
+}
+
+uint32_t softirq_pending_mask(void) {
+    return softirq_pending[0];
+}
+
+/* Run pending bottom halves with interrupts enabled; never nests on one CPU */
+void do_softirq(void) {
+    uint32_t flags = irq_save();
+    if (softirq_running[0]) {
+        irq_restore(flags);
+        return;
+    }
+    softirq_running[0] = 1;
     
-    /* Send EOI to PIC */
-    if (irq_number >= 40) {
-        /* Send EOI to slave PIC */
-        outb(0xA0, 0x20);
+    /* Bound the work per call so a flood cannot starve the interrupted task */
+    for (int round = 0; round < SOFTIRQ_MAX_RESTART && softirq_pending[0]; round++) {
+        uint32_t pending = softirq_pending[0];
+        softirq_pending[0] = 0;
+        
+        __asm__ __volatile__("sti" : : : "memory");
+        for (uint32_t nr = 0; pending; nr++, pending >>= 1) {
+            if ((pending & 1) && softirq_actions[nr]) {
+                softirq_actions[nr]();
+            }
+        }
+        __asm__ __volatile__("cli" : : : "memory");
     }
-    /* Send EOI to master PIC */
-    outb(0x20, 0x20);
+    
+    softirq_running[0] = 0;
+    irq_restore(flags);
+}
+
+void irq_stats_reset(void) {
+    for (int line = 0; line < IRQ_STAT_LINES; line++) {
+        irq_stats[line].count = 0;
+        irq_stats[line].max_cycles = 0;
+        for (int i = 0; i < IRQ_LATENCY_BUCKETS; i++) {
+            irq_stats[line].latency[i] = 0;
+        }
+    }
+}
+
+/* Interrupts taken on a line, or an MSI vector less 32, and the worst entry-to-EOI latency seen */
+uint32_t irq_get_stats(uint32_t line, uint32_t* max_cycles) {
+    if (line >= IRQ_STAT_LINES) {
+        *max_cycles = 0;
+        return 0;
+    }
+    *max_cycles = irq_stats[line].max_cycles;
+    return irq_stats[line].count;
+}
+
+/* Copy a line's IRQ_LATENCY_BUCKETS log2 latency buckets */
+void irq_get_latency_histogram(uint32_t line, uint32_t* buckets) {
+    for (int i = 0; i < IRQ_LATENCY_BUCKETS; i++) {
+        buckets[i] = line < IRQ_STAT_LINES ? irq_stats[line].latency[i] : 0;
+    }
+}
+
+/* File one interrupt's latency under the bucket of its highest set bit */
+static void irq_account(uint32_t line) {
+    uint64_t elapsed = rdtsc() - irq_entry_tsc;
+    uint32_t cycles = elapsed > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)elapsed;
+    uint32_t bucket = cycles ? 31 - __builtin_clz(cycles) : 0;
+    
+    struct irq_stat* stat = &irq_stats[line];
+    stat->count++;
+    stat->latency[bucket]++;
+    if (cycles > stat->max_cycles) {
+        stat->max_cycles = cycles;
+    }
+}
+
+/* IRQ handler function; the top half runs with interrupts off */
+void irq_handler(struct interrupt_frame* frame) {
+    uint32_t irq_number = frame->int_no;
+    uint32_t line = irq_number - 32;
+    this_cpu_inc(PCPU_INTERRUPTS);
+    TRACEPOINT(TRACE_IRQ_ENTRY, line, 0, 0);
+    
+    /* A message goes to the local APIC, never the PIC, so that is where it is acknowledged */
+    uint32_t msi = irq_number - MSI_VECTOR_BASE;
+    if (msi < MSI_VECTORS) {
+        if (msi_handlers[msi]) {
+            msi_handlers[msi](msi_data[msi]);
+        }
+        lapic_eoi();
+        irq_account(line);
+        do_softirq();
+        return;
+    }
+    
+    /* Drivers that registered a top half take precedence */
+    if (line < IRQ_LINES && irq_handlers[line]) {
+        irq_handlers[line]();
+    } else if (irq_number == 32) {  /* Timer (IRQ 0) */
+        timer_handler();
+    } else if (irq_number == 33) {  /* Keyboard (IRQ 1) */
+        keyboard_handler();
+    } else {
+        /* Unhandled IRQ */
+        printk_value(PRINTK_WARNING, "Unhandled IRQ: ", irq_number);
+    }
+    
+    if (irq_lines_via_ioapic) {
+        lapic_eoi();
+    } else {
+        /* Send EOI to PIC */
+        if (irq_number >= 40) {
+            /* Send EOI to slave PIC */
+            outb(0xA0, 0x20);
+        }
+        /* Send EOI to master PIC */
+        outb(0x20, 0x20);
+    }
+    if (line < IRQ_LINES) {
+        irq_account(line);
+    }
+    
+    /* Bottom halves run after EOI so further interrupts are not held off */
+    do_softirq();
 }
\ No newline at end of file
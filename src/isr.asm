@@ -2,9 +2,30 @@
 ; Tiny Operating System - Interrupt Service Routines
 ; Assembly handlers for interrupts and exceptions
 ;
+; The stubs leave %gs alone: it is the interrupted thread's TLS segment,
+; which kernel code never uses, and user code finds it intact on return.
+;
 
 [bits 32]
 
+; TSC at IRQ entry, read back by irq_handler after EOI; top halves never nest
+global irq_entry_tsc
+section .data
+align 8
+irq_entry_tsc: dq 0
+section .text
+
+; Record the entry time without disturbing any register
+%macro IRQ_TIMESTAMP 0
+    push eax
+    push edx
+    rdtsc
+    mov [irq_entry_tsc], eax
+    mov [irq_entry_tsc + 4], edx
+    pop edx
+    pop eax
+%endmacro
+
 ; Common ISR stub
 %macro ISR_NOERRCODE 1
 global isr%1
@@ -28,6 +49,7 @@ isr%1:
 global irq%1
 irq%1:
     cli
+    IRQ_TIMESTAMP
     push 0      ; Push dummy error code
     push %2     ; Push interrupt number
     jmp irq_common_stub
@@ -85,6 +107,32 @@ IRQ 13, 45    ; FPU / coprocessor / Inter-processor
 IRQ 14, 46    ; Primary ATA hard disk
 IRQ 15, 47    ; Secondary ATA hard disk
 
+; Message-signalled interrupts: vectors 48-79, handed out by irq_alloc_vector
+; (MSI_VECTOR_BASE and MSI_VECTORS must match interrupt_handlers.c)
+%assign vector 48
+%rep 32
+IRQ msi%[vector], vector
+%assign vector vector + 1
+%endrep
+
+; The MSI stubs in vector order, for irq_alloc_vector to install
+global msi_stub_table
+section .data
+align 4
+msi_stub_table:
+%assign vector 48
+%rep 32
+    dd irqmsi%[vector]
+%assign vector vector + 1
+%endrep
+section .text
+
+; Local APIC spurious interrupts (vector 0xFF, LAPIC_SPURIOUS_VECTOR in apic.c)
+; take no EOI and need no handler
+global lapic_spurious
+lapic_spurious:
+    iret
+
 ; External C functions
 extern isr_handler
 extern irq_handler
@@ -99,7 +147,6 @@ isr_common_stub:
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
     
     ; Call C handler
     push esp
@@ -111,7 +158,6 @@ isr_common_stub:
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
     popa
     
     ; Clean up error code and interrupt number
@@ -130,7 +176,6 @@ irq_common_stub:
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
     
     ; Call C handler
     push esp
@@ -142,7 +187,6 @@ irq_common_stub:
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
     popa
     
     ; Clean up error code and interrupt number
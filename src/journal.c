@@ -0,0 +1,394 @@
+/*
+ * Tiny Operating System - Metadata Journal
+ * Write-ahead journal over the buffer cache with group commit and replay
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SECTOR_SIZE 512
+#define JOURNAL_BLOCK_SIZE 1024         /* The buffer cache's block */
+#define JOURNAL_SECTORS_PER_BLOCK (JOURNAL_BLOCK_SIZE / SECTOR_SIZE)
+
+#define JOURNAL_MAGIC 0x4A524E4C        /* "JRNL": the journal superblock */
+#define JOURNAL_DESC_MAGIC 0x4A444553
+#define JOURNAL_COMMIT_MAGIC 0x4A434D54
+
+/*
+ * Group commit: handles join the running transaction, which commits when
+ * it holds JOURNAL_COMMIT_BLOCKS blocks, when the timer fires, or when
+ * the buffer cache is about to write back. Either way every operation
+ * since the last commit shares one pair of device writes.
+ */
+#define JOURNAL_MAX_BLOCKS 32           /* Largest transaction */
+#define JOURNAL_COMMIT_BLOCKS 24
+#define JOURNAL_COMMIT_INTERVAL 100     /* Ticks: 1 s */
+
+/*
+ * Layout inside the journal area: a superblock naming the sequence
+ * number replay starts from, then transactions from block 1 on. Each is
+ * a descriptor listing the home block of every block that follows, the
+ * blocks' new contents, and a commit block whose CRC32C covers all of them.
+ */
+struct journal_superblock {
+    uint32_t magic;
+    uint32_t blocks;                    /* Journal area, superblock included */
+    uint32_t sequence;                  /* First transaction to replay */
+};
+
+struct journal_descriptor {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t count;
+    uint32_t home[JOURNAL_MAX_BLOCKS];
+};
+
+struct journal_commit {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t count;
+    uint32_t crc;
+};
+
+/* Timer wheel entry (must match struct timer in timer_wheel.c) */
+struct timer {
+    struct timer* next;
+    struct timer** pprev;
+    uint32_t expires;
+    void (*callback)(void* data);
+    void* data;
+};
+
+struct buffer;
+
+/* The running transaction: buffers changed since the last commit */
+struct transaction {
+    uint32_t sequence;
+    uint32_t updates;                   /* Handles still open */
+    uint32_t count;
+    struct buffer* buffers[JOURNAL_MAX_BLOCKS];
+};
+
+/* One operation's part of the running transaction */
+struct journal_handle {
+    uint32_t blocks;                    /* Reserved with journal_start, not yet used */
+    uint8_t open;
+};
+
+static int journal_device = -1;
+static uint32_t journal_start_block;
+static uint32_t journal_blocks;
+static uint32_t journal_head;           /* Next free block after the superblock */
+static uint32_t journal_sequence;       /* First sequence in the journal */
+static struct transaction journal_running;
+static uint8_t journal_committing;
+static struct timer journal_timer;
+static struct journal_handle journal_handles[8];
+
+/* Descriptor, blocks and commit block of one transaction, written in two requests */
+static uint8_t journal_staging[JOURNAL_MAX_BLOCKS + 2][JOURNAL_BLOCK_SIZE];
+
+/* Statistics */
+static uint32_t journal_commits;
+static uint32_t journal_updates;        /* Handles that joined a commit */
+static uint32_t journal_logged;         /* Blocks written to the journal */
+static uint32_t journal_replayed;       /* Transactions replayed at mount */
+
+/* Tick counter of the kernel this is linked into */
+extern uint32_t timer_ticks;
+
+/* Block layer (block.c) */
+extern int blk_read(uint32_t device, uint32_t sector, uint32_t count, void* buffer);
+extern int blk_write(uint32_t device, uint32_t sector, uint32_t count, const void* buffer);
+extern uint32_t blk_sectors(uint32_t device);
+extern int blk_mappable(uint32_t device);
+
+/* Buffer cache (buffer_cache.c) */
+extern void bmark_dirty(struct buffer* buf);
+extern void* bdata(struct buffer* buf);
+extern uint32_t bblock(struct buffer* buf);
+extern void bjournal_pin(struct buffer* buf);
+extern void bjournal_unpin(struct buffer* buf);
+extern int bsync(void);
+extern void bcache_set_writeback_hook(void (*hook)(void));
+
+/* CRC32C (crc32c.c) */
+extern uint32_t crc32c(uint32_t crc, const void* data, uint32_t size);
+
+/* Timer wheel functions (timer_wheel.c) */
+extern void timer_setup(struct timer* timer, void (*callback)(void* data), void* data);
+extern void timer_add(struct timer* timer, uint32_t expires);
+extern void timer_cancel(struct timer* timer);
+
+/* Function prototypes */
+int journal_init(uint32_t device, uint32_t start, uint32_t blocks);
+struct journal_handle* journal_start(uint32_t blocks);
+int journal_dirty(struct journal_handle* handle, struct buffer* buf);
+void journal_stop(struct journal_handle* handle);
+int journal_commit(void);
+void journal_get_statistics(uint32_t* commits, uint32_t* updates, uint32_t* logged, uint32_t* replayed);
+
+/* Kernel runtime library (klib.c) */
+extern void* memcpy(void* dest, const void* src, size_t n);
+extern void* memset(void* s, int c, size_t n);
+
+static void copy_bytes(void* dest, const void* src, uint32_t size) {
+    memcpy(dest, src, size);
+}
+
+static void zero_bytes(void* dest, uint32_t size) {
+    memset(dest, 0, size);
+}
+
+static int journal_io(uint32_t block, uint32_t count, void* buffer, int write) {
+    uint32_t sector = (journal_start_block + block) * JOURNAL_SECTORS_PER_BLOCK;
+    uint32_t sectors = count * JOURNAL_SECTORS_PER_BLOCK;
+    return write ? blk_write((uint32_t)journal_device, sector, sectors, buffer) :
+                   blk_read((uint32_t)journal_device, sector, sectors, buffer);
+}
+
+/* Record where replay starts; everything before it is home already */
+static int journal_write_super(void) {
+    struct journal_superblock* sb = (struct journal_superblock*)journal_staging[0];
+    zero_bytes(sb, JOURNAL_BLOCK_SIZE);
+    sb->magic = JOURNAL_MAGIC;
+    sb->blocks = journal_blocks;
+    sb->sequence = journal_sequence;
+    return journal_io(0, 1, sb, 1);
+}
+
+/*
+ * Make room by writing every committed block home, after which the
+ * journal starts over. Blocks of the transaction being committed stay
+ * pinned, so none of them goes home ahead of its commit.
+ */
+static int journal_checkpoint(void) {
+    if (bsync() != 0) {
+        return -1;
+    }
+    journal_sequence = journal_running.sequence;
+    journal_head = 1;
+    return journal_write_super();
+}
+
+/*
+ * Commit the running transaction: descriptor and block copies in one
+ * sequential write, then the commit block. Only once that is on the
+ * device are the buffers unpinned for ordinary write-back. Commits are
+ * skipped while handles are open, and retried at the next trigger.
+ */
+int journal_commit(void) {
+    struct transaction* t = &journal_running;
+    if (journal_device < 0 || journal_committing || t->updates || !t->count) {
+        return 0;
+    }
+    journal_committing = 1;
+    int status = 0;
+    if (journal_head + t->count + 2 > journal_blocks) {
+        status = journal_checkpoint();
+    }
+
+    struct journal_descriptor* desc = (struct journal_descriptor*)journal_staging[0];
+    zero_bytes(desc, JOURNAL_BLOCK_SIZE);
+    desc->magic = JOURNAL_DESC_MAGIC;
+    desc->sequence = t->sequence;
+    desc->count = t->count;
+    for (uint32_t i = 0; i < t->count; i++) {
+        desc->home[i] = bblock(t->buffers[i]);
+        copy_bytes(journal_staging[i + 1], bdata(t->buffers[i]), JOURNAL_BLOCK_SIZE);
+    }
+    struct journal_commit* commit = (struct journal_commit*)journal_staging[t->count + 1];
+    zero_bytes(commit, JOURNAL_BLOCK_SIZE);
+    commit->magic = JOURNAL_COMMIT_MAGIC;
+    commit->sequence = t->sequence;
+    commit->count = t->count;
+    commit->crc = crc32c(0, journal_staging[0], (t->count + 1) * JOURNAL_BLOCK_SIZE);
+
+    /* The commit block must not reach the device before what it vouches for */
+    if (status == 0) {
+        status = journal_io(journal_head, t->count + 1, journal_staging[0], 1);
+    }
+    if (status == 0) {
+        status = journal_io(journal_head + t->count + 1, 1, commit, 1);
+    }
+    if (status == 0) {
+        journal_head += t->count + 2;
+        journal_logged += t->count;
+        journal_commits++;
+        for (uint32_t i = 0; i < t->count; i++) {
+            bjournal_unpin(t->buffers[i]);
+        }
+        t->count = 0;
+        t->sequence++;
+    }
+    journal_committing = 0;
+    return status;
+}
+
+/* Periodic commit, from the timer wheel */
+static void journal_tick(void* data) {
+    (void)data;
+    journal_commit();
+    timer_add(&journal_timer, timer_ticks + JOURNAL_COMMIT_INTERVAL);
+}
+
+/* The buffer cache is about to write back: commit so pinned buffers can go too */
+static void journal_writeback_hook(void) {
+    journal_commit();
+}
+
+/*
+ * Replay every complete transaction after the superblock's sequence: a
+ * descriptor, its blocks and a commit block whose CRC matches. The first
+ * gap or mismatch is where the log ends; a torn last commit is dropped.
+ */
+static int journal_recover(void) {
+    uint32_t head = 1;
+    uint32_t sequence = journal_sequence;
+    for (;;) {
+        struct journal_descriptor* desc = (struct journal_descriptor*)journal_staging[0];
+        if (head + 2 > journal_blocks || journal_io(head, 1, desc, 0) != 0 ||
+            desc->magic != JOURNAL_DESC_MAGIC || desc->sequence != sequence ||
+            !desc->count || desc->count > JOURNAL_MAX_BLOCKS || head + desc->count + 2 > journal_blocks) {
+            break;
+        }
+        uint32_t count = desc->count;
+        struct journal_commit* commit = (struct journal_commit*)journal_staging[count + 1];
+        if (journal_io(head + 1, count + 1, journal_staging[1], 0) != 0 ||
+            commit->magic != JOURNAL_COMMIT_MAGIC || commit->sequence != sequence || commit->count != count ||
+            crc32c(0, journal_staging[0], (count + 1) * JOURNAL_BLOCK_SIZE) != commit->crc) {
+            break;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            if (blk_write((uint32_t)journal_device, desc->home[i] * JOURNAL_SECTORS_PER_BLOCK,
+                          JOURNAL_SECTORS_PER_BLOCK, journal_staging[i + 1]) != 0) {
+                return -1;
+            }
+        }
+        journal_replayed++;
+        head += count + 2;
+        sequence++;
+    }
+
+    /* Everything replayed is home: start the journal over after it */
+    journal_sequence = sequence;
+    journal_head = 1;
+    journal_running.sequence = sequence;
+    return journal_write_super();
+}
+
+/*
+ * Put a journal on blocks [start, start + blocks) of device, replaying it
+ * if it holds one and formatting it otherwise. Must follow bcache_init.
+ * A mapped device is refused: its cached blocks are the device's own
+ * storage, so nothing could be held back until commit.
+ */
+int journal_init(uint32_t device, uint32_t start, uint32_t blocks) {
+    if (blocks < JOURNAL_MAX_BLOCKS + 3 || blk_mappable(device) ||
+        (start + blocks) * JOURNAL_SECTORS_PER_BLOCK > blk_sectors(device)) {
+        return -1;
+    }
+    timer_cancel(&journal_timer);
+    journal_device = (int)device;
+    journal_start_block = start;
+    journal_blocks = blocks;
+    journal_running.updates = 0;
+    journal_running.count = 0;
+    journal_committing = 0;
+    journal_commits = 0;
+    journal_updates = 0;
+    journal_logged = 0;
+    journal_replayed = 0;
+    for (uint32_t i = 0; i < sizeof(journal_handles) / sizeof(journal_handles[0]); i++) {
+        journal_handles[i].open = 0;
+    }
+
+    struct journal_superblock* sb = (struct journal_superblock*)journal_staging[0];
+    int status;
+    if (journal_io(0, 1, sb, 0) == 0 && sb->magic == JOURNAL_MAGIC && sb->blocks == blocks) {
+        journal_sequence = sb->sequence;
+        status = journal_recover();
+    } else {
+        journal_sequence = 1;
+        journal_head = 1;
+        journal_running.sequence = 1;
+        status = journal_write_super();
+    }
+    if (status != 0) {
+        journal_device = -1;
+        return -1;
+    }
+
+    bcache_set_writeback_hook(journal_writeback_hook);
+    timer_setup(&journal_timer, journal_tick, NULL);
+    timer_add(&journal_timer, timer_ticks + JOURNAL_COMMIT_INTERVAL);
+    return 0;
+}
+
+/*
+ * Open a handle for an operation that will change up to blocks buffers.
+ * If the running transaction cannot take them it is committed first.
+ * NULL when blocks is too large or too many handles are open.
+ */
+struct journal_handle* journal_start(uint32_t blocks) {
+    struct transaction* t = &journal_running;
+    if (journal_device < 0 || !blocks || blocks > JOURNAL_MAX_BLOCKS) {
+        return NULL;
+    }
+    if (t->count + blocks > JOURNAL_MAX_BLOCKS) {
+        journal_commit();
+        if (t->count + blocks > JOURNAL_MAX_BLOCKS) {
+            return NULL;                /* Open handles keep the transaction from committing */
+        }
+    }
+    for (uint32_t i = 0; i < sizeof(journal_handles) / sizeof(journal_handles[0]); i++) {
+        if (!journal_handles[i].open) {
+            journal_handles[i].open = 1;
+            journal_handles[i].blocks = blocks;
+            t->updates++;
+            return &journal_handles[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Add a buffer the caller has changed, or is about to, to the running
+ * transaction. It is pinned in the cache until the transaction commits;
+ * a buffer already in the transaction costs nothing more.
+ */
+int journal_dirty(struct journal_handle* handle, struct buffer* buf) {
+    struct transaction* t = &journal_running;
+    for (uint32_t i = 0; i < t->count; i++) {
+        if (t->buffers[i] == buf) {
+            bmark_dirty(buf);
+            return 0;
+        }
+    }
+    if (!handle->blocks || t->count == JOURNAL_MAX_BLOCKS) {
+        return -1;
+    }
+    handle->blocks--;
+    t->buffers[t->count++] = buf;
+    bjournal_pin(buf);
+    bmark_dirty(buf);
+    return 0;
+}
+
+/* Close a handle; a transaction grown past JOURNAL_COMMIT_BLOCKS commits now */
+void journal_stop(struct journal_handle* handle) {
+    struct transaction* t = &journal_running;
+    handle->open = 0;
+    t->updates--;
+    journal_updates++;
+    if (t->count >= JOURNAL_COMMIT_BLOCKS) {
+        journal_commit();
+    }
+}
+
+void journal_get_statistics(uint32_t* commits, uint32_t* updates, uint32_t* logged, uint32_t* replayed) {
+    if (commits) *commits = journal_commits;
+    if (updates) *updates = journal_updates;
+    if (logged) *logged = journal_logged;
+    if (replayed) *replayed = journal_replayed;
+}
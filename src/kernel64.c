@@ -0,0 +1,520 @@
+/*
+ * Tiny Operating System - x86-64 Long-Mode Kernel
+ * The 64-bit build: boot64.asm leaves 4-level paging with a direct map of
+ * the first 4 GiB and the kernel in the top 2 GiB; this stage adds a ring
+ * 3 address space, SYSCALL/SYSRET, 64-bit context switching, and PCID
+ * tags so a switch between address spaces keeps their TLB entries
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Layout (must match boot64.asm and linker.ld) */
+#define KERNEL_VMA 0xFFFFFFFF80000000ull
+#define DIRECT_MAP 0xFFFF800000000000ull    /* Physical address 0 */
+#define DIRECT_MAP_SIZE 0x100000000ull      /* 4 GiB of 2 MB pages */
+#define PHYS_TO_VIRT(phys) ((void*)(DIRECT_MAP + (uint64_t)(phys)))
+#define KERNEL_TO_PHYS(addr) ((uint64_t)(addr) - KERNEL_VMA)
+
+/* Page table entries */
+#define PAGE_SIZE 4096
+#define PAGE_PRESENT 0x001
+#define PAGE_WRITE 0x002
+#define PAGE_USER 0x004
+#define PAGE_HUGE 0x080
+#define PAGE_ADDR_MASK 0x000FFFFFFFFFF000ull
+
+/* Segment selectors (must match boot64.asm's GDT) */
+#define KERNEL_CS 0x08
+#define USER_BASE_SELECTOR 0x10             /* SYSRET: SS = this + 8, CS = this + 16 */
+
+/* MSRs */
+#define MSR_EFER 0xC0000080
+#define MSR_STAR 0xC0000081
+#define MSR_LSTAR 0xC0000082
+#define MSR_SFMASK 0xC0000084
+#define EFER_SCE 0x001
+#define EFER_LMA 0x400
+#define RFLAGS_TF 0x100
+#define RFLAGS_IF 0x200
+#define RFLAGS_DF 0x400
+#define CR4_PGE 0x080
+#define CR4_PCIDE 0x20000
+#define CPUID_FEAT_ECX_PCID (1 << 17)
+
+/* CR3 with PCIDE: the low 12 bits tag the address space's TLB entries */
+#define CR3_PCID_MASK 0xFFFull
+#define CR3_NOFLUSH (1ull << 63)                /* Keep the tag's entries on this load */
+
+/* System calls (must match context_switch64.asm's test program) */
+#define SYS64_WRITE 1
+#define SYS64_GETPID 39
+#define SYS64_EXIT 60
+
+/* The ring 3 test's address space: code page, then stack page, in one page table */
+#define USER_CODE 0x400000ull
+#define USER_STACK_TOP (USER_CODE + 2 * PAGE_SIZE)
+
+#define KERNEL_STACK_SIZE 16384
+#define SWITCH_ROUNDS 1000
+
+/* VGA text mode constants */
+#define VGA_WIDTH 80
+#define VGA_HEIGHT 25
+#define VGA_PHYS 0xB8000
+
+/* VGA colors */
+enum vga_color {
+    VGA_COLOR_LIGHT_GREY = 7,
+    VGA_COLOR_LIGHT_GREEN = 10,
+    VGA_COLOR_LIGHT_CYAN = 11,
+    VGA_COLOR_LIGHT_RED = 12,
+};
+
+/* struct cpu_context64 (must match context_switch64.asm's offsets) */
+struct cpu_context64 {
+    uint64_t rsp;
+    uint64_t cr3;                           /* 0: keep the current address space */
+    uint64_t kernel_stack;                  /* Top of its SYSCALL stack; 0: leave as is */
+};
+
+/* Function prototypes */
+void kernel_main(void);
+uint64_t syscall_dispatch64(uint64_t number, uint64_t arg0, uint64_t arg1, uint64_t arg2);
+void* memcpy(void* dest, const void* src, size_t n);
+void* memmove(void* dest, const void* src, size_t n);
+void* memset(void* s, int c, size_t n);
+int memcmp(const void* a, const void* b, size_t n);
+
+/* Context switch and system call entry (context_switch64.asm) */
+extern void switch_to64(struct cpu_context64* prev, struct cpu_context64* next);
+extern void syscall_entry64(void);
+extern uint64_t enter_user64(uint64_t entry, uint64_t user_stack);
+extern void exit_user64(uint64_t status);
+extern uint64_t syscall_kernel_rsp;
+extern const uint8_t user64_program[];
+extern const uint8_t user64_program_end[];
+
+static size_t terminal_row;
+static size_t terminal_column;
+static uint8_t terminal_color = VGA_COLOR_LIGHT_GREY;
+static volatile uint16_t* const terminal_buffer = PHYS_TO_VIRT(VGA_PHYS);
+
+/* Page-aligned frames for the ring 3 address space; kernel BSS, so their physical address is known */
+static uint64_t user_pdpt[512] __attribute__((aligned(PAGE_SIZE)));
+static uint64_t user_pd[512] __attribute__((aligned(PAGE_SIZE)));
+static uint64_t user_pt[512] __attribute__((aligned(PAGE_SIZE)));
+static uint8_t user_pages[2][PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+
+static uint8_t syscall_stack[KERNEL_STACK_SIZE] __attribute__((aligned(16)));
+static uint8_t task_stack[KERNEL_STACK_SIZE] __attribute__((aligned(16)));
+static uint64_t syscall_count;
+
+static struct cpu_context64 main_context;
+static struct cpu_context64 task_context;
+static volatile uint32_t task_switches;
+
+static int pcid_enabled;
+static uint64_t pcid_pml4[512] __attribute__((aligned(PAGE_SIZE)));   /* A second address space for the PCID test */
+
+/* Freestanding builds still get calls to these from the compiler; klib.c is 32-bit */
+void* memcpy(void* dest, const void* src, size_t n) {
+    uint8_t* d = dest;
+    const uint8_t* s = src;
+    while (n--) {
+        *d++ = *s++;
+    }
+    return dest;
+}
+
+void* memmove(void* dest, const void* src, size_t n) {
+    uint8_t* d = dest;
+    const uint8_t* s = src;
+    if (d < s) {
+        return memcpy(dest, src, n);
+    }
+    while (n--) {
+        d[n] = s[n];
+    }
+    return dest;
+}
+
+void* memset(void* s, int c, size_t n) {
+    uint8_t* p = s;
+    while (n--) {
+        *p++ = (uint8_t)c;
+    }
+    return s;
+}
+
+int memcmp(const void* a, const void* b, size_t n) {
+    const uint8_t* x = a;
+    const uint8_t* y = b;
+    for (size_t i = 0; i < n; i++) {
+        if (x[i] != y[i]) {
+            return x[i] < y[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t low, high;
+    __asm__ __volatile__("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ __volatile__("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline uint64_t read_cr3(void) {
+    uint64_t cr3;
+    __asm__ __volatile__("mov %%cr3, %0" : "=r"(cr3));
+    return cr3;
+}
+
+/* Drop every TLB entry, global ones too, by toggling CR4.PGE */
+static void flush_tlb_all(void) {
+    uint64_t cr4;
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(cr4));
+    __asm__ __volatile__("mov %0, %%cr4" : : "r"(cr4 & ~(uint64_t)CR4_PGE) : "memory");
+    __asm__ __volatile__("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
+static void terminal_putchar(char c) {
+    if (c == '\n') {
+        terminal_column = 0;
+    } else {
+        terminal_buffer[terminal_row * VGA_WIDTH + terminal_column] = (uint16_t)c | (uint16_t)terminal_color << 8;
+        if (++terminal_column < VGA_WIDTH) {
+            return;
+        }
+        terminal_column = 0;
+    }
+    if (++terminal_row == VGA_HEIGHT) {
+        for (size_t i = 0; i < (VGA_HEIGHT - 1) * VGA_WIDTH; i++) {
+            terminal_buffer[i] = terminal_buffer[i + VGA_WIDTH];
+        }
+        for (size_t x = 0; x < VGA_WIDTH; x++) {
+            terminal_buffer[(VGA_HEIGHT - 1) * VGA_WIDTH + x] = ' ' | (uint16_t)terminal_color << 8;
+        }
+        terminal_row = VGA_HEIGHT - 1;
+    }
+}
+
+static void terminal_write(const char* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        terminal_putchar(data[i]);
+    }
+}
+
+static void terminal_writestring(const char* data) {
+    while (*data) {
+        terminal_putchar(*data++);
+    }
+}
+
+static void terminal_writedec(uint64_t value) {
+    char digits[20];
+    size_t count = 0;
+    do {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    while (count) {
+        terminal_putchar(digits[--count]);
+    }
+}
+
+static void terminal_writehex(uint64_t value) {
+    terminal_writestring("0x");
+    for (int shift = 60; shift >= 0; shift -= 4) {
+        terminal_putchar("0123456789ABCDEF"[(value >> shift) & 0xF]);
+    }
+}
+
+static void terminal_initialize(void) {
+    for (size_t i = 0; i < VGA_WIDTH * VGA_HEIGHT; i++) {
+        terminal_buffer[i] = ' ' | (uint16_t)terminal_color << 8;
+    }
+}
+
+static void test_result(const char* name, int passed) {
+    terminal_writestring(name);
+    terminal_writestring(": ");
+    terminal_color = passed ? VGA_COLOR_LIGHT_GREEN : VGA_COLOR_LIGHT_RED;
+    terminal_writestring(passed ? "PASSED\n" : "FAILED\n");
+    terminal_color = VGA_COLOR_LIGHT_GREY;
+}
+
+static inline void write_cr3(uint64_t cr3) {
+    __asm__ __volatile__("mov %0, %%cr3" : : "r"(cr3) : "memory");
+}
+
+/*
+ * Turn on PCIDs where the CPU has them. CR3 is tagged 0 when PCIDE is set,
+ * as the architecture requires; the kernel's own mappings are global and
+ * so are shared by every tag.
+ */
+static void pcid_init(void) {
+    uint32_t eax = 1, ebx, ecx = 0, edx;
+    __asm__ __volatile__("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    if (!(ecx & CPUID_FEAT_ECX_PCID)) {
+        return;
+    }
+    write_cr3(read_cr3() & PAGE_ADDR_MASK);
+    uint64_t cr4;
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(cr4));
+    __asm__ __volatile__("mov %0, %%cr4" : : "r"(cr4 | CR4_PCIDE) : "memory");
+    pcid_enabled = 1;
+}
+
+/*
+ * The CR3 value a context switches to for the PML4 at pml4_phys: tagged
+ * with pcid and loaded without a flush, so the space's entries are still
+ * there when it is next switched to. The tag is flushed once here, as a
+ * previous owner may have left entries under it. Without PCIDs every load
+ * flushes, as before.
+ */
+static uint64_t address_space_cr3(uint64_t pml4_phys, uint32_t pcid) {
+    if (!pcid_enabled) {
+        return pml4_phys;
+    }
+    uint64_t current = read_cr3();
+    write_cr3(pml4_phys | (pcid & CR3_PCID_MASK));
+    write_cr3(current | CR3_NOFLUSH);
+    return pml4_phys | (pcid & CR3_PCID_MASK) | CR3_NOFLUSH;
+}
+
+/* Walk the four levels for a virtual address; ~0 when it is not mapped */
+static uint64_t virt_to_phys(uint64_t virt) {
+    uint64_t table = read_cr3() & PAGE_ADDR_MASK;
+    for (int level = 3; level >= 0; level--) {
+        uint64_t entry = ((uint64_t*)PHYS_TO_VIRT(table))[(virt >> (12 + 9 * level)) & 0x1FF];
+        if (!(entry & PAGE_PRESENT)) {
+            return ~0ull;
+        }
+        if (level && level < 3 && (entry & PAGE_HUGE)) {
+            uint64_t page_mask = (1ull << (12 + 9 * level)) - 1;
+            return (entry & PAGE_ADDR_MASK & ~page_mask) | (virt & page_mask);
+        }
+        table = entry & PAGE_ADDR_MASK;
+    }
+    return table | (virt & (PAGE_SIZE - 1));
+}
+
+/*
+ * The ring 3 address space: PML4 slot 0, which held boot64.asm's identity
+ * map, now leads to one page table with the test program's code and stack
+ * pages. The kernel keeps running through the direct map and its image.
+ */
+static void user_space_init(void) {
+    uint64_t* pml4 = PHYS_TO_VIRT(read_cr3() & PAGE_ADDR_MASK);
+    uint64_t flags = PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+
+    user_pt[(USER_CODE >> 12) & 0x1FF] = KERNEL_TO_PHYS(user_pages[0]) | flags;
+    user_pt[((USER_CODE >> 12) & 0x1FF) + 1] = KERNEL_TO_PHYS(user_pages[1]) | flags;
+    user_pd[(USER_CODE >> 21) & 0x1FF] = KERNEL_TO_PHYS(user_pt) | flags;
+    user_pdpt[0] = KERNEL_TO_PHYS(user_pd) | flags;
+    pml4[0] = KERNEL_TO_PHYS(user_pdpt) | flags;
+    flush_tlb_all();
+
+    memcpy(user_pages[0], user64_program, (size_t)(user64_program_end - user64_program));
+}
+
+/*
+ * SYSCALL enters at syscall_entry64 on the kernel's CS/SS; SYSRET returns
+ * on the user pair above USER_BASE_SELECTOR. IF, DF and TF are cleared on
+ * entry.
+ */
+static void syscall_init(void) {
+    wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_SCE);
+    wrmsr(MSR_STAR, (uint64_t)(USER_BASE_SELECTOR | 3) << 48 | (uint64_t)KERNEL_CS << 32);
+    wrmsr(MSR_LSTAR, (uint64_t)syscall_entry64);
+    wrmsr(MSR_SFMASK, RFLAGS_IF | RFLAGS_DF | RFLAGS_TF);
+    syscall_kernel_rsp = (uint64_t)(syscall_stack + KERNEL_STACK_SIZE);
+}
+
+/* Pointers from ring 3 must stay below the kernel half */
+static int user_range_ok(uint64_t address, uint64_t size) {
+    return address + size >= address && address + size <= 0x0000800000000000ull;
+}
+
+uint64_t syscall_dispatch64(uint64_t number, uint64_t arg0, uint64_t arg1, uint64_t arg2) {
+    (void)arg2;
+    syscall_count++;
+    switch (number) {
+    case SYS64_WRITE:
+        if (!user_range_ok(arg0, arg1)) {
+            return (uint64_t)-1;
+        }
+        terminal_write((const char*)arg0, (size_t)arg1);
+        return arg1;
+    case SYS64_GETPID:
+        return 1;
+    case SYS64_EXIT:
+        exit_user64(arg0);
+        return 0;
+    default:
+        return (uint64_t)-1;
+    }
+}
+
+static void test_long_mode(void) {
+    terminal_color = VGA_COLOR_LIGHT_CYAN;
+    terminal_writestring("=== Testing Long Mode and 4-Level Paging ===\n");
+    terminal_color = VGA_COLOR_LIGHT_GREY;
+
+    test_result("EFER.LMA set", (rdmsr(MSR_EFER) & EFER_LMA) != 0);
+
+    /* The image is linked in the top 2 GiB and loaded at its physical alias */
+    uint64_t main_phys = virt_to_phys((uint64_t)kernel_main);
+    terminal_writestring("kernel_main: ");
+    terminal_writehex((uint64_t)kernel_main);
+    terminal_writestring(" -> ");
+    terminal_writehex(main_phys);
+    terminal_putchar('\n');
+    test_result("Kernel image translates", main_phys == KERNEL_TO_PHYS(kernel_main));
+
+    /* A write through the direct map shows through the image's mapping */
+    static volatile uint64_t probe;
+    volatile uint64_t* alias = PHYS_TO_VIRT(KERNEL_TO_PHYS(&probe));
+    *alias = 0x123456789ABCDEF0ull;
+    test_result("Direct map aliases the image", probe == 0x123456789ABCDEF0ull);
+    test_result("Direct map reaches 4 GiB", virt_to_phys(DIRECT_MAP + DIRECT_MAP_SIZE - 1) == DIRECT_MAP_SIZE - 1);
+}
+
+static void task_entry(void) {
+    for (;;) {
+        task_switches++;
+        switch_to64(&task_context, &main_context);
+    }
+}
+
+static void test_context_switch64(void) {
+    terminal_color = VGA_COLOR_LIGHT_CYAN;
+    terminal_writestring("=== Testing 64-bit Context Switch ===\n");
+    terminal_color = VGA_COLOR_LIGHT_GREY;
+
+    /* The new task first "returns" into task_entry off a frame laid out as switch_to64 pops it */
+    uint64_t* stack = (uint64_t*)(task_stack + KERNEL_STACK_SIZE);
+    *--stack = 0;                           /* task_entry's return address: it never returns */
+    *--stack = (uint64_t)task_entry;
+    for (int i = 0; i < 6; i++) {
+        *--stack = 0;                       /* rbp, rbx, r12-r15 */
+    }
+    *--stack = 0x002;                       /* RFLAGS */
+    task_context.rsp = (uint64_t)stack;
+    task_context.kernel_stack = (uint64_t)(task_stack + KERNEL_STACK_SIZE);
+    main_context.kernel_stack = (uint64_t)(syscall_stack + KERNEL_STACK_SIZE);
+
+    uint64_t start = rdtsc();
+    for (int i = 0; i < SWITCH_ROUNDS; i++) {
+        switch_to64(&main_context, &task_context);
+    }
+    uint64_t cycles = rdtsc() - start;
+
+    terminal_writestring("Round trips: ");
+    terminal_writedec(task_switches);
+    terminal_writestring(", cycles per switch: ");
+    terminal_writedec(cycles / (2 * SWITCH_ROUNDS));
+    terminal_putchar('\n');
+    test_result("Context switch round trips", task_switches == SWITCH_ROUNDS);
+}
+
+/*
+ * Ping-pong between two address spaces, tagged and then untagged: with
+ * PCIDs each switch keeps the other space's entries, without them each
+ * switch starts both over.
+ */
+static uint64_t pcid_round_trips(uint64_t main_cr3, uint64_t task_cr3) {
+    main_context.cr3 = main_cr3;
+    task_context.cr3 = task_cr3;
+    task_switches = 0;
+    uint64_t start = rdtsc();
+    for (int i = 0; i < SWITCH_ROUNDS; i++) {
+        switch_to64(&main_context, &task_context);
+    }
+    uint64_t cycles = rdtsc() - start;
+    main_context.cr3 = 0;
+    task_context.cr3 = 0;
+    return task_switches == SWITCH_ROUNDS ? cycles / (2 * SWITCH_ROUNDS) : 0;
+}
+
+static void test_pcid(void) {
+    terminal_color = VGA_COLOR_LIGHT_CYAN;
+    terminal_writestring("=== Testing PCID-Tagged Address Spaces ===\n");
+    terminal_color = VGA_COLOR_LIGHT_GREY;
+
+    if (!pcid_enabled) {
+        terminal_writestring("PCID: SKIPPED (not supported)\n");
+        return;
+    }
+
+    /* Same kernel half and user pages, a different PML4: a second address space */
+    uint64_t main_pml4 = read_cr3() & PAGE_ADDR_MASK;
+    memcpy(pcid_pml4, PHYS_TO_VIRT(main_pml4), sizeof(pcid_pml4));
+    uint64_t task_pml4 = KERNEL_TO_PHYS(pcid_pml4);
+
+    uint64_t tagged = pcid_round_trips(address_space_cr3(main_pml4, 1), address_space_cr3(task_pml4, 2));
+    uint64_t flushing = pcid_round_trips(main_pml4, task_pml4);
+    write_cr3(main_pml4);
+
+    terminal_writestring("Cycles per switch, tagged: ");
+    terminal_writedec(tagged);
+    terminal_writestring(", flushing: ");
+    terminal_writedec(flushing);
+    terminal_putchar('\n');
+    test_result("PCID address space switches", tagged != 0 && flushing != 0);
+}
+
+static void test_syscall64(void) {
+    terminal_color = VGA_COLOR_LIGHT_CYAN;
+    terminal_writestring("=== Testing SYSCALL/SYSRET ===\n");
+    terminal_color = VGA_COLOR_LIGHT_GREY;
+
+    syscall_count = 0;
+    uint64_t start = rdtsc();
+    uint64_t status = enter_user64(USER_CODE, USER_STACK_TOP);
+    uint64_t cycles = rdtsc() - start;
+
+    terminal_writestring("System calls: ");
+    terminal_writedec(syscall_count);
+    terminal_writestring(", cycles per call: ");
+    terminal_writedec(syscall_count ? cycles / syscall_count : 0);
+    terminal_putchar('\n');
+    /* One write, the empty calls, one exit: the program exits with how many it made */
+    test_result("Ring 3 round trip", syscall_count == status + 2);
+}
+
+void kernel_main(void) {
+    terminal_initialize();
+    terminal_color = VGA_COLOR_LIGHT_GREEN;
+    terminal_writestring("=== Tiny Operating System - x86-64 Long Mode ===\n");
+    terminal_color = VGA_COLOR_LIGHT_GREY;
+
+    syscall_init();
+    user_space_init();
+    pcid_init();
+
+    test_long_mode();
+    test_context_switch64();
+    test_pcid();
+    test_syscall64();
+
+    terminal_color = VGA_COLOR_LIGHT_GREEN;
+    terminal_writestring("=== Long Mode Kernel Complete ===\n");
+    terminal_color = VGA_COLOR_LIGHT_GREY;
+
+    /* Infinite loop */
+    while (1) {
+        __asm__ __volatile__("hlt");
+    }
+}
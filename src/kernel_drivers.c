@@ -34,52 +34,52 @@ static inline uint16_t vga_entry(unsigned char uc, uint8_t color) {
     return (uint16_t) uc | (uint16_t) color << 8;
 }
 
-static const size_t VGA_WIDTH = 80;
-static const size_t VGA_HEIGHT = 25;
+/* Shadow-buffered console (vga_console.c) */
+extern void console_initialize(uint8_t color);
+extern void console_setcolor(uint8_t color);
+extern void console_putentryat(char c, uint8_t color, uint32_t x, uint32_t y);
+extern void console_putchar(char c);
+extern void console_flush(void);
+extern int console_framebuffer(uint32_t lfb);
 
-size_t terminal_row;
-size_t terminal_column;
-uint8_t terminal_color;
-uint16_t* terminal_buffer;
+/* Serial console (serial.c) */
+extern void serial_init(int use_irq);
+
+/* Kernel log ring (printk.c) */
+extern void printk_init(uint32_t (*clock)(void), int serial);
+extern uint32_t printk_console_drain(void);
+
+/* End of the kernel image (the linker's default script) */
+extern char _end[];
+
+/* Boot timeline (initcall.c) */
+extern void initcall_begin(const char* name);
+extern void initcall_end(void);
+extern void initcall_run(const char* name, void (*init)(void));
+extern void initcall_report(uint32_t tsc_khz);
+extern int initcall_driver(const char* name, int (*probe)(void), uint32_t depends, uint32_t flags);
+extern void initcall_run_drivers(void);
+extern int initcall_require(uint32_t id);
+extern uint32_t initcall_run_deferred(uint32_t budget);
+
+/* Driver flags (must match initcall.c) */
+#define INITCALL_DEFERRED 0x1
+#define INITCALL_ON_DEMAND 0x2
 
 void terminal_initialize(void) {
-    terminal_row = 0;
-    terminal_column = 0;
-    terminal_color = vga_entry_color(VGA_COLOR_LIGHT_GREY, VGA_COLOR_BLACK);
-    terminal_buffer = (uint16_t*) 0xB8000;
-    for (size_t y = 0; y < VGA_HEIGHT; y++) {
-        for (size_t x = 0; x < VGA_WIDTH; x++) {
-            const size_t index = y * VGA_WIDTH + x;
-            terminal_buffer[index] = vga_entry(' ', terminal_color);
-        }
-    }
+    console_initialize(vga_entry_color(VGA_COLOR_LIGHT_GREY, VGA_COLOR_BLACK));
 }
 
 void terminal_setcolor(uint8_t color) {
-    terminal_color = color;
+    console_setcolor(color);
 }
 
 void terminal_putentryat(char c, uint8_t color, size_t x, size_t y) {
-    const size_t index = y * VGA_WIDTH + x;
-    terminal_buffer[index] = vga_entry(c, color);
+    console_putentryat(c, color, x, y);
 }
 
 void terminal_putchar(char c) {
-    if (c == '\n') {
-        terminal_column = 0;
-        if (++terminal_row == VGA_HEIGHT) {
-            terminal_row = 0;
-        }
-        return;
-    }
-    
-    terminal_putentryat(c, terminal_color, terminal_column, terminal_row);
-    if (++terminal_column == VGA_WIDTH) {
-        terminal_column = 0;
-        if (++terminal_row == VGA_HEIGHT) {
-            terminal_row = 0;
-        }
-    }
+    console_putchar(c);
 }
 
 void terminal_write(const char* data, size_t size) {
@@ -92,6 +92,17 @@ void terminal_writestring(const char* data) {
         terminal_putchar(data[i]);
 }
 
+void terminal_writedec(uint32_t value) {
+    char digits[10];
+    int count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (count)
+        terminal_putchar(digits[--count]);
+}
+
 /* Port I/O Functions */
 static inline void outb(uint16_t port, uint8_t value) {
     __asm__ __volatile__ ("outb %0, %1" : : "a"(value), "Nd"(port));
@@ -113,6 +124,10 @@ static inline uint16_t inw(uint16_t port) {
     return ret;
 }
 
+static inline void outl(uint16_t port, uint32_t value) {
+    __asm__ __volatile__ ("outl %0, %1" : : "a"(value), "Nd"(port));
+}
+
 /* Keyboard Driver */
 #define KEYBOARD_DATA_PORT 0x60
 #define KEYBOARD_STATUS_PORT 0x64
@@ -128,9 +143,22 @@ static const char scancode_to_ascii[128] = {
     0, 0, 0, '+', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
 };
 
-static char keyboard_buffer[256];
-static int keyboard_buffer_head = 0;
-static int keyboard_buffer_tail = 0;
+/* Single-producer single-consumer byte ring (must match struct spsc_ring in spsc_ring.c) */
+struct spsc_ring {
+    uint8_t* buffer;
+    uint32_t mask;
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t tail __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+extern uint32_t spsc_count(const struct spsc_ring* ring);
+extern int spsc_push(struct spsc_ring* ring, uint8_t byte);
+extern int spsc_pop(struct spsc_ring* ring, uint8_t* byte);
+
+/* Filled by the IRQ handler, drained by keyboard_getchar; full rings drop keys */
+#define KEYBOARD_BUFFER_SIZE 256        /* Power of two */
+static uint8_t keyboard_buffer[KEYBOARD_BUFFER_SIZE];
+static struct spsc_ring keyboard_ring = { .buffer = keyboard_buffer, .mask = KEYBOARD_BUFFER_SIZE - 1 };
 static int keyboard_shift_pressed = 0;
 
 void keyboard_handler(void) {
@@ -183,26 +211,20 @@ void keyboard_handler(void) {
     
     /* Add to buffer if it's a valid character */
     if (ascii != 0) {
-        int next = (keyboard_buffer_head + 1) % 256;
-        if (next != keyboard_buffer_tail) {
-            keyboard_buffer[keyboard_buffer_head] = ascii;
-            keyboard_buffer_head = next;
-        }
+        spsc_push(&keyboard_ring, (uint8_t)ascii);
     }
 }
 
 char keyboard_getchar(void) {
-    if (keyboard_buffer_tail == keyboard_buffer_head) {
+    uint8_t c;
+    if (!spsc_pop(&keyboard_ring, &c)) {
         return 0; /* No character available */
     }
-    
-    char c = keyboard_buffer[keyboard_buffer_tail];
-    keyboard_buffer_tail = (keyboard_buffer_tail + 1) % 256;
-    return c;
+    return (char)c;
 }
 
 int keyboard_available(void) {
-    return keyboard_buffer_tail != keyboard_buffer_head;
+    return spsc_count(&keyboard_ring) != 0;
 }
 
 /* Mouse Driver */
@@ -218,6 +240,7 @@ struct mouse_packet {
 
 static struct mouse_packet mouse_state;
 static int mouse_initialized = 0;
+static int mouse_driver = -1;           /* Its probe's id; deferred, as boot never reads the mouse */
 
 void mouse_wait(uint8_t type) {
     uint32_t timeout = 100000;
@@ -299,18 +322,127 @@ void mouse_init(void) {
 #define ATA_DRIVE_HEAD_PORT 0x1F6
 #define ATA_COMMAND_PORT 0x1F7
 #define ATA_STATUS_PORT 0x1F7
+#define ATA_CONTROL_PORT 0x3F6          /* Device control; reads as alternate status */
 
 #define ATA_CMD_READ 0x20
+#define ATA_CMD_READ_EXT 0x24
+#define ATA_CMD_READ_MULTIPLE_EXT 0x29
 #define ATA_CMD_WRITE 0x30
+#define ATA_CMD_WRITE_EXT 0x34
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_READ_MULTIPLE 0xC4
+#define ATA_CMD_WRITE_MULTIPLE 0xC5
+#define ATA_CMD_SET_MULTIPLE 0xC6
+#define ATA_CMD_FLUSH_CACHE 0xE7
+#define ATA_CMD_FLUSH_CACHE_EXT 0xEA
+#define ATA_CMD_IDENTIFY 0xEC
 #define ATA_STATUS_BUSY 0x80
 #define ATA_STATUS_READY 0x40
+#define ATA_STATUS_FAULT 0x20
+#define ATA_STATUS_DRQ 0x08
 #define ATA_STATUS_ERROR 0x01
+#define ATA_CONTROL_NIEN 0x02           /* Polled: the drive raises no IRQ 14 */
+
+#define ATA_LBA28_LIMIT 0x10000000      /* First sector LBA28 cannot address */
+#define ATA_LBA28_MAX_COUNT 256         /* A count register of 0 means 256 */
+#define ATA_LBA48_MAX_COUNT 65536
+#define ATA_TIMEOUT_SPINS 1000000       /* Status polls before a command is given up */
+
+/* Bus-master IDE (SFF-8038i): registers of the primary channel at BAR4 */
+#define ATA_CMD_READ_DMA 0xC8
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_WRITE_DMA 0xCA
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_BM_COMMAND 0x00
+#define ATA_BM_STATUS 0x02
+#define ATA_BM_PRDT 0x04
+#define ATA_BM_CMD_START 0x01
+#define ATA_BM_CMD_READ 0x08            /* Device to memory */
+#define ATA_BM_STATUS_ERROR 0x02
+#define ATA_BM_STATUS_IRQ 0x04          /* Write 1 to clear, like ERROR */
+#define ATA_PRD_EOT 0x8000
+#define ATA_PRD_ENTRIES 64
+#define ATA_DMA_BOUNDARY 0x10000        /* A PRD region may not cross 64 KiB */
+#define ATA_IRQ 14
+#define ATA_DMA_TIMEOUT_TICKS 500       /* 5 s at 100 Hz */
+#define PCI_CLASS_STORAGE 0x01
+#define PCI_SUBCLASS_IDE 0x01
+#define PCI_CLASS_DISPLAY 0x03
+#define PCI_SUBCLASS_VGA 0x00
+#define PCI_BAR4 0x20
+#define PIC1_DATA_PORT 0x21
+#define PIC2_DATA_PORT 0xA1
+#define PAGE_SIZE 4096
 
 #define SECTOR_SIZE 512
 #define DISK_SIZE 1024 * 1024 /* 1MB simulated disk */
+#define LFS_DISK_SIZE (256 * 1024)
+
+/* RAM disks (ramdisk.c) */
+extern void ramdisk_init(void);
+extern int ramdisk_create(const char* name, uint32_t sectors, int shared);
+extern int ramdisk_read(int device, uint32_t sector, uint32_t count, void* buffer);
+extern int ramdisk_write(int device, uint32_t sector, uint32_t count, const void* buffer);
+extern uint32_t ramdisk_frames_available(void);
+
+/* Block devices registered at boot; -1 when the backend is missing */
+static int blk_ram = -1;
+static int blk_scratch = -1;            /* Copying RAM disk, for tests that count device I/O */
+static int blk_lfs = -1;                /* Holds the log-structured filesystem */
+static int blk_ata = -1;
+static int blk_ata_pio = -1;            /* The same drive with DMA off, when it has DMA */
+static int blk_ahci = -1;
+
+/* Primary master, as IDENTIFY DEVICE describes it */
+struct ata_drive {
+    uint8_t present;
+    uint8_t lba48;
+    uint16_t multiple;                  /* Sectors per DRQ block; 0 when READ/WRITE MULTIPLE is off */
+    uint32_t sectors;
+    uint16_t bm_base;                   /* Bus-master registers; 0 when transfers are PIO only */
+};
+
+static struct ata_drive ata_drive;
+
+/* Physical region descriptor: one contiguous piece of a DMA buffer */
+struct ata_prd {
+    uint32_t address;
+    uint16_t byte_count;                /* 0 means 64 KiB */
+    uint16_t flags;
+} __attribute__((packed));
+
+/* Aligned to its own size, so the table cannot straddle a 64 KiB boundary */
+static struct ata_prd ata_prd_table[ATA_PRD_ENTRIES] __attribute__((aligned(ATA_PRD_ENTRIES * 8)));
+
+/*
+ * Tasks waiting for an event. There is no scheduler in this stage, so a
+ * sleeper halts until the interrupt that wakes it; wake_up counts events.
+ */
+struct wait_queue {
+    volatile uint32_t wakeups;
+};
+
+static struct wait_queue ata_dma_queue;
+static volatile int ata_dma_result;
+
+extern uint32_t timer_ticks;
+extern void irq_install_handler(uint32_t irq, void (*handler)(void));
+
+/* PCI configuration space (pci.c) */
+extern uint32_t pci_find_class(uint8_t class_code, uint8_t subclass);
+extern uint32_t pci_config_read32(uint32_t device, uint8_t offset);
+extern uint32_t pci_bar(uint32_t device, uint32_t index);
+extern void* pci_map_bar(uint32_t device, uint32_t index);
+extern void pci_enable_device(uint32_t device);
 
-/* Simulated disk storage */
-static uint8_t disk_storage[DISK_SIZE];
+/* Move count words between the data port and memory, one instruction per transfer */
+static inline void insw(uint16_t port, void* buffer, uint32_t count) {
+    __asm__ __volatile__ ("rep insw" : "+D"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+
+static inline void outsw(uint16_t port, const void* buffer, uint32_t count) {
+    __asm__ __volatile__ ("rep outsw" : "+S"(buffer), "+c"(count) : "d"(port) : "memory");
+}
 
 void ata_wait_ready(void) {
     while (inb(ATA_STATUS_PORT) & ATA_STATUS_BUSY) {
@@ -318,92 +450,395 @@ void ata_wait_ready(void) {
     }
 }
 
-void ata_read_sector(uint32_t lba, uint8_t* buffer) {
-    ata_wait_ready();
-    
-    /* Select drive */
-    outb(ATA_DRIVE_HEAD_PORT, 0xE0 | ((lba >> 24) & 0x0F));
-    
-    /* Set sector count */
-    outb(ATA_SECTOR_COUNT_PORT, 1);
+/* Status is valid 400 ns after a command or drive select: four alternate status reads */
+static void ata_delay400(void) {
+    for (int i = 0; i < 4; i++) {
+        inb(ATA_CONTROL_PORT);
+    }
+}
+
+/* Wait for BSY to clear, and for DRQ too if data is expected; -1 on error or timeout */
+static int ata_poll(int need_drq) {
+    for (uint32_t spins = 0; spins < ATA_TIMEOUT_SPINS; spins++) {
+        uint8_t status = inb(ATA_STATUS_PORT);
+        if (status & ATA_STATUS_BUSY) {
+            continue;
+        }
+        if (status & (ATA_STATUS_ERROR | ATA_STATUS_FAULT)) {
+            return -1;
+        }
+        if (!need_drq || (status & ATA_STATUS_DRQ)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Load the task file and issue a command; LBA48 writes the high bytes first */
+static int ata_command(uint32_t lba, uint32_t count, int lba48, uint8_t command) {
+    outb(ATA_DRIVE_HEAD_PORT, lba48 ? 0x40 : 0xE0 | ((lba >> 24) & 0x0F));
+    ata_delay400();
+    if (ata_poll(0) != 0) {
+        return -1;
+    }
     
-    /* Set LBA */
+    if (lba48) {
+        outb(ATA_SECTOR_COUNT_PORT, (count >> 8) & 0xFF);
+        outb(ATA_SECTOR_NUMBER_PORT, (lba >> 24) & 0xFF);
+        outb(ATA_CYLINDER_LOW_PORT, 0);
+        outb(ATA_CYLINDER_HIGH_PORT, 0);
+    }
+    outb(ATA_SECTOR_COUNT_PORT, count & 0xFF);
     outb(ATA_SECTOR_NUMBER_PORT, lba & 0xFF);
     outb(ATA_CYLINDER_LOW_PORT, (lba >> 8) & 0xFF);
     outb(ATA_CYLINDER_HIGH_PORT, (lba >> 16) & 0xFF);
+    outb(ATA_COMMAND_PORT, command);
+    ata_delay400();
+    return 0;
+}
+
+static void wake_up(struct wait_queue* queue) {
+    queue->wakeups++;
+}
+
+static int irqs_enabled(void) {
+    uint32_t flags;
+    __asm__ __volatile__ ("pushfl; popl %0" : "=r"(flags));
+    return (flags & 0x200) != 0;
+}
+
+/*
+ * Sleep until the queue moves past seen, or timeout ticks pass (-1). The
+ * check and the halt are one sti;hlt apart so a wakeup cannot slip between
+ * them. With interrupts off nothing would wake the sleeper, so it runs poll
+ * itself, a bounded number of times.
+ */
+static int sleep_on(struct wait_queue* queue, uint32_t seen, uint32_t timeout, void (*poll)(void)) {
+    if (!irqs_enabled()) {
+        for (uint32_t spins = 0; queue->wakeups == seen; spins++) {
+            if (spins == ATA_TIMEOUT_SPINS) {
+                return -1;
+            }
+            poll();
+        }
+        return 0;
+    }
     
-    /* Send read command */
-    outb(ATA_COMMAND_PORT, ATA_CMD_READ);
+    uint32_t start = timer_ticks;
+    for (;;) {
+        __asm__ __volatile__ ("cli" : : : "memory");
+        if (queue->wakeups != seen) {
+            __asm__ __volatile__ ("sti" : : : "memory");
+            return 0;
+        }
+        if (timer_ticks - start >= timeout) {
+            __asm__ __volatile__ ("sti" : : : "memory");
+            return -1;
+        }
+        __asm__ __volatile__ ("sti; hlt" : : : "memory");
+    }
+}
+
+/* IRQ 14: a DMA command finished. Reading the status register acknowledges the drive */
+static void ata_dma_interrupt(void) {
+    uint8_t bm_status = inb(ata_drive.bm_base + ATA_BM_STATUS);
+    if (!(bm_status & ATA_BM_STATUS_IRQ)) {
+        return; /* Not a bus-master completion */
+    }
+    uint8_t status = inb(ATA_STATUS_PORT);
+    outb(ata_drive.bm_base + ATA_BM_COMMAND, 0);
+    outb(ata_drive.bm_base + ATA_BM_STATUS, ATA_BM_STATUS_IRQ | ATA_BM_STATUS_ERROR);
+    
+    ata_dma_result = ((bm_status & ATA_BM_STATUS_ERROR) || (status & (ATA_STATUS_ERROR | ATA_STATUS_FAULT))) ? -1 : 0;
+    wake_up(&ata_dma_queue);
+}
+
+/* Find the IDE controller, let it master the bus and take IRQ 14 */
+static void ata_dma_init(void) {
+    uint32_t controller = pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE);
+    if (!controller) {
+        return;
+    }
+    uint32_t bar4 = pci_config_read32(controller, PCI_BAR4);
+    if (!(bar4 & 1) || !(bar4 & ~0x3u)) {
+        return; /* No bus-master I/O window */
+    }
+    pci_enable_device(controller);
     
-    /* Wait for data ready */
-    ata_wait_ready();
+    ata_drive.bm_base = (uint16_t)pci_bar(controller, 4);
+    ata_dma_queue.wakeups = 0;
+    irq_install_handler(ATA_IRQ, ata_dma_interrupt);
+    
+    /* Unmask IRQ 14 on the slave PIC and the cascade on the master */
+    outb(PIC2_DATA_PORT, inb(PIC2_DATA_PORT) & ~(1 << (ATA_IRQ - 8)));
+    outb(PIC1_DATA_PORT, inb(PIC1_DATA_PORT) & ~(1 << 2));
+}
+
+/* This stage runs unpaged: a buffer's address is its physical address */
+static uint32_t virt_to_phys(const void* address) {
+    return (uint32_t)(uintptr_t)address;
+}
+
+/*
+ * Describe a buffer to the controller, a page at a time since consecutive
+ * pages need not be consecutive frames; pieces that are merge, up to the
+ * 64 KiB boundary no region may cross. -1 if the table overflows.
+ */
+static int ata_prd_build(const uint8_t* buffer, uint32_t size) {
+    uint32_t entries = 0;
+    uint32_t length = 0;                /* Of the entry being built */
     
-    /* Read sector data */
-    for (int i = 0; i < SECTOR_SIZE; i += 2) {
-        uint16_t data = inw(ATA_DATA_PORT);
-        buffer[i] = data & 0xFF;
-        buffer[i + 1] = (data >> 8) & 0xFF;
+    while (size) {
+        uint32_t phys = virt_to_phys(buffer);
+        uint32_t chunk = PAGE_SIZE - (phys & (PAGE_SIZE - 1));
+        if (chunk > size) {
+            chunk = size;
+        }
+        
+        struct ata_prd* prd = entries ? &ata_prd_table[entries - 1] : NULL;
+        if (prd && prd->address + length == phys && length + chunk <= ATA_DMA_BOUNDARY &&
+            (prd->address & ~(ATA_DMA_BOUNDARY - 1)) == ((phys + chunk - 1) & ~(ATA_DMA_BOUNDARY - 1))) {
+            length += chunk;
+        } else {
+            if (entries == ATA_PRD_ENTRIES) {
+                return -1;
+            }
+            prd = &ata_prd_table[entries++];
+            prd->address = phys;
+            prd->flags = 0;
+            length = chunk;
+        }
+        prd->byte_count = (uint16_t)length;  /* 64 KiB wraps to 0, as the format wants */
+        buffer += chunk;
+        size -= chunk;
     }
+    
+    ata_prd_table[entries - 1].flags = ATA_PRD_EOT;
+    return 0;
 }
 
-void ata_write_sector(uint32_t lba, const uint8_t* buffer) {
-    ata_wait_ready();
+/*
+ * Identify the primary master and switch it to its largest READ/WRITE
+ * MULTIPLE block, so a transfer waits for DRQ once per block, not per sector.
+ */
+int ata_init(void) {
+    uint16_t identify[256];
     
-    /* Select drive */
-    outb(ATA_DRIVE_HEAD_PORT, 0xE0 | ((lba >> 24) & 0x0F));
+    ata_drive.present = 0;
+    ata_drive.lba48 = 0;
+    ata_drive.multiple = 0;
+    ata_drive.sectors = 0;
+    ata_drive.bm_base = 0;
     
-    /* Set sector count */
-    outb(ATA_SECTOR_COUNT_PORT, 1);
+    outb(ATA_CONTROL_PORT, ATA_CONTROL_NIEN);
+    outb(ATA_DRIVE_HEAD_PORT, 0xA0);
+    ata_delay400();
+    if (inb(ATA_STATUS_PORT) == 0xFF) {
+        return -1; /* Floating bus: no controller */
+    }
+    outb(ATA_SECTOR_COUNT_PORT, 0);
+    outb(ATA_SECTOR_NUMBER_PORT, 0);
+    outb(ATA_CYLINDER_LOW_PORT, 0);
+    outb(ATA_CYLINDER_HIGH_PORT, 0);
+    outb(ATA_COMMAND_PORT, ATA_CMD_IDENTIFY);
+    ata_delay400();
+    if (inb(ATA_STATUS_PORT) == 0) {
+        return -1; /* No drive */
+    }
     
-    /* Set LBA */
-    outb(ATA_SECTOR_NUMBER_PORT, lba & 0xFF);
-    outb(ATA_CYLINDER_LOW_PORT, (lba >> 8) & 0xFF);
-    outb(ATA_CYLINDER_HIGH_PORT, (lba >> 16) & 0xFF);
+    /* ATAPI and SATA devices abort IDENTIFY with a signature in the cylinder registers */
+    if (ata_poll(0) != 0 || inb(ATA_CYLINDER_LOW_PORT) || inb(ATA_CYLINDER_HIGH_PORT) || ata_poll(1) != 0) {
+        return -1;
+    }
+    insw(ATA_DATA_PORT, identify, 256);
     
-    /* Send write command */
-    outb(ATA_COMMAND_PORT, ATA_CMD_WRITE);
+    ata_drive.lba48 = (identify[83] >> 10) & 1;
+    if (ata_drive.lba48) {
+        ata_drive.sectors = (identify[102] || identify[103]) ? 0xFFFFFFFF :
+                            identify[100] | ((uint32_t)identify[101] << 16);
+    } else {
+        ata_drive.sectors = identify[60] | ((uint32_t)identify[61] << 16);
+    }
     
-    /* Wait for data ready */
-    ata_wait_ready();
+    /* Word 47: the largest DRQ block the drive supports */
+    uint8_t max_multiple = identify[47] & 0xFF;
+    if (max_multiple && ata_command(0, max_multiple, 0, ATA_CMD_SET_MULTIPLE) == 0 && ata_poll(0) == 0) {
+        ata_drive.multiple = max_multiple;
+    }
     
-    /* Write sector data */
-    for (int i = 0; i < SECTOR_SIZE; i += 2) {
-        uint16_t data = buffer[i] | (buffer[i + 1] << 8);
-        outw(ATA_DATA_PORT, data);
+    /* Word 49 bit 8: DMA supported; the controller must be able to master the bus */
+    if (identify[49] & (1 << 8)) {
+        ata_dma_init();
     }
     
-    /* Flush cache */
-    outb(ATA_COMMAND_PORT, 0xE7);
+    ata_drive.present = 1;
+    return 0;
 }
 
-/* Simulated disk operations */
-void simulated_disk_read(uint32_t lba, uint8_t* buffer) {
-    uint32_t offset = lba * SECTOR_SIZE;
-    if (offset + SECTOR_SIZE > DISK_SIZE) {
-        return; /* Beyond disk size */
+/*
+ * Sectors the next command can move from lba: up to 256, or 65536 with
+ * LBA48, which is also used past the LBA28 limit. 0 if lba is unreachable.
+ */
+static uint32_t ata_next_chunk(uint32_t lba, uint32_t count, int* lba48) {
+    *lba48 = ata_drive.lba48 && (count > ATA_LBA28_MAX_COUNT || lba + count > ATA_LBA28_LIMIT);
+    uint32_t chunk = *lba48 ? ATA_LBA48_MAX_COUNT : ATA_LBA28_MAX_COUNT;
+    if (chunk > count) {
+        chunk = count;
+    }
+    if (!*lba48 && lba + chunk > ATA_LBA28_LIMIT) {
+        return 0;
+    }
+    return chunk;
+}
+
+/* PIO: each DRQ block goes straight between the data port and the buffer */
+static int ata_pio_transfer(uint32_t lba, uint32_t count, uint8_t* buffer, int write) {
+    while (count) {
+        int lba48;
+        uint32_t chunk = ata_next_chunk(lba, count, &lba48);
+        if (!chunk) {
+            return -1;
+        }
+        
+        uint8_t command;
+        if (ata_drive.multiple) {
+            command = write ? (lba48 ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_WRITE_MULTIPLE) :
+                              (lba48 ? ATA_CMD_READ_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE);
+        } else {
+            command = write ? (lba48 ? ATA_CMD_WRITE_EXT : ATA_CMD_WRITE) :
+                              (lba48 ? ATA_CMD_READ_EXT : ATA_CMD_READ);
+        }
+        if (ata_command(lba, chunk, lba48, command) != 0) {
+            return -1;
+        }
+        
+        uint32_t block = ata_drive.multiple ? ata_drive.multiple : 1;
+        for (uint32_t done = 0; done < chunk; done += block) {
+            uint32_t sectors = chunk - done < block ? chunk - done : block;
+            if (ata_poll(1) != 0) {
+                return -1;
+            }
+            if (write) {
+                outsw(ATA_DATA_PORT, buffer, sectors * SECTOR_SIZE / 2);
+            } else {
+                insw(ATA_DATA_PORT, buffer, sectors * SECTOR_SIZE / 2);
+            }
+            buffer += sectors * SECTOR_SIZE;
+        }
+        
+        /* A write has finished once the drive drops BSY after the last block */
+        if (write && ata_poll(0) != 0) {
+            return -1;
+        }
+        lba += chunk;
+        count -= chunk;
     }
+    return 0;
+}
+
+/*
+ * Bus-master DMA: the controller moves the data while the caller sleeps
+ * until IRQ 14. Commands are capped at 256 sectors so the PRD table always
+ * has room for a buffer of scattered pages.
+ */
+static int ata_dma_transfer(uint32_t lba, uint32_t count, uint8_t* buffer, int write) {
+    uint16_t bm = ata_drive.bm_base;
+    uint8_t direction = write ? 0 : ATA_BM_CMD_READ;
     
-    for (int i = 0; i < SECTOR_SIZE; i++) {
-        buffer[i] = disk_storage[offset + i];
+    while (count) {
+        int lba48;
+        uint32_t chunk = ata_next_chunk(lba, count, &lba48);
+        if (chunk > ATA_LBA28_MAX_COUNT) {
+            chunk = ATA_LBA28_MAX_COUNT;
+        }
+        if (!chunk || ata_prd_build(buffer, chunk * SECTOR_SIZE) != 0) {
+            return -1;
+        }
+        
+        outb(bm + ATA_BM_COMMAND, direction);
+        outl(bm + ATA_BM_PRDT, virt_to_phys(ata_prd_table));
+        outb(bm + ATA_BM_STATUS, ATA_BM_STATUS_IRQ | ATA_BM_STATUS_ERROR);
+        outb(ATA_CONTROL_PORT, 0);      /* Completion raises INTRQ */
+        
+        uint32_t seen = ata_dma_queue.wakeups;
+        uint8_t command = write ? (lba48 ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA) :
+                                  (lba48 ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA);
+        int result = ata_command(lba, chunk, lba48, command);
+        if (result == 0) {
+            outb(bm + ATA_BM_COMMAND, direction | ATA_BM_CMD_START);
+            result = sleep_on(&ata_dma_queue, seen, ATA_DMA_TIMEOUT_TICKS, ata_dma_interrupt) == 0 ? ata_dma_result : -1;
+        }
+        
+        outb(bm + ATA_BM_COMMAND, 0);
+        outb(ATA_CONTROL_PORT, ATA_CONTROL_NIEN);
+        if (result != 0) {
+            return -1;
+        }
+        buffer += chunk * SECTOR_SIZE;
+        lba += chunk;
+        count -= chunk;
     }
+    return 0;
 }
 
-void simulated_disk_write(uint32_t lba, const uint8_t* buffer) {
-    uint32_t offset = lba * SECTOR_SIZE;
-    if (offset + SECTOR_SIZE > DISK_SIZE) {
-        return; /* Beyond disk size */
+/*
+ * Move count sectors at lba, by DMA when allowed, the controller can master
+ * the bus and the buffer is word aligned, else by PIO. Writes flush the
+ * drive's cache once per request, not per sector.
+ */
+static int ata_transfer_mode(uint32_t lba, uint32_t count, uint8_t* buffer, int write, int dma) {
+    if (!ata_drive.present || lba + count < lba || lba + count > ata_drive.sectors) {
+        return -1;
     }
     
-    for (int i = 0; i < SECTOR_SIZE; i++) {
-        disk_storage[offset + i] = buffer[i];
+    int result;
+    if (dma && ata_drive.bm_base && !(virt_to_phys(buffer) & 1)) {
+        result = ata_dma_transfer(lba, count, buffer, write);
+    } else {
+        result = ata_pio_transfer(lba, count, buffer, write);
     }
+    
+    if (result == 0 && write) {
+        outb(ATA_COMMAND_PORT, ata_drive.lba48 ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE);
+        ata_delay400();
+        result = ata_poll(0);
+    }
+    return result;
+}
+
+static int ata_transfer(uint32_t lba, uint32_t count, uint8_t* buffer, int write) {
+    return ata_transfer_mode(lba, count, buffer, write, 1);
+}
+
+int ata_read_sectors(uint32_t lba, uint32_t count, uint8_t* buffer) {
+    return ata_transfer(lba, count, buffer, 0);
+}
+
+int ata_write_sectors(uint32_t lba, uint32_t count, const uint8_t* buffer) {
+    /* The buffer is only read; ata_transfer shares one loop for both directions */
+    return ata_transfer(lba, count, (uint8_t*)buffer, 1);
+}
+
+void ata_read_sector(uint32_t lba, uint8_t* buffer) {
+    ata_read_sectors(lba, 1, buffer);
+}
+
+void ata_write_sector(uint32_t lba, const uint8_t* buffer) {
+    ata_write_sectors(lba, 1, buffer);
+}
+
+/* Simulated disk operations: sector access to the boot RAM disk */
+void simulated_disk_read(uint32_t lba, uint8_t* buffer) {
+    ramdisk_read(blk_ram, lba, 1, buffer);
+}
+
+void simulated_disk_write(uint32_t lba, const uint8_t* buffer) {
+    ramdisk_write(blk_ram, lba, 1, buffer);
 }
 
 void disk_init(void) {
-    /* Initialize simulated disk with zeros */
-    for (int i = 0; i < DISK_SIZE; i++) {
-        disk_storage[i] = 0;
-    }
+    /* Frames for the RAM disks; block_init creates them, empty */
+    ramdisk_init();
 }
 
 /* Process management stubs (required for compatibility) */
@@ -418,16 +853,37 @@ void process_kill(int pid) {
     (void)pid;
 }
 
-void process_switch(void) {
-    /* Simple stub */
+void process_switch(uint32_t pid) {
+    (void)pid;
 }
 
 struct process* process_create(void) {
     return NULL;
 }
 
-void* paging_alloc_frame(void) {
-    return NULL;
+/*
+ * Physical frames for this unpaged stage: blocks of 2^order pages, each
+ * aligned to its size, handed out in address order from the first page
+ * past the kernel image and never taken back
+ */
+static uint32_t frames_next;
+
+uint32_t paging_frames_end(void) {
+    if (!frames_next) {
+        frames_next = ((uint32_t)_end + PAGE_SIZE - 1) & ~(uint32_t)(PAGE_SIZE - 1);
+    }
+    return frames_next;
+}
+
+uint32_t paging_alloc_frames(uint32_t order) {
+    uint32_t size = (uint32_t)PAGE_SIZE << order;
+    uint32_t frame = (paging_frames_end() + size - 1) & ~(size - 1);
+    frames_next = frame + size;
+    return frame;
+}
+
+uint32_t paging_alloc_frame(void) {
+    return paging_alloc_frames(0);
 }
 
 void paging_map_page(void* phys, void* virt) {
@@ -435,6 +891,33 @@ void paging_map_page(void* phys, void* virt) {
     (void)virt;
 }
 
+int paging_handle_fault(uint32_t faulting_address, uint32_t error_code) {
+    (void)faulting_address;
+    (void)error_code;
+    return 0;
+}
+
+uint32_t process_fork(void) {
+    return (uint32_t)-1;            /* SYSCALL_ERROR: no processes to fork in this stage */
+}
+
+void process_sleep(uint32_t ticks);
+
+/* Timer wheel entry (must match struct timer in timer_wheel.c) */
+struct timer {
+    struct timer* next;
+    struct timer** pprev;
+    uint32_t expires;
+    void (*callback)(void* data);
+    void* data;
+};
+
+/* Timer wheel functions (timer_wheel.c) */
+extern void timer_wheel_init(uint32_t now);
+extern void timer_setup(struct timer* timer, void (*callback)(void* data), void* data);
+extern void timer_add(struct timer* timer, uint32_t expires);
+extern void timer_wheel_tick(uint32_t now);
+
 /* Timer Driver */
 #define PIT_CHANNEL0 0x40
 #define PIT_COMMAND_PORT 0x43
@@ -455,25 +938,45 @@ void timer_init(uint32_t frequency) {
     /* Send divisor */
     outb(PIT_CHANNEL0, divisor & 0xFF);
     outb(PIT_CHANNEL0, (divisor >> 8) & 0xFF);
+    
+    timer_wheel_init(timer_ticks);
 }
 
 void timer_handler(void) {
     timer_ticks++;
+    timer_wheel_tick(timer_ticks);
+    console_flush();
 }
 
 uint32_t timer_get_ticks(void) {
     return timer_ticks;
 }
 
-void timer_sleep(uint32_t milliseconds) {
-    uint32_t start_ticks = timer_ticks;
-    uint32_t ticks_to_wait = (milliseconds * timer_frequency) / 1000;
+/* Set the flag a sleeper halts on */
+static void timer_sleep_wake(void* data) {
+    *(volatile int*)data = 1;
+}
+
+/* No scheduler in this stage: halt until the wheel fires the wake-up timer */
+void process_sleep(uint32_t ticks) {
+    if (ticks == 0) {
+        return;
+    }
+    
+    volatile int woken = 0;
+    struct timer wake;
+    timer_setup(&wake, timer_sleep_wake, (void*)&woken);
+    timer_add(&wake, timer_ticks + ticks);
     
-    while (timer_ticks - start_ticks < ticks_to_wait) {
-        /* Busy wait */
+    while (!woken) {
+        __asm__ __volatile__("hlt");
     }
 }
 
+void timer_sleep(uint32_t milliseconds) {
+    process_sleep((milliseconds * timer_frequency) / 1000);
+}
+
 /* Test Functions */
 void test_keyboard_driver(void) {
     terminal_setcolor(VGA_COLOR_LIGHT_CYAN);
@@ -498,6 +1001,10 @@ void test_mouse_driver(void) {
     terminal_writestring("=== Testing Mouse Driver ===\n");
     terminal_setcolor(VGA_COLOR_LIGHT_GREY);
     
+    /* First user: probe it now if the idle loop has not yet */
+    if (mouse_driver >= 0) {
+        initcall_require((uint32_t)mouse_driver);
+    }
     if (mouse_initialized) {
         terminal_writestring("Mouse initialized successfully\n");
         terminal_writestring("Move mouse to see packet data\n");
@@ -583,90 +1090,1219 @@ void test_disk_driver(void) {
     terminal_setcolor(VGA_COLOR_LIGHT_GREY);
 }
 
-void test_timer_driver(void) {
+/* Multi-sector PIO against the last sectors of a real drive, restored afterwards */
+void test_ata_multisector(void) {
     terminal_setcolor(VGA_COLOR_LIGHT_CYAN);
-    terminal_writestring("=== Testing Timer Driver ===\n");
+    terminal_writestring("=== Testing ATA Multi-Sector PIO ===\n");
     terminal_setcolor(VGA_COLOR_LIGHT_GREY);
     
-    uint32_t start_ticks = timer_get_ticks();
-    terminal_writestring("Testing timer sleep for 1 second...\n");
+    if (!ata_drive.present || ata_drive.sectors < 64) {
+        terminal_writestring("No ATA drive on the primary channel, skipped\n");
+        return;
+    }
+    terminal_writestring(ata_drive.multiple ? "READ/WRITE MULTIPLE: on" : "READ/WRITE MULTIPLE: off");
+    terminal_writestring(ata_drive.lba48 ? ", LBA48\n" : ", LBA28\n");
     
-    timer_sleep(1000); /* Sleep for 1 second */
+    static uint8_t saved[64 * SECTOR_SIZE];
+    static uint8_t pattern[64 * SECTOR_SIZE];
+    uint8_t sector[SECTOR_SIZE];
+    uint32_t lba = ata_drive.sectors - 64;
+    int ok = ata_read_sectors(lba, 64, saved) == 0;
     
-    uint32_t end_ticks = timer_get_ticks();
-    uint32_t elapsed = end_ticks - start_ticks;
+    /* One multi-sector write, read back both ways */
+    for (uint32_t i = 0; i < sizeof(pattern); i++) {
+        pattern[i] = (uint8_t)(i * 7 + i / SECTOR_SIZE);
+    }
+    ok = ok && ata_write_sectors(lba, 64, pattern) == 0;
+    for (uint32_t i = 0; ok && i < 64; i++) {
+        ata_read_sector(lba + i, sector);
+        for (uint32_t j = 0; j < SECTOR_SIZE; j++) {
+            ok = ok && sector[j] == pattern[i * SECTOR_SIZE + j];
+        }
+    }
+    static uint8_t readback[64 * SECTOR_SIZE];
+    ok = ok && ata_read_sectors(lba, 64, readback) == 0;
+    for (uint32_t i = 0; ok && i < sizeof(readback); i++) {
+        ok = readback[i] == pattern[i];
+    }
     
-    terminal_writestring("Expected ticks: ");
-    terminal_putchar('0' + timer_frequency / 100);
-    terminal_putchar('0' + (timer_frequency / 10) % 10);
-    terminal_putchar('0' + timer_frequency % 10);
-    terminal_writestring(", Actual ticks: ");
+    /* Past the end of the drive is refused */
+    ok = ok && ata_read_sectors(lba, 65, readback) == -1;
     
-    /* Display elapsed ticks */
-    if (elapsed < 100) {
-        terminal_putchar('0' + elapsed / 10);
-        terminal_putchar('0' + elapsed % 10);
-    } else {
-        terminal_putchar('0' + elapsed / 100);
-        terminal_putchar('0' + (elapsed / 10) % 10);
-        terminal_putchar('0' + elapsed % 10);
-    }
-    terminal_putchar('\n');
+    ata_write_sectors(lba, 64, saved);
     
-    if (elapsed >= timer_frequency / 2 && elapsed <= timer_frequency * 2) {
+    if (ok) {
         terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
-        terminal_writestring("Timer driver test PASSED\n");
+        terminal_writestring("ATA multi-sector test PASSED\n");
     } else {
         terminal_setcolor(VGA_COLOR_LIGHT_RED);
-        terminal_writestring("Timer driver test FAILED\n");
+        terminal_writestring("ATA multi-sector test FAILED\n");
     }
     terminal_setcolor(VGA_COLOR_LIGHT_GREY);
 }
 
-/* Main kernel function */
-void kernel_main(void) {
-    terminal_initialize();
-    terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
-    terminal_writestring("=== Tiny Operating System - Phase 8 Device Drivers ===\n");
+void test_ata_dma(void) {
+    terminal_setcolor(VGA_COLOR_LIGHT_CYAN);
+    terminal_writestring("=== Testing ATA Bus-Master DMA ===\n");
     terminal_setcolor(VGA_COLOR_LIGHT_GREY);
     
-    /* Initialize device drivers */
-    terminal_writestring("Initializing device drivers...\n");
+    if (!ata_drive.present || !ata_drive.bm_base || ata_drive.sectors < 300) {
+        terminal_writestring("No bus-master IDE controller, skipped\n");
+        return;
+    }
     
-    /* Initialize keyboard */
-    terminal_writestring("Keyboard: ");
-    terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
-    terminal_writestring("OK\n");
-    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+    /* 300 sectors: two commands, the PRD table spanning several 64 KiB windows */
+    static uint8_t saved[300 * SECTOR_SIZE];
+    static uint8_t pattern[300 * SECTOR_SIZE];
+    static uint8_t readback[300 * SECTOR_SIZE + 1];
+    uint32_t lba = ata_drive.sectors - 300;
+    int ok = ata_read_sectors(lba, 300, saved) == 0;
     
-    /* Initialize mouse */
-    terminal_writestring("Mouse: ");
-    mouse_init();
-    terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
-    terminal_writestring("OK\n");
-    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+    for (uint32_t i = 0; i < sizeof(pattern); i++) {
+        pattern[i] = (uint8_t)(i * 13 + i / SECTOR_SIZE);
+    }
+    ok = ok && ata_write_sectors(lba, 300, pattern) == 0;
     
-    /* Initialize disk */
-    terminal_writestring("Disk: ");
-    disk_init();
-    terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
-    terminal_writestring("OK\n");
-    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+    /* Read back by DMA, then through an odd address that forces PIO */
+    ok = ok && ata_read_sectors(lba, 300, readback) == 0;
+    for (uint32_t i = 0; ok && i < sizeof(pattern); i++) {
+        ok = readback[i] == pattern[i];
+    }
+    ok = ok && ata_read_sectors(lba, 300, readback + 1) == 0;
+    for (uint32_t i = 0; ok && i < sizeof(pattern); i++) {
+        ok = readback[i + 1] == pattern[i];
+    }
     
-    /* Initialize timer */
-    terminal_writestring("Timer: ");
-    timer_init(timer_frequency);
-    terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
-    terminal_writestring("OK\n");
+    ata_write_sectors(lba, 300, saved);
+    
+    if (ok) {
+        terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
+        terminal_writestring("ATA DMA test PASSED\n");
+    } else {
+        terminal_setcolor(VGA_COLOR_LIGHT_RED);
+        terminal_writestring("ATA DMA test FAILED\n");
+    }
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+}
+
+/* DMA memory (dma.c) */
+extern void dma_init(void);
+extern void* dma_alloc_coherent(uint32_t size, uint32_t limit, uint32_t* handle);
+extern void dma_free_coherent(void* address);
+extern uint32_t dma_map_single(void* buffer, uint32_t size, uint32_t direction, uint32_t limit);
+extern void dma_unmap_single(uint32_t bus, uint32_t size, uint32_t direction);
+extern uint32_t dma_get_stats(uint32_t* bounced);
+
+/* Directions (must match dma.c) */
+#define DMA_TO_DEVICE 1
+#define DMA_FROM_DEVICE 2
+#define DMA_BIDIRECTIONAL 3
+#define DMA_MAPPING_ERROR 0
+
+void test_dma(void) {
+    terminal_setcolor(VGA_COLOR_LIGHT_CYAN);
+    terminal_writestring("=== Testing DMA Memory ===\n");
     terminal_setcolor(VGA_COLOR_LIGHT_GREY);
     
-    terminal_putchar('\n');
+    uint32_t bounced_before;
+    uint32_t free_before = dma_get_stats(&bounced_before);
     
-    /* Test all device drivers */
+    /* Descriptor-sized chunks: distinct, aligned to their size, zeroed, reused once freed */
+    uint32_t handle_a, handle_b;
+    uint8_t* a = (uint8_t*)dma_alloc_coherent(100, 0xFFFFFFFF, &handle_a);
+    uint8_t* b = (uint8_t*)dma_alloc_coherent(100, 0xFFFFFFFF, &handle_b);
+    int ok = a && b && a != b && handle_a == virt_to_phys(a) && !(handle_a & 127) && !(handle_b & 127);
+    for (uint32_t i = 0; ok && i < 100; i++) {
+        ok = !a[i];
+    }
+    dma_free_coherent(b);
+    ok = ok && dma_alloc_coherent(100, 0xFFFFFFFF, NULL) == b;
+    dma_free_coherent(b);
+    dma_free_coherent(a);
+    
+    /* Three pages come as a 16KB block, which crosses no 64 KiB boundary */
+    uint32_t handle;
+    void* block = dma_alloc_coherent(3 * PAGE_SIZE, 0xFFFFFFFF, &handle);
+    ok = ok && block && !(handle & (4 * PAGE_SIZE - 1)) &&
+         (handle & ~(ATA_DMA_BOUNDARY - 1)) == ((handle + 3 * PAGE_SIZE - 1) & ~(ATA_DMA_BOUNDARY - 1));
+    dma_free_coherent(block);
+    
+    /* A buffer the device reaches maps to itself */
+    static uint8_t direct[256];
+    ok = ok && dma_map_single(direct, sizeof(direct), DMA_TO_DEVICE, 0xFFFFFFFF) == virt_to_phys(direct);
+    
+    /*
+     * A buffer above the device's limit goes through a bounce buffer: the
+     * limit is set to end at a page freed below it, the "device" overwrites
+     * the bounce buffer, and unmapping brings that back
+     */
+    uint8_t* low = (uint8_t*)dma_alloc_coherent(PAGE_SIZE, 0xFFFFFFFF, NULL);
+    uint8_t* high = (uint8_t*)dma_alloc_coherent(PAGE_SIZE, 0xFFFFFFFF, NULL);
+    ok = ok && low && high && high > low;
+    if (ok) {
+        uint32_t limit = virt_to_phys(low) + PAGE_SIZE - 1;
+        for (uint32_t i = 0; i < PAGE_SIZE; i++) {
+            high[i] = (uint8_t)(i * 7);
+        }
+        dma_free_coherent(low);
+        uint32_t bus = dma_map_single(high, PAGE_SIZE, DMA_BIDIRECTIONAL, limit);
+        ok = bus != DMA_MAPPING_ERROR && bus != virt_to_phys(high) && bus + PAGE_SIZE - 1 <= limit;
+        uint8_t* bounce = (uint8_t*)(uintptr_t)bus;
+        for (uint32_t i = 0; ok && i < PAGE_SIZE; i++) {
+            ok = bounce[i] == (uint8_t)(i * 7);
+            bounce[i] = (uint8_t)(i * 3);
+        }
+        if (bus != DMA_MAPPING_ERROR) {
+            dma_unmap_single(bus, PAGE_SIZE, DMA_BIDIRECTIONAL);
+        }
+        for (uint32_t i = 0; ok && i < PAGE_SIZE; i++) {
+            ok = high[i] == (uint8_t)(i * 3);
+        }
+    } else {
+        dma_free_coherent(low);
+    }
+    dma_free_coherent(high);
+    
+    /* Everything back but the page the chunks were cut from */
+    uint32_t bounced;
+    uint32_t free_after = dma_get_stats(&bounced);
+    ok = ok && bounced == bounced_before + 1 && free_after + 1 >= free_before;
+    
+    if (ok) {
+        terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
+        terminal_writestring("DMA memory test PASSED\n");
+    } else {
+        terminal_setcolor(VGA_COLOR_LIGHT_RED);
+        terminal_writestring("DMA memory test FAILED\n");
+    }
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+}
+
+/* AHCI driver (ahci.c) */
+extern int ahci_init(void);
+extern uint32_t ahci_disks_found(void);
+extern uint32_t ahci_disk_sectors(uint32_t disk);
+extern uint32_t ahci_queue_depth(uint32_t disk);
+extern uint32_t ahci_max_queued(uint32_t disk);
+extern int ahci_submit(uint32_t disk, uint32_t lba, uint32_t count, void* buffer, int write,
+                       void (*done)(void* context, int status), void* context);
+extern void ahci_poll(void);
+extern int ahci_read_sectors(uint32_t disk, uint32_t lba, uint32_t count, void* buffer);
+extern int ahci_write_sectors(uint32_t disk, uint32_t lba, uint32_t count, const void* buffer);
+
+#define AHCI_TEST_REQUESTS 32
+#define AHCI_TEST_SECTORS 8
+
+static volatile uint32_t ahci_test_done;
+static volatile uint32_t ahci_test_failed;
+
+static void ahci_test_complete(void* context, int status) {
+    (void)context;
+    ahci_test_done++;
+    if (status != 0) {
+        ahci_test_failed++;
+    }
+}
+
+void test_ahci_ncq(void) {
+    terminal_setcolor(VGA_COLOR_LIGHT_CYAN);
+    terminal_writestring("=== Testing AHCI Native Command Queuing ===\n");
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+    
+    uint32_t span = AHCI_TEST_REQUESTS * AHCI_TEST_SECTORS;
+    if (!ahci_disks_found() || ahci_disk_sectors(0) < span) {
+        terminal_writestring("No AHCI disk, skipped\n");
+        return;
+    }
+    terminal_writestring("Queue depth: ");
+    terminal_writedec(ahci_queue_depth(0));
+    terminal_putchar('\n');
+    
+    /* Tag each region of the end of the disk with its number */
+    static uint8_t saved[AHCI_TEST_REQUESTS * AHCI_TEST_SECTORS * SECTOR_SIZE];
+    static uint8_t buffers[AHCI_TEST_REQUESTS][AHCI_TEST_SECTORS * SECTOR_SIZE];
+    uint32_t base = ahci_disk_sectors(0) - span;
+    int ok = ahci_read_sectors(0, base, span, saved) == 0;
+    for (uint32_t i = 0; i < AHCI_TEST_REQUESTS; i++) {
+        for (uint32_t j = 0; j < sizeof(buffers[i]); j++) {
+            buffers[i][j] = (uint8_t)(i * 31 + j);
+        }
+    }
+    ok = ok && ahci_write_sectors(0, base, span, buffers) == 0;
+    
+    /* Random reads, as many in flight as the disk takes; each lands in its own buffer */
+    for (uint32_t i = 0; i < sizeof(buffers); i++) {
+        ((uint8_t*)buffers)[i] = 0;
+    }
+    ahci_test_done = 0;
+    ahci_test_failed = 0;
+    uint32_t submitted = 0;
+    for (uint32_t spins = 0; ok && ahci_test_done < AHCI_TEST_REQUESTS && spins < 10000000; spins++) {
+        if (submitted < AHCI_TEST_REQUESTS) {
+            uint32_t region = (submitted * 13 + 7) % AHCI_TEST_REQUESTS;
+            if (ahci_submit(0, base + region * AHCI_TEST_SECTORS, AHCI_TEST_SECTORS, buffers[region], 0,
+                            ahci_test_complete, NULL) >= 0) {
+                submitted++;
+                continue;
+            }
+        }
+        ahci_poll();
+    }
+    ok = ok && ahci_test_done == AHCI_TEST_REQUESTS && !ahci_test_failed;
+    for (uint32_t i = 0; ok && i < AHCI_TEST_REQUESTS; i++) {
+        for (uint32_t j = 0; ok && j < sizeof(buffers[i]); j++) {
+            ok = buffers[i][j] == (uint8_t)(i * 31 + j);
+        }
+    }
+    terminal_writestring("Deepest queue: ");
+    terminal_writedec(ahci_max_queued(0));
+    terminal_putchar('\n');
+    
+    ahci_write_sectors(0, base, span, saved);
+    
+    if (ok) {
+        terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
+        terminal_writestring("AHCI NCQ test PASSED\n");
+    } else {
+        terminal_setcolor(VGA_COLOR_LIGHT_RED);
+        terminal_writestring("AHCI NCQ test FAILED\n");
+    }
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+}
+
+/* Block I/O request (must match struct bio in block.c) */
+struct bio {
+    struct bio* next;
+    uint32_t sector;
+    uint32_t count;
+    uint8_t* buffer;
+    uint8_t write;
+    int status;
+    void (*done)(struct bio* bio);
+    void* private;
+};
+
+/* Block layer (block.c) */
+extern void blk_init(void);
+extern int blk_register(const char* name, uint32_t sectors, uint32_t depth, uint32_t max_sectors,
+                        int (*transfer)(uint32_t sector, uint32_t count, uint8_t* buffer, int write, void* cookie),
+                        void (*poll)(void));
+extern void blk_submit_bio(uint32_t device, struct bio* bio);
+extern void blk_complete(void* cookie, int status);
+extern void blk_plug(uint32_t device);
+extern void blk_unplug(uint32_t device);
+extern int blk_read(uint32_t device, uint32_t sector, uint32_t count, void* buffer);
+extern uint32_t blk_sectors(uint32_t device);
+extern void blk_get_statistics(uint32_t device, uint32_t* bios, uint32_t* merges,
+                               uint32_t* dispatched, uint32_t* dispatched_sectors);
+
+/* Backends: the synchronous ones complete before returning */
+static int ata_blk_transfer(uint32_t sector, uint32_t count, uint8_t* buffer, int write, void* cookie) {
+    blk_complete(cookie, ata_transfer(sector, count, buffer, write));
+    return 0;
+}
+
+static int ata_pio_blk_transfer(uint32_t sector, uint32_t count, uint8_t* buffer, int write, void* cookie) {
+    blk_complete(cookie, ata_transfer_mode(sector, count, buffer, write, 0));
+    return 0;
+}
+
+static void ahci_blk_done(void* context, int status) {
+    blk_complete(context, status);
+}
+
+static int ahci_blk_transfer(uint32_t sector, uint32_t count, uint8_t* buffer, int write, void* cookie) {
+    return ahci_submit(0, sector, count, buffer, write, ahci_blk_done, cookie) < 0 ? -1 : 0;
+}
+
+static void block_init(void) {
+    blk_init();
+    blk_ram = ramdisk_create("ram0", DISK_SIZE / SECTOR_SIZE, 1);
+    blk_scratch = ramdisk_create("ram1", DISK_SIZE / SECTOR_SIZE, 0);
+    blk_lfs = ramdisk_create("ram2", LFS_DISK_SIZE / SECTOR_SIZE, 0);
+    if (ata_drive.present) {
+        blk_ata = blk_register("ata0", ata_drive.sectors, 1, 0, ata_blk_transfer, NULL);
+    }
+    if (ata_drive.present && ata_drive.bm_base) {
+        blk_ata_pio = blk_register("ata0pio", ata_drive.sectors, 1, 0, ata_pio_blk_transfer, NULL);
+    }
+    if (ahci_disks_found()) {
+        /* Requests fit a command's PRD table: 64 sectors */
+        blk_ahci = blk_register("ahci0", ahci_disk_sectors(0), ahci_queue_depth(0), 64,
+                                ahci_blk_transfer, ahci_poll);
+    }
+}
+
+static volatile uint32_t blk_test_done;
+
+static void blk_test_complete(struct bio* bio) {
+    (void)bio;
+    blk_test_done++;
+}
+
+void test_block_layer(void) {
+    terminal_setcolor(VGA_COLOR_LIGHT_CYAN);
+    terminal_writestring("=== Testing Block Request Queue ===\n");
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+    
+    /* 32 one-sector writes from scattered buffers, submitted backwards under a plug */
+    static struct bio bios[32];
+    static uint8_t buffers[32][SECTOR_SIZE * 2];
+    for (int i = 31; i >= 0; i--) {
+        for (int j = 0; j < SECTOR_SIZE; j++) {
+            buffers[i][j] = (uint8_t)(i * 5 + j);
+        }
+    }
+    uint32_t before;
+    blk_get_statistics(blk_ram, NULL, NULL, &before, NULL);
+    
+    blk_test_done = 0;
+    blk_plug(blk_ram);
+    for (int i = 31; i >= 0; i--) {
+        bios[i].sector = 200 + i;
+        bios[i].count = 1;
+        bios[i].buffer = buffers[i];
+        bios[i].write = 1;
+        bios[i].done = blk_test_complete;
+        blk_submit_bio(blk_ram, &bios[i]);
+    }
+    int ok = blk_test_done == 0;        /* Nothing moves while plugged */
+    blk_unplug(blk_ram);
+    
+    uint32_t after;
+    blk_get_statistics(blk_ram, NULL, NULL, &after, NULL);
+    ok = ok && blk_test_done == 32 && after - before == 1;
+    terminal_writestring("32 bios, device transfers: ");
+    terminal_writedec(after - before);
+    terminal_putchar('\n');
+    
+    /* The merged write landed in order; read it back through the queue */
+    static uint8_t readback[32 * SECTOR_SIZE];
+    ok = ok && blk_read(blk_ram, 200, 32, readback) == 0;
+    for (int i = 0; ok && i < 32; i++) {
+        ok = bios[i].status == 0;
+        for (int j = 0; ok && j < SECTOR_SIZE; j++) {
+            ok = readback[i * SECTOR_SIZE + j] == (uint8_t)(i * 5 + j);
+        }
+    }
+    
+    if (ok) {
+        terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
+        terminal_writestring("Block layer test PASSED\n");
+    } else {
+        terminal_setcolor(VGA_COLOR_LIGHT_RED);
+        terminal_writestring("Block layer test FAILED\n");
+    }
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+}
+
+/* Buffer cache (buffer_cache.c) */
+struct buffer;
+extern void bcache_init(void);
+extern struct buffer* bread(uint32_t device, uint32_t block);
+extern void brelse(struct buffer* buf);
+extern void bmark_dirty(struct buffer* buf);
+extern void* bdata(struct buffer* buf);
+extern int bsync(void);
+extern void bcache_get_statistics(uint32_t* hits, uint32_t* misses, uint32_t* evictions, uint32_t* writebacks);
+
+/* Readahead state of one open file (must match struct file_ra_state in buffer_cache.c) */
+struct file_ra_state {
+    uint32_t start;
+    uint32_t size;
+    uint32_t marker;
+    uint32_t prev;
+};
+extern void file_ra_init(struct file_ra_state* ra);
+extern struct buffer* bread_ra(struct file_ra_state* ra, uint32_t device, uint32_t block);
+extern void bcache_get_ra_statistics(uint32_t* prefetched, uint32_t* used, uint32_t* wasted);
+
+void test_buffer_cache(void) {
+    terminal_setcolor(VGA_COLOR_LIGHT_CYAN);
+    terminal_writestring("=== Testing Buffer Cache ===\n");
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+    
+    uint32_t hits, misses, device_before, device_after;
+    bcache_get_statistics(&hits, &misses, NULL, NULL);
+    blk_get_statistics(blk_scratch, NULL, NULL, &device_before, NULL);
+    
+    /* Walk 16 blocks twice, as a directory listing rereads its metadata */
+    int ok = 1;
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t block = 400; ok && block < 416; block++) {
+            struct buffer* buf = bread(blk_scratch, block);
+            ok = buf != NULL;
+            if (buf) {
+                brelse(buf);
+            }
+        }
+    }
+    uint32_t hits_after, misses_after;
+    bcache_get_statistics(&hits_after, &misses_after, NULL, NULL);
+    blk_get_statistics(blk_scratch, NULL, NULL, &device_after, NULL);
+    ok = ok && misses_after - misses == 16 && hits_after - hits == 16 && device_after - device_before == 16;
+    terminal_writestring("Second pass hits: ");
+    terminal_writedec(hits_after - hits);
+    terminal_writestring(" of 16\n");
+    
+    /* Writes stay in RAM until a sync, which sends them as one request */
+    for (uint32_t block = 400; ok && block < 416; block++) {
+        struct buffer* buf = bread(blk_scratch, block);
+        ok = buf != NULL;
+        if (buf) {
+            ((uint8_t*)bdata(buf))[0] = (uint8_t)block;
+            bmark_dirty(buf);
+            brelse(buf);
+        }
+    }
+    uint8_t sector[SECTOR_SIZE];
+    ramdisk_read(blk_scratch, 400 * 2, 1, sector);
+    ok = ok && sector[0] != (uint8_t)400;
+    
+    blk_get_statistics(blk_scratch, NULL, NULL, &device_before, NULL);
+    ok = ok && bsync() == 0;
+    blk_get_statistics(blk_scratch, NULL, NULL, &device_after, NULL);
+    ok = ok && device_after - device_before == 1;
+    for (uint32_t block = 400; ok && block < 416; block++) {
+        ramdisk_read(blk_scratch, block * 2, 1, sector);
+        ok = sector[0] == (uint8_t)block;
+    }
+    
+    if (ok) {
+        terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
+        terminal_writestring("Buffer cache test PASSED\n");
+    } else {
+        terminal_setcolor(VGA_COLOR_LIGHT_RED);
+        terminal_writestring("Buffer cache test FAILED\n");
+    }
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+}
+
+void test_readahead(void) {
+    terminal_setcolor(VGA_COLOR_LIGHT_CYAN);
+    terminal_writestring("=== Testing Readahead ===\n");
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+    
+    struct file_ra_state ra;
+    file_ra_init(&ra);
+    uint32_t prefetched, used, device_before, device_after;
+    bcache_get_ra_statistics(&prefetched, &used, NULL);
+    blk_get_statistics(blk_scratch, NULL, NULL, &device_before, NULL);
+    
+    /* Stream 200 blocks: only the first should wait for the device */
+    int ok = 1;
+    for (uint32_t block = 600; ok && block < 800; block++) {
+        struct buffer* buf = bread_ra(&ra, blk_scratch, block);
+        ok = buf != NULL;
+        if (buf) {
+            brelse(buf);
+        }
+    }
+    uint32_t prefetched_after, used_after;
+    bcache_get_ra_statistics(&prefetched_after, &used_after, NULL);
+    blk_get_statistics(blk_scratch, NULL, NULL, &device_after, NULL);
+    ok = ok && used_after - used >= 199 && device_after - device_before <= 16;
+    terminal_writestring("Sequential: ");
+    terminal_writedec(device_after - device_before);
+    terminal_writestring(" device requests for 200 blocks\n");
+    
+    /* Jumping around collapses the window: nothing more is prefetched */
+    static const uint16_t random_blocks[] = { 950, 900, 1000, 920, 980, 910 };
+    bcache_get_ra_statistics(&prefetched, NULL, NULL);
+    for (uint32_t i = 0; ok && i < sizeof(random_blocks) / sizeof(random_blocks[0]); i++) {
+        struct buffer* buf = bread_ra(&ra, blk_scratch, random_blocks[i]);
+        ok = buf != NULL;
+        if (buf) {
+            brelse(buf);
+        }
+    }
+    bcache_get_ra_statistics(&prefetched_after, NULL, NULL);
+    ok = ok && prefetched_after == prefetched && ra.size == 0;
+    
+    if (ok) {
+        terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
+        terminal_writestring("Readahead test PASSED\n");
+    } else {
+        terminal_setcolor(VGA_COLOR_LIGHT_RED);
+        terminal_writestring("Readahead test FAILED\n");
+    }
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+}
+
+extern void* blk_map(uint32_t device, uint32_t sector);
+
+void test_ramdisk(void) {
+    terminal_setcolor(VGA_COLOR_LIGHT_CYAN);
+    terminal_writestring("=== Testing RAM Disk ===\n");
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+    
+    /* Cached blocks of ram0 are its own pages: no request reaches the queue */
+    uint32_t frames = ramdisk_frames_available();
+    uint32_t device_before, device_after;
+    blk_get_statistics(blk_ram, NULL, NULL, &device_before, NULL);
+    int ok = 1;
+    for (uint32_t block = 300; ok && block < 316; block++) {
+        struct buffer* buf = bread(blk_ram, block);
+        ok = buf != NULL && bdata(buf) == blk_map(blk_ram, block * 2);
+        if (buf) {
+            ((uint8_t*)bdata(buf))[0] = (uint8_t)block;
+            bmark_dirty(buf);
+            brelse(buf);
+        }
+    }
+    ok = ok && bsync() == 0;
+    blk_get_statistics(blk_ram, NULL, NULL, &device_after, NULL);
+    ok = ok && device_after == device_before;
+    
+    /* Stores went straight to the disk, which grew by just the pages touched */
+    uint8_t sector[SECTOR_SIZE];
+    for (uint32_t block = 300; ok && block < 316; block++) {
+        simulated_disk_read(block * 2, sector);
+        ok = sector[0] == (uint8_t)block;
+    }
+    frames -= ramdisk_frames_available();
+    ok = ok && frames == 16 * 1024 / PAGE_SIZE;
+    terminal_writestring("Frames for 16 KiB written: ");
+    terminal_writedec(frames);
+    terminal_writestring("\n");
+    
+    if (ok) {
+        terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
+        terminal_writestring("RAM disk test PASSED\n");
+    } else {
+        terminal_setcolor(VGA_COLOR_LIGHT_RED);
+        terminal_writestring("RAM disk test FAILED\n");
+    }
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+}
+
+/* CRC32C (crc32c.c) */
+extern uint32_t crc32c(uint32_t crc, const void* data, uint32_t size);
+extern int crc32c_hardware(void);
+
+/* A bit at a time, to check the fast paths against */
+static uint32_t crc32c_reference(uint32_t crc, const uint8_t* data, uint32_t size) {
+    crc = ~crc;
+    while (size--) {
+        crc ^= *data++;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+        }
+    }
+    return ~crc;
+}
+
+void test_crc32c(void) {
+    terminal_setcolor(VGA_COLOR_LIGHT_CYAN);
+    terminal_writestring("=== Testing CRC32C ===\n");
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+    terminal_writestring(crc32c_hardware() ? "Using SSE4.2 crc32\n" : "Using slice-by-8 tables\n");
+    
+    /* The check value, then lengths around the interleaved chunk sizes at every alignment */
+    static uint8_t data[3 * 8192 + 800];
+    static const uint32_t lengths[] = { 0, 1, 7, 767, 768, 771, 3 * 8192, sizeof(data) - 3 };
+    int ok = crc32c(0, "123456789", 9) == 0xE3069283;
+    for (uint32_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)((i * 2654435761u) >> 13);
+    }
+    for (uint32_t offset = 0; ok && offset < 4; offset++) {
+        for (uint32_t i = 0; ok && i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+            ok = crc32c(offset, data + offset, lengths[i]) == crc32c_reference(offset, data + offset, lengths[i]);
+        }
+    }
+    
+    if (ok) {
+        terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
+        terminal_writestring("CRC32C test PASSED\n");
+    } else {
+        terminal_setcolor(VGA_COLOR_LIGHT_RED);
+        terminal_writestring("CRC32C test FAILED\n");
+    }
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+}
+
+/* Metadata journal (journal.c) */
+struct journal_handle;
+extern int journal_init(uint32_t device, uint32_t start, uint32_t blocks);
+extern struct journal_handle* journal_start(uint32_t blocks);
+extern int journal_dirty(struct journal_handle* handle, struct buffer* buf);
+extern void journal_stop(struct journal_handle* handle);
+extern int journal_commit(void);
+extern void journal_get_statistics(uint32_t* commits, uint32_t* updates, uint32_t* logged, uint32_t* replayed);
+
+void test_journal(void) {
+    terminal_setcolor(VGA_COLOR_LIGHT_CYAN);
+    terminal_writestring("=== Testing Metadata Journal ===\n");
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+    
+    /* Journal in blocks 100-163 of ram1, metadata at 200-215 */
+    int ok = journal_init(blk_scratch, 100, 64) == 0;
+    
+    /* 48 small updates join one transaction: nothing is written yet */
+    uint32_t device_before, device_after;
+    blk_get_statistics(blk_scratch, NULL, NULL, &device_before, NULL);
+    for (uint32_t i = 0; ok && i < 48; i++) {
+        struct journal_handle* handle = journal_start(1);
+        struct buffer* buf = handle ? bread(blk_scratch, 200 + i % 16) : NULL;
+        ok = buf != NULL && journal_dirty(handle, buf) == 0;
+        if (buf) {
+            ((uint8_t*)bdata(buf))[i / 16] = (uint8_t)(0xA0 + i);
+            brelse(buf);
+        }
+        if (handle) {
+            journal_stop(handle);
+        }
+    }
+    blk_get_statistics(blk_scratch, NULL, NULL, &device_after, NULL);
+    ok = ok && device_after == device_before;
+    
+    /* The group commit costs two writes, and the home blocks stay untouched */
+    ok = ok && journal_commit() == 0;
+    blk_get_statistics(blk_scratch, NULL, NULL, &device_after, NULL);
+    ok = ok && device_after - device_before == 2;
+    uint32_t commits, updates;
+    journal_get_statistics(&commits, &updates, NULL, NULL);
+    ok = ok && commits == 1 && updates == 48;
+    terminal_writestring("Device writes for 48 updates: ");
+    terminal_writedec(device_after - device_before);
+    terminal_writestring("\n");
+    
+    /* As after a crash before write-back, mounting again replays the commit */
+    uint8_t sector[SECTOR_SIZE];
+    ramdisk_read(blk_scratch, 215 * 2, 1, sector);
+    ok = ok && sector[2] != 0xA0 + 47;
+    uint32_t replayed;
+    ok = ok && journal_init(blk_scratch, 100, 64) == 0;
+    journal_get_statistics(NULL, NULL, NULL, &replayed);
+    ramdisk_read(blk_scratch, 215 * 2, 1, sector);
+    ok = ok && replayed == 1 && sector[0] == 0xA0 + 15 && sector[1] == 0xA0 + 31 && sector[2] == 0xA0 + 47;
+    
+    /* Replay is idempotent, and ordinary write-back still reaches home */
+    ok = ok && journal_init(blk_scratch, 100, 64) == 0 && bsync() == 0;
+    journal_get_statistics(NULL, NULL, NULL, &replayed);
+    ok = ok && replayed == 0;
+    
+    if (ok) {
+        terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
+        terminal_writestring("Journal test PASSED\n");
+    } else {
+        terminal_setcolor(VGA_COLOR_LIGHT_RED);
+        terminal_writestring("Journal test FAILED\n");
+    }
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+}
+
+/* Log-structured filesystem (lfs.c) */
+extern int lfs_format(uint32_t device);
+extern int lfs_mount(uint32_t device);
+extern int lfs_unmount(void);
+extern int lfs_sync(void);
+extern int lfs_create(const char* name);
+extern int lfs_lookup(const char* name);
+extern int lfs_read(int ino, uint32_t offset, void* buffer, uint32_t size);
+extern int lfs_write(int ino, uint32_t offset, const void* buffer, uint32_t size);
+extern void lfs_get_statistics(uint32_t* segment_writes, uint32_t* blocks_written, uint32_t* absorbed,
+                               uint32_t* cleaned, uint32_t* moved, uint32_t* checkpoints);
+
+/* Whether bytes [offset, offset + size) of file ino all equal value */
+static int lfs_test_check(int ino, uint32_t offset, uint32_t size, uint8_t value) {
+    uint8_t chunk[256];
+    for (uint32_t done = 0; done < size; done += sizeof(chunk)) {
+        uint32_t n = size - done < sizeof(chunk) ? size - done : sizeof(chunk);
+        if (lfs_read(ino, offset + done, chunk, n) != (int)n) {
+            return 0;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            if (chunk[i] != value) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+void test_lfs(void) {
+    terminal_setcolor(VGA_COLOR_LIGHT_CYAN);
+    terminal_writestring("=== Testing Log-Structured Filesystem ===\n");
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+    
+    int ok = blk_lfs >= 0 && lfs_format(blk_lfs) == 0 && lfs_mount(blk_lfs) == 0;
+    int log = ok ? lfs_create("log") : -1;
+    int config = ok ? lfs_create("config") : -1;
+    ok = ok && log > 0 && config > 0;
+    
+    /* 128 small appends and scattered updates leave as a few large writes */
+    uint8_t record[64];
+    uint32_t device_before, device_after;
+    blk_get_statistics(blk_lfs, NULL, NULL, &device_before, NULL);
+    for (uint32_t i = 0; ok && i < 128; i++) {
+        for (uint32_t j = 0; j < sizeof(record); j++) {
+            record[j] = (uint8_t)(i / 16);
+        }
+        ok = lfs_write(log, i * sizeof(record), record, sizeof(record)) == sizeof(record);
+        ok = ok && lfs_write(config, (i * 7 % 16) * 256, record, 1) == 1;
+    }
+    ok = ok && lfs_sync() == 0;
+    blk_get_statistics(blk_lfs, NULL, NULL, &device_after, NULL);
+    ok = ok && device_after - device_before <= 4;
+    terminal_writestring("Device writes for 256 small writes: ");
+    terminal_writedec(device_after - device_before);
+    terminal_writestring("\n");
+    
+    /* Everything is found again from the checkpoint */
+    ok = ok && lfs_unmount() == 0 && lfs_mount(blk_lfs) == 0;
+    ok = ok && lfs_lookup("log") == log && lfs_lookup("config") == config;
+    for (uint32_t i = 0; ok && i < 8; i++) {
+        ok = lfs_test_check(log, i * 1024, 1024, (uint8_t)i);
+    }
+    
+    /*
+     * Rewriting a file many times over fills the disk. Blocks of a cold
+     * file written in between stay live in every segment, so space only
+     * comes back through the cleaner.
+     */
+    int cold = ok ? lfs_create("cold") : -1;
+    ok = ok && cold > 0;
+    uint8_t block[1024];
+    for (uint32_t round = 0; ok && round < 60; round++) {
+        if (round < 24) {
+            for (uint32_t j = 0; j < sizeof(block); j++) {
+                block[j] = (uint8_t)round;
+            }
+            ok = lfs_write(cold, round * sizeof(block), block, sizeof(block)) == sizeof(block);
+        }
+        for (uint32_t j = 0; j < sizeof(block); j++) {
+            block[j] = (uint8_t)(0x80 + round);
+        }
+        for (uint32_t offset = 0; ok && offset < 8 * 1024; offset += sizeof(block)) {
+            ok = lfs_write(config, offset, block, sizeof(block)) == sizeof(block);
+        }
+        ok = ok && lfs_sync() == 0;
+    }
+    uint32_t cleaned, moved;
+    lfs_get_statistics(NULL, NULL, NULL, &cleaned, &moved, NULL);
+    ok = ok && cleaned > 0 && lfs_unmount() == 0 && lfs_mount(blk_lfs) == 0;
+    ok = ok && lfs_test_check(config, 0, 8 * 1024, 0x80 + 59) && lfs_test_check(log, 7 * 1024, 1024, 7);
+    for (uint32_t i = 0; ok && i < 24; i++) {
+        ok = lfs_test_check(cold, i * 1024, 1024, (uint8_t)i);
+    }
+    terminal_writestring("Segments cleaned: ");
+    terminal_writedec(cleaned);
+    terminal_writestring(", live blocks moved: ");
+    terminal_writedec(moved);
+    terminal_writestring("\n");
+    lfs_unmount();
+    
+    if (ok) {
+        terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
+        terminal_writestring("Log-structured filesystem test PASSED\n");
+    } else {
+        terminal_setcolor(VGA_COLOR_LIGHT_RED);
+        terminal_writestring("Log-structured filesystem test FAILED\n");
+    }
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+}
+
+/* A block benchmark job (must match blk_bench.c) */
+struct blk_bench_job {
+    uint32_t device;
+    uint32_t first_sector;
+    uint32_t sectors;
+    uint32_t block_size;
+    uint32_t queue_depth;
+    uint32_t ios;
+    uint8_t write;
+    uint8_t random;
+    uint8_t cached;
+};
+
+/* What a job measured (must match blk_bench.c) */
+struct blk_bench_result {
+    uint32_t ios;
+    uint32_t errors;
+    uint32_t iops;
+    uint32_t kb_per_sec;
+    uint32_t lat_p50;
+    uint32_t lat_p99;
+    uint32_t lat_max;
+    uint32_t cache_hits;
+};
+
+/* Block I/O benchmark (blk_bench.c) */
+extern int blk_bench_run(const char* name, const struct blk_bench_job* job, uint32_t tsc_khz,
+                         struct blk_bench_result* result);
+
+/* Monotonic clock (clocksource.c) */
+extern void clocksource_init(void);
+extern uint32_t clocksource_tsc_khz(void);
+
+#define BLK_BENCH_SECTORS 128           /* The end of each disk the jobs run over, saved and restored */
+
+/* Straight to the queue first, so the cached jobs leave the cache holding what the disk does */
+static const struct blk_bench_job blk_bench_jobs[] = {
+    /* device, first_sector, sectors, block_size, queue_depth, ios, write, random, cached */
+    { 0, 0, BLK_BENCH_SECTORS, 32768, 1, 64, 0, 0, 0 },
+    { 0, 0, BLK_BENCH_SECTORS, 32768, 1, 64, 1, 0, 0 },
+    { 0, 0, BLK_BENCH_SECTORS, 4096, 1, 256, 0, 1, 0 },
+    { 0, 0, BLK_BENCH_SECTORS, 4096, 8, 256, 0, 1, 0 },
+    { 0, 0, BLK_BENCH_SECTORS, 4096, 8, 256, 1, 1, 0 },
+    { 0, 0, BLK_BENCH_SECTORS, 32768, 1, 64, 0, 0, 1 },
+    { 0, 0, BLK_BENCH_SECTORS, 4096, 1, 256, 0, 1, 1 },
+    { 0, 0, BLK_BENCH_SECTORS, 4096, 1, 256, 1, 1, 1 },
+};
+
+static uint8_t blk_bench_saved[BLK_BENCH_SECTORS * SECTOR_SIZE];
+
+/*
+ * Every job against one device, over its last sectors. What was there is
+ * put back through the buffer cache, so cached copies agree with the disk.
+ * Returns 0, 1 when a job failed, or -1 when the device was left changed.
+ */
+static int blk_bench_device(const char* name, int device, uint32_t tsc_khz) {
+    uint32_t first = (blk_sectors((uint32_t)device) - BLK_BENCH_SECTORS) & ~1u;
+    if (blk_read((uint32_t)device, first, BLK_BENCH_SECTORS, blk_bench_saved) != 0) {
+        return 1;
+    }
+    int failed = 0;
+    for (uint32_t i = 0; i < sizeof(blk_bench_jobs) / sizeof(blk_bench_jobs[0]); i++) {
+        struct blk_bench_job job = blk_bench_jobs[i];
+        struct blk_bench_result result;
+        job.device = (uint32_t)device;
+        job.first_sector = first;
+        if (blk_bench_run(name, &job, tsc_khz, &result) != 0 || result.errors) {
+            failed = 1;
+        }
+    }
+    for (uint32_t block = 0; block < BLK_BENCH_SECTORS / 2; block++) {
+        struct buffer* buf = bread((uint32_t)device, first / 2 + block);
+        if (!buf) {
+            return -1;
+        }
+        uint8_t* data = (uint8_t*)bdata(buf);
+        for (uint32_t j = 0; j < 2 * SECTOR_SIZE; j++) {
+            data[j] = blk_bench_saved[block * 2 * SECTOR_SIZE + j];
+        }
+        bmark_dirty(buf);
+        brelse(buf);
+    }
+    return bsync() == 0 ? failed : -1;
+}
+
+/* fio-style jobs on each backend: the RAM disk behind simulated_disk, ATA by PIO and DMA, and AHCI */
+void test_block_benchmark(void) {
+    terminal_setcolor(VGA_COLOR_LIGHT_CYAN);
+    terminal_writestring("=== Block I/O Benchmark ===\n");
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+    
+    const char* names[] = { "ram0", "ata0pio", "ata0", "ahci0" };
+    int devices[] = { blk_ram, blk_ata_pio, blk_ata, blk_ahci };
+    uint32_t tsc_khz = clocksource_tsc_khz();
+    int ran = 0;
+    int ok = 1;
+    for (uint32_t i = 0; i < 4; i++) {
+        if (devices[i] < 0 || blk_sectors((uint32_t)devices[i]) < 300) {
+            continue;
+        }
+        int status = blk_bench_device(names[i], devices[i], tsc_khz);
+        ok = ok && status == 0;
+        ran++;
+        terminal_writestring(names[i]);
+        terminal_writestring(status < 0 ? ": not restored\n" : status ? ": a job failed\n" : ": done\n");
+    }
+    terminal_writestring("Results are in the kernel log");
+    terminal_writestring(tsc_khz ? "\n" : ", latencies in cycles: no TSC rate\n");
+    
+    if (!ran) {
+        terminal_writestring("Block benchmark SKIPPED\n");
+    } else if (ok) {
+        terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
+        terminal_writestring("Block benchmark PASSED\n");
+    } else {
+        terminal_setcolor(VGA_COLOR_LIGHT_RED);
+        terminal_writestring("Block benchmark FAILED\n");
+    }
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+}
+
+void test_timer_driver(void) {
+    terminal_setcolor(VGA_COLOR_LIGHT_CYAN);
+    terminal_writestring("=== Testing Timer Driver ===\n");
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+    
+    uint32_t start_ticks = timer_get_ticks();
+    terminal_writestring("Testing timer sleep for 1 second...\n");
+    
+    timer_sleep(1000); /* Sleep for 1 second */
+    
+    uint32_t end_ticks = timer_get_ticks();
+    uint32_t elapsed = end_ticks - start_ticks;
+    
+    terminal_writestring("Expected ticks: ");
+    terminal_putchar('0' + timer_frequency / 100);
+    terminal_putchar('0' + (timer_frequency / 10) % 10);
+    terminal_putchar('0' + timer_frequency % 10);
+    terminal_writestring(", Actual ticks: ");
+    
+    /* Display elapsed ticks */
+    if (elapsed < 100) {
+        terminal_putchar('0' + elapsed / 10);
+        terminal_putchar('0' + elapsed % 10);
+    } else {
+        terminal_putchar('0' + elapsed / 100);
+        terminal_putchar('0' + (elapsed / 10) % 10);
+        terminal_putchar('0' + elapsed % 10);
+    }
+    terminal_putchar('\n');
+    
+    if (elapsed >= timer_frequency / 2 && elapsed <= timer_frequency * 2) {
+        terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
+        terminal_writestring("Timer driver test PASSED\n");
+    } else {
+        terminal_setcolor(VGA_COLOR_LIGHT_RED);
+        terminal_writestring("Timer driver test FAILED\n");
+    }
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+}
+
+/* Hibernation (hibernate.c) */
+extern uint8_t* hibernate_staging(void);
+extern uint32_t hibernate_image_sectors(void);
+extern int hibernate_snapshot(uint32_t device, uint32_t sector);
+extern int hibernate_resume(uint32_t device, uint32_t sector);
+
+/* Kernel command line (cmdline.c) */
+extern const char* cmdline_find(const char* key);
+
+/* Block device lookup (block.c) */
+extern int blk_lookup(const char* name);
+
+/* Kernel runtime library (klib.c) */
+extern void* memcpy(void* dest, const void* src, size_t n);
+
+/* The test's disk: memory past the staging copy, which a restore leaves as it is */
+static uint8_t* hibernate_test_disk;
+
+static int hibernate_test_transfer(uint32_t sector, uint32_t count, uint8_t* buffer, int write, void* cookie) {
+    uint8_t* data = hibernate_test_disk + sector * SECTOR_SIZE;
+    memcpy(write ? data : buffer, write ? buffer : data, count * SECTOR_SIZE);
+    blk_complete(cookie, 0);
+    return 0;
+}
+
+void test_hibernate(void) {
+    terminal_setcolor(VGA_COLOR_LIGHT_CYAN);
+    terminal_writestring("=== Testing Hibernation ===\n");
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+    
+    /*
+     * Snapshot, change what the image holds, resume: the kernel is back in
+     * the snapshot call, with the old value. A damaged image is refused
+     * first; what happened before the restore is kept in the test disk's
+     * sector 0, ahead of the image, where the restore does not reach.
+     */
+    static volatile uint32_t generation;
+    uint32_t sectors = hibernate_image_sectors() + 1;
+    hibernate_test_disk = hibernate_staging() + (sectors - 1) * SECTOR_SIZE;
+    volatile uint32_t* outside = (volatile uint32_t*)hibernate_test_disk;
+    int device = blk_register("hib0", sectors, 1, 0, hibernate_test_transfer, NULL);
+    outside[0] = 0;
+    generation = 1;
+    int result = device < 0 ? -1 : hibernate_snapshot((uint32_t)device, 1);
+    if (result == 0) {
+        generation = 2;
+        hibernate_test_disk[SECTOR_SIZE * 2] ^= 1;
+        outside[0] = hibernate_resume((uint32_t)device, 1) < 0;
+        hibernate_test_disk[SECTOR_SIZE * 2] ^= 1;
+        hibernate_resume((uint32_t)device, 1);
+    }
+    
+    if (result == 1 && generation == 1 && outside[0] == 1) {
+        terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
+        terminal_writestring("Hibernation test PASSED\n");
+    } else {
+        terminal_setcolor(VGA_COLOR_LIGHT_RED);
+        terminal_writestring("Hibernation test FAILED\n");
+    }
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+}
+
+/*
+ * hibernate=<block device> on the command line keeps an image of the
+ * booted kernel at the start of that device. -1 without one.
+ */
+static int hibernate_device(void) {
+    const char* value = cmdline_find("hibernate");
+    char name[16];
+    uint32_t length = 0;
+    while (value && value[length] && value[length] != ' ' && length < sizeof(name) - 1) {
+        name[length] = value[length];
+        length++;
+    }
+    name[length] = '\0';
+    return length ? blk_lookup(name) : -1;
+}
+
+/* Kernel heap (kernel_heap.c) */
+extern void heap_init(void);
+
+/* Log timestamps are timer ticks */
+static uint32_t log_clock(void) {
+    return timer_ticks;
+}
+
+/* Main kernel function */
+/* Driver probes: each reports on the console and returns 0 when it found its device */
+static void driver_status(const char* name, const char* status, int ok) {
+    terminal_writestring(name);
+    terminal_writestring(": ");
+    if (ok) {
+        terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
+    }
+    terminal_writestring(status);
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+}
+
+static int mouse_probe(void) {
+    mouse_init();
+    return 0;
+}
+
+static int disk_probe(void) {
+    disk_init();
+    driver_status("Disk", "OK\n", 1);
+    return 0;
+}
+
+/* The primary ATA channel */
+static int ata_probe(void) {
+    if (ata_init() != 0) {
+        driver_status("ATA", "no drive\n", 0);
+        return -1;
+    }
+    driver_status("ATA", ata_drive.bm_base ? "OK (DMA)\n" : "OK (PIO)\n", 1);
+    return 0;
+}
+
+/*
+ * Move the console onto the display adapter's linear framebuffer if it
+ * has one. The BAR is prefetchable, so pci_map_bar covers it with a
+ * write-combining MTRR: this stage runs unpaged, with no PAT to ask.
+ */
+static int display_probe(void) {
+    uint32_t display = pci_find_class(PCI_CLASS_DISPLAY, PCI_SUBCLASS_VGA);
+    if (display && console_framebuffer((uint32_t)pci_map_bar(display, 0))) {
+        driver_status("Display", "640x768 framebuffer, 80x48 console\n", 1);
+        return 0;
+    }
+    driver_status("Display", "80x25 text\n", 0);
+    return -1;
+}
+
+static int ahci_probe(void) {
+    if (ahci_init() != 0) {
+        driver_status("AHCI", "no controller\n", 0);
+        return -1;
+    }
+    terminal_writestring("AHCI: ");
+    terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
+    terminal_writedec(ahci_disks_found());
+    terminal_writestring(" disk(s)\n");
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+    return 0;
+}
+
+/* The block request queue, over every disk found */
+static int block_probe(void) {
+    block_init();
+    driver_status("Block layer", "OK\n", 1);
+    return 0;
+}
+
+static int timer_probe(void) {
+    timer_init(timer_frequency);
+    driver_status("Timer", "OK\n", 1);
+    return 0;
+}
+
+/* The buffer cache's flusher runs off the timer wheel */
+static int bcache_probe(void) {
+    bcache_init();
+    driver_status("Buffer cache", "OK\n", 1);
+    return 0;
+}
+
+void kernel_main(void) {
+    initcall_run("terminal", terminal_initialize);
+    initcall_begin("console");
+    serial_init(0);                 /* No IDT in this stage: writers drive the FIFO */
+    printk_init(log_clock, 1);
+    initcall_end();
+    terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
+    terminal_writestring("=== Tiny Operating System - Phase 8 Device Drivers ===\n");
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+    
+    /* Initialize kernel heap */
+    initcall_run("heap", heap_init);
+    initcall_run("dma", dma_init);
+    
+    /* Probe the drivers boot waits for, each after what it depends on */
+    terminal_writestring("Initializing device drivers...\n");
+    
+    /* Keyboard needs no probe */
+    terminal_writestring("Keyboard: ");
+    terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
+    terminal_writestring("OK\n");
+    terminal_setcolor(VGA_COLOR_LIGHT_GREY);
+    
+    int disk = initcall_driver("disk", disk_probe, 0, 0);
+    int ata = initcall_driver("ata", ata_probe, 0, 0);
+    initcall_driver("display", display_probe, 0, 0);
+    int ahci = initcall_driver("ahci", ahci_probe, 0, 0);
+    int block = initcall_driver("block", block_probe, 1u << disk | 1u << ata | 1u << ahci, 0);
+    int timer = initcall_driver("timer", timer_probe, 0, 0);
+    initcall_driver("buffer_cache", bcache_probe, 1u << block | 1u << timer, 0);
+    mouse_driver = initcall_driver("mouse", mouse_probe, 0, INITCALL_DEFERRED);
+    initcall_run_drivers();
+    terminal_writestring("Mouse: deferred\n");
+    
+    /* A warm boot goes on from the image's snapshot below and returns no more */
+    int hibernate = hibernate_device();
+    if (hibernate >= 0) {
+        initcall_begin("hibernate");
+        hibernate_resume((uint32_t)hibernate, 0);
+        initcall_end();
+        terminal_writestring("Hibernate: no image, booting cold\n");
+    }
+    
+    initcall_run("clocksource", clocksource_init);
+    terminal_putchar('\n');
+    initcall_report(clocksource_tsc_khz());
+    
+    /* Test all device drivers */
     test_keyboard_driver();
     test_mouse_driver();
     test_disk_driver();
+    test_ata_multisector();
+    test_ata_dma();
+    test_dma();
+    test_ahci_ncq();
+    test_block_layer();
+    test_buffer_cache();
+    test_readahead();
+    test_ramdisk();
+    test_crc32c();
+    test_lfs();
+    test_journal();
+    test_block_benchmark();
     test_timer_driver();
+    test_hibernate();
+    
+    /* The booted kernel, for the next boot to resume */
+    if (hibernate >= 0) {
+        int result = hibernate_snapshot((uint32_t)hibernate, 0);
+        terminal_writestring(result == 1 ? "Hibernate: resumed\n" :
+                             result == 0 ? "Hibernate: image written\n" : "Hibernate: image does not fit\n");
+    }
     
     terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
     terminal_writestring("=== Phase 8 Device Drivers Complete ===\n");
@@ -676,7 +2312,11 @@ void kernel_main(void) {
     
     /* Infinite loop */
     while (1) {
-        /* Halt CPU */
+        /* Write out what was logged and probe what boot left, then halt CPU */
+        printk_console_drain();
+        if (initcall_run_deferred(1)) {
+            continue;
+        }
         __asm__ __volatile__ ("hlt");
     }
 }
\ No newline at end of file
@@ -0,0 +1,301 @@
+/*
+ * Tiny Operating System - Kernel Heap
+ * Two-level segregated fit (TLSF) allocator shared by the stage kernels
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Heap configuration */
+#define KERNEL_HEAP_SIZE (256 * 1024)   /* 256KB kernel heap */
+#define HEAP_ALIGN 8
+
+/* TLSF index constants */
+#define TLSF_SL_LOG2 4                               /* 16 second-level lists per first level */
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+#define TLSF_FL_SHIFT (TLSF_SL_LOG2 + 3)             /* Sizes below 128 bytes share first level 0 */
+#define TLSF_SMALL_BLOCK (1 << TLSF_FL_SHIFT)
+#define TLSF_FL_COUNT 20
+
+/* Block flags, stored in the low bits of the size field */
+#define BLOCK_FREE 0x1
+#define BLOCK_SIZE_MASK (~(uint32_t)(HEAP_ALIGN - 1))
+
+/* Heap block header; the free list links overlay the payload of free blocks */
+struct heap_block {
+    struct heap_block* prev_phys;
+    uint32_t size;
+    struct heap_block* next_free;
+    struct heap_block* prev_free;
+};
+
+#define BLOCK_HEADER_SIZE (offsetof(struct heap_block, next_free))
+#define BLOCK_MIN_SIZE (sizeof(struct heap_block) - BLOCK_HEADER_SIZE)
+
+/* Heap state */
+static uint8_t heap_pool[KERNEL_HEAP_SIZE] __attribute__((aligned(HEAP_ALIGN)));
+static uint32_t heap_fl_bitmap;
+static uint32_t heap_sl_bitmap[TLSF_FL_COUNT];
+static struct heap_block* heap_free_lists[TLSF_FL_COUNT][TLSF_SL_COUNT];
+static uint32_t heap_used_bytes;
+static uint32_t heap_high_water;                     /* End of the highest block ever handed out */
+
+/* Function prototypes */
+void heap_init(void);
+void* malloc(uint32_t size);
+void free(void* ptr);
+uint32_t heap_used(void);
+uint32_t heap_footprint(void);
+uint32_t heap_free_space(uint32_t* largest);
+
+/* Allocation tracking (alloc_track.c) */
+extern void alloc_track_alloc(void* ptr, uint32_t size, void* caller);
+extern void alloc_track_free(void* ptr);
+
+/* Bit scan helpers (value must be non-zero) */
+static inline uint32_t bit_scan_forward(uint32_t value) {
+    uint32_t index;
+    __asm__ ("bsf %1, %0" : "=r"(index) : "rm"(value));
+    return index;
+}
+
+static inline uint32_t bit_scan_reverse(uint32_t value) {
+    uint32_t index;
+    __asm__ ("bsr %1, %0" : "=r"(index) : "rm"(value));
+    return index;
+}
+
+/* Save EFLAGS and disable interrupts */
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+/* Restore the interrupt flag saved by irq_save */
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+}
+
+/* Block helpers */
+static inline uint32_t block_size(const struct heap_block* block) {
+    return block->size & BLOCK_SIZE_MASK;
+}
+
+static inline struct heap_block* block_next(struct heap_block* block) {
+    return (struct heap_block*)((uint8_t*)block + BLOCK_HEADER_SIZE + block_size(block));
+}
+
+/* Map a block size to the list that holds it */
+static void mapping_insert(uint32_t size, uint32_t* fl, uint32_t* sl) {
+    if (size < TLSF_SMALL_BLOCK) {
+        *fl = 0;
+        *sl = size / (TLSF_SMALL_BLOCK / TLSF_SL_COUNT);
+    } else {
+        uint32_t top = bit_scan_reverse(size);
+        *sl = (size >> (top - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+        *fl = top - (TLSF_FL_SHIFT - 1);
+    }
+}
+
+/* Map a request to the first list whose blocks are all large enough */
+static void mapping_search(uint32_t size, uint32_t* fl, uint32_t* sl) {
+    if (size >= TLSF_SMALL_BLOCK) {
+        size += (1u << (bit_scan_reverse(size) - TLSF_SL_LOG2)) - 1;
+    }
+    mapping_insert(size, fl, sl);
+}
+
+static void free_list_insert(struct heap_block* block) {
+    uint32_t fl, sl;
+    mapping_insert(block_size(block), &fl, &sl);
+    
+    block->prev_free = NULL;
+    block->next_free = heap_free_lists[fl][sl];
+    if (block->next_free) {
+        block->next_free->prev_free = block;
+    }
+    heap_free_lists[fl][sl] = block;
+    
+    heap_fl_bitmap |= 1u << fl;
+    heap_sl_bitmap[fl] |= 1u << sl;
+}
+
+static void free_list_remove(struct heap_block* block) {
+    uint32_t fl, sl;
+    mapping_insert(block_size(block), &fl, &sl);
+    
+    if (block->prev_free) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        heap_free_lists[fl][sl] = block->next_free;
+    }
+    if (block->next_free) {
+        block->next_free->prev_free = block->prev_free;
+    }
+    
+    if (!heap_free_lists[fl][sl]) {
+        heap_sl_bitmap[fl] &= ~(1u << sl);
+        if (!heap_sl_bitmap[fl]) {
+            heap_fl_bitmap &= ~(1u << fl);
+        }
+    }
+}
+
+/* Find a free block of at least size bytes with two bit scans */
+static struct heap_block* find_suitable_block(uint32_t size) {
+    uint32_t fl, sl;
+    mapping_search(size, &fl, &sl);
+    if (fl >= TLSF_FL_COUNT) {
+        return NULL;
+    }
+    
+    uint32_t sl_map = heap_sl_bitmap[fl] & (~0u << sl);
+    if (!sl_map) {
+        uint32_t fl_map = fl + 1 < TLSF_FL_COUNT ? heap_fl_bitmap & (~0u << (fl + 1)) : 0;
+        if (!fl_map) {
+            return NULL;
+        }
+        fl = bit_scan_forward(fl_map);
+        sl_map = heap_sl_bitmap[fl];
+    }
+    
+    return heap_free_lists[fl][bit_scan_forward(sl_map)];
+}
+
+/* Initialize the heap as one free block followed by a zero-size sentinel */
+void heap_init(void) {
+    heap_fl_bitmap = 0;
+    for (int fl = 0; fl < TLSF_FL_COUNT; fl++) {
+        heap_sl_bitmap[fl] = 0;
+        for (int sl = 0; sl < TLSF_SL_COUNT; sl++) {
+            heap_free_lists[fl][sl] = NULL;
+        }
+    }
+    heap_used_bytes = 0;
+    heap_high_water = 0;
+    
+    struct heap_block* block = (struct heap_block*)heap_pool;
+    block->prev_phys = NULL;
+    /* Leave a whole struct for the sentinel so it lies inside the pool */
+    block->size = (KERNEL_HEAP_SIZE - BLOCK_HEADER_SIZE - sizeof(struct heap_block)) | BLOCK_FREE;
+    
+    struct heap_block* sentinel = block_next(block);
+    sentinel->prev_phys = block;
+    sentinel->size = 0;
+    
+    free_list_insert(block);
+}
+
+/* Memory allocation */
+void* malloc(uint32_t size) {
+    if (size == 0 || size > KERNEL_HEAP_SIZE) {
+        return NULL;
+    }
+    
+    /* Align size and leave room for the free list links once freed */
+    size = (size + HEAP_ALIGN - 1) & BLOCK_SIZE_MASK;
+    if (size < BLOCK_MIN_SIZE) {
+        size = BLOCK_MIN_SIZE;
+    }
+    
+    uint32_t flags = irq_save();
+    
+    struct heap_block* block = find_suitable_block(size);
+    if (!block) {
+        irq_restore(flags);
+        return NULL;  /* Out of memory */
+    }
+    free_list_remove(block);
+    
+    /* Split off the tail if it can hold a block of its own */
+    if (block_size(block) >= size + BLOCK_HEADER_SIZE + BLOCK_MIN_SIZE) {
+        struct heap_block* remainder = (struct heap_block*)((uint8_t*)block + BLOCK_HEADER_SIZE + size);
+        remainder->prev_phys = block;
+        remainder->size = (block_size(block) - size - BLOCK_HEADER_SIZE) | BLOCK_FREE;
+        block_next(remainder)->prev_phys = remainder;
+        free_list_insert(remainder);
+        block->size = size;
+    }
+    
+    block->size &= ~BLOCK_FREE;
+    heap_used_bytes += block_size(block);
+    uint32_t end = (uint32_t)((uint8_t*)block_next(block) - heap_pool);
+    if (end > heap_high_water) {
+        heap_high_water = end;
+    }
+    
+    irq_restore(flags);
+    void* ptr = (uint8_t*)block + BLOCK_HEADER_SIZE;
+    alloc_track_alloc(ptr, size, __builtin_return_address(0));
+    return ptr;
+}
+
+/* Memory deallocation */
+void free(void* ptr) {
+    if (ptr == NULL) return;
+    
+    struct heap_block* block = (struct heap_block*)((uint8_t*)ptr - BLOCK_HEADER_SIZE);
+    if (block->size & BLOCK_FREE) {
+        return;  /* Double free */
+    }
+    alloc_track_free(ptr);
+    
+    uint32_t flags = irq_save();
+    heap_used_bytes -= block_size(block);
+    block->size |= BLOCK_FREE;
+    
+    /* Merge with the previous physical block */
+    struct heap_block* prev = block->prev_phys;
+    if (prev && (prev->size & BLOCK_FREE)) {
+        free_list_remove(prev);
+        prev->size += BLOCK_HEADER_SIZE + block_size(block);
+        block = prev;
+    }
+    
+    /* Merge with the next physical block; the sentinel is never free */
+    struct heap_block* next = block_next(block);
+    if (next->size & BLOCK_FREE) {
+        free_list_remove(next);
+        block->size += BLOCK_HEADER_SIZE + block_size(next);
+    }
+    
+    block_next(block)->prev_phys = block;
+    free_list_insert(block);
+    
+    irq_restore(flags);
+}
+
+/* Bytes currently handed out by malloc */
+uint32_t heap_used(void) {
+    return heap_used_bytes;
+}
+
+/* Bytes of the pool below the highest block ever handed out: pages a paged heap would have backed */
+uint32_t heap_footprint(void) {
+    return heap_high_water;
+}
+
+/* Free bytes below the high-water mark, and the largest free block there; walks every block */
+uint32_t heap_free_space(uint32_t* largest) {
+    uint32_t free_bytes = 0;
+    uint32_t flags = irq_save();
+    *largest = 0;
+    for (struct heap_block* block = (struct heap_block*)heap_pool; block->size;
+         block = block_next(block)) {
+        uint32_t offset = (uint32_t)((uint8_t*)block - heap_pool);
+        if (!(block->size & BLOCK_FREE) || offset >= heap_high_water) {
+            continue;
+        }
+        uint32_t size = block_size(block);
+        if (offset + BLOCK_HEADER_SIZE + size > heap_high_water) {
+            size = heap_high_water - offset - BLOCK_HEADER_SIZE;
+        }
+        free_bytes += size;
+        if (size > *largest) {
+            *largest = size;
+        }
+    }
+    irq_restore(flags);
+    return free_bytes;
+}
@@ -46,11 +46,31 @@ struct idt_ptr {
     uint32_t base;
 } __attribute__((packed));
 
-/* Global variables */
-static size_t terminal_row;
-static size_t terminal_column;
-static enum vga_color terminal_color;
-static volatile uint16_t* terminal_buffer;
+/* Shadow-buffered console (vga_console.c) */
+extern void console_initialize(uint8_t color);
+extern void console_setcolor(uint8_t color);
+extern void console_putentryat(char c, uint8_t color, uint32_t x, uint32_t y);
+extern void console_putchar(char c);
+extern void console_flush(void);
+
+/* Serial console (serial.c) */
+extern void serial_init(int use_irq);
+
+/* Kernel log ring (printk.c) */
+extern void printk_init(uint32_t (*clock)(void), int serial);
+extern uint32_t printk_console_drain(void);
+
+/* Stack protector (stack_protector.c) */
+extern void stack_protector_init(void);
+
+/* Boot timeline (initcall.c) */
+extern void initcall_begin(const char* name);
+extern void initcall_end(void);
+extern void initcall_run(const char* name, void (*init)(void));
+extern void initcall_report(uint32_t tsc_khz);
+
+/* Kernel heap (kernel_heap.c) */
+extern void heap_init(void);
 
 /* IDT structures */
 static struct idt_entry idt[256];
@@ -132,48 +152,22 @@ extern void irq15(void);
 
 /* Terminal initialization */
 void terminal_initialize(void) {
-    terminal_row = 0;
-    terminal_column = 0;
-    terminal_color = VGA_COLOR_LIGHT_GREY;
-    terminal_buffer = VGA_BUFFER;
-    
-    /* Clear the screen */
-    for (size_t y = 0; y < VGA_HEIGHT; y++) {
-        for (size_t x = 0; x < VGA_WIDTH; x++) {
-            const size_t index = y * VGA_WIDTH + x;
-            terminal_buffer[index] = (uint16_t)' ' | (uint16_t)terminal_color << 8;
-        }
-    }
+    console_initialize(VGA_COLOR_LIGHT_GREY);
 }
 
 /* Set terminal color */
 void terminal_setcolor(enum vga_color color) {
-    terminal_color = color;
+    console_setcolor(color);
 }
 
 /* Put a character at position */
 void terminal_putentryat(char c, enum vga_color color, size_t x, size_t y) {
-    const size_t index = y * VGA_WIDTH + x;
-    terminal_buffer[index] = (uint16_t)c | (uint16_t)color << 8;
+    console_putentryat(c, color, x, y);
 }
 
 /* Put a character */
 void terminal_putchar(char c) {
-    if (c == '\n') {
-        terminal_column = 0;
-        if (++terminal_row == VGA_HEIGHT) {
-            terminal_row = 0;
-        }
-        return;
-    }
-    
-    terminal_putentryat(c, terminal_color, terminal_column, terminal_row);
-    if (++terminal_column == VGA_WIDTH) {
-        terminal_column = 0;
-        if (++terminal_row == VGA_HEIGHT) {
-            terminal_row = 0;
-        }
-    }
+    console_putchar(c);
 }
 
 /* Write a string */
@@ -327,14 +321,24 @@ void timer_handler(void) {
         /* Update cursor or other periodic tasks */
     }
     
+    /* Show text still short of a newline */
+    console_flush();
+    
     /* Send EOI */
     outb(0x20, 0x20);
 }
 
 /* Main kernel function */
 void kernel_main(void) {
+    /* No boot.asm in this stage to pick the stack guard first */
+    stack_protector_init();
+    
     /* Initialize terminal */
-    terminal_initialize();
+    initcall_run("terminal", terminal_initialize);
+    initcall_begin("console");
+    serial_init(0);                 /* Only the timer and keyboard have gates here */
+    printk_init(0, 1);             /* No tick count in this stage */
+    initcall_end();
     
     /* Display welcome message */
     terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
@@ -342,8 +346,10 @@ void kernel_main(void) {
     terminal_setcolor(VGA_COLOR_LIGHT_GREY);
     terminal_writestring("Kernel with interrupt handling initialized!\n\n");
     
-    /* Initialize interrupts */
-    interrupts_init();
+    /* Initialize the kernel heap and interrupts */
+    initcall_run("heap", heap_init);
+    initcall_run("interrupts", interrupts_init);
+    initcall_report(0);
     
     /* Display system information */
     terminal_setcolor(VGA_COLOR_LIGHT_CYAN);
@@ -366,7 +372,8 @@ void kernel_main(void) {
     
     /* Main kernel loop */
     while (1) {
-        /* Halt CPU until next interrupt */
+        /* Write out what was logged, then halt CPU until next interrupt */
+        printk_console_drain();
         __asm__ __volatile__("hlt");
     }
 }
\ No newline at end of file
@@ -62,11 +62,39 @@ typedef struct {
     const char* file;
     int line;
     const char* function;
-    uint32_t timestamp;
-    void* stack_trace[16];
+    uint32_t timestamp;             /* Milliseconds since boot */
+    uint32_t stack_trace[16];       /* Return addresses, innermost first */
     int stack_depth;
+    uint32_t repeats;               /* Identical errors suppressed at this site before this one */
+    uint32_t sequence;              /* Reservation number + 1 once published, 0 while being written */
 } error_info_t;
 
+/*
+ * error_log is a ring that any CPU or interrupt handler appends to
+ * without a lock: an atomic increment of error_log_head reserves a
+ * slot, the entry is filled in, and its sequence is stored last to
+ * publish it. The ring overwrites its oldest entries; a reader that
+ * finds a sequence other than the one it expects skips the slot.
+ */
+#define ERROR_LOG_SIZE 128          /* Power of two */
+#define ERROR_LOG_MASK (ERROR_LOG_SIZE - 1)
+
+/*
+ * An error storm from one call site is collapsed: past the burst in one
+ * window the site only counts, and the next entry it logs carries the
+ * count. Sites hash to a small table by file and line; two sites that
+ * collide share a budget, which only makes them quieter.
+ */
+#define ERROR_RATELIMIT_SITES 64    /* Power of two */
+#define ERROR_RATELIMIT_BURST 5
+#define ERROR_RATELIMIT_MS 1000
+
+typedef struct {
+    uint32_t window_start;
+    uint32_t logged;                /* Entries this window */
+    uint32_t suppressed;            /* Errors only counted since the site last logged */
+} error_site_t;
+
 /* System statistics */
 typedef struct {
     uint32_t total_errors;
@@ -79,12 +107,8 @@ typedef struct {
     uint32_t cpu_usage;
 } system_stats_t;
 
-/* Performance monitoring */
+/* Performance monitoring; system calls, interrupts, faults and switches are per-CPU counters */
 typedef struct {
-    uint32_t context_switches;
-    uint32_t syscalls_count;
-    uint32_t interrupts_count;
-    uint32_t page_faults;
     uint32_t memory_allocations;
     uint32_t memory_frees;
     uint32_t scheduler_runs;
@@ -94,8 +118,9 @@ typedef struct {
 /* Global variables */
 static system_stats_t system_stats;
 static performance_stats_t perf_stats;
-static error_info_t error_log[100];
-static int error_log_index = 0;
+static error_info_t error_log[ERROR_LOG_SIZE];
+static uint32_t error_log_head = 0; /* Reservations made */
+static error_site_t error_sites[ERROR_RATELIMIT_SITES];
 static int panic_mode = 0;
 static uint32_t system_start_time = 0;
 
@@ -191,54 +216,115 @@ static inline uint8_t inb(uint16_t port) {
     return ret;
 }
 
-/* Get timestamp (simple implementation) */
+/* Monotonic clock (clocksource.c) */
+extern void clocksource_init(void);
+extern uint32_t ktime_ms(void);
+extern uint32_t clocksource_tsc_khz(void);
+
+/* Kernel log ring (printk.c) */
+#define PRINTK_ERR 3                /* Must match printk.c */
+#define PRINTK_WARNING 4
+#define PRINTK_INFO 6
+#define PRINTK_DEBUG 7
+extern void printk_init(uint32_t (*clock)(void), int serial);
+extern int printk(uint32_t level, const char* text);
+extern uint32_t printk_drain(void (*emit)(uint32_t level, uint32_t timestamp, const char* text, uint32_t len),
+                             uint32_t budget);
+
+/* Per-CPU counters (percpu.c) */
+#define PCPU_SYSCALLS 0
+#define PCPU_INTERRUPTS 1
+extern void this_cpu_inc(uint32_t counter);
+extern uint64_t percpu_counter_read(uint32_t counter);
+
+/* Stack unwinder and kernel symbols (unwind.c) */
+extern uint32_t unwind_stack(uint32_t ebp, uint32_t* frames, uint32_t max);
+extern uint32_t ksym_format(char* out, uint32_t size, uint32_t addr);
+
+/* Crash dump (crashdump.c) */
+extern void crashdump_write(const char* reason, uint32_t eip, uint32_t ebp);
+
+/* Interrupt statistics (interrupt_handlers.c) */
+#define IRQ_LINES 16
+#define IRQ_LATENCY_BUCKETS 32
+#define IRQ_LATENCY_BUDGET_US 50    /* Entry-to-EOI time any top half should stay under */
+extern uint32_t irq_get_stats(uint32_t line, uint32_t* max_cycles);
+extern void irq_get_latency_histogram(uint32_t line, uint32_t* buckets);
+
+/* Get timestamp in milliseconds */
 static uint32_t get_timestamp(void) {
-    static uint32_t counter = 0;
-    return counter++;
+    return ktime_ms();
 }
 
-/* Stack trace capture (simplified) */
-static void capture_stack_trace(void** frames, int max_frames, int* captured) {
-    /* Simplified stack trace - in real implementation would walk the stack */
-    uint32_t* ebp;
-    __asm__ __volatile__ ("mov %%ebp, %0" : "=r"(ebp));
-    
-    *captured = 0;
-    for (int i = 0; i < max_frames && ebp; i++) {
-        if (ebp[1] != 0) { /* Return address */
-            frames[(*captured)++] = (void*)ebp[1];
-        }
-        ebp = (uint32_t*)ebp[0]; /* Move to next stack frame */
-        if ((uint32_t)ebp < 0x100000 || (uint32_t)ebp > 0xFFFFFFFF) break;
-    }
+/* The return addresses above the caller's frame: the frame-pointer chain unwind.c walks */
+static void capture_stack_trace(uint32_t* frames, int max_frames, int* captured) {
+    *captured = (int)unwind_stack((uint32_t)(uintptr_t)__builtin_frame_address(0), frames, (uint32_t)max_frames);
 }
 
-/* Error logging */
-static void log_error(error_code_t code, error_severity_t severity, 
-                     const char* message, const char* file, int line, const char* function) {
-    if (error_log_index >= 100) {
-        error_log_index = 0; /* Wrap around */
+/* The site's rate-limit slot */
+static error_site_t* error_site(const char* file, int line) {
+    uint32_t hash = ((uint32_t)(uintptr_t)file ^ (uint32_t)line * 0x9E3779B1u) * 0x9E3779B1u;
+    return &error_sites[hash >> 26 & (ERROR_RATELIMIT_SITES - 1)];
+}
+
+/*
+ * Count the error and, unless its site is over budget, append it to the
+ * ring. Returns the published entry, or NULL when the error was only
+ * counted. Safe from any context; nothing here waits.
+ */
+static error_info_t* log_error(error_code_t code, error_severity_t severity, 
+                               const char* message, const char* file, int line, const char* function) {
+    uint32_t timestamp = get_timestamp();
+    
+    __atomic_fetch_add(&system_stats.total_errors, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&system_stats.errors_by_severity[severity], 1, __ATOMIC_RELAXED);
+    if (code < 16) {
+        __atomic_fetch_add(&system_stats.errors_by_code[code], 1, __ATOMIC_RELAXED);
     }
+    __atomic_store_n(&system_stats.last_error_time, timestamp, __ATOMIC_RELAXED);
+    
+    /* Panics always get their entry: the panic screen shows it */
+    error_site_t* site = error_site(file, line);
+    uint32_t start = __atomic_load_n(&site->window_start, __ATOMIC_RELAXED);
+    if (timestamp - start >= ERROR_RATELIMIT_MS &&
+        __atomic_compare_exchange_n(&site->window_start, &start, timestamp, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&site->logged, 0, __ATOMIC_RELAXED);
+    }
+    if (__atomic_fetch_add(&site->logged, 1, __ATOMIC_RELAXED) >= ERROR_RATELIMIT_BURST &&
+        severity != ERROR_PANIC) {
+        __atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    
+    uint32_t reserved = __atomic_fetch_add(&error_log_head, 1, __ATOMIC_RELAXED);
+    error_info_t* error = &error_log[reserved & ERROR_LOG_MASK];
+    __atomic_store_n(&error->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
     
-    error_info_t* error = &error_log[error_log_index++];
     error->code = code;
     error->severity = severity;
     error->message = message;
     error->file = file;
     error->line = line;
     error->function = function;
-    error->timestamp = get_timestamp();
+    error->timestamp = timestamp;
+    error->repeats = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
     
     /* Capture stack trace */
     capture_stack_trace(error->stack_trace, 16, &error->stack_depth);
     
-    /* Update statistics */
-    system_stats.total_errors++;
-    system_stats.errors_by_severity[severity]++;
-    if (code < 16) {
-        system_stats.errors_by_code[code]++;
+    __atomic_store_n(&error->sequence, reserved + 1, __ATOMIC_RELEASE);
+    return error;
+}
+
+/* The entry reserved as number reserved, if it is published and not yet overwritten */
+static error_info_t* error_log_entry(uint32_t reserved) {
+    error_info_t* error = &error_log[reserved & ERROR_LOG_MASK];
+    if (__atomic_load_n(&error->sequence, __ATOMIC_ACQUIRE) != reserved + 1) {
+        return NULL;
     }
-    system_stats.last_error_time = error->timestamp;
+    return error;
 }
 
 /* Error message formatting */
@@ -331,6 +417,19 @@ static void display_panic_screen(const char* message, const char* file, int line
     terminal_writestring(function);
     terminal_putchar('\n');
     
+    /* The panic's own entry is the newest; name the calls that led to it */
+    uint32_t head = __atomic_load_n(&error_log_head, __ATOMIC_ACQUIRE);
+    error_info_t* panic_entry = head ? error_log_entry(head - 1) : NULL;
+    if (panic_entry) {
+        char symbol[64];
+        for (int i = 0; i < panic_entry->stack_depth && i < 6; i++) {
+            ksym_format(symbol, sizeof(symbol), panic_entry->stack_trace[i]);
+            terminal_writestring("  from ");
+            terminal_writestring(symbol);
+            terminal_putchar('\n');
+        }
+    }
+    
     /* Display system statistics */
     terminal_putchar('\n');
     terminal_writestring("System Statistics:\n");
@@ -358,15 +457,16 @@ static void display_panic_screen(const char* message, const char* file, int line
             terminal_putchar('0' + (uptime / i) % 10);
         }
     }
-    terminal_writestring(" ticks\n");
+    terminal_writestring(" ms\n");
     
     /* Display recent errors */
     terminal_putchar('\n');
     terminal_writestring("Recent Errors:\n");
-    int start_idx = (error_log_index - 5 + 100) % 100;
-    for (int i = 0; i < 5 && i < error_log_index; i++) {
-        int idx = (start_idx + i) % 100;
-        error_info_t* error = &error_log[idx];
+    for (uint32_t i = head < 5 ? 0 : head - 5; i < head; i++) {
+        error_info_t* error = error_log_entry(i);
+        if (!error) {
+            continue;
+        }
         
         terminal_writestring("[");
         terminal_writestring(severity_to_string(error->severity));
@@ -380,70 +480,113 @@ static void display_panic_screen(const char* message, const char* file, int line
     terminal_column = 0;
     terminal_writestring("System halted. Press Ctrl+Alt+Del to reboot.");
     
+    /* The rest of the state, error_log included, goes out on COM1 */
+    __asm__ __volatile__ ("cli");
+    crashdump_write(message, (uint32_t)(uintptr_t)__builtin_return_address(0),
+                    (uint32_t)(uintptr_t)__builtin_frame_address(0));
+    
     /* Infinite loop */
     while (1) {
         __asm__ __volatile__ ("hlt");
     }
 }
 
-/* Main error handling function */
-void error_handler(error_code_t code, error_severity_t severity, 
-                   const char* message, const char* file, int line, const char* function) {
-    /* Log the error */
-    log_error(code, severity, message, file, line, function);
-    
-    /* Display error based on severity */
+/* Append text to a log line of at most ERROR_LINE_MAX - 1 characters */
+#define ERROR_LINE_MAX 120          /* printk's longest message */
+
+static uint32_t error_line_puts(char* line, uint32_t len, const char* text) {
+    while (*text && len < ERROR_LINE_MAX - 1) {
+        line[len++] = *text++;
+    }
+    return len;
+}
+
+static uint32_t error_line_putu(char* line, uint32_t len, uint32_t value) {
+    char digits[10];
+    int count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (count-- && len < ERROR_LINE_MAX - 1) {
+        line[len++] = digits[count];
+    }
+    return len;
+}
+
+/* Where printk_drain hands the log over to this kernel's screen, coloured by level */
+static void error_log_emit(uint32_t level, uint32_t timestamp, const char* text, uint32_t len) {
+    (void)timestamp;
     uint8_t old_color = terminal_color;
-    
-    switch (severity) {
-        case ERROR_DEBUG:
+    switch (level) {
+        case PRINTK_DEBUG:
             terminal_color = vga_entry_color(VGA_COLOR_DARK_GREY, VGA_COLOR_BLACK);
             break;
-        case ERROR_INFO:
+        case PRINTK_INFO:
             terminal_color = vga_entry_color(VGA_COLOR_LIGHT_GREY, VGA_COLOR_BLACK);
             break;
-        case ERROR_WARNING:
+        case PRINTK_WARNING:
             terminal_color = vga_entry_color(VGA_COLOR_YELLOW, VGA_COLOR_BLACK);
             break;
-        case ERROR_ERROR:
+        default:
             terminal_color = vga_entry_color(VGA_COLOR_LIGHT_RED, VGA_COLOR_BLACK);
             break;
-        case ERROR_FATAL:
-            terminal_color = vga_entry_color(VGA_COLOR_RED, VGA_COLOR_BLACK);
-            break;
-        case ERROR_PANIC:
-            display_panic_screen(message, file, line, function);
-            return; /* Never returns */
     }
+    terminal_write(text, len);
+    terminal_putchar('\n');
+    terminal_color = old_color;
+}
+
+/* Show what has been logged; the idle loop calls this, and anything about to print or halt */
+void error_log_flush(void) {
+    printk_drain(error_log_emit, 0xFFFFFFFF);
+}
+
+/*
+ * Main error handling function. Logging is all the caller pays for: the
+ * message goes to printk and reaches the screen at the next flush, so an
+ * error storm in an interrupt handler never waits on the console.
+ */
+void error_handler(error_code_t code, error_severity_t severity, 
+                   const char* message, const char* file, int line, const char* function) {
+    error_info_t* error = log_error(code, severity, message, file, line, function);
     
-    /* Display error message */
-    terminal_writestring("[");
-    terminal_writestring(severity_to_string(severity));
-    terminal_writestring("] ");
-    terminal_writestring(message);
+    if (severity == ERROR_PANIC) {
+        display_panic_screen(message, file, line, function);
+        return; /* Never returns */
+    }
+    if (!error) {
+        return; /* Rate limited: counted, shown with the site's next entry */
+    }
     
+    static const uint8_t levels[] = {
+        PRINTK_DEBUG, PRINTK_INFO, PRINTK_WARNING, PRINTK_ERR, PRINTK_ERR
+    };
+    char text[ERROR_LINE_MAX];
+    uint32_t len = error_line_puts(text, 0, "[");
+    len = error_line_puts(text, len, severity_to_string(severity));
+    len = error_line_puts(text, len, "] ");
+    len = error_line_puts(text, len, message);
     if (file && function) {
-        terminal_writestring(" (");
-        terminal_writestring(file);
-        terminal_writestring(":");
-        /* Simple line number display */
-        if (line < 10) {
-            terminal_putchar('0' + line);
-        } else if (line < 100) {
-            terminal_putchar('0' + line / 10);
-            terminal_putchar('0' + line % 10);
-        }
-        terminal_writestring(" ");
-        terminal_writestring(function);
-        terminal_writestring(")");
+        len = error_line_puts(text, len, " (");
+        len = error_line_puts(text, len, file);
+        len = error_line_puts(text, len, ":");
+        len = error_line_putu(text, len, (uint32_t)line);
+        len = error_line_puts(text, len, " ");
+        len = error_line_puts(text, len, function);
+        len = error_line_puts(text, len, ")");
     }
-    terminal_putchar('\n');
-    
-    /* Restore terminal color */
-    terminal_color = old_color;
+    if (error->repeats) {
+        len = error_line_puts(text, len, " [");
+        len = error_line_putu(text, len, error->repeats);
+        len = error_line_puts(text, len, " more suppressed]");
+    }
+    text[len] = '\0';
+    printk(levels[severity], text);
     
     /* For fatal errors, stop the system */
     if (severity == ERROR_FATAL) {
+        error_log_flush();
         terminal_writestring("Fatal error encountered. System halted.\n");
         while (1) {
             __asm__ __volatile__ ("hlt");
@@ -479,6 +622,66 @@ static void update_performance_stats(void) {
     system_stats.cpu_usage = (perf_stats.total_cpu_time / 100) % 100;
 }
 
+/* Write an unsigned decimal number */
+static void terminal_writedec(uint32_t value) {
+    char digits[10];
+    int count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (count--) {
+        terminal_putchar(digits[count]);
+    }
+}
+
+/* Per-line interrupt rates and latencies, flagging lines over budget */
+static void display_interrupt_stats(void) {
+    uint32_t khz = clocksource_tsc_khz();
+    
+    terminal_writestring("Interrupts: ");
+    terminal_writedec((uint32_t)percpu_counter_read(PCPU_INTERRUPTS));
+    terminal_writestring("\n");
+    
+    for (uint32_t line = 0; line < IRQ_LINES; line++) {
+        uint32_t max_cycles;
+        uint32_t count = irq_get_stats(line, &max_cycles);
+        if (count == 0) {
+            continue;
+        }
+        
+        /* The most populated log2 bucket is the typical latency */
+        uint32_t buckets[IRQ_LATENCY_BUCKETS];
+        uint32_t typical = 0;
+        irq_get_latency_histogram(line, buckets);
+        for (uint32_t i = 1; i < IRQ_LATENCY_BUCKETS; i++) {
+            if (buckets[i] > buckets[typical]) {
+                typical = i;
+            }
+        }
+        
+        terminal_writestring("  IRQ ");
+        terminal_writedec(line);
+        terminal_writestring(": ");
+        terminal_writedec(count);
+        terminal_writestring(" hits, ~2^");
+        terminal_writedec(typical);
+        terminal_writestring(" cycles typical, max ");
+        if (khz) {
+            uint32_t max_us = max_cycles / khz * 1000 + max_cycles % khz * 1000 / khz;
+            terminal_writedec(max_us);
+            terminal_writestring(" us");
+            if (max_us > IRQ_LATENCY_BUDGET_US) {
+                terminal_writestring(" OVER BUDGET");
+            }
+        } else {
+            terminal_writedec(max_cycles);
+            terminal_writestring(" cycles");
+        }
+        terminal_writestring("\n");
+    }
+}
+
 /* Display system status */
 void display_system_status(void) {
     update_performance_stats();
@@ -494,7 +697,7 @@ void display_system_status(void) {
             terminal_putchar('0' + (uptime / i) % 10);
         }
     }
-    terminal_writestring(" ticks\n");
+    terminal_writestring(" ms\n");
     
     terminal_writestring("Total Errors: ");
     uint32_t total = system_stats.total_errors;
@@ -527,6 +730,8 @@ void display_system_status(void) {
     }
     terminal_writestring("%\n");
     
+    display_interrupt_stats();
+    
     terminal_color = old_color;
 }
 
@@ -544,6 +749,7 @@ void run_system_diagnostics(void) {
     error_handler(ERROR_MEMORY_ALLOCATION, ERROR_ERROR, "Simulated memory allocation failure", __FILE__, __LINE__, __func__);
     
     /* Display system status */
+    error_log_flush();
     display_system_status();
     
     terminal_writestring("Diagnostics completed.\n\n");
@@ -565,6 +771,7 @@ void security_audit(void) {
     /* Validate system calls */
     error_handler(ERROR_NONE, ERROR_INFO, "Validating system call handlers", __FILE__, __LINE__, __func__);
     
+    error_log_flush();
     terminal_writestring("Security audit completed. No critical issues found.\n\n");
 }
 
@@ -590,6 +797,7 @@ void performance_analysis(void) {
         terminal_writestring("Recommendation: Investigate error sources and fix underlying issues\n");
     }
     
+    error_log_flush();
     terminal_writestring("Performance analysis completed.\n\n");
 }
 
@@ -614,6 +822,22 @@ void system_health_check(void) {
     terminal_putchar('\n');
 }
 
+/* One site failing in a loop: every error is counted, only the burst is logged */
+static void test_error_storm(void) {
+    uint32_t total = system_stats.total_errors;
+    uint32_t head = error_log_head;
+    for (int i = 0; i < 1000; i++) {
+        error_handler(ERROR_NETWORK_ERROR, ERROR_DEBUG, "Simulated receive error", __FILE__, __LINE__, __func__);
+    }
+    error_log_flush();
+    
+    if (system_stats.total_errors - total == 1000 && error_log_head - head <= ERROR_RATELIMIT_BURST) {
+        terminal_writestring("Error storm rate limit: PASSED\n");
+    } else {
+        terminal_writestring("Error storm rate limit: FAILED\n");
+    }
+}
+
 /* Main kernel function */
 void kernel_main(void) {
     /* Initialize terminal */
@@ -628,6 +852,8 @@ void kernel_main(void) {
     /* Initialize system statistics */
     memset(&system_stats, 0, sizeof(system_stats));
     memset(&perf_stats, 0, sizeof(perf_stats));
+    clocksource_init();
+    printk_init(get_timestamp, 0);
     system_start_time = get_timestamp();
     
     /* Display welcome message */
@@ -645,6 +871,7 @@ void kernel_main(void) {
     terminal_writestring("Testing error handling system...\n");
     error_handler(ERROR_NONE, ERROR_INFO, "System initialized successfully", __FILE__, __LINE__, __func__);
     error_handler(ERROR_DEVICE_ERROR, ERROR_WARNING, "Simulated device warning", __FILE__, __LINE__, __func__);
+    test_error_storm();
     
     /* Demonstrate panic system (commented out to avoid actual panic) */
     /*
@@ -683,13 +910,16 @@ void kernel_main(void) {
         update_performance_stats();
         
         /* Simulate some system activity */
-        perf_stats.syscalls_count++;
+        this_cpu_inc(PCPU_SYSCALLS);
         
         /* Occasionally run health checks */
-        if (perf_stats.syscalls_count % 1000 == 0) {
+        if ((uint32_t)percpu_counter_read(PCPU_SYSCALLS) % 1000 == 0) {
             error_handler(ERROR_NONE, ERROR_INFO, "Periodic health check", __FILE__, __LINE__, __func__);
         }
         
+        /* Show what was logged since the last pass */
+        error_log_flush();
+        
         /* Halt until next interrupt */
         __asm__ __volatile__ ("hlt");
     }
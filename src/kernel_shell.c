@@ -24,25 +24,111 @@
 #define VGA_COLOR_LIGHT_BROWN 14
 #define VGA_COLOR_WHITE 15
 
+/* Shadow-buffered console (vga_console.c) */
+extern void console_initialize(uint8_t color);
+extern void console_setcolor(uint8_t color);
+extern void console_putentryat(char c, uint8_t color, uint32_t x, uint32_t y);
+extern void console_putchar(char c);
+extern void console_flush(void);
+
+/* Serial console (serial.c) */
+extern void serial_init(int use_irq);
+
+/* Keyboard line discipline (tty.c) */
+extern void tty_init(int use_irq);
+extern int tty_read(char* buffer, uint32_t size);
+
+/* Kernel log ring (printk.c) */
+extern void printk_init(uint32_t (*clock)(void), int serial);
+extern uint32_t printk_console_drain(void);
+
+/* Boot timeline (initcall.c) */
+extern void initcall_begin(const char* name);
+extern void initcall_end(void);
+extern void initcall_run(const char* name, void (*init)(void));
+extern void initcall_report(uint32_t tsc_khz);
+
+/* TSC clock (clocksource.c) */
+extern void clocksource_init(void);
+extern uint32_t ktime_ms(void);
+extern uint32_t clocksource_tsc_khz(void);
+
+/* Per-CPU counters (percpu.c) */
+#define PCPU_COUNTERS 8
+extern uint64_t percpu_counter_read(uint32_t counter);
+
+/* Kernel heap (kernel_heap.c) */
+extern uint32_t heap_used(void);
+
+/* Proc filesystem (procfs.c) */
+#define PROCFS_MAX_ENTRIES 16           /* Must match procfs.c */
+
+struct seq_file {                       /* (must match procfs.c) */
+    char* buf;
+    uint32_t size;
+    uint32_t count;
+};
+
+extern void seq_puts(struct seq_file* m, const char* text);
+extern void seq_putu(struct seq_file* m, uint32_t value);
+extern void seq_put_named(struct seq_file* m, const char* name, uint64_t value);
+extern void procfs_init(void);
+extern int procfs_register(const char* name, void (*show)(struct seq_file* m));
+extern int procfs_register_writable(const char* name, void (*show)(struct seq_file* m),
+                                    int (*store)(const char* buf, uint32_t size));
+extern int procfs_lookup(const char* name);
+extern uint32_t procfs_count(void);
+extern const char* procfs_name(uint32_t entry);
+extern int procfs_read(uint32_t entry, uint32_t offset, void* buffer, uint32_t size);
+extern int procfs_write(uint32_t entry, const void* buffer, uint32_t size);
+
+/* Runtime tunables (sysctl.c) */
+#define SYSCTL_UINT 0                   /* Must match sysctl.c */
+#define SYSCTL_VALUE_LEN 12
+extern void sysctl_init(void);
+extern int sysctl_register(const char* name, uint32_t type, void* value, int64_t min, int64_t max);
+extern int sysctl_lookup(const char* name);
+extern uint32_t sysctl_count(void);
+extern const char* sysctl_name(uint32_t entry);
+extern int sysctl_set(uint32_t entry, const char* text);
+extern uint32_t sysctl_format(uint32_t entry, char* buffer, uint32_t size);
+extern int sysctl_assign(const char* text, uint32_t length);
+extern uint32_t sysctl_apply_cmdline(const char* cmdline);
+
+/* Initial RAM filesystem (initramfs.c) */
+extern int initramfs_module(const uint8_t** start, uint32_t* size);
+extern int cpio_unpack(const uint8_t* archive, uint32_t size,
+                       int (*add)(const char* path, int is_directory, const uint8_t* data, uint32_t size));
+
+/* Kernel command line (cmdline.c) */
+extern const char* cmdline_get(void);
+
 /* Simple process management for Phase 9 */
 int current_process = 0;
 void process_kill(int pid) { (void)pid; }
-void process_switch(void) { }
+void process_switch(uint32_t pid) { (void)pid; }
 
 /* Timer and keyboard handlers */
 uint32_t timer_ticks = 0;
 uint32_t timer_frequency = 1000;
-void timer_handler(void) { timer_ticks++; }
+static void process_tick(void);
+void timer_handler(void) { timer_ticks++; process_tick(); console_flush(); }
 void keyboard_handler(void) { }
 
 /* Simple paging functions */
 void paging_alloc_frame(void) { }
 void paging_map_page(uint32_t virt, uint32_t phys) { (void)virt; (void)phys; }
+int paging_handle_fault(uint32_t addr, uint32_t error_code) { (void)addr; (void)error_code; return 0; }
 
 /* Simple process management */
 struct process { int dummy; };
 struct process processes[1];
 int process_create(void) { return 0; }
+uint32_t process_fork(void) { return (uint32_t)-1; }
+void process_sleep(uint32_t ticks) { (void)ticks; }
+
+/* The shell runs in ring 0 here; SYSEXIT would return it to ring 3 */
+uint32_t sysenter_enabled = 0;
 
 /* VGA Display Functions */
 static inline uint8_t vga_entry_color(uint8_t fg, uint8_t bg) {
@@ -53,52 +139,20 @@ static inline uint16_t vga_entry(unsigned char uc, uint8_t color) {
     return (uint16_t) uc | (uint16_t) color << 8;
 }
 
-static const size_t VGA_WIDTH = 80;
-static const size_t VGA_HEIGHT = 25;
-
-size_t terminal_row;
-size_t terminal_column;
-uint8_t terminal_color;
-uint16_t* terminal_buffer;
-
 void terminal_initialize(void) {
-    terminal_row = 0;
-    terminal_column = 0;
-    terminal_color = vga_entry_color(VGA_COLOR_LIGHT_GREY, VGA_COLOR_BLACK);
-    terminal_buffer = (uint16_t*) 0xB8000;
-    for (size_t y = 0; y < VGA_HEIGHT; y++) {
-        for (size_t x = 0; x < VGA_WIDTH; x++) {
-            const size_t index = y * VGA_WIDTH + x;
-            terminal_buffer[index] = vga_entry(' ', terminal_color);
-        }
-    }
+    console_initialize(vga_entry_color(VGA_COLOR_LIGHT_GREY, VGA_COLOR_BLACK));
 }
 
 void terminal_setcolor(uint8_t color) {
-    terminal_color = color;
+    console_setcolor(color);
 }
 
 void terminal_putentryat(char c, uint8_t color, size_t x, size_t y) {
-    const size_t index = y * VGA_WIDTH + x;
-    terminal_buffer[index] = vga_entry(c, color);
+    console_putentryat(c, color, x, y);
 }
 
 void terminal_putchar(char c) {
-    if (c == '\n') {
-        terminal_column = 0;
-        if (++terminal_row == VGA_HEIGHT) {
-            terminal_row = 0;
-        }
-        return;
-    }
-    
-    terminal_putentryat(c, terminal_color, terminal_column, terminal_row);
-    if (++terminal_column == VGA_WIDTH) {
-        terminal_column = 0;
-        if (++terminal_row == VGA_HEIGHT) {
-            terminal_row = 0;
-        }
-    }
+    console_putchar(c);
 }
 
 void terminal_write(const char* data, size_t size) {
@@ -132,44 +186,60 @@ static inline uint16_t inw(uint16_t port) {
     return ret;
 }
 
-/* Simple memory functions */
-static void* memset(void* s, int c, size_t n) {
-    unsigned char* p = s;
-    while (n--) *p++ = c;
-    return s;
-}
+/* Lock-free byte ring (spsc_ring.c) (must match struct spsc_ring there) */
+struct spsc_ring {
+    uint8_t* buffer;
+    uint32_t mask;
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t tail __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
 
-static size_t strlen(const char* str) {
-    size_t len = 0;
-    while (str[len]) len++;
-    return len;
-}
+extern void spsc_init(struct spsc_ring* ring, void* buffer, uint32_t size);
+extern uint32_t spsc_count(const struct spsc_ring* ring);
+extern uint32_t spsc_write(struct spsc_ring* ring, const void* data, uint32_t size);
+extern uint32_t spsc_read(struct spsc_ring* ring, void* data, uint32_t size);
+
+/* Kernel runtime library (klib.c) */
+extern void* memcpy(void* dest, const void* src, size_t n);
+extern void* memset(void* s, int c, size_t n);
+extern int memcmp(const void* a, const void* b, size_t n);
+extern size_t strlen(const char* str);
+extern int strcmp(const char* s1, const char* s2);
 
+/* Simple string functions */
 static char* strcpy(char* dest, const char* src) {
     char* d = dest;
     while ((*d++ = *src++));
     return dest;
 }
 
-static int strcmp(const char* s1, const char* s2) {
-    while (*s1 && (*s1 == *s2)) {
-        s1++;
-        s2++;
-    }
-    return *(const unsigned char*)s1 - *(const unsigned char*)s2;
-}
-
 /* Forward declarations for syscall functions */
 static void syscall_exit(int code) __attribute__((used));
 static int syscall_read(int fd, void* buffer, int size) __attribute__((used));
 static int syscall_write(int fd, const void* buffer, int size) __attribute__((used));
-static int syscall_open(const char* filename) __attribute__((used));
+static int syscall_open(const char* filename, int flags) __attribute__((used));
 static int syscall_close(int fd) __attribute__((used));
 static int syscall_chdir(const char* path) __attribute__((used));
 static int syscall_getcwd(char* buffer, int size) __attribute__((used));
 static int syscall_opendir(const char* path) __attribute__((used));
 static int syscall_readdir(int dirfd, void* dirent, int size) __attribute__((used));
 static int syscall_closedir(int dirfd) __attribute__((used));
+static int syscall_getdents(int dirfd, void* buffer, int size) __attribute__((used));
+static int syscall_pipe(int* fds) __attribute__((used));
+static int syscall_stats(void* buffer, int size) __attribute__((used));
+
+/* Ring operation hooks (usermode_syscall_handlers.c); arguments are fd, addr, len */
+struct syscall_args {
+    uint32_t arg1;
+    uint32_t arg2;
+    uint32_t arg3;
+    uint32_t arg4;
+    uint32_t arg5;
+};
+
+#define RING_OP_READDIR 5
+extern void syscall_ring_init(void);
+extern void ring_register_op(uint32_t opcode, uint32_t (*handler)(const struct syscall_args* args));
 
 /* User space management */
 #define USER_STACK_SIZE 4096
@@ -183,10 +253,21 @@ struct user_process {
     uint32_t eax, ebx, ecx, edx, esi, edi, ebp;
     uint8_t* stack;
     int running;
+    uint32_t cpu_ticks;                 /* Timer ticks it held the CPU for */
+    uint32_t switches;                  /* Times it was switched to */
+    uint32_t cache_hotness;             /* Ticks since it last came onto the CPU */
 };
 
 static struct user_process shell_process;
 
+/* Charge the tick to whoever holds the CPU; only the stats call reads these */
+static void process_tick(void) {
+    if (shell_process.running) {
+        shell_process.cpu_ticks++;
+        shell_process.cache_hotness++;
+    }
+}
+
 /* TSS structure for user space switching */
 struct tss_entry {
     uint32_t prev_tss;
@@ -291,49 +372,550 @@ static void tss_install(void) {
 #define SYSCALL_CLOSE 5
 #define SYSCALL_CHDIR 16
 #define SYSCALL_GETCWD 17
+#define SYSCALL_PIPE 28
 #define SYSCALL_OPENDIR 22
 #define SYSCALL_READDIR 23
 #define SYSCALL_CLOSEDIR 24
+#define SYSCALL_GETDENTS 51
+#define SYSCALL_STATS 52
+
+/*
+ * System status snapshot for top (must match shell.c). Everything in it
+ * is a counter some path keeps anyway, copied out only when asked for:
+ * rates are the caller's deltas between two snapshots, so nothing is
+ * spent on statistics while nobody is watching. Counters are the low
+ * halves of the per-CPU totals, which is all a delta needs.
+ */
+#define STATS_MAX_PROCS 8
+
+struct stats_proc {
+    uint32_t pid;
+    uint32_t running;
+    uint32_t cpu_ticks;
+    uint32_t switches;
+    uint32_t cache_hotness;
+    uint32_t mem_bytes;
+    char name[16];
+};
+
+struct sys_stats {
+    uint32_t uptime_ms;
+    uint32_t tsc_khz;
+    uint32_t ticks;
+    uint32_t hz;
+    uint32_t counters[PCPU_COUNTERS];   /* Indexed as in percpu.c */
+    uint32_t heap_used;
+    uint32_t proc_count;
+    struct stats_proc procs[STATS_MAX_PROCS];
+};
+
+/* open flags */
+#define O_CREAT 0x40
+#define O_TRUNC 0x200
+
+/* A pipe end that would have to wait: this stage has no scheduler to block in */
+#define SYSCALL_AGAIN -11
 
 /* Simple file system simulation */
-#define MAX_FILES 16
-#define MAX_FILENAME 256
-#define FILE_DATA_SIZE 4096
+#define MAX_FILES 32                   /* One bit each of file_inode_bitmap */
+#define MAX_FILENAME 256                /* Longest path component */
+#define FILE_NAME_LEN 64                /* Longest name a file can have, with its NUL */
+#define FS_BLOCK_SIZE 512
+#define FS_BLOCKS 128                   /* 64 KiB of file data, shared by all files */
+#define FILE_MAX_EXTENTS 8
+#define FILE_PREALLOC_MAX 16            /* Blocks a growing file may claim ahead of its size */
+#define FILE_HASH_SIZE 32               /* Directory index buckets; power of two */
+#define ROOT_INODE 0                    /* files[0], the root directory "." */
+#define DCACHE_SIZE 32
+#define DCACHE_HASH_SIZE 16             /* Power of two */
+#define DNAME_LEN 32                    /* Longer components are looked up uncached */
+#define DIRFD_BASE 100                  /* opendir handles are DIRFD_BASE + inode */
+#define MAX_PIPES 8
+#define PIPE_SIZE 1024                  /* Bytes; power of two */
+#define PIPEFD_BASE 200                 /* Pipe n's read end is PIPEFD_BASE + 2n, its write end one more */
+#define PROCFD_BASE 300                 /* Proc entry n, opened, is PROCFD_BASE + n */
+#define DIR_END (MAX_FILES + PROCFS_MAX_ENTRIES) /* Past the last entry a directory cursor can reach */
+
+/* A run of contiguous data blocks */
+struct file_extent {
+    uint16_t start;
+    uint16_t count;
+};
 
 struct file_entry {
-    char name[MAX_FILENAME];
-    uint8_t data[FILE_DATA_SIZE];
+    char name[FILE_NAME_LEN];
+    struct file_extent extents[FILE_MAX_EXTENTS]; /* In file order */
+    uint32_t extent_count;
+    uint32_t blocks;                    /* Allocated, over all extents */
     size_t size;
     int is_directory;
     int used;
+    int parent;                         /* Inode (files[] index) of the directory holding it */
+    uint32_t hash;                      /* file_name_hash(parent, name) */
+    struct file_entry* hash_next;       /* Directory index chain */
+    const uint8_t* image;               /* Initramfs bytes read in place until the first write, or NULL */
 };
 
 static struct file_entry files[MAX_FILES];
+static uint8_t fs_blocks[FS_BLOCKS][FS_BLOCK_SIZE];
+static uint32_t fs_block_bitmap[FS_BLOCKS / 32]; /* Set bits are blocks in use */
+static size_t file_offsets[MAX_FILES];  /* Read/write position of fd inode + 3 */
+static struct file_entry* file_hash[FILE_HASH_SIZE];
+static uint32_t file_inode_bitmap;      /* Bit n set: files[n] in use */
+static int current_dir = ROOT_INODE;
+static int dir_cursors[MAX_FILES];      /* Next inode readdir/getdents looks at, per directory */
+static int proc_dir = -1;               /* The directory the proc entries appear in */
+static uint32_t fs_prealloc_blocks = FILE_PREALLOC_MAX;  /* Tunable: sysctl fs_prealloc_blocks */
+static uint32_t proc_offsets[PROCFS_MAX_ENTRIES]; /* Read position of each open proc entry */
+
+/*
+ * Pipes: a byte ring between a write end and a read end. The shell runs
+ * its pipeline stages itself, so both ends are non-blocking: an empty
+ * pipe with a writer, or a full one with a reader, returns SYSCALL_AGAIN
+ * and the stage lets the others run.
+ */
+struct pipe {
+    int used;
+    struct spsc_ring ring;
+    uint8_t buffer[PIPE_SIZE];
+    uint32_t reader_count;
+    uint32_t writer_count;
+};
+
+static struct pipe pipes[MAX_PIPES];
+
+/* FNV-1a over the parent inode and the name */
+static uint32_t file_name_hash(int parent, const char* name) {
+    uint32_t hash = 2166136261u ^ (uint32_t)parent;
+    hash *= 16777619u;
+    while (*name) {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Inode of name in directory parent, through the index; -1 if absent */
+static int file_lookup(int parent, const char* name) {
+    uint32_t hash = file_name_hash(parent, name);
+    for (struct file_entry* file = file_hash[hash & (FILE_HASH_SIZE - 1)]; file; file = file->hash_next) {
+        if (file->hash == hash && file->parent == parent && strcmp(file->name, name) == 0) {
+            return (int)(file - files);
+        }
+    }
+    return -1;
+}
+
+/*
+ * Dentry cache: remembers what (parent, component) resolved to, including
+ * names that do not exist (inode -1), so that repeated path walks skip
+ * the directory lookup. Least recently used entries are reused first.
+ */
+struct dentry {
+    int parent;
+    int inode;                          /* -1: negative entry */
+    uint32_t hash;
+    char name[DNAME_LEN];
+    struct dentry* hash_next;
+    struct dentry* lru_next;            /* Most recently used first */
+    struct dentry* lru_prev;
+    int used;
+};
+
+static struct dentry dentries[DCACHE_SIZE];
+static struct dentry* dcache_hash[DCACHE_HASH_SIZE];
+static struct dentry* dcache_lru_head;
+static struct dentry* dcache_lru_tail;
+static uint32_t dcache_hits;
+static uint32_t dcache_misses;
+
+static void dcache_lru_remove(struct dentry* dentry) {
+    if (dentry->lru_prev) dentry->lru_prev->lru_next = dentry->lru_next;
+    else dcache_lru_head = dentry->lru_next;
+    if (dentry->lru_next) dentry->lru_next->lru_prev = dentry->lru_prev;
+    else dcache_lru_tail = dentry->lru_prev;
+}
+
+static void dcache_lru_push_front(struct dentry* dentry) {
+    dentry->lru_prev = NULL;
+    dentry->lru_next = dcache_lru_head;
+    if (dcache_lru_head) dcache_lru_head->lru_prev = dentry;
+    else dcache_lru_tail = dentry;
+    dcache_lru_head = dentry;
+}
+
+/* Unused entries wait at the tail, to be reused first */
+static void dcache_lru_push_back(struct dentry* dentry) {
+    dentry->lru_next = NULL;
+    dentry->lru_prev = dcache_lru_tail;
+    if (dcache_lru_tail) dcache_lru_tail->lru_next = dentry;
+    else dcache_lru_head = dentry;
+    dcache_lru_tail = dentry;
+}
+
+static void dcache_hash_remove(struct dentry* dentry) {
+    struct dentry** link = &dcache_hash[dentry->hash & (DCACHE_HASH_SIZE - 1)];
+    while (*link != dentry) {
+        link = &(*link)->hash_next;
+    }
+    *link = dentry->hash_next;
+    dentry->used = 0;
+}
+
+static void dcache_init(void) {
+    memset(dcache_hash, 0, sizeof(dcache_hash));
+    dcache_lru_head = NULL;
+    dcache_lru_tail = NULL;
+    for (int i = 0; i < DCACHE_SIZE; i++) {
+        dentries[i].used = 0;
+        dcache_lru_push_front(&dentries[i]);
+    }
+    dcache_hits = 0;
+    dcache_misses = 0;
+}
+
+static struct dentry* dcache_find(int parent, const char* name, uint32_t hash) {
+    for (struct dentry* dentry = dcache_hash[hash & (DCACHE_HASH_SIZE - 1)]; dentry; dentry = dentry->hash_next) {
+        if (dentry->hash == hash && dentry->parent == parent && strcmp(dentry->name, name) == 0) {
+            return dentry;
+        }
+    }
+    return NULL;
+}
+
+/* Resolve one component in parent: a single probe on a hit */
+static int dcache_lookup(int parent, const char* name) {
+    if (strlen(name) >= DNAME_LEN) {
+        return file_lookup(parent, name);
+    }
+    uint32_t hash = file_name_hash(parent, name);
+    struct dentry* dentry = dcache_find(parent, name, hash);
+    if (dentry) {
+        dcache_hits++;
+    } else {
+        dcache_misses++;
+        dentry = dcache_lru_tail;
+        if (dentry->used) {
+            dcache_hash_remove(dentry);
+        }
+        dentry->parent = parent;
+        dentry->inode = file_lookup(parent, name);
+        dentry->hash = hash;
+        strcpy(dentry->name, name);
+        dentry->hash_next = dcache_hash[hash & (DCACHE_HASH_SIZE - 1)];
+        dcache_hash[hash & (DCACHE_HASH_SIZE - 1)] = dentry;
+        dentry->used = 1;
+    }
+    dcache_lru_remove(dentry);
+    dcache_lru_push_front(dentry);
+    return dentry->inode;
+}
+
+/* A name came into existence or went away: drop what the cache believed */
+static void dcache_invalidate(int parent, const char* name) {
+    if (strlen(name) >= DNAME_LEN) {
+        return;
+    }
+    struct dentry* dentry = dcache_find(parent, name, file_name_hash(parent, name));
+    if (dentry) {
+        dcache_hash_remove(dentry);
+        dcache_lru_remove(dentry);
+        dcache_lru_push_back(dentry);
+    }
+}
+
+/*
+ * Resolve path, absolute or relative to the current directory, one dentry
+ * probe per component. Every component but the last must be a directory.
+ * Returns the inode, or -1.
+ */
+static int path_walk(const char* path) {
+    int inode = *path == '/' ? ROOT_INODE : current_dir;
+    char component[MAX_FILENAME];
+    while (*path) {
+        while (*path == '/') path++;
+        if (!*path) break;
+        
+        size_t length = 0;
+        while (path[length] && path[length] != '/') {
+            if (length == MAX_FILENAME - 1) return -1;
+            component[length] = path[length];
+            length++;
+        }
+        component[length] = '\0';
+        path += length;
+        
+        if (!files[inode].is_directory) return -1;
+        if (strcmp(component, ".") == 0) continue;
+        if (strcmp(component, "..") == 0) {
+            if (inode != ROOT_INODE) inode = files[inode].parent;
+            continue;
+        }
+        inode = dcache_lookup(inode, component);
+        if (inode < 0) return -1;
+    }
+    return inode;
+}
+
+/* Take the lowest free inode and enter it in parent's index; -1 if full or taken */
+static int file_create(int parent, const char* name, int is_directory) {
+    if (file_inode_bitmap == 0xFFFFFFFF >> (32 - MAX_FILES) || strlen(name) >= FILE_NAME_LEN ||
+        file_lookup(parent, name) >= 0) {
+        return -1;
+    }
+    int inode = __builtin_ctz(~file_inode_bitmap);
+    file_inode_bitmap |= 1u << inode;
+    
+    struct file_entry* file = &files[inode];
+    strcpy(file->name, name);
+    file->size = 0;
+    file->extent_count = 0;
+    file->blocks = 0;
+    file->image = NULL;
+    file->is_directory = is_directory;
+    file->used = 1;
+    file->parent = parent;
+    file->hash = file_name_hash(parent, name);
+    file->hash_next = file_hash[file->hash & (FILE_HASH_SIZE - 1)];
+    file_hash[file->hash & (FILE_HASH_SIZE - 1)] = file;
+    dcache_invalidate(parent, name);
+    return inode;
+}
+
+/* Data blocks */
+static int fs_block_used(uint32_t block) {
+    return (fs_block_bitmap[block / 32] >> (block % 32)) & 1;
+}
+
+/*
+ * Allocate up to want blocks in one run: at hint if it is free, so that a
+ * growing file extends its last extent, else the first free run long
+ * enough, else the longest there is. Returns the run's length, 0 when the
+ * disk is full.
+ */
+static uint32_t fs_alloc_run(uint32_t want, uint32_t hint, uint32_t* start) {
+    uint32_t best_start = 0;
+    uint32_t best_count = 0;
+    for (uint32_t block = hint < FS_BLOCKS && !fs_block_used(hint) ? hint : 0; block < FS_BLOCKS; block++) {
+        if (fs_block_used(block)) {
+            continue;
+        }
+        uint32_t count = 0;
+        while (block + count < FS_BLOCKS && count < want && !fs_block_used(block + count)) {
+            count++;
+        }
+        if (count > best_count) {
+            best_start = block;
+            best_count = count;
+        }
+        if (count == want || block == hint) {
+            break;
+        }
+        block += count;
+    }
+    for (uint32_t i = 0; i < best_count; i++) {
+        fs_block_bitmap[(best_start + i) / 32] |= 1u << ((best_start + i) % 32);
+        memset(fs_blocks[best_start + i], 0, FS_BLOCK_SIZE);
+    }
+    *start = best_start;
+    return best_count;
+}
+
+/*
+ * Grow file to at least blocks data blocks; -1 when out of blocks or
+ * extents. A file that keeps growing is given as many blocks again as it
+ * has, up to fs_prealloc_blocks, so that files growing side by side still
+ * get long extents.
+ */
+static int file_reserve(struct file_entry* file, uint32_t blocks) {
+    uint32_t prealloc = fs_prealloc_blocks;
+    while (file->blocks < blocks) {
+        uint32_t want = blocks - file->blocks;
+        uint32_t ahead = file->blocks < prealloc ? file->blocks : prealloc;
+        if (want < ahead) {
+            want = ahead;
+        }
+        struct file_extent* last = file->extent_count ? &file->extents[file->extent_count - 1] : NULL;
+        uint32_t hint = last ? last->start + last->count : FS_BLOCKS;
+        if (file->extent_count == FILE_MAX_EXTENTS && (hint >= FS_BLOCKS || fs_block_used(hint))) {
+            return -1;
+        }
+        uint32_t start;
+        uint32_t count = fs_alloc_run(want, hint, &start);
+        if (count == 0) {
+            return -1;
+        }
+        if (last && start == hint) {
+            last->count += count;
+        } else {
+            file->extents[file->extent_count].start = start;
+            file->extents[file->extent_count].count = count;
+            file->extent_count++;
+        }
+        file->blocks += count;
+    }
+    return 0;
+}
+
+/*
+ * Copy between buffer and the file's bytes at offset, a whole extent's
+ * worth at a time; the blocks must exist.
+ */
+static void file_copy(struct file_entry* file, size_t offset, uint8_t* buffer, size_t size, int write) {
+    size_t extent_offset = 0;
+    for (uint32_t i = 0; i < file->extent_count && size; i++) {
+        size_t extent_size = file->extents[i].count * FS_BLOCK_SIZE;
+        if (offset < extent_offset + extent_size) {
+            uint8_t* data = fs_blocks[file->extents[i].start] + (offset - extent_offset);
+            size_t chunk = extent_offset + extent_size - offset;
+            if (chunk > size) {
+                chunk = size;
+            }
+            if (write) {
+                memcpy(data, buffer, chunk);
+            } else {
+                memcpy(buffer, data, chunk);
+            }
+            offset += chunk;
+            buffer += chunk;
+            size -= chunk;
+        }
+        extent_offset += extent_size;
+    }
+}
+
+/* Give the file's blocks back, for one the initramfs replaces */
+static void file_release(struct file_entry* file) {
+    for (uint32_t i = 0; i < file->extent_count; i++) {
+        for (uint32_t block = file->extents[i].start; block < file->extents[i].start + file->extents[i].count; block++) {
+            fs_block_bitmap[block / 32] &= ~(1u << (block % 32));
+        }
+    }
+    file->extent_count = 0;
+    file->blocks = 0;
+}
+
+/*
+ * Copy a file still read from the initramfs into blocks of its own, so
+ * that it can be written; the module is never written. -1 when out of
+ * blocks, the file left in place.
+ */
+static int file_detach(struct file_entry* file) {
+    const uint8_t* image = file->image;
+    if (file_reserve(file, (file->size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE) < 0) {
+        return -1;
+    }
+    file->image = NULL;
+    file_copy(file, 0, (uint8_t*)image, file->size, 1);
+    return 0;
+}
+
+static int file_write(int inode, size_t offset, const void* buffer, size_t size) {
+    struct file_entry* file = &files[inode];
+    size_t end = offset + size;
+    if (file->is_directory || (file->image && file_detach(file) < 0) ||
+        file_reserve(file, (end + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE) < 0) {
+        return -1;
+    }
+    file_copy(file, offset, (uint8_t*)buffer, size, 1);
+    if (end > file->size) {
+        file->size = end;
+    }
+    return (int)size;
+}
+
+static int file_read(int inode, size_t offset, void* buffer, size_t size) {
+    struct file_entry* file = &files[inode];
+    if (file->is_directory) {
+        return -1;
+    }
+    if (offset >= file->size) {
+        return 0;
+    }
+    if (size > file->size - offset) {
+        size = file->size - offset;
+    }
+    if (file->image) {
+        memcpy(buffer, file->image + offset, size);
+    } else {
+        file_copy(file, offset, (uint8_t*)buffer, size, 0);
+    }
+    return (int)size;
+}
+
+/*
+ * Enter one initramfs entry at path, making the directories on the way
+ * that the archive did not list first. A file keeps its data where it
+ * lies in the module; one of that name already here, a built-in one
+ * included, gives up its blocks and takes the archive's bytes instead.
+ */
+static int initramfs_add(const char* path, int is_directory, const uint8_t* data, uint32_t size) {
+    int inode = ROOT_INODE;
+    char component[FILE_NAME_LEN];
+    while (*path) {
+        size_t length = 0;
+        while (path[length] && path[length] != '/') {
+            if (length == FILE_NAME_LEN - 1) return -1;
+            component[length] = path[length];
+            length++;
+        }
+        component[length] = '\0';
+        path += length;
+        while (*path == '/') path++;
+        if (strcmp(component, ".") == 0 || strcmp(component, "..") == 0) return -1;
+        
+        int directory = *path || is_directory;
+        int parent = inode;
+        inode = file_lookup(parent, component);
+        if (inode < 0) {
+            inode = file_create(parent, component, directory);
+        }
+        if (inode < 0 || files[inode].is_directory != directory) return -1;
+    }
+    if (!is_directory) {
+        file_release(&files[inode]);
+        files[inode].image = data;
+        files[inode].size = size;
+    }
+    return 0;
+}
 
 /* Initialize file system */
 static void filesystem_init(void) {
     memset(files, 0, sizeof(files));
+    memset(file_hash, 0, sizeof(file_hash));
+    memset(fs_block_bitmap, 0, sizeof(fs_block_bitmap));
+    memset(dir_cursors, 0, sizeof(dir_cursors));
+    file_inode_bitmap = 0;
+    current_dir = ROOT_INODE;
+    dcache_init();
     
-    /* Create root directory */
+    /* Create root directory: its own parent, so that it never matches a lookup by name */
     strcpy(files[0].name, ".");
     files[0].is_directory = 1;
     files[0].used = 1;
+    files[0].parent = -1;
+    file_inode_bitmap = 1u << ROOT_INODE;
     
     /* Create some test files */
-    strcpy(files[1].name, "README");
-    strcpy((char*)files[1].data, "Tiny Operating System\nPhase 9: Shell and User Space\n");
-    files[1].size = strlen((char*)files[1].data);
-    files[1].used = 1;
+    const char* readme = "Tiny Operating System\nPhase 9: Shell and User Space\n";
+    file_write(file_create(ROOT_INODE, "README", 0), 0, readme, strlen(readme));
     
-    strcpy(files[2].name, "test.txt");
-    strcpy((char*)files[2].data, "This is a test file.\n");
-    files[2].size = strlen((char*)files[2].data);
-    files[2].used = 1;
+    const char* test = "This is a test file.\n";
+    file_write(file_create(ROOT_INODE, "test.txt", 0), 0, test, strlen(test));
     
     /* Create a subdirectory */
-    strcpy(files[3].name, "home");
-    files[3].is_directory = 1;
-    files[3].used = 1;
+    file_create(ROOT_INODE, "home", 1);
+    
+    /* Its files are made up when read, by procfs.c */
+    proc_dir = file_create(ROOT_INODE, "proc", 1);
+    
+    /* Then the root filesystem GRUB loaded, when it did */
+    const uint8_t* archive;
+    uint32_t archive_size;
+    if (initramfs_module(&archive, &archive_size) && cpio_unpack(archive, archive_size, initramfs_add) < 0) {
+        terminal_writestring("initramfs: archive only partly unpacked, ");
+    }
 }
 
 /* System call implementations */
@@ -345,62 +927,84 @@ static void syscall_exit(int code) {
     }
 }
 
+/* The inode behind a file descriptor, or -1 */
+static int fd_inode(int fd) {
+    int inode = fd - 3;
+    return inode >= 0 && inode < MAX_FILES && files[inode].used ? inode : -1;
+}
+
+/* The pipe behind a pipe descriptor, or NULL; *end is 0 for the read end, 1 for the write end */
+static struct pipe* fd_pipe(int fd, int* end) {
+    int index = fd - PIPEFD_BASE;
+    if (index < 0 || index >= MAX_PIPES * 2 || !pipes[index / 2].used) return NULL;
+    *end = index & 1;
+    return &pipes[index / 2];
+}
+
+/* The proc entry behind a descriptor, or -1 */
+static int fd_proc(int fd) {
+    int entry = fd - PROCFD_BASE;
+    return entry >= 0 && entry < (int)procfs_count() ? entry : -1;
+}
+
+/* What is there, 0 at end of file (empty with no writer left), else SYSCALL_AGAIN */
+static int pipe_read(struct pipe* pipe, void* buffer, int size) {
+    uint32_t count = spsc_read(&pipe->ring, buffer, (uint32_t)size);
+    if (!count && size && pipe->writer_count) {
+        return SYSCALL_AGAIN;
+    }
+    return (int)count;
+}
+
+/* As much as fits; -1 once no reader is left, SYSCALL_AGAIN if nothing fits */
+static int pipe_write(struct pipe* pipe, const void* buffer, int size) {
+    if (!pipe->reader_count) {
+        return -1;
+    }
+    uint32_t count = spsc_write(&pipe->ring, buffer, (uint32_t)size);
+    return count || !size ? (int)count : SYSCALL_AGAIN;
+}
+
 static int syscall_read(int fd, void* buffer, int size) {
-    if (fd != 0) return -1; /* Only stdin supported */
-    
-    /* Simple keyboard input simulation */
-    char* buf = (char*)buffer;
-    int i = 0;
-    
-    while (i < size) {
-        /* Wait for key press */
-        while ((inb(0x64) & 1) == 0);
-        uint8_t scancode = inb(0x60);
-        
-        /* Simple scancode to ASCII conversion */
-        char c = 0;
-        if (scancode == 0x1E) c = 'a';
-        else if (scancode == 0x30) c = 'b';
-        else if (scancode == 0x2E) c = 'c';
-        else if (scancode == 0x20) c = 'd';
-        else if (scancode == 0x12) c = 'e';
-        else if (scancode == 0x21) c = 'f';
-        else if (scancode == 0x22) c = 'g';
-        else if (scancode == 0x23) c = 'h';
-        else if (scancode == 0x17) c = 'i';
-        else if (scancode == 0x24) c = 'j';
-        else if (scancode == 0x25) c = 'k';
-        else if (scancode == 0x26) c = 'l';
-        else if (scancode == 0x32) c = 'm';
-        else if (scancode == 0x31) c = 'n';
-        else if (scancode == 0x18) c = 'o';
-        else if (scancode == 0x19) c = 'p';
-        else if (scancode == 0x10) c = 'q';
-        else if (scancode == 0x13) c = 'r';
-        else if (scancode == 0x1F) c = 's';
-        else if (scancode == 0x14) c = 't';
-        else if (scancode == 0x16) c = 'u';
-        else if (scancode == 0x2F) c = 'v';
-        else if (scancode == 0x11) c = 'w';
-        else if (scancode == 0x2D) c = 'x';
-        else if (scancode == 0x15) c = 'y';
-        else if (scancode == 0x2C) c = 'z';
-        else if (scancode == 0x39) c = ' ';
-        else if (scancode == 0x1C) c = '\n';
-        else if (scancode == 0x0E) c = '\b';
-        
-        if (c != 0) {
-            buf[i++] = c;
-            terminal_putchar(c);
-            
-            if (c == '\n') break;
-        }
+    int end;
+    struct pipe* pipe = fd_pipe(fd, &end);
+    if (pipe) {
+        return end == 0 && size >= 0 ? pipe_read(pipe, buffer, size) : -1;
+    }
+    int entry = fd_proc(fd);
+    if (entry >= 0) {
+        int result = size < 0 ? -1 : procfs_read((uint32_t)entry, proc_offsets[entry], buffer, (uint32_t)size);
+        if (result > 0) proc_offsets[entry] += result;
+        return result;
     }
+    if (fd >= 3) {
+        int inode = fd_inode(fd);
+        int result = inode < 0 || size < 0 ? -1 : file_read(inode, file_offsets[inode], buffer, (size_t)size);
+        if (result > 0) file_offsets[inode] += result;
+        return result;
+    }
+    if (fd != 0 || size < 0) return -1; /* Only stdin supported */
     
-    return i;
+    /* A whole line per call, already echoed and edited by the tty */
+    return tty_read((char*)buffer, (uint32_t)size);
 }
 
 static int syscall_write(int fd, const void* buffer, int size) {
+    int end;
+    struct pipe* pipe = fd_pipe(fd, &end);
+    if (pipe) {
+        return end == 1 && size >= 0 ? pipe_write(pipe, buffer, size) : -1;
+    }
+    int entry = fd_proc(fd);
+    if (entry >= 0) {
+        return size < 0 ? -1 : procfs_write((uint32_t)entry, buffer, (uint32_t)size);
+    }
+    if (fd >= 3) {
+        int inode = fd_inode(fd);
+        int result = inode < 0 || size < 0 ? -1 : file_write(inode, file_offsets[inode], buffer, (size_t)size);
+        if (result > 0) file_offsets[inode] += result;
+        return result;
+    }
     if (fd != 1 && fd != 2) return -1; /* Only stdout/stderr supported */
     
     const char* buf = (const char*)buffer;
@@ -411,55 +1015,179 @@ static int syscall_write(int fd, const void* buffer, int size) {
     return size;
 }
 
-static int syscall_open(const char* filename) {
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (files[i].used && strcmp(files[i].name, filename) == 0) {
-            return i + 3; /* FD 0,1,2 reserved */
-        }
+/* Create the file path names, in an existing directory; its inode or -1 */
+static int path_create(const char* path) {
+    const char* name = path;
+    for (const char* p = path; *p; p++) {
+        if (*p == '/') name = p + 1;
     }
-    return -1;
+    int parent = current_dir;
+    if (name != path) {
+        char dir[MAX_FILENAME];
+        size_t length = (size_t)(name - path);
+        if (length >= sizeof(dir)) return -1;
+        memcpy(dir, path, length);
+        dir[length] = '\0';
+        parent = path_walk(dir);
+    }
+    if (parent < 0 || !files[parent].is_directory || parent == proc_dir || !*name) return -1;
+    return file_create(parent, name, 0);
+}
+
+/* The proc entry path names, or -1: an entry's name in the proc directory, which holds nothing else */
+static int proc_lookup(const char* path) {
+    const char* name = path;
+    for (const char* p = path; *p; p++) {
+        if (*p == '/') name = p + 1;
+    }
+    int parent = current_dir;
+    if (name != path) {
+        char dir[MAX_FILENAME];
+        size_t length = (size_t)(name - path);
+        if (length >= sizeof(dir)) return -1;
+        memcpy(dir, path, length);
+        dir[length] = '\0';
+        parent = path_walk(dir);
+    }
+    return parent >= 0 && parent == proc_dir ? procfs_lookup(name) : -1;
+}
+
+/* O_CREAT makes a missing file, O_TRUNC empties an existing one */
+static int syscall_open(const char* filename, int flags) {
+    int entry = proc_lookup(filename);
+    if (entry >= 0) {
+        proc_offsets[entry] = 0;
+        return PROCFD_BASE + entry;
+    }
+    int inode = path_walk(filename);
+    if (inode < 0 && (flags & O_CREAT)) {
+        inode = path_create(filename);
+    }
+    if (inode < 0) {
+        return -1;
+    }
+    if ((flags & O_TRUNC) && !files[inode].is_directory) {
+        files[inode].size = 0;          /* The blocks stay with the file for its next writes */
+        files[inode].image = NULL;
+    }
+    file_offsets[inode] = 0;
+    return inode + 3; /* FD 0,1,2 reserved */
 }
 
 static int syscall_close(int fd) {
+    int end;
+    struct pipe* pipe = fd_pipe(fd, &end);
+    if (pipe) {
+        uint32_t* count = end == 0 ? &pipe->reader_count : &pipe->writer_count;
+        if (!*count) return -1;
+        (*count)--;
+        if (!pipe->reader_count && !pipe->writer_count) {
+            pipe->used = 0;
+        }
+        return 0;
+    }
     if (fd < 3) return -1; /* Can't close stdin/stdout/stderr */
     return 0;
 }
 
-static int syscall_chdir(const char* path) {
-    /* Simple implementation - only support root and home */
-    if (strcmp(path, "/") == 0 || strcmp(path, ".") == 0) {
-        return 0;
-    } else if (strcmp(path, "home") == 0) {
-        return 0;
+/* A new pipe: fds[0] reads what fds[1] writes */
+static int syscall_pipe(int* fds) {
+    for (int i = 0; i < MAX_PIPES; i++) {
+        if (!pipes[i].used) {
+            pipes[i].used = 1;
+            spsc_init(&pipes[i].ring, pipes[i].buffer, PIPE_SIZE);
+            pipes[i].reader_count = 1;
+            pipes[i].writer_count = 1;
+            fds[0] = PIPEFD_BASE + i * 2;
+            fds[1] = PIPEFD_BASE + i * 2 + 1;
+            return 0;
+        }
     }
     return -1;
 }
 
+static int syscall_chdir(const char* path) {
+    int inode = path_walk(path);
+    if (inode < 0 || !files[inode].is_directory) {
+        return -1;
+    }
+    current_dir = inode;
+    return 0;
+}
+
 static int syscall_getcwd(char* buffer, int size) {
-    if (size < 2) return -1;
-    strcpy(buffer, "/");
-    return 1;
+    /* Walk up to the root, then write the names back down */
+    int chain[MAX_FILES];
+    int depth = 0;
+    int length = 1;
+    for (int dir = current_dir; dir != ROOT_INODE; dir = files[dir].parent) {
+        chain[depth++] = dir;
+        length += strlen(files[dir].name) + 1;
+    }
+    if (length >= size) return -1;
+    
+    char* p = buffer;
+    *p++ = '/';
+    while (depth--) {
+        strcpy(p, files[chain[depth]].name);
+        p += strlen(p);
+        if (depth) *p++ = '/';
+    }
+    *p = '\0';
+    return (int)(p - buffer);
 }
 
 static int syscall_opendir(const char* path) {
-    (void)path; /* Suppress unused parameter warning */
-    /* Simple implementation - return a fake directory handle */
-    return 100;
+    int inode = path_walk(path);
+    if (inode < 0 || !files[inode].is_directory) {
+        return -1;
+    }
+    dir_cursors[inode] = 0;
+    return DIRFD_BASE + inode;
+}
+
+/* The directory behind an opendir handle, or -1 */
+static int dirfd_inode(int dirfd) {
+    int dir = dirfd - DIRFD_BASE;
+    if (dir < 0 || dir >= MAX_FILES || !files[dir].used || !files[dir].is_directory) return -1;
+    return dir;
+}
+
+/*
+ * Advance dir's cursor to its next entry; DIR_END at the end. Past the
+ * inodes, the proc directory goes on with its entries as MAX_FILES + n.
+ */
+static int dir_next(int dir) {
+    int index = dir_cursors[dir];
+    while (index < MAX_FILES && !(files[index].used && files[index].parent == dir)) {
+        index++;
+    }
+    if (index >= MAX_FILES && (dir != proc_dir || index >= MAX_FILES + (int)procfs_count())) {
+        index = DIR_END;
+    }
+    dir_cursors[dir] = index;
+    return index;
+}
+
+/* The name and d_type of what dir_next found */
+static const char* dir_entry_name(int index) {
+    return index < MAX_FILES ? files[index].name : procfs_name((uint32_t)(index - MAX_FILES));
+}
+
+static uint8_t dir_entry_type(int index) {
+    return index < MAX_FILES && files[index].is_directory ? 2 : 1;
 }
 
 static int syscall_readdir(int dirfd, void* dirent, int size) {
     (void)size; /* Suppress unused parameter warning */
-    static int dir_index = 0;
     
-    if (dirfd != 100) return -1;
+    int dir = dirfd_inode(dirfd);
+    if (dir < 0) return -1;
     
-    /* Find next used file */
-    while (dir_index < MAX_FILES && !files[dir_index].used) {
-        dir_index++;
-    }
-    
-    if (dir_index >= MAX_FILES) {
-        dir_index = 0;
+    /* Find next used file in the directory */
+    int dir_index = dir_next(dir);
+    if (dir_index == DIR_END) {
+        dir_cursors[dir] = 0;
         return 0; /* End of directory */
     }
     
@@ -473,19 +1201,139 @@ static int syscall_readdir(int dirfd, void* dirent, int size) {
     } *entry = (void*)dirent;
     
     entry->d_ino = dir_index;
-    entry->d_type = files[dir_index].is_directory ? 2 : 1;
+    entry->d_type = dir_entry_type(dir_index);
     entry->d_reclen = sizeof(*entry);
-    strcpy(entry->d_name, files[dir_index].name);
+    strcpy(entry->d_name, dir_entry_name(dir_index));
     
-    dir_index++;
+    dir_cursors[dir] = dir_index + 1;
     return sizeof(*entry);
 }
 
+/*
+ * Fill buffer with as many directory entries as fit, each header plus
+ * NUL-terminated name rounded up to 4 bytes, and resume after the last
+ * one on the next call. Returns the bytes filled, 0 at the end of the
+ * directory, or -1 if not even the next entry fits.
+ */
+static int syscall_getdents(int dirfd, void* buffer, int size) {
+    int dir = dirfd_inode(dirfd);
+    if (dir < 0 || size < 0) return -1;
+    
+    struct dirent_header {
+        uint32_t d_ino;
+        uint8_t d_type;
+        uint8_t d_reserved;
+        uint16_t d_reclen;
+    };
+    
+    uint8_t* out = (uint8_t*)buffer;
+    int used = 0;
+    int index;
+    while ((index = dir_next(dir)) != DIR_END) {
+        const char* name = dir_entry_name(index);
+        int namelen = (int)strlen(name) + 1;
+        int reclen = ((int)sizeof(struct dirent_header) + namelen + 3) & ~3;
+        if (used + reclen > size) {
+            return used ? used : -1;
+        }
+        struct dirent_header* entry = (struct dirent_header*)(out + used);
+        entry->d_ino = index;
+        entry->d_type = dir_entry_type(index);
+        entry->d_reserved = 0;
+        entry->d_reclen = reclen;
+        memcpy(entry + 1, name, namelen);
+        used += reclen;
+        dir_cursors[dir] = index + 1;
+    }
+    return used;
+}
+
 static int syscall_closedir(int dirfd) {
-    if (dirfd == 100) return 0;
+    if (dirfd >= DIRFD_BASE && dirfd < DIRFD_BASE + MAX_FILES) return 0;
     return -1;
 }
 
+/* Fill in a struct sys_stats; returns its size, or -1 when the buffer is too small */
+static int syscall_stats(void* buffer, int size) {
+    struct sys_stats* stats = (struct sys_stats*)buffer;
+    if (size < (int)sizeof(*stats)) return -1;
+    memset(stats, 0, sizeof(*stats));
+    stats->uptime_ms = ktime_ms();
+    stats->tsc_khz = clocksource_tsc_khz();
+    stats->ticks = timer_ticks;
+    stats->hz = timer_frequency;
+    for (uint32_t i = 0; i < PCPU_COUNTERS; i++) {
+        stats->counters[i] = (uint32_t)percpu_counter_read(i);
+    }
+    stats->heap_used = heap_used();
+    
+    /* The shell is the only process this stage runs */
+    struct stats_proc* proc = &stats->procs[stats->proc_count++];
+    proc->pid = 1;
+    proc->running = (uint32_t)shell_process.running;
+    proc->cpu_ticks = shell_process.cpu_ticks;
+    proc->switches = shell_process.switches;
+    proc->cache_hotness = shell_process.cache_hotness;
+    proc->mem_bytes = USER_STACK_SIZE;
+    strcpy(proc->name, "shell");
+    return (int)sizeof(*stats);
+}
+
+/* /proc/uptime: milliseconds since the clock was calibrated, and timer ticks */
+static void proc_show_uptime(struct seq_file* m) {
+    seq_put_named(m, "uptime_ms", ktime_ms());
+    seq_put_named(m, "ticks", timer_ticks);
+}
+
+/* /proc/processes: a line per process, the same fields as the stats call */
+static void proc_show_processes(struct seq_file* m) {
+    seq_puts(m, "pid state cpu_ticks switches cache_hotness mem_bytes name\n");
+    seq_puts(m, "1 ");
+    seq_puts(m, shell_process.running ? "running " : "stopped ");
+    seq_putu(m, shell_process.cpu_ticks);
+    seq_puts(m, " ");
+    seq_putu(m, shell_process.switches);
+    seq_puts(m, " ");
+    seq_putu(m, shell_process.cache_hotness);
+    seq_puts(m, " ");
+    seq_putu(m, USER_STACK_SIZE);
+    seq_puts(m, " shell\n");
+}
+
+/* /proc/sysctl: a "name value" line per tunable; writing "name=value" words sets them */
+static void proc_show_sysctl(struct seq_file* m) {
+    for (uint32_t i = 0; i < sysctl_count(); i++) {
+        char value[SYSCTL_VALUE_LEN];
+        sysctl_format(i, value, sizeof(value));
+        seq_puts(m, sysctl_name(i));
+        seq_puts(m, " ");
+        seq_puts(m, value);
+        seq_puts(m, "\n");
+    }
+}
+
+/* The shared proc entries, then this stage's */
+static void procfs_setup(void) {
+    procfs_init();
+    procfs_register("uptime", proc_show_uptime);
+    procfs_register("processes", proc_show_processes);
+    procfs_register_writable("sysctl", proc_show_sysctl, sysctl_assign);
+}
+
+/* This stage's tunables, at their defaults unless the command line sets them */
+static void sysctl_setup(void) {
+    sysctl_init();
+    sysctl_register("fs_prealloc_blocks", SYSCTL_UINT, &fs_prealloc_blocks, 0, FS_BLOCKS);
+    if (sysctl_apply_cmdline(cmdline_get())) {
+        terminal_writestring("sysctl: command line settings refused\n");
+    }
+}
+
+/* Directory reads as a submission ring operation */
+static uint32_t ring_readdir(const struct syscall_args* args) {
+    return (uint32_t)syscall_readdir((int)args->arg1, (void*)args->arg2, (int)args->arg3);
+}
+
 
 /* User space execution */
 static void init_user_process(struct user_process* proc, void (*entry)(void)) {
@@ -508,6 +1356,8 @@ static void init_user_process(struct user_process* proc, void (*entry)(void)) {
 
 /* Switch to user mode */
 static void switch_to_user_mode(struct user_process* proc) {
+    proc->switches++;
+    proc->cache_hotness = 0;
     __asm__ __volatile__ (
         "push %0\n"      /* Stack segment */
         "push %1\n"      /* Stack pointer */
@@ -537,11 +1387,30 @@ void test_shell_basic(void) {
     terminal_writestring("Shell program compiled successfully\n");
     terminal_writestring("System calls implemented:\n");
     terminal_writestring("  - exit, read, write, open, close\n");
-    terminal_writestring("  - chdir, getcwd, opendir, readdir, closedir\n");
-    terminal_writestring("  - Built-in commands: help, exit, echo, cd, pwd, ls, clear, cat\n");
+    terminal_writestring("  - chdir, getcwd, opendir, readdir, getdents, closedir, pipe, stats\n");
+    terminal_writestring("  - Built-in commands: help, exit, echo, cd, pwd, ls, clear, cat, top\n");
     terminal_putchar('\n');
 }
 
+/* Append a newc cpio entry at offset; returns the offset past it */
+static uint32_t cpio_put(uint8_t* archive, uint32_t offset, const char* name, uint32_t mode, const char* data) {
+    uint32_t fields[13] = {0, mode, 0, 0, 1, 0, strlen(data), 0, 0, 0, 0, strlen(name) + 1, 0};
+    memcpy(archive + offset, "070701", 6);
+    for (uint32_t i = 0; i < 13; i++) {
+        for (uint32_t digit = 0; digit < 8; digit++) {
+            archive[offset + 6 + i * 8 + digit] = "0123456789abcdef"[(fields[i] >> (28 - digit * 4)) & 0xF];
+        }
+    }
+    offset += 110;
+    memcpy(archive + offset, name, fields[11]);
+    offset += fields[11];
+    while (offset & 3) archive[offset++] = 0;
+    memcpy(archive + offset, data, fields[6]);
+    offset += fields[6];
+    while (offset & 3) archive[offset++] = 0;
+    return offset;
+}
+
 void test_filesystem(void) {
     terminal_setcolor(VGA_COLOR_LIGHT_CYAN);
     terminal_writestring("=== Testing File System ===\n");
@@ -591,7 +1460,7 @@ void test_syscalls(void) {
     
     /* Test open syscall */
     terminal_writestring("Testing open syscall: ");
-    int fd = syscall_open("README");
+    int fd = syscall_open("README", 0);
     if (fd >= 0) {
         terminal_writestring("OK (fd=");
         terminal_putchar('0' + fd);
@@ -601,40 +1470,233 @@ void test_syscalls(void) {
         terminal_writestring("FAILED\n");
     }
     
+    /* Lookups are per directory: README is not visible from home */
+    terminal_writestring("Testing chdir/getcwd syscalls: ");
+    char cwd[MAX_FILENAME];
+    int ok = syscall_chdir("home") == 0 && syscall_getcwd(cwd, sizeof(cwd)) == 5 && strcmp(cwd, "/home") == 0;
+    ok = ok && syscall_open("README", 0) < 0 && syscall_chdir("README") < 0;
+    ok = ok && syscall_chdir("..") == 0 && syscall_open("README", 0) >= 0 && syscall_chdir("README") < 0;
+    terminal_writestring(ok ? "OK\n" : "FAILED\n");
+    
+    /* Repeated walks hit the dentry cache, misses included, until the name appears */
+    terminal_writestring("Testing path lookup cache: ");
+    uint32_t misses = dcache_misses;
+    ok = syscall_open("/home/../home/./notes", 0) < 0 && syscall_open("/home/notes", 0) < 0;
+    ok = ok && dcache_misses - misses == 1; /* home is cached since the chdir above */
+    int home = syscall_open("/home", 0) - 3;
+    ok = ok && home > 0 && file_create(home, "notes", 0) >= 0;
+    ok = ok && syscall_open("/home/notes", 0) >= 0 && syscall_opendir("/home/notes") < 0;
+    terminal_writestring(ok ? "OK\n" : "FAILED\n");
+    
+    /* A file past the old 4 KiB slot size, written in pieces, lands in one extent */
+    terminal_writestring("Testing extent-backed file: ");
+    static uint8_t pattern[1000];
+    for (int i = 0; i < (int)sizeof(pattern); i++) {
+        pattern[i] = (uint8_t)(i * 7);
+    }
+    int big = file_create(home, "big", 0);
+    fd = big + 3;
+    ok = big > 0;
+    for (int i = 0; ok && i < 10; i++) {
+        ok = syscall_write(fd, pattern, sizeof(pattern)) == (int)sizeof(pattern);
+    }
+    ok = ok && files[big].size == 10000 && files[big].extent_count == 1;
+    fd = syscall_open("/home/big", 0);
+    static uint8_t readback[1000];
+    int total = 0;
+    while (ok && (result = syscall_read(fd, readback, 700)) > 0) {
+        for (int i = 0; ok && i < result; i++) {
+            ok = readback[i] == pattern[(total + i) % sizeof(pattern)];
+        }
+        total += result;
+    }
+    ok = ok && total == 10000;
+    terminal_writestring(ok ? "OK\n" : "FAILED\n");
+    
+    /* A small buffer takes several calls, each resuming where the last stopped */
+    terminal_writestring("Testing batched getdents: ");
+    char name[8] = "entry0";
+    for (int i = 0; i < 6; i++) {
+        name[5] = '0' + i;
+        file_create(home, name, 0);
+    }
+    static uint8_t dents[512];
+    int dirfd = syscall_opendir("/home");
+    int calls = 0;
+    int seen = 0;
+    while ((result = syscall_getdents(dirfd, dents, 48)) > 0) {
+        calls++;
+        for (int off = 0; off < result; off += *(uint16_t*)(dents + off + 6)) {
+            seen++;
+        }
+    }
+    ok = result == 0 && seen == 8 && calls == 3; /* notes, big and six entryN, three per call */
+    ok = ok && syscall_getdents(dirfd, dents, 8) == 0;
+    dirfd = syscall_opendir("/home");
+    ok = ok && syscall_getdents(dirfd, dents, 8) == -1;
+    result = syscall_getdents(dirfd, dents, sizeof(dents));
+    ok = ok && result == 7 * 16 + 12 && syscall_getdents(dirfd, dents, sizeof(dents)) == 0;
+    ok = ok && strcmp((char*)dents + 8, "notes") == 0 && syscall_closedir(dirfd) == 0;
+    terminal_writestring(ok ? "OK\n" : "FAILED\n");
+    
+    /* Pipe ends never wait: a full or empty pipe says so, a closed one ends */
+    terminal_writestring("Testing pipes: ");
+    int pipe_fds[2];
+    ok = syscall_pipe(pipe_fds) == 0;
+    ok = ok && syscall_read(pipe_fds[0], readback, 1) == SYSCALL_AGAIN;
+    total = 0;
+    while (ok && (result = syscall_write(pipe_fds[1], pattern, sizeof(pattern))) > 0) {
+        total += result;
+    }
+    ok = ok && result == SYSCALL_AGAIN && total == PIPE_SIZE;
+    ok = ok && syscall_read(pipe_fds[0], readback, 700) == 700 && readback[699] == pattern[699];
+    ok = ok && syscall_write(pipe_fds[0], pattern, 1) == -1 && syscall_close(pipe_fds[1]) == 0;
+    ok = ok && syscall_read(pipe_fds[0], readback, 700) == PIPE_SIZE - 700;
+    ok = ok && syscall_read(pipe_fds[0], readback, 700) == 0 && syscall_close(pipe_fds[0]) == 0;
+    terminal_writestring(ok ? "OK\n" : "FAILED\n");
+    
+    /* Redirection targets: created on demand, emptied before rewriting */
+    terminal_writestring("Testing open O_CREAT/O_TRUNC: ");
+    fd = syscall_open("/home/out", O_CREAT | O_TRUNC);
+    ok = fd >= 3 && syscall_write(fd, "abcdef", 6) == 6;
+    fd = syscall_open("/home/out", O_CREAT | O_TRUNC);
+    ok = ok && syscall_write(fd, "xy", 2) == 2 && files[fd - 3].size == 2;
+    ok = ok && syscall_open("/nodir/out", O_CREAT) < 0;
+    terminal_writestring(ok ? "OK\n" : "FAILED\n");
+    
+    /* Snapshots carry the shell and a running clock; a short buffer gets nothing */
+    terminal_writestring("Testing stats syscall: ");
+    static struct sys_stats stats[2];
+    ok = syscall_stats(&stats[0], sizeof(stats[0])) == (int)sizeof(stats[0]);
+    ok = ok && stats[0].proc_count == 1 && strcmp(stats[0].procs[0].name, "shell") == 0;
+    ok = ok && stats[0].hz == timer_frequency && stats[0].heap_used == heap_used();
+    ok = ok && syscall_stats(&stats[1], sizeof(stats[1]) - 1) == -1;
+    ok = ok && syscall_stats(&stats[1], sizeof(stats[1])) > 0 && stats[1].uptime_ms >= stats[0].uptime_ms;
+    terminal_writestring(ok ? "OK\n" : "FAILED\n");
+    
+    /* Proc files list, open and read like any other, in pieces, and refuse writes and new names */
+    terminal_writestring("Testing /proc files: ");
+    dirfd = syscall_opendir("/proc");
+    seen = 0;
+    while ((result = syscall_getdents(dirfd, dents, sizeof(dents))) > 0) {
+        for (int off = 0; off < result; off += *(uint16_t*)(dents + off + 6)) {
+            seen++;
+        }
+    }
+    ok = seen == (int)procfs_count() && seen >= 5;
+    fd = syscall_open("/proc/meminfo", 0);
+    static char text[256];
+    total = 0;
+    while (ok && (result = syscall_read(fd, text + total, 7)) > 0 && total < (int)sizeof(text) - 8) {
+        total += result;
+    }
+    text[total] = '\0';
+    ok = ok && fd >= PROCFD_BASE && total > 10 && memcmp(text, "heap_used ", 10) == 0;
+    ok = ok && syscall_write(fd, "x", 1) == -1 && syscall_close(fd) == 0;
+    ok = ok && syscall_chdir("/proc") == 0 && syscall_open("stat", 0) >= PROCFD_BASE;
+    ok = ok && syscall_open("nothing", O_CREAT) < 0 && syscall_chdir("/") == 0;
+    fd = syscall_open("/proc/processes", 0);
+    ok = ok && syscall_read(fd, text, sizeof(text) - 1) > 0;
+    terminal_writestring(ok ? "OK\n" : "FAILED\n");
+    
+    /* Tunables set within their bounds only, from the command line, the API or /proc/sysctl */
+    terminal_writestring("Testing sysctl: ");
+    static uint32_t tunable = 5;
+    uint32_t saved = fs_prealloc_blocks;
+    int id = sysctl_register("test_tunable", SYSCTL_UINT, &tunable, 1, 100);
+    ok = id >= 0 && sysctl_lookup("test_tunable") == id && sysctl_register("test_tunable", SYSCTL_UINT, &tunable, 1, 100) < 0;
+    ok = ok && sysctl_set((uint32_t)id, "42") == 0 && tunable == 42;
+    ok = ok && sysctl_set((uint32_t)id, "0") < 0 && sysctl_set((uint32_t)id, "101") < 0 &&
+         sysctl_set((uint32_t)id, "-3") < 0 && sysctl_set((uint32_t)id, "7x") < 0 && tunable == 42;
+    ok = ok && sysctl_apply_cmdline("shard=0/1 sysctl.test_tunable=9 sysctl.nothing=1") == 1 && tunable == 9;
+    char value[SYSCTL_VALUE_LEN];
+    ok = ok && sysctl_format((uint32_t)id, value, sizeof(value)) == 1 && value[0] == '9';
+    fd = syscall_open("/proc/sysctl", 0);
+    ok = ok && syscall_write(fd, "test_tunable=64 fs_prealloc_blocks=4\n", 37) == 37 && tunable == 64 &&
+         fs_prealloc_blocks == 4;
+    ok = ok && syscall_write(fd, "test_tunable=1000", 17) == -1 && tunable == 64;
+    total = syscall_read(fd, text, sizeof(text) - 1);
+    text[total > 0 ? total : 0] = '\0';
+    ok = ok && total > 0 && memcmp(text, "fs_prealloc_blocks 4\ntest_tunable 64\n", 37) == 0;
+    ok = ok && syscall_close(fd) == 0;
+    fs_prealloc_blocks = saved;
+    terminal_writestring(ok ? "OK\n" : "FAILED\n");
+    
+    /* An archived file is read where it lies, and copied into blocks at its first write */
+    terminal_writestring("Testing initramfs: ");
+    static uint8_t archive[512] __attribute__((aligned(4)));
+    uint32_t length = cpio_put(archive, 0, ".", 0040755, "");
+    length = cpio_put(archive, length, "./etc", 0040755, "");
+    length = cpio_put(archive, length, "./etc/motd", 0100644, "Hello from the initramfs\n");
+    length = cpio_put(archive, length, "TRAILER!!!", 0, "");
+    ok = cpio_unpack(archive, length, initramfs_add) == 2 && cpio_unpack(archive, 100, initramfs_add) < 0;
+    fd = syscall_open("/etc/motd", 0);
+    int motd = fd - 3;
+    const uint8_t* image = motd > 0 ? files[motd].image : NULL;
+    ok = ok && image > archive && image < archive + length && files[motd].blocks == 0;
+    total = syscall_read(fd, text, sizeof(text) - 1);
+    ok = ok && total == 25 && memcmp(text, "Hello from the initramfs\n", 25) == 0;
+    ok = ok && syscall_write(fd, "!", 1) == 1 && !files[motd].image && files[motd].size == 26;
+    ok = ok && file_read(motd, 0, text, sizeof(text)) == 26 && memcmp(text, "Hello from the initramfs\n!", 26) == 0;
+    ok = ok && image[24] == '\n' && image[25] != '!' && syscall_close(fd) == 0;
+    terminal_writestring(ok ? "OK\n" : "FAILED\n");
+    
     terminal_putchar('\n');
 }
 
+/* Kernel heap (kernel_heap.c) */
+extern void heap_init(void);
+
+/* Log timestamps are timer ticks */
+static uint32_t log_clock(void) {
+    return timer_ticks;
+}
+
 /* Main kernel function */
 void kernel_main(void) {
-    terminal_initialize();
+    initcall_run("terminal", terminal_initialize);
+    initcall_begin("console");
+    serial_init(0);                 /* No IDT in this stage: writers drive the FIFO */
+    tty_init(0);                    /* Nor IRQ 1: readers poll the keyboard while they wait */
+    printk_init(log_clock, 1);
+    initcall_end();
     terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
     terminal_writestring("=== Tiny Operating System - Phase 9 Shell and User Space ===\n");
     terminal_setcolor(VGA_COLOR_LIGHT_GREY);
     
+    /* Initialize kernel heap */
+    initcall_run("heap", heap_init);
+    initcall_run("clocksource", clocksource_init);
+    
     /* Initialize system components */
     terminal_writestring("Initializing system...\n");
     
     /* Setup GDT and TSS for user space */
     terminal_writestring("GDT: ");
-    gdt_install();
+    initcall_run("gdt", gdt_install);
     terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
     terminal_writestring("OK\n");
     terminal_setcolor(VGA_COLOR_LIGHT_GREY);
     
     terminal_writestring("TSS: ");
-    tss_install();
+    initcall_run("tss", tss_install);
     terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
     terminal_writestring("OK\n");
     terminal_setcolor(VGA_COLOR_LIGHT_GREY);
     
     /* Initialize file system */
     terminal_writestring("Filesystem: ");
-    filesystem_init();
+    initcall_run("filesystem", filesystem_init);
+    initcall_run("procfs", procfs_setup);
+    initcall_run("sysctl", sysctl_setup);
+    initcall_run("syscall_ring", syscall_ring_init);
+    ring_register_op(RING_OP_READDIR, ring_readdir);
     terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
     terminal_writestring("OK\n");
     terminal_setcolor(VGA_COLOR_LIGHT_GREY);
     
     terminal_putchar('\n');
+    initcall_report(clocksource_tsc_khz());
     
     /* Run tests */
     test_shell_basic();
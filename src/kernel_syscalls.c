@@ -74,13 +74,6 @@ struct process {
     char name[32];
 };
 
-/* Memory block structure */
-struct memory_block {
-    uint32_t size;
-    uint32_t free;
-    struct memory_block* next;
-};
-
 /* File descriptor structure */
 struct file_descriptor {
     uint32_t inode;
@@ -104,11 +97,28 @@ struct idt_ptr {
     uint32_t base;
 } __attribute__((packed));
 
-/* Global variables */
-static size_t terminal_row;
-static size_t terminal_column;
-static enum vga_color terminal_color;
-static volatile uint16_t* terminal_buffer;
+/* Shadow-buffered console (vga_console.c) */
+extern void console_initialize(uint8_t color);
+extern void console_setcolor(uint8_t color);
+extern void console_putentryat(char c, uint8_t color, uint32_t x, uint32_t y);
+extern void console_putchar(char c);
+extern void console_flush(void);
+
+/* Serial console (serial.c) */
+extern void serial_init(int use_irq);
+
+/* Kernel log ring (printk.c) */
+extern void printk_init(uint32_t (*clock)(void), int serial);
+extern uint32_t printk_console_drain(void);
+
+/* Stack protector (stack_protector.c) */
+extern void stack_protector_init(void);
+
+/* Boot timeline (initcall.c) */
+extern void initcall_begin(const char* name);
+extern void initcall_end(void);
+extern void initcall_run(const char* name, void (*init)(void));
+extern void initcall_report(uint32_t tsc_khz);
 
 /* IDT structures */
 static struct idt_entry idt[256];
@@ -119,10 +129,6 @@ static struct process processes[16];
 static uint32_t current_process = 0;
 static uint32_t next_pid = 1;
 
-/* Memory management */
-static struct memory_block* memory_heap;
-static uint8_t memory_pool[1024 * 64];  // 64KB memory pool
-
 /* File descriptors */
 static struct file_descriptor file_descriptors[256];
 
@@ -148,6 +154,63 @@ void filesystem_init(void);
 void syscall_init(void);
 void kernel_main(void);
 
+/* Kernel heap (kernel_heap.c) */
+extern void heap_init(void);
+extern void* malloc(uint32_t size);
+extern void free(void* ptr);
+extern uint32_t heap_used(void);
+extern uint32_t heap_footprint(void);
+extern uint32_t heap_free_space(uint32_t* largest);
+
+/* Allocation tracking (alloc_track.c) */
+/* Outstanding allocations of one caller (must match alloc_track.c) */
+struct alloc_caller {
+    void* caller;
+    uint32_t count;
+    uint32_t bytes;
+    uint64_t oldest_tsc;
+};
+
+extern void alloc_track_enable(uint32_t rate);
+extern uint32_t alloc_track_top(struct alloc_caller* callers, uint32_t max);
+extern void alloc_track_report(uint32_t tsc_khz);
+
+/* Stack unwinder and kernel symbols (unwind.c) */
+extern uint32_t unwind_stack(uint32_t ebp, uint32_t* frames, uint32_t max);
+extern const char* ksym_lookup(uint32_t addr, uint32_t* offset);
+
+/* Monotonic clock (clocksource.c) */
+extern void clocksource_init(void);
+extern uint32_t clocksource_tsc_khz(void);
+
+/* Allocator benchmark (alloc_bench.c) */
+#define ALLOC_PROFILE_MIXED 0           /* Must match alloc_bench.c */
+#define ALLOC_PROFILE_SMALL 1
+
+/* An allocator under test (must match alloc_bench.c) */
+struct alloc_ops {
+    const char* name;
+    void* (*alloc)(uint32_t size);
+    void (*free)(void* ptr, uint32_t size);
+    uint32_t (*footprint)(void);
+    uint32_t (*free_space)(uint32_t* largest);
+};
+
+/* What one replay measured (must match alloc_bench.c) */
+struct alloc_bench_result {
+    uint32_t ops;
+    uint32_t failures;
+    uint32_t mean_cycles;
+    uint32_t worst_cycles;
+    uint32_t ops_per_sec;
+    uint32_t peak_live;
+    uint32_t peak_footprint;
+    uint32_t fragmentation;
+};
+
+extern int alloc_bench_run(const struct alloc_ops* ops, uint32_t profile, uint32_t tsc_khz,
+                           struct alloc_bench_result* result);
+
 /* Port I/O functions */
 static inline void outb(uint16_t port, uint8_t value) {
     __asm__ __volatile__("outb %0, %1" : : "a"(value), "Nd"(port));
@@ -211,51 +274,30 @@ extern void irq15(void);
 
 /* System call handler */
 extern void syscall_handler(void);
+extern void syscall_stats_reset(void);
+
+/* Deferred interrupt work (interrupt_handlers.c) */
+extern void softirq_init(void);
+extern void irq_stats_reset(void);
 
 /* Terminal functions */
 void terminal_initialize(void) {
-    terminal_row = 0;
-    terminal_column = 0;
-    terminal_color = VGA_COLOR_LIGHT_GREY;
-    terminal_buffer = VGA_BUFFER;
-    
-    /* Clear the screen */
-    for (size_t y = 0; y < VGA_HEIGHT; y++) {
-        for (size_t x = 0; x < VGA_WIDTH; x++) {
-            const size_t index = y * VGA_WIDTH + x;
-            terminal_buffer[index] = (uint16_t)' ' | (uint16_t)terminal_color << 8;
-        }
-    }
+    console_initialize(VGA_COLOR_LIGHT_GREY);
 }
 
 /* Set terminal color */
 void terminal_setcolor(enum vga_color color) {
-    terminal_color = color;
+    console_setcolor(color);
 }
 
 /* Put a character at position */
 void terminal_putentryat(char c, enum vga_color color, size_t x, size_t y) {
-    const size_t index = y * VGA_WIDTH + x;
-    terminal_buffer[index] = (uint16_t)c | (uint16_t)color << 8;
+    console_putentryat(c, color, x, y);
 }
 
 /* Put a character */
 void terminal_putchar(char c) {
-    if (c == '\n') {
-        terminal_column = 0;
-        if (++terminal_row == VGA_HEIGHT) {
-            terminal_row = 0;
-        }
-        return;
-    }
-    
-    terminal_putentryat(c, terminal_color, terminal_column, terminal_row);
-    if (++terminal_column == VGA_WIDTH) {
-        terminal_column = 0;
-        if (++terminal_row == VGA_HEIGHT) {
-            terminal_row = 0;
-        }
-    }
+    console_putchar(c);
 }
 
 /* Write a string */
@@ -325,6 +367,10 @@ void idt_init(void) {
     idt_set_gate(30, (uint32_t)isr30, 0x08, 0x8E);
     idt_set_gate(31, (uint32_t)isr31, 0x08, 0x8E);
     
+    /* No top or bottom halves until drivers register them */
+    softirq_init();
+    irq_stats_reset();
+    
     /* Set IRQs */
     idt_set_gate(32, (uint32_t)irq0, 0x08, 0x8E);
     idt_set_gate(33, (uint32_t)irq1, 0x08, 0x8E);
@@ -409,66 +455,21 @@ void timer_handler(void) {
         current_process = (current_process + 1) % 16;
     }
     
+    /* Show text still short of a newline */
+    console_flush();
+    
     /* Send EOI */
     outb(0x20, 0x20);
 }
 
 /* Initialize memory management */
 void memory_init(void) {
-    /* Initialize memory pool */
-    memory_heap = (struct memory_block*)memory_pool;
-    memory_heap->size = sizeof(memory_pool) - sizeof(struct memory_block);
-    memory_heap->free = 1;
-    memory_heap->next = NULL;
+    /* Initialize kernel heap */
+    heap_init();
     
     terminal_writestring("Memory management initialized\n");
 }
 
-/* Memory allocation */
-void* malloc(uint32_t size) {
-    struct memory_block* block = memory_heap;
-    
-    /* Align size to 4 bytes */
-    size = (size + 3) & ~3;
-    
-    /* Find free block */
-    while (block != NULL) {
-        if (block->free && block->size >= size) {
-            /* Split block if needed */
-            if (block->size > size + sizeof(struct memory_block)) {
-                struct memory_block* new_block = (struct memory_block*)((uint8_t*)block + sizeof(struct memory_block) + size);
-                new_block->size = block->size - size - sizeof(struct memory_block);
-                new_block->free = 1;
-                new_block->next = block->next;
-                
-                block->size = size;
-                block->next = new_block;
-            }
-            
-            block->free = 0;
-            return (uint8_t*)block + sizeof(struct memory_block);
-        }
-        
-        block = block->next;
-    }
-    
-    return NULL;  /* Out of memory */
-}
-
-/* Memory deallocation */
-void free(void* ptr) {
-    if (ptr == NULL) return;
-    
-    struct memory_block* block = (struct memory_block*)((uint8_t*)ptr - sizeof(struct memory_block));
-    block->free = 1;
-    
-    /* Merge with next block if free */
-    if (block->next != NULL && block->next->free) {
-        block->size += block->next->size + sizeof(struct memory_block);
-        block->next = block->next->next;
-    }
-}
-
 /* Initialize process management */
 void process_init(void) {
     /* Clear process table */
@@ -507,6 +508,7 @@ void filesystem_init(void) {
 
 /* System call interface */
 void syscall_init(void) {
+    syscall_stats_reset();
     terminal_writestring("System call interface initialized\n");
 }
 
@@ -560,7 +562,7 @@ void test_system_calls(void) {
     terminal_writestring("Testing write syscall: ");
     const char* msg = "Hello, syscall!\n";
     __asm__ __volatile__(
-        "mov $1, %%eax;"    /* SYSCALL_WRITE */
+        "mov $2, %%eax;"    /* SYSCALL_WRITE */
         "mov $1, %%ebx;"    /* stdout */
         "mov %0, %%ecx;"    /* message */
         "mov $14, %%edx;"   /* length */
@@ -597,10 +599,144 @@ void test_system_calls(void) {
     terminal_writestring("Sleep completed!\n");
 }
 
+/* Test kernel heap */
+void test_memory_allocator(void) {
+    terminal_writestring("Testing kernel heap...\n");
+    
+    /* Freed neighbours must merge so the same space is handed out again */
+    void* a = malloc(100);
+    void* b = malloc(2000);
+    void* c = malloc(16);
+    free(b);
+    free(a);
+    void* d = malloc(2048);
+    if (a && b && c && d == a) {
+        terminal_writestring("Heap coalescing: PASSED\n");
+    } else {
+        terminal_writestring("Heap coalescing: FAILED\n");
+    }
+    free(c);
+    free(d);
+    
+    if (malloc(0) == NULL && malloc(0x10000000) == NULL) {
+        terminal_writestring("Heap bounds: PASSED\n");
+    } else {
+        terminal_writestring("Heap bounds: FAILED\n");
+    }
+}
+
+/* The TLSF heap behind the allocator benchmark's interface */
+static void heap_bench_free(void* ptr, uint32_t size) {
+    (void)size;
+    free(ptr);
+}
+
+/* Replay realistic allocation traces against the heap; the table goes to the log */
+void test_allocator_benchmark(void) {
+    terminal_writestring("Testing allocator benchmark...\n");
+    
+    static const struct alloc_ops heap_ops = {
+        "tlsf heap", malloc, heap_bench_free, heap_footprint, heap_free_space
+    };
+    struct alloc_bench_result mixed, small;
+    uint32_t used = heap_used();
+    if (alloc_bench_run(&heap_ops, ALLOC_PROFILE_MIXED, clocksource_tsc_khz(), &mixed) != 0 ||
+        alloc_bench_run(&heap_ops, ALLOC_PROFILE_SMALL, clocksource_tsc_khz(), &small) != 0) {
+        terminal_writestring("Allocator benchmark: SKIPPED (no TSC)\n");
+        return;
+    }
+    
+    /* Every block came back, and the footprint covered what was live */
+    if (heap_used() == used && mixed.ops && small.ops &&
+        mixed.peak_footprint >= mixed.peak_live && small.peak_footprint >= small.peak_live &&
+        mixed.worst_cycles >= mixed.mean_cycles && mixed.fragmentation <= 100) {
+        terminal_writestring("Allocator benchmark: PASSED\n");
+    } else {
+        terminal_writestring("Allocator benchmark: FAILED\n");
+    }
+}
+
+/* Outstanding blocks grouped by the code that allocated them; freed ones drop out */
+void test_allocation_tracking(void) {
+    terminal_writestring("Testing allocation tracking...\n");
+    
+    void* kept[8];
+    void* small[2];
+    struct alloc_caller top[4];
+    alloc_track_enable(1);
+    for (uint32_t i = 0; i < 8; i++) {
+        kept[i] = malloc(64);
+    }
+    for (uint32_t i = 0; i < 4; i++) {
+        free(malloc(256));
+    }
+    for (uint32_t i = 0; i < 2; i++) {
+        small[i] = malloc(32);
+    }
+    uint32_t count = alloc_track_top(top, 4);
+    alloc_track_report(clocksource_tsc_khz());
+    for (uint32_t i = 0; i < 8; i++) {
+        free(kept[i]);
+    }
+    for (uint32_t i = 0; i < 2; i++) {
+        free(small[i]);
+    }
+    uint32_t left = alloc_track_top(top + 2, 2);
+    alloc_track_enable(0);
+    
+    if (count == 2 && top[0].count == 8 && top[0].bytes == 8 * 64 &&
+        top[1].count == 2 && top[1].bytes == 2 * 32 && top[0].caller != top[1].caller && left == 0) {
+        terminal_writestring("Allocation tracking: PASSED\n");
+    } else {
+        terminal_writestring("Allocation tracking: FAILED\n");
+    }
+}
+
+/* Walk up from a callee: its first return address must land back in the caller */
+static uint32_t __attribute__((noinline)) unwind_from_here(uint32_t* frames, uint32_t max) {
+    return unwind_stack((uint32_t)(uintptr_t)__builtin_frame_address(0), frames, max);
+}
+
+void test_stack_unwind(void) {
+    terminal_writestring("Testing stack unwinder...\n");
+    
+    uint32_t frames[4];
+    uint32_t offset;
+    if (!ksym_lookup((uint32_t)(uintptr_t)test_stack_unwind, &offset)) {
+        terminal_writestring("Stack unwinder: SKIPPED (no symbol table)\n");
+        return;
+    }
+    uint32_t depth = unwind_from_here(frames, 4);
+    const char* name = depth ? ksym_lookup(frames[0], &offset) : NULL;
+    
+    const char* expected = "test_stack_unwind";
+    uint32_t i = 0;
+    while (name && expected[i] && name[i] == expected[i]) {
+        i++;
+    }
+    if (depth >= 2 && name && !expected[i] && !name[i] && offset) {
+        terminal_writestring("Stack unwinder: PASSED\n");
+    } else {
+        terminal_writestring("Stack unwinder: FAILED\n");
+    }
+}
+
+/* Log timestamps are timer ticks */
+static uint32_t log_clock(void) {
+    return timer_ticks;
+}
+
 /* Main kernel function */
 void kernel_main(void) {
+    /* No boot.asm in this stage to pick the stack guard first */
+    stack_protector_init();
+    
     /* Initialize terminal */
-    terminal_initialize();
+    initcall_run("terminal", terminal_initialize);
+    initcall_begin("console");
+    serial_init(1);                 /* IRQ 4 drives transmission */
+    printk_init(log_clock, 1);
+    initcall_end();
     
     /* Display welcome message */
     terminal_setcolor(VGA_COLOR_LIGHT_GREEN);
@@ -609,11 +745,13 @@ void kernel_main(void) {
     terminal_writestring("Kernel with system services initialized!\n\n");
     
     /* Initialize all subsystems */
-    interrupts_init();
-    memory_init();
-    process_init();
-    filesystem_init();
-    syscall_init();
+    initcall_run("interrupts", interrupts_init);
+    initcall_run("memory", memory_init);
+    initcall_run("processes", process_init);
+    initcall_run("filesystem", filesystem_init);
+    initcall_run("syscalls", syscall_init);
+    initcall_run("clocksource", clocksource_init);
+    initcall_report(clocksource_tsc_khz());
     
     /* Display system information */
     terminal_setcolor(VGA_COLOR_LIGHT_CYAN);
@@ -626,7 +764,7 @@ void kernel_main(void) {
     terminal_writestring("- Timer: ");
     terminal_writehex(timer_frequency);
     terminal_writestring(" Hz\n");
-    terminal_writestring("- Memory: 64KB pool\n");
+    terminal_writestring("- Memory: 256KB TLSF heap\n");
     terminal_writestring("- Processes: 16 slots\n");
     terminal_writestring("- File descriptors: 256 slots\n");
     terminal_writestring("- System calls: ");
@@ -638,13 +776,18 @@ void kernel_main(void) {
     terminal_writestring("[OK] System services operational!\n\n");
     
     test_system_calls();
+    test_memory_allocator();
+    test_allocator_benchmark();
+    test_allocation_tracking();
+    test_stack_unwind();
     
     /* Enable keyboard interrupt */
     outb(0x21, inb(0x21) & ~0x02);  /* Enable IRQ1 (keyboard) */
     
     /* Main kernel loop */
     while (1) {
-        /* Halt CPU until next interrupt */
+        /* Write out what was logged, then halt CPU until next interrupt */
+        printk_console_drain();
         __asm__ __volatile__("hlt");
     }
 }
\ No newline at end of file
@@ -0,0 +1,231 @@
+/*
+ * Tiny Operating System - Kernel Runtime Library
+ * The memory and string routines every stage links against, in place of
+ * per-file byte loops; also what the compiler calls for struct copies,
+ * and the column formatting of the benchmark and test result tables
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CPUID_FEAT_EDX_SSE2 (1 << 26)
+#define CR0_TS 0x00000008
+#define CR4_OSFXSR 0x00000200
+#define KLIB_SSE2_MIN 8192              /* Below this the FXSAVE/FXRSTOR pair costs more than it saves */
+
+typedef uint32_t __attribute__((__may_alias__)) alias_u32;
+typedef uint32_t __attribute__((__may_alias__, aligned(1))) unaligned_u32;
+
+#define ONES 0x01010101u
+#define HIGHS 0x80808080u
+#define HAS_ZERO(word) (((word) - ONES) & ~(word) & HIGHS)
+
+/* Function prototypes */
+void* memcpy(void* dest, const void* src, size_t n);
+void* memmove(void* dest, const void* src, size_t n);
+void* memset(void* s, int c, size_t n);
+int memcmp(const void* a, const void* b, size_t n);
+size_t strlen(const char* str);
+int strcmp(const char* s1, const char* s2);
+char* klib_puts(char* out, const char* text, uint32_t width);
+char* klib_putu(char* out, uint32_t value, uint32_t width);
+
+/* 0 unknown, 1 usable, 2 absent: the CPU has SSE2 and the OS enabled FXSAVE */
+static uint8_t klib_sse2;
+static uint8_t klib_fpu_save[512] __attribute__((aligned(16)));
+
+static int klib_sse2_usable(void) {
+    if (!klib_sse2) {
+        uint32_t eax = 1, ebx, ecx = 0, edx, cr4;
+        __asm__ __volatile__("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+        __asm__ __volatile__("movl %%cr4, %0" : "=r"(cr4));
+        klib_sse2 = (edx & CPUID_FEAT_EDX_SSE2) && (cr4 & CR4_OSFXSR) ? 1 : 2;
+    }
+    if (klib_sse2 != 1) {
+        return 0;
+    }
+    /* While CR0.TS is set the registers belong to a process that has not run yet */
+    uint32_t cr0;
+    __asm__ __volatile__("movl %%cr0, %0" : "=r"(cr0));
+    return !(cr0 & CR0_TS);
+}
+
+static inline void copy_forward(void* dest, const void* src, size_t n) {
+    size_t words = n >> 2;
+    size_t bytes = n & 3;
+    __asm__ __volatile__("cld; rep movsl; mov %3, %%ecx; rep movsb"
+                         : "+D"(dest), "+S"(src), "+c"(words)
+                         : "r"(bytes)
+                         : "memory");
+}
+
+/*
+ * Large copies: 64 bytes per iteration through four XMM registers, with
+ * non-temporal stores so a bulk copy does not evict the caller's working
+ * set. The kernel keeps no vector state of its own, so whoever's the
+ * registers are is saved around the loop with interrupts off.
+ */
+static void copy_sse2(uint8_t* dest, const uint8_t* src, size_t n) {
+    size_t head = (16 - ((uintptr_t)dest & 15)) & 15;
+    copy_forward(dest, src, head);
+    dest += head;
+    src += head;
+    n -= head;
+
+    uint32_t flags;
+    __asm__ __volatile__("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    __asm__ __volatile__("fxsave %0" : "=m"(klib_fpu_save));
+    size_t blocks = n >> 6;
+    for (size_t i = 0; i < blocks; i++) {
+        __asm__ __volatile__("movdqu 0(%1), %%xmm0\n"
+                             "movdqu 16(%1), %%xmm1\n"
+                             "movdqu 32(%1), %%xmm2\n"
+                             "movdqu 48(%1), %%xmm3\n"
+                             "movntdq %%xmm0, 0(%0)\n"
+                             "movntdq %%xmm1, 16(%0)\n"
+                             "movntdq %%xmm2, 32(%0)\n"
+                             "movntdq %%xmm3, 48(%0)\n"
+                             :
+                             : "r"(dest), "r"(src)
+                             : "memory");
+        dest += 64;
+        src += 64;
+    }
+    __asm__ __volatile__("sfence; fxrstor %0" : : "m"(klib_fpu_save) : "memory");
+    __asm__ __volatile__("push %0; popf" : : "r"(flags) : "memory", "cc");
+
+    copy_forward(dest, src, n & 63);
+}
+
+void* memcpy(void* dest, const void* src, size_t n) {
+    if (n >= KLIB_SSE2_MIN && klib_sse2_usable()) {
+        copy_sse2((uint8_t*)dest, (const uint8_t*)src, n);
+    } else {
+        copy_forward(dest, src, n);
+    }
+    return dest;
+}
+
+/* Overlap-safe: forwards unless dest lies inside the source, then backwards */
+void* memmove(void* dest, const void* src, size_t n) {
+    if ((uintptr_t)dest - (uintptr_t)src >= n) {
+        return memcpy(dest, src, n);
+    }
+
+    /* The odd tail bytes first, then whole words, both from the top down */
+    uint8_t* d = (uint8_t*)dest + n - 1;
+    const uint8_t* s = (const uint8_t*)src + n - 1;
+    size_t bytes = n & 3;
+    size_t words = n >> 2;
+    __asm__ __volatile__("std; rep movsb; sub $3, %%esi; sub $3, %%edi; mov %3, %%ecx; rep movsl; cld"
+                         : "+D"(d), "+S"(s), "+c"(bytes)
+                         : "r"(words)
+                         : "memory", "cc");
+    return dest;
+}
+
+void* memset(void* s, int c, size_t n) {
+    void* d = s;
+    uint32_t fill = (uint8_t)c * ONES;
+    size_t words = n >> 2;
+    size_t bytes = n & 3;
+    __asm__ __volatile__("cld; rep stosl; mov %3, %%ecx; rep stosb"
+                         : "+D"(d), "+c"(words)
+                         : "a"(fill), "r"(bytes)
+                         : "memory");
+    return s;
+}
+
+int memcmp(const void* a, const void* b, size_t n) {
+    const uint8_t* p = (const uint8_t*)a;
+    const uint8_t* q = (const uint8_t*)b;
+    while (n >= 4 && *(const unaligned_u32*)p == *(const unaligned_u32*)q) {
+        p += 4;
+        q += 4;
+        n -= 4;
+    }
+    for (; n; n--, p++, q++) {
+        if (*p != *q) {
+            return *p - *q;
+        }
+    }
+    return 0;
+}
+
+/*
+ * A word at a time once aligned: an aligned load never crosses into a page
+ * the string does not reach, and HAS_ZERO finds a NUL among its four bytes.
+ */
+size_t strlen(const char* str) {
+    const char* p = str;
+    while ((uintptr_t)p & 3) {
+        if (!*p) {
+            return p - str;
+        }
+        p++;
+    }
+    const alias_u32* w = (const alias_u32*)p;
+    while (!HAS_ZERO(*w)) {
+        w++;
+    }
+    p = (const char*)w;
+    while (*p) {
+        p++;
+    }
+    return p - str;
+}
+
+/* Words while both strings share an alignment and no NUL is in sight, then bytes */
+int strcmp(const char* s1, const char* s2) {
+    if ((((uintptr_t)s1 ^ (uintptr_t)s2) & 3) == 0) {
+        while ((uintptr_t)s1 & 3) {
+            if (*s1 != *s2 || !*s1) {
+                return *(const unsigned char*)s1 - *(const unsigned char*)s2;
+            }
+            s1++;
+            s2++;
+        }
+        const alias_u32* w1 = (const alias_u32*)s1;
+        const alias_u32* w2 = (const alias_u32*)s2;
+        while (*w1 == *w2 && !HAS_ZERO(*w1)) {
+            w1++;
+            w2++;
+        }
+        s1 = (const char*)w1;
+        s2 = (const char*)w2;
+    }
+    while (*s1 && *s1 == *s2) {
+        s1++;
+        s2++;
+    }
+    return *(const unsigned char*)s1 - *(const unsigned char*)s2;
+}
+
+/* Padded to width columns and cut at width; width 0 copies text as it is */
+char* klib_puts(char* out, const char* text, uint32_t width) {
+    uint32_t len = 0;
+    while (text[len] && (!width || len < width)) {
+        *out++ = text[len++];
+    }
+    while (len++ < width) {
+        *out++ = ' ';
+    }
+    return out;
+}
+
+/* Right-aligned in width columns */
+char* klib_putu(char* out, uint32_t value, uint32_t width) {
+    char digits[10];
+    uint32_t count = 0;
+    do {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    while (width-- > count) {
+        *out++ = ' ';
+    }
+    while (count) {
+        *out++ = digits[--count];
+    }
+    return out;
+}
@@ -0,0 +1,936 @@
+/*
+ * Tiny Operating System - Log-Structured Filesystem
+ * Files and inodes appended to the block device in large segments, with a
+ * checkpoint region and a cost-benefit segment cleaner
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SECTOR_SIZE 512
+#define LFS_BLOCK_SIZE 1024
+#define LFS_SECTORS_PER_BLOCK (LFS_BLOCK_SIZE / SECTOR_SIZE)
+
+/*
+ * Disk layout, in blocks: the superblock, two checkpoint regions written
+ * in turn, a spare block, then the segments. Block 0 is never a file
+ * block, so it doubles as "no block".
+ */
+#define LFS_SUPER_BLOCK 0
+#define LFS_CHECKPOINT_BLOCK 1          /* And 2 */
+#define LFS_FIRST_SEGMENT_BLOCK 4
+#define LFS_SEGMENT_BLOCKS 32           /* 32 KiB, written with one request when full */
+#define LFS_SEGMENT_BYTES (LFS_SEGMENT_BLOCKS * LFS_BLOCK_SIZE)
+#define LFS_MAX_SEGMENTS 64
+
+#define LFS_MAGIC 0x4C465331            /* "LFS1" */
+#define LFS_CHECKPOINT_MAGIC 0x4C465343
+#define LFS_SUMMARY_MAGIC 0x4C465353
+
+#define LFS_MAX_INODES 64
+#define LFS_ROOT_INO 1
+#define LFS_DIRECT 24                   /* Largest file: 24 KiB */
+#define LFS_INODE_SIZE 128
+#define LFS_INODES_PER_BLOCK (LFS_BLOCK_SIZE / LFS_INODE_SIZE)
+#define LFS_NAME_MAX 28
+
+#define LFS_TYPE_FILE 1
+#define LFS_TYPE_DIR 2
+
+/* Summary entry of a block holding inodes rather than file data */
+#define LFS_SUM_INODES 0xFFFFFFFF
+
+/* Background work, in timer ticks and segments */
+#define LFS_FLUSH_INTERVAL 500          /* A dirty log is checkpointed within 5 s */
+#define LFS_CLEAN_RESERVE 2             /* Clean segments kept back for the cleaner's own writes */
+#define LFS_CLEAN_LOW 4                 /* The background cleaner starts below this many */
+#define LFS_CLEAN_TARGET 5              /* and stops once this many are free */
+
+/* Segment state */
+#define SEG_CLEAN 0
+#define SEG_DIRTY 1                     /* Holds log, possibly live */
+#define SEG_ACTIVE 2                    /* Being filled */
+#define SEG_FREEING 3                   /* Cleaned; clean once a checkpoint stops naming it */
+
+/* On-disk inode */
+struct lfs_dinode {
+    uint32_t ino;
+    uint16_t type;
+    uint16_t nlink;
+    uint32_t size;
+    uint32_t mtime;
+    uint32_t blocks[LFS_DIRECT];
+    uint32_t reserved[4];
+};
+
+struct lfs_dirent {
+    uint32_t ino;                       /* 0: free slot */
+    char name[LFS_NAME_MAX];
+};
+
+struct lfs_superblock {
+    uint32_t magic;
+    uint32_t block_size;
+    uint32_t segment_blocks;
+    uint32_t segments;
+    uint32_t checksum;
+};
+
+/* Live bytes and last write of a segment, for the cleaner */
+struct lfs_segment_usage {
+    uint32_t live;
+    uint32_t mtime;
+};
+
+/*
+ * Everything needed to find the filesystem again: where each inode was
+ * last written (block << 3 | slot), how full each segment is, and where
+ * the log continues. Written to the older of the two regions, so a crash
+ * mid-write leaves the newer one intact.
+ */
+struct lfs_checkpoint {
+    uint32_t magic;
+    uint32_t serial;
+    uint32_t segment;                   /* Active segment */
+    uint32_t offset;                    /* Its next free block */
+    uint32_t imap[LFS_MAX_INODES];
+    struct lfs_segment_usage usage[LFS_MAX_SEGMENTS];
+    uint32_t checksum;
+};
+
+/* Block 0 of each segment: who owns every other block in it */
+struct lfs_summary {
+    uint32_t magic;
+    uint32_t serial;
+    uint32_t blocks;                    /* Blocks in use, this one included */
+    uint32_t checksum;
+    struct {
+        uint32_t ino;
+        uint32_t index;                 /* File block, or LFS_SUM_INODES */
+    } entries[LFS_SEGMENT_BLOCKS];
+};
+
+/* Timer wheel entry (must match struct timer in timer_wheel.c) */
+struct timer {
+    struct timer* next;
+    struct timer** pprev;
+    uint32_t expires;
+    void (*callback)(void* data);
+    void* data;
+};
+
+/* In-memory inode: the newest version of every inode lives here */
+struct lfs_inode {
+    struct lfs_dinode d;
+    uint8_t used;
+    uint8_t dirty;
+};
+
+static struct lfs_inode lfs_inodes[LFS_MAX_INODES];
+static uint32_t lfs_imap[LFS_MAX_INODES];
+static struct lfs_segment_usage lfs_usage[LFS_MAX_SEGMENTS];
+static uint8_t lfs_seg_state[LFS_MAX_SEGMENTS];
+
+/* The segment being filled, written out as it fills or at a sync */
+static uint8_t lfs_seg_buf[LFS_SEGMENT_BLOCKS][LFS_BLOCK_SIZE] __attribute__((aligned(LFS_BLOCK_SIZE)));
+static uint8_t lfs_clean_buf[LFS_SEGMENT_BLOCKS][LFS_BLOCK_SIZE] __attribute__((aligned(LFS_BLOCK_SIZE)));
+static uint8_t lfs_block[LFS_BLOCK_SIZE];
+static uint32_t lfs_seg_current;
+static uint32_t lfs_seg_next;           /* Next free block in it */
+static uint32_t lfs_seg_flushed;        /* Blocks already on the device */
+
+static int lfs_device = -1;
+static uint32_t lfs_segments;
+static uint32_t lfs_serial;
+static uint32_t lfs_checkpoint_slot;
+static uint8_t lfs_dirty;               /* Anything newer than the last checkpoint */
+static volatile uint8_t lfs_busy;       /* A caller is inside; the timer keeps out */
+static uint8_t lfs_cleaning;
+static struct timer lfs_timer;
+
+/* Statistics */
+static uint32_t lfs_segment_writes;     /* Requests sent to the device */
+static uint32_t lfs_blocks_written;
+static uint32_t lfs_absorbed;           /* Rewrites of a block still in memory */
+static uint32_t lfs_cleaned;
+static uint32_t lfs_moved;              /* Live blocks copied by the cleaner */
+static uint32_t lfs_checkpoints;
+
+/* Tick counter of the kernel this is linked into */
+extern uint32_t timer_ticks;
+
+/* Block layer (block.c) */
+extern int blk_read(uint32_t device, uint32_t sector, uint32_t count, void* buffer);
+extern int blk_write(uint32_t device, uint32_t sector, uint32_t count, const void* buffer);
+extern uint32_t blk_sectors(uint32_t device);
+
+/* CRC32C (crc32c.c) */
+extern uint32_t crc32c(uint32_t crc, const void* data, uint32_t size);
+
+/* Timer wheel functions (timer_wheel.c) */
+extern void timer_setup(struct timer* timer, void (*callback)(void* data), void* data);
+extern void timer_add(struct timer* timer, uint32_t expires);
+extern void timer_cancel(struct timer* timer);
+
+/* Function prototypes */
+int lfs_format(uint32_t device);
+int lfs_mount(uint32_t device);
+int lfs_unmount(void);
+int lfs_sync(void);
+int lfs_create(const char* name);
+int lfs_lookup(const char* name);
+int lfs_unlink(const char* name);
+int lfs_read(int ino, uint32_t offset, void* buffer, uint32_t size);
+int lfs_write(int ino, uint32_t offset, const void* buffer, uint32_t size);
+uint32_t lfs_size(int ino);
+int lfs_clean(uint32_t count);
+uint32_t lfs_clean_segments(void);
+void lfs_get_statistics(uint32_t* segment_writes, uint32_t* blocks_written, uint32_t* absorbed,
+                        uint32_t* cleaned, uint32_t* moved, uint32_t* checkpoints);
+
+/* Kernel runtime library (klib.c) */
+extern void* memcpy(void* dest, const void* src, size_t n);
+extern void* memset(void* s, int c, size_t n);
+
+static void copy_bytes(void* dest, const void* src, uint32_t size) {
+    memcpy(dest, src, size);
+}
+
+static void zero_bytes(void* dest, uint32_t size) {
+    memset(dest, 0, size);
+}
+
+static int name_equal(const char* a, const char* b) {
+    uint32_t i = 0;
+    while (i < LFS_NAME_MAX && a[i] && a[i] == b[i]) {
+        i++;
+    }
+    return i == LFS_NAME_MAX || a[i] == b[i];
+}
+
+/* CRC32C of a structure whose checksum field is zero */
+static uint32_t lfs_checksum(const void* data, uint32_t size) {
+    return crc32c(0, data, size);
+}
+
+static uint32_t seg_first_block(uint32_t segment) {
+    return LFS_FIRST_SEGMENT_BLOCK + segment * LFS_SEGMENT_BLOCKS;
+}
+
+static uint32_t block_segment(uint32_t block) {
+    return (block - LFS_FIRST_SEGMENT_BLOCK) / LFS_SEGMENT_BLOCKS;
+}
+
+static int block_io(uint32_t block, uint32_t count, void* buffer, int write) {
+    uint32_t sector = block * LFS_SECTORS_PER_BLOCK;
+    uint32_t sectors = count * LFS_SECTORS_PER_BLOCK;
+    return write ? blk_write((uint32_t)lfs_device, sector, sectors, buffer) :
+                   blk_read((uint32_t)lfs_device, sector, sectors, buffer);
+}
+
+/* The block at address, from the segment being filled if it is there */
+static int lfs_read_block(uint32_t block, void* buffer) {
+    if (!block) {
+        zero_bytes(buffer, LFS_BLOCK_SIZE);
+        return 0;
+    }
+    uint32_t first = seg_first_block(lfs_seg_current);
+    if (block >= first && block < first + lfs_seg_next) {
+        copy_bytes(buffer, lfs_seg_buf[block - first], LFS_BLOCK_SIZE);
+        return 0;
+    }
+    return block_io(block, 1, buffer, 0);
+}
+
+/* Account bytes leaving a segment: their newer copy is elsewhere in the log */
+static void lfs_kill(uint32_t block, uint32_t bytes) {
+    if (block >= LFS_FIRST_SEGMENT_BLOCK) {
+        lfs_usage[block_segment(block)].live -= bytes;
+    }
+}
+
+/*
+ * Send the part of the active segment not yet on the device, with its
+ * summary. A segment filled in one go leaves as a single 32 KiB request.
+ */
+static int lfs_segment_flush(void) {
+    if (lfs_seg_next == lfs_seg_flushed) {
+        return 0;
+    }
+    struct lfs_summary* summary = (struct lfs_summary*)lfs_seg_buf[0];
+    summary->magic = LFS_SUMMARY_MAGIC;
+    summary->serial = lfs_serial;
+    summary->blocks = lfs_seg_next;
+    summary->checksum = 0;
+    summary->checksum = lfs_checksum(summary, sizeof(*summary));
+
+    uint32_t first = seg_first_block(lfs_seg_current);
+    int status;
+    if (lfs_seg_flushed <= 1) {
+        status = block_io(first, lfs_seg_next, lfs_seg_buf[0], 1);
+        lfs_segment_writes++;
+    } else {
+        status = block_io(first, 1, lfs_seg_buf[0], 1);
+        status |= block_io(first + lfs_seg_flushed, lfs_seg_next - lfs_seg_flushed,
+                           lfs_seg_buf[lfs_seg_flushed], 1);
+        lfs_segment_writes += 2;
+    }
+    lfs_blocks_written += lfs_seg_next - lfs_seg_flushed;
+    lfs_seg_flushed = lfs_seg_next;
+    return status;
+}
+
+static uint32_t lfs_count_clean(void) {
+    uint32_t clean = 0;
+    for (uint32_t s = 0; s < lfs_segments; s++) {
+        clean += lfs_seg_state[s] == SEG_CLEAN;
+    }
+    return clean;
+}
+
+/* Retire the full active segment and start filling a clean one */
+static int lfs_segment_advance(void) {
+    if (lfs_segment_flush() != 0) {
+        return -1;
+    }
+    uint32_t next = lfs_segments;
+    for (uint32_t s = 1; s <= lfs_segments; s++) {
+        uint32_t candidate = (lfs_seg_current + s) % lfs_segments;
+        if (lfs_seg_state[candidate] == SEG_CLEAN) {
+            next = candidate;
+            break;
+        }
+    }
+    if (next == lfs_segments) {
+        return -1;
+    }
+    lfs_seg_state[lfs_seg_current] = SEG_DIRTY;
+    lfs_seg_state[next] = SEG_ACTIVE;
+    lfs_seg_current = next;
+    lfs_seg_next = 1;
+    lfs_seg_flushed = 1;
+    lfs_usage[next].live = 0;
+    zero_bytes(lfs_seg_buf[0], LFS_BLOCK_SIZE);
+    return 0;
+}
+
+/*
+ * Take the next block of the log for (ino, index) and return its slot in
+ * the segment buffer, or NULL when no clean segment is left.
+ */
+static uint8_t* lfs_append(uint32_t ino, uint32_t index, uint32_t* block) {
+    if (lfs_seg_next == LFS_SEGMENT_BLOCKS && lfs_segment_advance() != 0) {
+        return NULL;
+    }
+    struct lfs_summary* summary = (struct lfs_summary*)lfs_seg_buf[0];
+    summary->entries[lfs_seg_next].ino = ino;
+    summary->entries[lfs_seg_next].index = index;
+    *block = seg_first_block(lfs_seg_current) + lfs_seg_next;
+    lfs_usage[lfs_seg_current].mtime = timer_ticks;
+    lfs_dirty = 1;
+    return lfs_seg_buf[lfs_seg_next++];
+}
+
+/*
+ * A writable copy of block index of the inode, at its new place in the
+ * log. A block appended since the last flush is still in memory and is
+ * changed where it is: repeated small writes cost one block. File writes
+ * leave LFS_CLEAN_RESERVE segments to inodes and the cleaner, cleaning
+ * first when they reach it.
+ */
+static uint8_t* lfs_block_for_write(struct lfs_inode* inode, uint32_t index) {
+    uint32_t first = seg_first_block(lfs_seg_current);
+    if (inode->d.blocks[index] >= first + lfs_seg_flushed && inode->d.blocks[index] < first + lfs_seg_next) {
+        lfs_absorbed++;
+        return lfs_seg_buf[inode->d.blocks[index] - first];
+    }
+    if (lfs_seg_next == LFS_SEGMENT_BLOCKS && lfs_count_clean() <= LFS_CLEAN_RESERVE) {
+        lfs_clean(LFS_CLEAN_TARGET);
+        if (lfs_seg_next == LFS_SEGMENT_BLOCKS && lfs_count_clean() <= LFS_CLEAN_RESERVE) {
+            return NULL;
+        }
+    }
+    
+    /* Cleaning may have moved the block: look it up only now */
+    uint32_t block;
+    uint8_t* data = lfs_append(inode->d.ino, index, &block);
+    if (!data || lfs_read_block(inode->d.blocks[index], data) != 0) {
+        return NULL;
+    }
+    lfs_kill(inode->d.blocks[index], LFS_BLOCK_SIZE);
+    inode->d.blocks[index] = block;
+    lfs_usage[lfs_seg_current].live += LFS_BLOCK_SIZE;
+    inode->dirty = 1;
+    return data;
+}
+
+/* Write every dirty inode into inode blocks at the end of the log */
+static int lfs_flush_inodes(void) {
+    uint8_t* data = NULL;
+    uint32_t block = 0;
+    uint32_t slot = LFS_INODES_PER_BLOCK;
+    for (uint32_t ino = 1; ino < LFS_MAX_INODES; ino++) {
+        struct lfs_inode* inode = &lfs_inodes[ino];
+        if (!inode->dirty) {
+            continue;
+        }
+        if (slot == LFS_INODES_PER_BLOCK) {
+            data = lfs_append(0, LFS_SUM_INODES, &block);
+            if (!data) {
+                return -1;
+            }
+            zero_bytes(data, LFS_BLOCK_SIZE);
+            slot = 0;
+        }
+        copy_bytes(data + slot * LFS_INODE_SIZE, &inode->d, sizeof(inode->d));
+        if (lfs_imap[ino]) {
+            lfs_kill(lfs_imap[ino] >> 3, LFS_INODE_SIZE);
+        }
+        lfs_imap[ino] = block << 3 | slot;
+        lfs_usage[block_segment(block)].live += LFS_INODE_SIZE;
+        inode->dirty = 0;
+        slot++;
+    }
+    return 0;
+}
+
+/*
+ * Make the log durable: inodes, then the unwritten tail of the segment,
+ * then a checkpoint naming both. Segments the checkpoint no longer needs
+ * become clean only now, so the previous checkpoint stays readable until
+ * this one is on the device.
+ */
+static int lfs_checkpoint(void) {
+    if (lfs_flush_inodes() != 0 || lfs_segment_flush() != 0) {
+        return -1;
+    }
+
+    struct lfs_checkpoint* cp = (struct lfs_checkpoint*)lfs_block;
+    zero_bytes(lfs_block, LFS_BLOCK_SIZE);
+    cp->magic = LFS_CHECKPOINT_MAGIC;
+    cp->serial = ++lfs_serial;
+    cp->segment = lfs_seg_current;
+    cp->offset = lfs_seg_next;
+    copy_bytes(cp->imap, lfs_imap, sizeof(lfs_imap));
+    copy_bytes(cp->usage, lfs_usage, sizeof(lfs_usage));
+    cp->checksum = lfs_checksum(cp, sizeof(*cp));
+    if (block_io(LFS_CHECKPOINT_BLOCK + lfs_checkpoint_slot, 1, lfs_block, 1) != 0) {
+        return -1;
+    }
+    lfs_checkpoint_slot ^= 1;
+    lfs_checkpoints++;
+    lfs_dirty = 0;
+
+    for (uint32_t s = 0; s < lfs_segments; s++) {
+        if ((lfs_seg_state[s] == SEG_DIRTY || lfs_seg_state[s] == SEG_FREEING) && lfs_usage[s].live == 0) {
+            lfs_seg_state[s] = SEG_CLEAN;
+        }
+    }
+    return 0;
+}
+
+/* Copy the live blocks of one segment to the head of the log */
+static int lfs_clean_segment(uint32_t segment) {
+    uint32_t first = seg_first_block(segment);
+    if (block_io(first, LFS_SEGMENT_BLOCKS, lfs_clean_buf[0], 0) != 0) {
+        return -1;
+    }
+    struct lfs_summary* summary = (struct lfs_summary*)lfs_clean_buf[0];
+    uint32_t checksum = summary->checksum;
+    summary->checksum = 0;
+    if (summary->magic != LFS_SUMMARY_MAGIC || summary->blocks > LFS_SEGMENT_BLOCKS ||
+        lfs_checksum(summary, sizeof(*summary)) != checksum) {
+        return -1;
+    }
+
+    for (uint32_t i = 1; i < summary->blocks; i++) {
+        uint32_t block = first + i;
+        uint32_t ino = summary->entries[i].ino;
+        uint32_t index = summary->entries[i].index;
+        if (index == LFS_SUM_INODES) {
+            /* Live inodes are rewritten from memory at the next checkpoint */
+            for (uint32_t slot = 0; slot < LFS_INODES_PER_BLOCK; slot++) {
+                struct lfs_dinode* d = (struct lfs_dinode*)(lfs_clean_buf[i] + slot * LFS_INODE_SIZE);
+                if (d->ino && d->ino < LFS_MAX_INODES && lfs_imap[d->ino] == (block << 3 | slot)) {
+                    lfs_inodes[d->ino].dirty = 1;
+                }
+            }
+            continue;
+        }
+        if (ino == 0 || ino >= LFS_MAX_INODES || index >= LFS_DIRECT ||
+            !lfs_inodes[ino].used || lfs_inodes[ino].d.blocks[index] != block) {
+            continue; /* Dead: the file has a newer copy, or is gone */
+        }
+        uint32_t moved;
+        uint8_t* data = lfs_append(ino, index, &moved);
+        if (!data) {
+            return -1;
+        }
+        copy_bytes(data, lfs_clean_buf[i], LFS_BLOCK_SIZE);
+        lfs_kill(block, LFS_BLOCK_SIZE);
+        lfs_inodes[ino].d.blocks[index] = moved;
+        lfs_inodes[ino].dirty = 1;
+        lfs_usage[lfs_seg_current].live += LFS_BLOCK_SIZE;
+        lfs_moved++;
+    }
+    lfs_cleaned++;
+    return 0;
+}
+
+/* Segments free now or at the next checkpoint */
+static uint32_t lfs_count_reclaimable(void) {
+    uint32_t free = 0;
+    for (uint32_t s = 0; s < lfs_segments; s++) {
+        free += lfs_seg_state[s] == SEG_CLEAN || lfs_seg_state[s] == SEG_FREEING ||
+                (lfs_seg_state[s] == SEG_DIRTY && lfs_usage[s].live == 0);
+    }
+    return free;
+}
+
+/*
+ * Clean until target segments are free, best first by cost-benefit: free
+ * space times age, over the cost of reading the segment and writing its
+ * live part back. Old, mostly empty segments go first; a hot segment is
+ * left to empty itself. Live blocks from several victims share the
+ * segment they move to, which is what makes a pass gain space. Returns
+ * the number of segments cleaned.
+ */
+int lfs_clean(uint32_t target) {
+    if (lfs_device < 0 || lfs_cleaning) {
+        return 0;
+    }
+    lfs_cleaning = 1;
+    uint32_t cleaned = 0;
+    while (lfs_count_reclaimable() < target) {
+        uint32_t best = lfs_segments;
+        uint32_t best_score = 0;
+        for (uint32_t s = 0; s < lfs_segments; s++) {
+            if (lfs_seg_state[s] != SEG_DIRTY || lfs_usage[s].live >= LFS_SEGMENT_BYTES - LFS_BLOCK_SIZE) {
+                continue;
+            }
+            uint32_t age = timer_ticks - lfs_usage[s].mtime + 1;
+            if (age > (1u << 20)) {
+                age = 1u << 20;
+            }
+            uint32_t free_kb = (LFS_SEGMENT_BYTES - lfs_usage[s].live) / 1024;
+            uint32_t cost_kb = (LFS_SEGMENT_BYTES + lfs_usage[s].live) / 1024;
+            uint32_t score = free_kb * age / cost_kb + 1;
+            if (score > best_score) {
+                best_score = score;
+                best = s;
+            }
+        }
+        if (best == lfs_segments || lfs_clean_segment(best) != 0) {
+            break;
+        }
+        lfs_seg_state[best] = SEG_FREEING;
+        cleaned++;
+    }
+    if (lfs_count_reclaimable() > lfs_count_clean()) {
+        lfs_checkpoint();
+    }
+    lfs_cleaning = 0;
+    return (int)cleaned;
+}
+
+/* Background work from the timer wheel, skipped while a caller is inside */
+static void lfs_tick(void* data) {
+    (void)data;
+    if (!lfs_busy && lfs_device >= 0) {
+        lfs_busy = 1;
+        if (lfs_count_clean() < LFS_CLEAN_LOW) {
+            lfs_clean(LFS_CLEAN_TARGET);
+        }
+        if (lfs_dirty) {
+            lfs_checkpoint();
+        }
+        lfs_busy = 0;
+    }
+    timer_add(&lfs_timer, timer_ticks + LFS_FLUSH_INTERVAL);
+}
+
+/* Write an empty filesystem, holding just the root directory */
+int lfs_format(uint32_t device) {
+    if (lfs_device >= 0) {
+        return -1;
+    }
+    uint32_t blocks = blk_sectors(device) / LFS_SECTORS_PER_BLOCK;
+    if (blocks < LFS_FIRST_SEGMENT_BLOCK + (LFS_CLEAN_RESERVE + 2) * LFS_SEGMENT_BLOCKS) {
+        return -1;
+    }
+    uint32_t segments = (blocks - LFS_FIRST_SEGMENT_BLOCK) / LFS_SEGMENT_BLOCKS;
+    if (segments > LFS_MAX_SEGMENTS) {
+        segments = LFS_MAX_SEGMENTS;
+    }
+
+    struct lfs_superblock* sb = (struct lfs_superblock*)lfs_block;
+    zero_bytes(lfs_block, LFS_BLOCK_SIZE);
+    sb->magic = LFS_MAGIC;
+    sb->block_size = LFS_BLOCK_SIZE;
+    sb->segment_blocks = LFS_SEGMENT_BLOCKS;
+    sb->segments = segments;
+    sb->checksum = lfs_checksum(sb, sizeof(*sb));
+    if (blk_write(device, LFS_SUPER_BLOCK, LFS_SECTORS_PER_BLOCK, lfs_block) != 0) {
+        return -1;
+    }
+
+    /* Both regions are invalidated, then the first checkpoint describes the root */
+    zero_bytes(lfs_block, LFS_BLOCK_SIZE);
+    for (uint32_t slot = 0; slot < 2; slot++) {
+        if (blk_write(device, (LFS_CHECKPOINT_BLOCK + slot) * LFS_SECTORS_PER_BLOCK,
+                      LFS_SECTORS_PER_BLOCK, lfs_block) != 0) {
+            return -1;
+        }
+    }
+
+    lfs_device = (int)device;
+    lfs_segments = segments;
+    lfs_serial = 0;
+    lfs_checkpoint_slot = 0;
+    for (uint32_t s = 0; s < LFS_MAX_SEGMENTS; s++) {
+        lfs_usage[s].live = 0;
+        lfs_usage[s].mtime = 0;
+        lfs_seg_state[s] = SEG_CLEAN;
+    }
+    for (uint32_t ino = 0; ino < LFS_MAX_INODES; ino++) {
+        lfs_imap[ino] = 0;
+        lfs_inodes[ino].used = 0;
+        lfs_inodes[ino].dirty = 0;
+    }
+    lfs_seg_current = 0;
+    lfs_seg_state[0] = SEG_ACTIVE;
+    lfs_seg_next = 1;
+    lfs_seg_flushed = 1;
+    zero_bytes(lfs_seg_buf[0], LFS_BLOCK_SIZE);
+
+    struct lfs_inode* root = &lfs_inodes[LFS_ROOT_INO];
+    zero_bytes(&root->d, sizeof(root->d));
+    root->d.ino = LFS_ROOT_INO;
+    root->d.type = LFS_TYPE_DIR;
+    root->d.nlink = 1;
+    root->used = 1;
+    root->dirty = 1;
+
+    int status = lfs_checkpoint();
+    lfs_device = -1;
+    return status;
+}
+
+/* Load the newest valid checkpoint and every inode it names */
+int lfs_mount(uint32_t device) {
+    if (lfs_device >= 0) {
+        return -1;
+    }
+    struct lfs_superblock* sb = (struct lfs_superblock*)lfs_block;
+    if (blk_read(device, LFS_SUPER_BLOCK, LFS_SECTORS_PER_BLOCK, lfs_block) != 0) {
+        return -1;
+    }
+    uint32_t checksum = sb->checksum;
+    sb->checksum = 0;
+    if (sb->magic != LFS_MAGIC || sb->segment_blocks != LFS_SEGMENT_BLOCKS ||
+        sb->segments > LFS_MAX_SEGMENTS || lfs_checksum(sb, sizeof(*sb)) != checksum) {
+        return -1;
+    }
+    lfs_segments = sb->segments;
+    lfs_device = (int)device;
+
+    /* The newer of the two checkpoints that check out */
+    struct lfs_checkpoint* cp = (struct lfs_checkpoint*)lfs_block;
+    int found = 0;
+    for (uint32_t slot = 0; slot < 2; slot++) {
+        if (block_io(LFS_CHECKPOINT_BLOCK + slot, 1, lfs_block, 0) != 0) {
+            continue;
+        }
+        checksum = cp->checksum;
+        cp->checksum = 0;
+        if (cp->magic != LFS_CHECKPOINT_MAGIC || cp->segment >= lfs_segments ||
+            cp->offset > LFS_SEGMENT_BLOCKS || lfs_checksum(cp, sizeof(*cp)) != checksum ||
+            (found && cp->serial <= lfs_serial)) {
+            continue;
+        }
+        found = 1;
+        lfs_serial = cp->serial;
+        lfs_checkpoint_slot = slot ^ 1;
+        lfs_seg_current = cp->segment;
+        lfs_seg_next = cp->offset;
+        copy_bytes(lfs_imap, cp->imap, sizeof(lfs_imap));
+        copy_bytes(lfs_usage, cp->usage, sizeof(lfs_usage));
+    }
+    if (!found) {
+        lfs_device = -1;
+        return -1;
+    }
+
+    /* The log continues in the active segment, after what the checkpoint covers */
+    if (block_io(seg_first_block(lfs_seg_current), lfs_seg_next, lfs_seg_buf[0], 0) != 0) {
+        lfs_device = -1;
+        return -1;
+    }
+    lfs_seg_flushed = lfs_seg_next;
+    for (uint32_t s = 0; s < lfs_segments; s++) {
+        lfs_seg_state[s] = lfs_usage[s].live ? SEG_DIRTY : SEG_CLEAN;
+    }
+    lfs_seg_state[lfs_seg_current] = SEG_ACTIVE;
+
+    for (uint32_t ino = 0; ino < LFS_MAX_INODES; ino++) {
+        struct lfs_inode* inode = &lfs_inodes[ino];
+        inode->used = 0;
+        inode->dirty = 0;
+        if (!lfs_imap[ino]) {
+            continue;
+        }
+        if (lfs_read_block(lfs_imap[ino] >> 3, lfs_block) != 0) {
+            lfs_device = -1;
+            return -1;
+        }
+        copy_bytes(&inode->d, lfs_block + (lfs_imap[ino] & 7) * LFS_INODE_SIZE, sizeof(inode->d));
+        inode->used = inode->d.ino == ino;
+    }
+
+    lfs_dirty = 0;
+    lfs_busy = 0;
+    lfs_cleaning = 0;
+    lfs_segment_writes = 0;
+    lfs_blocks_written = 0;
+    lfs_absorbed = 0;
+    lfs_cleaned = 0;
+    lfs_moved = 0;
+    lfs_checkpoints = 0;
+    timer_setup(&lfs_timer, lfs_tick, NULL);
+    timer_add(&lfs_timer, timer_ticks + LFS_FLUSH_INTERVAL);
+    return 0;
+}
+
+int lfs_sync(void) {
+    if (lfs_device < 0) {
+        return -1;
+    }
+    lfs_busy = 1;
+    int status = lfs_dirty ? lfs_checkpoint() : 0;
+    lfs_busy = 0;
+    return status;
+}
+
+int lfs_unmount(void) {
+    if (lfs_device < 0) {
+        return -1;
+    }
+    timer_cancel(&lfs_timer);
+    int status = lfs_sync();
+    lfs_device = -1;
+    return status;
+}
+
+static struct lfs_inode* lfs_get(int ino) {
+    if (lfs_device < 0 || ino <= 0 || ino >= LFS_MAX_INODES || !lfs_inodes[ino].used) {
+        return NULL;
+    }
+    return &lfs_inodes[ino];
+}
+
+/* Byte I/O on an inode; the caller holds lfs_busy */
+static int lfs_inode_read(struct lfs_inode* inode, uint32_t offset, uint8_t* buffer, uint32_t size) {
+    if (offset >= inode->d.size) {
+        return 0;
+    }
+    if (size > inode->d.size - offset) {
+        size = inode->d.size - offset;
+    }
+    uint32_t done = 0;
+    while (done < size) {
+        uint32_t index = (offset + done) / LFS_BLOCK_SIZE;
+        uint32_t start = (offset + done) % LFS_BLOCK_SIZE;
+        uint32_t chunk = LFS_BLOCK_SIZE - start;
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+        if (lfs_read_block(inode->d.blocks[index], lfs_block) != 0) {
+            return -1;
+        }
+        copy_bytes(buffer + done, lfs_block + start, chunk);
+        done += chunk;
+    }
+    return (int)done;
+}
+
+static int lfs_inode_write(struct lfs_inode* inode, uint32_t offset, const uint8_t* buffer, uint32_t size) {
+    if (offset >= LFS_DIRECT * LFS_BLOCK_SIZE) {
+        return -1;
+    }
+    if (size > LFS_DIRECT * LFS_BLOCK_SIZE - offset) {
+        size = LFS_DIRECT * LFS_BLOCK_SIZE - offset;
+    }
+    uint32_t done = 0;
+    while (done < size) {
+        uint32_t index = (offset + done) / LFS_BLOCK_SIZE;
+        uint32_t start = (offset + done) % LFS_BLOCK_SIZE;
+        uint32_t chunk = LFS_BLOCK_SIZE - start;
+        if (chunk > size - done) {
+            chunk = size - done;
+        }
+        uint8_t* data = lfs_block_for_write(inode, index);
+        if (!data) {
+            break;
+        }
+        copy_bytes(data + start, buffer + done, chunk);
+        done += chunk;
+    }
+    if (offset + done > inode->d.size) {
+        inode->d.size = offset + done;
+    }
+    inode->d.mtime = timer_ticks;
+    inode->dirty = 1;
+    lfs_dirty = 1;
+    return done || !size ? (int)done : -1;
+}
+
+/* The root directory slot holding name, or of a free slot with name NULL */
+static int lfs_dir_find(const char* name, uint32_t* offset, struct lfs_dirent* entry) {
+    struct lfs_inode* root = &lfs_inodes[LFS_ROOT_INO];
+    for (uint32_t pos = 0; pos < root->d.size; pos += sizeof(*entry)) {
+        if (lfs_inode_read(root, pos, (uint8_t*)entry, sizeof(*entry)) != sizeof(*entry)) {
+            return -1;
+        }
+        if (name ? entry->ino && name_equal(entry->name, name) : !entry->ino) {
+            *offset = pos;
+            return 0;
+        }
+    }
+    *offset = root->d.size;
+    return -1;
+}
+
+int lfs_lookup(const char* name) {
+    if (lfs_device < 0) {
+        return -1;
+    }
+    lfs_busy = 1;
+    uint32_t offset;
+    struct lfs_dirent entry;
+    int ino = lfs_dir_find(name, &offset, &entry) == 0 ? (int)entry.ino : -1;
+    lfs_busy = 0;
+    return ino;
+}
+
+/* Create an empty file in the root directory; returns its inode number */
+int lfs_create(const char* name) {
+    if (lfs_device < 0 || !name[0]) {
+        return -1;
+    }
+    lfs_busy = 1;
+    uint32_t offset;
+    struct lfs_dirent entry;
+    if (lfs_dir_find(name, &offset, &entry) == 0) {
+        lfs_busy = 0;
+        return -1;
+    }
+    uint32_t ino = 2;
+    while (ino < LFS_MAX_INODES && (lfs_inodes[ino].used || lfs_imap[ino])) {
+        ino++;
+    }
+    if (ino == LFS_MAX_INODES) {
+        lfs_busy = 0;
+        return -1;
+    }
+
+    struct lfs_inode* inode = &lfs_inodes[ino];
+    zero_bytes(&inode->d, sizeof(inode->d));
+    inode->d.ino = ino;
+    inode->d.type = LFS_TYPE_FILE;
+    inode->d.nlink = 1;
+    inode->d.mtime = timer_ticks;
+    inode->used = 1;
+    inode->dirty = 1;
+
+    lfs_dir_find(NULL, &offset, &entry);
+    struct lfs_dirent slot;
+    zero_bytes(&slot, sizeof(slot));
+    slot.ino = ino;
+    for (uint32_t i = 0; i < LFS_NAME_MAX - 1 && name[i]; i++) {
+        slot.name[i] = name[i];
+    }
+    int status = lfs_inode_write(&lfs_inodes[LFS_ROOT_INO], offset, (const uint8_t*)&slot, sizeof(slot));
+    if (status != sizeof(slot)) {
+        inode->used = 0;
+        inode->dirty = 0;
+        lfs_busy = 0;
+        return -1;
+    }
+    lfs_busy = 0;
+    return (int)ino;
+}
+
+/* Remove name; its blocks and inode become dead space for the cleaner */
+int lfs_unlink(const char* name) {
+    if (lfs_device < 0) {
+        return -1;
+    }
+    lfs_busy = 1;
+    uint32_t offset;
+    struct lfs_dirent entry;
+    if (lfs_dir_find(name, &offset, &entry) != 0 || !lfs_get((int)entry.ino)) {
+        lfs_busy = 0;
+        return -1;
+    }
+    struct lfs_inode* inode = &lfs_inodes[entry.ino];
+    for (uint32_t i = 0; i < LFS_DIRECT; i++) {
+        lfs_kill(inode->d.blocks[i], LFS_BLOCK_SIZE);
+    }
+    if (lfs_imap[entry.ino]) {
+        lfs_kill(lfs_imap[entry.ino] >> 3, LFS_INODE_SIZE);
+        lfs_imap[entry.ino] = 0;
+    }
+    inode->used = 0;
+    inode->dirty = 0;
+
+    entry.ino = 0;
+    int status = lfs_inode_write(&lfs_inodes[LFS_ROOT_INO], offset, (const uint8_t*)&entry, sizeof(entry));
+    lfs_busy = 0;
+    return status == sizeof(entry) ? 0 : -1;
+}
+
+int lfs_read(int ino, uint32_t offset, void* buffer, uint32_t size) {
+    struct lfs_inode* inode = lfs_get(ino);
+    if (!inode) {
+        return -1;
+    }
+    lfs_busy = 1;
+    int status = lfs_inode_read(inode, offset, (uint8_t*)buffer, size);
+    lfs_busy = 0;
+    return status;
+}
+
+/*
+ * Write into a file. The data only reaches the log in memory: the device
+ * sees it when the segment fills, at a sync, or at the next background
+ * checkpoint, as a few large sequential writes.
+ */
+int lfs_write(int ino, uint32_t offset, const void* buffer, uint32_t size) {
+    struct lfs_inode* inode = lfs_get(ino);
+    if (!inode || ino == LFS_ROOT_INO) {
+        return -1;
+    }
+    lfs_busy = 1;
+    int status = lfs_inode_write(inode, offset, (const uint8_t*)buffer, size);
+    lfs_busy = 0;
+    return status;
+}
+
+uint32_t lfs_size(int ino) {
+    struct lfs_inode* inode = lfs_get(ino);
+    return inode ? inode->d.size : 0;
+}
+
+uint32_t lfs_clean_segments(void) {
+    return lfs_device >= 0 ? lfs_count_clean() : 0;
+}
+
+void lfs_get_statistics(uint32_t* segment_writes, uint32_t* blocks_written, uint32_t* absorbed,
+                        uint32_t* cleaned, uint32_t* moved, uint32_t* checkpoints) {
+    if (segment_writes) *segment_writes = lfs_segment_writes;
+    if (blocks_written) *blocks_written = lfs_blocks_written;
+    if (absorbed) *absorbed = lfs_absorbed;
+    if (cleaned) *cleaned = lfs_cleaned;
+    if (moved) *moved = lfs_moved;
+    if (checkpoints) *checkpoints = lfs_checkpoints;
+}
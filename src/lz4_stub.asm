@@ -0,0 +1,112 @@
+;
+; Tiny Operating System - LZ4 Kernel Decompressor
+; Prepended to an LZ4-compressed kernel image: the bootloader loads and
+; enters it at 0x10000 like an uncompressed kernel, and it unpacks the
+; kernel over itself to 0x10000 and jumps there
+;
+
+[bits 32]
+[org 0x10000]
+
+%ifndef KERNEL_END
+%error "KERNEL_END must be the packed stage's _end, from nm"
+%endif
+
+KERNEL_BASE equ 0x10000     ; Link address of every kernel stage (-Ttext 0x10000)
+LZ4_STACK equ 0x1000        ; Room for the stub's stack, between the stage's .bss and the copy
+LZ4_RELOC equ (KERNEL_END + LZ4_STACK + 0xFFF) & ~0xFFF  ; Where the stub and payload run from
+
+%if LZ4_RELOC - LZ4_STACK < KERNEL_END
+%error "the relocated stub would overlap the stage's .bss"
+%endif
+
+; Address of a label in the relocated copy
+%define RELOC(label) (LZ4_RELOC + (label) - $$)
+
+%ifndef PAYLOAD
+%error "PAYLOAD must name the LZ4 block from tools/lz4pack, quoted"
+%endif
+
+section .text
+global start
+
+start:
+    ; The loader's boot-timing registers go to the kernel untouched (must match boot.asm)
+    mov [saved_eax], eax
+    mov [saved_esi], esi
+    mov [saved_edi], edi
+
+    ; The output overwrites this copy: move stub and payload out of its way
+    cld
+    mov esi, start
+    mov edi, LZ4_RELOC
+    mov ecx, image_end - start
+    rep movsb
+    mov esp, LZ4_RELOC          ; Stack just below the copy
+    mov eax, RELOC(unpack)
+    jmp eax
+
+; Decode one LZ4 block (sequences of literals then a back-reference, the
+; last one literals only) from ESI up to EBX into EDI. Position independent
+; but for the RELOC addresses, as it runs from the copy.
+unpack:
+    mov esi, RELOC(payload)
+    mov ebx, RELOC(payload_end)
+    mov edi, KERNEL_BASE
+.sequence:
+    xor eax, eax
+    lodsb                       ; Token: literal length, match length - 4
+    mov edx, eax
+    shr eax, 4
+    call .length
+    mov ecx, eax
+    rep movsb                   ; Literals
+    cmp esi, ebx
+    jae .done
+    xor eax, eax
+    lodsw                       ; Match offset, little-endian
+    push esi
+    mov esi, edi
+    sub esi, eax
+    mov eax, edx
+    and eax, 0x0F
+    xchg esi, [esp]             ; Length bytes follow the offset in the input
+    call .length
+    xchg esi, [esp]
+    lea ecx, [eax + 4]
+    rep movsb                   ; Byte by byte, so overlapping copies repeat
+    pop esi
+    jmp .sequence
+
+; A length nibble of 15 continues in bytes, each of 255 adding another
+.length:
+    cmp eax, 15
+    jne .length_done
+    push edx
+.length_byte:
+    xor edx, edx
+    mov dl, [esi]
+    inc esi
+    add eax, edx
+    cmp dl, 255
+    je .length_byte
+    pop edx
+.length_done:
+    ret
+
+.done:
+    mov eax, [RELOC(saved_eax)]
+    mov esi, [RELOC(saved_esi)]
+    mov edi, [RELOC(saved_edi)]
+    mov ecx, KERNEL_BASE
+    jmp ecx
+
+align 4
+saved_eax: dd 0
+saved_esi: dd 0
+saved_edi: dd 0
+
+payload:
+    incbin PAYLOAD
+payload_end:
+image_end:
@@ -32,9 +32,10 @@ struct device {
 #define NE2000_TRANSMIT_PAGE 0x04
 #define NE2000_TRANSMIT_COUNT 0x05
 #define NE2000_INTERRUPT_STATUS 0x07
-#define NE2000_REMOTE_COUNT 0x0D
+#define NE2000_REMOTE_START 0x08       /* RSAR0/1 on write, CRDA0/1 on read */
+#define NE2000_REMOTE_BYTE_COUNT 0x0A  /* RBCR0/1 */
 #define NE2000_CONFIG 0x0E
-#define NE2000_REMOTE_DMA 0x0F
+#define NE2000_INTERRUPT_MASK 0x0F
 
 /* NE2000 Commands */
 #define NE2000_CMD_STOP 0x21
@@ -51,21 +52,37 @@ struct device {
 #define NE2000_INT_OVW 0x10
 #define NE2000_INT_CNTD 0x20
 #define NE2000_INT_RDC 0x40
+#define NE2000_RX_INTS (NE2000_INT_RX | NE2000_INT_RXE | NE2000_INT_OVW)
+#define NE2000_TX_INTS (NE2000_INT_TX | NE2000_INT_TXE)
 
-/* NE2000 Configuration */
-#define NE2000_CFG_BOS 0x01
-#define NE2000_CFG_WTS 0x02
-#define NE2000_CFG_DAS 0x08
-#define NE2000_CFG_FDL0 0x10
-#define NE2000_CFG_FDL1 0x20
-#define NE2000_CFG_LAS 0x40
-#define NE2000_CFG_MON 0x80
+/* NE2000 Data Configuration Register */
+#define NE2000_CFG_WTS 0x01             /* Word-wide remote DMA */
+#define NE2000_CFG_BOS 0x02
+#define NE2000_CFG_LAS 0x04
+#define NE2000_CFG_LS 0x08              /* Normal operation, not loopback */
+#define NE2000_CFG_ARM 0x10
+#define NE2000_CFG_FT1 0x40             /* FIFO threshold 8 bytes */
 
 /* NE2000 Constants */
-#define NE2000_START_PAGE 0x40
+#define NE2000_TX_PAGE 0x40              /* Two transmit buffers sit below the receive ring */
+#define NE2000_TX_PAGES 6               /* 1536 bytes, one full frame */
+#define NE2000_TX_BUFFERS 2
+#define NE2000_START_PAGE (NE2000_TX_PAGE + NE2000_TX_BUFFERS * NE2000_TX_PAGES)
 #define NE2000_STOP_PAGE 0x80
+#define NE2000_MIN_FRAME 60
 #define NE2000_BUFFER_SIZE 8192
 #define NE2000_HEADER_SIZE 4
+#define NE2000_RX_QUEUE 8               /* Frames held between bottom half and reader */
+#define NE2000_FRAME_SIZE (ETH_MTU + 18)
+#define NE2000_POLL_BUDGET 4            /* Frames per bottom-half pass before yielding */
+#define NE2000_DMA_TIMEOUT 10000
+#define NE2000_TX_TIMEOUT 100000        /* Spins waiting for a free transmit buffer */
+
+/* Deferred interrupt work (interrupt_handlers.c) */
+#define SOFTIRQ_NET_RX 1
+extern void irq_install_handler(uint32_t irq, void (*handler)(void));
+extern void open_softirq(uint32_t nr, void (*action)(void));
+extern void raise_softirq(uint32_t nr);
 
 /* NE2000 device structure */
 struct ne2000_device {
@@ -78,11 +95,44 @@ struct ne2000_device {
     uint32_t tx_packets;
     uint32_t rx_errors;
     uint32_t tx_errors;
+    volatile uint8_t irq_status;        /* ISR bits acknowledged by the top half */
+    volatile uint8_t polling;           /* RX interrupts masked while the bottom half drains */
+    uint32_t rx_interrupts;
+    uint32_t rx_polls;
     uint8_t buffer[NE2000_BUFFER_SIZE];
 };
 
+/* Received frames; the bottom half only moves head and the reader only moves tail */
+struct ne2000_frame {
+    uint32_t size;
+    uint8_t data[NE2000_FRAME_SIZE];
+};
+
+/* Transmit buffer states */
+enum ne2000_tx_state {
+    TX_FREE = 0,
+    TX_LOADING,                         /* Sender is copying the frame in */
+    TX_READY,                           /* Waiting for the other buffer to go out */
+    TX_BUSY                             /* On the wire */
+};
+
+/* Transmit descriptor for one card buffer */
+struct ne2000_tx_slot {
+    uint8_t page;
+    volatile uint8_t state;
+    uint16_t size;
+};
+
 /* Global NE2000 device instance */
 static struct ne2000_device ne2000_dev;
+static struct ne2000_frame rx_queue[NE2000_RX_QUEUE];
+static volatile uint32_t rx_queue_head;
+static volatile uint32_t rx_queue_tail;
+static struct ne2000_tx_slot tx_slots[NE2000_TX_BUFFERS];
+static volatile int tx_active;          /* Slot being transmitted, or -1 when idle */
+
+static void ne2000_interrupt_handler(void);
+static void ne2000_rx_action(void);
 
 /* Port I/O functions */
 static inline void outb(uint16_t port, uint8_t value) {
@@ -114,25 +164,80 @@ static __attribute__((used)) uint8_t ne2000_read_cr(void) {
     return inb(ne2000_dev.base_port + NE2000_COMMAND);
 }
 
-static void ne2000_write_remote_dma(uint16_t value) {
-    outb(ne2000_dev.base_port + NE2000_REMOTE_DMA, value);
-}
-
-static void ne2000_write_remote_address(uint16_t addr) {
-    outb(ne2000_dev.base_port + NE2000_REMOTE_COUNT, addr & 0xFF);
-    outb(ne2000_dev.base_port + NE2000_REMOTE_COUNT + 1, addr >> 8);
+/* Aim the remote DMA channel at card memory; word mode moves whole words only */
+static void ne2000_remote_dma(uint8_t command, uint16_t addr, uint16_t count) {
+    uint16_t base = ne2000_dev.base_port;
+    count = (count + 1) & ~1;
+    outb(base + NE2000_REMOTE_BYTE_COUNT, count & 0xFF);
+    outb(base + NE2000_REMOTE_BYTE_COUNT + 1, count >> 8);
+    outb(base + NE2000_REMOTE_START, addr & 0xFF);
+    outb(base + NE2000_REMOTE_START + 1, addr >> 8);
+    ne2000_write_cr(command);
 }
 
 static __attribute__((used)) uint16_t ne2000_read_remote_address(void) {
-    uint16_t addr = inb(ne2000_dev.base_port + NE2000_REMOTE_COUNT);
-    addr |= inb(ne2000_dev.base_port + NE2000_REMOTE_COUNT + 1) << 8;
+    uint16_t addr = inb(ne2000_dev.base_port + NE2000_REMOTE_START);
+    addr |= inb(ne2000_dev.base_port + NE2000_REMOTE_START + 1) << 8;
     return addr;
 }
 
+/* Copy card memory to the host, one insw per pair of bytes */
+static void ne2000_block_input(void* data, uint16_t addr, uint16_t size) {
+    uint16_t port = ne2000_dev.base_port + NE2000_DATA_PORT;
+    uint8_t* dest = (uint8_t*)data;
+    uint32_t words = size / 2;
+    
+    ne2000_remote_dma(NE2000_CMD_READ, addr, size);
+    __asm__ __volatile__("cld; rep insw" : "+D"(dest), "+c"(words) : "d"(port) : "memory");
+    if (size & 1) {
+        *dest = (uint8_t)inw(port);
+    }
+}
+
+/* Copy host memory to the card, one outsw per pair of bytes; returns 0 if the DMA stalls */
+static uint32_t ne2000_block_output(const void* data, uint16_t addr, uint16_t size) {
+    uint16_t base = ne2000_dev.base_port;
+    uint16_t port = base + NE2000_DATA_PORT;
+    const uint8_t* src = (const uint8_t*)data;
+    uint32_t words = size / 2;
+    
+    outb(base + NE2000_INTERRUPT_STATUS, NE2000_INT_RDC);
+    ne2000_remote_dma(NE2000_CMD_WRITE, addr, size);
+    __asm__ __volatile__("cld; rep outsw" : "+S"(src), "+c"(words) : "d"(port) : "memory");
+    if (size & 1) {
+        outw(port, *src);
+    }
+    
+    /* The frame must be in card memory before transmit is started */
+    for (uint32_t timeout = NE2000_DMA_TIMEOUT; timeout; timeout--) {
+        if (inb(base + NE2000_INTERRUPT_STATUS) & NE2000_INT_RDC) {
+            outb(base + NE2000_INTERRUPT_STATUS, NE2000_INT_RDC);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void ne2000_write_imr(uint8_t mask) {
+    outb(ne2000_dev.base_port + NE2000_INTERRUPT_MASK, mask);
+}
+
 static void ne2000_set_page(uint8_t page) {
     outb(ne2000_dev.base_port, page);
 }
 
+/* Save EFLAGS and disable interrupts */
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+/* Restore the interrupt flag saved by irq_save */
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+}
+
 /* NE2000 initialization */
 static uint32_t ne2000_init(uint16_t base_port, uint16_t irq) {
     ne2000_dev.base_port = base_port;
@@ -162,7 +267,7 @@ static uint32_t ne2000_init(uint16_t base_port, uint16_t irq) {
     ne2000_set_page(0x00);
     
     /* Configure the card */
-    outb(base_port + NE2000_CONFIG, 0x49); /* 16-bit mode, FIFO normal */
+    outb(base_port + NE2000_CONFIG, NE2000_CFG_WTS | NE2000_CFG_LS | NE2000_CFG_FT1);
     outb(base_port + NE2000_PAGE_START, NE2000_START_PAGE);
     outb(base_port + NE2000_PAGE_STOP, NE2000_STOP_PAGE);
     outb(base_port + NE2000_BOUNDARY, NE2000_START_PAGE);
@@ -199,58 +304,126 @@ static uint32_t ne2000_init(uint16_t base_port, uint16_t irq) {
     /* Clear interrupts */
     outb(base_port + NE2000_INTERRUPT_STATUS, 0xFF);
     
+    /* Acknowledge in the top half; drain the ring in the bottom half */
+    ne2000_dev.irq_status = 0;
+    ne2000_dev.polling = 0;
+    ne2000_dev.rx_interrupts = 0;
+    ne2000_dev.rx_polls = 0;
+    rx_queue_head = 0;
+    rx_queue_tail = 0;
+    for (int i = 0; i < NE2000_TX_BUFFERS; i++) {
+        tx_slots[i].page = NE2000_TX_PAGE + i * NE2000_TX_PAGES;
+        tx_slots[i].state = TX_FREE;
+        tx_slots[i].size = 0;
+    }
+    tx_active = -1;
+    open_softirq(SOFTIRQ_NET_RX, ne2000_rx_action);
+    irq_install_handler(irq, ne2000_interrupt_handler);
+    ne2000_write_imr(NE2000_RX_INTS | NE2000_TX_INTS);
+    
     return 1; /* Success */
 }
 
-/* NE2000 transmit function */
+/* Put a loaded buffer on the wire; interrupts must be off */
+static void ne2000_tx_start(int slot) {
+    struct ne2000_tx_slot* tx = &tx_slots[slot];
+    uint16_t count = tx->size < NE2000_MIN_FRAME ? NE2000_MIN_FRAME : tx->size;
+    
+    outb(ne2000_dev.base_port + NE2000_TRANSMIT_PAGE, tx->page);
+    outb(ne2000_dev.base_port + NE2000_TRANSMIT_COUNT, count & 0xFF);
+    outb(ne2000_dev.base_port + NE2000_TRANSMIT_COUNT + 1, count >> 8);
+    ne2000_write_cr(NE2000_CMD_TRANSMIT);
+    
+    tx->state = TX_BUSY;
+    tx_active = slot;
+}
+
+/* Retire the frame on the wire and kick the other buffer if it is loaded; interrupts must be off */
+static void ne2000_tx_complete(uint8_t status) {
+    if (tx_active < 0) {
+        return;
+    }
+    
+    if (status & NE2000_INT_TXE) {
+        ne2000_dev.tx_errors++;
+    } else {
+        ne2000_dev.tx_packets++;
+    }
+    tx_slots[tx_active].state = TX_FREE;
+    
+    int next = tx_active ^ 1;
+    tx_active = -1;
+    if (tx_slots[next].state == TX_READY) {
+        ne2000_tx_start(next);
+    }
+}
+
+/* Reap a finished transmit without waiting for its interrupt; interrupts must be off */
+static void ne2000_tx_poll(void) {
+    uint8_t status = inb(ne2000_dev.base_port + NE2000_INTERRUPT_STATUS) & NE2000_TX_INTS;
+    if (status) {
+        outb(ne2000_dev.base_port + NE2000_INTERRUPT_STATUS, status);
+        ne2000_tx_complete(status);
+    }
+}
+
+/* NE2000 transmit function: queue the frame in a card buffer and return */
 static uint32_t ne2000_transmit(const void* data, uint32_t size) {
     if (size > ETH_MTU) {
         return 0;
     }
     
-    /* Stop the NIC */
-    ne2000_write_cr(NE2000_CMD_STOP);
+    /* Claim a free buffer, reaping completions in case the interrupt is not wired */
+    int slot = -1;
+    for (uint32_t timeout = NE2000_TX_TIMEOUT; slot < 0; timeout--) {
+        if (timeout == 0) {
+            ne2000_dev.tx_errors++;
+            return 0;
+        }
+        uint32_t flags = irq_save();
+        ne2000_tx_poll();
+        for (int i = 0; i < NE2000_TX_BUFFERS; i++) {
+            if (tx_slots[i].state == TX_FREE) {
+                tx_slots[i].state = TX_LOADING;
+                slot = i;
+                break;
+            }
+        }
+        irq_restore(flags);
+    }
     
-    /* Set page 0 */
+    /* Copy while the other buffer may still be transmitting; the bottom half also uses remote DMA */
+    struct ne2000_tx_slot* tx = &tx_slots[slot];
+    uint32_t flags = irq_save();
     ne2000_set_page(0x00);
-    
-    /* Set transmit parameters */
-    uint8_t transmit_page = NE2000_STOP_PAGE - (size + NE2000_HEADER_SIZE + 255) / 256;
-    outb(ne2000_dev.base_port + NE2000_TRANSMIT_PAGE, transmit_page);
-    outb(ne2000_dev.base_port + NE2000_TRANSMIT_COUNT, size & 0xFF);
-    outb(ne2000_dev.base_port + NE2000_TRANSMIT_COUNT + 1, size >> 8);
-    
-    /* Set remote DMA for write */
-    ne2000_write_cr(NE2000_CMD_WRITE);
-    ne2000_write_remote_dma(size);
-    ne2000_write_remote_address(0);
-    
-    /* Write data */
-    const uint8_t* byte_data = (const uint8_t*)data;
-    for (uint32_t i = 0; i < size; i++) {
-        outb(ne2000_dev.base_port + NE2000_DATA_PORT, byte_data[i]);
+    if (!ne2000_block_output(data, tx->page << 8, size)) {
+        tx->state = TX_FREE;
+        ne2000_dev.tx_errors++;
+        irq_restore(flags);
+        return 0;
     }
     
-    /* Start transmission */
-    ne2000_write_cr(NE2000_CMD_TRANSMIT);
+    tx->size = size;
+    tx->state = TX_READY;
+    if (tx_active < 0) {
+        ne2000_tx_start(slot);
+    }
+    irq_restore(flags);
     
-    /* Wait for transmission complete */
-    uint32_t timeout = 10000;
-    while (timeout--) {
-        uint8_t status = inb(ne2000_dev.base_port + NE2000_INTERRUPT_STATUS);
-        if (status & NE2000_INT_TX) {
-            outb(ne2000_dev.base_port + NE2000_INTERRUPT_STATUS, NE2000_INT_TX);
-            ne2000_dev.tx_packets++;
-            return size;
-        }
-        if (status & NE2000_INT_TXE) {
-            outb(ne2000_dev.base_port + NE2000_INTERRUPT_STATUS, NE2000_INT_TXE);
-            ne2000_dev.tx_errors++;
-            return 0;
+    return size;
+}
+
+/* Wait until every queued frame has gone out; returns 0 on timeout */
+static uint32_t ne2000_tx_flush(void) {
+    for (uint32_t timeout = NE2000_TX_TIMEOUT; timeout; timeout--) {
+        uint32_t flags = irq_save();
+        ne2000_tx_poll();
+        int idle = tx_active < 0;
+        irq_restore(flags);
+        if (idle) {
+            return 1;
         }
     }
-    
-    ne2000_dev.tx_errors++;
     return 0;
 }
 
@@ -267,36 +440,37 @@ static uint32_t ne2000_receive(void* data, uint32_t max_size) {
         return 0; /* No packets */
     }
     
-    /* Read packet header */
-    ne2000_write_cr(NE2000_CMD_READ);
-    ne2000_write_remote_dma(4);
-    ne2000_write_remote_address(current << 8);
-    
-    uint8_t header[4];
-    for (int i = 0; i < 4; i++) {
-        header[i] = inb(ne2000_dev.base_port + NE2000_DATA_PORT);
-    }
+    /* Read packet header: receive status, next page, then length including the header */
+    uint8_t header[NE2000_HEADER_SIZE];
+    ne2000_block_input(header, current << 8, NE2000_HEADER_SIZE);
     
-    uint16_t status = (header[1] << 8) | header[0];
-    uint16_t next_page = header[2];
-    uint16_t packet_size = (header[3] << 8) | header[2];
+    uint16_t status = header[0];
+    uint8_t next_page = header[1];
+    uint16_t length = (header[3] << 8) | header[2];
+    uint16_t packet_size = length > NE2000_HEADER_SIZE ? length - NE2000_HEADER_SIZE : 0;
     
     if (packet_size > max_size) {
         packet_size = max_size;
     }
     
-    /* Read packet data */
-    ne2000_write_remote_dma(packet_size);
-    ne2000_write_remote_address((current << 8) + 4);
-    
+    /* Read packet data, in two pieces if it wraps past the end of the ring */
+    uint16_t addr = (current << 8) + NE2000_HEADER_SIZE;
+    uint16_t ring_left = (NE2000_STOP_PAGE << 8) - addr;
     uint8_t* byte_data = (uint8_t*)data;
-    for (uint16_t i = 0; i < packet_size; i++) {
-        byte_data[i] = inb(ne2000_dev.base_port + NE2000_DATA_PORT);
+    if (packet_size > ring_left) {
+        ne2000_block_input(byte_data, addr, ring_left);
+        ne2000_block_input(byte_data + ring_left, NE2000_START_PAGE << 8, packet_size - ring_left);
+    } else {
+        ne2000_block_input(byte_data, addr, packet_size);
     }
     
-    /* Update current page */
+    /* Update current page; the boundary trails it by one page */
     ne2000_dev.current_page = next_page;
-    outb(ne2000_dev.base_port + NE2000_BOUNDARY, next_page - 1);
+    uint8_t boundary_page = next_page - 1;
+    if (boundary_page < NE2000_START_PAGE) {
+        boundary_page = NE2000_STOP_PAGE - 1;
+    }
+    outb(ne2000_dev.base_port + NE2000_BOUNDARY, boundary_page);
     
     if (status & 0x01) {
         ne2000_dev.rx_packets++;
@@ -307,37 +481,96 @@ static uint32_t ne2000_receive(void* data, uint32_t max_size) {
     return packet_size;
 }
 
-/* NE2000 interrupt handler */
-static __attribute__((used)) void ne2000_interrupt_handler(void) {
-    uint8_t status = inb(ne2000_dev.base_port + NE2000_INTERRUPT_STATUS);
+/* NE2000 top half: acknowledge the card, mask receive interrupts and defer the work */
+static void ne2000_interrupt_handler(void) {
+    uint8_t isr = inb(ne2000_dev.base_port + NE2000_INTERRUPT_STATUS);
     
-    if (status & NE2000_INT_RX) {
-        /* Packet received */
-        outb(ne2000_dev.base_port + NE2000_INTERRUPT_STATUS, NE2000_INT_RX);
+    /* Transmit done: free the buffer and start the next queued frame */
+    uint8_t status = isr & NE2000_TX_INTS;
+    if (status) {
+        outb(ne2000_dev.base_port + NE2000_INTERRUPT_STATUS, status);
+        ne2000_tx_complete(status);
     }
     
-    if (status & NE2000_INT_TX) {
-        /* Packet transmitted */
-        outb(ne2000_dev.base_port + NE2000_INTERRUPT_STATUS, NE2000_INT_TX);
+    status = isr & NE2000_RX_INTS;
+    if (status) {
+        outb(ne2000_dev.base_port + NE2000_INTERRUPT_STATUS, status);
+        ne2000_dev.irq_status |= status;
+        ne2000_dev.rx_interrupts++;
+        
+        /* Further frames are picked up by polling until the ring is empty */
+        ne2000_write_imr(NE2000_TX_INTS);
+        ne2000_dev.polling = 1;
+        raise_softirq(SOFTIRQ_NET_RX);
     }
+}
+
+/* NE2000 bottom half: polls frames off the card a budget at a time */
+static void ne2000_rx_action(void) {
+    __asm__ __volatile__("cli" : : : "memory");
+    uint8_t status = ne2000_dev.irq_status;
+    ne2000_dev.irq_status = 0;
+    __asm__ __volatile__("sti" : : : "memory");
     
-    if (status & NE2000_INT_RXE) {
-        /* Receive error */
-        outb(ne2000_dev.base_port + NE2000_INTERRUPT_STATUS, NE2000_INT_RXE);
+    if (status & (NE2000_INT_RXE | NE2000_INT_OVW)) {
         ne2000_dev.rx_errors++;
     }
+    ne2000_dev.rx_polls++;
     
-    if (status & NE2000_INT_TXE) {
-        /* Transmit error */
-        outb(ne2000_dev.base_port + NE2000_INTERRUPT_STATUS, NE2000_INT_TXE);
-        ne2000_dev.tx_errors++;
+    uint32_t budget = NE2000_POLL_BUDGET;
+    while (budget) {
+        /* Queue full: the frames wait in the card's ring and ne2000_read resumes polling */
+        if (rx_queue_head - rx_queue_tail >= NE2000_RX_QUEUE) {
+            return;
+        }
+        struct ne2000_frame* frame = &rx_queue[rx_queue_head % NE2000_RX_QUEUE];
+        frame->size = ne2000_receive(frame->data, sizeof(frame->data));
+        if (frame->size == 0) {
+            break;
+        }
+        rx_queue_head++;
+        budget--;
     }
+    
+    if (budget == 0) {
+        /* Still busy: go round again, letting other bottom halves and the idle loop run */
+        raise_softirq(SOFTIRQ_NET_RX);
+        return;
+    }
+    
+    /* Drained; a frame that landed meanwhile raises its ISR bit and interrupts on unmask */
+    __asm__ __volatile__("cli" : : : "memory");
+    ne2000_dev.polling = 0;
+    ne2000_write_imr(NE2000_RX_INTS | NE2000_TX_INTS);
+    __asm__ __volatile__("sti" : : : "memory");
 }
 
 /* NE2000 device driver interface functions */
 static __attribute__((used)) uint32_t ne2000_read(uint32_t device_id, void* buffer, uint32_t size) {
     (void)device_id; /* Suppress unused warning */
-    return ne2000_receive(buffer, size);
+    
+    /* Frames already pulled off by the bottom half come first */
+    if (rx_queue_tail != rx_queue_head) {
+        struct ne2000_frame* frame = &rx_queue[rx_queue_tail % NE2000_RX_QUEUE];
+        uint32_t copy = frame->size < size ? frame->size : size;
+        uint8_t* dest = (uint8_t*)buffer;
+        for (uint32_t i = 0; i < copy; i++) {
+            dest[i] = frame->data[i];
+        }
+        rx_queue_tail++;
+        
+        /* The bottom half may have stopped on a full queue */
+        if (ne2000_dev.polling) {
+            raise_softirq(SOFTIRQ_NET_RX);
+        }
+        return copy;
+    }
+    
+    /* Keep the bottom half off the remote DMA channel while polling it here */
+    uint32_t flags = irq_save();
+    uint32_t received = ne2000_receive(buffer, size);
+    irq_restore(flags);
+    return received;
 }
 
 static __attribute__((used)) uint32_t ne2000_write(uint32_t device_id, const void* buffer, uint32_t size) {
@@ -366,6 +599,13 @@ static __attribute__((used)) uint32_t ne2000_ioctl(uint32_t device_id, uint32_t
                 stats[3] = ne2000_dev.tx_errors;
             }
             return 1;
+        case 3: /* Get receive interrupt and poll counts */
+            if (arg) {
+                uint32_t* stats = (uint32_t*)arg;
+                stats[0] = ne2000_dev.rx_interrupts;
+                stats[1] = ne2000_dev.rx_polls;
+            }
+            return 1;
         default:
             return 0;
     }
@@ -384,6 +624,11 @@ uint32_t ne2000_register_device(uint16_t base_port, uint16_t irq) {
     return 1;
 }
 
+/* Queue one frame for transmission; returns its size, or 0 when it was refused */
+uint32_t ne2000_send(const void* data, uint32_t size) {
+    return ne2000_transmit(data, size);
+}
+
 /* NE2000 test functions */
 uint32_t ne2000_test_loopback(void) {
     uint8_t test_packet[] = {
@@ -397,8 +642,9 @@ uint32_t ne2000_test_loopback(void) {
         0x12, 0x34, 0x56, 0x78 /* Test data */
     };
     
+    uint32_t errors = ne2000_dev.tx_errors;
     uint32_t sent = ne2000_transmit(test_packet, sizeof(test_packet));
-    if (sent != sizeof(test_packet)) {
+    if (sent != sizeof(test_packet) || !ne2000_tx_flush() || ne2000_dev.tx_errors != errors) {
         return 0;
     }
     
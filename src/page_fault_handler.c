@@ -42,6 +42,32 @@ static void terminal_writehex(uint32_t value);
 
 /* External functions */
 void process_kill(uint32_t pid);
+int paging_handle_fault(uint32_t faulting_address, uint32_t error_code);
+
+/* Tracepoints (trace.c) (must match the event numbers there) */
+#define TRACE_PAGE_FAULT 7
+extern void trace_record(uint32_t event, uint32_t arg0, uint32_t arg1, uint32_t arg2);
+
+/* A NOP until trace_start patches in a jump to the call; -DNO_TRACEPOINTS leaves no site */
+#ifdef NO_TRACEPOINTS
+#define TRACEPOINT(event, arg0, arg1, arg2) do { (void)(arg0); (void)(arg1); (void)(arg2); } while (0)
+#else
+static inline __attribute__((always_inline)) int tracepoint_on(uint32_t event) {
+    __asm__ goto("1: .byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n\t"
+                 ".pushsection __tracepoints, \"aw\"\n\t"
+                 ".long 1b, %l[on], %c0\n\t"
+                 ".popsection" : : "i"(event) : : on);
+    return 0;
+on:
+    return 1;
+}
+
+#define TRACEPOINT(event, arg0, arg1, arg2) do {                     \
+    if (__builtin_expect(tracepoint_on(event), 0)) {                 \
+        trace_record(event, arg0, arg1, arg2);                       \
+    }                                                                \
+} while (0)
+#endif
 
 /* Put a character */
 static void terminal_putchar(char c) {
@@ -90,6 +116,13 @@ static void terminal_writehex(uint32_t value) {
 
 /* Page fault handler */
 void page_fault_handler_c(uint32_t faulting_address, uint32_t error_code) {
+    TRACEPOINT(TRACE_PAGE_FAULT, faulting_address, error_code, 0);
+    
+    /* Demand faults and pages back from zram are resolved silently, and the access is retried */
+    if (paging_handle_fault(faulting_address, error_code)) {
+        return;
+    }
+    
     terminal_writestring("PAGE FAULT!\n");
     terminal_writestring("Faulting address: ");
     terminal_writehex(faulting_address);
@@ -0,0 +1,823 @@
+/*
+ * Tiny Operating System - PCI Bus
+ * Configuration access by mechanism #1, or by ECAM where the ACPI MCFG
+ * table gives one; enumeration of every function behind the host
+ * bridges and PCI-PCI bridges, with each BAR sized; BAR mapping with the
+ * caching a device register needs; drivers bound to what was found by
+ * vendor and device ID; and MSI and MSI-X, which send a device's
+ * interrupts to a vector and CPU of the driver's choosing.
+ */
+
+#include <stdint.h>
+
+/* Configuration mechanism #1 ports */
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+#define PCI_ENABLE 0x80000000u
+
+/* Configuration header offsets */
+#define PCI_VENDOR_ID 0x00
+#define PCI_COMMAND 0x04
+#define PCI_STATUS 0x06
+#define PCI_CLASS_REVISION 0x08         /* Class, subclass, prog IF, revision from the top byte down */
+#define PCI_HEADER_TYPE 0x0E
+#define PCI_BAR0 0x10
+#define PCI_SECONDARY_BUS 0x19          /* Type 1 headers: the bus behind a PCI-PCI bridge */
+#define PCI_CAPABILITIES 0x34
+#define PCI_INTERRUPT_LINE 0x3C
+#define PCI_HEADER_MULTIFUNCTION 0x80
+#define PCI_HEADER_LAYOUT 0x7F
+#define PCI_HEADER_BRIDGE 0x01
+
+/* Command register bits */
+#define PCI_COMMAND_IO 0x0001
+#define PCI_COMMAND_MEMORY 0x0002
+#define PCI_COMMAND_MASTER 0x0004
+#define PCI_COMMAND_INTX_DISABLE 0x0400
+#define PCI_STATUS_CAPABILITIES 0x0010
+
+/* Capabilities */
+#define PCI_CAP_MSI 0x05
+#define PCI_CAP_MSIX 0x11
+#define PCI_MSI_CONTROL 2
+#define PCI_MSI_ENABLE 0x0001
+#define PCI_MSI_MULTIPLE 0x0070         /* Messages enabled, as a power of two */
+#define PCI_MSI_64BIT 0x0080
+#define PCI_MSI_ADDRESS 4
+#define PCI_MSIX_ENABLE 0x8000
+#define PCI_MSIX_FUNCTION_MASK 0x4000
+#define PCI_MSIX_TABLE_SIZE 0x07FF
+#define PCI_MSIX_TABLE 4                /* Offset into the BAR, with the BAR index in the low three bits */
+#define PCI_MSIX_ENTRY_SIZE 16
+#define PCI_MSIX_ENTRY_DATA 8
+#define PCI_MSIX_ENTRY_CONTROL 12
+#define PCI_MSIX_ENTRY_MASKED 0x1
+
+/* A message to a local APIC: fixed delivery, edge triggered, physical destination */
+#define MSI_ADDRESS_BASE 0xFEE00000u
+#define MSI_ADDRESS_DEST_SHIFT 12
+
+/* BAR low bits */
+#define PCI_BAR_SPACE_IO 0x1
+#define PCI_BAR_TYPE_64 0x4
+#define PCI_BAR_PREFETCH_BIT 0x8
+
+#define PCI_BUSES 256
+#define PCI_SLOTS 32
+#define PCI_FUNCTIONS 8
+#define PCI_MAX_DEVICES 64
+#define PCI_MAX_DRIVERS 16
+#define PCI_BARS 6
+#define PCI_ANY_ID 0xFFFF
+
+/* pci_bar_info flags (must match the users' copies) */
+#define PCI_BAR_IO 0x1
+#define PCI_BAR_PREFETCH 0x2
+#define PCI_BAR_64 0x4
+#define PCI_BAR_HIGH 0x8                /* Placed above 4GB: out of reach without PAE */
+
+/* Caching asked of a mapper (must match the users' copies) */
+#define PCI_MAP_UNCACHED 0
+#define PCI_MAP_WRITE_COMBINE 1
+
+/* MTRRs */
+#define MSR_MTRRCAP 0xFE
+#define MSR_MTRR_DEF_TYPE 0x2FF
+#define MSR_MTRR_PHYSBASE0 0x200
+#define MTRRCAP_VCNT 0xFF
+#define MTRRCAP_WC 0x400
+#define MTRR_DEF_ENABLE 0x800
+#define MTRR_MASK_VALID 0x800
+#define MTRR_TYPE_UC 0x00
+#define MTRR_TYPE_WC 0x01
+#define CR0_CD 0x40000000u
+#define CR0_NW 0x20000000u
+
+/* ACPI tables (must match smp.c) */
+struct acpi_rsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+} __attribute__((packed));
+
+struct acpi_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+/* One MCFG allocation: a 1MB window per bus from start_bus to end_bus */
+struct acpi_mcfg_entry {
+    uint64_t base;
+    uint16_t segment;
+    uint8_t start_bus;
+    uint8_t end_bus;
+    uint32_t reserved;
+} __attribute__((packed));
+
+/* A sized BAR; base is an I/O port or a physical address, 0 when unimplemented */
+struct pci_bar_info {
+    uint32_t base;
+    uint32_t size;
+    uint32_t flags;
+};
+
+/* One function found by pci_enumerate (must match the users' copies) */
+struct pci_device {
+    uint32_t address;                   /* The handle the config accessors take */
+    uint16_t vendor;
+    uint16_t device_id;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint8_t irq;
+    struct pci_bar_info bars[PCI_BARS];
+    const struct pci_driver* driver;
+};
+
+/* Bound to each function whose IDs match; PCI_ANY_ID matches any. probe returns 0 when it took the device */
+struct pci_driver {
+    const char* name;
+    uint16_t vendor;
+    uint16_t device_id;
+    int (*probe)(struct pci_device* dev);
+};
+
+static volatile uint8_t* pci_ecam;      /* Segment 0's window, from bus 0; NULL for mechanism #1 only */
+static uint32_t pci_ecam_start;
+static uint32_t pci_ecam_end;
+static int pci_ecam_probed;
+
+static struct pci_device pci_devices[PCI_MAX_DEVICES];
+static uint32_t pci_device_total;
+static int pci_enumerated;
+static uint8_t pci_bus_seen[PCI_BUSES / 8];
+
+static struct pci_driver* pci_drivers[PCI_MAX_DRIVERS];
+static uint32_t pci_driver_count;
+
+/* Maps size bytes at phys with the caching asked; NULL when paging is not in charge and memory is identity mapped */
+static void* (*pci_mapper)(uint32_t phys, uint32_t size, uint32_t cache);
+
+/* Function prototypes */
+uint32_t pci_config_read32(uint32_t device, uint8_t offset);
+void pci_config_write32(uint32_t device, uint8_t offset, uint32_t value);
+uint16_t pci_config_read16(uint32_t device, uint8_t offset);
+void pci_config_write16(uint32_t device, uint8_t offset, uint16_t value);
+uint32_t pci_find_device(uint16_t vendor, uint16_t device_id);
+uint32_t pci_find_class(uint8_t class_code, uint8_t subclass);
+uint32_t pci_bar(uint32_t device, uint32_t index);
+uint8_t pci_interrupt_line(uint32_t device);
+void pci_enable_device(uint32_t device);
+uint32_t pci_enumerate(void);
+uint32_t pci_device_count(void);
+struct pci_device* pci_get_device(uint32_t index);
+int pci_ecam_enabled(void);
+void* pci_map_bar(uint32_t device, uint32_t index);
+void pci_set_mapper(void* (*map)(uint32_t phys, uint32_t size, uint32_t cache));
+int pci_register_driver(struct pci_driver* driver);
+uint8_t pci_find_capability(uint32_t device, uint8_t id);
+int pci_enable_msi(uint32_t device, uint32_t vector, uint32_t apic_id);
+void pci_disable_msi(uint32_t device);
+uint32_t pci_msix_count(uint32_t device);
+int pci_enable_msix(uint32_t device, uint32_t entry, uint32_t vector, uint32_t apic_id);
+void pci_disable_msix(uint32_t device);
+
+/* Port I/O functions */
+static inline void outl(uint16_t port, uint32_t value) {
+    __asm__ __volatile__("outl %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t ret;
+    __asm__ __volatile__("inl %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t low, high;
+    __asm__ __volatile__("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ __volatile__("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* edx) {
+    uint32_t ebx, ecx;
+    __asm__ __volatile__("cpuid" : "=a"(*eax), "=b"(ebx), "=c"(ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+/* A device handle is its bus/slot/function in CONFIG_ADDRESS layout */
+static uint32_t pci_address(uint32_t bus, uint32_t slot, uint32_t function) {
+    return PCI_ENABLE | (bus << 16) | (slot << 11) | (function << 8);
+}
+
+static int pci_signature(const char* a, const char* b, uint32_t size) {
+    for (uint32_t i = 0; i < size; i++) {
+        if (a[i] != b[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static uint8_t pci_checksum(const void* data, uint32_t length) {
+    const uint8_t* bytes = data;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        sum += bytes[i];
+    }
+    return sum;
+}
+
+/* Read a word from the BIOS data area (asm keeps GCC from treating page 0 as null) */
+static inline uint16_t bios_read16(uint32_t addr) {
+    uint16_t value;
+    __asm__ __volatile__("movw (%1), %0" : "=r"(value) : "r"(addr));
+    return value;
+}
+
+/* The RSDP in the EBDA or the BIOS ROM area, as smp.c finds it */
+static struct acpi_rsdp* pci_find_rsdp(void) {
+    static const uint32_t areas[3][2] = {{0, 1024}, {0x9FC00, 1024}, {0xE0000, 0x20000}};
+    for (uint32_t i = 0; i < 3; i++) {
+        uint32_t start = i ? areas[i][0] : (uint32_t)bios_read16(0x40E) << 4;
+        if (!start) {
+            continue;
+        }
+        for (uint32_t addr = start; addr + 8 <= start + areas[i][1]; addr += 16) {
+            struct acpi_rsdp* rsdp = (struct acpi_rsdp*)addr;
+            if (pci_signature(rsdp->signature, "RSD PTR ", 8) && !pci_checksum(rsdp, sizeof(*rsdp))) {
+                return rsdp;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Take segment 0's ECAM window from the MCFG, if firmware has one. Only
+ * the first call looks: config access before it goes through the ports.
+ * A window above 4GB is out of reach and left to mechanism #1.
+ */
+static void pci_ecam_init(void) {
+    pci_ecam_probed = 1;
+    struct acpi_rsdp* rsdp = pci_find_rsdp();
+    if (!rsdp) {
+        return;
+    }
+    struct acpi_header* rsdt = (struct acpi_header*)rsdp->rsdt_address;
+    if (!pci_signature(rsdt->signature, "RSDT", 4)) {
+        return;
+    }
+    uint32_t table_count = (rsdt->length - sizeof(struct acpi_header)) / 4;
+    uint32_t* tables = (uint32_t*)(rsdt + 1);
+    for (uint32_t i = 0; i < table_count; i++) {
+        struct acpi_header* mcfg = (struct acpi_header*)tables[i];
+        if (!pci_signature(mcfg->signature, "MCFG", 4) || pci_checksum(mcfg, mcfg->length)) {
+            continue;
+        }
+        /* Eight reserved bytes follow the header */
+        struct acpi_mcfg_entry* entry = (struct acpi_mcfg_entry*)((uint8_t*)(mcfg + 1) + 8);
+        struct acpi_mcfg_entry* end = (struct acpi_mcfg_entry*)((uint8_t*)mcfg + mcfg->length);
+        for (; entry + 1 <= end; entry++) {
+            if (entry->segment == 0 && entry->base && !(entry->base >> 32) && entry->start_bus <= entry->end_bus) {
+                pci_ecam_start = entry->start_bus;
+                pci_ecam_end = entry->end_bus;
+                pci_ecam = (volatile uint8_t*)(uint32_t)entry->base;
+                return;
+            }
+        }
+    }
+}
+
+/* The ECAM dword for device and offset, or NULL when its bus is outside the window */
+static volatile uint32_t* pci_ecam_dword(uint32_t device, uint8_t offset) {
+    uint32_t bus = (device >> 16) & 0xFF;
+    if (!pci_ecam || bus < pci_ecam_start || bus > pci_ecam_end) {
+        return 0;
+    }
+    /* Bus, slot and function sit in the handle in the order ECAM wants them, 12 bits further up */
+    return (volatile uint32_t*)(pci_ecam + (((device >> 8) & 0xFFFF) << 12) + (offset & 0xFC));
+}
+
+uint32_t pci_config_read32(uint32_t device, uint8_t offset) {
+    volatile uint32_t* ecam = pci_ecam_dword(device, offset);
+    if (ecam) {
+        return *ecam;
+    }
+    outl(PCI_CONFIG_ADDRESS, device | (offset & 0xFC));
+    return inl(PCI_CONFIG_DATA);
+}
+
+void pci_config_write32(uint32_t device, uint8_t offset, uint32_t value) {
+    volatile uint32_t* ecam = pci_ecam_dword(device, offset);
+    if (ecam) {
+        *ecam = value;
+        return;
+    }
+    outl(PCI_CONFIG_ADDRESS, device | (offset & 0xFC));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+uint16_t pci_config_read16(uint32_t device, uint8_t offset) {
+    return (uint16_t)(pci_config_read32(device, offset) >> ((offset & 2) * 8));
+}
+
+/* Read-modify-write of the containing dword */
+void pci_config_write16(uint32_t device, uint8_t offset, uint16_t value) {
+    uint32_t shift = (offset & 2) * 8;
+    uint32_t dword = pci_config_read32(device, offset);
+    dword = (dword & ~(0xFFFFu << shift)) | ((uint32_t)value << shift);
+    pci_config_write32(device, offset, dword);
+}
+
+/* First function whose config dword at offset matches value under mask, or 0 if there is none */
+static uint32_t pci_scan(uint8_t offset, uint32_t mask, uint32_t value) {
+    for (uint32_t bus = 0; bus < PCI_BUSES; bus++) {
+        for (uint32_t slot = 0; slot < PCI_SLOTS; slot++) {
+            uint32_t functions = 1;
+            for (uint32_t function = 0; function < functions; function++) {
+                uint32_t device = pci_address(bus, slot, function);
+                uint32_t id = pci_config_read32(device, PCI_VENDOR_ID);
+                if ((id & 0xFFFF) == 0xFFFF) {
+                    continue;
+                }
+                if (function == 0 &&
+                    (pci_config_read32(device, PCI_HEADER_TYPE) >> 16) & PCI_HEADER_MULTIFUNCTION) {
+                    functions = PCI_FUNCTIONS;
+                }
+                if ((pci_config_read32(device, offset) & mask) == value) {
+                    return device;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/* First function matching vendor and device ID, or 0 if there is none */
+uint32_t pci_find_device(uint16_t vendor, uint16_t device_id) {
+    if (pci_enumerated) {
+        for (uint32_t i = 0; i < pci_device_total; i++) {
+            if (pci_devices[i].vendor == vendor && pci_devices[i].device_id == device_id) {
+                return pci_devices[i].address;
+            }
+        }
+        return 0;
+    }
+    return pci_scan(PCI_VENDOR_ID, 0xFFFFFFFF, vendor | ((uint32_t)device_id << 16));
+}
+
+/* First function of a class and subclass, such as 0x01/0x01 for an IDE controller */
+uint32_t pci_find_class(uint8_t class_code, uint8_t subclass) {
+    if (pci_enumerated) {
+        for (uint32_t i = 0; i < pci_device_total; i++) {
+            if (pci_devices[i].class_code == class_code && pci_devices[i].subclass == subclass) {
+                return pci_devices[i].address;
+            }
+        }
+        return 0;
+    }
+    return pci_scan(PCI_CLASS_REVISION, 0xFFFF0000, ((uint32_t)class_code << 24) | ((uint32_t)subclass << 16));
+}
+
+/* Base address with the type bits stripped: an I/O port or a memory address */
+uint32_t pci_bar(uint32_t device, uint32_t index) {
+    uint32_t bar = pci_config_read32(device, PCI_BAR0 + index * 4);
+    return (bar & 1) ? (bar & ~0x3u) : (bar & ~0xFu);
+}
+
+uint8_t pci_interrupt_line(uint32_t device) {
+    return pci_config_read32(device, PCI_INTERRUPT_LINE) & 0xFF;
+}
+
+/* Turn on I/O and memory decoding and let the device master the bus for DMA */
+void pci_enable_device(uint32_t device) {
+    uint16_t command = pci_config_read16(device, PCI_COMMAND);
+    pci_config_write16(device, PCI_COMMAND, command | PCI_COMMAND_IO | PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER);
+}
+
+/*
+ * Size BAR index by writing all ones and reading back which bits stick,
+ * with decoding off meanwhile so the device does not answer at the probe
+ * address. Returns the BAR slots it took: two for a 64-bit BAR.
+ */
+static uint32_t pci_size_bar(uint32_t device, uint32_t index, struct pci_bar_info* info) {
+    uint8_t offset = (uint8_t)(PCI_BAR0 + index * 4);
+    uint32_t bar = pci_config_read32(device, offset);
+    uint32_t is_64 = !(bar & PCI_BAR_SPACE_IO) && (bar & 0x6) == PCI_BAR_TYPE_64 && index + 1 < PCI_BARS;
+    uint16_t command = pci_config_read16(device, PCI_COMMAND);
+    pci_config_write16(device, PCI_COMMAND, command & ~(PCI_COMMAND_IO | PCI_COMMAND_MEMORY));
+    pci_config_write32(device, offset, 0xFFFFFFFF);
+    uint32_t mask = pci_config_read32(device, offset);
+    pci_config_write32(device, offset, bar);
+    uint32_t high = 0;
+    uint32_t high_mask = 0xFFFFFFFF;
+    if (is_64) {
+        high = pci_config_read32(device, offset + 4);
+        pci_config_write32(device, offset + 4, 0xFFFFFFFF);
+        high_mask = pci_config_read32(device, offset + 4);
+        pci_config_write32(device, offset + 4, high);
+    }
+    pci_config_write16(device, PCI_COMMAND, command);
+
+    info->base = 0;
+    info->size = 0;
+    info->flags = 0;
+    if (bar & PCI_BAR_SPACE_IO) {
+        /* I/O BARs may leave the top half reading 0 */
+        mask = (mask & ~0x3u) | 0xFFFF0000;
+        info->flags = PCI_BAR_IO;
+        info->base = bar & ~0x3u;
+    } else {
+        mask &= ~0xFu;
+        info->flags = (bar & PCI_BAR_PREFETCH_BIT) ? PCI_BAR_PREFETCH : 0;
+        info->base = bar & ~0xFu;
+        if (is_64) {
+            info->flags |= PCI_BAR_64;
+            if (high) {
+                info->flags |= PCI_BAR_HIGH;
+            }
+        }
+    }
+    /* A BAR that keeps no bits, or one wider than 4GB, is left unsized */
+    if (mask && (!is_64 || high_mask == 0xFFFFFFFF)) {
+        info->size = ~mask + 1;
+    } else {
+        info->base = 0;
+    }
+    return is_64 ? 2 : 1;
+}
+
+static void pci_add_function(uint32_t bus, uint32_t slot, uint32_t function);
+
+/* Every function on bus, and the buses behind its bridges; a bus is walked once */
+static void pci_enumerate_bus(uint32_t bus) {
+    if (pci_bus_seen[bus / 8] & (1u << (bus % 8))) {
+        return;
+    }
+    pci_bus_seen[bus / 8] |= (uint8_t)(1u << (bus % 8));
+    for (uint32_t slot = 0; slot < PCI_SLOTS; slot++) {
+        uint32_t device = pci_address(bus, slot, 0);
+        if ((pci_config_read32(device, PCI_VENDOR_ID) & 0xFFFF) == 0xFFFF) {
+            continue;
+        }
+        uint32_t functions = (pci_config_read32(device, PCI_HEADER_TYPE) >> 16) & PCI_HEADER_MULTIFUNCTION
+                                 ? PCI_FUNCTIONS : 1;
+        for (uint32_t function = 0; function < functions; function++) {
+            pci_add_function(bus, slot, function);
+        }
+    }
+}
+
+static void pci_add_function(uint32_t bus, uint32_t slot, uint32_t function) {
+    uint32_t device = pci_address(bus, slot, function);
+    uint32_t id = pci_config_read32(device, PCI_VENDOR_ID);
+    if ((id & 0xFFFF) == 0xFFFF) {
+        return;
+    }
+    uint32_t layout = (pci_config_read32(device, PCI_HEADER_TYPE) >> 16) & PCI_HEADER_LAYOUT;
+    if (pci_device_total < PCI_MAX_DEVICES) {
+        struct pci_device* dev = &pci_devices[pci_device_total++];
+        uint32_t class = pci_config_read32(device, PCI_CLASS_REVISION);
+        dev->address = device;
+        dev->vendor = (uint16_t)id;
+        dev->device_id = (uint16_t)(id >> 16);
+        dev->class_code = (uint8_t)(class >> 24);
+        dev->subclass = (uint8_t)(class >> 16);
+        dev->prog_if = (uint8_t)(class >> 8);
+        dev->irq = pci_interrupt_line(device);
+        dev->driver = 0;
+
+        /* A bridge has two BARs ahead of its bus numbers; other layouts have none worth sizing */
+        uint32_t bars = layout == 0 ? PCI_BARS : layout == PCI_HEADER_BRIDGE ? 2 : 0;
+        for (uint32_t i = 0; i < PCI_BARS; i++) {
+            dev->bars[i].base = 0;
+            dev->bars[i].size = 0;
+            dev->bars[i].flags = 0;
+        }
+        for (uint32_t i = 0; i < bars;) {
+            i += pci_size_bar(device, i, &dev->bars[i]);
+        }
+    }
+    if (layout == PCI_HEADER_BRIDGE) {
+        uint32_t secondary = (pci_config_read32(device, PCI_SECONDARY_BUS) >> 8) & 0xFF;
+        if (secondary) {
+            pci_enumerate_bus(secondary);
+        }
+    }
+}
+
+/* Offer dev to each registered driver in turn until one takes it */
+static void pci_bind(struct pci_device* dev) {
+    for (uint32_t i = 0; i < pci_driver_count && !dev->driver; i++) {
+        struct pci_driver* driver = pci_drivers[i];
+        if ((driver->vendor == PCI_ANY_ID || driver->vendor == dev->vendor) &&
+            (driver->device_id == PCI_ANY_ID || driver->device_id == dev->device_id) && driver->probe(dev) == 0) {
+            dev->driver = driver;
+        }
+    }
+}
+
+/*
+ * Walk the buses from the host bridge down and rebuild the device table,
+ * then bind drivers to what was found. A multifunction host bridge at
+ * 00:00.0 means one root bus per function. Returns the functions found.
+ */
+uint32_t pci_enumerate(void) {
+    if (!pci_ecam_probed) {
+        pci_ecam_init();
+    }
+    pci_device_total = 0;
+    for (uint32_t i = 0; i < PCI_BUSES / 8; i++) {
+        pci_bus_seen[i] = 0;
+    }
+    uint32_t host = pci_address(0, 0, 0);
+    if ((pci_config_read32(host, PCI_HEADER_TYPE) >> 16) & PCI_HEADER_MULTIFUNCTION) {
+        for (uint32_t function = 0; function < PCI_FUNCTIONS; function++) {
+            if ((pci_config_read32(pci_address(0, 0, function), PCI_VENDOR_ID) & 0xFFFF) != 0xFFFF) {
+                pci_enumerate_bus(function);
+            }
+        }
+    } else {
+        pci_enumerate_bus(0);
+    }
+    pci_enumerated = 1;
+    for (uint32_t i = 0; i < pci_device_total; i++) {
+        pci_bind(&pci_devices[i]);
+    }
+    return pci_device_total;
+}
+
+uint32_t pci_device_count(void) {
+    return pci_device_total;
+}
+
+struct pci_device* pci_get_device(uint32_t index) {
+    return index < pci_device_total ? &pci_devices[index] : 0;
+}
+
+int pci_ecam_enabled(void) {
+    return pci_ecam != 0;
+}
+
+/* Add a driver and offer it the devices already found; -1 when the table is full */
+int pci_register_driver(struct pci_driver* driver) {
+    if (pci_driver_count == PCI_MAX_DRIVERS) {
+        return -1;
+    }
+    pci_drivers[pci_driver_count++] = driver;
+    for (uint32_t i = 0; i < pci_device_total; i++) {
+        pci_bind(&pci_devices[i]);
+    }
+    return 0;
+}
+
+/* Hand BAR mapping to paging; until then BARs are used where they are, at their physical address */
+void pci_set_mapper(void* (*map)(uint32_t phys, uint32_t size, uint32_t cache)) {
+    pci_mapper = map;
+}
+
+static uint32_t pci_phys_bits(void) {
+    uint32_t eax, edx;
+    cpuid(0x80000000, &eax, &edx);
+    if (eax < 0x80000008) {
+        return 36;
+    }
+    cpuid(0x80000008, &eax, &edx);
+    return eax & 0xFF;
+}
+
+/*
+ * Program a variable MTRR, by the SDM's sequence: caching off and caches
+ * flushed while the ranges change, so no line is held under the old type.
+ * Only this CPU's MTRRs change; the stages that map BARs this way run on
+ * one.
+ */
+static void pci_mtrr_write(uint32_t index, uint64_t base, uint64_t mask) {
+    uint32_t flags, cr0, cr3;
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    __asm__ __volatile__("mov %%cr0, %0" : "=r"(cr0));
+    __asm__ __volatile__("mov %0, %%cr0; wbinvd" : : "r"((cr0 | CR0_CD) & ~CR0_NW) : "memory");
+    __asm__ __volatile__("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3) : : "memory");
+    uint64_t def_type = rdmsr(MSR_MTRR_DEF_TYPE);
+    wrmsr(MSR_MTRR_DEF_TYPE, def_type & ~(uint64_t)MTRR_DEF_ENABLE);
+    wrmsr(MSR_MTRR_PHYSBASE0 + index * 2, base);
+    wrmsr(MSR_MTRR_PHYSBASE0 + index * 2 + 1, mask);
+    __asm__ __volatile__("wbinvd" : : : "memory");
+    __asm__ __volatile__("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3) : : "memory");
+    wrmsr(MSR_MTRR_DEF_TYPE, def_type);
+    __asm__ __volatile__("mov %0, %%cr0" : : "r"(cr0) : "memory");
+    __asm__ __volatile__("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+}
+
+/*
+ * Make the identity-mapped range [base, base + size) uncached or
+ * write-combining through the MTRRs. A BAR is a power of two aligned to
+ * its size, which is the shape a variable range takes. A range firmware
+ * already set over it is kept when it is as strict as asked; since UC
+ * wins where ranges overlap, an uncached range can always be laid over
+ * whatever is there, but write-combining over another range is
+ * undefined and falls back to uncached. 0 when no MTRR can be had.
+ */
+static int pci_mtrr_cover(uint32_t base, uint32_t size, uint32_t type) {
+    uint32_t eax, edx;
+    cpuid(1, &eax, &edx);
+    if (!(edx & (1u << 12))) {
+        return 0;
+    }
+    uint64_t cap = rdmsr(MSR_MTRRCAP);
+    uint64_t def_type = rdmsr(MSR_MTRR_DEF_TYPE);
+    if (!(def_type & MTRR_DEF_ENABLE) || (def_type & 0xFF) == type) {
+        return 1;                       /* Everything is UC with MTRRs off, or the default is already right */
+    }
+    if (size < 4096) {
+        base &= ~0xFFFu;                /* MTRRs go by pages; a neighbour's registers on the page must not combine */
+        size = 4096;
+        type = MTRR_TYPE_UC;
+    }
+    if (type == MTRR_TYPE_WC && !(cap & MTRRCAP_WC)) {
+        type = MTRR_TYPE_UC;
+    }
+
+    uint32_t count = cap & MTRRCAP_VCNT;
+    uint64_t phys_mask = ((uint64_t)1 << pci_phys_bits()) - 1;
+    uint64_t bar_mask = phys_mask & ~(uint64_t)(size - 1);
+    int free_index = -1;
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t mask = rdmsr(MSR_MTRR_PHYSBASE0 + i * 2 + 1);
+        if (!(mask & MTRR_MASK_VALID)) {
+            if (free_index < 0) {
+                free_index = (int)i;
+            }
+            continue;
+        }
+        uint64_t range = rdmsr(MSR_MTRR_PHYSBASE0 + i * 2);
+        uint32_t range_type = range & 0xFF;
+        mask &= phys_mask & ~0xFFFull;
+        range &= phys_mask & ~0xFFFull;
+        int contains = (base & mask) == (range & mask);
+        int inside = (range & bar_mask) == base;
+        if (!contains && !inside) {
+            continue;
+        }
+        if (contains && (range_type == MTRR_TYPE_UC || range_type == type)) {
+            return 1;
+        }
+        type = MTRR_TYPE_UC;
+    }
+    if (free_index < 0) {
+        return 0;
+    }
+    pci_mtrr_write((uint32_t)free_index, base | type, bar_mask | MTRR_MASK_VALID);
+    return 1;
+}
+
+/*
+ * A pointer to memory BAR index of device, set to be uncached, or
+ * write-combining when the BAR is prefetchable. NULL for an I/O BAR, an
+ * unimplemented one or one out of reach.
+ */
+void* pci_map_bar(uint32_t device, uint32_t index) {
+    struct pci_bar_info info;
+    if (index >= PCI_BARS) {
+        return 0;
+    }
+    pci_size_bar(device, index, &info);
+    if (!info.size || (info.flags & (PCI_BAR_IO | PCI_BAR_HIGH))) {
+        return 0;
+    }
+    uint32_t cache = (info.flags & PCI_BAR_PREFETCH) ? PCI_MAP_WRITE_COMBINE : PCI_MAP_UNCACHED;
+    if (pci_mapper) {
+        return pci_mapper(info.base, info.size, cache);
+    }
+    pci_mtrr_cover(info.base, info.size, cache == PCI_MAP_WRITE_COMBINE ? MTRR_TYPE_WC : MTRR_TYPE_UC);
+    return (void*)info.base;
+}
+
+/* Offset of the first capability with id in device's list, or 0 when it has none */
+uint8_t pci_find_capability(uint32_t device, uint8_t id) {
+    if (!(pci_config_read16(device, PCI_STATUS) & PCI_STATUS_CAPABILITIES)) {
+        return 0;
+    }
+    uint8_t offset = pci_config_read32(device, PCI_CAPABILITIES) & 0xFC;
+    /* The list lives in the 192 bytes past the header; a loop in it runs out of that bound */
+    for (uint32_t hops = 0; offset >= 0x40 && hops < 48; hops++) {
+        uint32_t header = pci_config_read32(device, offset);
+        if ((header & 0xFF) == id) {
+            return offset;
+        }
+        offset = (header >> 8) & 0xFC;
+    }
+    return 0;
+}
+
+/* INTx off while messages are on: a device that can use either must not raise both */
+static void pci_intx(uint32_t device, int enable) {
+    uint16_t command = pci_config_read16(device, PCI_COMMAND);
+    command = enable ? command & ~PCI_COMMAND_INTX_DISABLE : command | PCI_COMMAND_INTX_DISABLE;
+    pci_config_write16(device, PCI_COMMAND, command);
+}
+
+/*
+ * Have device signal vector on the CPU whose local APIC is apic_id with
+ * a single MSI message, in place of its INTx line. -1 when it has no MSI
+ * capability.
+ */
+int pci_enable_msi(uint32_t device, uint32_t vector, uint32_t apic_id) {
+    uint8_t cap = pci_find_capability(device, PCI_CAP_MSI);
+    if (!cap) {
+        return -1;
+    }
+    uint16_t control = pci_config_read16(device, cap + PCI_MSI_CONTROL);
+    pci_config_write16(device, cap + PCI_MSI_CONTROL, control & ~(PCI_MSI_ENABLE | PCI_MSI_MULTIPLE));
+    pci_config_write32(device, cap + PCI_MSI_ADDRESS, MSI_ADDRESS_BASE | (apic_id << MSI_ADDRESS_DEST_SHIFT));
+    uint8_t data = cap + PCI_MSI_ADDRESS + 4;
+    if (control & PCI_MSI_64BIT) {
+        pci_config_write32(device, data, 0);
+        data += 4;
+    }
+    pci_config_write16(device, data, (uint16_t)(vector & 0xFF));
+    pci_intx(device, 0);
+    pci_config_write16(device, cap + PCI_MSI_CONTROL, (control & ~PCI_MSI_MULTIPLE) | PCI_MSI_ENABLE);
+    return 0;
+}
+
+void pci_disable_msi(uint32_t device) {
+    uint8_t cap = pci_find_capability(device, PCI_CAP_MSI);
+    if (cap) {
+        uint16_t control = pci_config_read16(device, cap + PCI_MSI_CONTROL);
+        pci_config_write16(device, cap + PCI_MSI_CONTROL, control & ~PCI_MSI_ENABLE);
+        pci_intx(device, 1);
+    }
+}
+
+/* Messages device's MSI-X table holds, one per queue or event; 0 without MSI-X */
+uint32_t pci_msix_count(uint32_t device) {
+    uint8_t cap = pci_find_capability(device, PCI_CAP_MSIX);
+    return cap ? (pci_config_read16(device, cap + PCI_MSI_CONTROL) & PCI_MSIX_TABLE_SIZE) + 1u : 0;
+}
+
+/* The MSI-X table, mapped with the BAR it lives in */
+static volatile uint32_t* pci_msix_table(uint32_t device, uint8_t cap) {
+    uint32_t table = pci_config_read32(device, cap + PCI_MSIX_TABLE);
+    uint8_t* bar = pci_map_bar(device, table & 0x7);
+    return bar ? (volatile uint32_t*)(bar + (table & ~0x7u)) : 0;
+}
+
+/*
+ * Point MSI-X table entry at vector on the CPU whose local APIC is
+ * apic_id, and unmask it; MSI-X goes on with the first entry set, every
+ * other entry left masked until it is set too. A queue per entry, each
+ * steered to a CPU of its own, is what the table is for. -1 when the
+ * device has no such entry or its table cannot be mapped.
+ */
+int pci_enable_msix(uint32_t device, uint32_t entry, uint32_t vector, uint32_t apic_id) {
+    uint8_t cap = pci_find_capability(device, PCI_CAP_MSIX);
+    if (!cap || entry >= pci_msix_count(device)) {
+        return -1;
+    }
+    volatile uint32_t* table = pci_msix_table(device, cap);
+    if (!table) {
+        return -1;
+    }
+    uint16_t control = pci_config_read16(device, cap + PCI_MSI_CONTROL);
+    if (!(control & PCI_MSIX_ENABLE)) {
+        /* Enabled under the function mask, so no entry fires before it is written */
+        pci_config_write16(device, cap + PCI_MSI_CONTROL, control | PCI_MSIX_ENABLE | PCI_MSIX_FUNCTION_MASK);
+        uint32_t count = pci_msix_count(device);
+        for (uint32_t i = 0; i < count; i++) {
+            table[(i * PCI_MSIX_ENTRY_SIZE + PCI_MSIX_ENTRY_CONTROL) / 4] |= PCI_MSIX_ENTRY_MASKED;
+        }
+        pci_intx(device, 0);
+        control = (uint16_t)(control | PCI_MSIX_ENABLE);
+    }
+    volatile uint32_t* slot = table + entry * PCI_MSIX_ENTRY_SIZE / 4;
+    slot[PCI_MSIX_ENTRY_CONTROL / 4] |= PCI_MSIX_ENTRY_MASKED;
+    slot[0] = MSI_ADDRESS_BASE | (apic_id << MSI_ADDRESS_DEST_SHIFT);
+    slot[1] = 0;
+    slot[PCI_MSIX_ENTRY_DATA / 4] = vector & 0xFF;
+    slot[PCI_MSIX_ENTRY_CONTROL / 4] &= ~PCI_MSIX_ENTRY_MASKED;
+    pci_config_write16(device, cap + PCI_MSI_CONTROL, control & ~PCI_MSIX_FUNCTION_MASK);
+    return 0;
+}
+
+void pci_disable_msix(uint32_t device) {
+    uint8_t cap = pci_find_capability(device, PCI_CAP_MSIX);
+    if (cap) {
+        uint16_t control = pci_config_read16(device, cap + PCI_MSI_CONTROL);
+        pci_config_write16(device, cap + PCI_MSI_CONTROL, control & ~(PCI_MSIX_ENABLE | PCI_MSIX_FUNCTION_MASK));
+        pci_intx(device, 1);
+    }
+}
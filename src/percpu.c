@@ -0,0 +1,83 @@
+/*
+ * Tiny Operating System - Per-CPU Counters
+ * Event counters every path bumps: each CPU adds into its own cache line
+ * and only a reader, summing the lines, ever touches them all
+ */
+
+#include <stdint.h>
+
+#define MAX_CPUS 8                      /* Must match smp.c */
+#define CACHE_LINE_SIZE 64
+
+/* Counters (must match the users' copies) */
+#define PCPU_SYSCALLS 0
+#define PCPU_INTERRUPTS 1
+#define PCPU_PAGE_FAULTS 2
+#define PCPU_CONTEXT_SWITCHES 3
+#define PCPU_NET_RX_PACKETS 4
+#define PCPU_NET_TX_PACKETS 5
+#define PCPU_NET_RX_BYTES 6
+#define PCPU_NET_TX_BYTES 7
+#define PCPU_COUNTERS 8                 /* One cache line of 64-bit counters per CPU */
+
+/*
+ * A global counter bumped from every CPU moves its cache line on nearly
+ * every increment. Here each CPU writes only its own block, with
+ * interrupts off so it cannot be moved to another CPU between finding
+ * its block and the add; reads are rare and pay for the sum instead.
+ */
+struct percpu_block {
+    uint64_t counters[PCPU_COUNTERS];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct percpu_block percpu_blocks[MAX_CPUS];
+static uint32_t (*percpu_this_cpu)(void);
+
+/* Function prototypes */
+void percpu_init(uint32_t (*this_cpu)(void));
+void this_cpu_inc(uint32_t counter);
+void this_cpu_add(uint32_t counter, uint32_t amount);
+uint64_t percpu_counter_read(uint32_t counter);
+
+/* Until this is called, or with NULL, every count goes to CPU 0 */
+void percpu_init(uint32_t (*this_cpu)(void)) {
+    percpu_this_cpu = this_cpu;
+}
+
+void this_cpu_add(uint32_t counter, uint32_t amount) {
+    if (counter >= PCPU_COUNTERS) {
+        return;
+    }
+    uint32_t flags;
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    uint32_t cpu = percpu_this_cpu ? percpu_this_cpu() : 0;
+    percpu_blocks[cpu].counters[counter] += amount;
+    __asm__ __volatile__("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+}
+
+void this_cpu_inc(uint32_t counter) {
+    this_cpu_add(counter, 1);
+}
+
+/* One CPU's count; the halves are re-read until a carry is not caught between them */
+static uint64_t percpu_read_cpu(uint32_t cpu, uint32_t counter) {
+    volatile uint32_t* halves = (volatile uint32_t*)&percpu_blocks[cpu].counters[counter];
+    uint32_t high, low;
+    do {
+        high = halves[1];
+        low = halves[0];
+    } while (halves[1] != high);
+    return ((uint64_t)high << 32) | low;
+}
+
+/* The total over all CPUs; writers are never held up by it */
+uint64_t percpu_counter_read(uint32_t counter) {
+    if (counter >= PCPU_COUNTERS) {
+        return 0;
+    }
+    uint64_t total = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        total += percpu_read_cpu(cpu, counter);
+    }
+    return total;
+}
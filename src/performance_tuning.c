@@ -8,11 +8,60 @@
 
 /* Performance tuning constants */
 #define MAX_PROCESSES 64
+#define PROCESS_NAME_LEN 16
 #define TIME_QUANTUM_BASE 10
 #define CACHE_LINE_SIZE 64
 #define PAGE_SIZE 4096
 #define MEMORY_POOL_SIZE (1024 * 1024) /* 1MB memory pool */
 
+/* Segregated free list size classes: class n holds sizes [2^(n+6), 2^(n+7)) */
+#define SIZE_CLASS_MIN_SHIFT 6
+#define SIZE_CLASS_COUNT 15
+
+/* Slab allocator constants */
+#define SLAB_PAGE_COUNT 256            /* 1MB of pages reserved for slabs */
+#define KMEM_CACHE_MAX 16
+
+/* Per-CPU run queues */
+#define MAX_CPUS 8                     /* Must match smp.c */
+#define BALANCE_INTERVAL 32            /* Scheduler passes between load balancing */
+#define MIGRATION_HOT_THRESHOLD 8      /* Hotter tasks stay on their last CPU when balancing */
+#define AFFINITY_SCAN 4                /* Queue entries examined for a cache-hot task */
+
+/* Aging: every AGING_INTERVAL passes, promote queue heads waiting too long */
+#define AGING_INTERVAL 16
+#define STARVATION_THRESHOLD 1000000   /* Nanoseconds */
+
+/* Terminated processes reclaimed per scheduler pass */
+#define REAP_BATCH 4
+
+/* Frames the idle path may clear per scheduler pass */
+#define IDLE_ZERO_BUDGET 4
+
+/* MWAIT idle: CPUID leaves and bits, and how far ahead the timer wheel is searched */
+#define CPUID_FEATURES 1
+#define CPUID_ECX_MONITOR (1u << 3)
+#define CPUID_MWAIT 5
+#define CPUID_MWAIT_EXTENSIONS (1u << 0)
+#define IDLE_STATE_MAX 4
+#define IDLE_PREDICT_TICKS 1000
+#define IDLE_EXIT_LATENCY_MAX_US 200   /* Deepest wakeup the scheduler will wait out */
+
+/* Deadline class bandwidth, runtime / period in DL_BW_SHIFT fixed point */
+#define DL_BW_SHIFT 20
+#define DL_BW_LIMIT ((95u << DL_BW_SHIFT) / 100)  /* Share of each CPU deadline tasks may reserve */
+
+/* Workqueues */
+#define WQ_MAX 8                       /* Workqueues in the system */
+#define WQ_MAX_ACTIVE 4                /* Workers per CPU a workqueue may run items on at once */
+#define EFLAGS_IF 0x200
+
+/* Fair class */
+#define FAIR_RANK PRIORITY_NORMAL      /* MLFQ levels above this run ahead of fair tasks */
+#define FAIR_LATENCY_NS 6000000        /* Period in which every runnable fair task gets a turn */
+#define FAIR_MIN_GRANULARITY_NS 750000 /* Shortest run before a fair task can be preempted */
+#define FAIR_NICE_0 20                 /* Index of nice 0 in the weight tables */
+
 /* Process priority levels */
 typedef enum {
     PRIORITY_IDLE = 0,
@@ -32,22 +81,30 @@ typedef enum {
     STATE_TERMINATED
 } process_state_t;
 
+/* Saved kernel context; layout must match context_switch.asm */
+typedef struct {
+    uint32_t esp;          /* Kernel stack pointer at the last switch_to */
+    uint32_t cr3;          /* Page directory, or 0 to share the current one */
+    uint32_t esp0;         /* Kernel stack top loaded into the TSS */
+} cpu_context_t;
+
+struct pi_mutex;
+
 /* Optimized process control block */
-typedef struct __attribute__((aligned(CACHE_LINE_SIZE))) {
+typedef struct __attribute__((aligned(CACHE_LINE_SIZE))) process {
     uint32_t pid;
+    char name[PROCESS_NAME_LEN];       /* Cut to fit, NUL-terminated */
     process_state_t state;
-    process_priority_t priority;
+    process_priority_t priority;       /* Effective: base_priority or what it inherited */
+    process_priority_t base_priority;
     uint32_t time_quantum;
-    uint32_t cpu_time_used;
-    uint32_t last_scheduled;
+    uint64_t cpu_time_used;            /* Nanoseconds */
+    uint64_t last_scheduled;
     
     /* Register context */
-    uint32_t eax, ebx, ecx, edx, esi, edi, ebp;
-    uint32_t esp, eip;
-    uint32_t eflags;
+    cpu_context_t context;
     
     /* Memory management */
-    uint32_t page_directory;
     uint32_t stack_start;
     uint32_t stack_size;
     
@@ -62,37 +119,198 @@ typedef struct __attribute__((aligned(CACHE_LINE_SIZE))) {
     uint32_t cache_hotness;
     
     /* Scheduling info */
+    volatile uint32_t on_cpu;          /* Set from selection until its context is saved */
     uint32_t timeslice_remaining;
-    uint32_t total_runtime;
-    uint32_t wait_time;
-    uint32_t last_ready_time;
+    uint64_t total_runtime;
+    uint32_t wait_time;                /* Nanoseconds spent on the last wait */
+    uint64_t last_ready_time;
+    uint32_t aging_boost;              /* Levels priority was raised by aging; undone when it runs */
+    uint32_t rgroup;                   /* Resource group (rgroup.c); 0, the root, is unlimited */
+    
+    /* Deadline class, in nanoseconds; dl_period is 0 for MLFQ tasks */
+    uint64_t dl_runtime;               /* Budget per period */
+    uint64_t dl_deadline;              /* Relative to the start of each period */
+    uint64_t dl_period;
+    uint64_t dl_abs_deadline;
+    uint64_t dl_budget;                /* Runtime left before dl_abs_deadline */
+    uint32_t dl_bw;
+    
+    /* Fair class; fair_weight is 0 outside it */
+    uint64_t vruntime;                 /* Nanoseconds run, scaled by nice 0 weight / fair_weight */
+    uint64_t fair_slice_start;         /* total_runtime when last picked */
+    uint32_t fair_weight;
+    uint32_t fair_wmult;               /* 2^32 / fair_weight */
+    struct process* rb_parent;
+    struct process* rb_left;
+    struct process* rb_right;
+    uint32_t rb_red;
+    
+    /* Priority inheritance */
+    struct pi_mutex* blocked_on;
+    struct pi_mutex* pi_held;          /* Mutexes owned, linked through next_held */
+    struct process* next_waiter;
+    
+    /* First code run by the trampoline; NULL idles */
+    void (*entry)(void);
+    void* entry_data;                  /* What a kernel thread's entry works on */
     
     /* List management */
+    uint32_t rq_cpu;                   /* Run queue last pushed onto */
     struct process* next;
     struct process* prev;
 } process_t;
 
-/* Memory block header for optimized allocator */
+/* FIFO run queue for one priority level */
+typedef struct {
+    process_t* head;
+    process_t* tail;
+} run_queue_t;
+
+/* Ticket spinlock (spinlock.c) (must match struct spinlock there) */
+typedef struct spinlock {
+    union {
+        uint32_t tickets;
+        struct {
+            uint16_t owner;
+            uint16_t next;
+        };
+    };
+    uint32_t contended;
+} spinlock_t;
+
+/* Sequence lock (spinlock.c) (must match struct seqlock there) */
+typedef struct seqlock {
+    uint32_t sequence;
+    spinlock_t lock;
+} seqlock_t;
+
+/* Sleeping mutex whose owner inherits the priority of its best waiter */
+typedef struct pi_mutex {
+    spinlock_t wait_lock;
+    process_t* owner;
+    process_t* waiters;                /* Linked through next_waiter, newest first */
+    struct pi_mutex* next_held;
+} pi_mutex_t;
+
+/* Per-CPU MLFQ state; each CPU only takes another CPU's lock to migrate tasks */
+typedef struct __attribute__((aligned(CACHE_LINE_SIZE))) {
+    spinlock_t lock;
+    run_queue_t queues[PRIORITY_COUNT];
+    uint32_t ready_bitmap;             /* Bit n set if queues[n] is non-empty */
+    uint32_t nr_ready;
+    uint32_t schedule_calls;
+    process_t* current;
+    process_t* prev;                   /* Switched-out task awaiting finish_task_switch */
+    process_t* reap_list;              /* Terminated processes awaiting destruction */
+    cpu_context_t idle_context;        /* Context of the code that started scheduling here */
+    process_t* dl_ready;               /* Deadline tasks, earliest absolute deadline first */
+    process_t* dl_throttled;           /* Deadline tasks out of budget until their next period */
+    uint32_t dl_bw;                    /* Bandwidth admitted to this CPU's deadline tasks */
+    process_t* rg_throttled;           /* Tasks whose resource group has used its CPU quota */
+    process_t* fair_root;              /* Red-black tree of ready fair tasks by vruntime */
+    process_t* fair_leftmost;          /* Smallest vruntime, cached */
+    uint32_t fair_load;                /* Total weight in the tree */
+    uint64_t fair_min_vruntime;        /* Never decreases; where joining tasks start */
+} cpu_runqueue_t;
+
+/* Timer wheel entry (must match struct timer in timer_wheel.c) */
+struct timer {
+    struct timer* next;
+    struct timer** pprev;
+    uint32_t expires;
+    void (*callback)(void* data);
+    void* data;
+};
+
+struct workqueue;
+
+/* Deferred function call, embedded in what it works on; pending from queueing until it starts */
+typedef struct work {
+    struct work* next;
+    void (*func)(struct work* work);
+    uint32_t pending;
+} work_t;
+
+/* Work queued once its timer on the wheel fires */
+typedef struct delayed_work {
+    work_t work;
+    struct timer timer;
+    struct workqueue* wq;
+} delayed_work_t;
+
+/* One CPU's share of a workqueue: its items and the worker threads running them */
 typedef struct __attribute__((aligned(CACHE_LINE_SIZE))) {
+    spinlock_t lock;
+    work_t* head;
+    work_t** tail;
+    process_t* idle;                   /* Workers blocked for want of items, linked through next_waiter */
+    uint32_t nr_workers;               /* Started, at most the workqueue's max_active */
+    uint32_t nr_busy;                  /* Running an item */
+    volatile uint32_t kick;            /* Items were queued from an interrupt, with no worker woken */
+    uint32_t completed;
+    uint32_t cpu;
+    struct workqueue* wq;
+} wq_pool_t;
+
+typedef struct workqueue {
+    const char* name;
+    process_priority_t priority;
+    uint32_t max_active;
+    wq_pool_t pools[MAX_CPUS];
+} workqueue_t;
+
+/* Memory block header for optimized allocator */
+typedef struct __attribute__((aligned(CACHE_LINE_SIZE))) memory_block {
     uint32_t size;
     uint32_t flags;
     struct memory_block* next;
     struct memory_block* prev;
-    uint32_t padding[4]; /* Cache line alignment */
+    uint32_t prev_size;  /* Boundary tag: size of the physically preceding block */
+    uint32_t rgroup;     /* Resource group charged, and how much; 0 for none */
+    uint32_t charged;
+    uint32_t padding[1]; /* Cache line alignment */
 } memory_block_t;
 
 /* Memory pool management */
 typedef struct {
-    uint8_t pool[MEMORY_POOL_SIZE];
-    memory_block_t* free_list[PRIORITY_COUNT]; /* Per-priority free lists */
+    uint8_t pool[MEMORY_POOL_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
+    seqlock_t lock;                              /* Guards everything below; statistics readers go lockless */
+    memory_block_t* free_list[SIZE_CLASS_COUNT]; /* Per-size-class free lists */
+    uint32_t free_bitmap;                        /* Bit n set if free_list[n] is non-empty */
     uint32_t total_allocated;
     uint32_t total_freed;
-    uint32_t fragmentation_count;
+    uint32_t fragmentation_count;   /* Number of free blocks */
     uint32_t allocation_failures;
     uint32_t cache_hits;
     uint32_t cache_misses;
+    uint32_t high_water;                         /* End of the highest block ever handed out */
 } memory_pool_t;
 
+/* Slab header, stored at the start of each slab page */
+typedef struct slab {
+    struct slab* next;
+    struct slab* prev;
+    struct kmem_cache* cache;
+    void* free_objects;                /* Free objects linked through their first word */
+    uint32_t in_use;
+} slab_t;
+
+/* Object cache for fixed-size kernel objects */
+typedef struct kmem_cache {
+    const char* name;
+    uint32_t object_size;
+    uint32_t objects_per_slab;
+    uint32_t colour_next;              /* Colour offset of the next slab, in cache lines */
+    uint32_t colour_count;
+    void (*ctor)(void* object);
+    slab_t* slabs_partial;
+    slab_t* slabs_full;
+    slab_t* slabs_empty;
+    uint32_t total_slabs;
+    uint32_t total_allocs;
+    uint32_t total_frees;
+} kmem_cache_t;
+
 /* Scheduler statistics */
 typedef struct {
     uint32_t total_context_switches;
@@ -100,10 +318,41 @@ typedef struct {
     uint32_t idle_time;
     uint32_t starvation_preventions;
     uint32_t load_balance_ops;
-    uint64_t total_schedule_time;
-    uint32_t average_schedule_latency;
+    uint64_t total_schedule_time;       /* Nanoseconds */
+    uint32_t average_schedule_latency;  /* Nanoseconds */
+    uint32_t migrations_in[MAX_CPUS];   /* Tasks moved onto each CPU */
+    uint32_t migrations_out[MAX_CPUS];  /* Tasks moved off each CPU */
+    uint32_t hot_migrations;            /* Moved despite being cache-hot */
+    uint32_t affinity_hits;             /* Hot task picked ahead of the queue head */
+    uint32_t dl_throttles;              /* Deadline tasks that ran out of budget */
+    uint32_t dl_rejections;             /* Deadline requests refused by admission control */
+    uint32_t idle_states[IDLE_STATE_MAX];  /* Idle entries into each C-state */
 } scheduler_stats_t;
 
+/* A C-state MWAIT can enter */
+typedef struct {
+    const char* name;
+    uint32_t hint;                      /* MWAIT EAX: C-state minus one, then sub-state */
+    uint32_t exit_latency;              /* Microseconds to wake */
+    uint32_t target_residency;          /* Microseconds asleep before it saves more than C1 */
+} idle_state_t;
+
+/*
+ * What an idle CPU watches with MONITOR. Another CPU queueing it a task
+ * writes wake, which ends the MWAIT the way an IPI would end a HLT; the
+ * line holds nothing else, so no other write wakes it.
+ */
+typedef struct __attribute__((aligned(CACHE_LINE_SIZE))) {
+    volatile uint32_t wake;
+    volatile uint32_t polling;          /* In MWAIT; remote queueing must write wake */
+} cpu_idle_t;
+
+/* Each CPU counts into its own block, so the hot paths share no cache line; readers sum them */
+typedef struct __attribute__((aligned(CACHE_LINE_SIZE))) {
+    seqlock_t seq;
+    scheduler_stats_t stats;
+} sched_stats_cpu_t;
+
 /* Performance counters */
 typedef struct {
     uint64_t tsc_start;
@@ -111,19 +360,201 @@ typedef struct {
     uint32_t cache_flushes;
     uint32_t tlb_flushes;
     uint32_t page_walks;
-    uint32_t interrupt_latency;
+    uint32_t interrupt_latency;         /* Worst IRQ entry-to-EOI time, in cycles */
+    uint32_t busiest_irq;               /* Line that took the most interrupts */
+    uint32_t irqs_over_budget;          /* Lines whose worst case exceeded IRQ_LATENCY_BUDGET_US */
     uint32_t syscall_latency;
 } performance_counters_t;
 
 /* Global variables */
-static process_t processes[MAX_PROCESSES];
 static memory_pool_t memory_pool;
-static scheduler_stats_t scheduler_stats;
+static uint8_t slab_pages[SLAB_PAGE_COUNT][PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+static uint16_t slab_free_pages[SLAB_PAGE_COUNT];
+static uint32_t slab_free_page_count;
+static kmem_cache_t kmem_caches[KMEM_CACHE_MAX];
+static uint32_t kmem_cache_count = 0;
+static kmem_cache_t* process_cache = NULL;
+static uint32_t process_count = 0;
+static sched_stats_cpu_t sched_stats[MAX_CPUS + 1];   /* Per run queue, the scratch one last */
 static performance_counters_t perf_counters;
-static process_t* ready_queues[PRIORITY_COUNT];
-static process_t* current_process = NULL;
+static cpu_runqueue_t runqueues[MAX_CPUS + 1];    /* The last is scratch for the benchmarks and replays */
+static spinlock_t process_lock;        /* Guards process_cache, the stack pool and pids */
 static uint32_t next_pid = 1;
 static uint32_t scheduler_running = 0;
+static uint32_t sched_sim_active;       /* The scratch run queue reads the replay's virtual clock */
+static uint64_t sched_sim_now;          /* Nanoseconds */
+static workqueue_t workqueues[WQ_MAX];
+static cpu_idle_t cpu_idle[MAX_CPUS];
+static idle_state_t idle_states[IDLE_STATE_MAX];
+static uint32_t idle_state_count;       /* 0 when there is no MWAIT */
+static uint32_t workqueue_count;
+static volatile uint32_t wq_kick[MAX_CPUS];   /* Some pool on the CPU has kick set */
+
+/*
+ * Fair class weights by nice level, -20 to 19: each level is about 10%
+ * more or less CPU than the next. fair_wmult holds 2^32 / weight, so
+ * scaling runtime by weight is a multiply and a shift, not a division.
+ */
+static const uint32_t fair_weights[40] = {
+    88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916,
+    9548, 7620, 6100, 4904, 3906, 3121, 2501, 1991, 1586, 1277,
+    1024, 820, 655, 526, 423, 335, 272, 215, 172, 137,
+    110, 87, 70, 56, 45, 36, 29, 23, 18, 15,
+};
+
+static const uint32_t fair_wmults[40] = {
+    48388, 59856, 76040, 92818, 118348, 147320, 184698, 229616, 287308, 360437,
+    449829, 563644, 704093, 875809, 1099582, 1376151, 1717300, 2157191, 2708050, 3363326,
+    4194304, 5237765, 6557202, 8165337, 10153587, 12820798, 15790321, 19976592, 24970740, 31350126,
+    39045157, 49367440, 61356676, 76695844, 95443717, 119304647, 148102320, 186737708, 238609294, 286331153,
+};
+
+/* Micro-benchmarks (bench.c) */
+#define BENCH(name) static void bench_##name(uint32_t iterations)
+extern int bench_register(const char* name, void (*run)(uint32_t iterations));
+extern uint32_t bench_run_all(void);
+
+/* Kernel runtime library (klib.c) */
+extern char* klib_puts(char* out, const char* text, uint32_t width);
+extern char* klib_putu(char* out, uint32_t value, uint32_t width);
+
+/* Single-producer single-consumer byte ring (must match struct spsc_ring in spsc_ring.c) */
+struct spsc_ring {
+    uint8_t* buffer;
+    uint32_t mask;
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t tail __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+extern void spsc_init(struct spsc_ring* ring, void* buffer, uint32_t size);
+extern int spsc_push(struct spsc_ring* ring, uint8_t byte);
+extern int spsc_pop(struct spsc_ring* ring, uint8_t* byte);
+
+/* Context switch (context_switch.asm) */
+extern void switch_to(cpu_context_t* prev, cpu_context_t* next);
+uint32_t* tss_esp0_ptr = NULL;     /* Set by the owner of the TSS */
+
+/* Per-CPU data (smp.c) */
+extern uint32_t smp_processor_id(void);
+extern uint32_t smp_cpu_count(void);
+
+/* Monotonic clock (clocksource.c) */
+extern uint64_t ktime_ns(void);
+extern uint32_t clocksource_tsc_khz(void);
+
+/* Interrupt statistics (interrupt_handlers.c) */
+#define IRQ_LINES 16
+#define IRQ_LATENCY_BUDGET_US 50
+extern uint32_t irq_get_stats(uint32_t line, uint32_t* max_cycles);
+
+/* Kernel locks (spinlock.c) */
+extern void spin_lock_init(spinlock_t* lock);
+extern void spin_lock(spinlock_t* lock);
+extern void spin_unlock(spinlock_t* lock);
+extern uint32_t spin_lock_irqsave(spinlock_t* lock);
+extern void spin_unlock_irqrestore(spinlock_t* lock, uint32_t flags);
+extern void write_seqlock(seqlock_t* lock);
+extern void write_sequnlock(seqlock_t* lock);
+extern uint32_t write_seqlock_irqsave(seqlock_t* lock);
+extern void write_sequnlock_irqrestore(seqlock_t* lock, uint32_t flags);
+extern uint32_t read_seqbegin(const seqlock_t* lock);
+extern int read_seqretry(const seqlock_t* lock, uint32_t start);
+
+/* Timer wheel (timer_wheel.c) */
+extern void timer_setup(struct timer* timer, void (*callback)(void* data), void* data);
+extern void timer_add(struct timer* timer, uint32_t expires);
+extern void timer_cancel(struct timer* timer);
+extern int timer_pending(const struct timer* timer);
+extern uint32_t timer_wheel_now(void);
+extern uint32_t timer_wheel_next_expiry(uint32_t limit);
+extern uint32_t timer_frequency;
+
+/* Read-copy-update (rcu.c) */
+extern void rcu_init(uint32_t cpu_count, uint32_t (*this_cpu)(void));
+extern void rcu_quiescent_state(void);
+
+/* Per-CPU counters (percpu.c) */
+#define PCPU_CONTEXT_SWITCHES 3
+extern void percpu_init(uint32_t (*this_cpu)(void));
+extern void this_cpu_inc(uint32_t counter);
+extern uint64_t percpu_counter_read(uint32_t counter);
+
+/* Runtime tunables (sysctl.c) */
+#define SYSCTL_UINT 0                   /* Must match sysctl.c */
+extern int sysctl_register(const char* name, uint32_t type, void* value, int64_t min, int64_t max);
+
+/* Base timeslice in ticks, scaled by priority; the sched_quantum tunable */
+static uint32_t sched_quantum = TIME_QUANTUM_BASE;
+
+/* Tracepoints (trace.c) (must match the event numbers there) */
+#define TRACE_CONTEXT_SWITCH 3
+extern void trace_init(uint32_t (*this_cpu)(void));
+extern void trace_record(uint32_t event, uint32_t arg0, uint32_t arg1, uint32_t arg2);
+
+/* A NOP until trace_start patches in a jump to the call; -DNO_TRACEPOINTS leaves no site */
+#ifdef NO_TRACEPOINTS
+#define TRACEPOINT(event, arg0, arg1, arg2) do { (void)(arg0); (void)(arg1); (void)(arg2); } while (0)
+#else
+static inline __attribute__((always_inline)) int tracepoint_on(uint32_t event) {
+    __asm__ goto("1: .byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n\t"
+                 ".pushsection __tracepoints, \"aw\"\n\t"
+                 ".long 1b, %l[on], %c0\n\t"
+                 ".popsection" : : "i"(event) : : on);
+    return 0;
+on:
+    return 1;
+}
+
+#define TRACEPOINT(event, arg0, arg1, arg2) do {                     \
+    if (__builtin_expect(tracepoint_on(event), 0)) {                 \
+        trace_record(event, arg0, arg1, arg2);                       \
+    }                                                                \
+} while (0)
+#endif
+
+/* Kernel log ring (printk.c) */
+#define PRINTK_INFO 6                   /* Must match printk.c */
+extern int printk(uint32_t level, const char* text);
+
+/* Resource groups (rgroup.c) */
+extern void rgroup_init(uint32_t (*this_cpu)(void));
+extern int rgroup_valid(uint32_t id);
+extern void rgroup_charge_cpu(uint32_t id, uint64_t runtime, uint64_t now);
+extern int rgroup_cpu_throttled(uint32_t id, uint64_t now);
+extern int rgroup_charge_mem(uint32_t id, uint32_t bytes);
+extern void rgroup_uncharge_mem(uint32_t id, uint32_t bytes);
+extern void rgroup_enter(uint32_t id);
+extern uint32_t rgroup_current(void);
+
+/* Pre-zeroed frame pool (kernel_usermode.c) */
+extern void paging_prezero_frames(uint32_t budget);
+
+/* Utility functions */
+static void* memset(void* s, int c, size_t n) {
+    unsigned char* p = s;
+    while (n--) *p++ = c;
+    return s;
+}
+
+static void* memcpy(void* dest, const void* src, size_t n) {
+    unsigned char* d = dest;
+    const unsigned char* s = src;
+    while (n--) *d++ = *s++;
+    return dest;
+}
+
+/* Bit scan helpers (value must be non-zero) */
+static inline uint32_t bit_scan_forward(uint32_t value) {
+    uint32_t index;
+    __asm__ ("bsf %1, %0" : "=r"(index) : "rm"(value));
+    return index;
+}
+
+static inline uint32_t bit_scan_reverse(uint32_t value) {
+    uint32_t index;
+    __asm__ ("bsr %1, %0" : "=r"(index) : "rm"(value));
+    return index;
+}
 
 /* CPUID and RDTSC support */
 static inline uint64_t rdtsc(void) {
@@ -136,6 +567,13 @@ static inline void cpuid(int info, int* eax, int* ebx, int* ecx, int* edx) {
     __asm__ __volatile__ ("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(info));
 }
 
+/* 64-by-32 division with divl; the quotient must fit 32 bits. There is no libgcc */
+static inline uint32_t div_u64_u32(uint64_t dividend, uint32_t divisor) {
+    uint32_t quotient, rem;
+    __asm__("divl %4" : "=a"(quotient), "=d"(rem) : "a"((uint32_t)dividend), "d"((uint32_t)(dividend >> 32)), "rm"(divisor));
+    return quotient;
+}
+
 /* Cache optimization functions */
 static inline void flush_cache_line(void* addr) {
     __asm__ __volatile__ ("clflush %0" : : "m"(*(char*)addr));
@@ -145,7 +583,70 @@ static inline void prefetch(void* addr) {
     __asm__ __volatile__ ("prefetcht0 %0" : : "m"(*(char*)addr));
 }
 
+/*
+ * Open the statistics block of run queue rq, this CPU's own or the scratch
+ * one, for update. Interrupts stay off until sched_stats_end, so the block
+ * cannot be reopened by a nested writer in between.
+ */
+static scheduler_stats_t* sched_stats_begin(cpu_runqueue_t* rq, uint32_t* flags) {
+    sched_stats_cpu_t* block = &sched_stats[rq - runqueues];
+    *flags = write_seqlock_irqsave(&block->seq);
+    return &block->stats;
+}
+
+static void sched_stats_end(cpu_runqueue_t* rq, uint32_t flags) {
+    write_sequnlock_irqrestore(&sched_stats[rq - runqueues].seq, flags);
+}
+
 /* Memory management functions */
+static uint32_t size_class(uint32_t size) {
+    uint32_t cls = bit_scan_reverse(size) - SIZE_CLASS_MIN_SHIFT;
+    return cls < SIZE_CLASS_COUNT ? cls : SIZE_CLASS_COUNT - 1;
+}
+
+static void free_list_insert(memory_block_t* block) {
+    uint32_t cls = size_class(block->size);
+    
+    block->prev = NULL;
+    block->next = memory_pool.free_list[cls];
+    if (block->next) {
+        block->next->prev = block;
+    }
+    memory_pool.free_list[cls] = block;
+    memory_pool.free_bitmap |= 1u << cls;
+    memory_pool.fragmentation_count++;
+}
+
+static void free_list_remove(memory_block_t* block) {
+    uint32_t cls = size_class(block->size);
+    
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        memory_pool.free_list[cls] = block->next;
+    }
+    if (block->next) {
+        block->next->prev = block->prev;
+    }
+    if (!memory_pool.free_list[cls]) {
+        memory_pool.free_bitmap &= ~(1u << cls);
+    }
+    memory_pool.fragmentation_count--;
+}
+
+/* Physical neighbours of a block, or NULL at the pool edges */
+static memory_block_t* next_physical(memory_block_t* block) {
+    uint8_t* next = (uint8_t*)block + sizeof(memory_block_t) + block->size;
+    return next < memory_pool.pool + MEMORY_POOL_SIZE ? (memory_block_t*)next : NULL;
+}
+
+static memory_block_t* prev_physical(memory_block_t* block) {
+    if ((uint8_t*)block == memory_pool.pool) {
+        return NULL;
+    }
+    return (memory_block_t*)((uint8_t*)block - block->prev_size - sizeof(memory_block_t));
+}
+
 static void memory_pool_init(void) {
     memset(&memory_pool, 0, sizeof(memory_pool_t));
     
@@ -153,11 +654,7 @@ static void memory_pool_init(void) {
     memory_block_t* initial_block = (memory_block_t*)memory_pool.pool;
     initial_block->size = MEMORY_POOL_SIZE - sizeof(memory_block_t);
     initial_block->flags = 0;
-    initial_block->next = NULL;
-    initial_block->prev = NULL;
-    
-    /* Add to normal priority free list */
-    memory_pool.free_list[PRIORITY_NORMAL] = initial_block;
+    initial_block->prev_size = 0;
     
     /* Initialize statistics */
     memory_pool.total_allocated = 0;
@@ -166,35 +663,29 @@ static void memory_pool_init(void) {
     memory_pool.allocation_failures = 0;
     memory_pool.cache_hits = 0;
     memory_pool.cache_misses = 0;
+    
+    free_list_insert(initial_block);
 }
 
-static memory_block_t* find_best_fit(uint32_t size, process_priority_t priority) {
-    memory_block_t* best_block = NULL;
-    uint32_t best_size = 0xFFFFFFFF;
-    
-    /* Search in the appropriate priority list */
-    memory_block_t* current = memory_pool.free_list[priority];
-    while (current) {
-        if (current->size >= size && current->size < best_size) {
-            best_block = current;
-            best_size = current->size;
-            
-            /* Early exit if we find an exact fit */
-            if (current->size == size) {
-                memory_pool.cache_hits++;
-                return current;
-            }
-        }
-        current = current->next;
-    }
+static memory_block_t* find_fit(uint32_t size) {
+    uint32_t cls = size_class(size);
     
-    if (best_block) {
+    /* A hit is a block served from the request's own size class */
+    memory_block_t* block = memory_pool.free_list[cls];
+    if (block && block->size >= size) {
         memory_pool.cache_hits++;
-    } else {
-        memory_pool.cache_misses++;
+        return block;
+    }
+    
+    /* Otherwise any block in a larger class is guaranteed to fit */
+    memory_pool.cache_misses++;
+    uint32_t larger = cls + 1 < SIZE_CLASS_COUNT ?
+        memory_pool.free_bitmap & ~((2u << cls) - 1) : 0;
+    if (!larger) {
+        return NULL;
     }
     
-    return best_block;
+    return memory_pool.free_list[bit_scan_forward(larger)];
 }
 
 static void split_block(memory_block_t* block, uint32_t size) {
@@ -202,127 +693,361 @@ static void split_block(memory_block_t* block, uint32_t size) {
         memory_block_t* new_block = (memory_block_t*)((uint8_t*)block + sizeof(memory_block_t) + size);
         new_block->size = block->size - size - sizeof(memory_block_t);
         new_block->flags = 0;
-        new_block->next = block->next;
-        new_block->prev = block;
+        new_block->prev_size = size;
         
-        if (block->next) {
-            block->next->prev = new_block;
+        memory_block_t* next = next_physical(new_block);
+        if (next) {
+            next->prev_size = new_block->size;
         }
         
-        block->next = new_block;
+        free_list_insert(new_block);
         block->size = size;
     }
 }
 
-static void coalesce_blocks(void) {
-    /* Coalesce adjacent free blocks to reduce fragmentation */
-    for (int priority = 0; priority < PRIORITY_COUNT; priority++) {
-        memory_block_t* current = memory_pool.free_list[priority];
-        while (current && current->next) {
-            if ((uint8_t*)current + sizeof(memory_block_t) + current->size == (uint8_t*)current->next) {
-                /* Adjacent blocks found, merge them */
-                memory_block_t* next = current->next;
-                current->size += sizeof(memory_block_t) + next->size;
-                current->next = next->next;
-                if (next->next) {
-                    next->next->prev = current;
-                }
-                memory_pool.fragmentation_count--;
-            } else {
-                current = current->next;
-            }
-        }
-    }
-}
-
 void* optimized_malloc(uint32_t size, process_priority_t priority) {
+    /* All priorities share the size-class free lists */
+    (void)priority;
+    
     /* Align size to cache line boundary */
     size = (size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+    if (size == 0) {
+        size = CACHE_LINE_SIZE;
+    }
     
-    /* Find best fit block */
-    memory_block_t* block = find_best_fit(size, priority);
-    if (!block) {
+    /* The running task's group pays for the block, if its limit allows */
+    uint32_t group = rgroup_current();
+    if (group && rgroup_charge_mem(group, size) != 0) {
+        write_seqlock(&memory_pool.lock);
         memory_pool.allocation_failures++;
+        write_sequnlock(&memory_pool.lock);
         return NULL;
     }
     
-    /* Remove block from free list */
-    if (block->prev) {
-        block->prev->next = block->next;
-    } else {
-        memory_pool.free_list[priority] = block->next;
+    /* Find a fitting block */
+    write_seqlock(&memory_pool.lock);
+    memory_block_t* block = find_fit(size);
+    if (!block) {
+        memory_pool.allocation_failures++;
+        write_sequnlock(&memory_pool.lock);
+        if (group) {
+            rgroup_uncharge_mem(group, size);
+        }
+        return NULL;
     }
     
-    if (block->next) {
-        block->next->prev = block->prev;
-    }
+    /* Remove block from free list */
+    free_list_remove(block);
     
     /* Split block if it's too large */
     split_block(block, size);
     
     /* Mark as allocated */
     block->flags = 1;
+    block->rgroup = group;
+    block->charged = size;
     
     /* Update statistics */
     memory_pool.total_allocated += size;
+    uint32_t end = (uint32_t)((uint8_t*)block + sizeof(memory_block_t) + size - memory_pool.pool);
+    if (end > memory_pool.high_water) {
+        memory_pool.high_water = end;
+    }
+    write_sequnlock(&memory_pool.lock);
     
     /* Return pointer to data area */
     return (uint8_t*)block + sizeof(memory_block_t);
 }
 
 void optimized_free(void* ptr, process_priority_t priority) {
+    (void)priority;
     if (!ptr) return;
     
     memory_block_t* block = (memory_block_t*)((uint8_t*)ptr - sizeof(memory_block_t));
     
+    if (block->rgroup) {
+        rgroup_uncharge_mem(block->rgroup, block->charged);
+        block->rgroup = 0;
+    }
+    
     /* Mark as free */
+    write_seqlock(&memory_pool.lock);
     block->flags = 0;
+    memory_pool.total_freed += block->size;
     
-    /* Add to free list */
-    block->next = memory_pool.free_list[priority];
-    block->prev = NULL;
+    /* Merge with free physical neighbours using the boundary tags */
+    memory_block_t* next = next_physical(block);
+    if (next && !next->flags) {
+        free_list_remove(next);
+        block->size += sizeof(memory_block_t) + next->size;
+    }
     
-    if (memory_pool.free_list[priority]) {
-        memory_pool.free_list[priority]->prev = block;
+    memory_block_t* prev = prev_physical(block);
+    if (prev && !prev->flags) {
+        free_list_remove(prev);
+        prev->size += sizeof(memory_block_t) + block->size;
+        block = prev;
     }
     
-    memory_pool.free_list[priority] = block;
+    next = next_physical(block);
+    if (next) {
+        next->prev_size = block->size;
+    }
     
-    /* Update statistics */
-    memory_pool.total_freed += block->size;
+    /* Add to the free list of its size class */
+    free_list_insert(block);
+    write_sequnlock(&memory_pool.lock);
+}
+
+/* Bytes of the pool below the highest block ever handed out */
+uint32_t optimized_pool_footprint(void) {
+    return memory_pool.high_water;
+}
+
+/* Free bytes below the high-water mark, and the largest free block there; walks every block */
+uint32_t optimized_pool_free_space(uint32_t* largest) {
+    uint32_t free_bytes = 0;
+    *largest = 0;
+    write_seqlock(&memory_pool.lock);
+    for (memory_block_t* block = (memory_block_t*)memory_pool.pool; block; block = next_physical(block)) {
+        uint32_t offset = (uint32_t)((uint8_t*)block - memory_pool.pool);
+        if (block->flags || offset + sizeof(memory_block_t) >= memory_pool.high_water) {
+            continue;
+        }
+        uint32_t size = block->size;
+        if (offset + sizeof(memory_block_t) + size > memory_pool.high_water) {
+            size = memory_pool.high_water - offset - sizeof(memory_block_t);
+        }
+        free_bytes += size;
+        if (size > *largest) {
+            *largest = size;
+        }
+    }
+    write_sequnlock(&memory_pool.lock);
+    return free_bytes;
+}
+
+/* Slab allocator functions */
+static void slab_pages_init(void) {
+    slab_free_page_count = 0;
+    for (int i = SLAB_PAGE_COUNT - 1; i >= 0; i--) {
+        slab_free_pages[slab_free_page_count++] = (uint16_t)i;
+    }
+}
+
+static void slab_list_add(slab_t** list, slab_t* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+static void slab_list_remove(slab_t** list, slab_t* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+static slab_t* slab_create(kmem_cache_t* cache) {
+    if (slab_free_page_count == 0) {
+        return NULL;
+    }
+    
+    slab_t* slab = (slab_t*)slab_pages[slab_free_pages[--slab_free_page_count]];
+    slab->cache = cache;
+    slab->in_use = 0;
+    slab->free_objects = NULL;
+    
+    /* Offset successive slabs by a cache line so objects spread across sets */
+    uint32_t offset = ((sizeof(slab_t) + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1)) +
+                      cache->colour_next * CACHE_LINE_SIZE;
+    cache->colour_next = (cache->colour_next + 1) % cache->colour_count;
+    
+    /* Thread every object onto the slab free list */
+    uint8_t* object = (uint8_t*)slab + offset + (cache->objects_per_slab - 1) * cache->object_size;
+    for (uint32_t i = 0; i < cache->objects_per_slab; i++) {
+        *(void**)object = slab->free_objects;
+        slab->free_objects = object;
+        object -= cache->object_size;
+    }
+    
+    cache->total_slabs++;
+    return slab;
+}
+
+kmem_cache_t* kmem_cache_create(const char* name, uint32_t size, void (*ctor)(void* object)) {
+    uint32_t header = (sizeof(slab_t) + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+    
+    if (kmem_cache_count >= KMEM_CACHE_MAX || size == 0 || size > PAGE_SIZE - header) {
+        return NULL;
+    }
+    
+    kmem_cache_t* cache = &kmem_caches[kmem_cache_count++];
+    memset(cache, 0, sizeof(kmem_cache_t));
+    
+    /* Objects hold a free-list link while free and keep their natural alignment */
+    if (size < sizeof(void*)) {
+        size = sizeof(void*);
+    }
+    cache->name = name;
+    cache->object_size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    cache->objects_per_slab = (PAGE_SIZE - header) / cache->object_size;
+    cache->colour_count = (PAGE_SIZE - header - cache->objects_per_slab * cache->object_size) /
+                          CACHE_LINE_SIZE + 1;
+    cache->ctor = ctor;
+    
+    return cache;
+}
+
+void* kmem_cache_alloc(kmem_cache_t* cache) {
+    slab_t* slab = cache->slabs_partial;
+    
+    if (!slab) {
+        /* Reuse an empty slab before taking a new page */
+        slab = cache->slabs_empty;
+        if (slab) {
+            slab_list_remove(&cache->slabs_empty, slab);
+        } else {
+            slab = slab_create(cache);
+            if (!slab) {
+                return NULL;
+            }
+        }
+        slab_list_add(&cache->slabs_partial, slab);
+    }
+    
+    void* object = slab->free_objects;
+    slab->free_objects = *(void**)object;
+    slab->in_use++;
+    
+    if (!slab->free_objects) {
+        slab_list_remove(&cache->slabs_partial, slab);
+        slab_list_add(&cache->slabs_full, slab);
+    }
     
-    /* Periodically coalesce blocks to reduce fragmentation */
-    if (memory_pool.fragmentation_count++ > 100) {
-        coalesce_blocks();
-        memory_pool.fragmentation_count = 0;
+    cache->total_allocs++;
+    if (cache->ctor) {
+        cache->ctor(object);
     }
+    return object;
+}
+
+void kmem_cache_free(kmem_cache_t* cache, void* object) {
+    if (!object) return;
+    
+    /* Slabs are page aligned, so the header is found by masking */
+    slab_t* slab = (slab_t*)((uint32_t)object & ~(PAGE_SIZE - 1));
+    if (slab->cache != cache) {
+        return;
+    }
+    
+    if (!slab->free_objects) {
+        slab_list_remove(&cache->slabs_full, slab);
+        slab_list_add(&cache->slabs_partial, slab);
+    }
+    
+    *(void**)object = slab->free_objects;
+    slab->free_objects = object;
+    slab->in_use--;
+    
+    if (slab->in_use == 0) {
+        slab_list_remove(&cache->slabs_partial, slab);
+        slab_list_add(&cache->slabs_empty, slab);
+    }
+    
+    cache->total_frees++;
+}
+
+/* Pages a cache holds; empty slabs are kept for reuse, so this only grows */
+uint32_t kmem_cache_footprint(const kmem_cache_t* cache) {
+    return cache->total_slabs * PAGE_SIZE;
+}
+
+/* Bytes of free objects in a cache's slabs */
+uint32_t kmem_cache_free_space(const kmem_cache_t* cache) {
+    uint32_t in_use = cache->total_allocs - cache->total_frees;
+    return (cache->total_slabs * cache->objects_per_slab - in_use) * cache->object_size;
 }
 
 /* Process management functions */
-static process_t* create_process(const char* name, process_priority_t priority) {
-    if (next_pid >= MAX_PROCESSES) {
+
+static void finish_task_switch(void);
+static cpu_runqueue_t* this_rq(void);
+static void wq_kick_pools(uint32_t cpu);
+static void cpu_idle_kick(cpu_runqueue_t* rq);
+void optimized_scheduler(void);
+void optimized_process_exit(void);
+
+/* First code run by a new process on its own kernel stack; a process whose entry returns exits */
+static void process_trampoline(void) {
+    finish_task_switch();
+    __asm__ __volatile__("sti");
+    process_t* self = this_rq()->current;
+    if (self->entry) {
+        self->entry();
+        optimized_process_exit();
+        optimized_scheduler();          /* Not resumed: the exited process is reaped */
+    }
+    while (1) {
+        __asm__ __volatile__("hlt");
+    }
+}
+
+static process_t* create_process(const char* name, process_priority_t priority, void (*entry)(void)) {
+    spin_lock(&process_lock);
+    if (process_count >= MAX_PROCESSES) {
+        spin_unlock(&process_lock);
         return NULL;
     }
     
-    process_t* proc = &processes[next_pid];
+    process_t* proc = kmem_cache_alloc(process_cache);
+    if (!proc) {
+        spin_unlock(&process_lock);
+        return NULL;
+    }
     memset(proc, 0, sizeof(process_t));
     
     proc->pid = next_pid++;
+    for (uint32_t i = 0; name && name[i] && i < PROCESS_NAME_LEN - 1; i++) {
+        proc->name[i] = name[i];
+    }
     proc->state = STATE_CREATED;
     proc->priority = priority;
-    proc->time_quantum = TIME_QUANTUM_BASE * (priority + 1);
+    proc->base_priority = priority;
+    proc->time_quantum = sched_quantum * (priority + 1);
     proc->last_scheduled = 0;
-    proc->last_cpu = 0;
+    proc->last_cpu = smp_processor_id();
     proc->cache_hotness = 0;
+    proc->entry = entry;
     
     /* Allocate stack */
     proc->stack_size = PAGE_SIZE;
     proc->stack_start = (uint32_t)optimized_malloc(proc->stack_size, priority);
     if (!proc->stack_start) {
+        kmem_cache_free(process_cache, proc);
+        spin_unlock(&process_lock);
         return NULL;
     }
     
-    proc->esp = proc->stack_start + proc->stack_size;
+    /* First switch_to into this process pops a zeroed frame and returns to the trampoline */
+    uint32_t* frame = (uint32_t*)(proc->stack_start + proc->stack_size);
+    *--frame = (uint32_t)process_trampoline;
+    for (int i = 0; i < 4; i++) {
+        *--frame = 0;                /* ebp, ebx, esi, edi */
+    }
+    *--frame = 0x002;                /* eflags: interrupts off until the trampoline */
+    proc->context.esp = (uint32_t)frame;
+    proc->context.cr3 = 0;
+    proc->context.esp0 = proc->stack_start + proc->stack_size;
+    process_count++;
+    spin_unlock(&process_lock);
     
     return proc;
 }
@@ -333,23 +1058,49 @@ static void destroy_process(process_t* proc) {
     }
     
     /* Free stack memory */
+    spin_lock(&process_lock);
     if (proc->stack_start) {
         optimized_free((void*)proc->stack_start, proc->priority);
         proc->stack_start = 0;
     }
+    
+    /* Return the control block to its cache */
+    process_count--;
+    kmem_cache_free(process_cache, proc);
+    spin_unlock(&process_lock);
 }
 
 /* Optimized scheduler implementation */
-static void update_process_stats(process_t* proc) {
-    uint64_t current_time = rdtsc();
+#define SCRATCH_RQ MAX_CPUS
+
+/* Time as run queue rq sees it: the monotonic clock, or virtual time for a replay */
+static uint64_t rq_clock(cpu_runqueue_t* rq) {
+    return sched_sim_active && rq == &runqueues[SCRATCH_RQ] ? sched_sim_now : ktime_ns();
+}
+
+static void update_process_stats(cpu_runqueue_t* rq, process_t* proc) {
+    uint64_t current_time = rq_clock(rq);
     uint64_t runtime = current_time - proc->last_scheduled;
     
     proc->cpu_time_used += runtime;
     proc->total_runtime += runtime;
-    proc->timeslice_remaining--;
+    if (proc->dl_period) {
+        proc->dl_budget = proc->dl_budget > runtime ? proc->dl_budget - runtime : 0;
+    }
+    if (proc->rgroup) {
+        rgroup_charge_cpu(proc->rgroup, runtime, current_time);
+    }
+    if (proc->fair_weight) {
+        /* delta * (1024 / weight), with delta capped so the product stays in 64 bits */
+        uint64_t delta = runtime > 0xFFFFFFFFu ? 0xFFFFFFFFu : runtime;
+        proc->vruntime += (delta * proc->fair_wmult) >> 22;
+    }
+    if (proc->timeslice_remaining) {
+        proc->timeslice_remaining--;
+    }
     
     /* Update cache hotness */
-    if (proc->last_cpu == 0) { /* Assuming CPU 0 for now */
+    if (proc->last_cpu == (uint32_t)(rq - runqueues)) {
         proc->cache_hotness++;
     } else {
         proc->cache_hotness = 0;
@@ -358,237 +1109,1409 @@ static void update_process_stats(process_t* proc) {
     proc->last_scheduled = current_time;
 }
 
-static process_t* select_next_process(void) {
-    process_t* selected = NULL;
-    uint32_t highest_priority = 0;
-    uint32_t min_wait_time = 0xFFFFFFFF;
-    
-    /* Multi-level feedback queue scheduling */
-    for (int priority = PRIORITY_REALTIME; priority >= PRIORITY_IDLE; priority--) {
-        process_t* current = ready_queues[priority];
-        
-        while (current) {
-            /* Skip terminated processes */
-            if (current->state == STATE_TERMINATED) {
-                process_t* next = current->next;
-                /* Remove from ready queue */
-                if (current->prev) {
-                    current->prev->next = current->next;
-                } else {
-                    ready_queues[priority] = current->next;
-                }
-                if (current->next) {
-                    current->next->prev = current->prev;
-                }
-                destroy_process(current);
-                current = next;
-                continue;
-            }
-            
-            /* Check if process is ready and has time remaining */
-            if (current->state == STATE_READY && current->timeslice_remaining > 0) {
-                /* Priority-based selection */
-                if (priority > highest_priority) {
-                    highest_priority = priority;
-                    selected = current;
-                    min_wait_time = current->wait_time;
-                } else if (priority == highest_priority) {
-                    /* Within same priority, use round-robin with aging */
-                    if (current->wait_time > min_wait_time + 1000) {
-                        selected = current;
-                        min_wait_time = current->wait_time;
-                        scheduler_stats.starvation_preventions++;
-                    } else if (current->wait_time == min_wait_time && !selected) {
-                        selected = current;
-                    }
-                }
-            }
-            
-            current = current->next;
-        }
-        
-        /* If we found a process at this priority level, break */
-        if (selected) {
-            break;
-        }
-    }
-    
-    /* If no process found, check for processes that need time quantum refresh */
-    if (!selected) {
-        for (int priority = PRIORITY_REALTIME; priority >= PRIORITY_IDLE; priority--) {
-            process_t* current = ready_queues[priority];
-            while (current) {
-                if (current->state == STATE_READY && current->timeslice_remaining == 0) {
-                    /* Refresh time quantum */
-                    current->timeslice_remaining = TIME_QUANTUM_BASE * (priority + 1);
-                    selected = current;
-                    break;
-                }
-                current = current->next;
-            }
-            if (selected) break;
-        }
+/* Run queue of the executing CPU */
+static cpu_runqueue_t* this_rq(void) {
+    return &runqueues[smp_processor_id()];
+}
+
+/* Append a process to the tail of its priority queue */
+static void run_queue_push(cpu_runqueue_t* rq, process_t* proc) {
+    run_queue_t* queue = &rq->queues[proc->priority];
+    
+    proc->next = NULL;
+    proc->prev = queue->tail;
+    if (queue->tail) {
+        queue->tail->next = proc;
+    } else {
+        queue->head = proc;
     }
-    
-    return selected;
+    queue->tail = proc;
+    proc->rq_cpu = rq - runqueues;
+    rq->ready_bitmap |= 1u << proc->priority;
+    rq->nr_ready++;
 }
 
-static void add_to_ready_queue(process_t* proc) {
-    proc->state = STATE_READY;
-    proc->last_ready_time = rdtsc();
+/* Unlink a process from its priority queue */
+static void run_queue_remove(cpu_runqueue_t* rq, process_t* proc) {
+    run_queue_t* queue = &rq->queues[proc->priority];
     
-    /* Add to appropriate priority queue */
-    proc->next = ready_queues[proc->priority];
-    proc->prev = NULL;
-    
-    if (ready_queues[proc->priority]) {
-        ready_queues[proc->priority]->prev = proc;
+    if (proc->prev) {
+        proc->prev->next = proc->next;
+    } else {
+        queue->head = proc->next;
+    }
+    if (proc->next) {
+        proc->next->prev = proc->prev;
+    } else {
+        queue->tail = proc->prev;
     }
+    proc->next = proc->prev = NULL;
+    rq->nr_ready--;
     
-    ready_queues[proc->priority] = proc;
+    if (!queue->head) {
+        rq->ready_bitmap &= ~(1u << proc->priority);
+    }
 }
 
-static void update_wait_times(void) {
-    uint64_t current_time = rdtsc();
-    
-    for (int priority = 0; priority < PRIORITY_COUNT; priority++) {
-        process_t* current = ready_queues[priority];
-        while (current) {
-            if (current->state == STATE_READY) {
-                current->wait_time = current_time - current->last_ready_time;
-            }
-            current = current->next;
-        }
-    }
-}
-
-static void context_switch(process_t* next) {
-    if (!next) return;
-    
-    uint64_t switch_start = rdtsc();
-    
-    /* Save current process context */
-    if (current_process && current_process != next) {
-        __asm__ __volatile__ (
-            "mov %%eax, %0\n"
-            "mov %%ebx, %1\n"
-            "mov %%ecx, %2\n"
-            "mov %%edx, %3\n"
-            "mov %%esi, %4\n"
-            "mov %%edi, %5\n"
-            "mov %%ebp, %6\n"
-            "mov %%esp, %7\n"
-            "mov %%eip, %8\n"
-            "pushfl\n"
-            "pop %9\n"
-            : "=m"(current_process->eax), "=m"(current_process->ebx),
-              "=m"(current_process->ecx), "=m"(current_process->edx),
-              "=m"(current_process->esi), "=m"(current_process->edi),
-              "=m"(current_process->ebp), "=m"(current_process->esp),
-              "=m"(current_process->eip), "=m"(current_process->eflags)
-        );
-        
-        current_process->state = STATE_READY;
-        current_process->context_switches++;
-        
-        /* Add back to ready queue */
-        add_to_ready_queue(current_process);
+/* Highest priority with a ready process; ready_bitmap must be non-zero */
+static uint32_t highest_ready_priority(cpu_runqueue_t* rq) {
+    return bit_scan_reverse(rq->ready_bitmap);
+}
+
+/*
+ * Deadline class: earliest deadline first, ahead of every MLFQ level, with
+ * each task run as a constant bandwidth server. A task may use dl_runtime
+ * per dl_period; once its budget is spent it is throttled until its next
+ * period starts, then gets a fresh budget and the next deadline. An
+ * overrunning task therefore only ever delays itself, and since admission
+ * keeps the CPU's total under DL_BW_LIMIT, every task that stays within
+ * its budget meets its deadlines and MLFQ tasks keep the remainder.
+ * Deadline tasks stay on the CPU that admitted them; the balancer only
+ * moves MLFQ tasks.
+ */
+static void dl_ready_insert(cpu_runqueue_t* rq, process_t* proc) {
+    process_t** link = &rq->dl_ready;
+    while (*link && (*link)->dl_abs_deadline <= proc->dl_abs_deadline) {
+        link = &(*link)->next;
+    }
+    proc->prev = NULL;
+    proc->next = *link;
+    *link = proc;
+}
+
+/* Start the next period: a full budget and the deadline after this one */
+static void dl_replenish(process_t* proc, uint64_t now) {
+    proc->dl_abs_deadline += proc->dl_period;
+    if (proc->dl_abs_deadline <= now) {
+        /* Overran by whole periods: restart the server from now rather than chase them */
+        proc->dl_abs_deadline = now + proc->dl_deadline;
+    }
+    proc->dl_budget = proc->dl_runtime;
+}
+
+static void dl_enqueue(cpu_runqueue_t* rq, process_t* proc) {
+    if (proc->dl_budget) {
+        dl_ready_insert(rq, proc);
+        return;
+    }
+    proc->next = rq->dl_throttled;
+    rq->dl_throttled = proc;
+    uint32_t stats_flags;
+    scheduler_stats_t* stats = sched_stats_begin(rq, &stats_flags);
+    stats->dl_throttles++;
+    sched_stats_end(rq, stats_flags);
+}
+
+/* Release throttled tasks whose next period has begun */
+static void dl_release_throttled(cpu_runqueue_t* rq) {
+    uint64_t now = rq_clock(rq);
+    process_t** link = &rq->dl_throttled;
+    while (*link) {
+        process_t* proc = *link;
+        if (now >= proc->dl_abs_deadline - proc->dl_deadline + proc->dl_period) {
+            *link = proc->next;
+            dl_replenish(proc, now);
+            dl_ready_insert(rq, proc);
+        } else {
+            link = &proc->next;
+        }
+    }
+}
+
+/*
+ * Fair class: weighted virtual runtime, as CFS. Ready fair tasks sit in a
+ * red-black tree ordered by vruntime and the leftmost, the one that has
+ * had least CPU for its weight, runs next. A task keeps the CPU for its
+ * share of FAIR_LATENCY_NS, never less than FAIR_MIN_GRANULARITY_NS, so
+ * switches stay bounded however many tasks are runnable. The class ranks
+ * as FAIR_RANK among the MLFQ levels, and its tasks stay on their CPU.
+ */
+static void rb_rotate_left(process_t** root, process_t* x) {
+    process_t* y = x->rb_right;
+    x->rb_right = y->rb_left;
+    if (y->rb_left) {
+        y->rb_left->rb_parent = x;
+    }
+    y->rb_parent = x->rb_parent;
+    if (!x->rb_parent) {
+        *root = y;
+    } else if (x == x->rb_parent->rb_left) {
+        x->rb_parent->rb_left = y;
+    } else {
+        x->rb_parent->rb_right = y;
+    }
+    y->rb_left = x;
+    x->rb_parent = y;
+}
+
+static void rb_rotate_right(process_t** root, process_t* x) {
+    process_t* y = x->rb_left;
+    x->rb_left = y->rb_right;
+    if (y->rb_right) {
+        y->rb_right->rb_parent = x;
+    }
+    y->rb_parent = x->rb_parent;
+    if (!x->rb_parent) {
+        *root = y;
+    } else if (x == x->rb_parent->rb_right) {
+        x->rb_parent->rb_right = y;
+    } else {
+        x->rb_parent->rb_left = y;
+    }
+    y->rb_right = x;
+    x->rb_parent = y;
+}
+
+/* Restore the red-black rules after linking in the red leaf node */
+static void rb_insert_fixup(process_t** root, process_t* node) {
+    while (node->rb_parent && node->rb_parent->rb_red) {
+        process_t* parent = node->rb_parent;
+        process_t* grand = parent->rb_parent;     /* A red parent is never the root */
+        int left = parent == grand->rb_left;
+        process_t* uncle = left ? grand->rb_right : grand->rb_left;
+        if (uncle && uncle->rb_red) {
+            parent->rb_red = 0;
+            uncle->rb_red = 0;
+            grand->rb_red = 1;
+            node = grand;
+            continue;
+        }
+        if (node == (left ? parent->rb_right : parent->rb_left)) {
+            node = parent;
+            if (left) {
+                rb_rotate_left(root, node);
+            } else {
+                rb_rotate_right(root, node);
+            }
+            parent = node->rb_parent;
+        }
+        parent->rb_red = 0;
+        grand->rb_red = 1;
+        if (left) {
+            rb_rotate_right(root, grand);
+        } else {
+            rb_rotate_left(root, grand);
+        }
+    }
+    (*root)->rb_red = 0;
+}
+
+/* Restore the rules after a black node was unlinked; node (maybe NULL) took its place under parent */
+static void rb_erase_fixup(process_t** root, process_t* node, process_t* parent) {
+    while (node != *root && (!node || !node->rb_red)) {
+        int left = node == parent->rb_left;
+        process_t* sibling = left ? parent->rb_right : parent->rb_left;
+        if (sibling->rb_red) {
+            sibling->rb_red = 0;
+            parent->rb_red = 1;
+            if (left) {
+                rb_rotate_left(root, parent);
+            } else {
+                rb_rotate_right(root, parent);
+            }
+            sibling = left ? parent->rb_right : parent->rb_left;
+        }
+        process_t* near = left ? sibling->rb_left : sibling->rb_right;
+        process_t* far = left ? sibling->rb_right : sibling->rb_left;
+        if ((!near || !near->rb_red) && (!far || !far->rb_red)) {
+            sibling->rb_red = 1;
+            node = parent;
+            parent = node->rb_parent;
+            continue;
+        }
+        if (!far || !far->rb_red) {
+            near->rb_red = 0;
+            sibling->rb_red = 1;
+            if (left) {
+                rb_rotate_right(root, sibling);
+            } else {
+                rb_rotate_left(root, sibling);
+            }
+            sibling = left ? parent->rb_right : parent->rb_left;
+            far = left ? sibling->rb_right : sibling->rb_left;
+        }
+        sibling->rb_red = parent->rb_red;
+        parent->rb_red = 0;
+        far->rb_red = 0;
+        if (left) {
+            rb_rotate_left(root, parent);
+        } else {
+            rb_rotate_right(root, parent);
+        }
+        node = *root;
+    }
+    if (node) {
+        node->rb_red = 0;
+    }
+}
+
+static void fair_enqueue(cpu_runqueue_t* rq, process_t* proc) {
+    process_t** link = &rq->fair_root;
+    process_t* parent = NULL;
+    int leftmost = 1;
+    while (*link) {
+        parent = *link;
+        if ((int64_t)(proc->vruntime - parent->vruntime) < 0) {
+            link = &parent->rb_left;
+        } else {
+            link = &parent->rb_right;
+            leftmost = 0;
+        }
+    }
+    proc->rb_parent = parent;
+    proc->rb_left = NULL;
+    proc->rb_right = NULL;
+    proc->rb_red = 1;
+    *link = proc;
+    if (leftmost) {
+        rq->fair_leftmost = proc;
+    }
+    rb_insert_fixup(&rq->fair_root, proc);
+    rq->fair_load += proc->fair_weight;
+}
+
+/* Unlink the leftmost task, which has no left child, and cache its successor */
+static process_t* fair_dequeue_leftmost(cpu_runqueue_t* rq) {
+    process_t* proc = rq->fair_leftmost;
+    process_t* child = proc->rb_right;
+    process_t* parent = proc->rb_parent;
+    
+    process_t* next = child;
+    if (next) {
+        while (next->rb_left) {
+            next = next->rb_left;
+        }
+    } else {
+        next = parent;
     }
+    rq->fair_leftmost = next;
     
-    /* Update scheduler statistics */
-    scheduler_stats.total_context_switches++;
-    uint64_t switch_end = rdtsc();
-    scheduler_stats.total_schedule_time += (switch_end - switch_start);
-    
-    /* Switch to next process */
-    current_process = next;
-    current_process->state = STATE_RUNNING;
-    current_process->last_scheduled = rdtsc();
-    current_process->last_cpu = 0; /* Assuming CPU 0 */
-    
-    /* Restore next process context */
-    __asm__ __volatile__ (
-        "mov %0, %%eax\n"
-        "mov %1, %%ebx\n"
-        "mov %2, %%ecx\n"
-        "mov %3, %%edx\n"
-        "mov %4, %%esi\n"
-        "mov %5, %%edi\n"
-        "mov %6, %%ebp\n"
-        "mov %7, %%esp\n"
-        "mov %8, %%eip\n"
-        "push %9\n"
-        "popfl\n"
-        :
-        : "m"(next->eax), "m"(next->ebx), "m"(next->ecx), "m"(next->edx),
-          "m"(next->esi), "m"(next->edi), "m"(next->ebp), "m"(next->esp),
-          "m"(next->eip), "m"(next->eflags)
-    );
+    if (child) {
+        child->rb_parent = parent;
+    }
+    if (parent) {
+        parent->rb_left = child;
+    } else {
+        rq->fair_root = child;
+    }
+    if (!proc->rb_red) {
+        rb_erase_fixup(&rq->fair_root, child, parent);
+    }
+    rq->fair_load -= proc->fair_weight;
+    return proc;
 }
 
-void optimized_scheduler(void) {
-    if (!scheduler_running) return;
+/* Advance min_vruntime to the least vruntime still in play */
+static void fair_update_min(cpu_runqueue_t* rq, process_t* current) {
+    uint64_t least = rq->fair_min_vruntime;
+    int have = 0;
+    if (current && current->fair_weight && current->state == STATE_RUNNING) {
+        least = current->vruntime;
+        have = 1;
+    }
+    if (rq->fair_leftmost && (!have || (int64_t)(rq->fair_leftmost->vruntime - least) < 0)) {
+        least = rq->fair_leftmost->vruntime;
+    }
+    if ((int64_t)(least - rq->fair_min_vruntime) > 0) {
+        rq->fair_min_vruntime = least;
+    }
+}
+
+/* A fair task's share of FAIR_LATENCY_NS by weight, at least FAIR_MIN_GRANULARITY_NS */
+static uint64_t fair_slice(cpu_runqueue_t* rq, process_t* proc) {
+    uint32_t slice = div_u64_u32((uint64_t)FAIR_LATENCY_NS * proc->fair_weight,
+                                 rq->fair_load + proc->fair_weight);
+    return slice > FAIR_MIN_GRANULARITY_NS ? slice : FAIR_MIN_GRANULARITY_NS;
+}
+
+/* Whether the fair class runs ahead of the MLFQ right now */
+static int fair_runs_first(cpu_runqueue_t* rq) {
+    return !rq->ready_bitmap || highest_ready_priority(rq) <= FAIR_RANK;
+}
+
+/* Whether the running task keeps the CPU for another pass */
+static int current_keeps_cpu(cpu_runqueue_t* rq, process_t* current) {
+    if (current->rgroup && rgroup_cpu_throttled(current->rgroup, rq_clock(rq))) {
+        return 0;
+    }
+    if (current->dl_period) {
+        return current->dl_budget &&
+               (!rq->dl_ready || rq->dl_ready->dl_abs_deadline >= current->dl_abs_deadline);
+    }
+    if (current->fair_weight) {
+        if (rq->dl_ready || !fair_runs_first(rq)) {
+            return 0;
+        }
+        return !rq->fair_leftmost ||
+               current->total_runtime - current->fair_slice_start < fair_slice(rq, current);
+    }
+    return !rq->dl_ready && current->timeslice_remaining > 0 &&
+           (!rq->ready_bitmap || highest_ready_priority(rq) <= current->priority);
+}
+
+/* Warm cache lines are worth more than strict FIFO order within one level */
+static int cache_hot_here(process_t* proc, uint32_t cpu) {
+    return proc->last_cpu == cpu && proc->cache_hotness >= MIGRATION_HOT_THRESHOLD;
+}
+
+/*
+ * The earliest deadline, else the fair task with least vruntime, else
+ * dequeue from the highest ready priority, preferring a task still hot on
+ * this CPU
+ */
+static process_t* select_next_process(cpu_runqueue_t* rq) {
+    process_t* selected = rq->dl_ready;
+    if (selected) {
+        rq->dl_ready = selected->next;
+        selected->next = NULL;
+        selected->wait_time = rq_clock(rq) - selected->last_ready_time;
+        return selected;
+    }
+    if (rq->fair_leftmost && fair_runs_first(rq)) {
+        selected = fair_dequeue_leftmost(rq);
+        selected->fair_slice_start = selected->total_runtime;
+        selected->wait_time = rq_clock(rq) - selected->last_ready_time;
+        return selected;
+    }
+    if (!rq->ready_bitmap) {
+        return NULL;
+    }
     
-    uint64_t schedule_start = rdtsc();
-    scheduler_stats.schedule_calls++;
+    uint32_t cpu = rq - runqueues;
+    selected = rq->queues[highest_ready_priority(rq)].head;
+    if (!cache_hot_here(selected, cpu)) {
+        /* Look a few entries past a cold head; the head still runs if none are hot */
+        process_t* candidate = selected->next;
+        for (int i = 1; candidate && i < AFFINITY_SCAN; i++) {
+            if (cache_hot_here(candidate, cpu)) {
+                selected = candidate;
+                uint32_t stats_flags;
+                scheduler_stats_t* stats = sched_stats_begin(rq, &stats_flags);
+                stats->affinity_hits++;
+                sched_stats_end(rq, stats_flags);
+                break;
+            }
+            candidate = candidate->next;
+        }
+    }
+    run_queue_remove(rq, selected);
     
-    /* Update wait times for all ready processes */
-    update_wait_times();
+    /* Aging only lasts until the task gets the CPU */
+    selected->priority -= selected->aging_boost;
+    selected->aging_boost = 0;
+    
+    /* Wait time is only needed once the task leaves the queue */
+    selected->wait_time = rq_clock(rq) - selected->last_ready_time;
+    return selected;
+}
+
+static void add_to_ready_queue(cpu_runqueue_t* rq, process_t* proc) {
+    proc->state = STATE_READY;
+    proc->last_ready_time = rq_clock(rq);
+    if (proc->rgroup && rgroup_cpu_throttled(proc->rgroup, proc->last_ready_time)) {
+        proc->next = rq->rg_throttled;
+        rq->rg_throttled = proc;
+        return;
+    }
+    if (proc->dl_period) {
+        dl_enqueue(rq, proc);
+    } else if (proc->fair_weight) {
+        fair_enqueue(rq, proc);
+    } else {
+        /* A process that used its whole slice gets a fresh one at the back */
+        if (proc->timeslice_remaining == 0) {
+            proc->timeslice_remaining = sched_quantum * (proc->priority + 1);
+        }
+        run_queue_push(rq, proc);
+    }
+    cpu_idle_kick(rq);
+}
+
+/* Defer destruction of a terminated process to reap_terminated() */
+static void queue_for_reaping(cpu_runqueue_t* rq, process_t* proc) {
+    proc->state = STATE_TERMINATED;
+    rq->dl_bw -= proc->dl_bw;
+    proc->dl_bw = 0;
+    proc->next = rq->reap_list;
+    rq->reap_list = proc;
+}
+
+/* Destroy up to REAP_BATCH terminated processes */
+static void reap_terminated(cpu_runqueue_t* rq) {
+    for (uint32_t i = 0; i < REAP_BATCH && rq->reap_list; i++) {
+        process_t* proc = rq->reap_list;
+        rq->reap_list = proc->next;
+        destroy_process(proc);
+    }
+}
+
+/* Give up the rest of the slice: another ready task at the same level runs first */
+void optimized_yield(void) {
+    cpu_runqueue_t* rq = this_rq();
+    if (rq->current) {
+        rq->current->timeslice_remaining = 0;
+    }
+    optimized_scheduler();
+}
+
+/* Terminate the running process; it is switched out on the next pass */
+void optimized_process_exit(void) {
+    cpu_runqueue_t* rq = this_rq();
+    if (rq->current) {
+        rq->current->state = STATE_TERMINATED;
+    }
+}
+
+/* Start a kernel thread running entry on this CPU; returns its pid, or -1 */
+int optimized_kthread_run(const char* name, process_priority_t priority, void (*entry)(void)) {
+    process_t* proc = create_process(name, priority, entry);
+    if (!proc) {
+        return -1;
+    }
+    cpu_runqueue_t* rq = this_rq();
+    spin_lock(&rq->lock);
+    add_to_ready_queue(rq, proc);
+    spin_unlock(&rq->lock);
+    return (int)proc->pid;
+}
+
+/*
+ * Raise the oldest task of each level by one if it has starved; one head
+ * per level. The boost is temporary, undone when the task is next picked,
+ * and never reaches PRIORITY_REALTIME.
+ */
+static void age_ready_queues(cpu_runqueue_t* rq) {
+    uint64_t current_time = rq_clock(rq);
+    
+    for (int priority = PRIORITY_HIGH - 1; priority >= PRIORITY_IDLE; priority--) {
+        process_t* oldest = rq->queues[priority].head;
+        if (oldest && current_time - oldest->last_ready_time > STARVATION_THRESHOLD) {
+            run_queue_remove(rq, oldest);
+            oldest->priority = priority + 1;
+            oldest->aging_boost++;
+            /* The wait starts over at the new level */
+            oldest->last_ready_time = current_time;
+            run_queue_push(rq, oldest);
+            uint32_t stats_flags;
+            scheduler_stats_t* stats = sched_stats_begin(rq, &stats_flags);
+            stats->starvation_preventions++;
+            sched_stats_end(rq, stats_flags);
+        }
+    }
+}
+
+/* CPU other than self with the most ready tasks, or -1 */
+static int find_busiest_cpu(uint32_t self) {
+    int busiest = -1;
+    uint32_t most = 0;
+    
+    /* Unlocked reads; the migration itself rechecks under both locks */
+    for (uint32_t cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        if (cpu != self && runqueues[cpu].nr_ready > most) {
+            most = runqueues[cpu].nr_ready;
+            busiest = cpu;
+        }
+    }
+    return busiest;
+}
+
+/* Move up to max ready tasks from src to dst, coldest first */
+static uint32_t migrate_tasks(cpu_runqueue_t* dst, cpu_runqueue_t* src, uint32_t max, int honour_affinity) {
+    uint32_t dst_cpu = dst - runqueues;
+    uint32_t src_cpu = src - runqueues;
+    
+    /* Always lock in address order so two balancing CPUs cannot deadlock */
+    spin_lock(dst < src ? &dst->lock : &src->lock);
+    spin_lock(dst < src ? &src->lock : &dst->lock);
+    
+    uint32_t moved = 0;
+    for (int pass = 0; pass < 2 && moved < max; pass++) {
+        /* Pass 0 takes cold tasks only; pass 1 also takes hot ones unless affinity is honoured */
+        if (pass == 1 && honour_affinity) {
+            break;
+        }
+        for (int priority = PRIORITY_IDLE; priority < PRIORITY_COUNT && moved < max; priority++) {
+            process_t* proc = src->queues[priority].head;
+            while (proc && moved < max) {
+                process_t* next = proc->next;
+                int hot = cache_hot_here(proc, src_cpu);
+                if (!proc->on_cpu && (pass == 1 || !hot)) {
+                    run_queue_remove(src, proc);
+                    run_queue_push(dst, proc);
+                    moved++;
+                    uint32_t stats_flags;
+                    scheduler_stats_t* stats = sched_stats_begin(dst, &stats_flags);
+                    stats->migrations_in[dst_cpu]++;
+                    stats->migrations_out[src_cpu]++;
+                    if (hot) {
+                        stats->hot_migrations++;
+                    }
+                    sched_stats_end(dst, stats_flags);
+                }
+                proc = next;
+            }
+        }
+    }
+    
+    spin_unlock(&src->lock);
+    spin_unlock(&dst->lock);
+    return moved;
+}
+
+/* Idle CPU: take half of the busiest CPU's ready tasks */
+static void steal_tasks(cpu_runqueue_t* rq, uint32_t cpu) {
+    int busiest = find_busiest_cpu(cpu);
+    if (busiest < 0 || runqueues[busiest].nr_ready < 2) {
+        return;
+    }
+    
+    migrate_tasks(rq, &runqueues[busiest], runqueues[busiest].nr_ready / 2, 0);
+}
+
+/* Periodic balancing toward the busiest CPU, leaving cache-hot tasks where they ran */
+static void load_balance(cpu_runqueue_t* rq, uint32_t cpu) {
+    int busiest = find_busiest_cpu(cpu);
+    if (busiest < 0 || runqueues[busiest].nr_ready <= rq->nr_ready + 1) {
+        return;
+    }
+    
+    uint32_t imbalance = (runqueues[busiest].nr_ready - rq->nr_ready) / 2;
+    if (migrate_tasks(rq, &runqueues[busiest], imbalance, 1)) {
+        uint32_t stats_flags;
+        scheduler_stats_t* stats = sched_stats_begin(rq, &stats_flags);
+        stats->load_balance_ops++;
+        sched_stats_end(rq, stats_flags);
+    }
+}
+
+/* Runs in the incoming task right after switch_to; drops the lock taken by the scheduler */
+static void finish_task_switch(void) {
+    cpu_runqueue_t* rq = this_rq();
+    if (rq->prev) {
+        rq->prev->on_cpu = 0;
+        rq->prev = NULL;
+    }
+    spin_unlock(&rq->lock);
+}
+
+/* Called with rq->lock held; the lock is released by finish_task_switch */
+static void context_switch(cpu_runqueue_t* rq, process_t* next) {
+    uint64_t switch_start = ktime_ns();
+    process_t* prev = rq->current;
+    
+    /* Requeue the outgoing process unless it has exited or blocked; stealers skip it while on_cpu */
+    if (prev) {
+        prev->context_switches++;
+        if (prev->state == STATE_TERMINATED) {
+            queue_for_reaping(rq, prev);
+        } else if (prev->state != STATE_BLOCKED) {
+            add_to_ready_queue(rq, prev);
+        }
+    }
+    
+    rq->prev = prev;
+    rq->current = next;
+    next->on_cpu = 1;
+    next->state = STATE_RUNNING;
+    next->last_scheduled = ktime_ns();
+    next->last_cpu = smp_processor_id();
+    rgroup_enter(next->rgroup);
+    
+    /* Update scheduler statistics */
+    this_cpu_inc(PCPU_CONTEXT_SWITCHES);
+    TRACEPOINT(TRACE_CONTEXT_SWITCH, prev ? prev->pid : 0, next->pid, 0);
+    uint32_t stats_flags;
+    scheduler_stats_t* stats = sched_stats_begin(rq, &stats_flags);
+    stats->total_schedule_time += ktime_ns() - switch_start;
+    sched_stats_end(rq, stats_flags);
+    
+    /* prev holds no RCU-protected pointer across a switch: a quiescent state */
+    rcu_quiescent_state();
+    
+    /* Returns once prev is scheduled again, possibly on another CPU */
+    switch_to(prev ? &prev->context : &rq->idle_context, &next->context);
+    finish_task_switch();
+}
+
+/*
+ * Resource group quotas. A task whose group has used its CPU quota for
+ * the period waits here, off every class's queue, and goes back to its
+ * class when a pass finds the group refilled.
+ */
+static void rg_release_throttled(cpu_runqueue_t* rq) {
+    uint64_t now = rq_clock(rq);
+    process_t** link = &rq->rg_throttled;
+    while (*link) {
+        process_t* proc = *link;
+        if (!rgroup_cpu_throttled(proc->rgroup, now)) {
+            *link = proc->next;
+            proc->next = NULL;
+            add_to_ready_queue(rq, proc);
+        } else {
+            link = &proc->next;
+        }
+    }
+}
+
+/*
+ * The policy half of a scheduler pass, with rq->lock held: age and release
+ * what waits, charge the running task, and choose what runs next. Returns
+ * current when it keeps the CPU, the task to switch to, or NULL to idle.
+ * Replays drive the scratch run queue through here too.
+ */
+static process_t* pick_next_task(cpu_runqueue_t* rq, process_t* current) {
+    if (rq->dl_throttled) {
+        dl_release_throttled(rq);
+    }
+    if (rq->rg_throttled) {
+        rg_release_throttled(rq);
+    }
+    
+    /* Bounded aging pass instead of touching every ready task each tick */
+    if (rq->schedule_calls % AGING_INTERVAL == 0) {
+        age_ready_queues(rq);
+    }
     
     /* Update current process stats */
-    if (current_process) {
-        update_process_stats(current_process);
+    int running = current && current->state == STATE_RUNNING;
+    if (running) {
+        update_process_stats(rq, current);
+        if (current->fair_weight) {
+            fair_update_min(rq, current);
+        }
         
-        /* Check if current process has used up its time quantum */
-        if (current_process->timeslice_remaining <= 0) {
-            current_process->state = STATE_READY;
+        /* Keep running until the slice or budget ends, or something more urgent is ready */
+        if (current_keeps_cpu(rq, current)) {
+            return current;
         }
     }
     
+    process_t* next = select_next_process(rq);
+    if (!next && running) {
+        /*
+         * Current process continues running with a fresh slice, or budget,
+         * if nobody else wants the CPU: a group over its quota is not
+         * kept off an otherwise idle CPU
+         */
+        current->timeslice_remaining = sched_quantum * (current->priority + 1);
+        if (current->dl_period && !current->dl_budget) {
+            dl_replenish(current, rq_clock(rq));
+        }
+        return current;
+    }
+    return next;
+}
+
+/*
+ * MWAIT idle. An idle CPU arms MONITOR on its cpu_idle line and MWAITs in
+ * the deepest C-state whose target residency fits before the next timer
+ * on the wheel is due and whose exit latency is within bounds; interrupts
+ * and a write to the line both end it. CPUID leaf 5 says how many
+ * sub-states each C-state has, and a state with none is left out.
+ */
+static void cpu_idle_init(void) {
+    static const idle_state_t candidates[IDLE_STATE_MAX] = {
+        { "C1", 0x00, 2, 2 },
+        { "C1E", 0x01, 10, 20 },
+        { "C3", 0x10, 80, 200 },
+        { "C6", 0x20, 150, 600 },
+    };
+    int eax, ebx, ecx, edx;
+    idle_state_count = 0;
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    if (eax < CPUID_MWAIT) {
+        return;
+    }
+    cpuid(CPUID_FEATURES, &eax, &ebx, &ecx, &edx);
+    if (!((uint32_t)ecx & CPUID_ECX_MONITOR)) {
+        return;
+    }
+    cpuid(CPUID_MWAIT, &eax, &ebx, &ecx, &edx);
+    for (uint32_t i = 0; i < IDLE_STATE_MAX; i++) {
+        uint32_t cstate = (candidates[i].hint >> 4) + 1;
+        uint32_t substates = ((uint32_t)edx >> (cstate * 4)) & 0xF;
+        /* Without the extensions leaf C1 is all there is to rely on */
+        if (!((uint32_t)ecx & CPUID_MWAIT_EXTENSIONS) && i > 0) {
+            break;
+        }
+        if (((uint32_t)ecx & CPUID_MWAIT_EXTENSIONS) && substates <= (candidates[i].hint & 0xF)) {
+            continue;
+        }
+        idle_states[idle_state_count++] = candidates[i];
+    }
+}
+
+/* Deepest C-state worth entering for predicted microseconds of idle; -1 without MWAIT */
+int cpu_idle_select(uint32_t predicted_us) {
+    int selected = idle_state_count ? 0 : -1;
+    for (uint32_t i = 1; i < idle_state_count; i++) {
+        if (idle_states[i].target_residency <= predicted_us &&
+            idle_states[i].exit_latency <= IDLE_EXIT_LATENCY_MAX_US) {
+            selected = (int)i;
+        }
+    }
+    return selected;
+}
+
+/* Whether rq has a task to run, read without its lock */
+static int cpu_idle_rq_busy(cpu_runqueue_t* rq) {
+    return rq->ready_bitmap || rq->dl_ready || rq->fair_root;
+}
+
+/* A task was queued on rq: end its CPU's MWAIT, if it is in one */
+static void cpu_idle_kick(cpu_runqueue_t* rq) {
+    uint32_t cpu = (uint32_t)(rq - runqueues);
+    if (cpu >= MAX_CPUS) {
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (cpu_idle[cpu].polling) {
+        cpu_idle[cpu].wake = 1;
+    }
+}
+
+/*
+ * Wait in a C-state for an interrupt or a task queued on rq; returns the
+ * state entered, or -1 if it did not wait. Interrupts have to be on to
+ * end the wait: with them off, or without MWAIT, it returns at once.
+ */
+static int cpu_idle_enter(cpu_runqueue_t* rq, uint32_t cpu) {
+    uint32_t flags;
+    __asm__ __volatile__("pushfl; popl %0" : "=r"(flags));
+    if (!idle_state_count || !(flags & EFLAGS_IF)) {
+        return -1;
+    }
+    uint32_t ticks = timer_wheel_next_expiry(IDLE_PREDICT_TICKS) - timer_wheel_now();
+    int state = cpu_idle_select(ticks * (1000000 / timer_frequency));
+    
+    /* Polling before the check pairs with the fence in cpu_idle_kick: a task queued after it writes wake */
+    cpu_idle_t* idle = &cpu_idle[cpu];
+    __asm__ __volatile__("cli" : : : "memory");
+    idle->wake = 0;
+    idle->polling = 1;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    __asm__ __volatile__("monitor" : : "a"(&idle->wake), "c"(0), "d"(0));
+    if (idle->wake || cpu_idle_rq_busy(rq) || wq_kick[cpu]) {
+        state = -1;
+    } else {
+        /* STI holds interrupts off for one more instruction, so one arriving now ends the MWAIT */
+        __asm__ __volatile__("sti; mwait" : : "a"(idle_states[state].hint), "c"(0) : "memory");
+    }
+    idle->polling = 0;
+    __asm__ __volatile__("sti" : : : "memory");
+    return state;
+}
+
+void optimized_scheduler(void) {
+    if (!scheduler_running) return;
+    
+    uint64_t schedule_start = ktime_ns();
+    uint32_t cpu = smp_processor_id();
+    cpu_runqueue_t* rq = &runqueues[cpu];
+    uint32_t stats_flags;
+    scheduler_stats_t* stats = sched_stats_begin(rq, &stats_flags);
+    stats->schedule_calls++;
+    sched_stats_end(rq, stats_flags);
+    rq->schedule_calls++;
+    
+    /* Cross-CPU work happens before this CPU's own lock is taken */
+    if (rq->schedule_calls % BALANCE_INTERVAL == 0) {
+        load_balance(rq, cpu);
+    }
+    if (!rq->ready_bitmap && (!rq->current || rq->current->state != STATE_RUNNING)) {
+        steal_tasks(rq, cpu);
+    }
+    
+    /* Wake workers for work queued from interrupts, which cannot take a run queue lock */
+    if (wq_kick[cpu]) {
+        wq_kick_pools(cpu);
+    }
+    
+    spin_lock(&rq->lock);
+    
+    /* Reclaim exited processes a few at a time, outside task selection */
+    if (rq->reap_list) {
+        reap_terminated(rq);
+    }
+    
     /* Select next process to run */
-    process_t* next = select_next_process();
+    process_t* current = rq->current;
+    process_t* next = pick_next_task(rq, current);
+    if (next && next == current) {
+        spin_unlock(&rq->lock);
+        return;
+    }
     
-    /* If no process is ready, keep current process or idle */
+    /* System idle: report a quiescent state, clear a few frames ahead of the next faults, then sleep */
     if (!next) {
-        if (current_process && current_process->state == STATE_RUNNING) {
-            /* Current process continues running */
-            return;
-        } else {
-            /* System idle */
-            scheduler_stats.idle_time++;
-            return;
+        spin_unlock(&rq->lock);
+        rcu_quiescent_state();
+        stats = sched_stats_begin(rq, &stats_flags);
+        stats->idle_time++;
+        sched_stats_end(rq, stats_flags);
+        paging_prezero_frames(IDLE_ZERO_BUDGET);
+        
+        int state = cpu_idle_enter(rq, cpu);
+        if (state >= 0) {
+            stats = sched_stats_begin(rq, &stats_flags);
+            stats->idle_states[state]++;
+            sched_stats_end(rq, stats_flags);
+        }
+        return;
+    }
+    
+    /* Latency is measured up to the switch, not across the time spent switched out */
+    uint64_t schedule_end = ktime_ns();
+    uint32_t schedule_latency = (uint32_t)(schedule_end - schedule_start);
+    
+    /* Update average schedule latency */
+    stats = sched_stats_begin(rq, &stats_flags);
+    stats->average_schedule_latency =
+        (stats->average_schedule_latency * 99 + schedule_latency) / 100;
+    sched_stats_end(rq, stats_flags);
+    
+    context_switch(rq, next);
+}
+
+/*
+ * Priority inheritance. A task that blocks on a pi_mutex lends its
+ * priority to the owner, and on along the chain if that owner is itself
+ * blocked, so a low-priority holder is not kept off the CPU by middle
+ * priorities while a realtime task waits on it: the wait is bounded by
+ * the critical section rather than by whatever else is runnable. Unlock
+ * hands the mutex straight to the best waiter and drops the owner back to
+ * what it is still owed. Inheritance moves tasks between MLFQ levels;
+ * deadline and fair tasks are ordered by their own class and keep their
+ * place.
+ */
+void pi_mutex_init(pi_mutex_t* mutex) {
+    memset(mutex, 0, sizeof(*mutex));
+}
+
+/* Change a task's effective level, moving it between queues if it is waiting in one */
+static void pi_set_priority(process_t* proc, process_priority_t priority) {
+    while (1) {
+        cpu_runqueue_t* rq = &runqueues[proc->rq_cpu];
+        spin_lock(&rq->lock);
+        if (rq != &runqueues[proc->rq_cpu]) {
+            spin_unlock(&rq->lock);             /* Migrated meanwhile */
+            continue;
+        }
+        int queued = proc->state == STATE_READY && !proc->dl_period && !proc->fair_weight;
+        if (queued) {
+            run_queue_remove(rq, proc);
+        }
+        proc->priority = priority;
+        proc->aging_boost = 0;                  /* The level is now inheritance's to restore */
+        if (queued) {
+            run_queue_push(rq, proc);
+        }
+        spin_unlock(&rq->lock);
+        return;
+    }
+}
+
+/* Raise owner, and whoever it waits on in turn, to at least priority */
+static void pi_boost(process_t* owner, process_priority_t priority) {
+    while (owner && owner->priority < priority) {
+        pi_set_priority(owner, priority);
+        owner = owner->blocked_on ? owner->blocked_on->owner : NULL;
+    }
+}
+
+/* The level a task is owed: its own, or the best waiter on any mutex it holds */
+static process_priority_t pi_owed_priority(process_t* proc) {
+    process_priority_t priority = proc->base_priority;
+    for (pi_mutex_t* mutex = proc->pi_held; mutex; mutex = mutex->next_held) {
+        spin_lock(&mutex->wait_lock);
+        for (process_t* waiter = mutex->waiters; waiter; waiter = waiter->next_waiter) {
+            if (waiter->priority > priority) {
+                priority = waiter->priority;
+            }
+        }
+        spin_unlock(&mutex->wait_lock);
+    }
+    return priority;
+}
+
+/*
+ * Make a blocked task runnable. One still on its CPU has not switched out
+ * yet, so it simply carries on; its scheduler pass sees it running.
+ */
+static void pi_wake(process_t* proc) {
+    cpu_runqueue_t* rq = &runqueues[proc->last_cpu];
+    spin_lock(&rq->lock);
+    if (proc->on_cpu) {
+        proc->state = STATE_RUNNING;
+    } else {
+        add_to_ready_queue(rq, proc);
+    }
+    spin_unlock(&rq->lock);
+}
+
+void pi_mutex_lock(pi_mutex_t* mutex) {
+    process_t* self = this_rq()->current;
+    spin_lock(&mutex->wait_lock);
+    while (mutex->owner && mutex->owner != self) {
+        if (self->blocked_on != mutex) {
+            self->blocked_on = mutex;
+            self->next_waiter = mutex->waiters;
+            mutex->waiters = self;
+        }
+        self->state = STATE_BLOCKED;
+        process_t* owner = mutex->owner;
+        spin_unlock(&mutex->wait_lock);
+        
+        pi_boost(owner, self->priority);
+        optimized_scheduler();          /* Returns once the mutex has been handed over */
+        spin_lock(&mutex->wait_lock);
+    }
+    if (!mutex->owner) {
+        mutex->owner = self;
+        mutex->next_held = self->pi_held;
+        self->pi_held = mutex;
+    }
+    spin_unlock(&mutex->wait_lock);
+}
+
+void pi_mutex_unlock(pi_mutex_t* mutex) {
+    process_t* self = this_rq()->current;
+    spin_lock(&mutex->wait_lock);
+    pi_mutex_t** link = &self->pi_held;
+    while (*link != mutex) {
+        link = &(*link)->next_held;
+    }
+    *link = mutex->next_held;
+    
+    /* Best waiter, oldest first among equals; the list is newest first */
+    process_t** best = NULL;
+    for (process_t** waiter = &mutex->waiters; *waiter; waiter = &(*waiter)->next_waiter) {
+        if (!best || (*waiter)->priority >= (*best)->priority) {
+            best = waiter;
+        }
+    }
+    process_t* next = best ? *best : NULL;
+    mutex->owner = next;
+    if (next) {
+        *best = next->next_waiter;
+        next->blocked_on = NULL;
+        mutex->next_held = next->pi_held;
+        next->pi_held = mutex;
+    }
+    
+    /* The new owner inherits from those still waiting */
+    process_priority_t inherited = PRIORITY_IDLE;
+    for (process_t* waiter = mutex->waiters; waiter; waiter = waiter->next_waiter) {
+        if (waiter->priority > inherited) {
+            inherited = waiter->priority;
+        }
+    }
+    spin_unlock(&mutex->wait_lock);
+    
+    self->priority = pi_owed_priority(self);
+    if (next) {
+        pi_boost(next, inherited);
+        pi_wake(next);
+        if (next->priority > self->priority) {
+            optimized_scheduler();
+        }
+    }
+}
+
+/*
+ * Workqueues: functions run later from kernel threads, out of interrupt
+ * context and at the priority of the workqueue, so background jobs can
+ * run at PRIORITY_LOW or PRIORITY_IDLE behind foreground work. Each
+ * workqueue has a pool per CPU, and an item runs from the pool of the CPU
+ * it was queued on. A pool starts workers as it needs them, while every
+ * one it has is busy, up to max_active; idle workers block until an item
+ * comes. An item already queued is not queued twice, so a burst of
+ * requests for the same job coalesces into one run; one queued again once
+ * it has started runs again. Delayed work waits on the timer wheel first.
+ */
+static void wq_worker(void) {
+    process_t* self = this_rq()->current;
+    wq_pool_t* pool = (wq_pool_t*)self->entry_data;
+    uint32_t flags = spin_lock_irqsave(&pool->lock);
+    while (1) {
+        work_t* work = pool->head;
+        if (!work) {
+            self->state = STATE_BLOCKED;
+            self->next_waiter = pool->idle;
+            pool->idle = self;
+            spin_unlock_irqrestore(&pool->lock, flags);
+            optimized_scheduler();      /* Returns once an item wakes it */
+            flags = spin_lock_irqsave(&pool->lock);
+            continue;
+        }
+        pool->head = work->next;
+        if (!pool->head) {
+            pool->tail = &pool->head;
+        }
+        pool->nr_busy++;
+        spin_unlock_irqrestore(&pool->lock, flags);
+        
+        /* The item may be queued again, or freed, from here on */
+        __atomic_store_n(&work->pending, 0, __ATOMIC_RELEASE);
+        work->func(work);
+        
+        flags = spin_lock_irqsave(&pool->lock);
+        pool->nr_busy--;
+        pool->completed++;
+    }
+}
+
+/* Start a worker for pool on its CPU; 0 if there is no memory for it, or no scheduler yet */
+static int wq_start_worker(wq_pool_t* pool) {
+    process_t* proc = process_cache ? create_process(pool->wq->name, pool->wq->priority, wq_worker) : NULL;
+    if (!proc) {
+        return 0;
+    }
+    proc->entry_data = pool;
+    proc->last_cpu = pool->cpu;
+    cpu_runqueue_t* rq = &runqueues[pool->cpu];
+    spin_lock(&rq->lock);
+    add_to_ready_queue(rq, proc);
+    spin_unlock(&rq->lock);
+    return 1;
+}
+
+/* Get a worker onto pool's items: wake an idle one, or start one if all are busy. Not from interrupts */
+static void wq_wake_worker(wq_pool_t* pool) {
+    uint32_t flags = spin_lock_irqsave(&pool->lock);
+    process_t* worker = pool->idle;
+    int start = 0;
+    if (worker) {
+        pool->idle = worker->next_waiter;
+    } else if (pool->head && pool->nr_busy == pool->nr_workers && pool->nr_workers < pool->wq->max_active) {
+        pool->nr_workers++;
+        start = 1;
+    }
+    spin_unlock_irqrestore(&pool->lock, flags);
+    
+    if (worker) {
+        pi_wake(worker);
+    } else if (start && !wq_start_worker(pool)) {
+        flags = spin_lock_irqsave(&pool->lock);
+        pool->nr_workers--;
+        spin_unlock_irqrestore(&pool->lock, flags);
+    }
+}
+
+/*
+ * Append an item already marked pending to pool. From an interrupt the run
+ * queue lock may be held by the code interrupted, so the worker is left
+ * for this CPU's next scheduler pass to wake.
+ */
+static void wq_insert(wq_pool_t* pool, work_t* work) {
+    uint32_t flags = spin_lock_irqsave(&pool->lock);
+    work->next = NULL;
+    *pool->tail = work;
+    pool->tail = &work->next;
+    spin_unlock_irqrestore(&pool->lock, flags);
+    
+    if (flags & EFLAGS_IF) {
+        wq_wake_worker(pool);
+    } else {
+        pool->kick = 1;
+        wq_kick[smp_processor_id()] = 1;
+    }
+}
+
+static void wq_kick_pools(uint32_t cpu) {
+    wq_kick[cpu] = 0;
+    for (uint32_t i = 0; i < workqueue_count; i++) {
+        wq_pool_t* pool = &workqueues[i].pools[cpu];
+        if (pool->kick) {
+            pool->kick = 0;
+            wq_wake_worker(pool);
         }
     }
+}
+
+/* A workqueue whose items run at priority, on up to max_active workers per CPU; NULL if there are WQ_MAX */
+workqueue_t* create_workqueue(const char* name, process_priority_t priority, uint32_t max_active) {
+    spin_lock(&process_lock);
+    if (workqueue_count == WQ_MAX) {
+        spin_unlock(&process_lock);
+        return NULL;
+    }
+    workqueue_t* wq = &workqueues[workqueue_count];
+    memset(wq, 0, sizeof(*wq));
+    wq->name = name;
+    wq->priority = priority;
+    wq->max_active = max_active == 0 ? 1 : max_active > WQ_MAX_ACTIVE ? WQ_MAX_ACTIVE : max_active;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        spin_lock_init(&wq->pools[cpu].lock);
+        wq->pools[cpu].tail = &wq->pools[cpu].head;
+        wq->pools[cpu].cpu = cpu;
+        wq->pools[cpu].wq = wq;
+    }
+    __atomic_store_n(&workqueue_count, workqueue_count + 1, __ATOMIC_RELEASE);
+    spin_unlock(&process_lock);
+    return wq;
+}
+
+void init_work(work_t* work, void (*func)(work_t* work)) {
+    work->next = NULL;
+    work->func = func;
+    work->pending = 0;
+}
+
+/* Queue work on cpu's pool; 0 if it was pending already, and this call coalesced into that run */
+int queue_work_on(uint32_t cpu, workqueue_t* wq, work_t* work) {
+    if (__atomic_exchange_n(&work->pending, 1, __ATOMIC_ACQ_REL)) {
+        return 0;
+    }
+    wq_insert(&wq->pools[cpu], work);
+    return 1;
+}
+
+/* Queue work on this CPU; callable from interrupts */
+int queue_work(workqueue_t* wq, work_t* work) {
+    return queue_work_on(smp_processor_id(), wq, work);
+}
+
+/* The timer went off: queue the item on the CPU that ran it */
+static void delayed_work_timer(void* data) {
+    delayed_work_t* dwork = (delayed_work_t*)data;
+    wq_insert(&dwork->wq->pools[smp_processor_id()], &dwork->work);
+}
+
+void init_delayed_work(delayed_work_t* dwork, void (*func)(work_t* work)) {
+    init_work(&dwork->work, func);
+    timer_setup(&dwork->timer, delayed_work_timer, dwork);
+    dwork->wq = NULL;
+}
+
+/* Queue dwork on wq once delay timer ticks have passed; 0 if it is pending already, waiting or queued */
+int queue_delayed_work(workqueue_t* wq, delayed_work_t* dwork, uint32_t delay) {
+    if (__atomic_exchange_n(&dwork->work.pending, 1, __ATOMIC_ACQ_REL)) {
+        return 0;
+    }
+    dwork->wq = wq;
+    if (delay == 0) {
+        wq_insert(&wq->pools[smp_processor_id()], &dwork->work);
+    } else {
+        timer_add(&dwork->timer, timer_wheel_now() + delay);
+    }
+    return 1;
+}
+
+/* Stop dwork before its timer goes off; 0 if it was not waiting, and may be queued or running */
+int cancel_delayed_work(delayed_work_t* dwork) {
+    uint32_t flags;
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    int waiting = timer_pending(&dwork->timer);
+    if (waiting) {
+        timer_cancel(&dwork->timer);
+        __atomic_store_n(&dwork->work.pending, 0, __ATOMIC_RELEASE);
+    }
+    __asm__ __volatile__("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+    return waiting;
+}
+
+/*
+ * Wait until every item queued on wq has run, yielding to its workers.
+ * Before the scheduler runs there are none, and the items run here, in
+ * order. Not from one of wq's own items, which would wait on itself.
+ */
+void flush_workqueue(workqueue_t* wq) {
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        wq_pool_t* pool = &wq->pools[cpu];
+        while (1) {
+            uint32_t flags = spin_lock_irqsave(&pool->lock);
+            work_t* work = pool->head;
+            if (!work && !pool->nr_busy) {
+                spin_unlock_irqrestore(&pool->lock, flags);
+                break;
+            }
+            if (work && !scheduler_running) {
+                pool->head = work->next;
+                if (!pool->head) {
+                    pool->tail = &pool->head;
+                }
+                pool->completed++;
+                spin_unlock_irqrestore(&pool->lock, flags);
+                __atomic_store_n(&work->pending, 0, __ATOMIC_RELEASE);
+                work->func(work);
+                continue;
+            }
+            spin_unlock_irqrestore(&pool->lock, flags);
+            optimized_yield();
+        }
+    }
+}
+
+/* Items wq has run since it was created, over all CPUs */
+uint32_t workqueue_completed(const workqueue_t* wq) {
+    uint32_t completed = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        completed += wq->pools[cpu].completed;
+    }
+    return completed;
+}
+
+/*
+ * Move the calling process into the deadline class: runtime nanoseconds
+ * of CPU in every period, each finished within deadline of the period's
+ * start (runtime <= deadline <= period, period under 2^32). Admitted only
+ * if this CPU's deadline bandwidth stays within DL_BW_LIMIT. A zero period
+ * returns the caller to the MLFQ. Returns 0, or -1 if refused.
+ */
+int optimized_sched_deadline(uint64_t runtime, uint64_t deadline, uint64_t period) {
+    cpu_runqueue_t* rq = this_rq();
+    process_t* current = rq->current;
+    if (!current || (period && (!runtime || runtime > deadline || deadline > period || period >> 32))) {
+        return -1;
+    }
     
-    /* Perform context switch if different process */
-    if (next != current_process) {
-        context_switch(next);
+    uint32_t bw = period ? div_u64_u32(runtime << DL_BW_SHIFT, (uint32_t)period) : 0;
+    spin_lock(&rq->lock);
+    if (rq->dl_bw - current->dl_bw + bw > DL_BW_LIMIT) {
+        uint32_t stats_flags;
+        scheduler_stats_t* stats = sched_stats_begin(rq, &stats_flags);
+        stats->dl_rejections++;
+        sched_stats_end(rq, stats_flags);
+        spin_unlock(&rq->lock);
+        return -1;
+    }
+    rq->dl_bw = rq->dl_bw - current->dl_bw + bw;
+    current->dl_bw = bw;
+    current->dl_runtime = runtime;
+    current->dl_deadline = deadline;
+    current->dl_period = period;
+    current->dl_abs_deadline = ktime_ns() + deadline;
+    current->dl_budget = runtime;
+    if (period) {
+        current->priority = PRIORITY_REALTIME;
+        current->base_priority = PRIORITY_REALTIME;
+        current->fair_weight = 0;
+    }
+    spin_unlock(&rq->lock);
+    return 0;
+}
+
+/*
+ * Move the calling process into the fair class at a nice level from -20
+ * to 19, leaving the deadline class if it was in it; fair 0 returns it to
+ * the MLFQ. Returns 0, or -1 for a nice level out of range.
+ */
+int optimized_sched_fair(int fair, int nice) {
+    cpu_runqueue_t* rq = this_rq();
+    process_t* current = rq->current;
+    if (!current || (fair && (nice < -20 || nice > 19))) {
+        return -1;
     }
     
-    uint64_t schedule_end = rdtsc();
-    uint64_t schedule_latency = schedule_end - schedule_start;
+    spin_lock(&rq->lock);
+    if (!fair) {
+        current->fair_weight = 0;
+        spin_unlock(&rq->lock);
+        return 0;
+    }
+    rq->dl_bw -= current->dl_bw;
+    current->dl_bw = 0;
+    current->dl_period = 0;
+    if (!current->fair_weight) {
+        /* Join level with the tasks already here rather than owed all the time it spent elsewhere */
+        current->vruntime = rq->fair_min_vruntime;
+        current->fair_slice_start = current->total_runtime;
+    }
+    current->fair_weight = fair_weights[FAIR_NICE_0 + nice];
+    current->fair_wmult = fair_wmults[FAIR_NICE_0 + nice];
+    spin_unlock(&rq->lock);
+    return 0;
+}
+
+/*
+ * Move the calling process into resource group id (rgroup.c): its CPU
+ * time counts against the group's quota from the next charge, and what it
+ * allocates from now on against the group's memory limit. Memory already
+ * held stays with the group that paid for it. Returns 0, or -1 for no
+ * such group.
+ */
+int optimized_sched_group(uint32_t id) {
+    cpu_runqueue_t* rq = this_rq();
+    process_t* current = rq->current;
+    if (!current || !rgroup_valid(id)) {
+        return -1;
+    }
     
-    /* Update average schedule latency */
-    scheduler_stats.average_schedule_latency = 
-        (scheduler_stats.average_schedule_latency * 99 + schedule_latency) / 100;
+    spin_lock(&rq->lock);
+    current->rgroup = id;
+    rgroup_enter(id);
+    spin_unlock(&rq->lock);
+    return 0;
 }
 
 /* Performance monitoring functions */
+/*
+ * Sum the per-CPU blocks, each copied under its seqlock so no field is
+ * seen half-updated; the latency is averaged over CPUs that have scheduled
+ * and context switches come from their per-CPU counter.
+ */
 void get_scheduler_stats(scheduler_stats_t* stats) {
-    if (stats) {
-        memcpy(stats, &scheduler_stats, sizeof(scheduler_stats_t));
+    if (!stats) {
+        return;
     }
+    memset(stats, 0, sizeof(scheduler_stats_t));
+    
+    uint32_t latency_cpus = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        scheduler_stats_t snap;
+        uint32_t seq;
+        do {
+            seq = read_seqbegin(&sched_stats[cpu].seq);
+            memcpy(&snap, &sched_stats[cpu].stats, sizeof(scheduler_stats_t));
+        } while (read_seqretry(&sched_stats[cpu].seq, seq));
+        
+        stats->schedule_calls += snap.schedule_calls;
+        stats->idle_time += snap.idle_time;
+        stats->starvation_preventions += snap.starvation_preventions;
+        stats->load_balance_ops += snap.load_balance_ops;
+        stats->total_schedule_time += snap.total_schedule_time;
+        stats->hot_migrations += snap.hot_migrations;
+        stats->affinity_hits += snap.affinity_hits;
+        stats->dl_throttles += snap.dl_throttles;
+        stats->dl_rejections += snap.dl_rejections;
+        for (int i = 0; i < IDLE_STATE_MAX; i++) {
+            stats->idle_states[i] += snap.idle_states[i];
+        }
+        for (int i = 0; i < MAX_CPUS; i++) {
+            stats->migrations_in[i] += snap.migrations_in[i];
+            stats->migrations_out[i] += snap.migrations_out[i];
+        }
+        if (snap.schedule_calls) {
+            stats->average_schedule_latency += snap.average_schedule_latency;
+            latency_cpus++;
+        }
+    }
+    if (latency_cpus) {
+        stats->average_schedule_latency /= latency_cpus;
+    }
+    stats->total_context_switches = (uint32_t)percpu_counter_read(PCPU_CONTEXT_SWITCHES);
 }
 
 void get_memory_stats(uint32_t* total_allocated, uint32_t* total_freed, 
                      uint32_t* fragmentation, uint32_t* cache_hit_ratio) {
-    if (total_allocated) *total_allocated = memory_pool.total_allocated;
-    if (total_freed) *total_freed = memory_pool.total_freed;
-    if (fragmentation) *fragmentation = memory_pool.fragmentation_count;
+    uint32_t allocated, freed, free_blocks, hits, misses, seq;
+    do {
+        seq = read_seqbegin(&memory_pool.lock);
+        allocated = memory_pool.total_allocated;
+        freed = memory_pool.total_freed;
+        free_blocks = memory_pool.fragmentation_count;
+        hits = memory_pool.cache_hits;
+        misses = memory_pool.cache_misses;
+    } while (read_seqretry(&memory_pool.lock, seq));
+    
+    if (total_allocated) *total_allocated = allocated;
+    if (total_freed) *total_freed = freed;
+    if (fragmentation) *fragmentation = free_blocks;
     if (cache_hit_ratio) {
-        uint32_t total_accesses = memory_pool.cache_hits + memory_pool.cache_misses;
+        uint32_t total_accesses = hits + misses;
         *cache_hit_ratio = total_accesses > 0 ? 
-            (memory_pool.cache_hits * 100) / total_accesses : 0;
+            (hits * 100) / total_accesses : 0;
     }
 }
 
@@ -617,6 +2540,479 @@ void analyze_performance(void) {
     if (cache_hit_ratio < 80) {
         /* Low cache hit ratio - may need better allocation strategy */
     }
+    
+    /* Analyze interrupt load: which line dominates, and who overruns the budget */
+    uint32_t budget_cycles = clocksource_tsc_khz() * IRQ_LATENCY_BUDGET_US / 1000;
+    uint32_t busiest_count = 0;
+    perf_counters.interrupt_latency = 0;
+    perf_counters.busiest_irq = 0;
+    perf_counters.irqs_over_budget = 0;
+    for (uint32_t line = 0; line < IRQ_LINES; line++) {
+        uint32_t max_cycles;
+        uint32_t count = irq_get_stats(line, &max_cycles);
+        if (count > busiest_count) {
+            busiest_count = count;
+            perf_counters.busiest_irq = line;
+        }
+        if (max_cycles > perf_counters.interrupt_latency) {
+            perf_counters.interrupt_latency = max_cycles;
+        }
+        if (budget_cycles && max_cycles > budget_cycles) {
+            /* Slow top half - move its work to a bottom half */
+            perf_counters.irqs_over_budget++;
+        }
+    }
+}
+
+/*
+ * Scheduler benchmarks. Helper tasks at the caller's level yield in turn:
+ * an iteration of the yield benchmarks is one full round, a switch into
+ * and out of every task taking part. Tasks not taking part stay blocked,
+ * so the set changes without creating or reaping processes between
+ * benchmarks. The ping-pong sends a byte to the first helper through one
+ * ring and waits for it to come back through another, yielding until it
+ * does. Decision time is a pick and requeue on a scratch run queue filled
+ * with control blocks that never run.
+ */
+#define BENCH_TASKS 7                   /* Helpers besides the caller: the largest yield round */
+#define BENCH_SCHED_TASKS 64
+
+static process_t* bench_tasks[BENCH_TASKS];
+static volatile uint32_t bench_active;  /* Helpers below this index take part */
+static volatile uint32_t bench_pingpong;
+static volatile uint32_t bench_stop;
+static volatile uint32_t bench_live;
+static struct spsc_ring bench_ping;
+static struct spsc_ring bench_pong;
+static uint8_t bench_ping_buffer[16];
+static uint8_t bench_pong_buffer[16];
+static process_t bench_sched_tasks[BENCH_SCHED_TASKS];
+
+static void bench_task(void) {
+    process_t* self = this_rq()->current;
+    uint32_t index = 0;
+    while (bench_tasks[index] != self) {
+        index++;
+    }
+    
+    while (!bench_stop) {
+        if (index >= bench_active) {
+            self->state = STATE_BLOCKED;
+            optimized_scheduler();      /* Until bench_set_tasks wakes it */
+            continue;
+        }
+        uint8_t byte;
+        if (bench_pingpong && spsc_pop(&bench_ping, &byte)) {
+            spsc_push(&bench_pong, byte);
+        }
+        optimized_yield();
+    }
+    bench_live--;
+}
+
+/* Let count helpers take part; the rest block on their next turn. Cheap when nothing changes. */
+static void bench_set_tasks(uint32_t count, uint32_t pingpong) {
+    if (!bench_stop && count == bench_active && pingpong == bench_pingpong) {
+        return;
+    }
+    bench_active = count;
+    bench_pingpong = pingpong;
+    for (uint32_t i = 0; i < BENCH_TASKS; i++) {
+        if (bench_tasks[i] && bench_tasks[i]->state == STATE_BLOCKED && (i < count || bench_stop)) {
+            pi_wake(bench_tasks[i]);
+        }
+    }
+    optimized_yield();
+}
+
+BENCH(yield_2) {
+    bench_set_tasks(1, 0);
+    for (uint32_t i = 0; i < iterations; i++) {
+        optimized_yield();
+    }
+}
+
+BENCH(yield_8) {
+    bench_set_tasks(7, 0);
+    for (uint32_t i = 0; i < iterations; i++) {
+        optimized_yield();
+    }
+}
+
+BENCH(pipe_pingpong) {
+    bench_set_tasks(1, 1);
+    for (uint32_t i = 0; i < iterations; i++) {
+        uint8_t byte;
+        spsc_push(&bench_ping, (uint8_t)i);
+        while (!spsc_pop(&bench_pong, &byte)) {
+            optimized_yield();
+        }
+    }
+}
+
+/* Refill the scratch queue with count ready tasks unless it already has them */
+static cpu_runqueue_t* bench_sched_fill(uint32_t count) {
+    cpu_runqueue_t* rq = &runqueues[SCRATCH_RQ];
+    if (rq->nr_ready == count) {
+        return rq;
+    }
+    memset(rq, 0, sizeof(*rq));
+    for (uint32_t i = 0; i < count; i++) {
+        process_t* proc = &bench_sched_tasks[i];
+        memset(proc, 0, sizeof(*proc));
+        proc->pid = i + 1;
+        proc->priority = PRIORITY_NORMAL;
+        proc->base_priority = PRIORITY_NORMAL;
+        add_to_ready_queue(rq, proc);
+    }
+    return rq;
+}
+
+static void bench_sched_pick(uint32_t count, uint32_t iterations) {
+    cpu_runqueue_t* rq = bench_sched_fill(count);
+    for (uint32_t i = 0; i < iterations; i++) {
+        spin_lock(&rq->lock);
+        add_to_ready_queue(rq, select_next_process(rq));
+        spin_unlock(&rq->lock);
+    }
+}
+
+BENCH(sched_pick_1) {
+    bench_sched_pick(1, iterations);
+}
+
+BENCH(sched_pick_16) {
+    bench_sched_pick(16, iterations);
+}
+
+BENCH(sched_pick_64) {
+    bench_sched_pick(BENCH_SCHED_TASKS, iterations);
+}
+
+/* Time yields, ping-pong and scheduling decisions from the running task; the table goes to the log */
+void performance_tuning_benchmarks(void) {
+    cpu_runqueue_t* rq = this_rq();
+    if (!scheduler_running || !rq->current) {
+        return;
+    }
+    
+    spsc_init(&bench_ping, bench_ping_buffer, sizeof(bench_ping_buffer));
+    spsc_init(&bench_pong, bench_pong_buffer, sizeof(bench_pong_buffer));
+    bench_active = 0;
+    bench_pingpong = 0;
+    bench_stop = 0;
+    bench_live = 0;
+    for (uint32_t i = 0; i < BENCH_TASKS; i++) {
+        bench_tasks[i] = create_process("bench", rq->current->priority, bench_task);
+        if (bench_tasks[i]) {
+            bench_live++;
+            spin_lock(&rq->lock);
+            add_to_ready_queue(rq, bench_tasks[i]);
+            spin_unlock(&rq->lock);
+        }
+    }
+    
+    if (bench_live == BENCH_TASKS) {
+        bench_register("yield round x2", bench_yield_2);
+        bench_register("yield round x8", bench_yield_8);
+        bench_register("pipe ping-pong", bench_pipe_pingpong);
+    }
+    bench_register("sched pick 1", bench_sched_pick_1);
+    bench_register("sched pick 16", bench_sched_pick_16);
+    bench_register("sched pick 64", bench_sched_pick_64);
+    bench_run_all();
+    
+    /* Wake every helper to see the stop, and run them until they have exited */
+    bench_stop = 1;
+    bench_set_tasks(0, 0);
+    while (bench_live) {
+        optimized_yield();
+    }
+    for (uint32_t i = 0; i < BENCH_TASKS; i++) {
+        bench_tasks[i] = NULL;
+    }
+}
+
+/*
+ * Workload replay. A trace of tasks, each arriving at a set time and then
+ * alternating CPU bursts with blocked spells, drives the policy on the
+ * scratch run queue under a virtual clock: a pass on every
+ * SCHED_SIM_TICK_NS tick, and another whenever the running task blocks or
+ * exits, through the same pick_next_task the live scheduler uses. Nothing
+ * reads the TSC, so a trace always gets the same decisions and a policy
+ * change can be judged on identical work. Wakeups are queued as of the
+ * moment they were due but only preempt at the next pass, as a timer
+ * interrupt would find them.
+ */
+#define SCHED_SIM_TASKS 32
+#define SCHED_SIM_TICK_NS 1000000      /* A 1 kHz timer */
+#define SCHED_SIM_LIMIT_NS 10000000000ull  /* Virtual time after which unfinished tasks are given up */
+#define SCHED_SIM_LINE 120
+
+/* A replayed task (must match the users' copies) */
+struct sched_sim_task {
+    uint32_t arrival;                   /* Microseconds of virtual time */
+    uint32_t priority;                  /* MLFQ level; fair tasks ignore it */
+    uint32_t fair;                      /* Non-zero: the fair class at nice */
+    int32_t nice;
+    uint32_t bursts;                    /* CPU bursts, each but the last followed by a block */
+    uint32_t burst;                     /* Microseconds of CPU per burst */
+    uint32_t block;                     /* Microseconds blocked after each burst */
+};
+
+/* What a replay measured, times in microseconds (must match the users' copies) */
+struct sched_sim_result {
+    uint32_t finished;                  /* Tasks that exited within SCHED_SIM_LIMIT_NS */
+    uint32_t makespan;                  /* Until the last exit */
+    uint32_t turnaround_mean;           /* Arrival to exit, over finished tasks */
+    uint32_t turnaround_max;
+    uint32_t response_mean;             /* Arrival to first run, over tasks that ran */
+    uint32_t response_max;
+    uint32_t fairness;                  /* Jain's index, in percent, of each task's CPU share while runnable */
+    uint32_t starvation_preventions;
+    uint32_t context_switches;
+};
+
+static process_t sched_sim_procs[SCHED_SIM_TASKS];
+static uint64_t sched_sim_due[SCHED_SIM_TASKS];        /* Arrival, then each wakeup */
+static uint64_t sched_sim_left[SCHED_SIM_TASKS];       /* Of the current burst */
+static uint32_t sched_sim_bursts[SCHED_SIM_TASKS];     /* Including the current one */
+static uint64_t sched_sim_first_run[SCHED_SIM_TASKS];
+static uint64_t sched_sim_exit[SCHED_SIM_TASKS];
+static uint8_t sched_sim_ran[SCHED_SIM_TASKS];
+static int sched_sim_header_logged;
+
+static void sched_sim_log(const char* name, uint32_t count, const struct sched_sim_result* result) {
+    char line[SCHED_SIM_LINE];
+    if (!sched_sim_header_logged) {
+        sched_sim_header_logged = 1;
+        printk(PRINTK_INFO, "Scheduler replay, us (done, turnaround mean/max, response mean/max, "
+                            "fairness %, starvation preventions, switches):\n");
+    }
+    char* out = klib_puts(line, "  ", 2);
+    out = klib_puts(out, name, 12);
+    out = klib_putu(out, result->finished, 3);
+    out = klib_puts(out, "/", 0);
+    out = klib_putu(out, count, 0);
+    out = klib_putu(out, result->turnaround_mean, 10);
+    out = klib_putu(out, result->turnaround_max, 10);
+    out = klib_putu(out, result->response_mean, 9);
+    out = klib_putu(out, result->response_max, 9);
+    out = klib_putu(out, result->fairness, 5);
+    out = klib_putu(out, result->starvation_preventions, 6);
+    out = klib_putu(out, result->context_switches, 7);
+    *out++ = '\n';
+    *out = '\0';
+    printk(PRINTK_INFO, line);
+}
+
+/* Turn a trace into control blocks that have not arrived yet; -1 for an invalid task */
+static int sched_sim_load(const struct sched_sim_task* trace, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        const struct sched_sim_task* task = &trace[i];
+        if (task->priority >= PRIORITY_COUNT || !task->bursts || !task->burst ||
+            (task->fair && (task->nice < -20 || task->nice > 19))) {
+            return -1;
+        }
+        process_t* proc = &sched_sim_procs[i];
+        memset(proc, 0, sizeof(*proc));
+        proc->pid = i + 1;
+        proc->state = STATE_CREATED;
+        proc->priority = task->fair ? PRIORITY_NORMAL : (process_priority_t)task->priority;
+        proc->base_priority = proc->priority;
+        proc->time_quantum = sched_quantum * (proc->priority + 1);
+        proc->last_cpu = SCRATCH_RQ;
+        if (task->fair) {
+            proc->fair_weight = fair_weights[FAIR_NICE_0 + task->nice];
+            proc->fair_wmult = fair_wmults[FAIR_NICE_0 + task->nice];
+        }
+        sched_sim_due[i] = (uint64_t)task->arrival * 1000;
+        sched_sim_left[i] = (uint64_t)task->burst * 1000;
+        sched_sim_bursts[i] = task->bursts;
+        sched_sim_ran[i] = 0;
+    }
+    return 0;
+}
+
+/* Queue what arrived or woke by now, as of when it did; returns when the next one is due */
+static uint64_t sched_sim_wake(cpu_runqueue_t* rq, uint32_t count) {
+    uint64_t now = sched_sim_now;
+    uint64_t next = ~0ull;
+    for (uint32_t i = 0; i < count; i++) {
+        process_t* proc = &sched_sim_procs[i];
+        if (proc->state != STATE_CREATED && proc->state != STATE_BLOCKED) {
+            continue;
+        }
+        if (sched_sim_due[i] > now) {
+            next = sched_sim_due[i] < next ? sched_sim_due[i] : next;
+            continue;
+        }
+        sched_sim_now = sched_sim_due[i];
+        if (proc->state == STATE_CREATED && proc->fair_weight) {
+            proc->vruntime = rq->fair_min_vruntime;
+        }
+        add_to_ready_queue(rq, proc);
+    }
+    sched_sim_now = now;
+    return next;
+}
+
+/* Summarise the finished replay into result */
+static void sched_sim_measure(const struct sched_sim_task* trace, uint32_t count, struct sched_sim_result* result) {
+    uint64_t turnaround_sum = 0;
+    uint64_t response_sum = 0;
+    uint32_t ran = 0;
+    uint32_t share_sum = 0;
+    uint32_t share_squares = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t arrival = (uint64_t)trace[i].arrival * 1000;
+        if (sched_sim_ran[i]) {
+            uint32_t response = div_u64_u32(sched_sim_first_run[i] - arrival, 1000);
+            response_sum += response;
+            result->response_max = response > result->response_max ? response : result->response_max;
+            ran++;
+        }
+        if (sched_sim_procs[i].state != STATE_TERMINATED) {
+            continue;
+        }
+        uint32_t turnaround_us = div_u64_u32(sched_sim_exit[i] - arrival, 1000);
+        turnaround_sum += turnaround_us;
+        result->turnaround_max = turnaround_us > result->turnaround_max ? turnaround_us : result->turnaround_max;
+        uint32_t exit_us = div_u64_u32(sched_sim_exit[i], 1000);
+        result->makespan = exit_us > result->makespan ? exit_us : result->makespan;
+        
+        /* CPU received over time spent wanting it, in thousandths */
+        uint64_t cpu = (uint64_t)trace[i].bursts * trace[i].burst;
+        uint32_t runnable = turnaround_us - (trace[i].bursts - 1) * trace[i].block;
+        uint32_t share = runnable && cpu < runnable ? div_u64_u32(cpu * 1000, runnable) : 1000;
+        share_sum += share;
+        share_squares += share * share;
+    }
+    if (result->finished) {
+        result->turnaround_mean = div_u64_u32(turnaround_sum, result->finished);
+        result->fairness = share_squares ? div_u64_u32((uint64_t)share_sum * share_sum * 100,
+                                                       result->finished * share_squares) : 100;
+    }
+    if (ran) {
+        result->response_mean = div_u64_u32(response_sum, ran);
+    }
+}
+
+/*
+ * Replay count tasks of trace and log one line for them under name.
+ * The scratch run queue must be idle: not in use by the benchmarks.
+ * Returns 0, or -1 for an empty, oversized or invalid trace.
+ */
+int sched_sim_run(const char* name, const struct sched_sim_task* trace, uint32_t count,
+                  struct sched_sim_result* result) {
+    if (!count || count > SCHED_SIM_TASKS || sched_sim_load(trace, count) != 0) {
+        return -1;
+    }
+    cpu_runqueue_t* rq = &runqueues[SCRATCH_RQ];
+    memset(rq, 0, sizeof(*rq));
+    memset(result, 0, sizeof(*result));
+    uint32_t starved = sched_stats[SCRATCH_RQ].stats.starvation_preventions;
+    sched_sim_now = 0;
+    sched_sim_active = 1;
+    
+    process_t* current = NULL;
+    while (result->finished < count && sched_sim_now < SCHED_SIM_LIMIT_NS) {
+        uint64_t next_due = sched_sim_wake(rq, count);
+        
+        /* A pass, and the switch context_switch would make */
+        spin_lock(&rq->lock);
+        rq->schedule_calls++;
+        process_t* next = pick_next_task(rq, current);
+        if (next && next != current) {
+            if (current) {
+                current->context_switches++;
+                add_to_ready_queue(rq, current);
+            }
+            next->state = STATE_RUNNING;
+            next->last_scheduled = sched_sim_now;
+            next->last_cpu = SCRATCH_RQ;
+            result->context_switches++;
+            uint32_t index = next - sched_sim_procs;
+            if (!sched_sim_ran[index]) {
+                sched_sim_ran[index] = 1;
+                sched_sim_first_run[index] = sched_sim_now;
+            }
+            current = next;
+        }
+        spin_unlock(&rq->lock);
+        
+        /* Idle until the next arrival or wakeup */
+        if (!current) {
+            if (next_due == ~0ull) {
+                break;
+            }
+            sched_sim_now = next_due;
+            continue;
+        }
+        
+        /* Run to the next tick, or to the end of the burst if that comes first */
+        uint32_t index = current - sched_sim_procs;
+        uint64_t slice = (uint64_t)(div_u64_u32(sched_sim_now, SCHED_SIM_TICK_NS) + 1) * SCHED_SIM_TICK_NS - sched_sim_now;
+        slice = sched_sim_left[index] < slice ? sched_sim_left[index] : slice;
+        sched_sim_now += slice;
+        sched_sim_left[index] -= slice;
+        if (sched_sim_left[index]) {
+            continue;
+        }
+        
+        /* The burst is over: charge it, then block until the next one or exit */
+        spin_lock(&rq->lock);
+        update_process_stats(rq, current);
+        spin_unlock(&rq->lock);
+        if (--sched_sim_bursts[index]) {
+            current->state = STATE_BLOCKED;
+            sched_sim_due[index] = sched_sim_now + (uint64_t)trace[index].block * 1000;
+            sched_sim_left[index] = (uint64_t)trace[index].burst * 1000;
+        } else {
+            current->state = STATE_TERMINATED;
+            sched_sim_exit[index] = sched_sim_now;
+            result->finished++;
+        }
+        current = NULL;
+    }
+    
+    sched_sim_active = 0;
+    memset(rq, 0, sizeof(*rq));
+    result->starvation_preventions = sched_stats[SCRATCH_RQ].stats.starvation_preventions - starved;
+    sched_sim_measure(trace, count, result);
+    sched_sim_log(name, count, result);
+    return 0;
+}
+
+/*
+ * Reference workloads: a desktop-like mix of CPU hogs, interactive tasks
+ * and fair tasks at two nice levels, and an idle-level task behind two
+ * hogs that only aging gets onto the CPU
+ */
+static const struct sched_sim_task sched_sim_mixed[] = {
+    /* arrival, priority, fair, nice, bursts, burst, block */
+    { 0, PRIORITY_LOW, 0, 0, 1, 200000, 0 },
+    { 0, PRIORITY_LOW, 0, 0, 1, 200000, 0 },
+    { 1000, PRIORITY_NORMAL, 0, 0, 40, 500, 4500 },
+    { 1500, PRIORITY_NORMAL, 0, 0, 40, 500, 4500 },
+    { 2000, PRIORITY_HIGH, 0, 0, 20, 2000, 8000 },
+    { 5000, PRIORITY_NORMAL, 1, 0, 1, 100000, 0 },
+    { 5000, PRIORITY_NORMAL, 1, 5, 1, 100000, 0 },
+    { 50000, PRIORITY_REALTIME, 0, 0, 10, 300, 9700 },
+};
+
+static const struct sched_sim_task sched_sim_starvation[] = {
+    { 0, PRIORITY_NORMAL, 0, 0, 1, 100000, 0 },
+    { 0, PRIORITY_NORMAL, 0, 0, 1, 100000, 0 },
+    { 0, PRIORITY_IDLE, 0, 0, 1, 10000, 0 },
+};
+
+/* Replay the reference workloads; the table goes to the log */
+void performance_tuning_replay(void) {
+    struct sched_sim_result result;
+    sched_sim_run("mixed", sched_sim_mixed, sizeof(sched_sim_mixed) / sizeof(sched_sim_mixed[0]), &result);
+    sched_sim_run("starvation", sched_sim_starvation,
+                  sizeof(sched_sim_starvation) / sizeof(sched_sim_starvation[0]), &result);
 }
 
 /* Initialize performance tuning system */
@@ -624,23 +3020,37 @@ void performance_tuning_init(void) {
     /* Initialize memory pool */
     memory_pool_init();
     
+    /* Initialize slab caches */
+    slab_pages_init();
+    kmem_cache_count = 0;
+    process_count = 0;
+    spin_lock_init(&process_lock);
+    percpu_init(smp_processor_id);
+    rgroup_init(smp_processor_id);
+    trace_init(smp_processor_id);
+    rcu_init(smp_cpu_count(), smp_processor_id);
+    process_cache = kmem_cache_create("process_t", sizeof(process_t), NULL);
+    
     /* Initialize scheduler statistics */
-    memset(&scheduler_stats, 0, sizeof(scheduler_stats_t));
+    memset(sched_stats, 0, sizeof(sched_stats));
     
     /* Initialize performance counters */
     memset(&perf_counters, 0, sizeof(performance_counters_t));
     perf_counters.tsc_start = rdtsc();
+    cpu_idle_init();
+    sysctl_register("sched_quantum", SYSCTL_UINT, &sched_quantum, 1, 1000);
     
-    /* Initialize ready queues */
-    for (int i = 0; i < PRIORITY_COUNT; i++) {
-        ready_queues[i] = NULL;
-    }
+    /* Initialize per-CPU ready queues */
+    memset(runqueues, 0, sizeof(runqueues));
     
-    /* Create init process */
-    process_t* init_proc = create_process("init", PRIORITY_HIGH);
+    /* Create init process; the running process is never on a run queue */
+    process_t* init_proc = create_process("init", PRIORITY_HIGH, NULL);
     if (init_proc) {
-        add_to_ready_queue(init_proc);
-        current_process = init_proc;
+        init_proc->state = STATE_RUNNING;
+        init_proc->on_cpu = 1;
+        init_proc->timeslice_remaining = init_proc->time_quantum;
+        init_proc->last_scheduled = ktime_ns();
+        this_rq()->current = init_proc;
     }
     
     scheduler_running = 1;
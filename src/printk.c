@@ -0,0 +1,226 @@
+/*
+ * Tiny Operating System - Kernel Log Ring
+ * Any context, interrupts included, logs with a reservation and a copy;
+ * the idle loop drains the records to the console and, if enabled, COM1
+ */
+
+#include <stdint.h>
+
+#define PRINTK_BUF_SIZE 8192            /* Power of two */
+#define PRINTK_MASK (PRINTK_BUF_SIZE - 1)
+#define PRINTK_TEXT_MAX 120             /* Longer messages are truncated */
+#define PRINTK_HEADER 8
+#define PRINTK_ALIGN 8
+
+/* Levels, as in syslog (must match the users' copies) */
+#define PRINTK_ERR 3
+#define PRINTK_WARNING 4
+#define PRINTK_INFO 6
+#define PRINTK_DEBUG 7
+
+/* Record states; free space is all zeroes */
+#define RECORD_FREE 0
+#define RECORD_READY 1                  /* Written and published */
+#define RECORD_PAD 2                    /* Skips the unused end of the buffer */
+
+/*
+ * Records are laid end to end in the ring, 8-byte aligned, and never
+ * straddle its end: a pad record fills the gap instead. A producer claims
+ * space by moving head with a compare-and-swap, so producers on other CPUs
+ * or in interrupt handlers each get their own range without a lock, then
+ * fills it in and publishes it by setting state last. The one consumer
+ * walks from tail, stops at the first record not yet published, and
+ * zeroes what it consumed so no stale byte can look like a published
+ * header on the next lap.
+ */
+struct printk_record {
+    uint16_t size;                      /* Header and text, rounded up to PRINTK_ALIGN */
+    uint8_t level;
+    uint8_t state;
+    uint32_t timestamp;
+    char text[];                        /* size - PRINTK_HEADER bytes, zero-padded */
+};
+
+static uint8_t printk_buffer[PRINTK_BUF_SIZE] __attribute__((aligned(PRINTK_ALIGN)));
+static uint32_t printk_head;            /* Next byte claimed by a producer */
+static uint32_t printk_tail;            /* Next byte the consumer reads */
+static uint32_t printk_dropped;         /* Messages lost to a full ring since the last drain */
+static uint32_t printk_draining;
+static uint32_t (*printk_clock)(void);
+static int printk_serial;
+
+/* Function prototypes */
+void printk_init(uint32_t (*clock)(void), int serial);
+int printk(uint32_t level, const char* text);
+int printk_value(uint32_t level, const char* text, uint32_t value);
+uint32_t printk_drain(void (*emit)(uint32_t level, uint32_t timestamp, const char* text, uint32_t len),
+                      uint32_t budget);
+uint32_t printk_console_drain(void);
+
+/* Shadow-buffered console (vga_console.c) */
+extern void console_write(const char* data, uint32_t size);
+
+/* Serial console (serial.c) */
+extern void serial_write(const void* data, uint32_t size);
+
+/*
+ * Set the timestamp source and whether records are also written to the
+ * serial console, which the caller has set up. Logging works before this;
+ * records are stamped 0.
+ */
+void printk_init(uint32_t (*clock)(void), int serial) {
+    printk_clock = clock;
+    printk_serial = serial;
+}
+
+/* Claim size bytes of contiguous space; returns the record, or NULL when the ring is full */
+static struct printk_record* printk_reserve(uint32_t size) {
+    uint32_t head = __atomic_load_n(&printk_head, __ATOMIC_RELAXED);
+    uint32_t pad;
+    do {
+        uint32_t offset = head & PRINTK_MASK;
+        pad = offset + size > PRINTK_BUF_SIZE ? PRINTK_BUF_SIZE - offset : 0;
+        if (head + pad + size - __atomic_load_n(&printk_tail, __ATOMIC_ACQUIRE) > PRINTK_BUF_SIZE) {
+            __atomic_fetch_add(&printk_dropped, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&printk_head, &head, head + pad + size, 1,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    if (pad) {
+        struct printk_record* filler = (struct printk_record*)&printk_buffer[head & PRINTK_MASK];
+        filler->size = pad;
+        __atomic_store_n(&filler->state, RECORD_PAD, __ATOMIC_RELEASE);
+    }
+    return (struct printk_record*)&printk_buffer[(head + pad) & PRINTK_MASK];
+}
+
+/* Log len bytes of text; a trailing newline is implied. Returns 0 if it was dropped */
+static int printk_write(uint32_t level, const char* text, uint32_t len) {
+    if (len > PRINTK_TEXT_MAX) {
+        len = PRINTK_TEXT_MAX;
+    }
+    uint32_t size = (PRINTK_HEADER + len + PRINTK_ALIGN - 1) & ~(PRINTK_ALIGN - 1);
+    struct printk_record* record = printk_reserve(size);
+    if (!record) {
+        return 0;
+    }
+
+    record->size = size;
+    record->level = level;
+    record->timestamp = printk_clock ? printk_clock() : 0;
+    for (uint32_t i = 0; i < len; i++) {
+        record->text[i] = text[i];
+    }
+    __atomic_store_n(&record->state, RECORD_READY, __ATOMIC_RELEASE);
+    return 1;
+}
+
+int printk(uint32_t level, const char* text) {
+    uint32_t len = 0;
+    while (text[len] && len < PRINTK_TEXT_MAX) {
+        len++;
+    }
+    if (len && text[len - 1] == '\n') {
+        len--;
+    }
+    return printk_write(level, text, len);
+}
+
+/* text followed by value in hex, the common diagnostic shape */
+int printk_value(uint32_t level, const char* text, uint32_t value) {
+    const char hex_chars[] = "0123456789ABCDEF";
+    char line[PRINTK_TEXT_MAX];
+    uint32_t len = 0;
+    while (text[len] && len < PRINTK_TEXT_MAX - 11) {
+        line[len] = text[len];
+        len++;
+    }
+    line[len++] = '0';
+    line[len++] = 'x';
+    for (int i = 7; i >= 0; i--) {
+        line[len++] = hex_chars[(value >> (i * 4)) & 0xF];
+    }
+    return printk_write(level, line, len);
+}
+
+/*
+ * Hand up to budget published records to emit, oldest first, and report
+ * any that were dropped. Only one drain runs at a time; a caller that
+ * finds another in progress returns 0. Returns the records emitted.
+ */
+uint32_t printk_drain(void (*emit)(uint32_t level, uint32_t timestamp, const char* text, uint32_t len),
+                      uint32_t budget) {
+    if (__atomic_exchange_n(&printk_draining, 1, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    uint32_t emitted = 0;
+    uint32_t lost = __atomic_exchange_n(&printk_dropped, 0, __ATOMIC_RELAXED);
+    if (lost) {
+        char line[] = "printk: 0x00000000 messages dropped";
+        const char hex_chars[] = "0123456789ABCDEF";
+        for (int i = 0; i < 8; i++) {
+            line[10 + i] = hex_chars[(lost >> ((7 - i) * 4)) & 0xF];
+        }
+        emit(PRINTK_WARNING, printk_clock ? printk_clock() : 0, line, sizeof(line) - 1);
+    }
+
+    uint32_t tail = __atomic_load_n(&printk_tail, __ATOMIC_RELAXED);
+    while (emitted < budget && tail != __atomic_load_n(&printk_head, __ATOMIC_ACQUIRE)) {
+        struct printk_record* record = (struct printk_record*)&printk_buffer[tail & PRINTK_MASK];
+        uint8_t state = __atomic_load_n(&record->state, __ATOMIC_ACQUIRE);
+        if (state == RECORD_FREE) {
+            break;                      /* Claimed but still being written */
+        }
+
+        uint32_t size = record->size;
+        if (state == RECORD_READY) {
+            uint32_t len = size - PRINTK_HEADER;
+            while (len && !record->text[len - 1]) {
+                len--;
+            }
+            emit(record->level, record->timestamp, record->text, len);
+            emitted++;
+        }
+
+        uint32_t* words = (uint32_t*)record;
+        for (uint32_t i = 0; i < size / 4; i++) {
+            words[i] = 0;
+        }
+        tail += size;
+        __atomic_store_n(&printk_tail, tail, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&printk_draining, 0, __ATOMIC_RELEASE);
+    return emitted;
+}
+
+static void printk_output(const char* data, uint32_t size) {
+    console_write(data, size);
+    if (printk_serial) {
+        serial_write(data, size);
+    }
+}
+
+/* One record as "[timestamp] text", with the level for warnings and worse */
+static void printk_emit_line(uint32_t level, uint32_t timestamp, const char* text, uint32_t len) {
+    const char hex_chars[] = "0123456789ABCDEF";
+    char prefix[] = "[00000000] ";
+    for (int i = 0; i < 8; i++) {
+        prefix[1 + i] = hex_chars[(timestamp >> ((7 - i) * 4)) & 0xF];
+    }
+    printk_output(prefix, sizeof(prefix) - 1);
+    if (level <= PRINTK_ERR) {
+        printk_output("error: ", 7);
+    } else if (level == PRINTK_WARNING) {
+        printk_output("warning: ", 9);
+    }
+    printk_output(text, len);
+    printk_output("\n", 1);
+}
+
+/* The idle hook: everything logged so far goes to the screen (and COM1) */
+uint32_t printk_console_drain(void) {
+    return printk_drain(printk_emit_line, 0xFFFFFFFF);
+}
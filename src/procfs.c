@@ -0,0 +1,261 @@
+/*
+ * Tiny Operating System - Proc Filesystem
+ * Generated files of kernel statistics: each entry is a show function
+ * that prints into a seq-file buffer when the file is read, so tools get
+ * the numbers with open and read rather than a system call apiece. The
+ * filesystem that mounts it asks for names and bytes at an offset. An
+ * entry with a store function also takes writes, each handed over whole.
+ */
+
+#include <stdint.h>
+
+#define PROCFS_MAX_ENTRIES 16
+#define PROCFS_NAME_LEN 16
+#define PROCFS_BUF_SIZE 4096            /* What one file can say; the rest is cut */
+#define IRQ_LINES 16                    /* Must match interrupt_handlers.c */
+
+/* Counters (must match percpu.c) */
+#define PCPU_SYSCALLS 0
+#define PCPU_INTERRUPTS 1
+#define PCPU_PAGE_FAULTS 2
+#define PCPU_CONTEXT_SWITCHES 3
+#define PCPU_NET_RX_PACKETS 4
+#define PCPU_NET_TX_PACKETS 5
+#define PCPU_NET_RX_BYTES 6
+#define PCPU_NET_TX_BYTES 7
+#define PCPU_COUNTERS 8
+
+/* Output of a show function: count bytes of buf so far, never more than size */
+struct seq_file {
+    char* buf;
+    uint32_t size;
+    uint32_t count;
+};
+
+struct procfs_entry {
+    char name[PROCFS_NAME_LEN];
+    void (*show)(struct seq_file* m);
+    int (*store)(const char* buf, uint32_t size);  /* NULL for a read-only file */
+};
+
+static struct procfs_entry procfs_entries[PROCFS_MAX_ENTRIES];
+static uint32_t procfs_entry_count;
+
+/*
+ * The text of one entry, generated when a read starts at offset 0 and
+ * kept for the reads that continue it, so a file read in pieces is one
+ * consistent snapshot. A read of another entry takes the buffer over.
+ */
+static char procfs_buf[PROCFS_BUF_SIZE];
+static uint32_t procfs_buf_len;
+static int procfs_buf_entry = -1;
+
+/* Per-CPU counters (percpu.c) */
+extern uint64_t percpu_counter_read(uint32_t counter);
+
+/* Interrupt statistics (interrupt_handlers.c) */
+extern uint32_t irq_get_stats(uint32_t line, uint32_t* max_cycles);
+
+/* Kernel heap (kernel_heap.c) */
+extern uint32_t heap_used(void);
+extern uint32_t heap_footprint(void);
+extern uint32_t heap_free_space(uint32_t* largest);
+
+/* Function prototypes */
+void seq_puts(struct seq_file* m, const char* text);
+void seq_putu64(struct seq_file* m, uint64_t value);
+void seq_putu(struct seq_file* m, uint32_t value);
+void seq_put_named(struct seq_file* m, const char* name, uint64_t value);
+int procfs_register(const char* name, void (*show)(struct seq_file* m));
+int procfs_register_writable(const char* name, void (*show)(struct seq_file* m),
+                             int (*store)(const char* buf, uint32_t size));
+int procfs_lookup(const char* name);
+uint32_t procfs_count(void);
+const char* procfs_name(uint32_t entry);
+int procfs_read(uint32_t entry, uint32_t offset, void* buffer, uint32_t size);
+int procfs_write(uint32_t entry, const void* buffer, uint32_t size);
+void procfs_init(void);
+
+void seq_puts(struct seq_file* m, const char* text) {
+    while (*text && m->count < m->size) {
+        m->buf[m->count++] = *text++;
+    }
+}
+
+/* Decimal by subtracting powers of ten: there is no 64-bit division without libgcc */
+void seq_putu64(struct seq_file* m, uint64_t value) {
+    static const uint64_t powers[] = {
+        10000000000000000000ull, 1000000000000000000ull, 100000000000000000ull,
+        10000000000000000ull, 1000000000000000ull, 100000000000000ull, 10000000000000ull,
+        1000000000000ull, 100000000000ull, 10000000000ull, 1000000000ull, 100000000ull,
+        10000000ull, 1000000ull, 100000ull, 10000ull, 1000ull, 100ull, 10ull, 1ull
+    };
+    char digits[21];
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < sizeof(powers) / sizeof(powers[0]); i++) {
+        char digit = '0';
+        while (value >= powers[i]) {
+            value -= powers[i];
+            digit++;
+        }
+        if (digit != '0' || count || i == sizeof(powers) / sizeof(powers[0]) - 1) {
+            digits[count++] = digit;
+        }
+    }
+    digits[count] = '\0';
+    seq_puts(m, digits);
+}
+
+void seq_putu(struct seq_file* m, uint32_t value) {
+    seq_putu64(m, value);
+}
+
+/* One "name value" line, the layout of every key-value file here */
+void seq_put_named(struct seq_file* m, const char* name, uint64_t value) {
+    seq_puts(m, name);
+    seq_puts(m, " ");
+    seq_putu64(m, value);
+    seq_puts(m, "\n");
+}
+
+/* Add a file; -1 when the table is full or the name is taken or too long */
+int procfs_register(const char* name, void (*show)(struct seq_file* m)) {
+    return procfs_register_writable(name, show, 0);
+}
+
+/* Add a file whose writes go to store, which returns 0 or -1 */
+int procfs_register_writable(const char* name, void (*show)(struct seq_file* m),
+                             int (*store)(const char* buf, uint32_t size)) {
+    uint32_t length = 0;
+    while (name[length]) {
+        length++;
+    }
+    if (procfs_entry_count == PROCFS_MAX_ENTRIES || !length || length >= PROCFS_NAME_LEN ||
+        procfs_lookup(name) >= 0) {
+        return -1;
+    }
+    struct procfs_entry* entry = &procfs_entries[procfs_entry_count];
+    for (uint32_t i = 0; i <= length; i++) {
+        entry->name[i] = name[i];
+    }
+    entry->show = show;
+    entry->store = store;
+    return (int)procfs_entry_count++;
+}
+
+/* The entry called name, or -1 */
+int procfs_lookup(const char* name) {
+    for (uint32_t i = 0; i < procfs_entry_count; i++) {
+        const char* a = procfs_entries[i].name;
+        const char* b = name;
+        while (*a && *a == *b) {
+            a++;
+            b++;
+        }
+        if (*a == *b) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+uint32_t procfs_count(void) {
+    return procfs_entry_count;
+}
+
+const char* procfs_name(uint32_t entry) {
+    return entry < procfs_entry_count ? procfs_entries[entry].name : 0;
+}
+
+/* Up to size bytes of the entry's text from offset; 0 at its end, -1 for no such entry */
+int procfs_read(uint32_t entry, uint32_t offset, void* buffer, uint32_t size) {
+    if (entry >= procfs_entry_count) {
+        return -1;
+    }
+    if (offset == 0 || procfs_buf_entry != (int)entry) {
+        struct seq_file m = {procfs_buf, PROCFS_BUF_SIZE, 0};
+        procfs_entries[entry].show(&m);
+        procfs_buf_len = m.count;
+        procfs_buf_entry = (int)entry;
+    }
+    if (offset >= procfs_buf_len) {
+        return 0;
+    }
+    if (size > procfs_buf_len - offset) {
+        size = procfs_buf_len - offset;
+    }
+    char* out = (char*)buffer;
+    for (uint32_t i = 0; i < size; i++) {
+        out[i] = procfs_buf[offset + i];
+    }
+    return (int)size;
+}
+
+/*
+ * Hand a write to the entry's store function; size bytes taken, or -1
+ * for no such entry, a read-only one, or a write it refused. A reader
+ * that continues after it sees the text regenerated.
+ */
+int procfs_write(uint32_t entry, const void* buffer, uint32_t size) {
+    if (entry >= procfs_entry_count || !procfs_entries[entry].store ||
+        procfs_entries[entry].store((const char*)buffer, size) < 0) {
+        return -1;
+    }
+    if (procfs_buf_entry == (int)entry) {
+        procfs_buf_entry = -1;
+    }
+    return (int)size;
+}
+
+/* Event totals over all CPUs */
+static void procfs_show_stat(struct seq_file* m) {
+    static const char* const names[PCPU_COUNTERS] = {
+        [PCPU_SYSCALLS] = "syscalls",
+        [PCPU_INTERRUPTS] = "interrupts",
+        [PCPU_PAGE_FAULTS] = "page_faults",
+        [PCPU_CONTEXT_SWITCHES] = "context_switches",
+        [PCPU_NET_RX_PACKETS] = "net_rx_packets",
+        [PCPU_NET_TX_PACKETS] = "net_tx_packets",
+        [PCPU_NET_RX_BYTES] = "net_rx_bytes",
+        [PCPU_NET_TX_BYTES] = "net_tx_bytes",
+    };
+    for (uint32_t i = 0; i < PCPU_COUNTERS; i++) {
+        seq_put_named(m, names[i], percpu_counter_read(i));
+    }
+}
+
+/* Lines that have fired: count and worst latency in cycles */
+static void procfs_show_interrupts(struct seq_file* m) {
+    seq_puts(m, "irq count max_cycles\n");
+    for (uint32_t line = 0; line < IRQ_LINES; line++) {
+        uint32_t max_cycles;
+        uint32_t count = irq_get_stats(line, &max_cycles);
+        if (!count) {
+            continue;
+        }
+        seq_putu(m, line);
+        seq_puts(m, " ");
+        seq_putu(m, count);
+        seq_puts(m, " ");
+        seq_putu(m, max_cycles);
+        seq_puts(m, "\n");
+    }
+}
+
+static void procfs_show_meminfo(struct seq_file* m) {
+    uint32_t largest;
+    uint32_t free_bytes = heap_free_space(&largest);
+    seq_put_named(m, "heap_used", heap_used());
+    seq_put_named(m, "heap_footprint", heap_footprint());
+    seq_put_named(m, "heap_free", free_bytes);
+    seq_put_named(m, "heap_largest_free", largest);
+}
+
+/* Forget every entry and add the ones every stage can fill in; the stage registers its own after */
+void procfs_init(void) {
+    procfs_entry_count = 0;
+    procfs_buf_entry = -1;
+    procfs_register("stat", procfs_show_stat);
+    procfs_register("interrupts", procfs_show_interrupts);
+    procfs_register("meminfo", procfs_show_meminfo);
+}
@@ -0,0 +1,347 @@
+/*
+ * Tiny Operating System - Sampling Profiler
+ * Architectural performance counters overflow every period events and
+ * raise an NMI through the local APIC; the NMI records where the CPU was
+ */
+
+#include <stdint.h>
+
+#define MAX_CPUS 8                      /* Must match smp.c */
+#define CACHE_LINE_SIZE 64
+#define PROFILE_RING_SAMPLES 2048       /* Per CPU, power of two */
+#define PROFILE_RING_MASK (PROFILE_RING_SAMPLES - 1)
+#define PROFILE_STACK_DEPTH 3           /* Callers kept with each kernel sample */
+#define PROFILE_SYMBOL_MAX 64
+
+/* Events (must match the users' copies) */
+#define PROFILE_CYCLES 0                /* Unhalted core cycles */
+#define PROFILE_INSTRUCTIONS 1          /* Instructions retired */
+#define PROFILE_LLC_MISSES 2            /* Last-level cache misses */
+#define PROFILE_EVENTS 3
+
+/* Architectural performance monitoring MSRs */
+#define MSR_PERFEVTSEL0 0x186
+#define MSR_PMC0 0x0C1
+#define MSR_PERF_GLOBAL_STATUS 0x38E    /* Version 2 and later */
+#define MSR_PERF_GLOBAL_CTRL 0x38F
+#define MSR_PERF_GLOBAL_OVF_CTRL 0x390
+
+#define EVTSEL_USR (1u << 16)
+#define EVTSEL_OS (1u << 17)
+#define EVTSEL_INT (1u << 20)           /* Interrupt through the LVT on overflow */
+#define EVTSEL_EN (1u << 22)
+
+#define CPUID_FEAT_EDX_MSR (1 << 5)
+#define CPUID_FEAT_EDX_APIC (1 << 9)
+
+/* Local APIC performance counter LVT entry */
+#define LAPIC_LVT_PERFMON 0x340
+#define LAPIC_LVT_MASKED 0x10000
+#define LAPIC_DELIVERY_NMI 0x400
+
+/* Event select and unit mask, and the CPUID 0AH EBX bit saying it is missing */
+static const struct {
+    uint8_t select;
+    uint8_t umask;
+    uint8_t missing_bit;
+    const char* name;
+} profile_events[PROFILE_EVENTS] = {
+    [PROFILE_CYCLES] = { 0x3C, 0x00, 0, "cycles" },
+    [PROFILE_INSTRUCTIONS] = { 0xC0, 0x00, 1, "instructions" },
+    [PROFILE_LLC_MISSES] = { 0x2E, 0x41, 4, "LLC-misses" },
+};
+
+/* Where the CPU was when a counter overflowed, and how it got there */
+struct profile_sample {
+    uint32_t eip;
+    uint32_t callers[PROFILE_STACK_DEPTH];
+    uint8_t event;
+    uint8_t cpu;
+    uint8_t user;                       /* Taken in ring 3 */
+    uint8_t depth;                      /* Callers found; user stacks are not walked */
+};
+
+/*
+ * Only the NMI writes a CPU's ring and NMIs do not nest, so a sample is
+ * a few stores, a short frame-pointer walk and a head bump with nothing
+ * to lock. A full ring keeps the
+ * newest samples.
+ */
+struct profile_ring {
+    uint32_t head;                      /* Samples ever taken */
+    struct profile_sample samples[PROFILE_RING_SAMPLES];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static struct profile_ring profile_rings[MAX_CPUS];
+static uint32_t (*profile_this_cpu)(void);
+static uint32_t profile_version;        /* Architectural PMU version, 0 if none */
+static uint32_t profile_counters;       /* General-purpose counters per CPU */
+static uint32_t profile_width;          /* Their width in bits */
+static uint32_t profile_missing;        /* CPUID 0AH EBX: events the CPU cannot count */
+static uint32_t profile_period;
+static uint8_t profile_counter_event[PROFILE_EVENTS];   /* Event on each counter in use */
+static uint32_t profile_active;         /* Counters in use */
+static volatile uint32_t profile_running;
+
+/* Function prototypes */
+uint32_t profiler_init(uint32_t (*this_cpu)(void));
+uint32_t profiler_start(uint32_t events, uint32_t period);
+void profiler_stop(void);
+uint32_t profiler_samples(void);
+uint32_t profiler_export(void (*emit)(const void* data, uint32_t size));
+uint32_t profiler_dump_serial(void);
+
+/* Local APIC (apic.c) */
+extern void lapic_enable(void);
+extern void lapic_write(uint32_t reg, uint32_t value);
+
+/* NMI routing (interrupt_handlers.c) */
+extern void nmi_install_handler(int (*handler)(uint32_t eip, uint32_t cs, uint32_t ebp));
+
+/* Stack unwinder and kernel symbols (unwind.c) */
+extern uint32_t unwind_stack(uint32_t ebp, uint32_t* frames, uint32_t max);
+extern uint32_t ksym_format(char* out, uint32_t size, uint32_t addr);
+
+/* Serial console (serial.c) */
+extern void serial_write(const void* data, uint32_t size);
+extern void serial_flush(void);
+
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    __asm__ __volatile__("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t low, high;
+    __asm__ __volatile__("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ __volatile__("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+/* A counter written through IA32_PMCx takes bits 31:0, sign-extended: -period counts up to overflow */
+static inline void profile_arm(uint32_t counter) {
+    wrmsr(MSR_PMC0 + counter, (uint32_t)-profile_period);
+}
+
+/* Has the counter wrapped past zero since it was armed; version 1 has no status register */
+static uint32_t profile_overflowed(void) {
+    if (profile_version >= 2) {
+        return (uint32_t)rdmsr(MSR_PERF_GLOBAL_STATUS) & ((1u << profile_active) - 1);
+    }
+    uint32_t status = 0;
+    for (uint32_t counter = 0; counter < profile_active; counter++) {
+        if (!((rdmsr(MSR_PMC0 + counter) >> (profile_width - 1)) & 1)) {
+            status |= 1u << counter;
+        }
+    }
+    return status;
+}
+
+/*
+ * The NMI: file a sample for each counter that overflowed and re-arm it.
+ * The APIC masks the LVT entry when it delivers, so it is opened again
+ * last. Returns 0 if no counter of ours overflowed.
+ */
+static int profile_nmi(uint32_t eip, uint32_t cs, uint32_t ebp) {
+    if (!profile_running) {
+        return 0;
+    }
+    uint32_t status = profile_overflowed();
+    if (!status) {
+        return 0;
+    }
+    uint32_t cpu = profile_this_cpu ? profile_this_cpu() : 0;
+    struct profile_ring* ring = &profile_rings[cpu];
+    for (uint32_t counter = 0; counter < profile_active; counter++) {
+        if (!(status & (1u << counter))) {
+            continue;
+        }
+        struct profile_sample* sample = &ring->samples[ring->head & PROFILE_RING_MASK];
+        sample->eip = eip;
+        sample->event = profile_counter_event[counter];
+        sample->cpu = (uint8_t)cpu;
+        sample->user = (cs & 3) != 0;
+        sample->depth = sample->user ? 0 : (uint8_t)unwind_stack(ebp, sample->callers, PROFILE_STACK_DEPTH);
+        ring->head++;
+        profile_arm(counter);
+    }
+    if (profile_version >= 2) {
+        wrmsr(MSR_PERF_GLOBAL_OVF_CTRL, status);
+    }
+    lapic_write(LAPIC_LVT_PERFMON, LAPIC_DELIVERY_NMI);
+    return 1;
+}
+
+/*
+ * Find the architectural PMU (CPUID leaf 0AH) and take over NMIs. this_cpu
+ * may be NULL on a uniprocessor. Returns the counters each CPU has, 0 if
+ * there is no PMU to sample with; the caller must have the local APIC
+ * mapped.
+ */
+uint32_t profiler_init(uint32_t (*this_cpu)(void)) {
+    uint32_t eax, ebx, ecx, edx;
+    profile_this_cpu = this_cpu;
+    profile_version = 0;
+    profile_running = 0;
+
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    uint32_t max_leaf = eax;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    if (max_leaf < 0x0A || !(edx & CPUID_FEAT_EDX_MSR) || !(edx & CPUID_FEAT_EDX_APIC)) {
+        return 0;
+    }
+    cpuid(0x0A, &eax, &ebx, &ecx, &edx);
+    if (!(eax & 0xFF) || !((eax >> 8) & 0xFF)) {
+        return 0;
+    }
+    profile_version = eax & 0xFF;
+    profile_counters = (eax >> 8) & 0xFF;
+    profile_width = (eax >> 16) & 0xFF;
+    profile_missing = ebx;
+
+    lapic_enable();
+    lapic_write(LAPIC_LVT_PERFMON, LAPIC_DELIVERY_NMI | LAPIC_LVT_MASKED);
+    nmi_install_handler(profile_nmi);
+    return profile_counters;
+}
+
+/*
+ * Sample this CPU every period occurrences of each event in the mask
+ * (bit PROFILE_x for event x), one counter per event, in both rings.
+ * Events the CPU cannot count, or beyond its counters, are left out.
+ * The rings are emptied. Returns the mask of events being sampled.
+ */
+uint32_t profiler_start(uint32_t events, uint32_t period) {
+    if (!profile_version || !period || period > 0x7FFFFFFF) {
+        return 0;
+    }
+    profiler_stop();
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        profile_rings[cpu].head = 0;
+    }
+    profile_period = period;
+    profile_active = 0;
+
+    uint32_t sampled = 0;
+    for (uint32_t event = 0; event < PROFILE_EVENTS && profile_active < profile_counters; event++) {
+        if (!(events & (1u << event)) || (profile_missing & (1u << profile_events[event].missing_bit))) {
+            continue;
+        }
+        uint32_t counter = profile_active++;
+        profile_counter_event[counter] = (uint8_t)event;
+        wrmsr(MSR_PERFEVTSEL0 + counter, 0);
+        profile_arm(counter);
+        wrmsr(MSR_PERFEVTSEL0 + counter, profile_events[event].select | (profile_events[event].umask << 8) |
+                                         EVTSEL_USR | EVTSEL_OS | EVTSEL_INT | EVTSEL_EN);
+        sampled |= 1u << event;
+    }
+    if (!profile_active) {
+        return 0;
+    }
+    profile_running = 1;
+    lapic_write(LAPIC_LVT_PERFMON, LAPIC_DELIVERY_NMI);
+    if (profile_version >= 2) {
+        wrmsr(MSR_PERF_GLOBAL_OVF_CTRL, (1u << profile_active) - 1);
+        wrmsr(MSR_PERF_GLOBAL_CTRL, (1u << profile_active) - 1);
+    }
+    return sampled;
+}
+
+/* Stop the counters; the samples stay until the next start */
+void profiler_stop(void) {
+    if (!profile_version) {
+        return;
+    }
+    if (profile_version >= 2) {
+        wrmsr(MSR_PERF_GLOBAL_CTRL, 0);
+    }
+    for (uint32_t counter = 0; counter < profile_active; counter++) {
+        wrmsr(MSR_PERFEVTSEL0 + counter, 0);
+    }
+    lapic_write(LAPIC_LVT_PERFMON, LAPIC_DELIVERY_NMI | LAPIC_LVT_MASKED);
+    profile_running = 0;
+}
+
+/* Samples held over all CPUs */
+uint32_t profiler_samples(void) {
+    uint32_t total = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        uint32_t head = profile_rings[cpu].head;
+        total += head < PROFILE_RING_SAMPLES ? head : PROFILE_RING_SAMPLES;
+    }
+    return total;
+}
+
+static char* profile_puts(char* out, const char* text) {
+    while (*text) {
+        *out++ = *text++;
+    }
+    return out;
+}
+
+static char* profile_puthex(char* out, uint32_t value, int digits) {
+    static const char hex[] = "0123456789abcdef";
+    for (int i = digits - 1; i >= 0; i--) {
+        *out++ = hex[(value >> (i * 4)) & 0xF];
+    }
+    return out;
+}
+
+/* One perf script frame line: the address in hex, its symbol and where it ran */
+static char* profile_putframe(char* out, uint32_t addr, int user) {
+    out = profile_puts(out, "\t");
+    out = profile_puthex(out, addr, 8);
+    out = profile_puts(out, " ");
+    if (user) {
+        return profile_puts(out, "[unknown] (user)\n");
+    }
+    char symbol[PROFILE_SYMBOL_MAX];
+    ksym_format(symbol, sizeof(symbol), addr);
+    out = profile_puts(out, symbol);
+    return profile_puts(out, " (kernel)\n");
+}
+
+/*
+ * Export the samples through emit, with the profiler stopped, as perf
+ * script text: a header line per sample, then its frames innermost
+ * first, each an address and the symbol holding it. stackcollapse-perf.pl
+ * folds it for flamegraph.pl. Kernel stacks are the sampled EIP and up to
+ * PROFILE_STACK_DEPTH callers; user ones only the EIP. Returns the
+ * samples exported.
+ */
+uint32_t profiler_export(void (*emit)(const void* data, uint32_t size)) {
+    uint32_t exported = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        const struct profile_ring* ring = &profile_rings[cpu];
+        uint32_t head = ring->head;
+        uint32_t count = head < PROFILE_RING_SAMPLES ? head : PROFILE_RING_SAMPLES;
+        for (uint32_t i = head - count; i != head; i++) {
+            const struct profile_sample* sample = &ring->samples[i & PROFILE_RING_MASK];
+            char line[48 + (PROFILE_STACK_DEPTH + 1) * (PROFILE_SYMBOL_MAX + 20)];
+            char* out = line;
+            out = profile_puts(out, sample->user ? "user 0 [" : "kernel 0 [");
+            out = profile_puthex(out, sample->cpu, 3);
+            out = profile_puts(out, "] 1 ");
+            out = profile_puts(out, profile_events[sample->event].name);
+            out = profile_puts(out, ":\n");
+            out = profile_putframe(out, sample->eip, sample->user);
+            for (uint32_t frame = 0; frame < sample->depth; frame++) {
+                out = profile_putframe(out, sample->callers[frame], 0);
+            }
+            out = profile_puts(out, "\n");
+            emit(line, (uint32_t)(out - line));
+            exported++;
+        }
+    }
+    return exported;
+}
+
+/* Stop sampling and dump the samples to COM1: run QEMU with -serial file:profile.txt */
+uint32_t profiler_dump_serial(void) {
+    profiler_stop();
+    uint32_t exported = profiler_export(serial_write);
+    serial_flush();
+    return exported;
+}
@@ -0,0 +1,183 @@
+/*
+ * Tiny Operating System - RAM Disk
+ * Block devices kept in page frames, allocated as sectors are first written
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SECTOR_SIZE 512
+#define PAGE_SIZE 4096
+#define SECTORS_PER_PAGE (PAGE_SIZE / SECTOR_SIZE)
+
+#define RAMDISK_FRAMES 256              /* 1 MiB shared by every RAM disk */
+#define RAMDISK_MAX_DISKS 4
+#define RAMDISK_MAX_PAGES 1024          /* Largest disk: 4 MiB */
+#define RAMDISK_DEVICES 8               /* Block layer device numbers (BLK_MAX_DEVICES) */
+
+/*
+ * One disk: a page table from page index to frame. Pages nobody wrote
+ * have no frame and read as zeros, so a disk only costs what it holds.
+ */
+struct ramdisk {
+    uint32_t sectors;
+    uint32_t pages_used;
+    uint8_t* pages[RAMDISK_MAX_PAGES];
+};
+
+static uint8_t ramdisk_frames[RAMDISK_FRAMES][PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+static uint8_t* ramdisk_free_frames;    /* Linked through each frame's first word */
+static uint32_t ramdisk_frames_free;
+static struct ramdisk ramdisks[RAMDISK_MAX_DISKS];
+static uint32_t ramdisk_count;
+static struct ramdisk* ramdisk_by_device[RAMDISK_DEVICES];
+
+/* Block layer (block.c) */
+extern int blk_register(const char* name, uint32_t sectors, uint32_t depth, uint32_t max_sectors,
+                        int (*transfer)(uint32_t sector, uint32_t count, uint8_t* buffer, int write, void* cookie),
+                        void (*poll)(void));
+extern void blk_complete(void* cookie, int status);
+extern int blk_request_device(void* cookie);
+extern void blk_set_map(uint32_t device, void* (*map)(uint32_t device, uint32_t sector));
+
+/* Function prototypes */
+void ramdisk_init(void);
+int ramdisk_create(const char* name, uint32_t sectors, int shared);
+int ramdisk_read(int device, uint32_t sector, uint32_t count, void* buffer);
+int ramdisk_write(int device, uint32_t sector, uint32_t count, const void* buffer);
+uint32_t ramdisk_frames_available(void);
+
+/* Word-sized copies: transfers are whole sectors */
+static inline void ramdisk_copy(void* dest, const void* src, uint32_t size) {
+    uint32_t words = size / 4;
+    __asm__ __volatile__("cld; rep movsl"
+                         : "+D"(dest), "+S"(src), "+c"(words)
+                         :
+                         : "memory");
+}
+
+static inline void ramdisk_zero(void* dest, uint32_t size) {
+    uint32_t words = size / 4;
+    __asm__ __volatile__("cld; rep stosl"
+                         : "+D"(dest), "+c"(words)
+                         : "a"(0)
+                         : "memory");
+}
+
+void ramdisk_init(void) {
+    ramdisk_free_frames = NULL;
+    for (uint32_t i = 0; i < RAMDISK_FRAMES; i++) {
+        *(uint8_t**)ramdisk_frames[i] = ramdisk_free_frames;
+        ramdisk_free_frames = ramdisk_frames[i];
+    }
+    ramdisk_frames_free = RAMDISK_FRAMES;
+    ramdisk_count = 0;
+    for (uint32_t i = 0; i < RAMDISK_DEVICES; i++) {
+        ramdisk_by_device[i] = NULL;
+    }
+}
+
+static struct ramdisk* ramdisk_get(int device) {
+    return device >= 0 && device < RAMDISK_DEVICES ? ramdisk_by_device[device] : NULL;
+}
+
+/* The frame behind page, allocated and zeroed on first use; NULL when out of frames */
+static uint8_t* ramdisk_page(struct ramdisk* disk, uint32_t page, int allocate) {
+    if (disk->pages[page] || !allocate || !ramdisk_free_frames) {
+        return disk->pages[page];
+    }
+    uint8_t* frame = ramdisk_free_frames;
+    ramdisk_free_frames = *(uint8_t**)frame;
+    ramdisk_frames_free--;
+    ramdisk_zero(frame, PAGE_SIZE);
+    disk->pages[page] = frame;
+    disk->pages_used++;
+    return frame;
+}
+
+/* Copy count sectors in or out, a page at a time; -1 if a write runs out of frames */
+static int ramdisk_io(struct ramdisk* disk, uint32_t sector, uint32_t count, uint8_t* buffer, int write) {
+    if (sector >= disk->sectors || count > disk->sectors - sector) {
+        return -1;
+    }
+    while (count) {
+        uint32_t offset = sector % SECTORS_PER_PAGE;
+        uint32_t chunk = SECTORS_PER_PAGE - offset;
+        if (chunk > count) {
+            chunk = count;
+        }
+        uint8_t* page = ramdisk_page(disk, sector / SECTORS_PER_PAGE, write);
+        if (write) {
+            if (!page) {
+                return -1;
+            }
+            ramdisk_copy(page + offset * SECTOR_SIZE, buffer, chunk * SECTOR_SIZE);
+        } else if (page) {
+            ramdisk_copy(buffer, page + offset * SECTOR_SIZE, chunk * SECTOR_SIZE);
+        } else {
+            ramdisk_zero(buffer, chunk * SECTOR_SIZE);
+        }
+        sector += chunk;
+        count -= chunk;
+        buffer += chunk * SECTOR_SIZE;
+    }
+    return 0;
+}
+
+static int ramdisk_transfer(uint32_t sector, uint32_t count, uint8_t* buffer, int write, void* cookie) {
+    struct ramdisk* disk = ramdisk_get(blk_request_device(cookie));
+    blk_complete(cookie, disk ? ramdisk_io(disk, sector, count, buffer, write) : -1);
+    return 0;
+}
+
+/* Hand out the page itself: a mapping may be written, so holes get a frame */
+static void* ramdisk_map(uint32_t device, uint32_t sector) {
+    struct ramdisk* disk = ramdisk_get((int)device);
+    if (!disk) {
+        return NULL;
+    }
+    uint8_t* page = ramdisk_page(disk, sector / SECTORS_PER_PAGE, 1);
+    return page ? page + (sector % SECTORS_PER_PAGE) * SECTOR_SIZE : NULL;
+}
+
+/*
+ * Register a RAM disk of the given size with the block layer; its frames
+ * come from the shared pool as it fills. With shared, the buffer cache
+ * maps the disk's pages instead of copying them. Returns the block device
+ * number, or -1.
+ */
+int ramdisk_create(const char* name, uint32_t sectors, int shared) {
+    if (ramdisk_count == RAMDISK_MAX_DISKS || !sectors || sectors > RAMDISK_MAX_PAGES * SECTORS_PER_PAGE) {
+        return -1;
+    }
+    int device = blk_register(name, sectors, 1, 0, ramdisk_transfer, NULL);
+    if (device < 0 || device >= RAMDISK_DEVICES) {
+        return -1;
+    }
+    struct ramdisk* disk = &ramdisks[ramdisk_count++];
+    disk->sectors = sectors;
+    disk->pages_used = 0;
+    for (uint32_t i = 0; i < RAMDISK_MAX_PAGES; i++) {
+        disk->pages[i] = NULL;
+    }
+    ramdisk_by_device[device] = disk;
+    if (shared) {
+        blk_set_map((uint32_t)device, ramdisk_map);
+    }
+    return device;
+}
+
+/* Direct access, bypassing the request queue */
+int ramdisk_read(int device, uint32_t sector, uint32_t count, void* buffer) {
+    struct ramdisk* disk = ramdisk_get(device);
+    return disk ? ramdisk_io(disk, sector, count, (uint8_t*)buffer, 0) : -1;
+}
+
+int ramdisk_write(int device, uint32_t sector, uint32_t count, const void* buffer) {
+    struct ramdisk* disk = ramdisk_get(device);
+    return disk ? ramdisk_io(disk, sector, count, (uint8_t*)buffer, 1) : -1;
+}
+
+uint32_t ramdisk_frames_available(void) {
+    return ramdisk_frames_free;
+}
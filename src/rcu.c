@@ -0,0 +1,86 @@
+/*
+ * Tiny Operating System - Read-Copy-Update
+ * Quiescent-state-based RCU for read-mostly tables: lookups take no lock
+ * and write nothing shared, updaters publish and then wait out the readers
+ */
+
+#include <stdint.h>
+
+#define RCU_MAX_CPUS 8                  /* Must match smp.c */
+#define CACHE_LINE_SIZE 64
+
+/*
+ * A reader holds RCU-protected pointers only between two quiescent
+ * states, the points where its CPU holds none: a context switch, the idle
+ * loop, the end of a top-level event. Nothing marks the read side, so a
+ * lookup costs the same on one CPU as on eight.
+ *
+ * An updater unlinks the old version (or publishes the new one) with a
+ * release store, then calls synchronize_rcu: that opens grace period N
+ * and waits until every CPU has reported a quiescent state with N in
+ * view. Any reader that could have seen the old version started before
+ * N and has finished by then, so the old version may be freed or reused.
+ */
+struct rcu_cpu {
+    uint32_t seen;                      /* Newest grace period this CPU was quiescent in */
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static uint32_t rcu_gp_seq;             /* Grace periods opened */
+static struct rcu_cpu rcu_cpus[RCU_MAX_CPUS];
+static uint32_t rcu_cpu_count = 1;
+static uint32_t (*rcu_this_cpu)(void);
+static uint32_t rcu_grace_periods;      /* Completed */
+
+/* Function prototypes */
+void rcu_init(uint32_t cpu_count, uint32_t (*this_cpu)(void));
+void rcu_quiescent_state(void);
+void synchronize_rcu(void);
+uint32_t rcu_get_grace_periods(void);
+
+static inline void cpu_relax(void) {
+    __asm__ __volatile__("pause" : : : "memory");
+}
+
+/* CPUs 0 to cpu_count - 1 take part; this_cpu may be NULL on a uniprocessor */
+void rcu_init(uint32_t cpu_count, uint32_t (*this_cpu)(void)) {
+    rcu_cpu_count = cpu_count && cpu_count <= RCU_MAX_CPUS ? cpu_count : 1;
+    rcu_this_cpu = this_cpu;
+    rcu_gp_seq = 0;
+    rcu_grace_periods = 0;
+    for (uint32_t cpu = 0; cpu < RCU_MAX_CPUS; cpu++) {
+        rcu_cpus[cpu].seen = 0;
+    }
+}
+
+/*
+ * The calling CPU holds no RCU-protected pointer. One shared load and a
+ * store to this CPU's own line: cheap enough for every context switch.
+ * x86 never moves a load after a later store, so the release store is
+ * ordered after every read the CPU made of the old version.
+ */
+void rcu_quiescent_state(void) {
+    uint32_t cpu = rcu_this_cpu ? rcu_this_cpu() : 0;
+    uint32_t seq = __atomic_load_n(&rcu_gp_seq, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&rcu_cpus[cpu].seen, seq, __ATOMIC_RELEASE);
+}
+
+/*
+ * Wait until every reader that may hold what the caller just unlinked has
+ * finished. The caller must not be a reader itself; it counts as
+ * quiescent while it waits, so two CPUs synchronizing at once both finish.
+ * Other CPUs report at their next switch or idle pass, at worst a tick.
+ */
+void synchronize_rcu(void) {
+    uint32_t target = __atomic_add_fetch(&rcu_gp_seq, 1, __ATOMIC_SEQ_CST);
+    for (uint32_t cpu = 0; cpu < rcu_cpu_count; cpu++) {
+        while ((int32_t)(__atomic_load_n(&rcu_cpus[cpu].seen, __ATOMIC_ACQUIRE) - target) < 0) {
+            rcu_quiescent_state();
+            cpu_relax();
+        }
+    }
+    __atomic_fetch_add(&rcu_grace_periods, 1, __ATOMIC_RELAXED);
+}
+
+uint32_t rcu_get_grace_periods(void) {
+    return __atomic_load_n(&rcu_grace_periods, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,287 @@
+/*
+ * Tiny Operating System - Resource Groups
+ * Hierarchical CPU and memory controls, as cgroups: each group has a
+ * parent, a CPU quota per period and a memory limit, and a charge counts
+ * against the group and every ancestor, so a limit on a parent holds for
+ * everything below it however its children are set. Group 0 is the root:
+ * unlimited and uncounted, so a task outside any group pays one compare.
+ * The scheduler asks whether a task's group may run and charges what it
+ * ran; the allocators charge the group of the running task.
+ */
+
+#include <stdint.h>
+
+#define MAX_CPUS 8                      /* Must match smp.c */
+#define RGROUP_MAX 16
+#define RGROUP_NAME_LEN 16
+#define RGROUP_ROOT 0
+#define RGROUP_UNLIMITED 0xFFFFFFFFu
+
+struct rgroup {
+    char name[RGROUP_NAME_LEN];
+    uint32_t parent;
+    uint32_t in_use;
+
+    /* CPU: quota_ns per period_ns; quota_ns 0 is no limit */
+    uint64_t quota_ns;
+    uint64_t period_ns;
+    uint64_t period_start;
+    uint64_t period_used;
+    uint32_t throttled;
+
+    /* Memory, in bytes */
+    uint32_t mem_limit;
+    uint32_t mem_usage;
+    uint32_t mem_max_usage;
+
+    /* Totals since creation */
+    uint64_t cpu_usage_ns;
+    uint32_t nr_throttled;              /* Periods in which the quota ran out */
+    uint32_t mem_failcnt;               /* Charges this group's limit refused */
+};
+
+/* What rgroup_get_stats reports (must match the users' copies) */
+struct rgroup_stats {
+    uint64_t cpu_usage_ns;
+    uint32_t nr_throttled;
+    uint32_t mem_usage;
+    uint32_t mem_max_usage;
+    uint32_t mem_failcnt;
+};
+
+static struct rgroup rgroups[RGROUP_MAX];
+static uint32_t rgroup_current_id[MAX_CPUS];
+static uint32_t (*rgroup_this_cpu)(void);
+static volatile uint32_t rgroup_lock_word;
+
+/* Function prototypes */
+void rgroup_init(uint32_t (*this_cpu)(void));
+int rgroup_create(const char* name, uint32_t parent);
+int rgroup_valid(uint32_t id);
+int rgroup_set_cpu(uint32_t id, uint64_t quota_ns, uint64_t period_ns);
+int rgroup_set_mem(uint32_t id, uint32_t limit);
+void rgroup_charge_cpu(uint32_t id, uint64_t runtime, uint64_t now);
+int rgroup_cpu_throttled(uint32_t id, uint64_t now);
+int rgroup_charge_mem(uint32_t id, uint32_t bytes);
+void rgroup_uncharge_mem(uint32_t id, uint32_t bytes);
+void rgroup_enter(uint32_t id);
+uint32_t rgroup_current(void);
+int rgroup_get_stats(uint32_t id, struct rgroup_stats* stats);
+
+/* One lock for the whole table, interrupts off: charges come from the allocators and the timer */
+static uint32_t rgroup_lock(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    while (__atomic_exchange_n(&rgroup_lock_word, 1, __ATOMIC_ACQUIRE)) {
+        __asm__ __volatile__("pause");
+    }
+    return flags;
+}
+
+static void rgroup_unlock(uint32_t flags) {
+    __atomic_store_n(&rgroup_lock_word, 0, __ATOMIC_RELEASE);
+    __asm__ __volatile__("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+}
+
+/* Forget every group but the root; every CPU starts in it. With NULL, everything is CPU 0 */
+void rgroup_init(uint32_t (*this_cpu)(void)) {
+    for (uint32_t i = 0; i < RGROUP_MAX; i++) {
+        rgroups[i].in_use = 0;
+    }
+    struct rgroup* root = &rgroups[RGROUP_ROOT];
+    const char* name = "root";
+    for (uint32_t i = 0; i < RGROUP_NAME_LEN; i++) {
+        root->name[i] = i < 4 ? name[i] : '\0';
+    }
+    root->in_use = 1;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        rgroup_current_id[cpu] = RGROUP_ROOT;
+    }
+    rgroup_this_cpu = this_cpu;
+}
+
+int rgroup_valid(uint32_t id) {
+    return id < RGROUP_MAX && rgroups[id].in_use;
+}
+
+/* A new group under parent with no limits; returns its id, or -1 when full or parent is not a group */
+int rgroup_create(const char* name, uint32_t parent) {
+    uint32_t flags = rgroup_lock();
+    if (!rgroup_valid(parent)) {
+        rgroup_unlock(flags);
+        return -1;
+    }
+    for (uint32_t id = 1; id < RGROUP_MAX; id++) {
+        struct rgroup* group = &rgroups[id];
+        if (group->in_use) {
+            continue;
+        }
+        uint8_t* bytes = (uint8_t*)group;
+        for (uint32_t i = 0; i < sizeof(*group); i++) {
+            bytes[i] = 0;
+        }
+        for (uint32_t i = 0; i < RGROUP_NAME_LEN - 1 && name[i]; i++) {
+            group->name[i] = name[i];
+        }
+        group->parent = parent;
+        group->mem_limit = RGROUP_UNLIMITED;
+        group->in_use = 1;
+        rgroup_unlock(flags);
+        return (int)id;
+    }
+    rgroup_unlock(flags);
+    return -1;
+}
+
+/* Let the group run quota_ns in every period_ns; quota 0 lifts the limit. Not for the root */
+int rgroup_set_cpu(uint32_t id, uint64_t quota_ns, uint64_t period_ns) {
+    if (id == RGROUP_ROOT || !rgroup_valid(id) || (quota_ns && (!period_ns || quota_ns > period_ns))) {
+        return -1;
+    }
+    uint32_t flags = rgroup_lock();
+    rgroups[id].quota_ns = quota_ns;
+    rgroups[id].period_ns = period_ns;
+    rgroups[id].period_used = 0;
+    rgroups[id].throttled = 0;
+    rgroup_unlock(flags);
+    return 0;
+}
+
+/* Cap the group's bytes; -1 for the root or a limit below what it already holds */
+int rgroup_set_mem(uint32_t id, uint32_t limit) {
+    if (id == RGROUP_ROOT || !rgroup_valid(id)) {
+        return -1;
+    }
+    uint32_t flags = rgroup_lock();
+    int result = -1;
+    if (limit >= rgroups[id].mem_usage) {
+        rgroups[id].mem_limit = limit;
+        result = 0;
+    }
+    rgroup_unlock(flags);
+    return result;
+}
+
+/*
+ * Move the group's period on to the one containing now, starting it
+ * afresh. Periods are skipped by doubling rather than divided out: there
+ * is no 64-bit division without libgcc.
+ */
+static void rgroup_refill(struct rgroup* group, uint64_t now) {
+    if (!group->quota_ns || now - group->period_start < group->period_ns) {
+        return;
+    }
+    uint64_t behind = now - group->period_start;
+    while (behind >= group->period_ns) {
+        uint64_t step = group->period_ns;
+        while (step <= behind - step) {
+            step <<= 1;
+        }
+        group->period_start += step;
+        behind -= step;
+    }
+    group->period_used = 0;
+    group->throttled = 0;
+}
+
+/* Charge runtime ns, ended at now, to the group and its ancestors */
+void rgroup_charge_cpu(uint32_t id, uint64_t runtime, uint64_t now) {
+    if (id == RGROUP_ROOT || !rgroup_valid(id)) {
+        return;
+    }
+    uint32_t flags = rgroup_lock();
+    for (; id != RGROUP_ROOT; id = rgroups[id].parent) {
+        struct rgroup* group = &rgroups[id];
+        rgroup_refill(group, now);
+        group->cpu_usage_ns += runtime;
+        if (!group->quota_ns) {
+            continue;
+        }
+        group->period_used += runtime;
+        if (!group->throttled && group->period_used >= group->quota_ns) {
+            group->throttled = 1;
+            group->nr_throttled++;
+        }
+    }
+    rgroup_unlock(flags);
+}
+
+/* Whether the group, or any ancestor, has used its quota for the period containing now */
+int rgroup_cpu_throttled(uint32_t id, uint64_t now) {
+    if (id == RGROUP_ROOT || !rgroup_valid(id)) {
+        return 0;
+    }
+    uint32_t flags = rgroup_lock();
+    int throttled = 0;
+    for (; id != RGROUP_ROOT; id = rgroups[id].parent) {
+        rgroup_refill(&rgroups[id], now);
+        throttled |= rgroups[id].throttled;
+    }
+    rgroup_unlock(flags);
+    return throttled;
+}
+
+/*
+ * Charge bytes to the group and its ancestors, all or nothing: -1, with
+ * nothing charged, when any of them would go over its limit. The refusal
+ * counts against the group whose limit it was.
+ */
+int rgroup_charge_mem(uint32_t id, uint32_t bytes) {
+    if (id == RGROUP_ROOT || !rgroup_valid(id)) {
+        return 0;
+    }
+    uint32_t flags = rgroup_lock();
+    for (uint32_t at = id; at != RGROUP_ROOT; at = rgroups[at].parent) {
+        struct rgroup* group = &rgroups[at];
+        if (bytes > group->mem_limit - group->mem_usage) {
+            group->mem_failcnt++;
+            rgroup_unlock(flags);
+            return -1;
+        }
+    }
+    for (; id != RGROUP_ROOT; id = rgroups[id].parent) {
+        struct rgroup* group = &rgroups[id];
+        group->mem_usage += bytes;
+        if (group->mem_usage > group->mem_max_usage) {
+            group->mem_max_usage = group->mem_usage;
+        }
+    }
+    rgroup_unlock(flags);
+    return 0;
+}
+
+void rgroup_uncharge_mem(uint32_t id, uint32_t bytes) {
+    if (id == RGROUP_ROOT || !rgroup_valid(id)) {
+        return;
+    }
+    uint32_t flags = rgroup_lock();
+    for (; id != RGROUP_ROOT; id = rgroups[id].parent) {
+        struct rgroup* group = &rgroups[id];
+        group->mem_usage = group->mem_usage > bytes ? group->mem_usage - bytes : 0;
+    }
+    rgroup_unlock(flags);
+}
+
+/* The group this CPU's allocations are charged to from now on; the scheduler sets it at each switch */
+void rgroup_enter(uint32_t id) {
+    uint32_t cpu = rgroup_this_cpu ? rgroup_this_cpu() : 0;
+    rgroup_current_id[cpu] = rgroup_valid(id) ? id : RGROUP_ROOT;
+}
+
+uint32_t rgroup_current(void) {
+    return rgroup_current_id[rgroup_this_cpu ? rgroup_this_cpu() : 0];
+}
+
+int rgroup_get_stats(uint32_t id, struct rgroup_stats* stats) {
+    if (!rgroup_valid(id)) {
+        return -1;
+    }
+    uint32_t flags = rgroup_lock();
+    stats->cpu_usage_ns = rgroups[id].cpu_usage_ns;
+    stats->nr_throttled = rgroups[id].nr_throttled;
+    stats->mem_usage = rgroups[id].mem_usage;
+    stats->mem_max_usage = rgroups[id].mem_max_usage;
+    stats->mem_failcnt = rgroups[id].mem_failcnt;
+    rgroup_unlock(flags);
+    return 0;
+}
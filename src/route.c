@@ -0,0 +1,415 @@
+/*
+ * Tiny Operating System - IPv4 Routing Table
+ * Longest-prefix match over any number of interfaces. Routes live in a
+ * table kept sorted by prefix, and every change compiles them into a
+ * lookup structure after poptrie: the top 12 bits of the address index a
+ * flat table, and below that each node covers 5 more bits with two
+ * bitmaps, one of the children that are nodes and one of where a run of
+ * equal leaves starts, so a child is found by counting set bits rather
+ * than stored as a pointer. A lookup is one load from the flat table and
+ * at most four small nodes, however many routes there are.
+ *
+ * Lookups take no lock. A change builds the other of two copies and
+ * publishes it, then waits out the readers of the old one before it can
+ * be built over. Both copies and the table take over half a megabyte, so
+ * they come from the stage's frames at init rather than its image.
+ */
+
+#include <stdint.h>
+
+#define ROUTE_MAX 2048                  /* Routes in the table */
+#define ROUTE_NEXTHOPS 256              /* Distinct device and gateway pairs, the first meaning none */
+#define ROUTE_DIRECT_BITS 12
+#define ROUTE_STRIDE 5                  /* Bits a node covers: its bitmaps are one word each */
+#define ROUTE_FIB_NODES 8192
+#define ROUTE_FIB_LEAVES 16384
+#define ROUTE_LEAF 0x80000000u          /* In the flat table: a next hop, not a node */
+#define PAGE_SIZE 4096
+
+/* What a lookup finds (must match kernel_network.c) */
+struct route_nexthop {
+    uint32_t device;
+    uint32_t gateway;                   /* 0 when the destination is on the link */
+};
+
+struct route_entry {
+    uint32_t prefix;
+    uint32_t len;
+    struct route_nexthop nexthop;
+};
+
+struct route_node {
+    uint32_t vector;                    /* Children that are nodes */
+    uint32_t leafvec;                   /* Leaf children that start a run of a new next hop */
+    uint32_t base0;                     /* The node's first leaf */
+    uint32_t base1;                     /* Its first child node; the others follow it */
+};
+
+struct route_fib {
+    uint32_t direct[1u << ROUTE_DIRECT_BITS];
+    struct route_node nodes[ROUTE_FIB_NODES];
+    uint16_t leaves[ROUTE_FIB_LEAVES];
+    struct route_nexthop nexthops[ROUTE_NEXTHOPS];
+    uint32_t node_count;
+    uint32_t leaf_count;
+    uint32_t nexthop_count;
+};
+
+/* Read-copy-update (rcu.c) */
+extern void synchronize_rcu(void);
+
+/* Physical frames (the stage's paging_alloc_frames) */
+extern uint32_t paging_alloc_frames(uint32_t order);
+
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_CONSUME)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+static struct route_entry* route_table;            /* ROUTE_MAX, sorted by prefix, then length */
+static uint32_t route_count;
+static struct route_fib* route_fibs;    /* Two, the table after them */
+static struct route_fib* route_fib;     /* The copy lookups use */
+static uint16_t route_entry_nexthop[ROUTE_MAX];     /* While building: each route's next hop index */
+static uint32_t route_generation_count;
+static volatile uint32_t route_lock_word;
+
+/* Function prototypes */
+void route_init(void);
+int route_add(uint32_t prefix, uint32_t len, uint32_t device, uint32_t gateway);
+int route_del(uint32_t prefix, uint32_t len);
+void route_flush_device(uint32_t device);
+void route_invalidate(void);
+int route_lookup(uint32_t dest, struct route_nexthop* nexthop);
+uint32_t route_generation(void);
+uint32_t route_get_count(void);
+
+/* Changes only, from process context; lookups never take it */
+static void route_lock(void) {
+    while (__atomic_exchange_n(&route_lock_word, 1, __ATOMIC_ACQUIRE)) {
+        __asm__ __volatile__("pause");
+    }
+}
+
+static void route_unlock(void) {
+    __atomic_store_n(&route_lock_word, 0, __ATOMIC_RELEASE);
+}
+
+/* There is no popcnt before SSE4.2, nor libgcc for the builtin */
+static inline uint32_t route_popcount(uint32_t x) {
+    x = x - ((x >> 1) & 0x55555555u);
+    x = (x & 0x33333333u) + ((x >> 2) & 0x33333333u);
+    x = (x + (x >> 4)) & 0x0F0F0F0Fu;
+    return (x * 0x01010101u) >> 24;
+}
+
+static uint32_t route_mask(uint32_t len) {
+    return len ? 0xFFFFFFFFu << (32 - len) : 0;
+}
+
+/* The children of a node at depth bits a route covers, as a first index and a count */
+static uint32_t route_child(uint32_t prefix, uint32_t depth) {
+    return (prefix << depth) >> (32 - ROUTE_STRIDE);
+}
+
+/* The index of a next hop in the copy being built, added if new; 0 when the copy has no room */
+static uint16_t route_nexthop_index(struct route_fib* fib, const struct route_nexthop* nexthop) {
+    for (uint32_t i = 1; i < fib->nexthop_count; i++) {
+        if (fib->nexthops[i].device == nexthop->device && fib->nexthops[i].gateway == nexthop->gateway) {
+            return (uint16_t)i;
+        }
+    }
+    if (fib->nexthop_count == ROUTE_NEXTHOPS) {
+        return 0;
+    }
+    fib->nexthops[fib->nexthop_count] = *nexthop;
+    return (uint16_t)fib->nexthop_count++;
+}
+
+/*
+ * Fill the node at index, depth bits below the root, from the routes
+ * first to last - 1, all inside it and longer than depth. Children start
+ * as fallback, the next hop of the longest route covering the whole node.
+ * In prefix order a route that overlaps an earlier one lies inside it, so
+ * painting the short routes in order leaves each child its longest match.
+ * Returns 0 when the copy runs out of room.
+ */
+static int route_build_node(struct route_fib* fib, uint32_t index, uint32_t first, uint32_t last,
+                            uint32_t depth, uint16_t fallback) {
+    uint16_t value[1u << ROUTE_STRIDE];
+    uint32_t vector = 0;
+    for (uint32_t c = 0; c < (1u << ROUTE_STRIDE); c++) {
+        value[c] = fallback;
+    }
+    for (uint32_t r = first; r < last; r++) {
+        const struct route_entry* route = &route_table[r];
+        uint32_t child = route_child(route->prefix, depth);
+        if (route->len > depth + ROUTE_STRIDE) {
+            vector |= 1u << child;
+            continue;
+        }
+        for (uint32_t c = 0; c < (1u << (depth + ROUTE_STRIDE - route->len)); c++) {
+            value[child + c] = route_entry_nexthop[r];
+        }
+    }
+
+    uint32_t children = route_popcount(vector);
+    if (fib->node_count + children > ROUTE_FIB_NODES) {
+        return 0;
+    }
+    struct route_node* node = &fib->nodes[index];
+    node->vector = vector;
+    node->leafvec = 0;
+    node->base0 = fib->leaf_count;
+    node->base1 = fib->node_count;
+    fib->node_count += children;
+
+    /* Leaves the same as the last one stored share it, child nodes between them or not */
+    int stored = 0;
+    for (uint32_t c = 0; c < (1u << ROUTE_STRIDE); c++) {
+        if ((vector & (1u << c)) || (stored && fib->leaves[fib->leaf_count - 1] == value[c])) {
+            continue;
+        }
+        if (fib->leaf_count == ROUTE_FIB_LEAVES) {
+            return 0;
+        }
+        fib->leaves[fib->leaf_count++] = value[c];
+        node->leafvec |= 1u << c;
+        stored = 1;
+    }
+
+    /* The routes under one child node are contiguous, the ones covering it having come first */
+    uint32_t slot = node->base1;
+    for (uint32_t r = first; r < last;) {
+        if (route_table[r].len <= depth + ROUTE_STRIDE) {
+            r++;
+            continue;
+        }
+        uint32_t child = route_child(route_table[r].prefix, depth);
+        uint32_t end = r + 1;
+        while (end < last && route_child(route_table[end].prefix, depth) == child) {
+            end++;
+        }
+        if (!route_build_node(fib, slot++, r, end, depth + ROUTE_STRIDE, value[child])) {
+            return 0;
+        }
+        r = end;
+    }
+    return 1;
+}
+
+/* Compile the whole table into fib; 0 when it does not fit */
+static int route_build(struct route_fib* fib) {
+    fib->node_count = 0;
+    fib->leaf_count = 0;
+    fib->nexthop_count = 1;
+    fib->nexthops[0].device = 0;
+    fib->nexthops[0].gateway = 0;
+    for (uint32_t r = 0; r < route_count; r++) {
+        route_entry_nexthop[r] = route_nexthop_index(fib, &route_table[r].nexthop);
+        if (!route_entry_nexthop[r]) {
+            return 0;
+        }
+    }
+
+    /* The flat table is painted like a node's children, then its slots with longer routes become nodes */
+    const uint32_t shift = 32 - ROUTE_DIRECT_BITS;
+    for (uint32_t i = 0; i < (1u << ROUTE_DIRECT_BITS); i++) {
+        fib->direct[i] = ROUTE_LEAF;
+    }
+    for (uint32_t r = 0; r < route_count; r++) {
+        const struct route_entry* route = &route_table[r];
+        if (route->len <= ROUTE_DIRECT_BITS) {
+            uint32_t slot = route->prefix >> shift;
+            for (uint32_t i = 0; i < (1u << (ROUTE_DIRECT_BITS - route->len)); i++) {
+                fib->direct[slot + i] = ROUTE_LEAF | route_entry_nexthop[r];
+            }
+        }
+    }
+    for (uint32_t r = 0; r < route_count;) {
+        if (route_table[r].len <= ROUTE_DIRECT_BITS) {
+            r++;
+            continue;
+        }
+        uint32_t slot = route_table[r].prefix >> shift;
+        uint32_t end = r + 1;
+        while (end < route_count && (route_table[end].prefix >> shift) == slot) {
+            end++;
+        }
+        if (fib->node_count == ROUTE_FIB_NODES) {
+            return 0;
+        }
+        uint32_t index = fib->node_count++;
+        uint16_t fallback = (uint16_t)fib->direct[slot];
+        if (!route_build_node(fib, index, r, end, ROUTE_DIRECT_BITS, fallback)) {
+            return 0;
+        }
+        fib->direct[slot] = index;
+        r = end;
+    }
+    return 1;
+}
+
+/* Build the copy lookups are not using and switch them to it. Locked */
+static int route_publish(void) {
+    if (!route_fib) {
+        return 0;
+    }
+    struct route_fib* next = route_fib == &route_fibs[0] ? &route_fibs[1] : &route_fibs[0];
+    if (!route_build(next)) {
+        return 0;
+    }
+    rcu_assign_pointer(route_fib, next);
+    __atomic_fetch_add(&route_generation_count, 1, __ATOMIC_RELEASE);
+    synchronize_rcu();
+    return 1;
+}
+
+/* Where prefix/len is in the table, or would go */
+static uint32_t route_position(uint32_t prefix, uint32_t len) {
+    uint32_t low = 0;
+    uint32_t high = route_count;
+    while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        const struct route_entry* route = &route_table[mid];
+        if (route->prefix < prefix || (route->prefix == prefix && route->len < len)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/* An empty table: every lookup fails, as do changes when there are no frames for it */
+void route_init(void) {
+    route_count = 0;
+    if (!route_fibs) {
+        uint32_t size = 2 * sizeof(struct route_fib) + ROUTE_MAX * sizeof(struct route_entry);
+        uint32_t order = 0;
+        while (((uint32_t)PAGE_SIZE << order) < size) {
+            order++;
+        }
+        route_fibs = (struct route_fib*)paging_alloc_frames(order);
+        if (!route_fibs) {
+            return;
+        }
+        route_table = (struct route_entry*)&route_fibs[2];
+    }
+    route_build(&route_fibs[0]);
+    rcu_assign_pointer(route_fib, &route_fibs[0]);
+}
+
+/*
+ * Send prefix/len through device, via gateway unless that is 0. Bits of
+ * prefix past len are ignored. -1 if the prefix already has a route, or
+ * the table or its compiled form is full.
+ */
+int route_add(uint32_t prefix, uint32_t len, uint32_t device, uint32_t gateway) {
+    if (len > 32) {
+        return -1;
+    }
+    prefix &= route_mask(len);
+    route_lock();
+    uint32_t at = route_position(prefix, len);
+    if (!route_fib || route_count == ROUTE_MAX || (at < route_count && route_table[at].prefix == prefix && route_table[at].len == len)) {
+        route_unlock();
+        return -1;
+    }
+    for (uint32_t i = route_count; i > at; i--) {
+        route_table[i] = route_table[i - 1];
+    }
+    route_table[at].prefix = prefix;
+    route_table[at].len = len;
+    route_table[at].nexthop.device = device;
+    route_table[at].nexthop.gateway = gateway;
+    route_count++;
+
+    if (!route_publish()) {
+        route_count--;
+        for (uint32_t i = at; i < route_count; i++) {
+            route_table[i] = route_table[i + 1];
+        }
+        route_unlock();
+        return -1;
+    }
+    route_unlock();
+    return 0;
+}
+
+/* Remove the route for exactly prefix/len; -1 if there is none */
+int route_del(uint32_t prefix, uint32_t len) {
+    if (len > 32) {
+        return -1;
+    }
+    prefix &= route_mask(len);
+    route_lock();
+    uint32_t at = route_position(prefix, len);
+    if (at == route_count || route_table[at].prefix != prefix || route_table[at].len != len) {
+        route_unlock();
+        return -1;
+    }
+    route_count--;
+    for (uint32_t i = at; i < route_count; i++) {
+        route_table[i] = route_table[i + 1];
+    }
+    route_publish();                    /* Fewer routes always fit */
+    route_unlock();
+    return 0;
+}
+
+/* Remove every route through device, for when it goes away */
+void route_flush_device(uint32_t device) {
+    route_lock();
+    uint32_t kept = 0;
+    for (uint32_t r = 0; r < route_count; r++) {
+        if (route_table[r].nexthop.device != device) {
+            route_table[kept++] = route_table[r];
+        }
+    }
+    route_count = kept;
+    route_publish();
+    route_unlock();
+}
+
+/* Tell route caches to look again although no route changed: what a miss falls back to has */
+void route_invalidate(void) {
+    __atomic_fetch_add(&route_generation_count, 1, __ATOMIC_RELEASE);
+}
+
+/* The longest route matching dest; 0 if none does */
+int route_lookup(uint32_t dest, struct route_nexthop* nexthop) {
+    const struct route_fib* fib = rcu_dereference(route_fib);
+    if (!fib) {
+        return 0;
+    }
+    uint32_t entry = fib->direct[dest >> (32 - ROUTE_DIRECT_BITS)];
+    uint32_t hop;
+    if (entry & ROUTE_LEAF) {
+        hop = entry & ~ROUTE_LEAF;
+    } else {
+        const struct route_node* node = &fib->nodes[entry];
+        uint32_t shift = 32 - ROUTE_DIRECT_BITS - ROUTE_STRIDE;
+        for (;;) {
+            uint32_t bit = 1u << ((dest >> shift) & ((1u << ROUTE_STRIDE) - 1));
+            if (!(node->vector & bit)) {
+                hop = fib->leaves[node->base0 + route_popcount(node->leafvec & ((bit << 1) - 1)) - 1];
+                break;
+            }
+            node = &fib->nodes[node->base1 + route_popcount(node->vector & (bit - 1))];
+            shift -= ROUTE_STRIDE;
+        }
+    }
+    if (!hop) {
+        return 0;
+    }
+    *nexthop = fib->nexthops[hop];
+    return 1;
+}
+
+/* Bumped by every change; a cached route is good while this is what it was */
+uint32_t route_generation(void) {
+    return __atomic_load_n(&route_generation_count, __ATOMIC_ACQUIRE);
+}
+
+uint32_t route_get_count(void) {
+    return route_count;
+}
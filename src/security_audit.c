@@ -11,6 +11,12 @@
 #define BUFFER_SIZE 1024
 #define CHECKSUM_SIZE 32
 #define SECURITY_LOG_SIZE 256
+#define MAX_PROTECTED_BUFFERS 64
+#define MAX_MEMORY_REGIONS 128
+#define AUDIT_STEP_BYTES 4096           /* Memory one audit step may checksum */
+#define AUDIT_STEP_ENTRIES 16           /* Table entries one audit step may examine */
+#define LEAK_AUDIT_CALLERS 8            /* Biggest outstanding callers followed between audits */
+#define LEAK_GROWTH_BYTES (16 * 1024)   /* Growth of one caller between audits that looks like a leak */
 
 /* Vulnerability types */
 typedef enum {
@@ -66,6 +72,7 @@ typedef struct {
     uint8_t is_writable;
     uint8_t is_stack;
     uint8_t is_heap;
+    uint32_t checksum;                  /* CRC32C of the contents, for regions that are not writable */
 } memory_region_t;
 
 /* Stack canary structure */
@@ -98,62 +105,74 @@ typedef struct {
     uint32_t canary_value;
 } buffer_protection_t;
 
+/* A check the incremental audit resumes where the last step left it */
+typedef struct audit_job {
+    const char* name;
+    int (*step)(struct audit_job* job); /* Non-zero once the pass is complete */
+    void (*check)(void);                /* Or a check short enough to run whole */
+    uint32_t cursor;                    /* Entry, or region, to resume at */
+    uint32_t offset;                    /* Bytes of that region already covered */
+    uint32_t crc;                       /* CRC32C of those bytes */
+    uint32_t generation;                /* Of the region table the cursor indexes */
+    uint32_t passes;
+} audit_job_t;
+
 /* Global security state */
 static security_audit_log_t security_log;
 static stack_canary_t stack_canaries[MAX_STACK_FRAMES];
-static buffer_protection_t protected_buffers[64];
-static memory_region_t memory_regions[128];
+
+/*
+ * Both tables are kept sorted by start address so a check is a binary
+ * search, and each remembers the entry its last lookup found: checks
+ * cluster on one buffer or region, so most never search at all.
+ * region_max_end[i] is the furthest end among regions 0..i, which bounds
+ * the walk back over regions that start earlier but overlap.
+ */
+static buffer_protection_t protected_buffers[MAX_PROTECTED_BUFFERS];
+static uint32_t protected_buffer_count = 0;
+static uint32_t protected_buffer_last = 0;
+static memory_region_t memory_regions[MAX_MEMORY_REGIONS];
+static void* region_max_end[MAX_MEMORY_REGIONS];
 static uint32_t memory_region_count = 0;
+static uint32_t memory_region_last = 0;
+static uint32_t memory_region_generation = 0;   /* Bumped when regions move */
 static uint8_t security_audit_enabled = 1;
 static uint32_t security_check_count = 0;
 
-/* Utility functions */
-static void* memset(void* s, int c, size_t n) {
-    unsigned char* p = s;
-    while (n--) *p++ = c;
-    return s;
-}
+/* CRC32C (crc32c.c) */
+extern uint32_t crc32c(uint32_t crc, const void* data, uint32_t size);
 
-static void* memcpy(void* dest, const void* src, size_t n) {
-    unsigned char* d = dest;
-    const unsigned char* s = src;
-    while (n--) *d++ = *s++;
-    return dest;
-}
+/* Allocation tracking (alloc_track.c) */
+/* Outstanding allocations of one caller (must match alloc_track.c) */
+struct alloc_caller {
+    void* caller;
+    uint32_t count;
+    uint32_t bytes;
+    uint64_t oldest_tsc;
+};
 
-static size_t strlen(const char* str) {
-    size_t len = 0;
-    while (str[len]) len++;
-    return len;
-}
+extern uint32_t alloc_track_top(struct alloc_caller* callers, uint32_t max);
 
-static uint32_t simple_checksum(const void* data, size_t size) {
-    uint32_t checksum = 0;
-    const uint8_t* bytes = (const uint8_t*)data;
-    
-    for (size_t i = 0; i < size; i++) {
-        checksum = (checksum << 5) + checksum + bytes[i];
-    }
-    
-    return checksum;
-}
+/* Hardware entropy (stack_protector.c) */
+extern uint32_t hw_random(void);
+
+/* Scheduler (performance_tuning.c) */
+#define PRIORITY_IDLE 0                 /* Must match process_priority_t there */
+extern int optimized_kthread_run(const char* name, int priority, void (*entry)(void));
+extern void optimized_yield(void);
+
+/* Kernel runtime library (klib.c) */
+extern void* memcpy(void* dest, const void* src, size_t n);
+extern void* memset(void* s, int c, size_t n);
+extern size_t strlen(const char* str);
 
 /* Stack canary implementation */
-static uint32_t generate_canary(void) {
-    /* Generate a random canary value */
-    uint32_t canary = 0xDEADC0DE;
-    
-    /* Add some entropy based on timer or other sources */
-    uint32_t* stack_ptr;
-    __asm__ __volatile__ ("mov %%esp, %0" : "=r"(stack_ptr));
-    
-    canary ^= (uint32_t)stack_ptr;
-    canary ^= 0xAAAAAAAA;
-    
-    return canary;
+static inline uint32_t generate_canary(void) {
+    /* RDSEED or RDRAND where the CPU has them; the low byte is zero so string copies stop short of it */
+    return hw_random() & ~0xFFu;
 }
 
-static void setup_stack_canary(void* frame_ptr) {
+static inline void setup_stack_canary(void* frame_ptr) {
     static int canary_index = 0;
     
     if (canary_index < MAX_STACK_FRAMES) {
@@ -170,7 +189,7 @@ static void setup_stack_canary(void* frame_ptr) {
     }
 }
 
-static uint8_t check_stack_canary(void* frame_ptr) {
+static inline uint8_t check_stack_canary(void* frame_ptr) {
     for (int i = 0; i < MAX_STACK_FRAMES; i++) {
         if (stack_canaries[i].stack_frame == frame_ptr) {
             uint32_t* canary_location = (uint32_t*)frame_ptr;
@@ -189,93 +208,184 @@ static uint8_t check_stack_canary(void* frame_ptr) {
 }
 
 /* Buffer overflow detection */
+
+/* Index of the first buffer starting at or after buffer */
+static uint32_t find_buffer_slot(void* buffer) {
+    uint32_t low = 0, high = protected_buffer_count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if ((uint8_t*)protected_buffers[mid].buffer_start < (uint8_t*)buffer) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
 static void register_buffer(void* buffer, uint32_t size, uint8_t enable_canary) {
-    static int buffer_index = 0;
-    
-    if (buffer_index < 64) {
-        protected_buffers[buffer_index].buffer_start = buffer;
-        protected_buffers[buffer_index].buffer_size = size;
-        protected_buffers[buffer_index].access_count = 0;
-        protected_buffers[buffer_index].overflow_attempts = 0;
-        protected_buffers[buffer_index].is_protected = 1;
-        protected_buffers[buffer_index].canary_enabled = enable_canary;
-        
-        if (enable_canary) {
-            protected_buffers[buffer_index].canary_value = generate_canary();
-            /* Place canary at end of buffer */
-            uint32_t* canary_ptr = (uint32_t*)((uint8_t*)buffer + size);
-            *canary_ptr = protected_buffers[buffer_index].canary_value;
+    uint32_t slot = find_buffer_slot(buffer);
+    
+    /* A buffer registered again at the same address (a reused stack frame) replaces the old one */
+    if (slot == protected_buffer_count || protected_buffers[slot].buffer_start != buffer) {
+        if (protected_buffer_count == MAX_PROTECTED_BUFFERS) {
+            return;
         }
-        
-        buffer_index++;
+        for (uint32_t i = protected_buffer_count; i > slot; i--) {
+            protected_buffers[i] = protected_buffers[i - 1];
+        }
+        protected_buffer_count++;
     }
+    
+    buffer_protection_t* entry = &protected_buffers[slot];
+    entry->buffer_start = buffer;
+    entry->buffer_size = size;
+    entry->access_count = 0;
+    entry->overflow_attempts = 0;
+    entry->is_protected = 1;
+    entry->canary_enabled = enable_canary;
+    
+    if (enable_canary) {
+        entry->canary_value = generate_canary();
+        /* Place canary at end of buffer */
+        uint32_t* canary_ptr = (uint32_t*)((uint8_t*)buffer + size);
+        *canary_ptr = entry->canary_value;
+    }
+    protected_buffer_last = slot;
 }
 
 static uint8_t validate_buffer_access(void* buffer, uint32_t offset, uint32_t size) {
-    for (int i = 0; i < 64; i++) {
-        if (protected_buffers[i].is_protected && 
-            protected_buffers[i].buffer_start == buffer) {
-            
-            protected_buffers[i].access_count++;
-            
-            /* Check for overflow */
-            if (offset + size > protected_buffers[i].buffer_size) {
-                protected_buffers[i].overflow_attempts++;
-                return 0; /* Buffer overflow detected */
-            }
-            
-            /* Check canary if enabled */
-            if (protected_buffers[i].canary_enabled) {
-                uint32_t* canary_ptr = (uint32_t*)((uint8_t*)buffer + 
-                    protected_buffers[i].buffer_size);
-                if (*canary_ptr != protected_buffers[i].canary_value) {
-                    return 0; /* Canary corrupted */
-                }
-            }
-            
-            return 1; /* Access is valid */
+    uint32_t i = protected_buffer_last;
+    if (i >= protected_buffer_count || protected_buffers[i].buffer_start != buffer) {
+        i = find_buffer_slot(buffer);
+        if (i == protected_buffer_count || protected_buffers[i].buffer_start != buffer) {
+            return 1; /* Buffer not protected, assume safe */
         }
+        protected_buffer_last = i;
+    }
+    
+    buffer_protection_t* entry = &protected_buffers[i];
+    entry->access_count++;
+    
+    /* Check for overflow */
+    if (offset + size > entry->buffer_size) {
+        entry->overflow_attempts++;
+        return 0; /* Buffer overflow detected */
     }
     
-    return 1; /* Buffer not protected, assume safe */
+    /* Check canary if enabled */
+    if (entry->canary_enabled) {
+        uint32_t* canary_ptr = (uint32_t*)((uint8_t*)buffer + entry->buffer_size);
+        if (*canary_ptr != entry->canary_value) {
+            return 0; /* Canary corrupted */
+        }
+    }
+    
+    return 1; /* Access is valid */
 }
 
 /* Memory region tracking */
+
+/* Index of the first region starting after address */
+static uint32_t find_region_slot(void* address) {
+    uint32_t low = 0, high = memory_region_count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if ((uint8_t*)memory_regions[mid].start <= (uint8_t*)address) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/* Recompute region_max_end from index first on, after regions moved */
+static void update_region_max_end(uint32_t first) {
+    for (uint32_t i = first; i < memory_region_count; i++) {
+        void* end = memory_regions[i].end;
+        region_max_end[i] = i && (uint8_t*)region_max_end[i - 1] > (uint8_t*)end ? region_max_end[i - 1] : end;
+    }
+}
+
 static void add_memory_region(void* start, void* end, const char* name, 
                              uint32_t permissions) {
-    if (memory_region_count < 128) {
-        memory_regions[memory_region_count].start = start;
-        memory_regions[memory_region_count].end = end;
-        memory_regions[memory_region_count].size = (uint8_t*)end - (uint8_t*)start;
-        memory_regions[memory_region_count].name = name;
-        memory_regions[memory_region_count].permissions = permissions;
-        memory_regions[memory_region_count].is_executable = (permissions & 0x1);
-        memory_regions[memory_region_count].is_writable = (permissions & 0x2);
-        memory_regions[memory_region_count].is_stack = (permissions & 0x4);
-        memory_regions[memory_region_count].is_heap = (permissions & 0x8);
-        
+    uint32_t slot = find_region_slot(start);
+    uint8_t was_read_only = 0;
+    
+    /* The audit declares its regions on every run: the same range updates in place */
+    if (slot && memory_regions[slot - 1].start == start && memory_regions[slot - 1].end == end) {
+        slot--;
+        was_read_only = !memory_regions[slot].is_writable;
+    } else {
+        if (memory_region_count == MAX_MEMORY_REGIONS) {
+            return;
+        }
+        for (uint32_t i = memory_region_count; i > slot; i--) {
+            memory_regions[i] = memory_regions[i - 1];
+        }
         memory_region_count++;
+        memory_region_last = memory_region_count;     /* Indices moved */
+        memory_region_generation++;
+    }
+    
+    /* A redeclared read-only region keeps its checksum: recomputing it would hide a change */
+    memory_region_t* region = &memory_regions[slot];
+    region->start = start;
+    region->end = end;
+    region->size = (uint8_t*)end - (uint8_t*)start;
+    region->name = name;
+    region->permissions = permissions;
+    region->is_executable = (permissions & 0x1);
+    region->is_writable = (permissions & 0x2);
+    region->is_stack = (permissions & 0x4);
+    region->is_heap = (permissions & 0x8);
+    if (region->is_writable) {
+        region->checksum = 0;
+    } else if (!was_read_only) {
+        region->checksum = crc32c(0, start, region->size);
     }
+    update_region_max_end(slot);
 }
 
-static uint8_t is_valid_memory_access(void* address, uint32_t size, uint32_t required_permissions) {
-    for (uint32_t i = 0; i < memory_region_count; i++) {
-        if (address >= memory_regions[i].start && 
-            (uint8_t*)address + size <= (uint8_t*)memory_regions[i].end) {
-            
-            /* Check if required permissions are available */
-            if ((required_permissions & 0x1) && !memory_regions[i].is_executable) {
-                return 0; /* Execution permission required but not available */
-            }
-            if ((required_permissions & 0x2) && !memory_regions[i].is_writable) {
-                return 0; /* Write permission required but not available */
-            }
-            
-            return 1; /* Access is valid */
+/*
+ * The region holding [address, address + size): the last-hit region if it
+ * still does, else the innermost, meaning the one starting latest
+ */
+static memory_region_t* find_memory_region(void* address, uint32_t size) {
+    uint8_t* first = (uint8_t*)address;
+    uint8_t* last = first + size;
+    uint32_t i = memory_region_last;
+    if (i < memory_region_count && first >= (uint8_t*)memory_regions[i].start &&
+        last <= (uint8_t*)memory_regions[i].end) {
+        return &memory_regions[i];
+    }
+    
+    /* Regions before the slot start at or below address; stop once none of them reaches far enough */
+    for (i = find_region_slot(address); i-- > 0 && last <= (uint8_t*)region_max_end[i];) {
+        if (last <= (uint8_t*)memory_regions[i].end) {
+            memory_region_last = i;
+            return &memory_regions[i];
         }
     }
+    return NULL;
+}
+
+static uint8_t is_valid_memory_access(void* address, uint32_t size, uint32_t required_permissions) {
+    memory_region_t* region = find_memory_region(address, size);
+    if (!region) {
+        return 0; /* Address not in any known memory region */
+    }
+    
+    /* Check if required permissions are available */
+    if ((required_permissions & 0x1) && !region->is_executable) {
+        return 0; /* Execution permission required but not available */
+    }
+    if ((required_permissions & 0x2) && !region->is_writable) {
+        return 0; /* Write permission required but not available */
+    }
     
-    return 0; /* Address not in any known memory region */
+    return 1; /* Access is valid */
 }
 
 /* Security logging */
@@ -296,7 +406,7 @@ static void log_security_issue(vulnerability_type_t vuln_type, security_severity
     result->function = function;
     result->address = address;
     result->timestamp = security_check_count++;
-    result->checksum = simple_checksum(description, strlen(description));
+    result->checksum = crc32c(0, description, strlen(description));
     result->remediation_suggested = 1;
     
     /* Update statistics */
@@ -321,42 +431,91 @@ static void log_security_issue(vulnerability_type_t vuln_type, security_severity
 }
 
 /* Security check functions */
-static void check_buffer_overflows(void) {
-    /* Check all protected buffers for overflow attempts */
-    for (int i = 0; i < 64; i++) {
-        if (protected_buffers[i].is_protected && protected_buffers[i].overflow_attempts > 0) {
+static int check_buffer_overflows(audit_job_t* job) {
+    /* Check protected buffers for overflow attempts; an insert may shift one past the cursor until next pass */
+    uint32_t end = job->cursor + AUDIT_STEP_ENTRIES;
+    for (; job->cursor < protected_buffer_count && job->cursor < end; job->cursor++) {
+        buffer_protection_t* buffer = &protected_buffers[job->cursor];
+        if (buffer->is_protected && buffer->overflow_attempts > 0) {
             log_security_issue(VULN_BUFFER_OVERFLOW, SEVERITY_HIGH,
                              "Buffer overflow detected", __FILE__, __LINE__, __func__,
-                             protected_buffers[i].buffer_start);
+                             buffer->buffer_start);
         }
     }
+    return job->cursor >= protected_buffer_count;
 }
 
-static void check_stack_corruption(void) {
-    /* Check all stack canaries for corruption */
-    for (int i = 0; i < MAX_STACK_FRAMES; i++) {
-        if (stack_canaries[i].stack_frame && stack_canaries[i].is_corrupted) {
+/* Regions that are not writable must still hold what they held when declared */
+static int check_region_integrity(audit_job_t* job) {
+    if (job->generation != memory_region_generation) {
+        job->generation = memory_region_generation;   /* Regions moved: start over */
+        job->cursor = 0;
+        job->offset = 0;
+        job->crc = 0;
+    }
+    
+    uint32_t budget = AUDIT_STEP_BYTES;
+    for (; job->cursor < memory_region_count; job->cursor++) {
+        memory_region_t* region = &memory_regions[job->cursor];
+        if (region->is_writable) {
+            continue;
+        }
+        uint32_t chunk = region->size - job->offset;
+        chunk = chunk < budget ? chunk : budget;
+        job->crc = crc32c(job->crc, (uint8_t*)region->start + job->offset, chunk);
+        job->offset += chunk;
+        budget -= chunk;
+        if (job->offset < region->size) {
+            return 0;
+        }
+        if (job->crc != region->checksum) {
+            log_security_issue(VULN_CODE_INJECTION, SEVERITY_CRITICAL,
+                             "Read-only memory region modified", __FILE__, __LINE__, __func__,
+                             region->start);
+        }
+        job->offset = 0;
+        job->crc = 0;
+    }
+    return 1;
+}
+
+static int check_stack_corruption(audit_job_t* job) {
+    /* Check stack canaries for corruption */
+    uint32_t end = job->cursor + AUDIT_STEP_ENTRIES;
+    for (; job->cursor < MAX_STACK_FRAMES && job->cursor < end; job->cursor++) {
+        stack_canary_t* canary = &stack_canaries[job->cursor];
+        if (canary->stack_frame && canary->is_corrupted) {
             log_security_issue(VULN_STACK_OVERFLOW, SEVERITY_CRITICAL,
                              "Stack canary corruption detected", __FILE__, __LINE__, __func__,
-                             stack_canaries[i].stack_frame);
+                             canary->stack_frame);
         }
     }
+    return job->cursor >= MAX_STACK_FRAMES;
 }
 
 static void check_memory_leaks(void) {
-    /* Simple memory leak detection */
-    static uint32_t last_total_allocated = 0;
-    uint32_t current_allocated = 0;
-    
-    /* This would normally track actual allocations */
-    current_allocated = security_check_count * 16; /* Simulated */
-    
-    if (current_allocated > last_total_allocated + 1024 * 1024) {
-        log_security_issue(VULN_MEMORY_LEAK, SEVERITY_MEDIUM,
-                         "Potential memory leak detected", __FILE__, __LINE__, __func__, 0);
+    /*
+     * A caller whose outstanding bytes keep climbing between audits is
+     * leaking. Needs alloc_track_enable; with tracking off nothing is seen.
+     */
+    static struct alloc_caller last[LEAK_AUDIT_CALLERS];
+    static uint32_t last_count = 0;
+    struct alloc_caller current[LEAK_AUDIT_CALLERS];
+    
+    uint32_t count = alloc_track_top(current, LEAK_AUDIT_CALLERS);
+    for (uint32_t i = 0; i < count; i++) {
+        for (uint32_t j = 0; j < last_count; j++) {
+            if (last[j].caller == current[i].caller &&
+                current[i].bytes > last[j].bytes + LEAK_GROWTH_BYTES) {
+                log_security_issue(VULN_MEMORY_LEAK, SEVERITY_MEDIUM,
+                                 "Potential memory leak detected", __FILE__, __LINE__, __func__,
+                                 current[i].caller);
+                break;
+            }
+        }
+        last[i] = current[i];
     }
-    
-    last_total_allocated = current_allocated;
+    last_count = count;
 }
 
 static void check_integer_overflows(void) {
@@ -443,28 +602,106 @@ static void check_return_oriented_programming(void) {
     }
 }
 
-/* Comprehensive security audit */
-void comprehensive_security_audit(void) {
-    if (!security_audit_enabled) return;
-    
-    /* Initialize memory regions */
+static void check_input_format_strings(void) {
+    /* Test format string vulnerability detection */
+    check_format_string_vulnerabilities("User input: %s");
+}
+
+/*
+ * Incremental audit. Every check is a job; security_audit_step runs one
+ * bounded step of the current job, at most AUDIT_STEP_BYTES of memory or
+ * AUDIT_STEP_ENTRIES table entries, and moves to the next job once a
+ * pass of this one is complete. The audit thread, at idle priority,
+ * steps and yields for as long as the audit is enabled, so a pass is
+ * spread out instead of stalling the CPU, and findings reach
+ * security_log as they are made.
+ */
+static audit_job_t audit_jobs[] = {
+    { "region integrity", check_region_integrity, NULL, 0, 0, 0, 0, 0 },
+    { "buffer overflows", check_buffer_overflows, NULL, 0, 0, 0, 0, 0 },
+    { "stack corruption", check_stack_corruption, NULL, 0, 0, 0, 0, 0 },
+    { "memory leaks", NULL, check_memory_leaks, 0, 0, 0, 0, 0 },
+    { "integer overflows", NULL, check_integer_overflows, 0, 0, 0, 0, 0 },
+    { "null pointers", NULL, check_null_pointer_dereferences, 0, 0, 0, 0, 0 },
+    { "race conditions", NULL, check_race_conditions, 0, 0, 0, 0, 0 },
+    { "privilege escalation", NULL, check_privilege_escalation, 0, 0, 0, 0, 0 },
+    { "code injection", NULL, check_code_injection, 0, 0, 0, 0, 0 },
+    { "rop", NULL, check_return_oriented_programming, 0, 0, 0, 0, 0 },
+    { "format strings", NULL, check_input_format_strings, 0, 0, 0, 0, 0 },
+};
+#define AUDIT_JOBS (sizeof(audit_jobs) / sizeof(audit_jobs[0]))
+
+static uint32_t audit_job_current = 0;
+static uint32_t audit_passes = 0;
+static volatile uint8_t audit_thread_running = 0;
+
+static void declare_memory_regions(void) {
     add_memory_region((void*)0x00000000, (void*)0x0009FFFF, "Conventional Memory", 0x2);
     add_memory_region((void*)0x00100000, (void*)0x7FFFFFFF, "Extended Memory", 0x2);
     add_memory_region((void*)0xB8000, (void*)0xB8FFF, "Video Memory", 0x3);
+    add_memory_region((void*)0xF0000, (void*)0xFFFFF, "BIOS ROM", 0x1);
+}
+
+/* One step of the current job; returns 1 when it completed a pass over every job */
+int security_audit_step(void) {
+    audit_job_t* job = &audit_jobs[audit_job_current];
+    int done = 1;
+    if (job->step) {
+        done = job->step(job);
+    } else {
+        job->check();
+    }
+    if (!done) {
+        return 0;
+    }
     
-    /* Run all security checks */
-    check_buffer_overflows();
-    check_stack_corruption();
-    check_memory_leaks();
-    check_integer_overflows();
-    check_null_pointer_dereferences();
-    check_race_conditions();
-    check_privilege_escalation();
-    check_code_injection();
-    check_return_oriented_programming();
+    job->cursor = 0;
+    job->offset = 0;
+    job->crc = 0;
+    job->passes++;
+    if (++audit_job_current < AUDIT_JOBS) {
+        return 0;
+    }
+    audit_job_current = 0;
+    audit_passes++;
+    return 1;
+}
+
+static void security_audit_thread(void) {
+    while (security_audit_enabled) {
+        security_audit_step();
+        optimized_yield();
+    }
+    audit_thread_running = 0;
+}
+
+/* Audit continuously from an idle-priority kernel thread; 0, or -1 if it cannot start */
+int security_audit_start(void) {
+    if (audit_thread_running) {
+        return 0;
+    }
+    audit_thread_running = 1;
+    if (optimized_kthread_run("audit", PRIORITY_IDLE, security_audit_thread) < 0) {
+        audit_thread_running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Comprehensive security audit: the rest of the current pass, in one go.
+ * With the audit thread running this only redeclares the regions, as the
+ * thread is already working through every check.
+ */
+void comprehensive_security_audit(void) {
+    if (!security_audit_enabled) return;
     
-    /* Test format string vulnerability detection */
-    check_format_string_vulnerabilities("User input: %s");
+    declare_memory_regions();
+    if (audit_thread_running) {
+        return;
+    }
+    while (!security_audit_step()) {
+    }
 }
 
 /* Security hardening functions */
@@ -477,6 +714,8 @@ void security_hardening_init(void) {
     
     /* Initialize protected buffers */
     memset(protected_buffers, 0, sizeof(protected_buffers));
+    protected_buffer_count = 0;
+    protected_buffer_last = 0;
     
     /* Setup initial stack canary */
     void* current_stack;
@@ -488,6 +727,7 @@ void security_hardening_init(void) {
     register_buffer(test_buffer, sizeof(test_buffer), 1);
     
     /* Enable security audit */
+    declare_memory_regions();
     security_audit_enabled = 1;
     
     /* Log initialization */
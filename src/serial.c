@@ -0,0 +1,161 @@
+/*
+ * Tiny Operating System - 16550 Serial Console
+ * COM1 at 115200 8N1 with the FIFOs on; writers fill a transmit ring that
+ * the THRE interrupt empties sixteen bytes at a time
+ */
+
+#include <stdint.h>
+
+#define COM1_PORT 0x3F8
+#define COM1_IRQ 4
+
+/* Register offsets from the base port */
+#define UART_THR 0                      /* Transmit holding (DLAB off) */
+#define UART_IER 1                      /* Interrupt enable (DLAB off) */
+#define UART_IIR 2                      /* Interrupt identification, read */
+#define UART_FCR 2                      /* FIFO control, write */
+#define UART_LCR 3
+#define UART_MCR 4
+#define UART_LSR 5
+
+#define UART_IER_THRI 0x02              /* Interrupt when the transmitter empties */
+#define UART_LSR_THRE 0x20              /* Transmit FIFO empty */
+#define UART_MCR_OUT2 0x08              /* Gates the UART's interrupt onto the ISA line */
+#define UART_TX_FIFO 16                 /* Bytes the 16550A takes per THRE */
+
+#define SERIAL_TX_SIZE 4096             /* Power of two */
+
+/* Lock-free byte ring (spsc_ring.c) (must match struct spsc_ring there) */
+struct spsc_ring {
+    uint8_t* buffer;
+    uint32_t mask;
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t tail __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+extern void spsc_init(struct spsc_ring* ring, void* buffer, uint32_t size);
+extern uint32_t spsc_count(const struct spsc_ring* ring);
+extern uint32_t spsc_write(struct spsc_ring* ring, const void* data, uint32_t size);
+extern int spsc_pop(struct spsc_ring* ring, uint8_t* byte);
+
+/* IRQ routing (interrupt_handlers.c) */
+extern void irq_install_handler(uint32_t irq, void (*handler)(void));
+
+/*
+ * Writers, in task context and one at a time, are the ring's producer.
+ * The consumer is the THRE interrupt, or in a stage without an IDT the
+ * writer itself, which tops up the FIFO whenever it finds it empty and
+ * only waits on the line when the ring is full or on serial_flush.
+ */
+static struct spsc_ring serial_tx;
+static uint8_t serial_tx_buffer[SERIAL_TX_SIZE];
+static int serial_irq_mode;
+static int serial_present;
+
+/* Function prototypes */
+void serial_init(int use_irq);
+void serial_write(const void* data, uint32_t size);
+void serial_flush(void);
+
+static inline void outb(uint16_t port, uint8_t value) {
+    __asm__ __volatile__("outb %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    __asm__ __volatile__("inb %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static inline int interrupts_enabled(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushf; pop %0" : "=r"(flags));
+    return (flags >> 9) & 1;
+}
+
+/* Move up to a FIFO's worth of the ring into the UART if it is ready for more */
+static void serial_fill(void) {
+    if (!(inb(COM1_PORT + UART_LSR) & UART_LSR_THRE)) {
+        return;
+    }
+    uint8_t byte;
+    for (int i = 0; i < UART_TX_FIFO && spsc_pop(&serial_tx, &byte); i++) {
+        outb(COM1_PORT + UART_THR, byte);
+    }
+}
+
+/* THRE: refill the FIFO, and stop the interrupt once there is nothing left to send */
+static void serial_interrupt(void) {
+    (void)inb(COM1_PORT + UART_IIR);    /* Reading IIR acknowledges THRE */
+    serial_fill();
+    if (!spsc_count(&serial_tx)) {
+        outb(COM1_PORT + UART_IER, 0x00);
+    }
+}
+
+/* Get bytes moving: arm THRE, which fires at once if the transmitter is idle */
+static void serial_kick(void) {
+    if (serial_irq_mode) {
+        outb(COM1_PORT + UART_IER, UART_IER_THRI);
+    } else {
+        serial_fill();
+    }
+}
+
+/* Wait for the line to take some of the ring; sleeps when the interrupt will do the work */
+static void serial_wait(void) {
+    if (serial_irq_mode && interrupts_enabled()) {
+        __asm__ __volatile__("hlt" : : : "memory");
+        return;
+    }
+    while (!(inb(COM1_PORT + UART_LSR) & UART_LSR_THRE)) {
+    }
+    serial_fill();
+}
+
+/*
+ * 115200 8N1 (divisor 1, the 16550's fastest), FIFOs on and cleared. With
+ * use_irq, transmission is driven by IRQ 4; without it, by the writers.
+ */
+void serial_init(int use_irq) {
+    spsc_init(&serial_tx, serial_tx_buffer, SERIAL_TX_SIZE);
+    outb(COM1_PORT + UART_IER, 0x00);   /* No interrupts while programming */
+    outb(COM1_PORT + UART_LCR, 0x80);   /* DLAB on: divisor follows */
+    outb(COM1_PORT + 0, 0x01);          /* 115200 baud */
+    outb(COM1_PORT + 1, 0x00);
+    outb(COM1_PORT + UART_LCR, 0x03);   /* 8 bits, no parity, one stop bit */
+    outb(COM1_PORT + UART_FCR, 0xC7);   /* FIFO on and cleared, 14-byte receive trigger */
+
+    serial_irq_mode = use_irq;
+    if (use_irq) {
+        irq_install_handler(COM1_IRQ, serial_interrupt);
+        outb(COM1_PORT + UART_MCR, 0x03 | UART_MCR_OUT2);   /* DTR, RTS, IRQ on */
+    } else {
+        outb(COM1_PORT + UART_MCR, 0x03);
+    }
+    serial_present = 1;
+}
+
+/* Queue size bytes; blocks only while the ring is full */
+void serial_write(const void* data, uint32_t size) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    if (!serial_present) {
+        return;
+    }
+    while (size) {
+        uint32_t queued = spsc_write(&serial_tx, bytes, size);
+        bytes += queued;
+        size -= queued;
+        serial_kick();
+        if (size) {
+            serial_wait();
+        }
+    }
+}
+
+/* Wait until everything queued has gone to the UART */
+void serial_flush(void) {
+    while (serial_present && spsc_count(&serial_tx)) {
+        serial_wait();
+    }
+}
@@ -57,35 +57,51 @@
 #define SYS_GETSOCKNAME 48
 #define SYS_GETHOSTNAME 49
 #define SYS_SETHOSTNAME 50
+#define SYS_GETDENTS 51
+#define SYS_STATS 52
 
 /* File descriptors */
 #define STDIN_FILENO 0
 #define STDOUT_FILENO 1
 #define STDERR_FILENO 2
 
-/* System call interface */
-static inline int syscall0(int num) {
+/* open flags */
+#define O_CREAT 0x40
+#define O_TRUNC 0x200
+
+/* A pipe end that would have to wait */
+#define EAGAIN 11
+
+/* Set by the kernel once the SYSENTER MSRs point at its fast entry */
+extern uint32_t sysenter_enabled;
+
+/* System call interface: SYSENTER when the kernel armed it, INT 0x80 otherwise.
+   SYSENTER passes arguments in ebx/esi/edi since ecx/edx carry the return esp/eip. */
+static inline int syscall3(int num, int arg1, int arg2, int arg3) {
     int ret;
-    __asm__ __volatile__ ("int $0x80" : "=a"(ret) : "a"(num));
+    if (sysenter_enabled) {
+        __asm__ __volatile__ (
+            "mov $1f, %%edx\n"
+            "mov %%esp, %%ecx\n"
+            "sysenter\n"
+            "1:\n"
+            : "=a"(ret) : "a"(num), "b"(arg1), "S"(arg2), "D"(arg3) : "ecx", "edx", "memory");
+    } else {
+        __asm__ __volatile__ ("int $0x80" : "=a"(ret) : "a"(num), "b"(arg1), "c"(arg2), "d"(arg3) : "memory");
+    }
     return ret;
 }
 
-static inline int syscall1(int num, int arg1) {
-    int ret;
-    __asm__ __volatile__ ("int $0x80" : "=a"(ret) : "a"(num), "b"(arg1));
-    return ret;
+static inline int syscall0(int num) {
+    return syscall3(num, 0, 0, 0);
 }
 
-static inline int syscall2(int num, int arg1, int arg2) {
-    int ret;
-    __asm__ __volatile__ ("int $0x80" : "=a"(ret) : "a"(num), "b"(arg1), "c"(arg2));
-    return ret;
+static inline int syscall1(int num, int arg1) {
+    return syscall3(num, arg1, 0, 0);
 }
 
-static inline int syscall3(int num, int arg1, int arg2, int arg3) {
-    int ret;
-    __asm__ __volatile__ ("int $0x80" : "=a"(ret) : "a"(num), "b"(arg1), "c"(arg2), "d"(arg3));
-    return ret;
+static inline int syscall2(int num, int arg1, int arg2) {
+    return syscall3(num, arg1, arg2, 0);
 }
 
 /* Simple string functions */
@@ -95,16 +111,6 @@ static size_t strlen(const char* str) {
     return len;
 }
 
-/* Forward declarations */
-static char* strtok_r(char* str, const char* delim, char** saveptr);
-
-/* Simple memory functions */
-static void* memset(void* s, int c, size_t n) {
-    unsigned char* p = s;
-    while (n--) *p++ = c;
-    return s;
-}
-
 static int strcmp(const char* s1, const char* s2) {
     while (*s1 && (*s1 == *s2)) {
         s1++;
@@ -120,12 +126,6 @@ static char* strcpy(char* dest, const char* src) {
     return dest;
 }
 
-static char* strncpy(char* dest, const char* src, size_t n) {
-    char* d = dest;
-    while (n-- && (*d++ = *src++));
-    while (n--) *d++ = '\0';
-    return dest;
-}
 
 
 /* Directory entry structure */
@@ -137,21 +137,171 @@ struct dirent {
     char d_name[256];      /* Filename */
 };
 
+/* System status snapshot (must match kernel_shell.c) */
+#define STATS_MAX_PROCS 8
+#define STATS_COUNTERS 8
+#define STATS_SYSCALLS 0                /* Counter indices: must match percpu.c */
+#define STATS_INTERRUPTS 1
+#define STATS_PAGE_FAULTS 2
+#define STATS_CONTEXT_SWITCHES 3
+#define STATS_NET_RX_PACKETS 4
+#define STATS_NET_TX_PACKETS 5
+
+struct stats_proc {
+    uint32_t pid;
+    uint32_t running;
+    uint32_t cpu_ticks;
+    uint32_t switches;
+    uint32_t cache_hotness;
+    uint32_t mem_bytes;
+    char name[16];
+};
+
+struct sys_stats {
+    uint32_t uptime_ms;
+    uint32_t tsc_khz;
+    uint32_t ticks;
+    uint32_t hz;
+    uint32_t counters[STATS_COUNTERS];
+    uint32_t heap_used;
+    uint32_t proc_count;
+    struct stats_proc procs[STATS_MAX_PROCS];
+};
+
+#define TOP_REFRESHES 10                /* Screens top shows unless told otherwise */
+
 /* Shell command structure */
-#define MAX_ARGS 32
 #define MAX_CMD_LEN 256
 #define MAX_PATH_LEN 256
+#define MAX_STAGES 4                    /* Commands in one pipeline */
+#define ARGV_SLOTS (MAX_CMD_LEN / 2 + MAX_STAGES) /* A word at most every other character, and the NULLs */
+#define STDOUT_BUF_SIZE 1024
+#define STAGE_STACK_SIZE 8192
+#define SCRIPT_SIZE 4096                /* Largest script sh will run */
+#define SCRIPT_MAX_COMMANDS 64          /* Command lines in one script */
+#define SCRIPT_SLOTS (SCRIPT_SIZE / 2 + SCRIPT_MAX_COMMANDS * MAX_STAGES)
+
+struct builtin_command;
 
+/* Words point into the command line itself, which parsing cuts up with NULs */
 struct command {
-    char name[MAX_CMD_LEN];
-    char* args[MAX_ARGS + 1]; /* +1 for NULL terminator */
+    char** args;              /* NULL-terminated; args[0] is the command name */
     int argc;
+    char* input;              /* < file, or NULL */
+    char* output;             /* > file, or NULL */
+    const struct builtin_command* builtin;   /* Resolved when parsed; NULL if not found */
+};
+
+struct pipeline {
+    struct command stages[MAX_STAGES];
+    int count;
     int background;
 };
 
 /* Shell state */
 static char current_directory[MAX_PATH_LEN] = "/";
 static char input_buffer[MAX_CMD_LEN];
+static char* argv_slots[ARGV_SLOTS];   /* Every command's args, back to back */
+
+/*
+ * A script is read in one go and parsed whole before any of it runs:
+ * its pipelines, their words pointing into script_buffer, are kept in
+ * script_pipelines and then run one after another with no prompt and no
+ * further reads or lookups.
+ */
+static char script_buffer[SCRIPT_SIZE + 1];
+static char* script_slots[SCRIPT_SLOTS];
+static struct pipeline script_pipelines[SCRIPT_MAX_COMMANDS];
+static int script_running;
+
+/*
+ * Standard input and output of whatever is running. Output is collected
+ * in the buffer and handed to the kernel in one write: at each newline
+ * while it is the terminal (line buffered), else only when the buffer
+ * fills (fully buffered), and always before the shell reads input or a
+ * command finishes, so nothing typed overtakes a prompt.
+ */
+struct shell_io {
+    int in_fd;
+    int out_fd;
+    int line_buffered;
+    int length;
+    char buffer[STDOUT_BUF_SIZE];
+};
+
+static struct shell_io tty_io = {STDIN_FILENO, STDOUT_FILENO, 1, 0, {0}};
+static struct shell_io* io = &tty_io;
+
+/*
+ * Pipeline stages run side by side as coroutines on their own stacks,
+ * each with its own shell_io. A stage that finds its pipe empty or full
+ * switches back to the scheduler in run_pipeline, which resumes the next
+ * stage that has not finished; so data streams through the pipes a
+ * buffer at a time rather than piling up between commands.
+ */
+struct stage {
+    struct command* cmd;      /* NULL if its redirection failed */
+    struct shell_io io;
+    uint32_t esp;             /* Saved while switched out */
+    int done;
+    int status;
+};
+
+static struct stage stages[MAX_STAGES];
+static uint8_t stage_stacks[MAX_STAGES][STAGE_STACK_SIZE] __attribute__((aligned(16)));
+static int stage_current = -1;
+static uint32_t scheduler_esp;
+
+/*
+ * Save the callee-saved state and a resume address on this stack, park
+ * the stack pointer in *save and continue on next: either a stack parked
+ * the same way or a fresh one whose top word is the stage entry point.
+ * Always inlined, so the "memory" clobber acts at the call site: out of
+ * line, interprocedural analysis sees a function that touches no global
+ * and may drop stores, such as stage_current, made just before it.
+ */
+static inline __attribute__((always_inline)) void stage_switch(uint32_t* save, uint32_t next) {
+    __asm__ __volatile__ (
+        "push %%ebp\n"
+        "push $1f\n"
+        "mov %%esp, (%0)\n"
+        "mov %1, %%esp\n"
+        "ret\n"
+        "1:\n"
+        "pop %%ebp\n"
+        : "+a"(save), "+d"(next) : : "ebx", "ecx", "esi", "edi", "memory", "cc");
+}
+
+/* Let the other stages run; outside a pipeline there is nobody to wait for */
+static void stage_yield(void) {
+    if (stage_current >= 0) {
+        stage_switch(&stages[stage_current].esp, scheduler_esp);
+    }
+}
+
+/* Read from fd, waiting out an empty pipe */
+static int shell_read_fd(int fd, char* buffer, int size) {
+    int result;
+    while ((result = syscall3(SYS_READ, fd, (int)buffer, size)) == -EAGAIN) {
+        stage_yield();
+    }
+    return result;
+}
+
+/* Write all of data to fd, waiting out a full pipe; gives up once nobody reads */
+static void shell_write_fd(int fd, const char* data, int size) {
+    while (size > 0) {
+        int result = syscall3(SYS_WRITE, fd, (int)data, size);
+        if (result == -EAGAIN) {
+            stage_yield();
+        } else if (result <= 0) {
+            return;
+        } else {
+            data += result;
+            size -= result;
+        }
+    }
+}
 
 /* Built-in commands */
 static int builtin_help(int argc, char* argv[]);
@@ -162,36 +312,130 @@ static int builtin_pwd(int argc, char* argv[]);
 static int builtin_ls(int argc, char* argv[]);
 static int builtin_clear(int argc, char* argv[]);
 static int builtin_cat(int argc, char* argv[]);
+static int builtin_grep(int argc, char* argv[]);
+static int builtin_wc(int argc, char* argv[]);
+static int builtin_sh(int argc, char* argv[]);
+static int builtin_top(int argc, char* argv[]);
+static int builtin_sysctl(int argc, char* argv[]);
+
+/*
+ * Command table, in the order help lists it, and a perfect hash over it:
+ * BUILTIN_HASH gives every builtin its own slot in builtin_index, worked
+ * out by the compiler from the designated initializers. Two names landing
+ * on one slot would initialize it twice, which -Wextra reports and
+ * -Werror makes a build failure. A lookup is then one hash and one strcmp.
+ */
+#define BUILTIN_HASH_SIZE 32            /* Power of two */
+#define BUILTIN_HASH(length, first, last) \
+    (((length) * 3 + ((first) + (last)) * 7) & (BUILTIN_HASH_SIZE - 1))
+
+enum {
+    BUILTIN_HELP,
+    BUILTIN_EXIT,
+    BUILTIN_ECHO,
+    BUILTIN_CD,
+    BUILTIN_PWD,
+    BUILTIN_LS,
+    BUILTIN_CLEAR,
+    BUILTIN_CAT,
+    BUILTIN_GREP,
+    BUILTIN_WC,
+    BUILTIN_SH,
+    BUILTIN_TOP,
+    BUILTIN_SYSCTL,
+    BUILTIN_COUNT
+};
 
-/* Command table */
 struct builtin_command {
     const char* name;
     int (*func)(int argc, char* argv[]);
     const char* help;
 };
 
-static struct builtin_command builtin_commands[] = {
-    {"help", builtin_help, "Show available commands"},
-    {"exit", builtin_exit, "Exit the shell"},
-    {"echo", builtin_echo, "Echo arguments to output"},
-    {"cd", builtin_cd, "Change directory"},
-    {"pwd", builtin_pwd, "Print working directory"},
-    {"ls", builtin_ls, "List directory contents"},
-    {"clear", builtin_clear, "Clear screen"},
-    {"cat", builtin_cat, "Display file contents"},
-    {NULL, NULL, NULL}
+static struct builtin_command builtin_commands[BUILTIN_COUNT + 1] = {
+    [BUILTIN_HELP] = {"help", builtin_help, "Show available commands"},
+    [BUILTIN_EXIT] = {"exit", builtin_exit, "Exit the shell"},
+    [BUILTIN_ECHO] = {"echo", builtin_echo, "Echo arguments to output"},
+    [BUILTIN_CD] = {"cd", builtin_cd, "Change directory"},
+    [BUILTIN_PWD] = {"pwd", builtin_pwd, "Print working directory"},
+    [BUILTIN_LS] = {"ls", builtin_ls, "List directory contents"},
+    [BUILTIN_CLEAR] = {"clear", builtin_clear, "Clear screen"},
+    [BUILTIN_CAT] = {"cat", builtin_cat, "Display file contents"},
+    [BUILTIN_GREP] = {"grep", builtin_grep, "Print lines containing a string"},
+    [BUILTIN_WC] = {"wc", builtin_wc, "Count lines, words and bytes"},
+    [BUILTIN_SH] = {"sh", builtin_sh, "Run the commands in a script"},
+    [BUILTIN_TOP] = {"top", builtin_top, "Show system activity once a second"},
+    [BUILTIN_SYSCTL] = {"sysctl", builtin_sysctl, "List tunables, or set name=value"},
+    [BUILTIN_COUNT] = {NULL, NULL, NULL}
+};
+
+/* Slot to table index + 1; 0 is no builtin */
+static const uint8_t builtin_index[BUILTIN_HASH_SIZE] = {
+    [BUILTIN_HASH(4, 'h', 'p')] = BUILTIN_HELP + 1,
+    [BUILTIN_HASH(4, 'e', 't')] = BUILTIN_EXIT + 1,
+    [BUILTIN_HASH(4, 'e', 'o')] = BUILTIN_ECHO + 1,
+    [BUILTIN_HASH(2, 'c', 'd')] = BUILTIN_CD + 1,
+    [BUILTIN_HASH(3, 'p', 'd')] = BUILTIN_PWD + 1,
+    [BUILTIN_HASH(2, 'l', 's')] = BUILTIN_LS + 1,
+    [BUILTIN_HASH(5, 'c', 'r')] = BUILTIN_CLEAR + 1,
+    [BUILTIN_HASH(3, 'c', 't')] = BUILTIN_CAT + 1,
+    [BUILTIN_HASH(4, 'g', 'p')] = BUILTIN_GREP + 1,
+    [BUILTIN_HASH(2, 'w', 'c')] = BUILTIN_WC + 1,
+    [BUILTIN_HASH(2, 's', 'h')] = BUILTIN_SH + 1,
+    [BUILTIN_HASH(3, 't', 'p')] = BUILTIN_TOP + 1,
+    [BUILTIN_HASH(6, 's', 'l')] = BUILTIN_SYSCTL + 1,
 };
 
+/* One probe of the perfect hash; NULL if name is no builtin */
+static const struct builtin_command* find_builtin(const char* name) {
+    size_t length = strlen(name);
+    int index = builtin_index[BUILTIN_HASH(length, name[0], name[length - 1])];
+    if (index && strcmp(name, builtin_commands[index - 1].name) == 0) {
+        return &builtin_commands[index - 1];
+    }
+    return NULL;
+}
+
 /* Output functions */
-static void shell_putchar(char c) {
-    (void)c; /* Suppress unused parameter warning */
-    syscall1(SYS_WRITE, STDOUT_FILENO);
-    /* Note: This is simplified - real implementation would pass character */
-    /* For now, we'll use the write system call with buffer */
+static void shell_flush(void) {
+    if (io->length) {
+        int length = io->length;
+        io->length = 0;
+        shell_write_fd(io->out_fd, io->buffer, length);
+    }
+}
+
+static void shell_output(const char* data, int size) {
+    /* A block as large as the buffer gains nothing from a copy */
+    if (size >= STDOUT_BUF_SIZE) {
+        shell_flush();
+        shell_write_fd(io->out_fd, data, size);
+        return;
+    }
+    
+    int newline = 0;
+    while (size > 0) {
+        int chunk = STDOUT_BUF_SIZE - io->length;
+        if (chunk > size) {
+            chunk = size;
+        }
+        for (int i = 0; i < chunk; i++) {
+            newline |= data[i] == '\n';
+            io->buffer[io->length++] = data[i];
+        }
+        data += chunk;
+        size -= chunk;
+        if (io->length == STDOUT_BUF_SIZE) {
+            shell_flush();
+        }
+    }
+    if (newline && io->line_buffered) {
+        shell_flush();
+    }
 }
 
 static void shell_write(const char* str) {
-    syscall2(SYS_WRITE, STDOUT_FILENO, (int)str);
+    shell_output(str, (int)strlen(str));
 }
 
 static void shell_writeln(const char* str) {
@@ -199,71 +443,122 @@ static void shell_writeln(const char* str) {
     shell_write("\n");
 }
 
+static void shell_write_number(uint32_t value) {
+    char digits[11];
+    int i = sizeof(digits);
+    do {
+        digits[--i] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    shell_output(digits + i, (int)sizeof(digits) - i);
+}
+
 
 /* Input functions */
-static char shell_getchar(void) {
-    char c;
-    if (syscall2(SYS_READ, STDIN_FILENO, (int)&c) > 0) {
-        return c;
-    }
-    return 0;
-}
 
+/* One read returns the whole line, echoed and edited by the kernel's tty */
 static void shell_read_line(char* buffer, int max_len) {
-    int pos = 0;
-    
-    while (pos < max_len - 1) {
-        char c = shell_getchar();
-        if (c == '\n' || c == '\r') {
-            break;
-        } else if (c == '\b' || c == 127) {
-            if (pos > 0) {
-                pos--;
-                shell_write("\b \b"); /* Backspace, space, backspace */
-            }
-        } else if (c >= 32 && c <= 126) {
-            buffer[pos++] = c;
-            shell_putchar(c);
-        }
+    shell_flush();
+    int length = syscall3(SYS_READ, STDIN_FILENO, (int)buffer, max_len - 1);
+    if (length < 0) {
+        length = 0;
     }
-    
-    buffer[pos] = '\0';
-    shell_write("\n");
+    if (length > 0 && buffer[length - 1] == '\n') {
+        length--;
+    }
+    buffer[length] = '\0';
 }
 
 /* Command parsing */
-static void parse_command(const char* input, struct command* cmd) {
-    char buffer[MAX_CMD_LEN];
-    strncpy(buffer, input, MAX_CMD_LEN - 1);
-    buffer[MAX_CMD_LEN - 1] = '\0';
-    
+static int is_operator(char c) {
+    return c == '|' || c == '<' || c == '>' || c == '&';
+}
+
+/* Open the next stage of the pipeline, its args starting at slot; NULL if there are too many */
+static struct command* parse_stage(struct pipeline* pipeline, char** slot) {
+    if (pipeline->count == MAX_STAGES) {
+        return NULL;
+    }
+    struct command* cmd = &pipeline->stages[pipeline->count++];
+    cmd->args = slot;
     cmd->argc = 0;
-    cmd->background = 0;
-    
-    char* token = buffer;
-    char* saveptr;
-    
-    /* Parse command name */
-    token = strtok_r(buffer, " \t\n", &saveptr);
-    if (!token) return;
-    
-    strncpy(cmd->name, token, MAX_CMD_LEN - 1);
-    cmd->name[MAX_CMD_LEN - 1] = '\0';
-    cmd->args[cmd->argc++] = cmd->name;
+    cmd->input = NULL;
+    cmd->output = NULL;
+    cmd->builtin = NULL;
+    return cmd;
+}
+
+/*
+ * Parse "cmd args [< in] [> out] | cmd ... [&]" in place: separators and
+ * operators in line are overwritten with NULs, which ends the word before
+ * them, and args point at the words where they lie, so no word is copied
+ * and the number of them is bounded only by the line. The args go in
+ * slots, which must have room for half the line's length plus a NULL per
+ * stage. Operators need no spaces around them. Each command's builtin is
+ * looked up here, once. Returns 0, or -1 on a syntax error, with
+ * pipeline->count 0.
+ */
+static int parse_command(char* line, struct pipeline* pipeline, char** slots) {
+    char** slot = slots;
+    struct command* cmd = NULL;
+    char** redirect = NULL;             /* Where the word after < or > goes */
+    char* p = line;
     
-    /* Parse arguments */
-    while ((token = strtok_r(NULL, " \t\n", &saveptr)) && cmd->argc < MAX_ARGS) {
-        cmd->args[cmd->argc++] = token;
+    pipeline->count = 0;
+    pipeline->background = 0;
+    while (*p) {
+        char c = *p;
+        if (c == ' ' || c == '\t' || c == '\n') {
+            *p++ = '\0';
+            continue;
+        }
+        if (pipeline->background) {
+            goto error;                 /* Nothing may follow & */
+        }
+        if (c == '|' || c == '&') {
+            if (!cmd || !cmd->argc || redirect) goto error;
+            *p++ = '\0';
+            *slot++ = NULL;
+            cmd = NULL;
+            pipeline->background = c == '&';
+            continue;
+        }
+        
+        if (!cmd && !(cmd = parse_stage(pipeline, slot))) goto error;
+        if (c == '<' || c == '>') {
+            if (redirect) goto error;
+            *p++ = '\0';
+            redirect = c == '<' ? &cmd->input : &cmd->output;
+            continue;
+        }
+        
+        char* word = p;
+        while (*p && *p != ' ' && *p != '\t' && *p != '\n' && !is_operator(*p)) {
+            p++;
+        }
+        if (redirect) {
+            *redirect = word;
+            redirect = NULL;
+        } else {
+            *slot++ = word;
+            cmd->argc++;
+        }
     }
     
-    /* Check for background execution */
-    if (cmd->argc > 0 && strcmp(cmd->args[cmd->argc - 1], "&") == 0) {
-        cmd->background = 1;
-        cmd->argc--;
-        cmd->args[cmd->argc] = NULL;
-    } else {
-        cmd->args[cmd->argc] = NULL;
+    if (redirect || (cmd && !cmd->argc) || (!cmd && pipeline->count && !pipeline->background)) {
+        goto error;                     /* Dangling < or >, or a line ending in | */
     }
+    if (cmd) {
+        *slot = NULL;
+    }
+    for (int i = 0; i < pipeline->count; i++) {
+        pipeline->stages[i].builtin = find_builtin(pipeline->stages[i].args[0]);
+    }
+    return 0;
+    
+error:
+    pipeline->count = 0;
+    return -1;
 }
 
 /* Built-in command implementations */
@@ -290,6 +585,7 @@ static int builtin_exit(int argc, char* argv[]) {
     (void)argc;
     (void)argv;
     shell_writeln("Exiting shell...");
+    shell_flush();
     syscall0(SYS_EXIT);
     return 0;
 }
@@ -351,12 +647,17 @@ static int builtin_ls(int argc, char* argv[]) {
         return 1;
     }
     
-    struct dirent entry;
-    memset(&entry, 0, sizeof(entry)); /* Initialize to avoid warning */
-    while (syscall3(SYS_READDIR, dirfd, (int)&entry, sizeof(entry)) > 0) {
-        if (entry.d_name[0] != '\0') {
-            shell_write(entry.d_name);
-            shell_write("\n");
+    /* Entries come packed, d_reclen bytes each, many per call */
+    static char buffer[2048];
+    int bytes;
+    while ((bytes = syscall3(SYS_GETDENTS, dirfd, (int)buffer, sizeof(buffer))) > 0) {
+        for (int offset = 0; offset < bytes; ) {
+            struct dirent* entry = (struct dirent*)(buffer + offset);
+            if (entry->d_name[0] != '\0') {
+                shell_write(entry->d_name);
+                shell_write("\n");
+            }
+            offset += entry->d_reclen;
         }
     }
     
@@ -371,75 +672,493 @@ static int builtin_clear(int argc, char* argv[]) {
     return 0;
 }
 
+/* The file named in argv[index], or standard input if there is none; -1 after a message */
+static int open_input(const char* command, int argc, char* argv[], int index) {
+    if (argc <= index) {
+        return io->in_fd;
+    }
+    int fd = syscall2(SYS_OPEN, (int)argv[index], 0);
+    if (fd < 0) {
+        shell_write(command);
+        shell_write(": ");
+        shell_write(argv[index]);
+        shell_writeln(": No such file");
+    }
+    return fd;
+}
+
+static void close_input(int fd) {
+    if (fd != io->in_fd) {
+        syscall1(SYS_CLOSE, fd);
+    }
+}
+
 static int builtin_cat(int argc, char* argv[]) {
-    if (argc != 2) {
-        shell_writeln("Usage: cat <file>");
+    if (argc > 2) {
+        shell_writeln("Usage: cat [file]");
         return 1;
     }
-    
-    int fd = syscall1(SYS_OPEN, (int)argv[1]);
+    int fd = open_input("cat", argc, argv, 1);
     if (fd < 0) {
-        shell_write("cat: ");
-        shell_write(argv[1]);
-        shell_writeln(": No such file");
         return 1;
     }
     
     char buffer[1024];
     int bytes_read;
     
-    while ((bytes_read = syscall3(SYS_READ, fd, (int)buffer, sizeof(buffer))) > 0) {
-        syscall2(SYS_WRITE, STDOUT_FILENO, (int)buffer);
+    while ((bytes_read = shell_read_fd(fd, buffer, sizeof(buffer))) > 0) {
+        shell_output(buffer, bytes_read);
     }
     
-    syscall1(SYS_CLOSE, fd);
+    close_input(fd);
     return 0;
 }
 
-/* Simple strtok_r implementation */
-static char* strtok_r(char* str, const char* delim, char** saveptr) {
-    if (str == NULL) {
-        str = *saveptr;
+static int contains(const char* text, const char* pattern) {
+    for (; *text; text++) {
+        const char* t = text;
+        const char* p = pattern;
+        while (*p && *t == *p) {
+            t++;
+            p++;
+        }
+        if (!*p) {
+            return 1;
+        }
+    }
+    return !*pattern;
+}
+
+/* Print line if it contains pattern; returns whether it did */
+static int grep_line(char* line, int length, const char* pattern) {
+    line[length] = '\0';
+    if (!contains(line, pattern)) {
+        return 0;
+    }
+    shell_output(line, length);
+    shell_write("\n");
+    return 1;
+}
+
+/* Lines longer than a command line are matched in pieces */
+static int builtin_grep(int argc, char* argv[]) {
+    if (argc < 2 || argc > 3) {
+        shell_writeln("Usage: grep <string> [file]");
+        return 1;
+    }
+    int fd = open_input("grep", argc, argv, 2);
+    if (fd < 0) {
+        return 1;
     }
     
-    if (*str == '\0') {
-        *saveptr = str;
-        return NULL;
+    char buffer[256];
+    char line[MAX_CMD_LEN];
+    int length = 0;
+    int matched = 0;
+    int bytes_read;
+    while ((bytes_read = shell_read_fd(fd, buffer, sizeof(buffer))) > 0) {
+        for (int i = 0; i < bytes_read; i++) {
+            if (buffer[i] != '\n' && length < MAX_CMD_LEN - 1) {
+                line[length++] = buffer[i];
+                continue;
+            }
+            matched |= grep_line(line, length, argv[1]);
+            length = 0;
+            if (buffer[i] != '\n') {
+                line[length++] = buffer[i];
+            }
+        }
+    }
+    if (length) {
+        matched |= grep_line(line, length, argv[1]);
     }
     
-    char* token = str;
-    while (*str) {
-        const char* d = delim;
-        while (*d) {
-            if (*str == *d) {
-                *str = '\0';
-                *saveptr = str + 1;
-                return token;
+    close_input(fd);
+    return matched ? 0 : 1;
+}
+
+static int builtin_wc(int argc, char* argv[]) {
+    if (argc > 2) {
+        shell_writeln("Usage: wc [file]");
+        return 1;
+    }
+    int fd = open_input("wc", argc, argv, 1);
+    if (fd < 0) {
+        return 1;
+    }
+    
+    char buffer[1024];
+    uint32_t lines = 0, words = 0, bytes = 0;
+    int in_word = 0;
+    int bytes_read;
+    while ((bytes_read = shell_read_fd(fd, buffer, sizeof(buffer))) > 0) {
+        bytes += bytes_read;
+        for (int i = 0; i < bytes_read; i++) {
+            char c = buffer[i];
+            int space = c == ' ' || c == '\t' || c == '\n';
+            lines += c == '\n';
+            words += !space && !in_word;
+            in_word = !space;
+        }
+    }
+    
+    shell_write_number(lines);
+    shell_write(" ");
+    shell_write_number(words);
+    shell_write(" ");
+    shell_write_number(bytes);
+    shell_write("\n");
+    close_input(fd);
+    return 0;
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+/* value right-aligned in width columns */
+static void shell_write_padded(uint32_t value, int width) {
+    uint32_t digits = 1;
+    for (uint32_t rest = value; rest >= 10; rest /= 10) {
+        digits++;
+    }
+    for (int i = (int)digits; i < width; i++) {
+        shell_write(" ");
+    }
+    shell_write_number(value);
+}
+
+/* delta events over elapsed_ms, per second */
+static uint32_t per_second(uint32_t delta, uint32_t elapsed_ms) {
+    if (!elapsed_ms) {
+        return 0;
+    }
+    return delta > 0xFFFFFFFFu / 1000 ? delta / elapsed_ms * 1000 : delta * 1000 / elapsed_ms;
+}
+
+/*
+ * Redraw a status screen once a second, count times (TOP_REFRESHES by
+ * default). Every rate is the difference of two snapshots over the time
+ * between them, so the kernel keeps nothing for top while it is not
+ * running; CPU% needs the timer interrupt and shows - without it.
+ */
+static int builtin_top(int argc, char* argv[]) {
+    uint32_t count = TOP_REFRESHES;
+    if (argc == 2) {
+        count = 0;
+        for (const char* p = argv[1]; *p; p++) {
+            if (*p < '0' || *p > '9') {
+                count = 0;
+                break;
             }
-            d++;
+            count = count * 10 + (uint32_t)(*p - '0');
         }
-        str++;
+    }
+    if (argc > 2 || !count) {
+        shell_writeln("Usage: top [count]");
+        return 1;
     }
     
-    *saveptr = str;
-    return token;
+    static struct sys_stats snapshots[2];
+    struct sys_stats* last = &snapshots[0];
+    struct sys_stats* now = &snapshots[1];
+    if (syscall2(SYS_STATS, (int)last, sizeof(*last)) != (int)sizeof(*last) || !last->tsc_khz) {
+        shell_writeln("top: no statistics from the kernel");
+        return 1;
+    }
+    
+    for (uint32_t screen = 0; screen < count; screen++) {
+        /* Nothing else runs while top waits, so it spins on the TSC rather than sleep */
+        uint64_t until = rdtsc() + (uint64_t)last->tsc_khz * 1000;
+        while (rdtsc() < until) {
+            __asm__ __volatile__("pause");
+        }
+        syscall2(SYS_STATS, (int)now, sizeof(*now));
+        uint32_t elapsed = now->uptime_ms - last->uptime_ms;
+        uint32_t ticks = now->ticks - last->ticks;
+        
+        shell_write("\033[2J\033[H");
+        shell_write("top - up ");
+        shell_write_number(now->uptime_ms / 1000);
+        shell_write("s, heap ");
+        shell_write_number(now->heap_used);
+        shell_writeln(" bytes in use");
+        static const char* const labels[] = {"syscalls/s", "irqs/s", "faults/s", "ctxsw/s", "rx pps", "tx pps"};
+        for (int i = STATS_SYSCALLS; i <= STATS_NET_TX_PACKETS; i++) {
+            shell_write(i ? "  " : "");
+            shell_write(labels[i]);
+            shell_write(" ");
+            shell_write_number(per_second(now->counters[i] - last->counters[i], elapsed));
+        }
+        shell_writeln("");
+        shell_writeln("");
+        shell_writeln("  PID  CPU%  CTXSW    HOT    MEM  NAME");
+        for (uint32_t i = 0; i < now->proc_count && i < STATS_MAX_PROCS; i++) {
+            const struct stats_proc* proc = &now->procs[i];
+            const struct stats_proc* before = NULL;
+            for (uint32_t j = 0; j < last->proc_count && j < STATS_MAX_PROCS; j++) {
+                if (last->procs[j].pid == proc->pid) {
+                    before = &last->procs[j];
+                }
+            }
+            uint32_t cpu_ticks = proc->cpu_ticks - (before ? before->cpu_ticks : 0);
+            uint32_t switches = proc->switches - (before ? before->switches : 0);
+            shell_write_padded(proc->pid, 5);
+            if (ticks) {
+                shell_write_padded(cpu_ticks > ticks ? 100 : cpu_ticks * 100 / ticks, 6);
+            } else {
+                shell_write("     -");
+            }
+            shell_write_padded(switches, 7);
+            shell_write_padded(proc->cache_hotness, 7);
+            shell_write_padded(proc->mem_bytes, 7);
+            shell_write("  ");
+            shell_writeln(proc->name);
+        }
+        shell_flush();
+        
+        struct sys_stats* swap = last;
+        last = now;
+        now = swap;
+    }
+    return 0;
+}
+
+/* Print every tunable, or set each name=value given; the kernel refuses a value out of bounds */
+static int builtin_sysctl(int argc, char* argv[]) {
+    int fd = syscall2(SYS_OPEN, (int)"/proc/sysctl", 0);
+    if (fd < 0) {
+        shell_writeln("sysctl: no /proc/sysctl");
+        return 1;
+    }
+    int status = 0;
+    if (argc == 1) {
+        char buffer[512];
+        int bytes_read;
+        while ((bytes_read = shell_read_fd(fd, buffer, sizeof(buffer))) > 0) {
+            shell_output(buffer, bytes_read);
+        }
+    }
+    for (int i = 1; i < argc; i++) {
+        int length = (int)strlen(argv[i]);
+        if (syscall3(SYS_WRITE, fd, (int)argv[i], length) != length) {
+            shell_write("sysctl: refused ");
+            shell_writeln(argv[i]);
+            status = 1;
+        }
+    }
+    syscall1(SYS_CLOSE, fd);
+    return status;
 }
 
 /* Command execution */
 static int execute_command(struct command* cmd) {
-    /* Check for built-in commands */
-    for (int i = 0; builtin_commands[i].name; i++) {
-        if (strcmp(cmd->name, builtin_commands[i].name) == 0) {
-            return builtin_commands[i].func(cmd->argc, cmd->args);
-        }
+    if (cmd->builtin) {
+        return cmd->builtin->func(cmd->argc, cmd->args);
     }
     
     shell_write("shell: ");
-    shell_write(cmd->name);
+    shell_write(cmd->args[0]);
     shell_writeln(": command not found");
     return 127;
 }
 
+/* A stage's first frame: run its command, flush, close its ends and never come back */
+static void stage_start(void) {
+    struct stage* stage = &stages[stage_current];
+    stage->status = stage->cmd ? execute_command(stage->cmd) : 1;
+    shell_flush();
+    if (stage->io.in_fd != STDIN_FILENO) {
+        syscall1(SYS_CLOSE, stage->io.in_fd);
+    }
+    if (stage->io.out_fd != STDOUT_FILENO) {
+        syscall1(SYS_CLOSE, stage->io.out_fd);   /* The reader downstream sees end of file */
+    }
+    stage->done = 1;
+    stage_switch(&stage->esp, scheduler_esp);
+}
+
+/* Point *fd at path in place of what it had; 0 after a message if it cannot be opened */
+static int stage_redirect(int* fd, const char* path, int flags, int standard_fd) {
+    int new_fd = syscall2(SYS_OPEN, (int)path, flags);
+    if (new_fd < 0) {
+        shell_write("shell: ");
+        shell_write(path);
+        shell_writeln(flags ? ": Cannot create file" : ": No such file");
+        return 0;
+    }
+    if (*fd != standard_fd) {
+        syscall1(SYS_CLOSE, *fd);
+    }
+    *fd = new_fd;
+    return 1;
+}
+
+/*
+ * Connect the stages with pipes, apply their redirections, then run them
+ * round robin until all have finished. Returns the last stage's status.
+ */
+static int run_pipeline(struct pipeline* pipeline) {
+    int count = pipeline->count;
+    int pipe_fds[MAX_STAGES - 1][2];
+    for (int i = 0; i < count - 1; i++) {
+        if (syscall1(SYS_PIPE, (int)pipe_fds[i]) < 0) {
+            while (i--) {
+                syscall1(SYS_CLOSE, pipe_fds[i][0]);
+                syscall1(SYS_CLOSE, pipe_fds[i][1]);
+            }
+            shell_writeln("shell: Too many pipes open");
+            return 1;
+        }
+    }
+    
+    for (int i = 0; i < count; i++) {
+        struct command* cmd = &pipeline->stages[i];
+        struct stage* stage = &stages[i];
+        stage->cmd = cmd;
+        stage->done = 0;
+        stage->status = 0;
+        stage->io.in_fd = i ? pipe_fds[i - 1][0] : STDIN_FILENO;
+        stage->io.out_fd = i < count - 1 ? pipe_fds[i][1] : STDOUT_FILENO;
+        stage->io.length = 0;
+        if (cmd->input && !stage_redirect(&stage->io.in_fd, cmd->input, 0, STDIN_FILENO)) {
+            stage->cmd = NULL;
+        }
+        if (cmd->output && !stage_redirect(&stage->io.out_fd, cmd->output, O_CREAT | O_TRUNC, STDOUT_FILENO)) {
+            stage->cmd = NULL;
+        }
+        /* A script's output is flushed as each command finishes rather than at every newline */
+        stage->io.line_buffered = stage->io.out_fd == STDOUT_FILENO && !script_running;
+        
+        /* A fresh stack: stage_start as the resume address, under it a return address never used */
+        uint32_t* sp = (uint32_t*)(stage_stacks[i] + STAGE_STACK_SIZE);
+        *--sp = 0;
+        *--sp = (uint32_t)stage_start;
+        stage->esp = (uint32_t)sp;
+    }
+    
+    int running = count;
+    while (running) {
+        running = 0;
+        for (int i = 0; i < count; i++) {
+            if (!stages[i].done) {
+                stage_current = i;
+                io = &stages[i].io;
+                stage_switch(&scheduler_esp, stages[i].esp);
+                running += !stages[i].done;
+            }
+        }
+    }
+    stage_current = -1;
+    io = &tty_io;
+    return stages[count - 1].status;
+}
+
+/*
+ * Read path into script_buffer and parse every line of it into
+ * script_pipelines, skipping blank lines and # comments. Returns the
+ * number of pipelines, or -1 after a message if the script cannot be
+ * read or a line does not parse, in which case none of it should run.
+ */
+static int load_script(const char* path) {
+    int fd = syscall2(SYS_OPEN, (int)path, 0);
+    if (fd < 0) {
+        shell_write("sh: ");
+        shell_write(path);
+        shell_writeln(": No such file");
+        return -1;
+    }
+    int size = 0;
+    int n;
+    while (size < SCRIPT_SIZE && (n = syscall3(SYS_READ, fd, (int)(script_buffer + size), SCRIPT_SIZE - size)) > 0) {
+        size += n;
+    }
+    char extra;
+    int too_large = size == SCRIPT_SIZE && syscall3(SYS_READ, fd, (int)&extra, 1) > 0;
+    syscall1(SYS_CLOSE, fd);
+    if (too_large) {
+        shell_write("sh: ");
+        shell_write(path);
+        shell_writeln(": Script too large");
+        return -1;
+    }
+    script_buffer[size] = '\0';
+    
+    char** slot = script_slots;
+    int count = 0;
+    int line_number = 0;
+    char* line = script_buffer;
+    while (line < script_buffer + size) {
+        char* end = line;
+        while (*end && *end != '\n') {
+            end++;
+        }
+        *end = '\0';
+        line_number++;
+        
+        char* p = line;
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p && *p != '#') {
+            struct pipeline* pipeline = &script_pipelines[count];
+            if (count == SCRIPT_MAX_COMMANDS) {
+                shell_writeln("sh: Too many commands in script");
+                return -1;
+            }
+            if (parse_command(p, pipeline, slot) < 0) {
+                shell_write("sh: syntax error on line ");
+                shell_write_number(line_number);
+                shell_writeln("");
+                return -1;
+            }
+            struct command* last = &pipeline->stages[pipeline->count - 1];
+            slot = last->args + last->argc + 1;
+            count++;
+        }
+        line = end + 1;
+    }
+    return count;
+}
+
+/* Run a script's pipelines in order; returns the last one's status */
+static int run_script(const char* path) {
+    int count = load_script(path);
+    if (count < 0) {
+        return 1;
+    }
+    
+    int status = 0;
+    script_running = 1;
+    for (int i = 0; i < count; i++) {
+        status = run_pipeline(&script_pipelines[i]);
+    }
+    script_running = 0;
+    return status;
+}
+
+/*
+ * Reached only when sh is a stage of a pipeline, or run by a script:
+ * both would need run_pipeline while it is already running, so sh only
+ * runs as a command of its own, where shell_loop calls run_script.
+ */
+static int builtin_sh(int argc, char* argv[]) {
+    (void)argc;
+    (void)argv;
+    shell_writeln(script_running ? "sh: Scripts cannot run scripts" :
+                                   "sh: Cannot be part of a pipeline or redirected");
+    return 1;
+}
+
+/* Whether pipeline is a plain "sh script" that shell_loop runs itself */
+static int is_script_command(const struct pipeline* pipeline) {
+    const struct command* cmd = &pipeline->stages[0];
+    return pipeline->count == 1 && !pipeline->background && cmd->builtin == &builtin_commands[BUILTIN_SH] &&
+           !cmd->input && !cmd->output;
+}
+
 /* Shell prompt */
 static void show_prompt(void) {
     if (syscall2(SYS_GETCWD, (int)current_directory, MAX_PATH_LEN) < 0) {
@@ -453,7 +1172,7 @@ static void show_prompt(void) {
 
 /* Main shell loop */
 static void shell_loop(void) {
-    struct command cmd;
+    static struct pipeline pipeline;
     
     while (1) {
         show_prompt();
@@ -467,10 +1186,21 @@ static void shell_loop(void) {
         }
         
         /* Parse command */
-        parse_command(input_buffer, &cmd);
+        if (parse_command(input_buffer, &pipeline, argv_slots) < 0) {
+            shell_writeln("shell: syntax error");
+            continue;
+        }
         
         /* Execute command */
-        execute_command(&cmd);
+        if (pipeline.count && is_script_command(&pipeline)) {
+            if (pipeline.stages[0].argc != 2) {
+                shell_writeln("Usage: sh <script>");
+            } else {
+                run_script(pipeline.stages[0].args[1]);
+            }
+        } else if (pipeline.count) {
+            run_pipeline(&pipeline);
+        }
     }
 }
 
@@ -489,5 +1219,6 @@ void shell_main(void) {
     shell_loop();
     
     /* Should never reach here */
+    shell_flush();
     syscall0(SYS_EXIT);
 }
\ No newline at end of file
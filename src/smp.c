@@ -0,0 +1,558 @@
+/*
+ * Phase 10: Multiprocessor Support
+ * MADT/MP table discovery, AP start-up and per-CPU data areas
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* SMP constants */
+#define MAX_CPUS 8
+#define CPU_STACK_SIZE 8192
+#define TRAMPOLINE_BASE 0x8000       /* Must match ap_trampoline.asm */
+#define AP_START_TIMEOUT 100000      /* Polls of the started flag per AP */
+
+/* Local APIC */
+#define LAPIC_DEFAULT_BASE 0xFEE00000
+#define ICR_INIT 0x00004500
+#define ICR_STARTUP 0x00004600
+
+/* Per-CPU GDT layout */
+#define GDT_ENTRIES 7
+#define GDT_KERNEL_CODE 0x08
+#define GDT_KERNEL_DATA 0x10
+#define GDT_USER_CODE 0x18
+#define GDT_USER_DATA 0x20
+#define GDT_TSS 0x28
+#define GDT_PERCPU 0x30
+
+/* ACPI MADT entry types */
+#define MADT_LOCAL_APIC 0
+#define MADT_IO_APIC 1
+#define MADT_INTERRUPT_OVERRIDE 2
+#define MADT_LAPIC_ENABLED 0x1
+
+/* MP configuration table entry types */
+#define MP_ENTRY_PROCESSOR 0
+#define MP_ENTRY_IOAPIC 2
+#define MP_PROCESSOR_ENABLED 0x1
+
+/* Task state segment */
+struct tss {
+    uint32_t prev_tss;
+    uint32_t esp0;
+    uint32_t ss0;
+    uint32_t esp1;
+    uint32_t ss1;
+    uint32_t esp2;
+    uint32_t ss2;
+    uint32_t cr3;
+    uint32_t eip;
+    uint32_t eflags;
+    uint32_t eax;
+    uint32_t ecx;
+    uint32_t edx;
+    uint32_t ebx;
+    uint32_t esp;
+    uint32_t ebp;
+    uint32_t esi;
+    uint32_t edi;
+    uint32_t es;
+    uint32_t cs;
+    uint32_t ss;
+    uint32_t ds;
+    uint32_t fs;
+    uint32_t gs;
+    uint32_t ldt;
+    uint16_t trap;
+    uint16_t iomap_base;
+} __attribute__((packed));
+
+/* Per-CPU data area, reached through %gs */
+typedef struct cpu {
+    struct cpu* self;                /* Must stay first: this_cpu() loads %gs:0 */
+    uint32_t stack_guard;            /* Must stay at %gs:4: the canary under make SSP_GUARD=tls */
+    uint32_t id;                     /* Logical CPU number, 0 is the BSP */
+    uint32_t apic_id;
+    volatile uint32_t started;
+    uint64_t gdt[GDT_ENTRIES];
+    struct tss tss;
+} cpu_t;
+
+/* ACPI table headers */
+struct acpi_rsdp {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+} __attribute__((packed));
+
+struct acpi_header {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+struct acpi_madt {
+    struct acpi_header header;
+    uint32_t lapic_address;
+    uint32_t flags;
+} __attribute__((packed));
+
+struct madt_local_apic {
+    uint8_t type;
+    uint8_t length;
+    uint8_t processor_id;
+    uint8_t apic_id;
+    uint32_t flags;
+} __attribute__((packed));
+
+struct madt_io_apic {
+    uint8_t type;
+    uint8_t length;
+    uint8_t ioapic_id;
+    uint8_t reserved;
+    uint32_t address;
+    uint32_t gsi_base;
+} __attribute__((packed));
+
+struct madt_interrupt_override {
+    uint8_t type;
+    uint8_t length;
+    uint8_t bus;
+    uint8_t source;
+    uint32_t gsi;
+    uint16_t flags;
+} __attribute__((packed));
+
+/* Intel MP specification tables */
+struct mp_floating_pointer {
+    char signature[4];
+    uint32_t config_address;
+    uint8_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    uint8_t features[5];
+} __attribute__((packed));
+
+struct mp_config_header {
+    char signature[4];
+    uint16_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[8];
+    char product_id[12];
+    uint32_t oem_table;
+    uint16_t oem_table_size;
+    uint16_t entry_count;
+    uint32_t lapic_address;
+    uint16_t extended_length;
+    uint8_t extended_checksum;
+    uint8_t reserved;
+} __attribute__((packed));
+
+struct mp_processor_entry {
+    uint8_t type;
+    uint8_t apic_id;
+    uint8_t apic_version;
+    uint8_t flags;
+    uint32_t signature;
+    uint32_t features;
+    uint32_t reserved[2];
+} __attribute__((packed));
+
+struct mp_ioapic_entry {
+    uint8_t type;
+    uint8_t ioapic_id;
+    uint8_t version;
+    uint8_t flags;
+    uint32_t address;
+} __attribute__((packed));
+
+/* Global variables */
+static cpu_t cpus[MAX_CPUS];
+static uint8_t cpu_stacks[MAX_CPUS][CPU_STACK_SIZE] __attribute__((aligned(16)));
+static uint32_t cpu_count = 0;
+static int bsp_own_descriptors = 0;  /* The stage keeps its GDT and TSS on the BSP */
+
+/* Trampoline (ap_trampoline.asm) */
+extern uint8_t ap_trampoline_start[];
+extern uint8_t ap_trampoline_end[];
+extern uint32_t ap_boot_stack;
+extern uint32_t ap_boot_cr3;
+extern uint32_t ap_boot_cr4;
+extern uint32_t ap_boot_entry;
+
+/* Local and I/O APIC driver (apic.c) */
+extern void lapic_set_base(uint32_t address);
+extern void lapic_enable(void);
+extern uint32_t lapic_id(void);
+extern void lapic_send_ipi(uint32_t apic_id, uint32_t command);
+extern void apic_reset(void);
+extern uint32_t ioapic_add(uint32_t address, uint32_t gsi_base);
+extern void ioapic_add_override(uint8_t irq, uint32_t gsi, uint16_t flags);
+
+/* Hardware entropy (stack_protector.c) */
+extern uint32_t hw_random(void);
+
+/* Function prototypes */
+void smp_init(void);
+cpu_t* this_cpu(void);
+uint32_t smp_processor_id(void);
+uint32_t smp_cpu_count(void);
+void ap_main(void);
+
+/* Utility functions */
+static void* memcpy(void* dest, const void* src, size_t n) {
+    uint8_t* d = dest;
+    const uint8_t* s = src;
+    while (n--) *d++ = *s++;
+    return dest;
+}
+
+static int memcmp(const void* a, const void* b, size_t n) {
+    const uint8_t* x = a;
+    const uint8_t* y = b;
+    for (size_t i = 0; i < n; i++) {
+        if (x[i] != y[i]) return x[i] - y[i];
+    }
+    return 0;
+}
+
+static uint8_t checksum(const void* data, uint32_t length) {
+    const uint8_t* bytes = data;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        sum += bytes[i];
+    }
+    return sum;
+}
+
+static inline void outb(uint16_t port, uint8_t value) {
+    __asm__ __volatile__("outb %0, %1" : : "a"(value), "Nd"(port));
+}
+
+/* Roughly one microsecond per write to the POST port */
+static void udelay(uint32_t microseconds) {
+    while (microseconds--) {
+        outb(0x80, 0);
+    }
+}
+
+/* Record a usable processor reported by firmware */
+static void cpu_add(uint32_t apic_id) {
+    if (cpu_count >= MAX_CPUS) {
+        return;
+    }
+    
+    cpu_t* cpu = &cpus[cpu_count];
+    cpu->self = cpu;
+    cpu->id = cpu_count;
+    cpu->apic_id = apic_id;
+    cpu->stack_guard = hw_random() & ~0xFFu;
+    cpu->started = 0;
+    cpu_count++;
+}
+
+/* Scan a physical range for a 16-byte aligned signature */
+static void* scan_signature(uint32_t start, uint32_t length, const char* signature, uint32_t size) {
+    for (uint32_t addr = start; addr + size <= start + length; addr += 16) {
+        if (memcmp((void*)addr, signature, size) == 0) {
+            return (void*)addr;
+        }
+    }
+    return NULL;
+}
+
+/* Read a word from the BIOS data area (asm keeps GCC from treating page 0 as null) */
+static inline uint16_t bios_read16(uint32_t addr) {
+    uint16_t value;
+    __asm__ __volatile__("movw (%1), %0" : "=r"(value) : "r"(addr));
+    return value;
+}
+
+/* Search the EBDA and the BIOS ROM area the way firmware tables require */
+static void* find_bios_table(const char* signature, uint32_t size) {
+    uint32_t ebda = (uint32_t)bios_read16(0x40E) << 4;
+    void* table = NULL;
+    
+    if (ebda) {
+        table = scan_signature(ebda, 1024, signature, size);
+    }
+    if (!table) {
+        table = scan_signature(0x9FC00, 1024, signature, size);
+    }
+    if (!table) {
+        table = scan_signature(0xE0000, 0x20000, signature, size);
+    }
+    return table;
+}
+
+/* Enumerate processors from the ACPI MADT; returns 0 if there is none */
+static int smp_parse_madt(void) {
+    struct acpi_rsdp* rsdp = find_bios_table("RSD PTR ", 8);
+    if (!rsdp || checksum(rsdp, sizeof(struct acpi_rsdp)) != 0) {
+        return 0;
+    }
+    
+    struct acpi_header* rsdt = (struct acpi_header*)rsdp->rsdt_address;
+    if (memcmp(rsdt->signature, "RSDT", 4) != 0) {
+        return 0;
+    }
+    
+    uint32_t table_count = (rsdt->length - sizeof(struct acpi_header)) / 4;
+    uint32_t* tables = (uint32_t*)(rsdt + 1);
+    for (uint32_t i = 0; i < table_count; i++) {
+        struct acpi_madt* madt = (struct acpi_madt*)tables[i];
+        if (memcmp(madt->header.signature, "APIC", 4) != 0 ||
+            checksum(madt, madt->header.length) != 0) {
+            continue;
+        }
+        
+        lapic_set_base(madt->lapic_address);
+        
+        /* Variable-length entries follow the fixed header */
+        uint8_t* entry = (uint8_t*)(madt + 1);
+        uint8_t* end = (uint8_t*)madt + madt->header.length;
+        while (entry + 2 <= end && entry[1] >= 2) {
+            struct madt_local_apic* local = (struct madt_local_apic*)entry;
+            if (local->type == MADT_LOCAL_APIC && (local->flags & MADT_LAPIC_ENABLED)) {
+                cpu_add(local->apic_id);
+            } else if (entry[0] == MADT_IO_APIC) {
+                struct madt_io_apic* io = (struct madt_io_apic*)entry;
+                ioapic_add(io->address, io->gsi_base);
+            } else if (entry[0] == MADT_INTERRUPT_OVERRIDE) {
+                struct madt_interrupt_override* iso = (struct madt_interrupt_override*)entry;
+                ioapic_add_override(iso->source, iso->gsi, iso->flags);
+            }
+            entry += entry[1];
+        }
+        return cpu_count > 0;
+    }
+    return 0;
+}
+
+/* Enumerate processors from the legacy MP tables; returns 0 if absent */
+static int smp_parse_mp_table(void) {
+    struct mp_floating_pointer* mpfp = find_bios_table("_MP_", 4);
+    if (!mpfp || !mpfp->config_address || checksum(mpfp, mpfp->length * 16) != 0) {
+        return 0;
+    }
+    
+    struct mp_config_header* config = (struct mp_config_header*)mpfp->config_address;
+    if (memcmp(config->signature, "PCMP", 4) != 0 || checksum(config, config->length) != 0) {
+        return 0;
+    }
+    
+    lapic_set_base(config->lapic_address);
+    
+    /* Processor entries are 20 bytes, every other entry type is 8 */
+    uint32_t gsi_base = 0;
+    uint8_t* entry = (uint8_t*)(config + 1);
+    for (uint32_t i = 0; i < config->entry_count; i++) {
+        if (entry[0] == MP_ENTRY_PROCESSOR) {
+            struct mp_processor_entry* processor = (struct mp_processor_entry*)entry;
+            if (processor->flags & MP_PROCESSOR_ENABLED) {
+                cpu_add(processor->apic_id);
+            }
+            entry += sizeof(struct mp_processor_entry);
+        } else if (entry[0] == MP_ENTRY_IOAPIC) {
+            /* Without the MADT, GSIs are numbered across I/O APICs in table order */
+            struct mp_ioapic_entry* io = (struct mp_ioapic_entry*)entry;
+            if (io->flags & MP_PROCESSOR_ENABLED) {
+                gsi_base += ioapic_add(io->address, gsi_base);
+            }
+            entry += 8;
+        } else {
+            entry += 8;
+        }
+    }
+    return cpu_count > 0;
+}
+
+/* Build a segment descriptor */
+static uint64_t gdt_descriptor(uint32_t base, uint32_t limit, uint8_t access, uint8_t flags) {
+    uint64_t descriptor = limit & 0xFFFF;
+    descriptor |= (uint64_t)(base & 0xFFFFFF) << 16;
+    descriptor |= (uint64_t)access << 40;
+    descriptor |= (uint64_t)((limit >> 16) & 0x0F) << 48;
+    descriptor |= (uint64_t)(flags & 0x0F) << 52;
+    descriptor |= (uint64_t)(base >> 24) << 56;
+    return descriptor;
+}
+
+/* Give a CPU its own GDT, TSS and %gs per-CPU segment, then load them */
+static void cpu_setup(cpu_t* cpu) {
+    uint32_t stack_top = (uint32_t)&cpu_stacks[cpu->id][CPU_STACK_SIZE];
+    
+    for (uint32_t i = 0; i < sizeof(struct tss) / 4; i++) {
+        ((uint32_t*)&cpu->tss)[i] = 0;
+    }
+    cpu->tss.ss0 = GDT_KERNEL_DATA;
+    cpu->tss.esp0 = stack_top;
+    cpu->tss.iomap_base = sizeof(struct tss);
+    
+    cpu->gdt[0] = 0;
+    cpu->gdt[1] = gdt_descriptor(0, 0xFFFFF, 0x9A, 0xC);
+    cpu->gdt[2] = gdt_descriptor(0, 0xFFFFF, 0x92, 0xC);
+    cpu->gdt[3] = gdt_descriptor(0, 0xFFFFF, 0xFA, 0xC);
+    cpu->gdt[4] = gdt_descriptor(0, 0xFFFFF, 0xF2, 0xC);
+    cpu->gdt[5] = gdt_descriptor((uint32_t)&cpu->tss, sizeof(struct tss) - 1, 0x89, 0x0);
+    cpu->gdt[6] = gdt_descriptor((uint32_t)cpu, sizeof(cpu_t) - 1, 0x92, 0x4);
+    
+    struct {
+        uint16_t limit;
+        uint32_t base;
+    } __attribute__((packed)) gdt_ptr = { sizeof(cpu->gdt) - 1, (uint32_t)cpu->gdt };
+    
+    __asm__ __volatile__(
+        "lgdt %0\n"
+        "ljmp %1, $1f\n"
+        "1:\n"
+        "mov %2, %%ds\n"
+        "mov %2, %%es\n"
+        "mov %2, %%fs\n"
+        "mov %2, %%ss\n"
+        "mov %3, %%gs\n"
+        "ltr %w4\n"
+        :
+        : "m"(gdt_ptr), "i"(GDT_KERNEL_CODE), "r"(GDT_KERNEL_DATA),
+          "r"(GDT_PERCPU), "r"(GDT_TSS)
+        : "memory"
+    );
+}
+
+/* Per-CPU data of the executing processor */
+cpu_t* this_cpu(void) {
+    cpu_t* cpu;
+    if (bsp_own_descriptors && lapic_id() == cpus[0].apic_id) {
+        return &cpus[0];
+    }
+    __asm__ __volatile__("mov %%gs:0, %0" : "=r"(cpu));
+    return cpu;
+}
+
+uint32_t smp_processor_id(void) {
+    return cpu_count ? this_cpu()->id : 0;
+}
+
+uint32_t smp_cpu_count(void) {
+    return cpu_count ? cpu_count : 1;
+}
+
+/* C entry for application processors, called from the trampoline */
+void ap_main(void) {
+    uint32_t apic_id = lapic_id();
+    cpu_t* cpu = NULL;
+    for (uint32_t i = 1; i < cpu_count; i++) {
+        if (cpus[i].apic_id == apic_id) {
+            cpu = &cpus[i];
+        }
+    }
+    if (!cpu) {
+        while (1) {
+            __asm__ __volatile__("cli; hlt");
+        }
+    }
+    
+    cpu_setup(cpu);
+    lapic_enable();
+    cpu->started = 1;
+    
+    /* Wait for work */
+    while (1) {
+        __asm__ __volatile__("sti; hlt");
+    }
+}
+
+/* Wake one AP with INIT-SIPI-SIPI; returns 0 on success, -1 on timeout */
+static int smp_start_ap(cpu_t* cpu) {
+    /* The trampoline starts the AP on its own stack */
+    cpu->tss.esp0 = (uint32_t)&cpu_stacks[cpu->id][CPU_STACK_SIZE];
+    *(volatile uint32_t*)(TRAMPOLINE_BASE + ((uint8_t*)&ap_boot_stack - ap_trampoline_start)) = cpu->tss.esp0;
+    
+    lapic_send_ipi(cpu->apic_id, ICR_INIT);
+    udelay(10000);
+    for (int i = 0; i < 2; i++) {
+        lapic_send_ipi(cpu->apic_id, ICR_STARTUP | (TRAMPOLINE_BASE >> 12));
+        udelay(200);
+    }
+    
+    for (uint32_t i = 0; i < AP_START_TIMEOUT; i++) {
+        if (cpu->started) {
+            return 0;
+        }
+        udelay(1);
+    }
+    return -1;
+}
+
+/* Discover processors and bring every AP online */
+void smp_init(void) {
+    cpu_count = 0;
+    apic_reset();
+    lapic_set_base(LAPIC_DEFAULT_BASE);
+    
+    /* Prefer the MADT; fall back to MP tables, then to a single CPU */
+    if (!smp_parse_madt()) {
+        cpu_count = 0;
+        apic_reset();
+        if (!smp_parse_mp_table()) {
+            cpu_count = 0;
+            apic_reset();
+            lapic_set_base(LAPIC_DEFAULT_BASE);
+            cpu_add(lapic_id());
+        }
+    }
+    
+    /* The BSP becomes CPU 0 regardless of table order */
+    uint32_t bsp_apic_id = lapic_id();
+    for (uint32_t i = 1; i < cpu_count; i++) {
+        if (cpus[i].apic_id == bsp_apic_id) {
+            cpus[i].apic_id = cpus[0].apic_id;
+            cpus[0].apic_id = bsp_apic_id;
+        }
+    }
+    
+    /* A stage that already loaded its own GDT and TSS keeps them on the BSP,
+       whose %gs then stays free for user TLS */
+    uint16_t task_register;
+    __asm__ __volatile__("str %0" : "=r"(task_register));
+    bsp_own_descriptors = task_register != 0;
+    if (!bsp_own_descriptors) {
+        cpu_setup(&cpus[0]);
+    }
+    lapic_enable();
+    cpus[0].started = 1;
+    
+    if (cpu_count == 1) {
+        return;
+    }
+    
+    /* Copy the trampoline below 1MB and hand it the BSP's paging setup */
+    uint32_t trampoline_size = ap_trampoline_end - ap_trampoline_start;
+    memcpy((void*)TRAMPOLINE_BASE, ap_trampoline_start, trampoline_size);
+    
+    uint32_t cr0, cr3, cr4;
+    __asm__ __volatile__("mov %%cr0, %0" : "=r"(cr0));
+    __asm__ __volatile__("mov %%cr3, %0" : "=r"(cr3));
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(cr4));
+    
+    volatile uint8_t* base = (volatile uint8_t*)TRAMPOLINE_BASE;
+    *(volatile uint32_t*)(base + ((uint8_t*)&ap_boot_cr3 - ap_trampoline_start)) = (cr0 & 0x80000000) ? cr3 : 0;
+    *(volatile uint32_t*)(base + ((uint8_t*)&ap_boot_cr4 - ap_trampoline_start)) = cr4;
+    *(volatile uint32_t*)(base + ((uint8_t*)&ap_boot_entry - ap_trampoline_start)) = (uint32_t)ap_main;
+    
+    /* Start APs one at a time since they share the trampoline; a CPU that
+       times out keeps started == 0 and is never given work */
+    for (uint32_t i = 1; i < cpu_count; i++) {
+        smp_start_ap(&cpus[i]);
+    }
+}
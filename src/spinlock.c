@@ -0,0 +1,258 @@
+/*
+ * Tiny Operating System - Kernel Locks
+ * Ticket spinlocks, their interrupt-safe forms and reader-writer spinlocks,
+ * each counting the acquisitions that found it taken; seqlocks for data
+ * that is read far more often than it is written
+ */
+
+#include <stdint.h>
+
+#define RW_WRITER 0x80000000u           /* Held for writing */
+#define RW_WAITING 0x40000000u          /* A writer is waiting: new readers hold off */
+#define RW_READERS 0x3FFFFFFFu
+
+/*
+ * A ticket lock hands itself out in arrival order: each locker takes the
+ * next ticket and waits until owner reaches it, so no CPU can be starved
+ * by others that happen to win the cache line more often. Both halves
+ * share one word so trylock can take a ticket only if it is served at once.
+ */
+struct spinlock {
+    union {
+        uint32_t tickets;
+        struct {
+            uint16_t owner;             /* Ticket being served */
+            uint16_t next;              /* Ticket the next locker takes */
+        };
+    };
+    uint32_t contended;                 /* Acquisitions that had to wait */
+};
+
+/*
+ * Reader-writer spinlock: any number of readers or one writer. A waiting
+ * writer sets RW_WAITING so a steady stream of readers cannot keep it
+ * out; readers already inside finish first.
+ */
+struct rwlock {
+    uint32_t state;                     /* RW_WRITER, RW_WAITING and the reader count */
+    uint32_t contended;
+};
+
+/*
+ * Seqlock: writers serialize on the spinlock and make sequence odd while
+ * they update; readers take no lock at all, copy what they need and retry
+ * if sequence was odd or moved meanwhile. A reader never delays a writer,
+ * and never keeps a copy torn by one, 64-bit fields included.
+ */
+struct seqlock {
+    uint32_t sequence;
+    struct spinlock lock;
+};
+
+/* Function prototypes */
+void spin_lock_init(struct spinlock* lock);
+void spin_lock(struct spinlock* lock);
+int spin_trylock(struct spinlock* lock);
+void spin_unlock(struct spinlock* lock);
+uint32_t spin_lock_irqsave(struct spinlock* lock);
+void spin_unlock_irqrestore(struct spinlock* lock, uint32_t flags);
+void rwlock_init(struct rwlock* lock);
+void read_lock(struct rwlock* lock);
+void read_unlock(struct rwlock* lock);
+void write_lock(struct rwlock* lock);
+void write_unlock(struct rwlock* lock);
+uint32_t read_lock_irqsave(struct rwlock* lock);
+void read_unlock_irqrestore(struct rwlock* lock, uint32_t flags);
+uint32_t write_lock_irqsave(struct rwlock* lock);
+void write_unlock_irqrestore(struct rwlock* lock, uint32_t flags);
+void seqlock_init(struct seqlock* lock);
+void write_seqlock(struct seqlock* lock);
+void write_sequnlock(struct seqlock* lock);
+uint32_t write_seqlock_irqsave(struct seqlock* lock);
+void write_sequnlock_irqrestore(struct seqlock* lock, uint32_t flags);
+uint32_t read_seqbegin(const struct seqlock* lock);
+int read_seqretry(const struct seqlock* lock, uint32_t start);
+
+static inline void cpu_relax(void) {
+    __asm__ __volatile__("pause" : : : "memory");
+}
+
+/* Save EFLAGS and disable interrupts */
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+}
+
+void spin_lock_init(struct spinlock* lock) {
+    lock->tickets = 0;
+    lock->contended = 0;
+}
+
+void spin_lock(struct spinlock* lock) {
+    uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) == ticket) {
+        return;
+    }
+    __atomic_fetch_add(&lock->contended, 1, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+        cpu_relax();
+    }
+}
+
+/* Take the lock only if nobody holds or waits for it; returns 1 if taken */
+int spin_trylock(struct spinlock* lock) {
+    uint32_t tickets = __atomic_load_n(&lock->tickets, __ATOMIC_RELAXED);
+    if ((tickets & 0xFFFF) != tickets >> 16) {
+        return 0;
+    }
+    return __atomic_compare_exchange_n(&lock->tickets, &tickets, tickets + 0x10000, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/* Only the holder writes owner, so a plain increment published with release is enough */
+void spin_unlock(struct spinlock* lock) {
+    __atomic_store_n(&lock->owner, (uint16_t)(lock->owner + 1), __ATOMIC_RELEASE);
+}
+
+/*
+ * For data an interrupt handler also takes: interrupts stay off while the
+ * lock is held, or the handler could spin on a lock its own CPU holds.
+ */
+uint32_t spin_lock_irqsave(struct spinlock* lock) {
+    uint32_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+void spin_unlock_irqrestore(struct spinlock* lock, uint32_t flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+void rwlock_init(struct rwlock* lock) {
+    lock->state = 0;
+    lock->contended = 0;
+}
+
+void read_lock(struct rwlock* lock) {
+    int waited = 0;
+    uint32_t state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    for (;;) {
+        if (!(state & (RW_WRITER | RW_WAITING)) &&
+            __atomic_compare_exchange_n(&lock->state, &state, state + 1, 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+        if (state & (RW_WRITER | RW_WAITING)) {
+            waited = 1;
+            cpu_relax();
+            state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        }
+    }
+    if (waited) {
+        __atomic_fetch_add(&lock->contended, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void read_unlock(struct rwlock* lock) {
+    __atomic_fetch_sub(&lock->state, 1, __ATOMIC_RELEASE);
+}
+
+void write_lock(struct rwlock* lock) {
+    uint32_t state = 0;
+    if (__atomic_compare_exchange_n(&lock->state, &state, RW_WRITER, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    __atomic_fetch_add(&lock->contended, 1, __ATOMIC_RELAXED);
+    for (;;) {
+        state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+        if (!(state & (RW_WRITER | RW_READERS))) {
+            /* Free, perhaps with the waiting bit set by us or another writer: take it and clear the bit */
+            if (__atomic_compare_exchange_n(&lock->state, &state, RW_WRITER, 0,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                return;
+            }
+            continue;
+        }
+        if (!(state & RW_WAITING)) {
+            __atomic_fetch_or(&lock->state, RW_WAITING, __ATOMIC_RELAXED);
+        }
+        cpu_relax();
+    }
+}
+
+/* Other writers still waiting set RW_WAITING again on their next look */
+void write_unlock(struct rwlock* lock) {
+    __atomic_fetch_and(&lock->state, ~RW_WRITER, __ATOMIC_RELEASE);
+}
+
+uint32_t read_lock_irqsave(struct rwlock* lock) {
+    uint32_t flags = irq_save();
+    read_lock(lock);
+    return flags;
+}
+
+void read_unlock_irqrestore(struct rwlock* lock, uint32_t flags) {
+    read_unlock(lock);
+    irq_restore(flags);
+}
+
+uint32_t write_lock_irqsave(struct rwlock* lock) {
+    uint32_t flags = irq_save();
+    write_lock(lock);
+    return flags;
+}
+
+void write_unlock_irqrestore(struct rwlock* lock, uint32_t flags) {
+    write_unlock(lock);
+    irq_restore(flags);
+}
+
+void seqlock_init(struct seqlock* lock) {
+    lock->sequence = 0;
+    spin_lock_init(&lock->lock);
+}
+
+/* The fences keep the odd sequence ahead of the data stores, and the data ahead of the even one */
+void write_seqlock(struct seqlock* lock) {
+    spin_lock(&lock->lock);
+    __atomic_store_n(&lock->sequence, lock->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void write_sequnlock(struct seqlock* lock) {
+    __atomic_store_n(&lock->sequence, lock->sequence + 1, __ATOMIC_RELEASE);
+    spin_unlock(&lock->lock);
+}
+
+uint32_t write_seqlock_irqsave(struct seqlock* lock) {
+    uint32_t flags = irq_save();
+    write_seqlock(lock);
+    return flags;
+}
+
+void write_sequnlock_irqrestore(struct seqlock* lock, uint32_t flags) {
+    write_sequnlock(lock);
+    irq_restore(flags);
+}
+
+/* Wait out a writer in progress; returns the sequence to hand to read_seqretry */
+uint32_t read_seqbegin(const struct seqlock* lock) {
+    uint32_t sequence;
+    while ((sequence = __atomic_load_n(&lock->sequence, __ATOMIC_ACQUIRE)) & 1) {
+        cpu_relax();
+    }
+    return sequence;
+}
+
+/* Nonzero if a writer ran since read_seqbegin and the copy must be taken again */
+int read_seqretry(const struct seqlock* lock, uint32_t start) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&lock->sequence, __ATOMIC_RELAXED) != start;
+}
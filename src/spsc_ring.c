@@ -0,0 +1,118 @@
+/*
+ * Tiny Operating System - Single-Producer Single-Consumer Byte Ring
+ * Lock-free between one producer and one consumer, an IRQ handler and a
+ * task or two CPUs, with no lock and no interrupts disabled
+ */
+
+#include <stdint.h>
+
+#define SPSC_CACHE_LINE 64
+
+/*
+ * head and tail run freely and are masked on use, so head - tail is the fill
+ * level and every byte of the buffer is usable. Each index sits on its own
+ * cache line, written by one side only, so the two sides do not bounce a
+ * line between them on every byte; buffer and mask are read-only after init.
+ * (must match struct spsc_ring in every user)
+ */
+struct spsc_ring {
+    uint8_t* buffer;
+    uint32_t mask;                      /* Size - 1; the size is a power of two */
+    uint32_t head __attribute__((aligned(SPSC_CACHE_LINE)));   /* Producer: next byte written */
+    uint32_t tail __attribute__((aligned(SPSC_CACHE_LINE)));   /* Consumer: next byte read */
+} __attribute__((aligned(SPSC_CACHE_LINE)));
+
+/* Function prototypes */
+void spsc_init(struct spsc_ring* ring, void* buffer, uint32_t size);
+uint32_t spsc_count(const struct spsc_ring* ring);
+uint32_t spsc_space(const struct spsc_ring* ring);
+uint32_t spsc_write(struct spsc_ring* ring, const void* data, uint32_t size);
+uint32_t spsc_read(struct spsc_ring* ring, void* data, uint32_t size);
+int spsc_push(struct spsc_ring* ring, uint8_t byte);
+int spsc_pop(struct spsc_ring* ring, uint8_t* byte);
+
+static inline void spsc_copy(void* dest, const void* src, uint32_t size) {
+    __asm__ __volatile__("cld; rep movsb"
+                         : "+D"(dest), "+S"(src), "+c"(size)
+                         :
+                         : "memory");
+}
+
+/* size must be a power of two; the ring starts empty */
+void spsc_init(struct spsc_ring* ring, void* buffer, uint32_t size) {
+    ring->buffer = (uint8_t*)buffer;
+    ring->mask = size - 1;
+    __atomic_store_n(&ring->head, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->tail, 0, __ATOMIC_RELAXED);
+}
+
+/* Bytes waiting; exact for the consumer, a lower bound for the producer */
+uint32_t spsc_count(const struct spsc_ring* ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/* Free bytes; exact for the producer, a lower bound for the consumer */
+uint32_t spsc_space(const struct spsc_ring* ring) {
+    return ring->mask + 1 - spsc_count(ring);
+}
+
+/*
+ * Producer: copy in as much of data as fits, in at most two pieces, up to
+ * the end of the buffer and from its start. The acquire load of tail keeps
+ * the copy from overwriting bytes the consumer is still reading; the release
+ * store of head publishes the bytes before the new index. Returns the bytes
+ * written.
+ */
+uint32_t spsc_write(struct spsc_ring* ring, const void* data, uint32_t size) {
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    uint32_t room = ring->mask + 1 - (head - tail);
+    uint32_t count = size < room ? size : room;
+
+    uint32_t start = head & ring->mask;
+    uint32_t first = count < ring->mask + 1 - start ? count : ring->mask + 1 - start;
+    spsc_copy(ring->buffer + start, data, first);
+    spsc_copy(ring->buffer, (const uint8_t*)data + first, count - first);
+    __atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE);
+    return count;
+}
+
+/*
+ * Consumer: copy out up to size bytes, the mirror of spsc_write. The
+ * release store of tail hands the space back only once the bytes are read.
+ */
+uint32_t spsc_read(struct spsc_ring* ring, void* data, uint32_t size) {
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t available = head - tail;
+    uint32_t count = size < available ? size : available;
+
+    uint32_t start = tail & ring->mask;
+    uint32_t first = count < ring->mask + 1 - start ? count : ring->mask + 1 - start;
+    spsc_copy(data, ring->buffer + start, first);
+    spsc_copy((uint8_t*)data + first, ring->buffer, count - first);
+    __atomic_store_n(&ring->tail, tail + count, __ATOMIC_RELEASE);
+    return count;
+}
+
+/* Producer: one byte, for interrupt handlers; 0 when full */
+int spsc_push(struct spsc_ring* ring, uint8_t byte) {
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > ring->mask) {
+        return 0;
+    }
+    ring->buffer[head & ring->mask] = byte;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Consumer: one byte; 0 when empty */
+int spsc_pop(struct spsc_ring* ring, uint8_t* byte) {
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+        return 0;
+    }
+    *byte = ring->buffer[tail & ring->mask];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
@@ -0,0 +1,130 @@
+/*
+ * Tiny Operating System - Stack Protector
+ * The guard and failure hook GCC's -fstack-protector-strong calls into
+ * (make SSP=1), and the hardware entropy that seeds it: RDSEED, then
+ * RDRAND, then the TSC on CPUs with neither. This file is always built
+ * without the protector, since it changes the guard under running code.
+ */
+
+#include <stdint.h>
+
+#define CPUID_ECX_RDRAND (1u << 30)
+#define CPUID_7_EBX_RDSEED (1u << 18)
+#define HW_RANDOM_RETRIES 10            /* Intel's advice for RDRAND; RDSEED may need more and then gives way */
+
+#define PRINTK_ERR 3                    /* Must match printk.c */
+
+/* Kernel log ring (printk.c) */
+extern int printk(uint32_t level, const char* text);
+
+/* Crash dump (crashdump.c) */
+extern void crashdump_write(const char* reason, uint32_t eip, uint32_t ebp);
+
+/*
+ * Compared on return by every protected function; in .data, not .bss,
+ * so it is not zero before stack_protector_init runs. The low byte stays
+ * zero: a string copy overrunning a buffer stops at it and cannot write
+ * the guard back.
+ */
+uint32_t __stack_chk_guard = 0x595E9F00;
+
+static int hw_random_probed;
+static int has_rdrand;
+static int has_rdseed;
+
+/* Function prototypes */
+uint32_t hw_random(void);
+void stack_protector_init(void);
+void __stack_chk_fail(void) __attribute__((noreturn));
+
+static inline void cpuid(uint32_t leaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    __asm__ __volatile__("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+/* Each sets the carry flag when it delivered a value */
+static inline int rdseed32(uint32_t* value) {
+    uint8_t ok;
+    __asm__ __volatile__("rdseed %0; setc %1" : "=r"(*value), "=qm"(ok) : : "cc");
+    return ok;
+}
+
+static inline int rdrand32(uint32_t* value) {
+    uint8_t ok;
+    __asm__ __volatile__("rdrand %0; setc %1" : "=r"(*value), "=qm"(ok) : : "cc");
+    return ok;
+}
+
+static void hw_random_probe(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+    uint32_t max_leaf = eax;
+    if (max_leaf >= 1) {
+        cpuid(1, &eax, &ebx, &ecx, &edx);
+        has_rdrand = (ecx & CPUID_ECX_RDRAND) != 0;
+    }
+    if (max_leaf >= 7) {
+        cpuid(7, &eax, &ebx, &ecx, &edx);
+        has_rdseed = (ebx & CPUID_7_EBX_RDSEED) != 0;
+    }
+    hw_random_probed = 1;
+}
+
+/* MurmurHash3's finaliser: every input bit reaches every output bit */
+static uint32_t mix32(uint32_t value) {
+    value ^= value >> 16;
+    value *= 0x85EBCA6B;
+    value ^= value >> 13;
+    value *= 0xC2B2AE35;
+    value ^= value >> 16;
+    return value;
+}
+
+/* 32 random bits: a true seed if the CPU has one to give, else the DRBG, else the TSC mixed */
+uint32_t hw_random(void) {
+    if (!hw_random_probed) {
+        hw_random_probe();
+    }
+    uint32_t value;
+    for (int i = 0; has_rdseed && i < HW_RANDOM_RETRIES; i++) {
+        if (rdseed32(&value)) {
+            return value;
+        }
+        __asm__ __volatile__("pause");
+    }
+    for (int i = 0; has_rdrand && i < HW_RANDOM_RETRIES; i++) {
+        if (rdrand32(&value)) {
+            return value;
+        }
+    }
+    uint64_t tsc = rdtsc();
+    return mix32((uint32_t)tsc ^ mix32((uint32_t)(tsc >> 32) ^ (uint32_t)(uintptr_t)&value));
+}
+
+/*
+ * Pick the guard. Call before any protected function that will return:
+ * frames already on the stack hold the old value and would fail their
+ * check. boot.asm calls it before kernel_main.
+ */
+void stack_protector_init(void) {
+    __stack_chk_guard = hw_random() & ~0xFFu;
+    if (!__stack_chk_guard) {
+        __stack_chk_guard = 0x595E9F00;
+    }
+}
+
+/* A protected function found its canary overwritten: the stack cannot be trusted to return through */
+void __stack_chk_fail(void) {
+    printk(PRINTK_ERR, "stack protector: canary overwritten, halting\n");
+    __asm__ __volatile__("cli");
+    crashdump_write("stack protector: canary overwritten", (uint32_t)(uintptr_t)__builtin_return_address(0),
+                    (uint32_t)(uintptr_t)__builtin_frame_address(0));
+    while (1) {
+        __asm__ __volatile__("cli; hlt");
+    }
+}
@@ -19,23 +19,11 @@ syscall_handler:
     mov fs, ax
     mov gs, ax
     
-    ; Get system call number and arguments
-    mov eax, [esp+36]  ; syscall number
-    mov ebx, [esp+40]  ; arg1
-    mov ecx, [esp+44]  ; arg2
-    mov edx, [esp+48]  ; arg3
-    mov esi, [esp+52]  ; arg4
-    mov edi, [esp+56]  ; arg5
-    
-    ; Call C handler
-    push edi
-    push esi
-    push edx
-    push ecx
-    push ebx
-    push eax
+    ; Hand the C handler the saved registers: eax = number, ebx..edi = arguments.
+    ; It stores the result in the saved eax, which popa restores below.
+    push esp
     call syscall_handler_c
-    add esp, 24  ; Clean up arguments
+    add esp, 4  ; Clean up argument
     
     ; Restore registers
     pop eax
@@ -48,11 +48,70 @@ enum syscall_num {
     SYSCALL_MAX = 15
 };
 
+/* Result returned for failed or unknown system calls */
+#define SYSCALL_ERROR 0xFFFFFFFF
+
+/* Registers saved by the INT 0x80 stub: data segment, pusha block, then the CPU's frame */
+struct syscall_frame {
+    uint32_t ds;
+    uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax;
+    uint32_t eip, cs, eflags;
+};
+
+/* System call arguments, taken from ebx, ecx, edx, esi and edi */
+struct syscall_args {
+    uint32_t arg1;
+    uint32_t arg2;
+    uint32_t arg3;
+    uint32_t arg4;
+    uint32_t arg5;
+};
+
+/* System call handler type and per-call accounting */
+typedef uint32_t (*syscall_fn_t)(const struct syscall_args* args);
+
+struct syscall_stat {
+    uint32_t calls;
+    uint64_t cycles;        /* TSC cycles spent in the handler */
+};
+
+static struct syscall_stat syscall_stats[SYSCALL_MAX];
+
 /* Terminal functions */
 static void terminal_putchar(char c);
 static void terminal_writestring(const char* data);
 static void terminal_writehex(uint32_t value);
 
+/* Per-CPU counters (percpu.c) */
+#define PCPU_SYSCALLS 0
+extern void this_cpu_inc(uint32_t counter);
+
+/* Tracepoints (trace.c) (must match the event numbers there) */
+#define TRACE_SYSCALL_ENTRY 1
+#define TRACE_SYSCALL_EXIT 2
+extern void trace_record(uint32_t event, uint32_t arg0, uint32_t arg1, uint32_t arg2);
+
+/* A NOP until trace_start patches in a jump to the call; -DNO_TRACEPOINTS leaves no site */
+#ifdef NO_TRACEPOINTS
+#define TRACEPOINT(event, arg0, arg1, arg2) do { (void)(arg0); (void)(arg1); (void)(arg2); } while (0)
+#else
+static inline __attribute__((always_inline)) int tracepoint_on(uint32_t event) {
+    __asm__ goto("1: .byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n\t"
+                 ".pushsection __tracepoints, \"aw\"\n\t"
+                 ".long 1b, %l[on], %c0\n\t"
+                 ".popsection" : : "i"(event) : : on);
+    return 0;
+on:
+    return 1;
+}
+
+#define TRACEPOINT(event, arg0, arg1, arg2) do {                     \
+    if (__builtin_expect(tracepoint_on(event), 0)) {                 \
+        trace_record(event, arg0, arg1, arg2);                       \
+    }                                                                \
+} while (0)
+#endif
+
 /* External timer variable */
 extern uint32_t timer_ticks;
 extern uint32_t timer_frequency;
@@ -68,6 +127,12 @@ static inline uint8_t inb(uint16_t port) {
     return ret;
 }
 
+static inline uint64_t rdtsc(void) {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
 /* Put a character */
 static void terminal_putchar(char c) {
     volatile uint16_t* terminal_buffer = VGA_BUFFER;
@@ -113,57 +178,102 @@ static void terminal_writehex(uint32_t value) {
     }
 }
 
-/* System call handler */
-void syscall_handler_c(uint32_t syscall_num, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5) {
-    /* Suppress unused parameter warnings */
-    (void)arg4;
-    (void)arg5;
+/* Process exit */
+static uint32_t sys_exit(const struct syscall_args* args) {
+    terminal_writestring("Process exited with code ");
+    terminal_writehex(args->arg1);
+    terminal_writestring("\n");
+    return 0;
+}
+
+/* Write to stdout or stderr */
+static uint32_t sys_write(const struct syscall_args* args) {
+    if (args->arg1 != 1 && args->arg1 != 2) {
+        return SYSCALL_ERROR;
+    }
+    
+    const char* buf = (const char*)args->arg2;
+    uint32_t count = args->arg3;
+    for (uint32_t i = 0; i < count; i++) {
+        terminal_putchar(buf[i]);
+    }
+    return count;
+}
+
+/* Simple read implementation */
+static uint32_t sys_read(const struct syscall_args* args) {
+    if (args->arg1 == 0) {  /* stdin */
+        /* Return 0 for now (no input available) */
+        return 0;
+    }
+    return SYSCALL_ERROR;
+}
+
+/* Return current process PID */
+static uint32_t sys_getpid(const struct syscall_args* args) {
+    (void)args;
+    return 1;  /* Simplified */
+}
+
+/* Simple sleep implementation */
+static uint32_t sys_sleep(const struct syscall_args* args) {
+    if (timer_frequency > 0) {
+        uint32_t sleep_ticks = args->arg1 * timer_frequency / 1000;  /* Convert ms to ticks */
+        uint32_t start_ticks = timer_ticks;
+        while (timer_ticks - start_ticks < sleep_ticks) {
+            __asm__ __volatile__("hlt" : : : "memory");
+        }
+    }
+    return 0;
+}
+
+/* Dispatch table; unimplemented numbers stay NULL */
+static const syscall_fn_t syscall_table[SYSCALL_MAX] = {
+    [SYSCALL_EXIT] = sys_exit,
+    [SYSCALL_READ] = sys_read,
+    [SYSCALL_WRITE] = sys_write,
+    [SYSCALL_GETPID] = sys_getpid,
+    [SYSCALL_SLEEP] = sys_sleep,
+};
+
+/* System call handler; the result is restored into eax by the stub's popa */
+void syscall_handler_c(struct syscall_frame* frame) {
+    uint32_t syscall_num = frame->eax;
+    if (syscall_num >= SYSCALL_MAX || !syscall_table[syscall_num]) {
+        terminal_writestring("Unknown system call: ");
+        terminal_writehex(syscall_num);
+        terminal_writestring("\n");
+        frame->eax = SYSCALL_ERROR;
+        return;
+    }
     
-    switch (syscall_num) {
-        case SYSCALL_EXIT:
-            terminal_writestring("Process exited with code ");
-            terminal_writehex(arg1);
-            terminal_writestring("\n");
-            break;
-            
-        case SYSCALL_WRITE:
-            if (arg1 == 1 || arg1 == 2) {  /* stdout or stderr */
-                const char* buf = (const char*)arg2;
-                uint32_t count = arg3;
-                for (uint32_t i = 0; i < count; i++) {
-                    terminal_putchar(buf[i]);
-                }
-            }
-            break;
-            
-        case SYSCALL_READ:
-            /* Simple read implementation */
-            if (arg1 == 0) {  /* stdin */
-                /* Return 0 for now (no input available) */
-                return;
-            }
-            break;
-            
-        case SYSCALL_GETPID:
-            /* Return current process PID */
-            __asm__ __volatile__("mov %0, %%eax" : : "r"(1));  /* Simplified */
-            return;
-            
-        case SYSCALL_SLEEP:
-            /* Simple sleep implementation */
-            if (timer_frequency > 0) {
-                uint32_t sleep_ticks = arg1 * timer_frequency / 1000;  /* Convert ms to ticks */
-                uint32_t start_ticks = timer_ticks;
-                while (timer_ticks - start_ticks < sleep_ticks) {
-                    __asm__ __volatile__("hlt");
-                }
-            }
-            break;
-            
-        default:
-            terminal_writestring("Unknown system call: ");
-            terminal_writehex(syscall_num);
-            terminal_writestring("\n");
-            break;
+    struct syscall_args args = { frame->ebx, frame->ecx, frame->edx, frame->esi, frame->edi };
+    struct syscall_stat* stat = &syscall_stats[syscall_num];
+    
+    stat->calls++;
+    this_cpu_inc(PCPU_SYSCALLS);
+    TRACEPOINT(TRACE_SYSCALL_ENTRY, syscall_num, args.arg1, args.arg2);
+    uint64_t start = rdtsc();
+    frame->eax = syscall_table[syscall_num](&args);
+    stat->cycles += rdtsc() - start;
+    TRACEPOINT(TRACE_SYSCALL_EXIT, syscall_num, frame->eax, 0);
+}
+
+/* Clear the per-syscall counters */
+void syscall_stats_reset(void) {
+    for (uint32_t i = 0; i < SYSCALL_MAX; i++) {
+        syscall_stats[i].calls = 0;
+        syscall_stats[i].cycles = 0;
     }
-}
\ No newline at end of file
+}
+
+/* Invocation count and cumulative TSC cycles of one system call */
+void syscall_get_stats(uint32_t syscall_num, uint32_t* calls, uint64_t* cycles) {
+    if (syscall_num >= SYSCALL_MAX) {
+        *calls = 0;
+        *cycles = 0;
+        return;
+    }
+    *calls = syscall_stats[syscall_num].calls;
+    *cycles = syscall_stats[syscall_num].cycles;
+}
@@ -0,0 +1,246 @@
+/*
+ * Tiny Operating System - Runtime Tunables
+ * Parameters a deployment may want to change without a rebuild. The
+ * owner keeps each one in a plain variable that its hot path reads like
+ * any other, and registers the variable here with a type and bounds; a
+ * tunable is set from "sysctl.name=value" words on the kernel command
+ * line, or later as "name=value" from the shell or a write to
+ * /proc/sysctl, and a value out of its bounds is refused rather than
+ * clamped. Values are 32 bits wide, so a store is seen whole.
+ */
+
+#include <stdint.h>
+
+#define SYSCTL_MAX_ENTRIES 32
+#define SYSCTL_NAME_LEN 24
+#define SYSCTL_VALUE_LEN 12             /* "-2147483648" and its NUL */
+#define SYSCTL_CMDLINE_PREFIX "sysctl."
+
+/* Types: what a value is stored as, and how it is written */
+#define SYSCTL_UINT 0                   /* uint32_t */
+#define SYSCTL_INT 1                    /* int32_t */
+#define SYSCTL_BOOL 2                   /* uint32_t, 0 or 1 */
+
+struct sysctl_entry {
+    char name[SYSCTL_NAME_LEN];
+    uint32_t type;
+    volatile uint32_t* value;
+    int64_t min;                        /* Bounds, both included */
+    int64_t max;
+};
+
+static struct sysctl_entry sysctl_entries[SYSCTL_MAX_ENTRIES];
+static uint32_t sysctl_entry_count;
+
+/* Function prototypes */
+void sysctl_init(void);
+int sysctl_register(const char* name, uint32_t type, void* value, int64_t min, int64_t max);
+int sysctl_lookup(const char* name);
+uint32_t sysctl_count(void);
+const char* sysctl_name(uint32_t entry);
+int sysctl_set(uint32_t entry, const char* text);
+uint32_t sysctl_format(uint32_t entry, char* buffer, uint32_t size);
+int sysctl_assign(const char* text, uint32_t length);
+uint32_t sysctl_apply_cmdline(const char* cmdline);
+
+/* A name ends at its NUL, '=' or a separator */
+static int sysctl_name_char(char c) {
+    return c && c != '=' && c != ' ' && c != '\n';
+}
+
+/* The entry named by the first length characters of name, or -1 */
+static int sysctl_lookup_n(const char* name, uint32_t length) {
+    for (uint32_t i = 0; i < sysctl_entry_count; i++) {
+        const char* entry = sysctl_entries[i].name;
+        uint32_t j = 0;
+        while (j < length && entry[j] == name[j]) {
+            j++;
+        }
+        if (j == length && !entry[j]) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+static int64_t sysctl_read(const struct sysctl_entry* entry) {
+    uint32_t raw = *entry->value;
+    return entry->type == SYSCTL_INT ? (int64_t)(int32_t)raw : (int64_t)raw;
+}
+
+/* Forget every tunable; owners register theirs after */
+void sysctl_init(void) {
+    sysctl_entry_count = 0;
+}
+
+/*
+ * Make *value settable as name within [min, max]; a SYSCTL_BOOL is always
+ * 0 or 1. -1 when the table is full, the name is taken, empty or too
+ * long, or the value it has now is out of bounds.
+ */
+int sysctl_register(const char* name, uint32_t type, void* value, int64_t min, int64_t max) {
+    uint32_t length = 0;
+    while (sysctl_name_char(name[length])) {
+        length++;
+    }
+    if (type == SYSCTL_BOOL) {
+        min = 0;
+        max = 1;
+    }
+    if (sysctl_entry_count == SYSCTL_MAX_ENTRIES || !length || name[length] || length >= SYSCTL_NAME_LEN ||
+        type > SYSCTL_BOOL || min > max || sysctl_lookup_n(name, length) >= 0) {
+        return -1;
+    }
+    struct sysctl_entry* entry = &sysctl_entries[sysctl_entry_count];
+    for (uint32_t i = 0; i <= length; i++) {
+        entry->name[i] = name[i];
+    }
+    entry->type = type;
+    entry->value = (volatile uint32_t*)value;
+    entry->min = min;
+    entry->max = max;
+    int64_t now = sysctl_read(entry);
+    if (now < min || now > max) {
+        return -1;
+    }
+    return (int)sysctl_entry_count++;
+}
+
+/* The tunable called name, or -1 */
+int sysctl_lookup(const char* name) {
+    uint32_t length = 0;
+    while (name[length]) {
+        length++;
+    }
+    return sysctl_lookup_n(name, length);
+}
+
+uint32_t sysctl_count(void) {
+    return sysctl_entry_count;
+}
+
+const char* sysctl_name(uint32_t entry) {
+    return entry < sysctl_entry_count ? sysctl_entries[entry].name : 0;
+}
+
+/*
+ * Set a tunable from the decimal number at text, which ends at a NUL,
+ * space or newline; a negative one only for SYSCTL_INT. -1, with the
+ * value left as it was, when it does not parse or is out of bounds.
+ */
+int sysctl_set(uint32_t entry, const char* text) {
+    if (entry >= sysctl_entry_count) {
+        return -1;
+    }
+    struct sysctl_entry* tunable = &sysctl_entries[entry];
+    int negative = *text == '-' && tunable->type == SYSCTL_INT;
+    text += negative;
+    int64_t value = 0;
+    uint32_t digits = 0;
+    while (*text >= '0' && *text <= '9') {
+        value = value * 10 + (*text++ - '0');
+        /* Past any 32-bit value: no need to read further */
+        if (++digits > SYSCTL_VALUE_LEN - 2) {
+            return -1;
+        }
+    }
+    if (!digits || (*text && *text != ' ' && *text != '\n')) {
+        return -1;
+    }
+    value = negative ? -value : value;
+    if (value < tunable->min || value > tunable->max) {
+        return -1;
+    }
+    __atomic_store_n(tunable->value, (uint32_t)value, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* The value in decimal, with its NUL, cut to size; returns its length */
+uint32_t sysctl_format(uint32_t entry, char* buffer, uint32_t size) {
+    if (entry >= sysctl_entry_count || !size) {
+        return 0;
+    }
+    int64_t value = sysctl_read(&sysctl_entries[entry]);
+    char digits[SYSCTL_VALUE_LEN];
+    uint32_t count = 0;
+    uint32_t magnitude = (uint32_t)(value < 0 ? -value : value);
+    do {
+        digits[count++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    if (value < 0) {
+        digits[count++] = '-';
+    }
+    uint32_t length = 0;
+    while (count && length < size - 1) {
+        buffer[length++] = digits[--count];
+    }
+    buffer[length] = '\0';
+    return length;
+}
+
+/*
+ * Apply the "name=value" words in the first length characters of text,
+ * separated by spaces, newlines or NULs. Stops at the first word that
+ * names no tunable or is refused, returning -1; the ones before it stay
+ * applied.
+ */
+int sysctl_assign(const char* text, uint32_t length) {
+    uint32_t i = 0;
+    while (i < length) {
+        if (text[i] == ' ' || text[i] == '\n' || !text[i]) {
+            i++;
+            continue;
+        }
+        uint32_t name = i;
+        while (i < length && sysctl_name_char(text[i])) {
+            i++;
+        }
+        int entry = sysctl_lookup_n(text + name, i - name);
+        if (entry < 0 || i == length || text[i] != '=') {
+            return -1;
+        }
+
+        /* The value is copied out, so text need not end where the write did */
+        char value[SYSCTL_VALUE_LEN + 1];
+        uint32_t count = 0;
+        for (i++; i < length && text[i] && text[i] != ' ' && text[i] != '\n'; i++) {
+            if (count == SYSCTL_VALUE_LEN) {
+                return -1;
+            }
+            value[count++] = text[i];
+        }
+        value[count] = '\0';
+        if (sysctl_set((uint32_t)entry, value) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Apply every sysctl.name=value word of a kernel command line; other
+ * words are someone else's. Returns how many were refused, each of them
+ * leaving its tunable at the default.
+ */
+uint32_t sysctl_apply_cmdline(const char* cmdline) {
+    static const char prefix[] = SYSCTL_CMDLINE_PREFIX;
+    uint32_t refused = 0;
+    while (*cmdline) {
+        while (*cmdline == ' ') {
+            cmdline++;
+        }
+        const char* word = cmdline;
+        while (*cmdline && *cmdline != ' ') {
+            cmdline++;
+        }
+        uint32_t i = 0;
+        while (prefix[i] && word + i < cmdline && word[i] == prefix[i]) {
+            i++;
+        }
+        if (!prefix[i] && sysctl_assign(word + i, (uint32_t)(cmdline - word) - i) < 0) {
+            refused++;
+        }
+    }
+    return refused;
+}
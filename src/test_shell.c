@@ -101,16 +101,19 @@ static int atoi(const char* str) {
 }
 
 /* Shell structures and constants */
-#define MAX_ARGS 32
 #define MAX_CMD_LEN 256
+#define ARGV_SLOTS (MAX_CMD_LEN / 2 + 1)   /* Every other byte a word, and the NULL */
 
+/* Words are pointers into the line, so only its length limits the count */
 struct command {
-    char name[MAX_CMD_LEN];
-    char* args[MAX_ARGS + 1];
+    char* name;
+    char** args;
     int argc;
     int background;
 };
 
+static char* argv_slots[ARGV_SLOTS];
+
 /* strtok_r implementation */
 static char* strtok_r(char* str, const char* delim, char** saveptr) {
     if (str == NULL) {
@@ -419,48 +422,54 @@ void test_path_handling(void) {
 
 void test_command_argument_limits(void) {
     struct command cmd;
-    char input[] = "command arg1 arg2 arg3 arg4 arg5";
-    
+    char input[MAX_CMD_LEN];
+    int length = 0;
+
+    /* More words than the old fixed 32-entry argv held */
+    input[length++] = 'x';
+    for (int i = 0; i < 40; i++) {
+        input[length++] = ' ';
+        input[length++] = 'a' + (i % 26);
+    }
+    input[length] = '\0';
+
     parse_command(input, &cmd);
-    
-    assert(cmd.argc == 6);
-    assert(cmd.argc <= MAX_ARGS);
-    assert(cmd.args[MAX_ARGS] == NULL);
+
+    assert(cmd.argc == 41);
+    assert(cmd.args[40][0] == 'a' + (39 % 26));
+    assert(cmd.args[41] == NULL);
 }
 
-/* Helper function for command parsing (duplicate from shell) */
-static void parse_command(const char* input, struct command* cmd) {
-    char buffer[MAX_CMD_LEN];
-    strncpy(buffer, input, MAX_CMD_LEN - 1);
-    buffer[MAX_CMD_LEN - 1] = '\0';
-    
+/* Helper function for command parsing (duplicate from shell): splits the line in place */
+static void parse_command(char* input, struct command* cmd) {
+    char* p = input;
+
+    cmd->args = argv_slots;
     cmd->argc = 0;
     cmd->background = 0;
-    
-    char* token = buffer;
-    char* saveptr;
-    
-    /* Parse command name */
-    token = strtok_r(buffer, " \t\n", &saveptr);
-    if (!token) return;
-    
-    strncpy(cmd->name, token, MAX_CMD_LEN - 1);
-    cmd->name[MAX_CMD_LEN - 1] = '\0';
-    cmd->args[cmd->argc++] = cmd->name;
-    
-    /* Parse arguments */
-    while ((token = strtok_r(NULL, " \t\n", &saveptr)) && cmd->argc < MAX_ARGS) {
-        cmd->args[cmd->argc++] = token;
+
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == '\n') {
+            *p++ = '\0';
+        }
+        if (!*p) {
+            break;
+        }
+        if (cmd->argc < ARGV_SLOTS - 1) {
+            cmd->args[cmd->argc++] = p;
+        }
+        while (*p && *p != ' ' && *p != '\t' && *p != '\n') {
+            p++;
+        }
     }
-    
+
     /* Check for background execution */
-    if (cmd->argc > 0 && strcmp(cmd->args[cmd->argc - 1], "&") == 0) {
+    while (cmd->argc > 0 && strcmp(cmd->args[cmd->argc - 1], "&") == 0) {
         cmd->background = 1;
         cmd->argc--;
-        cmd->args[cmd->argc] = NULL;
-    } else {
-        cmd->args[cmd->argc] = NULL;
     }
+    cmd->args[cmd->argc] = NULL;
+    cmd->name = cmd->argc ? cmd->args[0] : NULL;
 }
 
 /* Test runner */
@@ -0,0 +1,221 @@
+/*
+ * Tiny Operating System - Timer Wheel
+ * Hierarchical timing wheel with O(1) insert, cancel and per-tick expiry
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Wheel geometry: 256 one-tick slots, then three levels of 64 coarser slots */
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TVN_LEVELS 3
+#define TIMER_MAX_DELTA ((1u << (TVR_BITS + TVN_LEVELS * TVN_BITS)) - 1)
+
+/* Timer, embedded in the object that owns it */
+struct timer {
+    struct timer* next;
+    struct timer** pprev;           /* Link pointing at this timer, for O(1) removal */
+    uint32_t expires;               /* Tick at which the callback runs */
+    void (*callback)(void* data);
+    void* data;
+};
+
+/* Wheel state */
+static struct timer* wheel_root[TVR_SIZE];
+static struct timer* wheel_levels[TVN_LEVELS][TVN_SIZE];
+static uint32_t wheel_now;          /* Next tick to be processed */
+
+/* Function prototypes */
+void timer_wheel_init(uint32_t now);
+void timer_setup(struct timer* timer, void (*callback)(void* data), void* data);
+void timer_add(struct timer* timer, uint32_t expires);
+void timer_cancel(struct timer* timer);
+int timer_pending(const struct timer* timer);
+void timer_wheel_tick(uint32_t now);
+uint32_t timer_wheel_next_expiry(uint32_t limit);
+uint32_t timer_wheel_now(void);
+
+/* Save EFLAGS and disable interrupts */
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+/* Restore the interrupt flag saved by irq_save */
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+}
+
+/* List helpers */
+static void slot_insert(struct timer** slot, struct timer* timer) {
+    timer->next = *slot;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+static void slot_remove(struct timer* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/* File a timer in the slot matching how far away it expires */
+static void wheel_insert(struct timer* timer) {
+    uint32_t expires = timer->expires;
+    uint32_t delta = expires - wheel_now;
+    
+    if ((int32_t)delta < 0) {
+        /* Already due: run on the next tick processed */
+        slot_insert(&wheel_root[wheel_now & TVR_MASK], timer);
+        return;
+    }
+    if (delta < TVR_SIZE) {
+        slot_insert(&wheel_root[expires & TVR_MASK], timer);
+        return;
+    }
+    
+    if (delta > TIMER_MAX_DELTA) {
+        delta = TIMER_MAX_DELTA;
+        expires = wheel_now + TIMER_MAX_DELTA;
+        timer->expires = expires;
+    }
+    for (int level = 0; level < TVN_LEVELS; level++) {
+        uint32_t shift = TVR_BITS + (level + 1) * TVN_BITS;
+        if (level == TVN_LEVELS - 1 || delta < (1u << shift)) {
+            uint32_t index = (expires >> (shift - TVN_BITS)) & TVN_MASK;
+            slot_insert(&wheel_levels[level][index], timer);
+            return;
+        }
+    }
+}
+
+/* Redistribute one coarse slot into finer slots; returns the slot index */
+static uint32_t wheel_cascade(int level) {
+    uint32_t index = (wheel_now >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK;
+    struct timer* timer = wheel_levels[level][index];
+    
+    wheel_levels[level][index] = NULL;
+    while (timer) {
+        struct timer* next = timer->next;
+        wheel_insert(timer);
+        timer = next;
+    }
+    return index;
+}
+
+/* Initialize an empty wheel starting at tick now */
+void timer_wheel_init(uint32_t now) {
+    for (int i = 0; i < TVR_SIZE; i++) {
+        wheel_root[i] = NULL;
+    }
+    for (int level = 0; level < TVN_LEVELS; level++) {
+        for (int i = 0; i < TVN_SIZE; i++) {
+            wheel_levels[level][i] = NULL;
+        }
+    }
+    wheel_now = now;
+}
+
+/* Prepare a timer; it is not armed until timer_add */
+void timer_setup(struct timer* timer, void (*callback)(void* data), void* data) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->data = data;
+}
+
+/* Arm (or re-arm) a timer to fire at tick expires */
+void timer_add(struct timer* timer, uint32_t expires) {
+    uint32_t flags = irq_save();
+    if (timer->pprev) {
+        slot_remove(timer);
+    }
+    timer->expires = expires;
+    wheel_insert(timer);
+    irq_restore(flags);
+}
+
+/* Disarm a timer if it has not fired yet */
+void timer_cancel(struct timer* timer) {
+    uint32_t flags = irq_save();
+    if (timer->pprev) {
+        slot_remove(timer);
+    }
+    irq_restore(flags);
+}
+
+int timer_pending(const struct timer* timer) {
+    return timer->pprev != NULL;
+}
+
+/* Run every timer due up to and including tick now; called from the timer interrupt */
+void timer_wheel_tick(uint32_t now) {
+    uint32_t flags = irq_save();
+    
+    while ((int32_t)(now - wheel_now) >= 0) {
+        uint32_t index = wheel_now & TVR_MASK;
+        
+        /* Each time the root wraps, pull the next coarse slot down */
+        if (index == 0) {
+            for (int level = 0; level < TVN_LEVELS && wheel_cascade(level) == 0; level++) {
+            }
+        }
+        
+        /* Detach the slot first so callbacks can re-arm or cancel timers */
+        struct timer* pending = wheel_root[index];
+        wheel_root[index] = NULL;
+        if (pending) {
+            pending->pprev = &pending;
+        }
+        
+        /* Timers armed as already due from a callback land on the next tick */
+        wheel_now++;
+        
+        while (pending) {
+            struct timer* timer = pending;
+            slot_remove(timer);
+            timer->callback(timer->data);
+        }
+    }
+    
+    irq_restore(flags);
+}
+
+/* Earliest tick, at most limit ticks ahead, at which timer_wheel_tick has work */
+uint32_t timer_wheel_next_expiry(uint32_t limit) {
+    uint32_t flags = irq_save();
+    
+    if (limit > TVR_SIZE) {
+        limit = TVR_SIZE;
+    }
+    uint32_t next = wheel_now + limit;
+    for (uint32_t i = 0; i < limit; i++) {
+        uint32_t tick = wheel_now + i;
+        /* A root wrap may cascade coarse timers down, so it counts as work */
+        if ((tick & TVR_MASK) == 0 || wheel_root[tick & TVR_MASK]) {
+            next = tick;
+            break;
+        }
+    }
+    
+    irq_restore(flags);
+    return next;
+}
+
+/* Current wheel time: the next tick timer_wheel_tick will process */
+uint32_t timer_wheel_now(void) {
+    return wheel_now;
+}
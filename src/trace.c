@@ -0,0 +1,210 @@
+/*
+ * Tiny Operating System - Static Tracepoints
+ * Fixed-size binary event records, TSC-stamped, in a ring per CPU; the
+ * tracepoints cost a 5-byte NOP each until tracing is started
+ */
+
+#include <stdint.h>
+
+#define MAX_CPUS 8                      /* Must match smp.c */
+#define CACHE_LINE_SIZE 64
+#define TRACE_RING_RECORDS 512          /* Per CPU, power of two */
+#define TRACE_RING_MASK (TRACE_RING_RECORDS - 1)
+
+/* Events (must match the users' copies) */
+#define TRACE_SYSCALL_ENTRY 1           /* Number, first two arguments */
+#define TRACE_SYSCALL_EXIT 2            /* Number, result */
+#define TRACE_CONTEXT_SWITCH 3          /* Previous pid, next pid */
+#define TRACE_IRQ_ENTRY 4               /* Line */
+#define TRACE_NET_RX 5                  /* Device, length */
+#define TRACE_NET_TX 6                  /* Device, length */
+#define TRACE_PAGE_FAULT 7              /* Address, error code */
+#define TRACE_EVENTS 8
+
+#define TRACE_MAGIC 0x45435254          /* "TRCE" in the stream's byte order */
+#define TRACE_VERSION 1
+
+#define CR0_WP 0x00010000               /* Ring 0 writes honour read-only pages */
+
+/*
+ * One event. Unused arguments are zero. The export writes records as they
+ * are laid out here, little-endian, so an offline tool reads them with a
+ * single fixed-size struct.
+ */
+struct trace_record {
+    uint64_t tsc;
+    uint16_t event;
+    uint16_t cpu;
+    uint32_t args[3];
+};
+
+/*
+ * Each CPU writes only its own ring, with interrupts off, so records need
+ * no lock and no shared cache line. A full ring overwrites its oldest
+ * records: after a stall the trace still shows what led up to it.
+ */
+struct trace_ring {
+    uint32_t head;                      /* Records ever written */
+    struct trace_record records[TRACE_RING_RECORDS];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/*
+ * Every TRACEPOINT assembles a 5-byte NOP and, in the __tracepoints
+ * section, an entry naming it, the out-of-line trace_record call the
+ * compiler placed for it, and its event. The linker collects the entries
+ * from all objects and brackets them with the __start_ and __stop_ symbols.
+ */
+struct trace_site {
+    uint32_t site;                      /* Address of the NOP */
+    uint32_t target;                    /* Where the jump patched over it goes */
+    uint32_t event;
+};
+
+extern struct trace_site __start___tracepoints[] __attribute__((weak));
+extern struct trace_site __stop___tracepoints[] __attribute__((weak));
+
+static const uint8_t trace_nop[5] = { 0x0F, 0x1F, 0x44, 0x00, 0x00 };   /* nopl 0(%eax,%eax,1) */
+
+static struct trace_ring trace_rings[MAX_CPUS];
+static uint32_t (*trace_this_cpu)(void);
+
+/* Function prototypes */
+void trace_init(uint32_t (*this_cpu)(void));
+void trace_record(uint32_t event, uint32_t arg0, uint32_t arg1, uint32_t arg2);
+uint32_t trace_start(uint32_t events);
+void trace_stop(void);
+uint32_t trace_export(void (*emit)(const void* data, uint32_t size));
+uint32_t trace_dump_serial(void);
+
+/* Serial console (serial.c) */
+extern void serial_write(const void* data, uint32_t size);
+extern void serial_flush(void);
+
+static inline uint64_t rdtsc(void) {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+}
+
+static inline uint32_t read_cr0(void) {
+    uint32_t cr0;
+    __asm__ __volatile__("mov %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+static inline void write_cr0(uint32_t cr0) {
+    __asm__ __volatile__("mov %0, %%cr0" : : "r"(cr0) : "memory");
+}
+
+/* Until this is called, or with NULL, every record goes to CPU 0's ring */
+void trace_init(uint32_t (*this_cpu)(void)) {
+    trace_this_cpu = this_cpu;
+}
+
+/* Reached only through a patched site; out of line so the sites stay small */
+void trace_record(uint32_t event, uint32_t arg0, uint32_t arg1, uint32_t arg2) {
+    uint32_t flags = irq_save();
+    uint32_t cpu = trace_this_cpu ? trace_this_cpu() : 0;
+    struct trace_ring* ring = &trace_rings[cpu];
+    struct trace_record* record = &ring->records[ring->head & TRACE_RING_MASK];
+    record->tsc = rdtsc();
+    record->event = (uint16_t)event;
+    record->cpu = (uint16_t)cpu;
+    record->args[0] = arg0;
+    record->args[1] = arg1;
+    record->args[2] = arg2;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    irq_restore(flags);
+}
+
+/*
+ * Rewrite every site to match events: a jump to its trace_record call if
+ * its event is in the mask, the NOP otherwise. Interrupts are off and
+ * write protection is lifted for the rewrite; a site is only ever half
+ * written while no CPU can be running it, so call this before other CPUs
+ * are started or while they are parked.
+ */
+static uint32_t trace_patch(uint32_t events) {
+    uint32_t patched = 0;
+    uint32_t flags = irq_save();
+    uint32_t cr0 = read_cr0();
+    write_cr0(cr0 & ~CR0_WP);
+    for (struct trace_site* site = __start___tracepoints; site < __stop___tracepoints; site++) {
+        uint8_t* code = (uint8_t*)site->site;
+        if (site->event < TRACE_EVENTS && (events & (1u << site->event))) {
+            uint32_t offset = site->target - (site->site + 5);
+            code[1] = (uint8_t)offset;
+            code[2] = (uint8_t)(offset >> 8);
+            code[3] = (uint8_t)(offset >> 16);
+            code[4] = (uint8_t)(offset >> 24);
+            code[0] = 0xE9;             /* jmp rel32 */
+            patched++;
+        } else {
+            for (int i = 0; i < 5; i++) {
+                code[i] = trace_nop[i];
+            }
+        }
+    }
+    write_cr0(cr0);
+    irq_restore(flags);
+    return patched;
+}
+
+/*
+ * Empty the rings and turn on the sites of the events in the mask (bit
+ * TRACE_x for event x). Returns the number of sites turned on.
+ */
+uint32_t trace_start(uint32_t events) {
+    trace_patch(0);
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        trace_rings[cpu].head = 0;
+    }
+    return trace_patch(events);
+}
+
+/* Every site back to a NOP; the rings keep what they hold until the next start */
+void trace_stop(void) {
+    trace_patch(0);
+}
+
+/*
+ * Export the rings through emit, with tracing stopped. The stream is a
+ * header of four 32-bit words (magic, version, record size, CPU count),
+ * then for each CPU three words (CPU, records that follow, records
+ * overwritten) and its records, oldest first. Returns the records exported.
+ */
+uint32_t trace_export(void (*emit)(const void* data, uint32_t size)) {
+    uint32_t header[4] = { TRACE_MAGIC, TRACE_VERSION, sizeof(struct trace_record), MAX_CPUS };
+    uint32_t exported = 0;
+    emit(header, sizeof(header));
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        const struct trace_ring* ring = &trace_rings[cpu];
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint32_t count = head < TRACE_RING_RECORDS ? head : TRACE_RING_RECORDS;
+        uint32_t cpu_header[3] = { cpu, count, head - count };
+        emit(cpu_header, sizeof(cpu_header));
+        for (uint32_t i = head - count; i != head; i++) {
+            emit(&ring->records[i & TRACE_RING_MASK], sizeof(struct trace_record));
+        }
+        exported += count;
+    }
+    return exported;
+}
+
+/* Stop tracing and dump the rings to COM1: run QEMU with -serial file:trace.bin */
+uint32_t trace_dump_serial(void) {
+    trace_stop();
+    uint32_t exported = trace_export(serial_write);
+    serial_flush();
+    return exported;
+}
@@ -0,0 +1,180 @@
+/*
+ * Tiny Operating System - Keyboard TTY Line Discipline
+ * The keyboard interrupt translates scancodes, echoes and edits the line
+ * being typed, and queues it whole on Enter; readers get a line per read
+ */
+
+#include <stdint.h>
+
+#define KBD_DATA_PORT 0x60
+#define KBD_STATUS_PORT 0x64
+#define KBD_STATUS_OUTPUT 0x01          /* A byte is waiting in the data port */
+#define KBD_IRQ 1
+#define KBD_RELEASE 0x80                /* Set in the scancode of a key going up */
+#define KBD_LSHIFT 0x2A
+#define KBD_RSHIFT 0x36
+
+#define TTY_LINE_MAX 256                /* Longest line, newline included */
+#define TTY_RING_SIZE 1024              /* Power of two */
+
+/* Lock-free byte ring (spsc_ring.c) (must match struct spsc_ring there) */
+struct spsc_ring {
+    uint8_t* buffer;
+    uint32_t mask;
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t tail __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+extern void spsc_init(struct spsc_ring* ring, void* buffer, uint32_t size);
+extern uint32_t spsc_count(const struct spsc_ring* ring);
+extern uint32_t spsc_space(const struct spsc_ring* ring);
+extern uint32_t spsc_write(struct spsc_ring* ring, const void* data, uint32_t size);
+extern int spsc_pop(struct spsc_ring* ring, uint8_t* byte);
+
+/* IRQ routing (interrupt_handlers.c) */
+extern void irq_install_handler(uint32_t irq, void (*handler)(void));
+
+/* Shadow-buffered console (vga_console.c) */
+extern void console_putchar(char c);
+
+/* Kernel log ring (printk.c) */
+extern uint32_t printk_console_drain(void);
+
+/*
+ * Scancode set 1 to ASCII, unshifted and shifted. One table lookup per key
+ * in the interrupt; keys with no character map to 0.
+ */
+static const char tty_keymap[2][0x3A] = {
+    {
+        0, 27, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b',
+        '\t', 'q', 'w', 'e', 'r', 't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n',
+        0, 'a', 's', 'd', 'f', 'g', 'h', 'j', 'k', 'l', ';', '\'', '`',
+        0, '\\', 'z', 'x', 'c', 'v', 'b', 'n', 'm', ',', '.', '/', 0,
+        '*', 0, ' ',
+    },
+    {
+        0, 27, '!', '@', '#', '$', '%', '^', '&', '*', '(', ')', '_', '+', '\b',
+        '\t', 'Q', 'W', 'E', 'R', 'T', 'Y', 'U', 'I', 'O', 'P', '{', '}', '\n',
+        0, 'A', 'S', 'D', 'F', 'G', 'H', 'J', 'K', 'L', ':', '"', '~',
+        0, '|', 'Z', 'X', 'C', 'V', 'B', 'N', 'M', '<', '>', '?', 0,
+        '*', 0, ' ',
+    },
+};
+
+/*
+ * The line being typed lives in tty_line, touched only by the input side
+ * (the interrupt, or in a stage without an IDT the reader polling on its
+ * behalf). Enter moves it into tty_input in a single ring write, so the
+ * ring only ever holds whole lines: a reader that finds it non-empty has
+ * a line to return and never waits part way through one.
+ */
+static struct spsc_ring tty_input;
+static uint8_t tty_input_buffer[TTY_RING_SIZE];
+static char tty_line[TTY_LINE_MAX];
+static uint32_t tty_line_length;
+static uint32_t tty_shift;              /* Bit 0 left, bit 1 right */
+static int tty_irq_mode;
+static int tty_present;
+
+/* Function prototypes */
+void tty_init(int use_irq);
+void tty_receive(uint8_t scancode);
+int tty_read(char* buffer, uint32_t size);
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    __asm__ __volatile__("inb %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static inline int interrupts_enabled(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushf; pop %0" : "=r"(flags));
+    return (flags >> 9) & 1;
+}
+
+static void tty_interrupt(void) {
+    tty_receive(inb(KBD_DATA_PORT));
+}
+
+/*
+ * Start with an empty line and nothing queued. With use_irq, keys arrive
+ * through IRQ 1; without it, readers poll the controller while they wait.
+ */
+void tty_init(int use_irq) {
+    spsc_init(&tty_input, tty_input_buffer, TTY_RING_SIZE);
+    tty_line_length = 0;
+    tty_shift = 0;
+    tty_irq_mode = use_irq;
+    if (use_irq) {
+        irq_install_handler(KBD_IRQ, tty_interrupt);
+    }
+    tty_present = 1;
+}
+
+/* One scancode: track Shift, edit the line and echo, queue the line on Enter */
+void tty_receive(uint8_t scancode) {
+    uint8_t key = scancode & ~KBD_RELEASE;
+    if (key == KBD_LSHIFT || key == KBD_RSHIFT) {
+        uint32_t bit = key == KBD_LSHIFT ? 1 : 2;
+        tty_shift = (scancode & KBD_RELEASE) ? tty_shift & ~bit : tty_shift | bit;
+        return;
+    }
+    if ((scancode & KBD_RELEASE) || key >= sizeof(tty_keymap[0])) {
+        return;
+    }
+
+    char c = tty_keymap[tty_shift ? 1 : 0][key];
+    if (c == '\b') {
+        if (tty_line_length) {
+            tty_line_length--;
+            console_putchar('\b');
+        }
+    } else if (c == '\n') {
+        tty_line[tty_line_length++] = '\n';
+        console_putchar('\n');
+        if (spsc_space(&tty_input) >= tty_line_length) {   /* Else the line is lost */
+            spsc_write(&tty_input, tty_line, tty_line_length);
+        }
+        tty_line_length = 0;
+    } else if (c >= ' ' && c <= '~' && tty_line_length < TTY_LINE_MAX - 1) {
+        tty_line[tty_line_length++] = c;
+        console_putchar(c);
+    }
+}
+
+/* Wait for the input side to queue something; sleeps when the interrupt will do the work */
+static void tty_wait(void) {
+    printk_console_drain();
+    if (tty_irq_mode && interrupts_enabled()) {
+        __asm__ __volatile__("hlt" : : : "memory");
+        return;
+    }
+    if (inb(KBD_STATUS_PORT) & KBD_STATUS_OUTPUT) {
+        tty_receive(inb(KBD_DATA_PORT));
+    }
+}
+
+/*
+ * Block until a whole line has been typed, then return it, newline
+ * included, or its first size bytes, leaving the rest for the next read.
+ * Returns 0 at once if the tty was never set up.
+ */
+int tty_read(char* buffer, uint32_t size) {
+    if (!tty_present || !size) {
+        return 0;
+    }
+    while (!spsc_count(&tty_input)) {
+        tty_wait();
+    }
+
+    uint32_t count = 0;
+    uint8_t byte;
+    while (count < size && spsc_pop(&tty_input, &byte)) {
+        buffer[count++] = (char)byte;
+        if (byte == '\n') {
+            break;
+        }
+    }
+    return (int)count;
+}
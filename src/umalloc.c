@@ -0,0 +1,250 @@
+/*
+ * Tiny Operating System - User Heap Allocator
+ * malloc for user programs. Small sizes come from power-of-two classes
+ * cut out of 16KB spans of the brk heap, and each thread keeps a few free
+ * blocks of every class in its TLS block, so most calls take no lock and
+ * make no system call; a thread without a TLS block uses the shared
+ * lists. Larger sizes get an anonymous mapping of their own. The
+ * allocator owns the break: a program using it does not call brk itself.
+ */
+
+#include <stdint.h>
+
+/* System calls (must match usermode_syscall_handlers.c) */
+#define SYSCALL_MMAP 6
+#define SYSCALL_MUNMAP 7
+#define SYSCALL_YIELD 14
+#define SYSCALL_BRK 15
+#define SYSCALL_ERROR 0xFFFFFFFF
+#define MMAP_ANON 0xFFFFFFFF            /* Must match kernel_usermode.c */
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+
+#define PAGE_SIZE 4096
+#define UMALLOC_MIN_SHIFT 4             /* The smallest class, and every block's alignment: 16 bytes */
+#define UMALLOC_CLASSES 8               /* Powers of two up to 2KB */
+#define UMALLOC_SMALL_MAX (1u << (UMALLOC_MIN_SHIFT + UMALLOC_CLASSES - 1))
+#define UMALLOC_SPAN_SHIFT 14           /* 16KB spans, each cut into blocks of one class */
+#define UMALLOC_SPAN_SIZE (1u << UMALLOC_SPAN_SHIFT)
+#define UMALLOC_MAX_SPANS 4096          /* 64MB of small blocks */
+#define UMALLOC_CACHE_MAX 32            /* Blocks of a class a thread holds before it gives some back */
+#define UMALLOC_BATCH 16                /* Blocks moved between a thread and the shared lists at once */
+#define UMALLOC_LARGE_HEADER 16         /* Ahead of a large block: the length of its mapping */
+
+struct umalloc_block {
+    struct umalloc_block* next;
+};
+
+/* Free blocks of each class, held by one thread or shared by all */
+struct umalloc_cache {
+    struct umalloc_block* head[UMALLOC_CLASSES];
+    uint32_t count[UMALLOC_CLASSES];
+};
+
+/*
+ * How a thread's TLS block, at %gs:0, has to start for the allocator to
+ * find its cache there: with its own address, as the i386 TLS ABI has
+ * it. umalloc_thread_init sets one up before it is handed to clone.
+ */
+struct umalloc_tls {
+    struct umalloc_tls* self;
+    struct umalloc_cache cache;
+};
+
+static struct umalloc_cache umalloc_shared;
+static uint8_t umalloc_span_class[UMALLOC_MAX_SPANS];   /* Class of each span plus one */
+static uint32_t umalloc_heap_base;      /* The first span; 0 until the first small block */
+static uint32_t umalloc_heap_top;       /* The end of the last, where the break is */
+static volatile uint32_t umalloc_lock_word;
+
+/* Function prototypes */
+void* umalloc(uint32_t size);
+void ufree(void* ptr);
+void umalloc_thread_init(struct umalloc_tls* tls);
+void umalloc_thread_exit(void);
+
+static inline uint32_t umalloc_syscall(uint32_t num, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4,
+                                       uint32_t arg5) {
+    uint32_t result;
+    __asm__ __volatile__("int $0x80"
+                         : "=a"(result)
+                         : "a"(num), "b"(arg1), "c"(arg2), "d"(arg3), "S"(arg4), "D"(arg5)
+                         : "memory");
+    return result;
+}
+
+/* The shared lists and the heap's growth; a holder that was preempted gets the CPU back by yielding to it */
+static void umalloc_lock(void) {
+    while (__atomic_exchange_n(&umalloc_lock_word, 1, __ATOMIC_ACQUIRE)) {
+        umalloc_syscall(SYSCALL_YIELD, 0, 0, 0, 0, 0);
+    }
+}
+
+static void umalloc_unlock(void) {
+    __atomic_store_n(&umalloc_lock_word, 0, __ATOMIC_RELEASE);
+}
+
+/* The calling thread's cache, or NULL when it runs with a null %gs: no TLS block */
+static struct umalloc_cache* umalloc_this_cache(void) {
+    uint32_t selector;
+    __asm__ __volatile__("mov %%gs, %0" : "=r"(selector));
+    if (!(selector & 0xFFFC)) {
+        return 0;
+    }
+    struct umalloc_tls* tls;
+    __asm__ __volatile__("mov %%gs:0, %0" : "=r"(tls));
+    return tls ? &tls->cache : 0;
+}
+
+static uint32_t umalloc_class(uint32_t size) {
+    uint32_t class = 0;
+    while ((1u << (UMALLOC_MIN_SHIFT + class)) < size) {
+        class++;
+    }
+    return class;
+}
+
+/* Move the break up a span and cut it into class's blocks on the shared list; 0 when it will not move. Locked */
+static int umalloc_grow(uint32_t class) {
+    if (!umalloc_heap_base) {
+        uint32_t brk = umalloc_syscall(SYSCALL_BRK, 0, 0, 0, 0, 0);
+        if (brk == SYSCALL_ERROR) {
+            return 0;
+        }
+        umalloc_heap_base = (brk + UMALLOC_SPAN_SIZE - 1) & ~(UMALLOC_SPAN_SIZE - 1);
+        umalloc_heap_top = umalloc_heap_base;
+    }
+    uint32_t span = (umalloc_heap_top - umalloc_heap_base) >> UMALLOC_SPAN_SHIFT;
+    if (span == UMALLOC_MAX_SPANS ||
+        umalloc_syscall(SYSCALL_BRK, umalloc_heap_top + UMALLOC_SPAN_SIZE, 0, 0, 0, 0) == SYSCALL_ERROR) {
+        return 0;
+    }
+
+    /* Pushed from the top down, so they are handed out in address order */
+    uint32_t size = 1u << (UMALLOC_MIN_SHIFT + class);
+    for (uint32_t offset = UMALLOC_SPAN_SIZE; offset >= size; offset -= size) {
+        struct umalloc_block* block = (struct umalloc_block*)(umalloc_heap_top + offset - size);
+        block->next = umalloc_shared.head[class];
+        umalloc_shared.head[class] = block;
+    }
+    umalloc_shared.count[class] += UMALLOC_SPAN_SIZE / size;
+    umalloc_span_class[span] = (uint8_t)(class + 1);
+    umalloc_heap_top += UMALLOC_SPAN_SIZE;
+    return 1;
+}
+
+/* Move up to count blocks of class from one cache to another; returns how many moved */
+static uint32_t umalloc_move(struct umalloc_cache* to, struct umalloc_cache* from, uint32_t class, uint32_t count) {
+    uint32_t moved = 0;
+    while (moved < count && from->head[class]) {
+        struct umalloc_block* block = from->head[class];
+        from->head[class] = block->next;
+        block->next = to->head[class];
+        to->head[class] = block;
+        moved++;
+    }
+    from->count[class] -= moved;
+    to->count[class] += moved;
+    return moved;
+}
+
+/* A mapping of its own for a block too big for the classes */
+static void* umalloc_large(uint32_t size) {
+    if (size > 0xFFFFFFFF - UMALLOC_LARGE_HEADER - PAGE_SIZE) {
+        return 0;
+    }
+    uint32_t length = (size + UMALLOC_LARGE_HEADER + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    uint32_t base = umalloc_syscall(SYSCALL_MMAP, 0, length, PROT_READ | PROT_WRITE, MMAP_ANON, 0);
+    if (base == SYSCALL_ERROR) {
+        return 0;
+    }
+    *(uint32_t*)base = length;
+    return (void*)(base + UMALLOC_LARGE_HEADER);
+}
+
+/* size bytes aligned to 16, or NULL; the contents are whatever was there */
+void* umalloc(uint32_t size) {
+    if (size > UMALLOC_SMALL_MAX) {
+        return umalloc_large(size);
+    }
+    uint32_t class = umalloc_class(size);
+    struct umalloc_cache* cache = umalloc_this_cache();
+
+    /* A thread's own blocks first; an empty cache takes a batch, which may need a new span */
+    if (!cache || !cache->head[class]) {
+        umalloc_lock();
+        if (!umalloc_shared.head[class] && !umalloc_grow(class)) {
+            umalloc_unlock();
+            return 0;
+        }
+        if (!cache) {
+            struct umalloc_block* block = umalloc_shared.head[class];
+            umalloc_shared.head[class] = block->next;
+            umalloc_shared.count[class]--;
+            umalloc_unlock();
+            return block;
+        }
+        umalloc_move(cache, &umalloc_shared, class, UMALLOC_BATCH);
+        umalloc_unlock();
+    }
+    struct umalloc_block* block = cache->head[class];
+    cache->head[class] = block->next;
+    cache->count[class]--;
+    return block;
+}
+
+/* Give back a block from umalloc; NULL is ignored */
+void ufree(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+    uint32_t addr = (uint32_t)ptr;
+    if (addr < umalloc_heap_base || addr >= umalloc_heap_top) {
+        uint32_t base = addr - UMALLOC_LARGE_HEADER;
+        umalloc_syscall(SYSCALL_MUNMAP, base, *(uint32_t*)base, 0, 0, 0);
+        return;
+    }
+
+    uint32_t class = umalloc_span_class[(addr - umalloc_heap_base) >> UMALLOC_SPAN_SHIFT] - 1u;
+    struct umalloc_block* block = (struct umalloc_block*)ptr;
+    struct umalloc_cache* cache = umalloc_this_cache();
+    if (!cache) {
+        umalloc_lock();
+        block->next = umalloc_shared.head[class];
+        umalloc_shared.head[class] = block;
+        umalloc_shared.count[class]++;
+        umalloc_unlock();
+        return;
+    }
+
+    /* A thread that frees more than it allocates hands the surplus back in a batch */
+    block->next = cache->head[class];
+    cache->head[class] = block;
+    if (++cache->count[class] > UMALLOC_CACHE_MAX) {
+        umalloc_lock();
+        umalloc_move(&umalloc_shared, cache, class, UMALLOC_BATCH);
+        umalloc_unlock();
+    }
+}
+
+/* Start a thread's TLS block empty; give it to clone as the new thread's tls */
+void umalloc_thread_init(struct umalloc_tls* tls) {
+    tls->self = tls;
+    for (uint32_t class = 0; class < UMALLOC_CLASSES; class++) {
+        tls->cache.head[class] = 0;
+        tls->cache.count[class] = 0;
+    }
+}
+
+/* Hand every block the calling thread holds to the shared lists; call before it exits */
+void umalloc_thread_exit(void) {
+    struct umalloc_cache* cache = umalloc_this_cache();
+    if (!cache) {
+        return;
+    }
+    umalloc_lock();
+    for (uint32_t class = 0; class < UMALLOC_CLASSES; class++) {
+        umalloc_move(&umalloc_shared, cache, class, cache->count[class]);
+    }
+    umalloc_unlock();
+}
@@ -0,0 +1,110 @@
+/*
+ * Tiny Operating System - Stack Unwinder and Kernel Symbols
+ * Walks the frame-pointer chain the kernels are built with (make
+ * FRAME_POINTER=1, the default) and names code addresses from the symbol
+ * table the Makefile links into each stage (tools/ksymgen.c).
+ */
+
+#include <stdint.h>
+
+#define UNWIND_STACK_MAX (64 * 1024)    /* Frames further than this above the first are another stack */
+#define KSYM_NAME_MAX 48                /* Longer names are cut in ksym_format */
+
+/*
+ * The table: ksym_count code addresses in ascending order and one more
+ * where code ends, each with its name at ksym_strings + ksym_names[i].
+ * Weak, so a stage linked in one pass still links, with no names.
+ */
+extern const uint32_t ksym_count __attribute__((weak));
+extern const uint32_t ksym_addrs[] __attribute__((weak));
+extern const uint32_t ksym_names[] __attribute__((weak));
+extern const char ksym_strings[] __attribute__((weak));
+
+/* Function prototypes */
+uint32_t unwind_stack(uint32_t ebp, uint32_t* frames, uint32_t max);
+const char* ksym_lookup(uint32_t addr, uint32_t* offset);
+uint32_t ksym_format(char* out, uint32_t size, uint32_t addr);
+
+/*
+ * The return addresses of up to max frames, innermost first, starting at
+ * the frame ebp points to. Each frame holds the caller's ebp and then the
+ * return address; the walk stops at the first frame that does not lie
+ * further up the same stack, so code built without frame pointers, or the
+ * bottom of the stack, ends it rather than a fault.
+ */
+uint32_t unwind_stack(uint32_t ebp, uint32_t* frames, uint32_t max) {
+    uint32_t count = 0;
+    uint32_t base = ebp;
+    while (count < max && ebp >= 0x1000 && !(ebp & 3) && ebp - base < UNWIND_STACK_MAX) {
+        const uint32_t* frame = (const uint32_t*)ebp;
+        if (!frame[1]) {
+            break;
+        }
+        frames[count++] = frame[1];
+        if (frame[0] <= ebp) {
+            break;
+        }
+        ebp = frame[0];
+    }
+    return count;
+}
+
+/* The function containing addr and how far into it addr is; NULL when it is not kernel code */
+const char* ksym_lookup(uint32_t addr, uint32_t* offset) {
+    if (!&ksym_count || !ksym_count || addr < ksym_addrs[0] || addr >= ksym_addrs[ksym_count]) {
+        return 0;
+    }
+    uint32_t low = 0;
+    uint32_t high = ksym_count;
+    while (high - low > 1) {
+        uint32_t mid = low + (high - low) / 2;
+        if (ksym_addrs[mid] <= addr) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    *offset = addr - ksym_addrs[low];
+    return ksym_strings + ksym_names[low];
+}
+
+/* addr as "name+0x1f", or "0x0001a2b3" without a name, NUL-terminated in size bytes; returns its length */
+uint32_t ksym_format(char* out, uint32_t size, uint32_t addr) {
+    static const char hex[] = "0123456789abcdef";
+    uint32_t offset;
+    uint32_t len = 0;
+    const char* name = ksym_lookup(addr, &offset);
+    if (!size) {
+        return 0;
+    }
+    if (name) {
+        while (name[len] && len < KSYM_NAME_MAX && len < size - 1) {
+            out[len] = name[len];
+            len++;
+        }
+        if (!offset) {
+            out[len] = '\0';
+            return len;
+        }
+        addr = offset;
+        if (len < size - 1) {
+            out[len++] = '+';
+        }
+    }
+    /* Offsets in as few digits as they need, bare addresses in all eight */
+    int digits = 8;
+    while (name && digits > 1 && !(addr >> ((digits - 1) * 4))) {
+        digits--;
+    }
+    if (len < size - 1) {
+        out[len++] = '0';
+    }
+    if (len < size - 1) {
+        out[len++] = 'x';
+    }
+    for (int i = digits - 1; i >= 0 && len < size - 1; i--) {
+        out[len++] = hex[(addr >> (i * 4)) & 0xF];
+    }
+    out[len] = '\0';
+    return len;
+}
@@ -0,0 +1,116 @@
+;
+; Tiny Operating System - Ring 3 Benchmark Loops
+; Drops to ring 3 to run one of the system call loops below, and comes back
+; when the loop raises the exit vector
+;
+
+[bits 32]
+
+KERNEL_DATA_SELECTOR equ 0x10
+USER_CODE_SELECTOR equ 0x1B
+USER_DATA_SELECTOR equ 0x23
+USER_EFLAGS equ 0x002               ; Interrupts off in ring 3: no tick lands inside a sample
+
+SYSCALL_GETPID equ 12               ; Must match usermode_syscall_handlers.c
+VVAR_PROC_ADDR equ 0x08047000       ; Must match kernel_usermode.c
+USER_BENCH_EXIT_VECTOR equ 0x81     ; Must match kernel_usermode.c
+
+section .text
+
+; uint32_t user_bench_enter(uint32_t entry, uint32_t stack_top, uint32_t iterations)
+; Runs a copied loop in ring 3 with ECX = iterations; returns EAX as it exits
+global user_bench_enter
+user_bench_enter:
+    push ebp
+    push ebx
+    push esi
+    push edi
+    pushfd
+    push fs                         ; The IRET to ring 3 nulls kernel selectors
+    push gs
+    mov [user_bench_kernel_esp], esp
+    mov eax, [esp + 32]             ; entry
+    mov edx, [esp + 36]             ; stack_top
+    mov ecx, [esp + 40]             ; iterations
+    push USER_DATA_SELECTOR
+    push edx
+    push USER_EFLAGS
+    push USER_CODE_SELECTOR
+    push eax
+    mov ax, USER_DATA_SELECTOR
+    mov ds, ax
+    mov es, ax
+    iret
+
+; Interrupt gate at USER_BENCH_EXIT_VECTOR, DPL 3: drops the frame the
+; ring 3 exit pushed on the TSS stack and returns from user_bench_enter
+global user_bench_exit
+user_bench_exit:
+    mov esp, [user_bench_kernel_esp]
+    mov dx, KERNEL_DATA_SELECTOR
+    mov ds, dx
+    mov es, dx
+    pop gs
+    pop fs
+    popfd
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ret
+
+; The loops: position independent, copied to a user page. Each makes ECX
+; getpid calls one way and exits with the last pid in EAX.
+
+; Through the INT 0x80 gate
+global user_bench_int80
+global user_bench_int80_end
+user_bench_int80:
+    mov edi, ecx
+.call:
+    mov eax, SYSCALL_GETPID
+    int 0x80
+    dec edi
+    jnz .call
+    int USER_BENCH_EXIT_VECTOR
+user_bench_int80_end:
+
+; Through SYSENTER: ECX carries the user stack and EDX the return address,
+; which SYSEXIT restores; EDI, the count, is preserved by the entry path.
+; The entry path's STI lets ticks into this loop, unlike the others.
+global user_bench_sysenter
+global user_bench_sysenter_end
+user_bench_sysenter:
+    mov edi, ecx
+    call .base
+.base:
+    pop ebp
+    add ebp, .resume - .base
+.call:
+    mov eax, SYSCALL_GETPID
+    mov ecx, esp
+    mov edx, ebp
+    sysenter
+.resume:
+    dec edi
+    jnz .call
+    int USER_BENCH_EXIT_VECTOR
+user_bench_sysenter_end:
+
+; Through the vDSO: the pid is a load from the read-only vvar page
+global user_bench_vdso
+global user_bench_vdso_end
+user_bench_vdso:
+    mov edi, ecx
+.call:
+    mov eax, [VVAR_PROC_ADDR]
+    dec edi
+    jnz .call
+    int USER_BENCH_EXIT_VECTOR
+user_bench_vdso_end:
+
+section .data
+user_bench_kernel_esp: dd 0
+
+; Mark the object as not needing an executable stack
+section .note.GNU-stack noalloc noexec nowrite progbits
@@ -2,12 +2,16 @@
 ; Tiny Operating System - User Space System Call Handler
 ; Assembly handler for system calls with user space support
 ;
+; Like the stubs in isr.asm, these leave the caller's TLS segment in %gs.
+;
 
 [bits 32]
 
 ; System call handler
 global syscall_handler
 extern syscall_handler_c
+extern syscall_dispatch
+extern syscall_from_user
 syscall_handler:
     ; Save registers
     pusha
@@ -17,37 +21,48 @@ syscall_handler:
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
-    
-    ; Get system call number and arguments
-    mov eax, [esp+36]  ; syscall number
-    mov ebx, [esp+40]  ; arg1
-    mov ecx, [esp+44]  ; arg2
-    mov edx, [esp+48]  ; arg3
-    mov esi, [esp+52]  ; arg4
-    mov edi, [esp+56]  ; arg5
     
-    ; Call C handler
-    push edi
-    push esi
-    push edx
-    push ecx
-    push ebx
-    push eax
+    ; Hand the C handler the saved registers: eax = number, ebx..edi = arguments.
+    ; It stores the result in the saved eax, which popa restores below.
+    push esp
     call syscall_handler_c
-    add esp, 24  ; Clean up arguments
+    add esp, 4  ; Clean up argument
     
     ; Restore registers
     pop eax
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
     popa
     
     ; Return from interrupt
     iret
 
+; Fast system call entry, reached through SYSENTER with interrupts disabled
+; eax = number, ebx/esi/edi = arguments, ecx = user esp, edx = user return eip
+; The user data segments are flat, so they are used as-is instead of reloaded
+global sysenter_entry
+sysenter_entry:
+    push ecx            ; User stack to return to
+    push edx            ; User instruction to return to
+    
+    ; Dispatch directly; it preserves ebx/esi/edi/ebp and returns the result in eax
+    push 0              ; arg5
+    push 0              ; arg4
+    push edi
+    push esi
+    push ebx
+    push eax
+    mov dword [syscall_from_user], 1
+    call syscall_dispatch
+    add esp, 24
+    
+    ; SYSEXIT resumes at edx with esp = ecx in ring 3
+    pop edx
+    pop ecx
+    sti                 ; Takes effect after SYSEXIT, so no interrupt lands in between
+    sysexit
+
 ; Page fault handler
 global page_fault_handler
 extern page_fault_handler_c
@@ -60,7 +75,6 @@ page_fault_handler:
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
     
     ; Get error code and faulting address
     mov eax, [esp+36]  ; error code
@@ -70,8 +84,8 @@ page_fault_handler:
     mov ecx, cr2
     
     ; Call C handler
-    push ecx
     push eax
+    push ecx
     call page_fault_handler_c
     add esp, 8  ; Clean up arguments
     
@@ -80,8 +94,8 @@ page_fault_handler:
     mov ds, ax
     mov es, ax
     mov fs, ax
-    mov gs, ax
     popa
     
-    ; Return from interrupt
+    ; Drop the error code and retry the faulting instruction
+    add esp, 4
     iret
\ No newline at end of file
@@ -3,6 +3,7 @@
  * C functions for handling system calls with user space support
  */
 
+#include <stddef.h>
 #include <stdint.h>
 
 /* VGA text mode constants */
@@ -46,7 +47,46 @@ enum syscall_num {
     SYSCALL_SLEEP = 13,
     SYSCALL_YIELD = 14,
     SYSCALL_BRK = 15,
-    SYSCALL_MAX = 16
+    SYSCALL_RING_SETUP = 16,
+    SYSCALL_RING_ENTER = 17,
+    SYSCALL_READV = 18,
+    SYSCALL_WRITEV = 19,
+    SYSCALL_SENDFILE = 20,
+    SYSCALL_SPLICE = 21,
+    SYSCALL_SHM_OPEN = 22,
+    SYSCALL_SHM_UNLINK = 23,
+    SYSCALL_FUTEX = 24,
+    SYSCALL_CLONE = 25,
+    SYSCALL_SPAWN = 26,
+    SYSCALL_SENDMMSG = 27,
+    SYSCALL_RECVMMSG = 28,
+    SYSCALL_PRING_MMAP = 29,
+    SYSCALL_PRING_POLL = 30,
+    SYSCALL_ATTACH_FILTER = 31,
+    SYSCALL_ROUTE_ADD = 32,
+    SYSCALL_ROUTE_DEL = 33,
+    SYSCALL_NF_RULE = 34,
+    SYSCALL_NF_POLICY = 35,
+    SYSCALL_MAX = 36
+};
+
+/* Scatter/gather buffer */
+#define IOV_MAX 16
+
+struct iovec {
+    void* iov_base;
+    uint32_t iov_len;
+};
+
+/* Submission ring operations */
+enum ring_op {
+    RING_OP_NOP = 0,
+    RING_OP_WRITE = 1,
+    RING_OP_READ = 2,
+    RING_OP_SEND = 3,
+    RING_OP_RECV = 4,
+    RING_OP_READDIR = 5,
+    RING_OP_MAX = 6
 };
 
 /* Memory management constants */
@@ -54,6 +94,13 @@ enum syscall_num {
 #define PAGE_PRESENT    0x001
 #define PAGE_WRITE      0x002
 #define PAGE_USER       0x004
+#define PAGE_LARGE      0x080
+#define MAX_VMAS 16                     /* (must match kernel_usermode.c) */
+#define MAX_PROCESSES 64                /* (must match kernel_usermode.c) */
+#define USER_SPACE_END 0xC0000000
+
+/* Result returned for failed or unknown system calls */
+#define SYSCALL_ERROR 0xFFFFFFFF
 
 /* Process states */
 enum process_state {
@@ -64,6 +111,13 @@ enum process_state {
     PROCESS_ZOMBIE = 4
 };
 
+/* Virtual memory area */
+struct vm_area {
+    uint32_t start;
+    uint32_t end;
+    uint32_t flags;
+};
+
 /* Process structure */
 struct process {
     uint32_t pid;
@@ -78,17 +132,119 @@ struct process {
     char name[32];
     uint32_t page_directory;
     uint32_t brk;
+    struct vm_area vmas[MAX_VMAS];
+    uint32_t vma_count;
+    uint32_t tgid;           /* Thread group: pid of the process whose address space this runs in */
+    uint32_t tls_base;
+};
+
+/* System call handler type and per-call accounting */
+struct syscall_args;
+typedef uint32_t (*syscall_fn_t)(const struct syscall_args* args);
+
+struct syscall_stat {
+    uint32_t calls;
+    uint64_t cycles;        /* TSC cycles spent in the handler */
+};
+
+static struct syscall_stat syscall_stats[SYSCALL_MAX];
+
+/* Shared submission/completion rings, laid out in user memory */
+#define RING_ENTRIES 32                 /* Power of two; indices wrap freely */
+#define RING_MASK (RING_ENTRIES - 1)
+
+struct ring_sqe {
+    uint32_t opcode;
+    uint32_t fd;
+    uint32_t addr;
+    uint32_t len;
+    uint32_t user_data;                 /* Copied to the completion untouched */
+};
+
+struct ring_cqe {
+    uint32_t user_data;
+    uint32_t result;
 };
 
+struct io_ring {
+    volatile uint32_t sq_head;          /* Advanced by the kernel */
+    volatile uint32_t sq_tail;          /* Advanced by the process */
+    volatile uint32_t cq_head;          /* Advanced by the process */
+    volatile uint32_t cq_tail;          /* Advanced by the kernel */
+    struct ring_sqe sq[RING_ENTRIES];
+    struct ring_cqe cq[RING_ENTRIES];
+};
+
+/* Registered ring of each process slot, tagged with its owner */
+struct ring_slot {
+    uint32_t pid;
+    struct io_ring* ring;
+};
+
+static struct ring_slot process_rings[MAX_PROCESSES];
+static syscall_fn_t ring_ops[RING_OP_MAX];
+
+/* Privilege of the current caller; set on every entry, SYSENTER always comes from ring 3 */
+uint32_t syscall_from_user;
+
+/* Console position, shared by every write */
+static uint32_t terminal_row = 0;
+static uint32_t terminal_column = 0;
+
 /* Terminal functions */
+static void terminal_write(const char* data, uint32_t size);
 static void terminal_putchar(char c);
 static void terminal_writestring(const char* data);
 static void terminal_writehex(uint32_t value);
 
+/* User memory access */
+int copy_from_user(void* kernel_dest, const void* user_src, uint32_t size);
+int copy_to_user(void* user_dest, const void* kernel_src, uint32_t size);
+
+/* Ring operation and system call hooks */
+void ring_register_op(uint32_t opcode, syscall_fn_t handler);
+void syscall_register(uint32_t syscall_num, syscall_fn_t handler);
+
+/* Kernel log ring (printk.c) */
+#define PRINTK_WARNING 4
+extern int printk_value(uint32_t level, const char* text, uint32_t value);
+
+/* Keyboard line discipline (tty.c) */
+extern int tty_read(char* buffer, uint32_t size);
+
+/* Per-CPU counters (percpu.c) */
+#define PCPU_SYSCALLS 0
+extern void this_cpu_inc(uint32_t counter);
+
+/* Tracepoints (trace.c) (must match the event numbers there) */
+#define TRACE_SYSCALL_ENTRY 1
+#define TRACE_SYSCALL_EXIT 2
+extern void trace_record(uint32_t event, uint32_t arg0, uint32_t arg1, uint32_t arg2);
+
+/* A NOP until trace_start patches in a jump to the call; -DNO_TRACEPOINTS leaves no site */
+#ifdef NO_TRACEPOINTS
+#define TRACEPOINT(event, arg0, arg1, arg2) do { (void)(arg0); (void)(arg1); (void)(arg2); } while (0)
+#else
+static inline __attribute__((always_inline)) int tracepoint_on(uint32_t event) {
+    __asm__ goto("1: .byte 0x0f, 0x1f, 0x44, 0x00, 0x00\n\t"
+                 ".pushsection __tracepoints, \"aw\"\n\t"
+                 ".long 1b, %l[on], %c0\n\t"
+                 ".popsection" : : "i"(event) : : on);
+    return 0;
+on:
+    return 1;
+}
+
+#define TRACEPOINT(event, arg0, arg1, arg2) do {                     \
+    if (__builtin_expect(tracepoint_on(event), 0)) {                 \
+        trace_record(event, arg0, arg1, arg2);                       \
+    }                                                                \
+} while (0)
+#endif
+
 /* External variables */
-extern uint32_t timer_ticks;
 extern uint32_t timer_frequency;
-extern struct process processes[16];
+extern struct process processes[];
 extern uint32_t current_process;
 
 /* External functions */
@@ -96,6 +252,8 @@ uint32_t paging_alloc_frame(void);
 void paging_free_frame(uint32_t addr);
 void paging_map_page(uint32_t virt, uint32_t phys, uint32_t flags);
 uint32_t process_create(const char* name, uint32_t entry_point);
+uint32_t process_fork(void);
+void process_sleep(uint32_t ticks);
 void process_switch(uint32_t pid);
 void process_kill(uint32_t pid);
 
@@ -110,30 +268,34 @@ static inline uint8_t inb(uint16_t port) {
     return ret;
 }
 
-/* Put a character */
-static void terminal_putchar(char c) {
+/* Write a buffer to the console in one pass */
+static void terminal_write(const char* data, uint32_t size) {
     volatile uint16_t* terminal_buffer = VGA_BUFFER;
-    static uint32_t terminal_row = 0;
-    static uint32_t terminal_column = 0;
-    static enum vga_color terminal_color = VGA_COLOR_LIGHT_GREY;
+    const uint16_t attribute = (uint16_t)VGA_COLOR_LIGHT_GREY << 8;
+    uint32_t row = terminal_row;
+    uint32_t column = terminal_column;
     
-    if (c == '\n') {
-        terminal_column = 0;
-        if (++terminal_row == 25) {
-            terminal_row = 0;
+    for (uint32_t i = 0; i < size; i++) {
+        char c = data[i];
+        if (c != '\n') {
+            terminal_buffer[row * 80 + column] = (uint16_t)(uint8_t)c | attribute;
+            if (++column < 80) {
+                continue;
+            }
         }
-        return;
-    }
-    
-    const uint32_t index = terminal_row * 80 + terminal_column;
-    terminal_buffer[index] = (uint16_t)c | (uint16_t)terminal_color << 8;
-    
-    if (++terminal_column == 80) {
-        terminal_column = 0;
-        if (++terminal_row == 25) {
-            terminal_row = 0;
+        column = 0;
+        if (++row == 25) {
+            row = 0;
         }
     }
+    
+    terminal_row = row;
+    terminal_column = column;
+}
+
+/* Put a character */
+static void terminal_putchar(char c) {
+    terminal_write(&c, 1);
 }
 
 /* Write a string */
@@ -155,241 +317,460 @@ static void terminal_writehex(uint32_t value) {
     }
 }
 
-/* User space memory access validation */
-static int validate_user_pointer(const void* ptr, uint32_t size) {
+/* Read the page directory the caller is running on, or 0 with paging off */
+static uint32_t* current_page_directory(void) {
+    uint32_t cr0, cr3;
+    __asm__ __volatile__("mov %%cr0, %0" : "=r"(cr0));
+    if (!(cr0 & 0x80000000)) {
+        return NULL;
+    }
+    __asm__ __volatile__("mov %%cr3, %0" : "=r"(cr3));
+    return (uint32_t*)(cr3 & 0xFFFFF000);
+}
+
+/* The thread group leader, which owns the areas and break a thread uses */
+static struct process* process_mm(struct process* proc) {
+    if (proc->tgid && proc->tgid != proc->pid) {
+        struct process* leader = &processes[(proc->tgid - 1) & (MAX_PROCESSES - 1)];   /* A pid's slot, as process_lookup finds it */
+        if (leader->pid == proc->tgid) {
+            return leader;
+        }
+    }
+    return proc;
+}
+
+/* Whether a not-yet-present page lies in an area the fault handler will populate */
+static int user_page_faultable(uint32_t addr, int write) {
+    struct process* proc = process_mm(&processes[current_process]);
+    for (uint32_t i = 0; i < proc->vma_count; i++) {
+        if (addr >= proc->vmas[i].start && addr < proc->vmas[i].end) {
+            return !write || (proc->vmas[i].flags & PAGE_WRITE);
+        }
+    }
+    return 0;
+}
+
+/* Validate a whole user range once: bounds first, then one page table lookup per page */
+static int validate_user_range(const void* ptr, uint32_t size, int write) {
     uint32_t addr = (uint32_t)ptr;
     
-    /* Check if pointer is in user space */
-    if (addr >= 0xC0000000) {
-        return 0;  /* Kernel space */
+    if (size == 0) {
+        return 1;
     }
     
-    /* Check for overflow */
-    if (addr + size < addr) {
-        return 0;  /* Overflow */
+    /* The range must sit entirely below the kernel split, without wrapping */
+    if (addr >= USER_SPACE_END || size > USER_SPACE_END - addr) {
+        return 0;
     }
     
-    /* Check if pointer is mapped */
-    /* For now, assume it's valid if in user space */
-    return 1;
+    uint32_t* page_dir = current_page_directory();
+    if (!page_dir) {
+        return 1;
+    }
+    
+    /* Ring 3 callers may only name user pages; writes also need PAGE_WRITE */
+    uint32_t required = PAGE_PRESENT;
+    if (syscall_from_user) {
+        required |= PAGE_USER;
+    }
+    if (write) {
+        required |= PAGE_WRITE;
+    }
+    
+    uint32_t last = (addr + size - 1) & ~(PAGE_SIZE - 1);
+    for (uint32_t page = addr & ~(PAGE_SIZE - 1); ; page += PAGE_SIZE) {
+        uint32_t dir_entry = page_dir[page >> 22];
+        uint32_t entry = dir_entry;
+        if ((dir_entry & PAGE_PRESENT) && !(dir_entry & PAGE_LARGE)) {
+            entry = ((uint32_t*)(dir_entry & 0xFFFFF000))[(page >> 12) & 0x3FF];
+        }
+        
+        /* Both levels must grant access; demand and copy-on-write pages fault in on copy */
+        if ((dir_entry & entry & required) != required && !user_page_faultable(page, write)) {
+            return 0;
+        }
+        if (page == last) {
+            return 1;
+        }
+    }
+}
+
+/* Copy size bytes a dword at a time, then the tail */
+static inline void copy_bulk(void* dest, const void* src, uint32_t size) {
+    uint32_t dwords = size / 4;
+    uint32_t bytes = size % 4;
+    __asm__ __volatile__(
+        "cld; rep movsl; mov %3, %%ecx; rep movsb"
+        : "+D"(dest), "+S"(src), "+c"(dwords)
+        : "r"(bytes)
+        : "memory", "cc");
 }
 
 /* Copy data from user space to kernel space */
-static int copy_from_user(void* kernel_dest, const void* user_src, uint32_t size) {
-    if (!validate_user_pointer(user_src, size)) {
+int copy_from_user(void* kernel_dest, const void* user_src, uint32_t size) {
+    if (!validate_user_range(user_src, size, 0)) {
         return -1;  /* Invalid user pointer */
     }
-    
-    /* Copy data byte by byte */
-    uint8_t* dest = (uint8_t*)kernel_dest;
-    const uint8_t* src = (const uint8_t*)user_src;
-    
-    for (uint32_t i = 0; i < size; i++) {
-        dest[i] = src[i];
-    }
-    
+    copy_bulk(kernel_dest, user_src, size);
     return 0;
 }
 
+/* Copy data from kernel space to user space */
+int copy_to_user(void* user_dest, const void* kernel_src, uint32_t size) {
+    if (!validate_user_range(user_dest, size, 1)) {
+        return -1;  /* Invalid user pointer */
+    }
+    copy_bulk(user_dest, kernel_src, size);
+    return 0;
+}
 
-/* Get string length from user space */
+/* Get string length from user space, validating a page at a time */
 static uint32_t strnlen_user(const char* user_str, uint32_t max_len) {
     uint32_t len = 0;
     
     while (len < max_len) {
-        char c;
-        if (copy_from_user(&c, user_str + len, 1) != 0) {
-            break;
+        uint32_t addr = (uint32_t)(user_str + len);
+        uint32_t chunk = PAGE_SIZE - (addr & (PAGE_SIZE - 1));
+        if (chunk > max_len - len) {
+            chunk = max_len - len;
         }
-        if (c == '\0') {
+        if (!validate_user_range(user_str + len, chunk, 0)) {
             break;
         }
-        len++;
+        for (uint32_t i = 0; i < chunk; i++, len++) {
+            if (user_str[len] == '\0') {
+                return len;
+            }
+        }
     }
     
     return len;
 }
 
-/* System call handler with user space support */
-void syscall_handler_c(uint32_t syscall_num, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5) {
-    /* Suppress unused parameter warnings */
-    (void)arg4;
-    (void)arg5;
+/* Registers saved by the INT 0x80 stub: data segment, pusha block, then the CPU's frame */
+struct syscall_frame {
+    uint32_t ds;
+    uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax;
+    uint32_t eip, cs, eflags;
+};
+
+/* System call arguments, taken from ebx, ecx, edx, esi and edi */
+struct syscall_args {
+    uint32_t arg1;
+    uint32_t arg2;
+    uint32_t arg3;
+    uint32_t arg4;
+    uint32_t arg5;
+};
+
+static inline uint64_t rdtsc(void) {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+/* Process exit */
+static uint32_t sys_exit(const struct syscall_args* args) {
+    terminal_writestring("Process ");
+    terminal_writehex(current_process);
+    terminal_writestring(" exited with code ");
+    terminal_writehex(args->arg1);
+    terminal_writestring("\n");
     
-    switch (syscall_num) {
-        case SYSCALL_EXIT: {
-            /* Process exit */
-            terminal_writestring("Process ");
-            terminal_writehex(current_process);
-            terminal_writestring(" exited with code ");
-            terminal_writehex(arg1);
-            terminal_writestring("\n");
-            
-            /* Kill the process */
-            process_kill(current_process);
-            
-            /* Schedule another process */
-            process_switch(0);  /* This will be handled by scheduler */
-            break;
-        }
-            
-        case SYSCALL_WRITE: {
-            /* Write to file descriptor */
-            if (arg1 == 1 || arg1 == 2) {  /* stdout or stderr */
-                const char* user_buf = (const char*)arg2;
-                uint32_t count = arg3;
-                
-                /* Validate user buffer */
-                if (!validate_user_pointer(user_buf, count)) {
-                    /* Return error */
-                    __asm__ __volatile__("mov $0, %%eax" : : : "eax");
-                    return;
-                }
-                
-                /* Copy and write character by character */
-                for (uint32_t i = 0; i < count; i++) {
-                    char c;
-                    if (copy_from_user(&c, user_buf + i, 1) == 0) {
-                        terminal_putchar(c);
-                    }
-                }
-                
-                /* Return number of bytes written */
-                __asm__ __volatile__("mov %0, %%eax" : : "r"(count) : "eax");
-            } else {
-                /* Invalid file descriptor */
-                __asm__ __volatile__("mov $-1, %%eax" : : : "eax");
-            }
-            break;
-        }
-            
-        case SYSCALL_READ: {
-            /* Read from file descriptor */
-            if (arg1 == 0) {  /* stdin */
-                /* For now, return 0 (no input available) */
-                __asm__ __volatile__("mov $0, %%eax" : : : "eax");
-            } else {
-                /* Invalid file descriptor */
-                __asm__ __volatile__("mov $-1, %%eax" : : : "eax");
-            }
-            break;
-        }
-            
-        case SYSCALL_GETPID: {
-            /* Return current process PID */
-            __asm__ __volatile__("mov %0, %%eax" : : "r"(processes[current_process].pid) : "eax");
-            return;
-        }
-            
-        case SYSCALL_SLEEP: {
-            /* Sleep for specified milliseconds */
-            if (timer_frequency > 0) {
-                uint32_t sleep_ticks = arg1 * timer_frequency / 1000;  /* Convert ms to ticks */
-                uint32_t start_ticks = timer_ticks;
-                
-                while (timer_ticks - start_ticks < sleep_ticks) {
-                    __asm__ __volatile__("hlt");
-                }
-            }
-            break;
-        }
-            
-        case SYSCALL_FORK: {
-            /* Create new process */
-            uint32_t child_pid = process_create("child", processes[current_process].eip);
-            if (child_pid) {
-                __asm__ __volatile__("mov %0, %%eax" : : "r"(child_pid) : "eax");
-            } else {
-                __asm__ __volatile__("mov $-1, %%eax" : : : "eax");
-            }
-            return;
+    /* Kill the process */
+    process_kill(current_process);
+    
+    /* Schedule another process */
+    process_switch(0);  /* This will be handled by scheduler */
+    return 0;
+}
+
+/* Write to file descriptor */
+static uint32_t sys_write(const struct syscall_args* args) {
+    if (args->arg1 != 1 && args->arg1 != 2) {  /* stdout or stderr */
+        return SYSCALL_ERROR;
+    }
+    
+    const char* user_buf = (const char*)args->arg2;
+    uint32_t count = args->arg3;
+    
+    /* Validate the whole buffer once, then hand it to the console in one call */
+    if (!validate_user_range(user_buf, count, 0)) {
+        return SYSCALL_ERROR;
+    }
+    terminal_write(user_buf, count);
+    
+    /* Return number of bytes written */
+    return count;
+}
+
+/* Copy in an iovec array and check every segment in one pass; returns the total length */
+static uint32_t iovec_import(struct iovec* iov, uint32_t addr, uint32_t iovcnt, int write) {
+    if (iovcnt > IOV_MAX || copy_from_user(iov, (const void*)addr, iovcnt * sizeof(*iov)) != 0) {
+        return SYSCALL_ERROR;
+    }
+    
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > SYSCALL_ERROR - 1 - total ||
+            !validate_user_range(iov[i].iov_base, iov[i].iov_len, write)) {
+            return SYSCALL_ERROR;
         }
-            
-        case SYSCALL_EXEC: {
-            /* Execute new program */
-            const char* user_path = (const char*)arg1;
-            
-            /* Validate path string */
-            if (!validate_user_pointer(user_path, 1)) {
-                __asm__ __volatile__("mov $-1, %%eax" : : : "eax");
-                return;
-            }
-            
-            /* Get path length */
-            uint32_t path_len = strnlen_user(user_path, 256);
-            if (path_len == 0) {
-                __asm__ __volatile__("mov $-1, %%eax" : : : "eax");
-                return;
-            }
-            
-            /* For now, just print the path */
-            terminal_writestring("Exec: ");
-            for (uint32_t i = 0; i < path_len && i < 256; i++) {
-                char c;
-                if (copy_from_user(&c, user_path + i, 1) == 0) {
-                    terminal_putchar(c);
-                }
-            }
-            terminal_writestring("\n");
-            
-            /* Return success */
-            __asm__ __volatile__("mov $0, %%eax" : : : "eax");
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+/* Gather several buffers into one console write */
+static uint32_t sys_writev(const struct syscall_args* args) {
+    if (args->arg1 != 1 && args->arg1 != 2) {  /* stdout or stderr */
+        return SYSCALL_ERROR;
+    }
+    
+    struct iovec iov[IOV_MAX];
+    uint32_t total = iovec_import(iov, args->arg2, args->arg3, 0);
+    if (total == SYSCALL_ERROR) {
+        return SYSCALL_ERROR;
+    }
+    for (uint32_t i = 0; i < args->arg3; i++) {
+        terminal_write(iov[i].iov_base, iov[i].iov_len);
+    }
+    return total;
+}
+
+/* Scatter a read across several buffers */
+static uint32_t sys_readv(const struct syscall_args* args) {
+    if (args->arg1 != 0) {  /* stdin */
+        return SYSCALL_ERROR;
+    }
+    
+    struct iovec iov[IOV_MAX];
+    if (iovec_import(iov, args->arg2, args->arg3, 1) == SYSCALL_ERROR) {
+        return SYSCALL_ERROR;
+    }
+    
+    /* One line, spread over the buffers in order */
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < args->arg3; i++) {
+        int count = tty_read(iov[i].iov_base, iov[i].iov_len);
+        total += count;
+        if ((uint32_t)count < iov[i].iov_len || (count && ((char*)iov[i].iov_base)[count - 1] == '\n')) {
             break;
         }
-            
-        case SYSCALL_BRK: {
-            /* Change program break */
-            uint32_t new_brk = arg1;
-            
-            if (new_brk == 0) {
-                /* Return current break */
-                __asm__ __volatile__("mov %0, %%eax" : : "r"(processes[current_process].brk) : "eax");
-                return;
-            }
-            
-            /* Validate new break */
-            if (new_brk < processes[current_process].brk) {
-                /* Can only decrease break for now */
-                __asm__ __volatile__("mov $-1, %%eax" : : : "eax");
-                return;
-            }
-            
-            /* Allocate pages as needed */
-            uint32_t current_brk = processes[current_process].brk;
-            while (current_brk < new_brk) {
-                uint32_t page_frame = paging_alloc_frame();
-                if (!page_frame) {
-                    /* Out of memory */
-                    __asm__ __volatile__("mov $-1, %%eax" : : : "eax");
-                    return;
-                }
-                
-                /* Map page to user space */
-                paging_map_page(current_brk, page_frame, PAGE_PRESENT | PAGE_WRITE | PAGE_USER);
-                current_brk += PAGE_SIZE;
-            }
-            
-            /* Update break */
-            processes[current_process].brk = new_brk;
-            
-            /* Return success */
-            __asm__ __volatile__("mov $0, %%eax" : : : "eax");
-            break;
+    }
+    return total;
+}
+
+/* Read from file descriptor: stdin returns a typed line at a time */
+static uint32_t sys_read(const struct syscall_args* args) {
+    if (args->arg1 == 0) {  /* stdin */
+        char* user_buf = (char*)args->arg2;
+        if (!validate_user_range(user_buf, args->arg3, 1)) {
+            return SYSCALL_ERROR;
         }
-            
-        case SYSCALL_YIELD: {
-            /* Yield CPU to another process */
-            process_switch(0);  /* Let scheduler decide */
-            break;
+        return tty_read(user_buf, args->arg3);
+    }
+    
+    /* Invalid file descriptor */
+    return SYSCALL_ERROR;
+}
+
+/* Return current process PID */
+static uint32_t sys_getpid(const struct syscall_args* args) {
+    (void)args;
+    return processes[current_process].pid;
+}
+
+/* Sleep for specified milliseconds */
+static uint32_t sys_sleep(const struct syscall_args* args) {
+    if (timer_frequency > 0) {
+        uint32_t sleep_ticks = args->arg1 * timer_frequency / 1000;  /* Convert ms to ticks */
+        process_sleep(sleep_ticks);
+    }
+    return 0;
+}
+
+/* Duplicate the caller, sharing its pages copy-on-write */
+static uint32_t sys_fork(const struct syscall_args* args) {
+    (void)args;
+    uint32_t child_pid = process_fork();
+    return child_pid ? child_pid : SYSCALL_ERROR;
+}
+
+/* Execute new program */
+static uint32_t sys_exec(const struct syscall_args* args) {
+    const char* user_path = (const char*)args->arg1;
+    char path[256];
+    
+    /* Get path length */
+    uint32_t path_len = strnlen_user(user_path, sizeof(path));
+    if (path_len == 0 || copy_from_user(path, user_path, path_len) != 0) {
+        return SYSCALL_ERROR;
+    }
+    
+    /* For now, just print the path */
+    terminal_writestring("Exec: ");
+    terminal_write(path, path_len);
+    terminal_writestring("\n");
+    
+    /* Return success */
+    return 0;
+}
+
+/* Yield CPU to another process */
+static uint32_t sys_yield(const struct syscall_args* args) {
+    (void)args;
+    process_switch(0);  /* Let scheduler decide */
+    return 0;
+}
+
+/* Register the calling process's submission/completion ring */
+static uint32_t sys_ring_setup(const struct syscall_args* args) {
+    struct io_ring* ring = (struct io_ring*)args->arg1;
+    struct ring_slot* slot = &process_rings[current_process];
+    
+    if (!ring) {
+        slot->ring = NULL;
+        return 0;
+    }
+    if (((uint32_t)ring & 3) || !validate_user_range(ring, sizeof(*ring), 1)) {
+        return SYSCALL_ERROR;
+    }
+    
+    ring->sq_head = ring->sq_tail;
+    ring->cq_tail = ring->cq_head;
+    slot->pid = processes[current_process].pid;
+    slot->ring = ring;
+    return 0;
+}
+
+/* Run up to arg1 queued submissions in one trap; returns how many were consumed */
+static uint32_t sys_ring_enter(const struct syscall_args* args) {
+    struct ring_slot* slot = &process_rings[current_process];
+    struct io_ring* ring = slot->ring;
+    
+    /* The mapping may have changed since setup, so the ring is checked once per entry */
+    if (!ring || slot->pid != processes[current_process].pid ||
+        !validate_user_range(ring, sizeof(*ring), 1)) {
+        return SYSCALL_ERROR;
+    }
+    
+    uint32_t head = ring->sq_head;
+    uint32_t pending = ring->sq_tail - head;
+    uint32_t to_submit = args->arg1 < pending ? args->arg1 : pending;
+    uint32_t cq_tail = ring->cq_tail;
+    uint32_t done = 0;
+    
+    /* Stop early rather than overwrite completions the process has not reaped */
+    while (done < to_submit && cq_tail - ring->cq_head < RING_ENTRIES) {
+        struct ring_sqe sqe = ring->sq[(head + done) & RING_MASK];
+        struct syscall_args op_args = { sqe.fd, sqe.addr, sqe.len, 0, 0 };
+        uint32_t result = SYSCALL_ERROR;
+        if (sqe.opcode == RING_OP_NOP) {
+            result = 0;
+        } else if (sqe.opcode < RING_OP_MAX && ring_ops[sqe.opcode]) {
+            result = ring_ops[sqe.opcode](&op_args);
         }
-            
-        default:
-            terminal_writestring("Unknown system call: ");
-            terminal_writehex(syscall_num);
-            terminal_writestring("\n");
-            
-            /* Return error */
-            __asm__ __volatile__("mov $-1, %%eax" : : : "eax");
-            break;
+        
+        struct ring_cqe* cqe = &ring->cq[cq_tail & RING_MASK];
+        cqe->user_data = sqe.user_data;
+        cqe->result = result;
+        cq_tail++;
+        done++;
+    }
+    
+    /* Publish completions before the consumed submissions */
+    __asm__ __volatile__("" : : : "memory");
+    ring->cq_tail = cq_tail;
+    ring->sq_head = head + done;
+    return done;
+}
+
+/* Let other subsystems serve ring operations, such as sockets or directories */
+void ring_register_op(uint32_t opcode, syscall_fn_t handler) {
+    if (opcode != RING_OP_NOP && opcode < RING_OP_MAX) {
+        ring_ops[opcode] = handler;
     }
-}
\ No newline at end of file
+}
+
+/* Dispatch table; unimplemented numbers stay NULL until a subsystem registers them */
+static syscall_fn_t syscall_table[SYSCALL_MAX] = {
+    [SYSCALL_EXIT] = sys_exit,
+    [SYSCALL_READ] = sys_read,
+    [SYSCALL_WRITE] = sys_write,
+    [SYSCALL_FORK] = sys_fork,
+    [SYSCALL_EXEC] = sys_exec,
+    [SYSCALL_GETPID] = sys_getpid,
+    [SYSCALL_SLEEP] = sys_sleep,
+    [SYSCALL_YIELD] = sys_yield,
+    [SYSCALL_RING_SETUP] = sys_ring_setup,
+    [SYSCALL_RING_ENTER] = sys_ring_enter,
+    [SYSCALL_READV] = sys_readv,
+    [SYSCALL_WRITEV] = sys_writev,
+};
+
+/* Let other subsystems serve calls this file cannot, such as sendfile from the socket layer */
+void syscall_register(uint32_t syscall_num, syscall_fn_t handler) {
+    if (syscall_num < SYSCALL_MAX && !syscall_table[syscall_num]) {
+        syscall_table[syscall_num] = handler;
+    }
+}
+
+/* Run one system call and return its result */
+uint32_t syscall_dispatch(uint32_t syscall_num, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4, uint32_t arg5) {
+    if (syscall_num >= SYSCALL_MAX || !syscall_table[syscall_num]) {
+        printk_value(PRINTK_WARNING, "Unknown system call: ", syscall_num);
+        return SYSCALL_ERROR;
+    }
+    
+    struct syscall_args args = { arg1, arg2, arg3, arg4, arg5 };
+    struct syscall_stat* stat = &syscall_stats[syscall_num];
+    
+    /* Count before the call: exit and yield may not come back */
+    stat->calls++;
+    this_cpu_inc(PCPU_SYSCALLS);
+    TRACEPOINT(TRACE_SYSCALL_ENTRY, syscall_num, arg1, arg2);
+    uint64_t start = rdtsc();
+    uint32_t result = syscall_table[syscall_num](&args);
+    stat->cycles += rdtsc() - start;
+    TRACEPOINT(TRACE_SYSCALL_EXIT, syscall_num, result, 0);
+    return result;
+}
+
+/* INT 0x80 entry; the result is restored into eax by the stub's popa */
+void syscall_handler_c(struct syscall_frame* frame) {
+    syscall_from_user = (frame->cs & 3) != 0;
+    frame->eax = syscall_dispatch(frame->eax, frame->ebx, frame->ecx, frame->edx, frame->esi, frame->edi);
+}
+
+/* Clear the per-syscall counters */
+void syscall_stats_reset(void) {
+    for (uint32_t i = 0; i < SYSCALL_MAX; i++) {
+        syscall_stats[i].calls = 0;
+        syscall_stats[i].cycles = 0;
+    }
+}
+
+/* Forget every registered ring and install the built-in ring operations */
+void syscall_ring_init(void) {
+    for (uint32_t i = 0; i < MAX_PROCESSES; i++) {
+        process_rings[i].pid = 0;
+        process_rings[i].ring = NULL;
+    }
+    for (uint32_t i = 0; i < RING_OP_MAX; i++) {
+        ring_ops[i] = NULL;
+    }
+    ring_ops[RING_OP_WRITE] = sys_write;
+    ring_ops[RING_OP_READ] = sys_read;
+}
+
+/* Invocation count and cumulative TSC cycles of one system call */
+void syscall_get_stats(uint32_t syscall_num, uint32_t* calls, uint64_t* cycles) {
+    if (syscall_num >= SYSCALL_MAX) {
+        *calls = 0;
+        *cycles = 0;
+        return;
+    }
+    *calls = syscall_stats[syscall_num].calls;
+    *cycles = syscall_stats[syscall_num].cycles;
+}
@@ -0,0 +1,75 @@
+/*
+ * Tiny Operating System - vDSO User Library
+ * getpid and clock reads served from the read-only vvar pages, without a system call
+ */
+
+#include <stdint.h>
+
+/* Fixed user addresses of the vvar pages (must match kernel_usermode.c) */
+#define VVAR_DATA_ADDR 0x08046000
+#define VVAR_PROC_ADDR 0x08047000
+
+/* Shared kernel data (must match kernel_usermode.c) */
+struct vvar_data {
+    volatile uint32_t ticks;
+    uint32_t tick_hz;
+    uint32_t tsc_khz;
+    uint32_t tsc_mult;
+    uint32_t tsc_shift;
+    uint32_t tsc_base_low;
+    uint32_t tsc_base_high;
+};
+
+/* Per-process data (must match kernel_usermode.c) */
+struct vvar_proc {
+    uint32_t pid;
+};
+
+#define VVAR_DATA ((const struct vvar_data*)VVAR_DATA_ADDR)
+#define VVAR_PROC ((const struct vvar_proc*)VVAR_PROC_ADDR)
+
+/* Function prototypes */
+uint32_t vdso_getpid(void);
+uint32_t vdso_ticks(void);
+uint32_t vdso_uptime_ms(void);
+uint64_t vdso_clock_ns(void);
+
+static inline uint64_t rdtsc(void) {
+    uint32_t low, high;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+/* Process ID of the caller */
+uint32_t vdso_getpid(void) {
+    return VVAR_PROC->pid;
+}
+
+/* Timer ticks since boot */
+uint32_t vdso_ticks(void) {
+    return VVAR_DATA->ticks;
+}
+
+/* Milliseconds since boot at tick resolution; split to stay within 32 bits */
+uint32_t vdso_uptime_ms(void) {
+    uint32_t ticks = VVAR_DATA->ticks;
+    uint32_t hz = VVAR_DATA->tick_hz;
+    if (hz == 0) {
+        return 0;
+    }
+    return (ticks / hz) * 1000 + (ticks % hz) * 1000 / hz;
+}
+
+/* Nanoseconds since the TSC was calibrated, or 0 without a usable TSC */
+uint64_t vdso_clock_ns(void) {
+    const struct vvar_data* data = VVAR_DATA;
+    if (!data->tsc_mult) {
+        return 0;
+    }
+    
+    uint64_t base = ((uint64_t)data->tsc_base_high << 32) | data->tsc_base_low;
+    uint64_t cycles = rdtsc() - base;
+    uint64_t low = (uint64_t)(uint32_t)cycles * data->tsc_mult;
+    uint64_t high = (uint64_t)(uint32_t)(cycles >> 32) * data->tsc_mult;
+    return (low >> data->tsc_shift) + (high << (32 - data->tsc_shift));
+}
@@ -0,0 +1,446 @@
+/*
+ * Tiny Operating System - Shadow-Buffered Console
+ * Characters go to a copy of the screen in RAM; only the rows that changed
+ * are copied out to the VGA text buffer, a row run at a time, or drawn into
+ * a linear framebuffer once console_framebuffer has switched to one
+ */
+
+#include <stdint.h>
+
+#define CONSOLE_VGA ((volatile uint16_t*)0xB8000)
+#define CONSOLE_WIDTH 80
+#define CONSOLE_HEIGHT 25                /* Text mode */
+#define CONSOLE_MAX_HEIGHT 48            /* Framebuffer mode */
+#define CONSOLE_CLEAN CONSOLE_MAX_HEIGHT /* dirty_first value when nothing is dirty */
+
+/* Bochs/QEMU display interface (DISPI): an index port and a data port */
+#define DISPI_INDEX_PORT 0x01CE
+#define DISPI_DATA_PORT 0x01CF
+#define DISPI_INDEX_ID 0
+#define DISPI_INDEX_XRES 1
+#define DISPI_INDEX_YRES 2
+#define DISPI_INDEX_BPP 3
+#define DISPI_INDEX_ENABLE 4
+#define DISPI_INDEX_VIRT_WIDTH 6
+#define DISPI_INDEX_VIRT_HEIGHT 7
+#define DISPI_INDEX_Y_OFFSET 9
+#define DISPI_INDEX_VIDEO_MEMORY_64K 10
+#define DISPI_ID_MIN 0xB0C0
+#define DISPI_ID_MAX 0xB0C5
+#define DISPI_ENABLED 0x01
+#define DISPI_LFB_ENABLED 0x40
+
+#define GLYPH_WIDTH 8
+#define GLYPH_HEIGHT 16
+#define GLYPH_CACHE_SIZE 128            /* Power of two */
+#define FB_WIDTH (CONSOLE_WIDTH * GLYPH_WIDTH)
+#define FB_HEIGHT (CONSOLE_MAX_HEIGHT * GLYPH_HEIGHT)
+#define FB_PITCH (FB_WIDTH * 4)
+#define FB_VIRT_MAX 4096                /* Lines of virtual framebuffer to pan through */
+
+/* VGA sequencer and graphics controller, to read the font out of plane 2 */
+#define VGA_SEQ_INDEX 0x3C4
+#define VGA_GC_INDEX 0x3CE
+#define VGA_FONT_PLANE ((volatile const uint8_t*)0xA0000)
+
+/*
+ * The shadow rows form a ring: visible row y is shadow row (top + y) mod
+ * console_height, so scrolling moves top and clears one row instead of
+ * moving the whole screen. Writes into VGA memory are slow, uncached MMIO
+ * under most hypervisors, so they are batched into rep movsd copies of the
+ * dirty rows on newline, on console_flush and from the timer tick.
+ */
+static uint16_t console_rows[CONSOLE_MAX_HEIGHT][CONSOLE_WIDTH] __attribute__((aligned(16)));
+static uint32_t console_height = CONSOLE_HEIGHT;
+static uint32_t console_top;
+static uint32_t console_row;
+static uint32_t console_column;
+static uint8_t console_color = 0x07;
+static volatile uint32_t dirty_first = CONSOLE_CLEAN;   /* Visible rows first..last need copying */
+static volatile uint32_t dirty_last;
+
+/*
+ * Framebuffer mode. The card scans out FB_HEIGHT lines starting at
+ * fb_origin within a virtual framebuffer fb_virt_height lines tall, so a
+ * scroll moves fb_origin down a text row and draws only the new bottom
+ * row; the rows above are already in place. Only when the origin reaches
+ * the end of the virtual framebuffer is the whole screen drawn again, at
+ * the top. Cells are drawn from a direct-mapped cache of glyphs already
+ * expanded to 32-bit pixels in their colours, so a redraw is mostly
+ * 32-byte copies. The cache and the font are taken from the kernel heap
+ * when the framebuffer is switched on, so text-mode stages do not carry
+ * them in their images.
+ */
+struct glyph {
+    uint32_t key;                       /* Character | attribute << 8, or GLYPH_NONE */
+    uint32_t pixels[GLYPH_HEIGHT][GLYPH_WIDTH];
+};
+
+#define GLYPH_NONE 0xFFFFFFFF
+
+static uint8_t* fb_base;
+static uint32_t fb_virt_height;
+static uint32_t fb_origin;              /* First scanned-out line, where visible row 0 is drawn */
+static uint32_t fb_shown;               /* fb_origin as last written to the card */
+static uint8_t (*console_font)[GLYPH_HEIGHT];   /* 256 characters */
+static struct glyph* glyph_cache;               /* GLYPH_CACHE_SIZE entries */
+
+/* The text-mode palette as 0x00RRGGBB */
+static const uint32_t console_palette[16] = {
+    0x000000, 0x0000AA, 0x00AA00, 0x00AAAA, 0xAA0000, 0xAA00AA, 0xAA5500, 0xAAAAAA,
+    0x555555, 0x5555FF, 0x55FF55, 0x55FFFF, 0xFF5555, 0xFF55FF, 0xFFFF55, 0xFFFFFF,
+};
+
+/* Function prototypes */
+void console_initialize(uint8_t color);
+void console_setcolor(uint8_t color);
+void console_putentryat(char c, uint8_t color, uint32_t x, uint32_t y);
+void console_putchar(char c);
+void console_write(const char* data, uint32_t size);
+void console_flush(void);
+int console_framebuffer(uint32_t lfb);
+
+/* Kernel heap (kernel_heap.c) */
+extern void* malloc(uint32_t size);
+extern void free(void* ptr);
+static inline void outw(uint16_t port, uint16_t value) {
+    __asm__ __volatile__("outw %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint16_t inw(uint16_t port) {
+    uint16_t ret;
+    __asm__ __volatile__("inw %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static void dispi_write(uint16_t index, uint16_t value) {
+    outw(DISPI_INDEX_PORT, index);
+    outw(DISPI_DATA_PORT, value);
+}
+
+static uint16_t dispi_read(uint16_t index) {
+    outw(DISPI_INDEX_PORT, index);
+    return inw(DISPI_DATA_PORT);
+}
+
+static inline uint32_t console_ring_row(uint32_t y) {
+    uint32_t row = console_top + y;
+    return row >= console_height ? row - console_height : row;
+}
+
+static inline uint16_t* console_line(uint32_t y) {
+    return console_rows[console_ring_row(y)];
+}
+
+/*
+ * Mark visible rows first..last for the next flush. Callers change the
+ * shadow first and mark afterwards, so a flush that interrupts them either
+ * copies the new cells or leaves the rows marked for the next one.
+ */
+static void console_mark(uint32_t first, uint32_t last) {
+    uint32_t flags;
+    __asm__ __volatile__("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    if (dirty_first == CONSOLE_CLEAN) {
+        dirty_first = first;
+        dirty_last = last;
+    } else {
+        if (first < dirty_first) {
+            dirty_first = first;
+        }
+        if (last > dirty_last) {
+            dirty_last = last;
+        }
+    }
+    __asm__ __volatile__("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+static void console_clear_line(uint16_t* line) {
+    uint32_t blank = ((uint32_t)' ' | (uint32_t)console_color << 8) * 0x00010001;
+    uint32_t count = CONSOLE_WIDTH / 2;
+    __asm__ __volatile__("cld; rep stosl"
+                         : "+D"(line), "+c"(count)
+                         : "a"(blank)
+                         : "memory");
+}
+
+/*
+ * Move the text up a line: the old top row becomes the new, blank bottom
+ * row. In text mode every row is then copied again; in framebuffer mode
+ * the picture pans instead, so rows still waiting to be drawn move up one
+ * with it and only the new row is added.
+ */
+static void console_scroll(void) {
+    uint16_t* line = console_rows[console_top];
+    console_clear_line(line);
+    if (!fb_base) {
+        console_top = console_top + 1 == console_height ? 0 : console_top + 1;
+        console_mark(0, console_height - 1);
+        return;
+    }
+
+    uint32_t flags;
+    __asm__ __volatile__("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    console_top = console_top + 1 == console_height ? 0 : console_top + 1;
+    if (fb_origin + GLYPH_HEIGHT + FB_HEIGHT <= fb_virt_height) {
+        fb_origin += GLYPH_HEIGHT;
+        if (dirty_first != CONSOLE_CLEAN) {
+            if (dirty_last == 0) {
+                dirty_first = CONSOLE_CLEAN;
+            } else {
+                dirty_first = dirty_first ? dirty_first - 1 : 0;
+                dirty_last--;
+            }
+        }
+        console_mark(console_height - 1, console_height - 1);
+    } else {
+        fb_origin = 0;
+        console_mark(0, console_height - 1);
+    }
+    __asm__ __volatile__("push %0; popf" : : "r"(flags) : "memory", "cc");
+}
+
+/* Clear the screen and draw it at once */
+void console_initialize(uint8_t color) {
+    console_color = color;
+    console_top = 0;
+    console_row = 0;
+    console_column = 0;
+    for (uint32_t y = 0; y < console_height; y++) {
+        console_clear_line(console_rows[y]);
+    }
+    console_mark(0, console_height - 1);
+    console_flush();
+}
+
+void console_setcolor(uint8_t color) {
+    console_color = color;
+}
+
+void console_putentryat(char c, uint8_t color, uint32_t x, uint32_t y) {
+    console_line(y)[x] = (uint16_t)(uint8_t)c | (uint16_t)color << 8;
+    console_mark(y, y);
+}
+
+/*
+ * Newlines and full lines scroll once the cursor reaches the bottom; a
+ * newline flushes. A backspace erases the character before the cursor
+ * on the same line.
+ */
+void console_putchar(char c) {
+    if (c == '\b') {
+        if (console_column) {
+            console_column--;
+            console_putentryat(' ', console_color, console_column, console_row);
+        }
+        return;
+    }
+    if (c != '\n') {
+        console_putentryat(c, console_color, console_column, console_row);
+        if (++console_column < CONSOLE_WIDTH) {
+            return;
+        }
+    }
+
+    console_column = 0;
+    if (console_row + 1 < console_height) {
+        console_row++;
+    } else {
+        console_scroll();
+    }
+    if (c == '\n') {
+        console_flush();
+    }
+}
+
+void console_write(const char* data, uint32_t size) {
+    for (uint32_t i = 0; i < size; i++) {
+        console_putchar(data[i]);
+    }
+}
+
+/* The glyph for a character in an attribute's colours, rendered on a miss */
+static const struct glyph* console_glyph(uint16_t cell) {
+    uint32_t key = cell;
+    struct glyph* glyph = &glyph_cache[(cell ^ (cell >> 8) * 37) & (GLYPH_CACHE_SIZE - 1)];
+    if (glyph->key == key) {
+        return glyph;
+    }
+
+    uint32_t fg = console_palette[(cell >> 8) & 0xF];
+    uint32_t bg = console_palette[cell >> 12];
+    const uint8_t* bitmap = console_font[cell & 0xFF];
+    for (uint32_t y = 0; y < GLYPH_HEIGHT; y++) {
+        for (uint32_t x = 0; x < GLYPH_WIDTH; x++) {
+            glyph->pixels[y][x] = (bitmap[y] & (0x80 >> x)) ? fg : bg;
+        }
+    }
+    glyph->key = key;
+    return glyph;
+}
+
+/* Draw visible row y of the shadow at the current origin */
+static void console_draw_row(uint32_t y) {
+    const uint16_t* line = console_line(y);
+    uint8_t* row = fb_base + (fb_origin + y * GLYPH_HEIGHT) * FB_PITCH;
+    for (uint32_t x = 0; x < CONSOLE_WIDTH; x++) {
+        const struct glyph* glyph = console_glyph(line[x]);
+        for (uint32_t i = 0; i < GLYPH_HEIGHT; i++) {
+            const uint32_t* src = glyph->pixels[i];
+            uint8_t* dest = row + i * FB_PITCH + x * GLYPH_WIDTH * 4;
+            uint32_t count = GLYPH_WIDTH;
+            __asm__ __volatile__("cld; rep movsl"
+                                 : "+D"(dest), "+S"(src), "+c"(count)
+                                 :
+                                 : "memory");
+        }
+    }
+}
+
+/*
+ * Copy the dirty rows to the screen. The dirty range is taken and reset
+ * before copying, so rows marked by an interrupt during the copy stay
+ * marked. A visible run of rows is at most two runs of the ring. In
+ * framebuffer mode the rows are drawn below the picture being scanned out
+ * and the display start moves to them last, so a scroll never shows half
+ * drawn.
+ */
+void console_flush(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    uint32_t first = dirty_first;
+    uint32_t last = dirty_last;
+    dirty_first = CONSOLE_CLEAN;
+    if (fb_base) {
+        /* With interrupts off so a scroll cannot move the origin under a row being drawn */
+        for (uint32_t y = first; y != CONSOLE_CLEAN && y <= last; y++) {
+            console_draw_row(y);
+        }
+        if (fb_shown != fb_origin) {
+            fb_shown = fb_origin;
+            dispi_write(DISPI_INDEX_Y_OFFSET, (uint16_t)fb_origin);
+        }
+        first = CONSOLE_CLEAN;
+    }
+    __asm__ __volatile__("push %0; popf" : : "r"(flags) : "memory", "cc");
+
+    while (first != CONSOLE_CLEAN && first <= last) {
+        uint32_t row = console_ring_row(first);
+        uint32_t rows = last - first + 1;
+        if (rows > console_height - row) {
+            rows = console_height - row;
+        }
+
+        const uint16_t* src = console_rows[row];
+        volatile uint16_t* dest = CONSOLE_VGA + first * CONSOLE_WIDTH;
+        uint32_t count = rows * CONSOLE_WIDTH / 2;
+        __asm__ __volatile__("cld; rep movsl"
+                             : "+D"(dest), "+S"(src), "+c"(count)
+                             :
+                             : "memory");
+        first += rows;
+    }
+}
+
+/*
+ * Copy the 8x16 text font out of VGA plane 2 while it is still there: map
+ * the plane alone at 0xA0000, read 16 of each character's 32 bytes, then
+ * put back the text-mode settings.
+ */
+static void console_save_font(void) {
+    outw(VGA_SEQ_INDEX, 0x0402);        /* Map mask: plane 2 */
+    outw(VGA_SEQ_INDEX, 0x0704);        /* Sequential addressing */
+    outw(VGA_GC_INDEX, 0x0204);         /* Read map select: plane 2 */
+    outw(VGA_GC_INDEX, 0x0005);         /* No odd/even */
+    outw(VGA_GC_INDEX, 0x0406);         /* 64 KB at 0xA0000 */
+    for (uint32_t c = 0; c < 256; c++) {
+        for (uint32_t y = 0; y < GLYPH_HEIGHT; y++) {
+            console_font[c][y] = VGA_FONT_PLANE[c * 32 + y];
+        }
+    }
+    outw(VGA_SEQ_INDEX, 0x0302);
+    outw(VGA_SEQ_INDEX, 0x0304);
+    outw(VGA_GC_INDEX, 0x0004);
+    outw(VGA_GC_INDEX, 0x1005);
+    outw(VGA_GC_INDEX, 0x0E06);
+}
+
+/*
+ * Switch to a 640x768 32-bit linear framebuffer at physical address lfb
+ * (the adapter's BAR 0, which this stage reaches unpaged) with an 80x48
+ * console, keeping the text on screen. Needs the Bochs/QEMU display
+ * interface, room for at least two screens of video memory and 70 KB of
+ * heap for the font and glyph cache; returns 0 and stays in text mode
+ * otherwise.
+ */
+int console_framebuffer(uint32_t lfb) {
+    uint16_t id = dispi_read(DISPI_INDEX_ID);
+    if (!lfb || id < DISPI_ID_MIN || id > DISPI_ID_MAX) {
+        return 0;
+    }
+    uint32_t lines = (uint32_t)dispi_read(DISPI_INDEX_VIDEO_MEMORY_64K) * 65536 / FB_PITCH;
+    if (id < 0xB0C3) {
+        lines = 0x400000 / FB_PITCH;    /* Older interfaces cannot report it; all had 4 MB */
+    }
+    if (lines > FB_VIRT_MAX) {
+        lines = FB_VIRT_MAX;
+    }
+    if (lines < 2 * FB_HEIGHT) {
+        return 0;
+    }
+    if (!glyph_cache) {
+        console_font = malloc(256 * GLYPH_HEIGHT);
+        glyph_cache = malloc(GLYPH_CACHE_SIZE * sizeof(struct glyph));
+        if (!console_font || !glyph_cache) {
+            free(console_font);
+            free(glyph_cache);
+            console_font = 0;
+            glyph_cache = 0;
+            return 0;
+        }
+    }
+
+    console_save_font();
+    dispi_write(DISPI_INDEX_ENABLE, 0);
+    dispi_write(DISPI_INDEX_XRES, FB_WIDTH);
+    dispi_write(DISPI_INDEX_YRES, FB_HEIGHT);
+    dispi_write(DISPI_INDEX_BPP, 32);
+    dispi_write(DISPI_INDEX_ENABLE, DISPI_ENABLED | DISPI_LFB_ENABLED);
+    dispi_write(DISPI_INDEX_VIRT_WIDTH, FB_WIDTH);
+    dispi_write(DISPI_INDEX_VIRT_HEIGHT, (uint16_t)lines);
+    dispi_write(DISPI_INDEX_Y_OFFSET, 0);
+
+    for (uint32_t i = 0; i < GLYPH_CACHE_SIZE; i++) {
+        glyph_cache[i].key = GLYPH_NONE;
+    }
+
+    /* Unroll the ring so the existing text keeps its rows, and blank the new ones below */
+    uint32_t flags;
+    __asm__ __volatile__("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    static uint16_t unrolled[CONSOLE_HEIGHT][CONSOLE_WIDTH];
+    for (uint32_t y = 0; y < console_height; y++) {
+        const uint16_t* line = console_line(y);
+        for (uint32_t x = 0; x < CONSOLE_WIDTH; x++) {
+            unrolled[y][x] = line[x];
+        }
+    }
+    for (uint32_t y = 0; y < CONSOLE_HEIGHT; y++) {
+        for (uint32_t x = 0; x < CONSOLE_WIDTH; x++) {
+            console_rows[y][x] = unrolled[y][x];
+        }
+    }
+    for (uint32_t y = CONSOLE_HEIGHT; y < CONSOLE_MAX_HEIGHT; y++) {
+        console_clear_line(console_rows[y]);
+    }
+    console_top = 0;
+    console_height = CONSOLE_MAX_HEIGHT;
+    fb_base = (uint8_t*)(uintptr_t)lfb;
+    fb_virt_height = lines;
+    fb_origin = 0;
+    fb_shown = 0;
+    dirty_first = CONSOLE_CLEAN;
+    console_mark(0, console_height - 1);
+    __asm__ __volatile__("push %0; popf" : : "r"(flags) : "memory", "cc");
+
+    console_flush();
+    return 1;
+}
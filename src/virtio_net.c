@@ -0,0 +1,446 @@
+/*
+ * Virtio-net Network Device Driver
+ * Legacy virtio PCI transport with split RX/TX virtqueues
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Network constants from kernel */
+#define ETH_MTU 1500
+#define ETH_FRAME_MAX (ETH_MTU + 14)
+
+/* PCI identity of a transitional virtio network device */
+#define VIRTIO_VENDOR 0x1AF4
+#define VIRTIO_NET_DEVICE 0x1000
+
+/* Legacy I/O registers (BAR0) */
+#define VIRTIO_DEVICE_FEATURES 0x00
+#define VIRTIO_GUEST_FEATURES 0x04
+#define VIRTIO_QUEUE_PFN 0x08
+#define VIRTIO_QUEUE_SIZE 0x0C
+#define VIRTIO_QUEUE_SELECT 0x0E
+#define VIRTIO_QUEUE_NOTIFY 0x10
+#define VIRTIO_DEVICE_STATUS 0x12
+#define VIRTIO_ISR_STATUS 0x13
+#define VIRTIO_NET_MAC 0x14
+
+/* Device status bits */
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x01
+#define VIRTIO_STATUS_DRIVER 0x02
+#define VIRTIO_STATUS_DRIVER_OK 0x04
+#define VIRTIO_STATUS_FAILED 0x80
+
+/* Feature bits */
+#define VIRTIO_NET_F_MAC (1u << 5)
+
+/* Descriptor and ring flags */
+#define VRING_DESC_F_NEXT 1
+#define VRING_DESC_F_WRITE 2
+#define VRING_AVAIL_F_NO_INTERRUPT 1
+#define VRING_USED_F_NO_NOTIFY 1
+
+/* Queue geometry */
+#define VIRTIO_RX_QUEUE 0
+#define VIRTIO_TX_QUEUE 1
+#define VIRTQUEUE_MAX 256               /* Largest ring the static backing store holds */
+#define VIRTQUEUE_ALIGN 4096
+#define VIRTQUEUE_BYTES (3 * 4096)      /* Descriptors and avail ring, page aligned, then used ring */
+#define VIRTIO_NET_BUFFERS 16           /* Frames in flight per queue, two descriptors each */
+#define VIRTIO_RX_REFILL_BATCH 4        /* Recycled RX buffers published per notify */
+
+/* Deferred interrupt work (interrupt_handlers.c) */
+extern void irq_install_handler(uint32_t irq, void (*handler)(void));
+
+/* PCI configuration space (pci.c) */
+extern uint32_t pci_find_device(uint16_t vendor, uint16_t device_id);
+extern uint32_t pci_bar(uint32_t device, uint32_t index);
+extern uint8_t pci_interrupt_line(uint32_t device);
+extern void pci_enable_device(uint32_t device);
+
+/* Split virtqueue layout, shared with the device */
+struct vring_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct vring_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+};
+
+struct vring_used_elem {
+    uint32_t id;
+    uint32_t len;
+};
+
+struct vring_used {
+    uint16_t flags;
+    uint16_t idx;
+    struct vring_used_elem ring[];
+};
+
+/* Per-frame header the device reads before TX frames and writes before RX frames */
+struct virtio_net_hdr {
+    uint8_t flags;
+    uint8_t gso_type;
+    uint16_t hdr_len;
+    uint16_t gso_size;
+    uint16_t csum_start;
+    uint16_t csum_offset;
+} __attribute__((packed));
+
+/* Driver side of one virtqueue */
+struct virtqueue {
+    uint16_t index;
+    uint16_t size;
+    volatile struct vring_desc* desc;
+    volatile struct vring_avail* avail;
+    volatile struct vring_used* used;
+    uint16_t avail_idx;                 /* Entries posted, published to the device on kick */
+    uint16_t last_used;                 /* Used entries consumed */
+};
+
+/* Buffer behind one descriptor chain: header, then frame */
+struct virtio_net_buffer {
+    struct virtio_net_hdr hdr;
+    uint8_t data[ETH_FRAME_MAX];
+};
+
+/* Virtio-net device structure */
+struct virtio_net_device {
+    uint16_t io_base;
+    uint8_t irq;
+    uint8_t mac_address[6];
+    struct virtqueue rx;
+    struct virtqueue tx;
+    uint16_t tx_free[VIRTIO_NET_BUFFERS];
+    uint32_t tx_free_count;
+    uint32_t rx_refill_pending;
+    uint32_t rx_packets;
+    uint32_t tx_packets;
+    uint32_t rx_errors;
+    uint32_t tx_errors;
+    uint32_t notifications;
+};
+
+/* Global virtio-net device instance; the rings assume identity-mapped memory */
+static struct virtio_net_device vnet;
+static uint8_t vq_memory[2][VIRTQUEUE_BYTES] __attribute__((aligned(VIRTQUEUE_ALIGN)));
+static struct virtio_net_buffer rx_buffers[VIRTIO_NET_BUFFERS];
+static struct virtio_net_buffer tx_buffers[VIRTIO_NET_BUFFERS];
+
+/* Function prototypes */
+uint32_t virtio_net_register_device(void);
+uint32_t virtio_net_send(const void* data, uint32_t size);
+uint32_t virtio_net_send_batch(const void* const* frames, const uint32_t* sizes, uint32_t count);
+uint32_t virtio_net_receive(void* data, uint32_t max_size);
+uint32_t virtio_net_get_mac_address(uint8_t* mac);
+uint32_t virtio_net_get_statistics(uint32_t* rx_packets, uint32_t* tx_packets,
+                                   uint32_t* rx_errors, uint32_t* tx_errors);
+
+/* Port I/O functions */
+static inline void outb(uint16_t port, uint8_t value) {
+    __asm__ __volatile__("outb %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    __asm__ __volatile__("inb %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static inline void outw(uint16_t port, uint16_t value) {
+    __asm__ __volatile__("outw %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint16_t inw(uint16_t port) {
+    uint16_t ret;
+    __asm__ __volatile__("inw %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+static inline void outl(uint16_t port, uint32_t value) {
+    __asm__ __volatile__("outl %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t ret;
+    __asm__ __volatile__("inl %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+/* Save EFLAGS and disable interrupts */
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+/* Restore the interrupt flag saved by irq_save */
+static inline void irq_restore(uint32_t flags) {
+    __asm__ __volatile__("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+}
+
+/* x86 keeps stores in order, so only the store-then-load case needs a fence */
+static inline void virtio_wmb(void) {
+    __asm__ __volatile__("" : : : "memory");
+}
+
+static inline void virtio_mb(void) {
+    __asm__ __volatile__("lock; addl $0, (%%esp)" : : : "memory", "cc");
+}
+
+static void copy_bytes(void* dest, const void* src, uint32_t size) {
+    uint8_t* d = (uint8_t*)dest;
+    const uint8_t* s = (const uint8_t*)src;
+    for (uint32_t i = 0; i < size; i++) {
+        d[i] = s[i];
+    }
+}
+
+/* Size the ring the device offers and hand it our backing pages */
+static uint32_t virtqueue_setup(struct virtqueue* vq, uint16_t index, uint8_t* memory) {
+    outw(vnet.io_base + VIRTIO_QUEUE_SELECT, index);
+    uint16_t size = inw(vnet.io_base + VIRTIO_QUEUE_SIZE);
+    if (size < VIRTIO_NET_BUFFERS * 2 || size > VIRTQUEUE_MAX) {
+        return 0;
+    }
+    
+    for (uint32_t i = 0; i < VIRTQUEUE_BYTES; i++) {
+        memory[i] = 0;
+    }
+    
+    uint32_t avail_end = 16 * size + 2 * (3 + size);
+    vq->index = index;
+    vq->size = size;
+    vq->desc = (volatile struct vring_desc*)memory;
+    vq->avail = (volatile struct vring_avail*)(memory + 16 * size);
+    vq->used = (volatile struct vring_used*)(memory + ((avail_end + VIRTQUEUE_ALIGN - 1) & ~(VIRTQUEUE_ALIGN - 1)));
+    vq->avail_idx = 0;
+    vq->last_used = 0;
+    
+    outl(vnet.io_base + VIRTIO_QUEUE_PFN, (uint32_t)memory / VIRTQUEUE_ALIGN);
+    return 1;
+}
+
+/* Queue a descriptor chain; the device sees it at the next kick */
+static void virtqueue_post(struct virtqueue* vq, uint16_t head) {
+    vq->avail->ring[vq->avail_idx % vq->size] = head;
+    vq->avail_idx++;
+}
+
+/* Publish everything posted so far, notifying only if the device wants it */
+static void virtqueue_kick(struct virtqueue* vq) {
+    virtio_wmb();
+    vq->avail->idx = vq->avail_idx;
+    virtio_mb();
+    if (!(vq->used->flags & VRING_USED_F_NO_NOTIFY)) {
+        outw(vnet.io_base + VIRTIO_QUEUE_NOTIFY, vq->index);
+        vnet.notifications++;
+    }
+}
+
+/* Next chain the device has finished with, or -1 */
+static int virtqueue_get_used(struct virtqueue* vq, uint32_t* len) {
+    if (vq->last_used == vq->used->idx) {
+        return -1;
+    }
+    virtio_wmb();
+    volatile struct vring_used_elem* elem = &vq->used->ring[vq->last_used % vq->size];
+    vq->last_used++;
+    if (len) {
+        *len = elem->len;
+    }
+    return (int)elem->id;
+}
+
+/* Buffer i always owns descriptors 2i (header) and 2i+1 (frame) */
+static void virtqueue_chain(struct virtqueue* vq, struct virtio_net_buffer* buffers, uint16_t flags) {
+    for (uint16_t i = 0; i < VIRTIO_NET_BUFFERS; i++) {
+        volatile struct vring_desc* hdr = &vq->desc[2 * i];
+        volatile struct vring_desc* data = &vq->desc[2 * i + 1];
+        hdr->addr = (uint32_t)&buffers[i].hdr;
+        hdr->len = sizeof(struct virtio_net_hdr);
+        hdr->flags = flags | VRING_DESC_F_NEXT;
+        hdr->next = 2 * i + 1;
+        data->addr = (uint32_t)buffers[i].data;
+        data->len = ETH_FRAME_MAX;
+        data->flags = flags;
+        data->next = 0;
+    }
+}
+
+/* Retire transmitted chains; interrupts must be off */
+static void virtio_net_tx_reclaim(void) {
+    int head;
+    while ((head = virtqueue_get_used(&vnet.tx, NULL)) >= 0) {
+        vnet.tx_free[vnet.tx_free_count++] = head / 2;
+        vnet.tx_packets++;
+    }
+}
+
+/* Acknowledge the device; reading the ISR deasserts the line */
+static void virtio_net_interrupt(void) {
+    (void)inb(vnet.io_base + VIRTIO_ISR_STATUS);
+}
+
+/* Virtio-net initialization */
+static uint32_t virtio_net_init(void) {
+    vnet.rx_packets = 0;
+    vnet.tx_packets = 0;
+    vnet.rx_errors = 0;
+    vnet.tx_errors = 0;
+    vnet.notifications = 0;
+    vnet.rx_refill_pending = 0;
+    
+    uint32_t pci = pci_find_device(VIRTIO_VENDOR, VIRTIO_NET_DEVICE);
+    if (!pci) {
+        return 0; /* Device not found */
+    }
+    pci_enable_device(pci);
+    vnet.io_base = pci_bar(pci, 0);
+    vnet.irq = pci_interrupt_line(pci);
+    
+    /* Reset, then announce the driver */
+    outb(vnet.io_base + VIRTIO_DEVICE_STATUS, 0);
+    outb(vnet.io_base + VIRTIO_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    outb(vnet.io_base + VIRTIO_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+    
+    uint32_t features = inl(vnet.io_base + VIRTIO_DEVICE_FEATURES) & VIRTIO_NET_F_MAC;
+    outl(vnet.io_base + VIRTIO_GUEST_FEATURES, features);
+    
+    if (!virtqueue_setup(&vnet.rx, VIRTIO_RX_QUEUE, vq_memory[0]) ||
+        !virtqueue_setup(&vnet.tx, VIRTIO_TX_QUEUE, vq_memory[1])) {
+        outb(vnet.io_base + VIRTIO_DEVICE_STATUS, VIRTIO_STATUS_FAILED);
+        return 0;
+    }
+    
+    /* Use the device's MAC when it has one, else a locally administered default */
+    static const uint8_t default_mac[6] = {0x52, 0x54, 0x00, 0x12, 0x34, 0x57};
+    for (int i = 0; i < 6; i++) {
+        vnet.mac_address[i] = (features & VIRTIO_NET_F_MAC) ? inb(vnet.io_base + VIRTIO_NET_MAC + i) : default_mac[i];
+    }
+    
+    /* Fill the receive ring in one batch */
+    virtqueue_chain(&vnet.rx, rx_buffers, VRING_DESC_F_WRITE);
+    for (uint16_t i = 0; i < VIRTIO_NET_BUFFERS; i++) {
+        virtqueue_post(&vnet.rx, 2 * i);
+    }
+    
+    virtqueue_chain(&vnet.tx, tx_buffers, 0);
+    for (uint16_t i = 0; i < VIRTIO_NET_BUFFERS; i++) {
+        vnet.tx_free[i] = i;
+    }
+    vnet.tx_free_count = VIRTIO_NET_BUFFERS;
+    
+    /* Receive is polled and transmit reclaimed on send, so neither needs interrupts */
+    vnet.rx.avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+    vnet.tx.avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+    if (vnet.irq < 16) {
+        irq_install_handler(vnet.irq, virtio_net_interrupt);
+    }
+    
+    outb(vnet.io_base + VIRTIO_DEVICE_STATUS,
+         VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+    virtqueue_kick(&vnet.rx);
+    
+    return 1; /* Success */
+}
+
+/* Queue up to count frames with a single notify; returns the number queued */
+uint32_t virtio_net_send_batch(const void* const* frames, const uint32_t* sizes, uint32_t count) {
+    uint32_t flags = irq_save();
+    virtio_net_tx_reclaim();
+    
+    uint32_t queued = 0;
+    while (queued < count && vnet.tx_free_count > 0) {
+        if (sizes[queued] > ETH_FRAME_MAX) {
+            vnet.tx_errors++;
+            break;
+        }
+        
+        uint16_t buffer = vnet.tx_free[--vnet.tx_free_count];
+        struct virtio_net_buffer* tx = &tx_buffers[buffer];
+        struct virtio_net_hdr zero = {0};
+        tx->hdr = zero;
+        copy_bytes(tx->data, frames[queued], sizes[queued]);
+        vnet.tx.desc[2 * buffer + 1].len = sizes[queued];
+        virtqueue_post(&vnet.tx, 2 * buffer);
+        queued++;
+    }
+    
+    if (queued) {
+        virtqueue_kick(&vnet.tx);
+    }
+    irq_restore(flags);
+    return queued;
+}
+
+uint32_t virtio_net_send(const void* data, uint32_t size) {
+    return virtio_net_send_batch(&data, &size, 1) ? size : 0;
+}
+
+/* Copy out the next received frame and recycle its buffer; returns its length or 0 */
+uint32_t virtio_net_receive(void* data, uint32_t max_size) {
+    uint32_t flags = irq_save();
+    uint32_t len;
+    int head = virtqueue_get_used(&vnet.rx, &len);
+    
+    if (head < 0) {
+        /* Idle: publish any recycled buffers still held back */
+        if (vnet.rx_refill_pending) {
+            vnet.rx_refill_pending = 0;
+            virtqueue_kick(&vnet.rx);
+        }
+        irq_restore(flags);
+        return 0;
+    }
+    
+    uint32_t size = 0;
+    if (len > sizeof(struct virtio_net_hdr)) {
+        size = len - sizeof(struct virtio_net_hdr);
+        if (size > max_size) {
+            size = max_size;
+        }
+        copy_bytes(data, rx_buffers[head / 2].data, size);
+        vnet.rx_packets++;
+    } else {
+        vnet.rx_errors++;
+    }
+    
+    virtqueue_post(&vnet.rx, head);
+    if (++vnet.rx_refill_pending >= VIRTIO_RX_REFILL_BATCH) {
+        vnet.rx_refill_pending = 0;
+        virtqueue_kick(&vnet.rx);
+    }
+    
+    irq_restore(flags);
+    return size;
+}
+
+/* Virtio-net device registration function */
+uint32_t virtio_net_register_device(void) {
+    return virtio_net_init();
+}
+
+uint32_t virtio_net_get_mac_address(uint8_t* mac) {
+    if (mac) {
+        for (int i = 0; i < 6; i++) {
+            mac[i] = vnet.mac_address[i];
+        }
+    }
+    return 1;
+}
+
+uint32_t virtio_net_get_statistics(uint32_t* rx_packets, uint32_t* tx_packets,
+                                   uint32_t* rx_errors, uint32_t* tx_errors) {
+    if (rx_packets) *rx_packets = vnet.rx_packets;
+    if (tx_packets) *tx_packets = vnet.tx_packets;
+    if (rx_errors) *rx_errors = vnet.rx_errors;
+    if (tx_errors) *tx_errors = vnet.tx_errors;
+    return 1;
+}
@@ -0,0 +1,398 @@
+/*
+ * Tiny Operating System - Compressed RAM Swap
+ * Where cold anonymous pages go when memory runs out, as zram: a page is
+ * LZ4-compressed into a pool of frames, so one that packs to a third of
+ * its size costs a third of a frame, and nothing waits on a disk. A
+ * stored page is known by its slot number, which the paging code keeps
+ * in the not-present PTE and hands back on the fault that wants it.
+ *
+ * The pool is carved up as zsmalloc does it: a compressed page is rounded
+ * up to a 64-byte class, and each pool frame holds objects of one class
+ * only, so a freed object is reused by the next page of about its size
+ * and a frame goes back as soon as it is empty.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PAGE_SIZE 4096
+#define ZRAM_SLOTS 4096                 /* Pages out at once; slot 0 is never handed out */
+#define ZRAM_POOL_FRAMES 1024
+#define ZRAM_UNIT_SHIFT 6               /* Objects are multiples of 64 bytes */
+#define ZRAM_MAX_STORED 3072            /* A page that does not pack below this stays in memory */
+#define ZRAM_CLASSES ((ZRAM_MAX_STORED >> ZRAM_UNIT_SHIFT) + 1)
+#define ZRAM_NIL 0xFFFF
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5             /* The block ends with at least this many literals */
+#define LZ4_MATCH_LIMIT 12              /* No match starts within this many bytes of the end */
+#define LZ4_HASH_BITS 10
+#define LZ4_WORST_CASE (PAGE_SIZE + PAGE_SIZE / 255 + 16)
+
+/* A stored page: its object in the pool, and how many PTEs name it */
+struct zram_slot {
+    uint16_t frame;                     /* Pool index, ZRAM_NIL when the slot is free */
+    uint8_t object;
+    uint8_t refs;
+    uint16_t length;                    /* Compressed bytes */
+    uint16_t next_free;
+};
+
+/* A pool frame, cut into objects of one class; those with room are on their class's list */
+struct zram_frame {
+    uint32_t addr;                      /* 0 when the entry is unused */
+    uint16_t class;
+    uint16_t used;
+    uint16_t prev;
+    uint16_t next;
+    uint32_t free_mask[2];              /* Set bits are free objects */
+};
+
+/* What zram_get_stats reports (must match the users' copies) */
+struct zram_stats {
+    uint32_t stored;                    /* Pages held */
+    uint32_t compressed_bytes;          /* What they pack to */
+    uint32_t pool_frames;               /* Frames holding them */
+    uint32_t rejected;                  /* Stores refused: the page did not compress */
+    uint32_t pool_full;                 /* Stores refused: no slot or frame */
+};
+
+static struct zram_slot zram_slots[ZRAM_SLOTS];
+static uint16_t zram_free_slot;
+static struct zram_frame zram_frames[ZRAM_POOL_FRAMES];
+static uint16_t zram_partial[ZRAM_CLASSES];     /* Frames of each class with a free object */
+static struct zram_stats zram_stats;
+static uint32_t (*zram_alloc_frame)(void);
+static void (*zram_free_frame)(uint32_t addr);
+static uint8_t zram_buffer[LZ4_WORST_CASE];
+static uint16_t zram_hash_table[1 << LZ4_HASH_BITS];
+static volatile uint32_t zram_lock_word;
+
+/* Kernel runtime library (klib.c) */
+extern void* memcpy(void* dest, const void* src, size_t n);
+extern void* memset(void* s, int c, size_t n);
+
+/* Function prototypes */
+void zram_init(uint32_t (*alloc_frame)(void), void (*free_frame)(uint32_t addr));
+uint32_t zram_store(const void* page);
+int zram_load(uint32_t slot, void* page);
+void zram_dup(uint32_t slot);
+void zram_free(uint32_t slot);
+void zram_get_stats(struct zram_stats* stats);
+
+/* Interrupts off as well: the paging code calls in from fault and reclaim paths */
+static uint32_t zram_lock(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    while (__atomic_exchange_n(&zram_lock_word, 1, __ATOMIC_ACQUIRE)) {
+        __asm__ __volatile__("pause");
+    }
+    return flags;
+}
+
+static void zram_unlock(uint32_t flags) {
+    __atomic_store_n(&zram_lock_word, 0, __ATOMIC_RELEASE);
+    __asm__ __volatile__("pushl %0; popfl" : : "r"(flags) : "memory", "cc");
+}
+
+static uint32_t read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t lz4_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+/* A length beyond the token's nibble: 255s then the remainder */
+static uint8_t* lz4_put_length(uint8_t* out, uint32_t length) {
+    while (length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = (uint8_t)length;
+    return out;
+}
+
+/* One sequence; match_length 0 for the final, literals-only one */
+static uint8_t* lz4_put_sequence(uint8_t* out, const uint8_t* literals, uint32_t literal_length,
+                                 uint32_t offset, uint32_t match_length) {
+    uint32_t match_code = match_length ? match_length - LZ4_MIN_MATCH : 0;
+    *out++ = (uint8_t)((literal_length < 15 ? literal_length : 15) << 4 |
+                       (match_code < 15 ? match_code : 15));
+    if (literal_length >= 15) {
+        out = lz4_put_length(out, literal_length - 15);
+    }
+    memcpy(out, literals, literal_length);
+    out += literal_length;
+    if (!match_length) {
+        return out;
+    }
+    *out++ = (uint8_t)offset;
+    *out++ = (uint8_t)(offset >> 8);
+    if (match_code >= 15) {
+        out = lz4_put_length(out, match_code - 15);
+    }
+    return out;
+}
+
+/*
+ * Compress a page into zram_buffer as one raw LZ4 block, the format
+ * tools/lz4pack.c writes: greedy matching over a hash of 4-byte
+ * prefixes. A page is within the 16-bit offset of any match. Locked
+ */
+static uint32_t lz4_compress_page(const uint8_t* in) {
+    uint8_t* out = zram_buffer;
+    uint32_t anchor = 0;
+    uint32_t pos = 0;
+    memset(zram_hash_table, 0, sizeof(zram_hash_table));
+
+    while (pos < PAGE_SIZE - LZ4_MATCH_LIMIT) {
+        uint32_t hash = lz4_hash(read32(in + pos));
+        uint32_t candidate = zram_hash_table[hash];
+        zram_hash_table[hash] = (uint16_t)(pos + 1);
+        if (!candidate-- || read32(in + candidate) != read32(in + pos)) {
+            pos++;
+            continue;
+        }
+        uint32_t length = LZ4_MIN_MATCH;
+        while (pos + length < PAGE_SIZE - LZ4_LAST_LITERALS && in[candidate + length] == in[pos + length]) {
+            length++;
+        }
+        out = lz4_put_sequence(out, in + anchor, pos - anchor, pos - candidate, length);
+        pos += length;
+        anchor = pos;
+    }
+    out = lz4_put_sequence(out, in + anchor, PAGE_SIZE - anchor, 0, 0);
+    return (uint32_t)(out - zram_buffer);
+}
+
+/* A token's length nibble continued in the bytes after it; 0xFFFFFFFF when they run past end */
+static uint32_t lz4_get_length(const uint8_t** in, const uint8_t* end, uint32_t length) {
+    if (length != 15) {
+        return length;
+    }
+    uint8_t byte;
+    do {
+        if (*in >= end) {
+            return 0xFFFFFFFF;
+        }
+        byte = *(*in)++;
+        length += byte;
+    } while (byte == 255);
+    return length;
+}
+
+/* Decode one block of size bytes into a page; 0 unless it fills the page exactly */
+static int lz4_decompress_page(const uint8_t* in, uint32_t size, uint8_t* out) {
+    const uint8_t* end = in + size;
+    uint32_t done = 0;
+    while (in < end) {
+        uint8_t token = *in++;
+        uint32_t literals = lz4_get_length(&in, end, token >> 4);
+        if (literals > (uint32_t)(end - in) || literals > PAGE_SIZE - done) {
+            return 0;
+        }
+        memcpy(out + done, in, literals);
+        in += literals;
+        done += literals;
+        if (in == end) {
+            break;
+        }
+
+        if (end - in < 2) {
+            return 0;
+        }
+        uint32_t offset = in[0] | (uint32_t)in[1] << 8;
+        in += 2;
+        uint32_t length = lz4_get_length(&in, end, token & 0x0F);
+        if (length == 0xFFFFFFFF || !offset || offset > done || length + LZ4_MIN_MATCH > PAGE_SIZE - done) {
+            return 0;
+        }
+        length += LZ4_MIN_MATCH;
+
+        /* Byte by byte: a match may overlap the bytes it is producing */
+        for (uint32_t i = 0; i < length; i++, done++) {
+            out[done] = out[done - offset];
+        }
+    }
+    return done == PAGE_SIZE;
+}
+
+/* Pool frames come from and go back to the callbacks; the pool starts empty */
+void zram_init(uint32_t (*alloc_frame)(void), void (*free_frame)(uint32_t addr)) {
+    for (uint32_t i = 0; i < ZRAM_SLOTS; i++) {
+        zram_slots[i].frame = ZRAM_NIL;
+        zram_slots[i].refs = 0;
+        zram_slots[i].next_free = i + 1 < ZRAM_SLOTS ? (uint16_t)(i + 1) : ZRAM_NIL;
+    }
+    zram_free_slot = 1;
+    for (uint32_t i = 0; i < ZRAM_POOL_FRAMES; i++) {
+        zram_frames[i].addr = 0;
+    }
+    for (uint32_t i = 0; i < ZRAM_CLASSES; i++) {
+        zram_partial[i] = ZRAM_NIL;
+    }
+    memset(&zram_stats, 0, sizeof(zram_stats));
+    zram_alloc_frame = alloc_frame;
+    zram_free_frame = free_frame;
+}
+
+static void zram_partial_push(uint16_t index) {
+    struct zram_frame* frame = &zram_frames[index];
+    frame->prev = ZRAM_NIL;
+    frame->next = zram_partial[frame->class];
+    if (frame->next != ZRAM_NIL) {
+        zram_frames[frame->next].prev = index;
+    }
+    zram_partial[frame->class] = index;
+}
+
+static void zram_partial_remove(uint16_t index) {
+    struct zram_frame* frame = &zram_frames[index];
+    if (frame->prev != ZRAM_NIL) {
+        zram_frames[frame->prev].next = frame->next;
+    } else {
+        zram_partial[frame->class] = frame->next;
+    }
+    if (frame->next != ZRAM_NIL) {
+        zram_frames[frame->next].prev = frame->prev;
+    }
+}
+
+static uint32_t zram_capacity(uint32_t class) {
+    return PAGE_SIZE / (class << ZRAM_UNIT_SHIFT);
+}
+
+/* A free object of class: from a partial frame, else from a new one. Returns the frame, or ZRAM_NIL. Locked */
+static uint16_t zram_object_alloc(uint32_t class, uint8_t* object) {
+    uint16_t index = zram_partial[class];
+    if (index == ZRAM_NIL) {
+        for (index = 0; index < ZRAM_POOL_FRAMES && zram_frames[index].addr; index++) {
+        }
+        uint32_t addr = index < ZRAM_POOL_FRAMES && zram_alloc_frame ? zram_alloc_frame() : 0;
+        if (!addr) {
+            return ZRAM_NIL;
+        }
+        struct zram_frame* frame = &zram_frames[index];
+        uint32_t capacity = zram_capacity(class);
+        frame->addr = addr;
+        frame->class = (uint16_t)class;
+        frame->used = 0;
+        frame->free_mask[0] = capacity >= 32 ? 0xFFFFFFFF : (1u << capacity) - 1;
+        frame->free_mask[1] = capacity > 32 ? (capacity == 64 ? 0xFFFFFFFF : (1u << (capacity - 32)) - 1) : 0;
+        zram_partial_push(index);
+        zram_stats.pool_frames++;
+    }
+
+    struct zram_frame* frame = &zram_frames[index];
+    uint32_t word = frame->free_mask[0] ? 0 : 1;
+    uint32_t bit = (uint32_t)__builtin_ctz(frame->free_mask[word]);
+    frame->free_mask[word] &= ~(1u << bit);
+    *object = (uint8_t)(word * 32 + bit);
+    if (++frame->used == zram_capacity(class)) {
+        zram_partial_remove(index);
+    }
+    return index;
+}
+
+/* Locked */
+static void zram_object_free(uint16_t index, uint8_t object) {
+    struct zram_frame* frame = &zram_frames[index];
+    if (frame->used == zram_capacity(frame->class)) {
+        zram_partial_push(index);
+    }
+    frame->free_mask[object / 32] |= 1u << (object % 32);
+    if (--frame->used == 0) {
+        zram_partial_remove(index);
+        if (zram_free_frame) {
+            zram_free_frame(frame->addr);
+        }
+        frame->addr = 0;
+        zram_stats.pool_frames--;
+    }
+}
+
+/*
+ * Compress a page into the pool; returns its slot, or 0 when it does not
+ * pack below ZRAM_MAX_STORED or the pool has no room. The page is only
+ * read, so the caller frees it once the PTE names the slot.
+ */
+uint32_t zram_store(const void* page) {
+    uint32_t flags = zram_lock();
+    uint32_t length = lz4_compress_page((const uint8_t*)page);
+    if (length > ZRAM_MAX_STORED) {
+        zram_stats.rejected++;
+        zram_unlock(flags);
+        return 0;
+    }
+
+    uint32_t class = (length + (1u << ZRAM_UNIT_SHIFT) - 1) >> ZRAM_UNIT_SHIFT;
+    uint16_t slot = zram_free_slot;
+    uint8_t object;
+    uint16_t index = slot != ZRAM_NIL ? zram_object_alloc(class, &object) : ZRAM_NIL;
+    if (index == ZRAM_NIL) {
+        zram_stats.pool_full++;
+        zram_unlock(flags);
+        return 0;
+    }
+
+    memcpy((void*)(zram_frames[index].addr + ((uint32_t)object * class << ZRAM_UNIT_SHIFT)), zram_buffer, length);
+    zram_free_slot = zram_slots[slot].next_free;
+    zram_slots[slot].frame = index;
+    zram_slots[slot].object = object;
+    zram_slots[slot].refs = 1;
+    zram_slots[slot].length = (uint16_t)length;
+    zram_stats.stored++;
+    zram_stats.compressed_bytes += length;
+    zram_unlock(flags);
+    return slot;
+}
+
+/* Decompress a slot's page; 0 if the slot holds none or its data is corrupt. The slot stays */
+int zram_load(uint32_t slot, void* page) {
+    uint32_t flags = zram_lock();
+    if (!slot || slot >= ZRAM_SLOTS || zram_slots[slot].frame == ZRAM_NIL) {
+        zram_unlock(flags);
+        return 0;
+    }
+    struct zram_slot* entry = &zram_slots[slot];
+    struct zram_frame* frame = &zram_frames[entry->frame];
+    const uint8_t* data = (const uint8_t*)(frame->addr + ((uint32_t)entry->object * frame->class << ZRAM_UNIT_SHIFT));
+    int ok = lz4_decompress_page(data, entry->length, (uint8_t*)page);
+    zram_unlock(flags);
+    return ok;
+}
+
+/* One more PTE names the slot, as when a fork copies it */
+void zram_dup(uint32_t slot) {
+    uint32_t flags = zram_lock();
+    if (slot && slot < ZRAM_SLOTS && zram_slots[slot].frame != ZRAM_NIL && zram_slots[slot].refs < 255) {
+        zram_slots[slot].refs++;
+    }
+    zram_unlock(flags);
+}
+
+/* One PTE fewer names the slot; the last one gives its object back */
+void zram_free(uint32_t slot) {
+    uint32_t flags = zram_lock();
+    if (!slot || slot >= ZRAM_SLOTS || zram_slots[slot].frame == ZRAM_NIL || --zram_slots[slot].refs) {
+        zram_unlock(flags);
+        return;
+    }
+    struct zram_slot* entry = &zram_slots[slot];
+    zram_object_free(entry->frame, entry->object);
+    zram_stats.stored--;
+    zram_stats.compressed_bytes -= entry->length;
+    entry->frame = ZRAM_NIL;
+    entry->next_free = zram_free_slot;
+    zram_free_slot = (uint16_t)slot;
+    zram_unlock(flags);
+}
+
+void zram_get_stats(struct zram_stats* stats) {
+    uint32_t flags = zram_lock();
+    *stats = zram_stats;
+    zram_unlock(flags);
+}
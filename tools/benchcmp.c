@@ -0,0 +1,104 @@
+/*
+ * Tiny Operating System - Benchmark Comparison
+ * Host tool: compares the JSON lines a headless benchmark run printed
+ * (bench.c's bench_export) with a baseline run, benchmark by benchmark
+ * on the median. Exits 1 when any got slower by more than the threshold.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_MAX 64
+#define BENCH_NAME_MAX 64
+
+struct bench_line {
+    char name[BENCH_NAME_MAX];
+    unsigned long min;
+    unsigned long median;
+    unsigned long p99;
+};
+
+/* The number after "key": in line, or -1 */
+static long json_number(const char* line, const char* key) {
+    char pattern[32];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char* at = strstr(line, pattern);
+    return at ? strtol(at + strlen(pattern), NULL, 10) : -1;
+}
+
+/* Read the benchmark lines of file, skipping anything else on the console; returns the count or -1 */
+static int read_results(const char* path, struct bench_line* out) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    char line[512];
+    int count = 0;
+    while (count < BENCH_MAX && fgets(line, sizeof(line), file)) {
+        const char* name = strstr(line, "{\"bench\":\"");
+        if (!name) {
+            continue;
+        }
+        name += strlen("{\"bench\":\"");
+        const char* end = strchr(name, '"');
+        long median = json_number(line, "median");
+        if (!end || end - name >= BENCH_NAME_MAX || median < 0) {
+            continue;
+        }
+        memcpy(out[count].name, name, (size_t)(end - name));
+        out[count].name[end - name] = '\0';
+        out[count].min = (unsigned long)json_number(line, "min");
+        out[count].median = (unsigned long)median;
+        out[count].p99 = (unsigned long)json_number(line, "p99");
+        count++;
+    }
+    fclose(file);
+    return count;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s baseline.jsonl current.jsonl threshold-percent\n", argv[0]);
+        return 2;
+    }
+    static struct bench_line baseline[BENCH_MAX];
+    static struct bench_line current[BENCH_MAX];
+    long threshold = strtol(argv[3], NULL, 10);
+    int current_count = read_results(argv[2], current);
+    if (current_count <= 0) {
+        fprintf(stderr, "%s: no benchmark results\n", argv[2]);
+        return 2;
+    }
+    int baseline_count = read_results(argv[1], baseline);
+    if (baseline_count < 0) {
+        printf("%s: no baseline, nothing to compare\n", argv[1]);
+        baseline_count = 0;
+    }
+
+    int regressions = 0;
+    printf("%-20s %10s %10s %8s\n", "benchmark", "baseline", "median", "change");
+    for (int i = 0; i < current_count; i++) {
+        const struct bench_line* now = &current[i];
+        const struct bench_line* then = NULL;
+        for (int j = 0; j < baseline_count && !then; j++) {
+            if (strcmp(baseline[j].name, now->name) == 0) {
+                then = &baseline[j];
+            }
+        }
+        if (!then || !then->median) {
+            printf("%-20s %10s %10lu %8s\n", now->name, "-", now->median, "new");
+            continue;
+        }
+        double change = ((double)now->median - (double)then->median) * 100.0 / (double)then->median;
+        int slower = change > (double)threshold;
+        regressions += slower;
+        printf("%-20s %10lu %10lu %+7.1f%%%s\n", now->name, then->median, now->median,
+               change, slower ? "  REGRESSION" : "");
+    }
+    if (regressions) {
+        printf("%d benchmark(s) slower than the baseline by more than %ld%%\n", regressions, threshold);
+        return 1;
+    }
+    return 0;
+}
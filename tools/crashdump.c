@@ -0,0 +1,187 @@
+/*
+ * Tiny Operating System - Crash Dump Reader
+ * Host tool: finds the dump src/crashdump.c streamed to COM1 in a serial
+ * log, prints where the kernel died, and writes each region it carried to
+ * <prefix>-<name>.bin. To read a variable out of the kernel or bss
+ * region, take its address and size from nm -S build/kernel_<stage>.elf
+ * and subtract the region's base; addr2line -f -e on the same .elf names
+ * the frames.
+ * Exits 1 when the dump is missing, truncated or fails its checksums.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CRASHDUMP_VERSION 1
+#define CRASHDUMP_FRAMES 16
+#define CRASHDUMP_REASON 64
+#define CRASHDUMP_NAME 16
+
+/* The stream's layout (must match src/crashdump.c) */
+struct crashdump_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t regions;
+    uint32_t eip;
+    uint32_t ebp;
+    uint32_t depth;
+    uint32_t frames[CRASHDUMP_FRAMES];
+    uint64_t tsc;
+    char reason[CRASHDUMP_REASON];
+} __attribute__((packed));
+
+struct crashdump_region_header {
+    char name[CRASHDUMP_NAME];
+    uint32_t base;
+    uint32_t size;
+} __attribute__((packed));
+
+static const uint8_t* data;
+static size_t data_size;
+static size_t data_pos;
+
+static int take(void* out, size_t size) {
+    if (data_size - data_pos < size) {
+        return -1;
+    }
+    memcpy(out, data + data_pos, size);
+    data_pos += size;
+    return 0;
+}
+
+/* Undo the run-length encoding into out, size bytes; returns their FNV-1a checksum, sets *ok */
+static uint32_t decode(uint8_t* out, uint32_t size, int* ok) {
+    uint32_t hash = 0x811C9DC5;
+    uint32_t done = 0;
+    *ok = 1;
+    while (done < size) {
+        uint8_t control;
+        if (take(&control, 1) != 0) {
+            *ok = 0;
+            return 0;
+        }
+        if (control < 0x80) {
+            uint32_t count = control + 1u;
+            if (count > size - done || take(out + done, count) != 0) {
+                *ok = 0;
+                return 0;
+            }
+            done += count;
+        } else {
+            uint8_t byte;
+            uint32_t count = control - 0x80u + 3;
+            if (count > size - done || take(&byte, 1) != 0) {
+                *ok = 0;
+                return 0;
+            }
+            memset(out + done, byte, count);
+            done += count;
+        }
+    }
+    for (uint32_t i = 0; i < size; i++) {
+        hash = (hash ^ out[i]) * 0x01000193;
+    }
+    return hash;
+}
+
+static uint8_t* read_file(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t* buffer = length > 0 ? malloc((size_t)length) : NULL;
+    if (!buffer || fread(buffer, 1, (size_t)length, file) != (size_t)length) {
+        free(buffer);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    *size = (size_t)length;
+    return buffer;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s serial.log [prefix]\n", argv[0]);
+        return 2;
+    }
+    const char* prefix = argc == 3 ? argv[2] : "crash";
+    uint8_t* log = read_file(argv[1], &data_size);
+    if (!log) {
+        fprintf(stderr, "%s: cannot read\n", argv[1]);
+        return 1;
+    }
+    data = log;
+
+    /* The last dump in the log, if the machine crashed more than once */
+    const uint8_t* found = NULL;
+    for (size_t i = 0; i + sizeof(struct crashdump_header) <= data_size; i++) {
+        if (memcmp(data + i, "TOSDUMP", 8) == 0) {
+            found = data + i;
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "%s: no crash dump\n", argv[1]);
+        return 1;
+    }
+    data_pos = (size_t)(found - data);
+
+    struct crashdump_header header;
+    take(&header, sizeof(header));
+    if (header.version != CRASHDUMP_VERSION) {
+        fprintf(stderr, "dump version %u, expected %d\n", header.version, CRASHDUMP_VERSION);
+        return 1;
+    }
+    header.reason[CRASHDUMP_REASON - 1] = '\0';
+    printf("reason: %s\n", header.reason);
+    printf("eip:    0x%08x\n", header.eip);
+    printf("tsc:    %llu\n", (unsigned long long)header.tsc);
+    for (uint32_t i = 0; i < header.depth && i < CRASHDUMP_FRAMES; i++) {
+        printf("  from  0x%08x\n", header.frames[i]);
+    }
+
+    int bad = 0;
+    for (uint32_t r = 0; r < header.regions; r++) {
+        struct crashdump_region_header region;
+        if (take(&region, sizeof(region)) != 0) {
+            printf("truncated before region %u\n", r);
+            return 1;
+        }
+        region.name[CRASHDUMP_NAME - 1] = '\0';
+        uint8_t* bytes = malloc(region.size ? region.size : 1);
+        int ok;
+        uint32_t checksum = decode(bytes, region.size, &ok);
+        uint32_t expected;
+        if (!ok || take(&expected, sizeof(expected)) != 0) {
+            printf("%s: truncated\n", region.name);
+            free(bytes);
+            return 1;
+        }
+
+        char path[256];
+        snprintf(path, sizeof(path), "%s-%s.bin", prefix, region.name);
+        FILE* out = fopen(path, "wb");
+        if (!out || fwrite(bytes, 1, region.size, out) != region.size) {
+            fprintf(stderr, "%s: cannot write\n", path);
+            return 1;
+        }
+        fclose(out);
+        printf("%-16s base 0x%08x size %8u -> %s%s\n", region.name, region.base, region.size, path,
+               checksum == expected ? "" : " (CHECKSUM MISMATCH)");
+        bad += checksum != expected;
+        free(bytes);
+    }
+
+    char end[8];
+    if (take(end, sizeof(end)) != 0 || memcmp(end, "TOSDEND", 8) != 0) {
+        printf("no end marker: the dump may be incomplete\n");
+        bad++;
+    }
+    free(log);
+    return bad ? 1 : 0;
+}
@@ -0,0 +1,105 @@
+/*
+ * Tiny Operating System - Profile Extraction
+ * Host tool: writes out the .gcda files a profiling kernel sent on its
+ * console (gcov.c's gcov_dump), each line
+ *   {"gcda":"/path/of/object.gcda","data":"<hex>"}
+ * becoming the file at that path, where -fprofile-use looks for it.
+ * Anything else on the console is skipped. Exits 1 when the log holds no
+ * profile, a line is cut short, or a file cannot be written.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define GCDA_PATH_MAX 4096
+
+static int hex_digit(char c) {
+    return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+/* The whole log, NUL-terminated, or NULL */
+static char* read_log(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+    size_t size = 0, capacity = 1 << 16;
+    char* text = malloc(capacity);
+    size_t got;
+    while (text && (got = fread(text + size, 1, capacity - size - 1, file)) > 0) {
+        size += got;
+        if (capacity - size == 1) {
+            capacity *= 2;
+            char* grown = realloc(text, capacity);
+            if (!grown) {
+                free(text);
+            }
+            text = grown;
+        }
+    }
+    fclose(file);
+    if (text) {
+        text[size] = '\0';
+    }
+    return text;
+}
+
+/* Decode the hex at data, up to its closing quote, into path; 0, or -1 */
+static int write_gcda(const char* path, const char* data) {
+    const char* end = strchr(data, '"');
+    if (!end || (end - data) % 2) {
+        return -1;
+    }
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        return -1;
+    }
+    for (const char* at = data; at < end; at += 2) {
+        int high = hex_digit(at[0]), low = hex_digit(at[1]);
+        if (high < 0 || low < 0) {
+            fclose(file);
+            remove(path);
+            return -1;
+        }
+        fputc(high << 4 | low, file);
+    }
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+int main(int argc, char** argv) {
+    static const char path_key[] = "{\"gcda\":\"";
+    static const char data_key[] = "\",\"data\":\"";
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <console log>\n", argv[0]);
+        return 2;
+    }
+    char* log = read_log(argv[1]);
+    if (!log) {
+        fprintf(stderr, "%s: cannot read\n", argv[1]);
+        return 1;
+    }
+    int written = 0, failed = 0;
+    for (char* at = strstr(log, path_key); at; at = strstr(at, path_key)) {
+        at += strlen(path_key);
+        char* path_end = strstr(at, data_key);
+        char* line_end = strchr(at, '\n');
+        if (!path_end || (line_end && path_end > line_end) || path_end - at >= GCDA_PATH_MAX) {
+            fprintf(stderr, "malformed profile line\n");
+            failed = 1;
+            continue;
+        }
+        char path[GCDA_PATH_MAX];
+        memcpy(path, at, (size_t)(path_end - at));
+        path[path_end - at] = '\0';
+        if (write_gcda(path, path_end + strlen(data_key)) != 0) {
+            fprintf(stderr, "%s: not written\n", path);
+            failed = 1;
+            continue;
+        }
+        written++;
+    }
+    free(log);
+    printf("%d profile files written\n", written);
+    return failed || !written;
+}
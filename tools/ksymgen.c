@@ -0,0 +1,83 @@
+/*
+ * Tiny Operating System - Kernel Symbol Table Generator
+ * Host tool: turns `nm -n kernel.elf` on stdin into a NASM source for the
+ * symbol table unwind.c searches, on stdout. Only code symbols are kept;
+ * the table ends with the address where code ends, so an address past the
+ * last function resolves to nothing rather than to it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define KSYM_MAX 8192
+#define KSYM_NAME_MAX 128
+
+struct ksym_line {
+    unsigned long addr;
+    char name[KSYM_NAME_MAX];
+};
+
+static struct ksym_line symbols[KSYM_MAX];
+static int symbol_count;
+
+static int is_code(char type) {
+    return type == 'T' || type == 't' || type == 'W';
+}
+
+int main(void) {
+    char line[512];
+    unsigned long end = 0;
+    while (fgets(line, sizeof(line), stdin)) {
+        unsigned long addr;
+        char type;
+        char name[KSYM_NAME_MAX];
+        if (sscanf(line, "%lx %c %127s", &addr, &type, name) != 3) {
+            continue;                   /* Undefined weak symbols have no address */
+        }
+        if (!is_code(type)) {
+            /* Absolute symbols are not in the image; anything else placed after the code ends it */
+            if (type != 'a' && type != 'A' && !end && symbol_count && addr > symbols[symbol_count - 1].addr) {
+                end = addr;
+            }
+            continue;
+        }
+        if (symbol_count && addr == symbols[symbol_count - 1].addr) {
+            continue;                   /* Aliases: the first name wins */
+        }
+        if (symbol_count == KSYM_MAX) {
+            fprintf(stderr, "ksymgen: more than %d symbols\n", KSYM_MAX);
+            return 1;
+        }
+        end = 0;
+        symbols[symbol_count].addr = addr;
+        strcpy(symbols[symbol_count].name, name);
+        symbol_count++;
+    }
+    if (symbol_count && !end) {
+        end = symbols[symbol_count - 1].addr + 1;
+    }
+
+    printf("; Generated by ksymgen from nm -n: do not edit\n");
+    printf("section .rodata\n");
+    printf("global ksym_count, ksym_addrs, ksym_names, ksym_strings\n");
+    printf("align 4\n");
+    printf("ksym_count: dd %d\n", symbol_count);
+    printf("ksym_addrs:\n");
+    for (int i = 0; i < symbol_count; i++) {
+        printf("    dd 0x%08lx\n", symbols[i].addr);
+    }
+    printf("    dd 0x%08lx\n", end);
+    printf("ksym_names:\n");
+    unsigned long offset = 0;
+    for (int i = 0; i < symbol_count; i++) {
+        printf("    dd %lu\n", offset);
+        offset += strlen(symbols[i].name) + 1;
+    }
+    printf("ksym_strings:\n");
+    for (int i = 0; i < symbol_count; i++) {
+        printf("    db \"%s\", 0\n", symbols[i].name);
+    }
+    printf("section .note.GNU-stack noalloc noexec nowrite progbits\n");
+    return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * Tiny Operating System - LZ4 Kernel Packer
+ * Host tool: compresses a flat kernel binary into one raw LZ4 block for
+ * lz4_stub.asm to unpack at boot. Greedy matching over a hash of 4-byte
+ * prefixes; the output follows the LZ4 block format's end-of-block rules.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5             /* The block ends with at least this many literals */
+#define LZ4_MATCH_LIMIT 12              /* No match starts within this many bytes of the end */
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_BITS 12
+
+static uint32_t read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t lz4_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+/* A length beyond the token's nibble: 255s then the remainder */
+static uint8_t* lz4_put_length(uint8_t* out, size_t length) {
+    while (length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = (uint8_t)length;
+    return out;
+}
+
+/* One sequence; match_length 0 for the final, literals-only one */
+static uint8_t* lz4_put_sequence(uint8_t* out, const uint8_t* literals, size_t literal_length,
+                                 size_t offset, size_t match_length) {
+    size_t match_code = match_length ? match_length - LZ4_MIN_MATCH : 0;
+    *out++ = (uint8_t)((literal_length < 15 ? literal_length : 15) << 4 |
+                       (match_code < 15 ? match_code : 15));
+    if (literal_length >= 15) {
+        out = lz4_put_length(out, literal_length - 15);
+    }
+    memcpy(out, literals, literal_length);
+    out += literal_length;
+    if (!match_length) {
+        return out;
+    }
+    *out++ = (uint8_t)offset;
+    *out++ = (uint8_t)(offset >> 8);
+    if (match_code >= 15) {
+        out = lz4_put_length(out, match_code - 15);
+    }
+    return out;
+}
+
+/* Compress size bytes into out, which has room for the worst case; returns the block's size */
+static size_t lz4_compress(const uint8_t* in, size_t size, uint8_t* out) {
+    static uint32_t table[1 << LZ4_HASH_BITS];     /* Position + 1 of the last prefix with each hash */
+    uint8_t* start = out;
+    size_t anchor = 0;
+    size_t pos = 0;
+
+    while (size > LZ4_MATCH_LIMIT && pos < size - LZ4_MATCH_LIMIT) {
+        uint32_t hash = lz4_hash(read32(in + pos));
+        size_t candidate = table[hash];
+        table[hash] = (uint32_t)(pos + 1);
+        if (!candidate-- || pos - candidate > LZ4_MAX_OFFSET || read32(in + candidate) != read32(in + pos)) {
+            pos++;
+            continue;
+        }
+        size_t length = LZ4_MIN_MATCH;
+        while (pos + length < size - LZ4_LAST_LITERALS && in[candidate + length] == in[pos + length]) {
+            length++;
+        }
+        out = lz4_put_sequence(out, in + anchor, pos - anchor, pos - candidate, length);
+        pos += length;
+        anchor = pos;
+    }
+    out = lz4_put_sequence(out, in + anchor, size - anchor, 0, 0);
+    return (size_t)(out - start);
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s kernel.bin kernel.lz4\n", argv[0]);
+        return 2;
+    }
+    FILE* input = fopen(argv[1], "rb");
+    if (!input) {
+        perror(argv[1]);
+        return 1;
+    }
+    fseek(input, 0, SEEK_END);
+    long size = ftell(input);
+    fseek(input, 0, SEEK_SET);
+    uint8_t* in = malloc(size > 0 ? (size_t)size : 1);
+    uint8_t* out = malloc((size_t)size + (size_t)size / 255 + 16);
+    if (!in || !out || fread(in, 1, (size_t)size, input) != (size_t)size) {
+        fprintf(stderr, "%s: cannot read\n", argv[1]);
+        return 1;
+    }
+    fclose(input);
+
+    size_t packed = lz4_compress(in, (size_t)size, out);
+    FILE* output = fopen(argv[2], "wb");
+    if (!output || fwrite(out, 1, packed, output) != packed || fclose(output)) {
+        perror(argv[2]);
+        return 1;
+    }
+    printf("%s: %ld -> %zu bytes\n", argv[2], size, packed);
+    return 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * Tiny Operating System - Test Shard Merge
+ * Host tool: merges the JSON lines that parallel test boots printed, one
+ * console log per shard (comprehensive_tests.c's test_export and
+ * integration_tests.c's integration_test_export), into one report. Exits 1
+ * when a test failed or a shard never reported that it finished.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_MAX 512
+#define TEST_NAME_MAX 64
+#define SUITE_NAME_MAX 16
+
+struct test_line {
+    char suite[SUITE_NAME_MAX];
+    char name[TEST_NAME_MAX];
+    long shard;
+    long passed;
+    long detail;                        /* Failing line, or errors for integration scenarios */
+};
+
+static struct test_line results[TEST_MAX];
+static int result_count;
+
+/* The number after "key": in line, or -1 */
+static long json_number(const char* line, const char* key) {
+    char pattern[32];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    const char* at = strstr(line, pattern);
+    return at ? strtol(at + strlen(pattern), NULL, 10) : -1;
+}
+
+/* The string after "key":" in line, copied to out; 0, or -1 when missing or too long */
+static int json_string(const char* line, const char* key, char* out, size_t size) {
+    char pattern[32];
+    snprintf(pattern, sizeof(pattern), "\"%s\":\"", key);
+    const char* at = strstr(line, pattern);
+    if (!at) {
+        return -1;
+    }
+    at += strlen(pattern);
+    const char* end = strchr(at, '"');
+    if (!end || (size_t)(end - at) >= size) {
+        return -1;
+    }
+    memcpy(out, at, (size_t)(end - at));
+    out[end - at] = '\0';
+    return 0;
+}
+
+/*
+ * Collect one shard's results from its log, skipping anything else on the
+ * console; returns how many suites said they were done, or -1
+ */
+static int read_shard(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    char line[512];
+    int done = 0;
+    while (fgets(line, sizeof(line), file)) {
+        struct test_line test;
+        if (!strstr(line, "{\"suite\":\"") || json_string(line, "suite", test.suite, sizeof(test.suite)) != 0) {
+            continue;
+        }
+        if (json_number(line, "done") >= 0) {
+            done++;
+            continue;
+        }
+        if (json_string(line, "test", test.name, sizeof(test.name)) != 0 || result_count == TEST_MAX) {
+            continue;
+        }
+        test.shard = json_number(line, "shard");
+        test.passed = json_number(line, "passed");
+        test.detail = json_number(line, strcmp(test.suite, "integration") == 0 ? "errors" : "line");
+        results[result_count++] = test;
+    }
+    fclose(file);
+    return done;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s shard.log...\n", argv[0]);
+        return 2;
+    }
+
+    int incomplete = 0;
+    for (int i = 1; i < argc; i++) {
+        int done = read_shard(argv[i]);
+        if (done <= 0) {
+            printf("%s: %s\n", argv[i], done < 0 ? "cannot read" : "no suite finished (crashed or timed out)");
+            incomplete++;
+        }
+    }
+
+    int failed = 0;
+    printf("%-14s %-36s %5s %s\n", "suite", "test", "shard", "result");
+    for (int i = 0; i < result_count; i++) {
+        const struct test_line* test = &results[i];
+        int ok = test->passed == 1;
+        failed += !ok;
+        printf("%-14s %-36s %5ld %s", test->suite, test->name, test->shard, ok ? "PASS" : "FAIL");
+        if (!ok && test->detail > 0) {
+            printf(strcmp(test->suite, "integration") == 0 ? " (%ld errors)" : " (line %ld)", test->detail);
+        }
+        putchar('\n');
+    }
+    printf("%d passed, %d failed across %d shard(s)\n", result_count - failed, failed, argc - 1);
+    if (incomplete) {
+        printf("%d shard(s) did not finish\n", incomplete);
+    }
+    return failed || incomplete ? 1 : 0;
+}